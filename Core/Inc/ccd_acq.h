@@ -0,0 +1,348 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_acq.h
+ * @brief          : CCD acquisition driver (ADC1 + DMA1_Stream0 into the ring)
+ ******************************************************************************
+ * Two ways to keep the DMA running:
+ *  - CCD_ACQ_RESTART: the stream runs in normal mode and is re-armed at
+ *    register level (M0AR/NDTR/EN, ADC OVR) straight from TIM2_IRQHandler on
+ *    every ICG. DMA completion is handled in DMA1_Stream0_IRQHandler without
+ *    going through the HAL. Mode 1 snaps use the same path.
+ *  - CCD_ACQ_HWSYNC: the stream is started once in double-buffer mode and
+ *    flips between ring slots in hardware. No interrupt runs at the ICG;
+ *    each completion only checks its TIM2 count against the ICG phase of
+ *    the others, and a stream that lost step is re-armed (a resync).
+ *
+ * Mode 3 reconfigures the timer chain so that a rising edge on
+ * CCD_EXT_TRIG starts one ICG/SH sequence in hardware, and captures it on
+ * the restart path.
+ *
+ * Several boards frame-lock with "Y1" on one (master: its ICG start is
+ * exported on CCD_SYNC_OUT) and "Y2" on the others (slaves: CCD_SYNC_OUT of
+ * the master wired to their CCD_EXT_TRIG restarts their ICG period). Each
+ * board keeps its own fM; slave frames start about 50 ns after the
+ * master's. In mode 3 wire the trigger to every board instead. "Y3" is a
+ * slave of the AC line in CCD_LINE_SYNC builds (ccd_mains.h).
+ *
+ * A strobe output (CCD_STROBE, TIM2 CH3) pulses at a fixed delay from the
+ * start of every ICG period, for light sources that must fire inside the
+ * exposure ("S<delay_us>:<width_us>", "S0" = off). The frame read out after
+ * an ICG holds the light integrated between the last two SH pulses before
+ * it:
+ *  - Modes 0/1: the last SH period of the previous frame, from
+ *    CCD_STROBE_FAST_US after its start to its end (TIM5 restarts with the
+ *    ICG period, which is not a whole number of SH periods).
+ *  - Mode 2: the whole previous frame after its SH pulse.
+ *  - Mode 3: the strobe fires after the edge, so it lands in the frame of
+ *    the next edge.
+ *
+ * "I2"/"I4" take several samples per pixel and average them on the device:
+ * ADC2 runs as the interleaved slave of ADC1 on the same input, so each
+ * TIM4 trigger converts on ADC1 and then on ADC2 a few ADC cycles later
+ * ("I4" also fires TIM4 twice per pixel). The DMA moves one packed ADC12
+ * word per trigger into a staging buffer; a completed buffer is averaged
+ * into the frame slot with SIMD halving adds, so the frame format and rate
+ * are unchanged. "I1" is the single ADC1 conversion.
+ *
+ * "O<n>" selects a readout speed profile from CCD_LN_TABLE (ccd_timing.h)
+ * at run time, fM down to the sensor's minimum: fM, the pixel, the ADC
+ * trigger and the ICG period stretch by the profile's divider, and the
+ * longer pixel goes to lower noise. Either the ADC1 hardware oversampler
+ * averages several conversions per trigger at no CPU cost (ADC1 alone: the
+ * conversions already fill the pixel), or the one conversion samples for
+ * longer (32.5 or 64.5 ADC cycles, beyond what "S" offers). "O0" returns
+ * to the plain timing profile. The frame format and DMA length are
+ * unchanged; the frame rate drops by the divider.
+ *
+ * "K1" turns on correlated double sampling: TIM4 fires twice per pixel, so
+ * ADC1 takes the reset level acq_adc_phase into the pixel and the signal
+ * level half a pixel later. Both go to a staging buffer as halfword pairs,
+ * and each pixel becomes 0xFFFF - (reset - signal), two pixels per SIMD
+ * saturating subtract. Offset drift and noise slower than a pixel cancel;
+ * dark stays near full scale and light lowers the value as before.
+ *
+ * In both cases the ADC is started once with unlimited DMA requests and only
+ * converts on TIM4 CC4 triggers.
+ *
+ * "L<period_us>:<pulse_us>" sets the fast-shutter SH period and pulse of
+ * modes 0, 1 and 3 while acquisition runs. TIM5 has ARR and CCR3 preload
+ * on, and the new values are loaded at an ICG, so the exposure changes
+ * between one frame and the next without a restart or a dropped frame.
+ * Mode 2 keeps its single SH per ICG and uses the setting once left.
+ *
+ * Mode 2 is the zero-dead-time mode: with one SH per ICG the electronic
+ * shutter is off and every frame integrates the whole frame period, at
+ * the frame rate of mode 0. Its exposure_us is measured between the ICG
+ * edges of consecutive frames rather than taken from the timer setting,
+ * so it stays exact when a sync master or a speed profile sets the period.
+ *
+ * "JX<ms>" takes one long exposure in mode 1, 10 ms to 2 min: the SH
+ * pulse that starts it clears the sensor, then TIM5 counts the whole
+ * exposure in at most 2^31-tick periods with its SH output held inactive
+ * and TIM2 parked, so nothing is read out and USB stays idle. Its last
+ * update starts a snap's readout ICG period at once, without the flush,
+ * and the frame carries the exposure in exposure_us. "JA" aborts it.
+ *
+ * "Q<t0>:<t1>[:<t2>[:<t3>]]" brackets the exposure in mode 0: each ICG
+ * period integrates the next of these times (us) in turn, through the same
+ * preloaded path, and CCD_Acq_BracketIndex() tells which one a frame
+ * holds. An "L" meanwhile applies once bracketing stops ("Q0").
+ *
+ * What DMA1_Stream0 reads once per TIM4 period comes from a sample source
+ * (CCD_AcqSource_t, "V<d>"): ADC1/ADC2, the external SPI converter of
+ * ccd_extadc.h (CCD_EXT_ADC builds, where it is the default), the
+ * synthetic line of ccd_pattern.h or, in CCD_DUAL_SENSOR builds, two heads
+ * on ADC1 and ADC2 (ccd_dual.h). The driver keeps the timer chain, both
+ * DMA paths and the ring slots: it claims a slot, points the stream at it
+ * and publishes it, and a source only sets up what the stream reads and
+ * when. "I", "K" and the oversampler of "O" apply to ADC1 alone; the fM
+ * divider of "O" applies to every source.
+ *
+ * TIM1 counts the ICG periods in hardware (TIM2 TRGO, external clock
+ * mode), and every frame handed off looks at the count of its own period.
+ * An ICG period of a continuous or triggered run that ends with no frame
+ * is acquisition loss (ccd_acq_stats.missed): a resync's discarded frame
+ * or a lost completion, which leave no gap in seq. Ring drops keep their
+ * seq and show as CCD_CmdStats_t.dropped, transport loss as seq gaps.
+ *
+ * ADC1's analog watchdog 1 flags saturation in hardware
+ * (CCD_TELEM_SATURATION): with a level set, any conversion at or below it
+ * sets AWD1, and each frame handed off takes the flag and clears it, at no
+ * cost per pixel and with no interrupt. The frames flagged are a bit
+ * history in CCD_SatStatus_t, as CCD_FrameInfo_t.flags has no bit left.
+ * The main loop also polls the flag during the readout (CCD_Acq_SatPoll),
+ * and with CCD_ACQ_SAT_AE auto-exposure cuts the integration time as soon
+ * as it is seen, in time for the next ICG, rather than after a look at the
+ * finished frame. The watchdog sees ADC1's conversions only: the reset
+ * and the signal level with "K", one of each pair with "I2"/"I4", the
+ * oversampler's sum, before its shift, with "O", and sensor A with "V3".
+ * The level is written with the ADC stopped, so a change restarts the
+ * capture.
+ *
+ * Bus paths (RM0433 bus matrix): DMA1 is a D2 master. In the cached build
+ * its writes into the ring and the staging buffers (AXI SRAM) cross the
+ * D2-to-D1 bus into the AXI interconnect, where the core and the OTG_HS
+ * DMA, which sends frames straight from their slots, have ports of their
+ * own. The D2 SRAM holds the rest of the D2 traffic: the USB state the
+ * OTG_HS DMA writes (CCD_USB_DMA) and the burst store. Only the uncached
+ * build keeps the ring in D2 as well, as D2 is too small to split. The
+ * stream runs at the highest DMA priority and through its FIFO
+ * (CCD_ACQ_FIFO), so a stalled write waits in the FIFO instead of ending
+ * in an ADC overrun.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_ACQ_H
+#define __CCD_ACQ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ccd_timing.h"
+#include "main.h"
+
+// ADC sampling times selectable with acq_adc_sample: 2.5, 8.5, 16.5 cycles
+#define CCD_ACQ_SMP_COUNT 3
+
+// Samples per pixel (acq_adc_samples): 1, 2 or 4. "I4" needs two
+// conversions per ADC inside one pixel, so in the fast timing profile only
+// the shortest sampling time fits.
+#define CCD_ACQ_SAMPLES_MAX 4
+
+// DMA1_Stream0 through its FIFO, halfword samples packed into word writes;
+// 0 = direct mode, one bus write per sample
+#ifndef CCD_ACQ_FIFO
+#define CCD_ACQ_FIFO 1
+#endif
+
+// Double-buffer completions off the ICG phase in a row that make a resync
+#define CCD_ACQ_SLIP_FRAMES 4U
+
+// Saturation flag modes (CCD_TELEM_SATURATION)
+#define CCD_ACQ_SAT_OFF 0
+#define CCD_ACQ_SAT_FLAG 1 // Flag frames with a conversion at or below level
+#define CCD_ACQ_SAT_AE 2   // And cut the auto-exposure time mid-readout
+#ifndef CCD_ACQ_SAT_LEVEL
+#define CCD_ACQ_SAT_LEVEL 2048U // Default level, raw counts
+#endif
+
+// CCD_Acq_ConfigTrigger() sources
+#define CCD_ACQ_TRIG_FREE 0 // ICG free-runs (modes 0-2)
+#define CCD_ACQ_TRIG_EDGE 1 // One ICG period per edge (mode 3)
+#define CCD_ACQ_TRIG_SYNC 2 // ICG restarted by each edge (sync slave)
+#define CCD_ACQ_TRIG_ENCODER 3 // Mode 3 on TIM8 line boundaries (ccd_line.h)
+#define CCD_ACQ_TRIG_LINE 4    // ICG restarted at a mains phase (ccd_mains.h)
+
+#define CCD_SYNC_PULSE_US 1U // Sync master output pulse
+
+// Mode 1 timer chain (CCD_Acq_Snap())
+#define CCD_ACQ_SNAP_OFF 0    // Not in mode 1
+#define CCD_ACQ_SNAP_READY 1  // Parked, waiting for a snap
+#define CCD_ACQ_SNAP_FLUSH 2  // First ICG period, clearing the sensor
+#define CCD_ACQ_SNAP_READ 3   // Frame being read out
+#define CCD_ACQ_SNAP_ARM 4    // Long exposure, waiting for its first SH
+#define CCD_ACQ_SNAP_EXPOSE 5 // Long exposure integrating, SH held off
+
+// Long exposures in mode 1 ("JX<ms>", CCD_Acq_Expose())
+#define CCD_ACQ_EXPOSE_MIN_MS 10U
+#define CCD_ACQ_EXPOSE_MAX_MS 120000U
+
+// Longest strobe delay or width: one ICG period
+#define CCD_STROBE_MAX_US (CCD_ICG_TICKS / CCD_TICKS_PER_US)
+
+// Exposure bracketing ("Q"): up to 4 integration times, one per frame
+#define CCD_ACQ_BRACKET_MAX 4
+#define CCD_ACQ_BRACKET_NONE 0xFF // CCD_Acq_BracketIndex(): not bracketed
+
+// SH period limits for "L": the sensor's minimum integration, one ICG
+// period of the slowest speed profile (longer only fires SH once per ICG),
+// held where a full bracket's time sums stay 16-bit (ccd_hdr.c); mode 2
+// goes longer
+#define CCD_SH_MIN_PERIOD_US CCD_SENSOR_INT_MIN_US
+#define CCD_SH_CAP_US (0xFFFFU / CCD_ACQ_BRACKET_MAX)
+#define CCD_SH_MAX_PERIOD_US                                                   \
+  ((CCD_STROBE_MAX_US * CCD_LN_MAX_DIV < CCD_SH_CAP_US)                        \
+       ? CCD_STROBE_MAX_US * CCD_LN_MAX_DIV                                    \
+       : CCD_SH_CAP_US)
+
+// Start of the last fast-shutter SH period in a frame (us into the frame),
+// at the default SH period
+#define CCD_STROBE_FAST_US                                                     \
+  ((CCD_TIM2_ARR / (CCD_TIM5_ARR + 1U)) * (CCD_TIM5_ARR + 1U) /                \
+   CCD_TICKS_PER_US)
+
+// Sample sources (acq_source, "V<d>")
+#define CCD_ACQ_SRC_ADC 0     // ADC1, with ADC2 for multi-sampling
+#define CCD_ACQ_SRC_SPI 1     // External SPI ADC (CCD_EXT_ADC builds)
+#define CCD_ACQ_SRC_PATTERN 2 // Synthetic test line, no sensor needed
+#define CCD_ACQ_SRC_DUAL 3    // ADC1 and ADC2, one head each (ccd_dual.h)
+#define CCD_ACQ_SRC_COUNT 4
+
+// The acquisition stream every source feeds
+#define CCD_ACQ_DMA DMA1
+#define CCD_ACQ_STREAM LL_DMA_STREAM_0
+
+// A sample source. Everything but arm runs with the capture stopped.
+typedef struct {
+  uint8_t (*init)(void); // Boot; 0 = not fitted. NULL: always there
+  // Sample point at TIM4 tick ccr of a TIM4 period of arr + 1 ticks, with
+  // CCD_Acq_ApplySampling()'s settings latched; the tick by which the
+  // sample has reached memory
+  uint32_t (*apply)(uint32_t ccr, uint32_t arr);
+  void (*stream)(void); // DMAMUX request, source address and element size
+  void (*start)(void);  // Once per capture, before the stream is armed
+  void (*arm)(void);    // Restart path: enable the prepared stream (ITCM)
+  void (*stop)(void);
+  void (*done)(CCD_Frame_t *frame); // Slot filled, before publishing. NULL
+                                    // when the DMA leaves it final (ITCM)
+  uint8_t (*overrun)(void); // A sample the DMA missed since the arm (ITCM,
+                            // ICG interrupt). NULL: cannot happen
+} CCD_AcqSource_t;
+
+typedef struct {
+  volatile uint32_t resyncs;    // ICG found the DMA mid-frame (pixel 0 missed)
+  volatile uint32_t dma_errors; // Transfer errors, frame discarded
+  volatile uint32_t overruns;   // Resyncs with a sample overrun behind them
+  volatile uint32_t late; // Frames PendSV had not finished by the next one
+  volatile uint32_t missed; // ICG periods the hardware counted with no frame
+} CCD_Acq_Stats_t;
+
+// The periods the applied profile should give the running chain, in timer
+// ticks, for ccd_selftest.h. sh is 0 while an exposure change, bracketing
+// cycle or long exposure is under way.
+typedef struct {
+  uint32_t fm;  // TIM3
+  uint32_t adc; // TIM4: one trigger per pixel
+  uint32_t sh;  // TIM5
+  uint32_t icg; // TIM2
+} CCD_AcqPeriods_t;
+
+#pragma pack(push, 1)
+// CCD_TELEM_SATURATION reply
+typedef struct {
+  uint8_t mode;        // CCD_ACQ_SAT_*
+  uint8_t armed;       // Watching: a mode set and the ADC1 source sampling
+  uint16_t level;      // Raw counts; a conversion at or below it flags
+  uint32_t seq;        // Last frame handed off
+  uint32_t history;    // Bit n: frame seq - n was flagged
+  uint32_t frames;     // Handed off while armed
+  uint32_t saturated;  // Of those, flagged
+  uint32_t last;       // seq of the last frame flagged
+  uint32_t early;      // Frames the main loop saw flagged mid-readout
+  uint32_t seen_us;    // The last of those: from its ICG to the sighting
+  uint32_t readout_us; // ICG edge to the last sample, for comparison
+} CCD_SatStatus_t;
+#pragma pack(pop)
+
+extern CCD_Acq_Stats_t ccd_acq_stats;
+extern volatile uint8_t frame_ready; // Set when a frame reaches the ring
+extern volatile uint16_t acq_adc_phase; // ADC trigger, ticks into each pixel
+                                        // (at the default fM)
+extern volatile uint8_t acq_adc_sample; // Index of the ADC sampling time
+extern volatile uint8_t acq_adc_samples; // Samples averaged per pixel
+extern volatile uint8_t acq_noise_profile; // CCD_LN_TABLE entry, "O<n>"
+extern volatile uint8_t acq_cds; // Correlated double sampling, "K1"
+extern volatile uint8_t acq_source; // CCD_ACQ_SRC_*, "V<d>"
+
+void CCD_Acq_InitSlaveAdc(void); // Boot, before CCD_AdcCal_Init()
+ADC_HandleTypeDef *CCD_Acq_SlaveAdc(void); // ADC2, for its calibration
+void CCD_Acq_InitSources(void);  // Boot, after CCD_Acq_InitSlaveAdc()
+void CCD_Acq_InitIcgCounter(void); // Boot: TIM1 counts TIM2 TRGO
+uint8_t CCD_Acq_SetSource(uint8_t source); // 0 = unknown or not fitted
+
+// Call with the timers stopped and their counters reset
+void CCD_Acq_StartContinuous(void);
+void CCD_Acq_StartTriggered(void);
+void CCD_Acq_ConfigTrigger(uint8_t source); // CCD_ACQ_TRIG_*
+void CCD_Acq_SetSyncOut(uint8_t enable);
+void CCD_Acq_AlignTimers(void); // After starting TIM2/TIM4/TIM5
+void CCD_Acq_StartSnap(void);   // Mode 1, after CCD_Acq_AlignTimers()
+uint8_t CCD_Acq_SnapState(uint32_t *elapsed_ms); // CCD_ACQ_SNAP_*
+void CCD_Acq_ApplySampling(void); // With the ADC stopped
+uint16_t CCD_Acq_FrameCount(void);
+// ICG periods TIM1 counted from frame to frame over the runs so far (the
+// 16-bit count extended at each frame)
+uint32_t CCD_Acq_IcgCount(void);
+uint32_t CCD_Acq_IcgTicks(void); // ICG period of the applied profile
+void CCD_Acq_Periods(CCD_AcqPeriods_t *out);
+uint32_t CCD_Acq_ReadoutCycles(void); // ICG edge to DMA complete
+// Double-buffer path: the completions left the ICG phase; cleared by the
+// re-arm
+uint8_t CCD_Acq_HwSyncSlipped(void);
+// Saturation flag, from the next CCD_Acq_ApplySampling(); 0 = bad mode
+uint8_t CCD_Acq_SetSaturation(uint8_t mode, uint16_t level);
+void CCD_Acq_GetSaturation(uint8_t *mode, uint16_t *level);
+void CCD_Acq_SatStatus(CCD_SatStatus_t *out);
+// Main loop: 1 the first time the frame being read out is seen flagged
+uint8_t CCD_Acq_SatPoll(void);
+uint8_t CCD_Acq_SetStrobe(uint32_t delay_us, uint32_t width_us); // 0 = bad
+uint8_t CCD_Acq_SetExposure(uint32_t period_us, uint32_t pulse_us); // 0 = bad
+uint8_t CCD_Acq_ExposureValid(uint32_t period_us, uint32_t pulse_us);
+void CCD_Acq_GetStrobe(uint32_t *delay_us, uint32_t *width_us);
+void CCD_Acq_GetExposure(uint32_t *period_us, uint32_t *pulse_us);
+void CCD_Acq_ConfigShutter(uint8_t mode); // Mode switch, TIM5 stopped
+uint32_t CCD_Acq_IntegrationUs(void); // Fast shutter, from the SH period
+uint8_t CCD_Acq_SetIntegration(uint32_t t_us); // 0 = not reachable
+uint8_t CCD_Acq_ExposureSettled(uint16_t frame_num); // Captured with it
+uint8_t CCD_Acq_SetBracket(const uint32_t *t_us, uint8_t count); // 0 = bad
+uint8_t CCD_Acq_BracketCount(void); // Entries cycling, 0 = off
+uint32_t CCD_Acq_BracketUs(uint8_t index);
+uint8_t CCD_Acq_BracketIndex(uint16_t frame_num); // Main loop only
+void CCD_Acq_Stop(void);
+
+// Fast paths, called from stm32h7xx_it.c
+void CCD_Acq_IcgIRQ(void);
+uint8_t CCD_Acq_DmaIRQ(void);
+void CCD_Acq_ShIRQ(void);
+void CCD_Acq_ShPulseIRQ(void); // TIM5 CC3, long exposures only
+void CCD_Acq_DeferredIRQ(void); // PendSV: frame work (ccd_irq.h)
+uint8_t CCD_Acq_Snap(void); // Interrupts masked, see ccd_snap.h
+uint8_t CCD_Acq_Expose(uint32_t t_ms); // The same
+uint8_t CCD_Acq_ExposeAbort(void);     // The same, 0 if none was running
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_ACQ_H */
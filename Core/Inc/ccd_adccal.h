@@ -0,0 +1,74 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_adccal.h
+ * @brief          : ADC offset and linearity calibration, kept in flash
+ ******************************************************************************
+ * ADC1 and ADC2 get a full calibration (offset and linearity,
+ * single-ended) once, and its factors go to flash (CCD_STORE_ADCCAL) with
+ * the ADC kernel clock and the die temperature they were measured at. A
+ * boot writes them back (HAL_ADCEx_Calibration_SetValue(),
+ * HAL_ADCEx_LinearCalibration_SetValue()) in place of a calibration run,
+ * as long as the clock is the same and the die is within
+ * CCD_ADCCAL_DRIFT_C of that temperature; otherwise it calibrates and
+ * saves again.
+ *
+ * The main loop checks the die temperature (ccd_temp.h) every
+ * CCD_ADCCAL_TEMP_MS. A drift past CCD_ADCCAL_DRIFT_C, CCD_ADCCAL_PERIOD_S
+ * since the last calibration (0 = never) or a host request
+ * (CCD_TELEM_ADCCAL) makes a recalibration due. It needs the ADCs
+ * disabled, so it runs in the next capture restart, which is forced once
+ * no sweep, sequence or benchmark holds the stream: a few frames are lost,
+ * as for any mode switch.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_ADCCAL_H
+#define __CCD_ADCCAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#ifndef CCD_ADCCAL_DRIFT_C
+#define CCD_ADCCAL_DRIFT_C 10 // Die temperature change that recalibrates
+#endif
+#ifndef CCD_ADCCAL_PERIOD_S
+#define CCD_ADCCAL_PERIOD_S 0U // Recalibrate this often, 0 = on drift only
+#endif
+#define CCD_ADCCAL_TEMP_MS 1000U
+
+// CCD_AdcCalStatus_t.source
+#define CCD_ADCCAL_MEASURED 0 // Calibrated on this boot or since
+#define CCD_ADCCAL_STORED 1   // Factors from flash
+
+#pragma pack(push, 1)
+typedef struct {
+  int16_t temp_c;     // Die temperature now
+  int16_t cal_temp_c; // At the calibration in use
+  uint8_t source;     // CCD_ADCCAL_*
+  uint8_t pending;    // A recalibration is due
+  uint16_t reserved;
+  uint32_t calibrations; // Run since boot
+  uint32_t age_s;        // Since the calibration in use (this boot)
+  uint32_t offset[2];    // ADC1, ADC2 CALFACT_S
+} CCD_AdcCalStatus_t;
+#pragma pack(pop)
+
+// Boot, after CCD_Acq_InitSlaveAdc() (ADC1 and ADC2 initialised, disabled)
+// and CCD_Temp_Init()
+void CCD_AdcCal_Init(void);
+void CCD_AdcCal_Poll(void);
+
+// Mode switch, ADCs stopped: runs a recalibration that is due
+void CCD_AdcCal_Service(void);
+
+// Main loop; recalibrate makes one due
+void CCD_AdcCal_Read(CCD_AdcCalStatus_t *out, uint8_t recalibrate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_ADCCAL_H */
@@ -0,0 +1,87 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_ae.h
+ * @brief          : Closed-loop auto-exposure on the device
+ ******************************************************************************
+ * With "U1" the newest raw frame in the ring is measured as soon as it
+ * arrives, whatever the USB link is doing, and the fast-shutter
+ * integration time is corrected for the frames that follow:
+ *  - signal: shielded-pixel mean minus the level reached by the brightest
+ *    active pixels (light lowers the value), at a percentile of the active
+ *    pixels ("UP<pct>", 100 = peak)
+ *  - the integration time is scaled by target / signal ("UT<counts>"),
+ *    at most CCD_AE_MAX_STEP per frame and not inside a +-1/16 deadband,
+ *    and kept within "UL<min_us>:<max_us>"
+ * The change goes out through the preloaded SH timing (CCD_Acq_SetIntegration)
+ * at the next ICG, and frames captured before it took effect are skipped,
+ * so the loop settles without overshoot from stale frames.
+ *
+ * With the saturation flag in CCD_ACQ_SAT_AE (ccd_acq.h) a frame the ADC
+ * watchdog flags during its readout cuts the integration time by
+ * CCD_AE_SAT_STEP at once, if it was captured with the time in use. The
+ * cut loads at the next ICG, a frame sooner than a look at the finished
+ * frame allows. The watchdog flags a single pixel, where the percentile
+ * ignores the brightest, so this suits scenes that must not saturate at
+ * all.
+ *
+ * Only modes 0 and 1 are regulated: mode 2 integrates the whole frame and
+ * the mode 3 shutter phase depends on the edge. "U0" stops the loop and
+ * leaves the last integration time in place. "US" sends a CCD_AEStatus_t.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_AE_H
+#define __CCD_AE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_AE_MAGIC 0xABD2 // CCD_AEStatus_t
+
+#define CCD_AE_TARGET 24000U // Default signal target, counts
+#define CCD_AE_PERCENTILE 99U // Default; ignores the brightest 1 %
+#define CCD_AE_MAX_STEP 4U   // Largest change per frame, either way
+#define CCD_AE_SAT_STEP 2U   // Cut on a saturation flag
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;     // CCD_AE_MAGIC
+  uint8_t enabled;    // "U1"
+  uint8_t percentile; // "UP"
+  uint32_t min_us;    // "UL" bounds
+  uint32_t max_us;
+  uint32_t t_us;      // Fast-shutter integration time in use
+  uint16_t target;    // "UT"
+  uint16_t signal;    // Last measured, counts
+  uint16_t frame_num; // Frame it was measured on
+  uint16_t sat_cuts;  // CCD_AE_SAT_STEP cuts on a saturation flag
+} CCD_AEStatus_t;
+
+typedef struct {
+  uint8_t enabled;    // "U1"
+  uint8_t percentile; // "UP"
+  uint16_t target;    // "UT"
+  uint32_t min_us;    // "UL" bounds
+  uint32_t max_us;
+} CCD_AESettings_t;
+#pragma pack(pop)
+
+// Command side (USB RX interrupt): 0 if the request is out of range
+void CCD_AE_Enable(uint8_t enable);
+uint8_t CCD_AE_SetLimits(uint32_t min_us, uint32_t max_us);
+uint8_t CCD_AE_SetTarget(uint32_t target);
+uint8_t CCD_AE_SetPercentile(uint32_t pct);
+void CCD_AE_RequestStatus(void);
+void CCD_AE_GetSettings(CCD_AESettings_t *out);
+
+// Main loop, before Send_CCD_Frames()
+void CCD_AE_Poll(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_AE_H */
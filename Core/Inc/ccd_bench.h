@@ -0,0 +1,90 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_bench.h
+ * @brief          : Frame generator for link and pipeline benchmarks
+ ******************************************************************************
+ * CCD_CMD_BENCH stops the capture chain and has the main loop fill ring
+ * slots with frames the host can check bit for bit, at a set rate that
+ * need not be the ICG rate, so transport throughput, latency and
+ * corruption can be measured with no sensor or light. The frames take the
+ * normal path from the ring: processing stages, flow control, CRC and
+ * every transport, so a verifying host leaves the stages off.
+ *
+ * Every pixel is a function of the pattern, its index i and the frame's
+ * info.seq (counted from 0 per run), so a lost frame does not stop the
+ * next one from being checked:
+ *  - RAMP:    (seq + i) & 0xFFFF
+ *  - COUNTER: seq & 0xFFFF at even i, seq >> 16 at odd i
+ *  - PRBS:    the low half of a 32-bit integer hash of seq and i
+ *             (Bench_Prbs() in ccd_bench.c), so every bit toggles
+ * Headers are those of a capture with no flags and info.timestamp the
+ * cycle time the frame was made; info.exposure_us is 0, which tells them
+ * from the captures before and after a run.
+ *
+ * rate is in frames/s; the generator catches up by at most
+ * CCD_BENCH_BATCH frames per main loop pass, so a rate the loop cannot
+ * reach just runs slower. Frames that find the ring full are dropped and
+ * counted as for a capture (the host sees the gap in seq). rate 0 makes
+ * frames only while a slot is free: the fastest the pipeline drains,
+ * without loss. After count frames (0 = until CCD_BENCH_OFF) capture
+ * restarts in the current mode.
+ *
+ * CCD_BENCH_REPLAY takes the frames from the host instead, to run the
+ * stages on recorded spectra with no optics: the host writes whole
+ * CCD_Frame_t records to the FS port, as the device sends them but with
+ * CCD_BENCH_REPLAY_MAGIC, and the RX interrupt copies each into a ring
+ * slot it claims, then completes it as a capture. seq, frame_num,
+ * exposure, co-add, flags and temperatures are kept as sent; the
+ * timestamp is the cycle time the frame was whole, so latencies are the
+ * pipeline's. A frame that finds no free slot leaves its packet waiting
+ * and the OUT endpoint un-armed: the host is NAKed until the pipeline
+ * frees one, so the replay runs as fast as the stages and the link drain
+ * it and none is lost (counted in stalls). Other packets still reach the
+ * command parser. rate is unused; the run ends after count frames, with
+ * CCD_BENCH_OFF, or after CCD_BENCH_REPLAY_TIMEOUT_MS stalled or part way
+ * through a frame.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_BENCH_H
+#define __CCD_BENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+// CCD_CMD_BENCH patterns
+#define CCD_BENCH_OFF 0
+#define CCD_BENCH_RAMP 1
+#define CCD_BENCH_COUNTER 2
+#define CCD_BENCH_PRBS 3
+#define CCD_BENCH_REPLAY 4 // Frames from the host
+
+#define CCD_BENCH_REPLAY_MAGIC 0xABE6 // Replayed frames, host to device
+#define CCD_BENCH_REPLAY_TIMEOUT_MS 2000U
+
+#define CCD_BENCH_RATE_MAX 100000U // frames/s
+#define CCD_BENCH_BATCH 4          // Frames per main loop pass at most
+
+// CCD_CMD_BENCH (main loop). Ends the run before, if any.
+uint8_t CCD_Bench_Start(uint8_t pattern, uint32_t rate, uint32_t count);
+uint32_t CCD_Bench_Made(void); // Frames of the last or current run
+uint32_t CCD_Bench_Stalls(void); // Replay: packets held for a slot, same run
+uint8_t CCD_Bench_Running(void);
+
+// FS RX interrupt, after the link tests: the bytes of buf the replay took.
+// All of it when the packet is held; the endpoint then stays un-armed
+// while CCD_Bench_Held().
+uint32_t CCD_Bench_Receive(const uint8_t *buf, uint32_t len);
+uint8_t CCD_Bench_Held(void);
+
+// Main loop stage, after CCD_Mode_Poll()
+void CCD_Bench_Poll(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_BENCH_H */
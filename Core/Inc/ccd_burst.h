@@ -0,0 +1,123 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_burst.h
+ * @brief          : Burst capture into a RAM frame store, drained afterwards
+ ******************************************************************************
+ * While a burst is armed, every DMA capture lands in the burst store instead
+ * of the frame ring, so no processing or USB work happens per frame and no
+ * frame is lost to the link. The store is used as a circular history until
+ * the trigger; it then records the remaining frames and stops, keeping the
+ * last count frames: pre before the trigger, count - pre from it on.
+ *
+ * The kept frames are then queued for USB with a CCD_BurstHeader_t in front
+ * of the normal CCD_Frame_t (frame_num as captured, timestamp relative to
+ * the trigger frame). The frame ring carries on in the meantime.
+ *
+ * Commands: "X<n>" captures n frames now, "X<n>:<p>" arms with p
+ * pre-trigger frames and waits for a trigger, "XS" sends a
+ * CCD_BurstStatus_t, "X0" aborts. Triggers, first one wins:
+ *  - "XT" from the host
+ *  - a rising edge on CCD_TRIG_IN (main.h), enabled with "XE1"
+ *  - "XL<level>": a frame with any pixel below level (light lowers the
+ *    value), checked as each history frame completes
+ * The trigger frame is the first capture started after the trigger, so a
+ * level-triggered burst holds the frame that crossed just before it.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_BURST_H
+#define __CCD_BURST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+// The store lives in RAM_D2 beside the AXI frame ring (38 x 7456 bytes of
+// 288 KB). The uncached build keeps the ring in RAM_D2, which leaves room for
+// only a short burst. CCD_USB_HS_DMA puts the 4 KB of endpoint buffers in
+// .sram3 as well, which costs one slot.
+#if CCD_CACHE_ENABLE
+#define CCD_BURST_STAGE (CCD_USB_HS_DMA ? 37 : 38)
+#else
+#define CCD_BURST_STAGE (CCD_USB_HS_DMA ? 5 : 6)
+#endif
+
+// With CCD_BURST_PSRAM the RAM_D2 slots only stage the captures: the main
+// loop copies each completed one to the PSRAM (ccd_psram.h), which holds the
+// burst. A capture that finds every staging slot still waiting for its copy
+// goes to the frame ring instead and leaves a gap in the burst (overruns,
+// visible in t_us). The copy keeps up with frames longer than ~0.3 ms.
+#if CCD_BURST_PSRAM
+#define CCD_BURST_FRAMES 1125 // 8 MB of 7456-byte slots
+#else
+#define CCD_BURST_FRAMES CCD_BURST_STAGE
+#endif
+
+#define CCD_BURST_MAGIC 0xABCF  // CCD_BurstHeader_t, followed by a frame
+#define CCD_BURST_STATUS 0xABD0 // CCD_BurstStatus_t
+
+// ccd_burst.state
+#define CCD_BURST_IDLE 0
+#define CCD_BURST_ARMED 1     // Recording history, waiting for the trigger
+#define CCD_BURST_CAPTURING 2 // Triggered, recording the remaining frames
+#define CCD_BURST_DRAINING 3  // Complete, frames queued for USB
+
+// Trigger sources (CCD_BurstStatus_t.sources and .cause)
+#define CCD_BURST_SRC_HOST 0x01
+#define CCD_BURST_SRC_PIN 0x02
+#define CCD_BURST_SRC_LEVEL 0x04
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;   // CCD_BURST_MAGIC
+  uint16_t index;   // Position in the burst, 0 = oldest
+  uint16_t count;   // Frames in the burst
+  uint16_t trigger; // index of the first frame from the trigger on
+  int32_t t_us;     // Completion time relative to the trigger frame
+} CCD_BurstHeader_t;
+
+typedef struct {
+  uint16_t magic;    // CCD_BURST_STATUS
+  uint8_t state;     // CCD_BURST_*
+  uint8_t sources;   // CCD_BURST_SRC_* enabled
+  uint8_t cause;     // CCD_BURST_SRC_* that fired, 0 = not yet
+  uint8_t failed;    // A PSRAM write failed and stopped the burst
+  uint16_t count;    // Frames requested
+  uint16_t pre;      // Of which before the trigger
+  uint16_t stored;   // Frames in the store so far (up to count)
+  uint16_t sent;     // Frames drained
+  uint16_t max;      // CCD_BURST_FRAMES
+  uint16_t level;    // "XL" level, 0 = off
+  uint32_t overruns; // Captures the PSRAM copy had no staging slot for
+} CCD_BurstStatus_t;
+#pragma pack(pop)
+
+void CCD_Burst_Init(void);
+
+// Command side (USB RX interrupt): 0 if the request is out of range
+uint8_t CCD_Burst_Arm(uint16_t count, uint16_t pre);
+void CCD_Burst_Trigger(void);
+void CCD_Burst_SetPinTrigger(uint8_t enable);
+void CCD_Burst_SetLevelTrigger(uint16_t level);
+void CCD_Burst_Abort(void);
+void CCD_Burst_RequestStatus(void);
+
+// EXTI0 interrupt (stm32h7xx_it.c)
+void CCD_Burst_PinIRQ(void);
+
+// Producer side (acquisition ISRs), ahead of the frame ring
+CCD_Frame_t *CCD_Burst_Claim(void);
+uint8_t CCD_Burst_Complete(CCD_Frame_t *frame);
+void CCD_Burst_CancelClaims(void);
+
+// Main loop: queue stored frames and status replies for USB, and with
+// CCD_BURST_PSRAM copy the staged captures to the PSRAM
+void CCD_Burst_Send(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_BURST_H */
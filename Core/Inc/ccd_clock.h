@@ -0,0 +1,111 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_clock.h
+ * @brief          : System clock profiles and derived CCD timer periods
+ ******************************************************************************
+ * Select a profile with -DCCD_CLOCK_PROFILE=<MHz>. Every profile keeps PLL1Q
+ * at 48 MHz because it also clocks both USB cores. The CCD timer periods
+ * are derived from CCD_TIM_CLK_HZ in ccd_timing.h, so fM and the ADC trigger
+ * phase do not depend on the profile.
+ *
+ *   Profile  SYSCLK  HCLK  APBx  TIMx  VOS
+ *   120      120     120   120   120   VOS3 (CubeMX default)
+ *   240      240     120    60   120   VOS1
+ *   480      480     240   120   240   VOS0
+ *
+ * There is no 400 MHz profile: an 800 MHz VCO has no integer PLL1Q divider
+ * for 48 MHz USB.
+ *
+ * The profile is the power setting too: the main loop sleeps whenever it
+ * has nothing to do, so at long exposures the board mostly idles, and 120
+ * (VOS3) idles coolest, with the least self-heating of the sensor and so
+ * the least dark current. The profile itself is a build choice because the
+ * CCD timer periods are compiled for CCD_TIM_CLK_HZ. The faster profiles
+ * are for processing that does not fit the frame period at 120
+ * (CCD_CMD_PROFILE).
+ *
+ * They step down on their own while that processing is not needed: in
+ * mode 1 (snaps) and at ICG periods of CCD_CLOCK_SLOW_MS or more, with no
+ * benchmark running, CCD_Clock_Poll() halves the core clock (D1CPRE / 2)
+ * and takes HPRE to / 1, one register write, so HCLK, the APB and timer
+ * clocks, USB and the timestamps (ccd_time.h) do not move. The 240 build
+ * then runs the clocks of the 120 profile and drops to VOS3 too; the 480
+ * one runs its core at 240 and stays at VOS0, which its 240 MHz HCLK
+ * needs. The probes, the processing profile and the CPU cycle budgets of
+ * CCD_CMD_PROFILE count cycles of the clock of the moment, so a reading
+ * taken stepped down is in half-speed cycles.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_CLOCK_H
+#define __CCD_CLOCK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#ifndef CCD_CLOCK_PROFILE
+#define CCD_CLOCK_PROFILE 120
+#endif
+
+// PLL1 from the 25 MHz HSE with M = 5 (5 MHz reference, VCIRANGE_2)
+#if CCD_CLOCK_PROFILE == 120
+#define CCD_CLK_VOS PWR_REGULATOR_VOLTAGE_SCALE3
+#define CCD_CLK_PLLN 48 // VCO 240 MHz
+#define CCD_CLK_PLLQ 5
+#define CCD_CLK_HPRE RCC_HCLK_DIV1
+#define CCD_CLK_PPRE_DIV 1
+#define CCD_CLK_FLASH_LATENCY FLASH_LATENCY_2
+#define CCD_TIM_CLK_HZ 120000000U
+#define CCD_CLK_SLOW 0 // Already the floor
+#elif CCD_CLOCK_PROFILE == 240
+#define CCD_CLK_VOS PWR_REGULATOR_VOLTAGE_SCALE1
+#define CCD_CLK_PLLN 96 // VCO 480 MHz
+#define CCD_CLK_PLLQ 10
+#define CCD_CLK_HPRE RCC_HCLK_DIV2
+#define CCD_CLK_PPRE_DIV 2
+#define CCD_CLK_FLASH_LATENCY FLASH_LATENCY_2
+#define CCD_TIM_CLK_HZ 120000000U
+#define CCD_CLK_SLOW 1
+#define CCD_CLK_SLOW_VOS PWR_REGULATOR_VOLTAGE_SCALE3 // Core 120
+#elif CCD_CLOCK_PROFILE == 480
+#define CCD_CLK_VOS PWR_REGULATOR_VOLTAGE_SCALE0
+#define CCD_CLK_PLLN 192 // VCO 960 MHz
+#define CCD_CLK_PLLQ 20
+#define CCD_CLK_HPRE RCC_HCLK_DIV2
+#define CCD_CLK_PPRE_DIV 2
+#define CCD_CLK_FLASH_LATENCY FLASH_LATENCY_4
+#define CCD_TIM_CLK_HZ 240000000U
+#define CCD_CLK_SLOW 1
+#define CCD_CLK_SLOW_VOS PWR_REGULATOR_VOLTAGE_SCALE0 // Core 240, HCLK 240
+#else
+#error "CCD_CLOCK_PROFILE must be 120, 240 or 480"
+#endif
+
+#if CCD_CLK_PPRE_DIV == 1
+#define CCD_CLK_APB1_DIV RCC_APB1_DIV1
+#define CCD_CLK_APB2_DIV RCC_APB2_DIV1
+#define CCD_CLK_APB3_DIV RCC_APB3_DIV1
+#define CCD_CLK_APB4_DIV RCC_APB4_DIV1
+#else
+#define CCD_CLK_APB1_DIV RCC_APB1_DIV2
+#define CCD_CLK_APB2_DIV RCC_APB2_DIV2
+#define CCD_CLK_APB3_DIV RCC_APB3_DIV2
+#define CCD_CLK_APB4_DIV RCC_APB4_DIV2
+#endif
+
+// ICG period from which the faster profiles step down, 0 = never step down
+#ifndef CCD_CLOCK_SLOW_MS
+#define CCD_CLOCK_SLOW_MS 50U
+#endif
+
+// Main loop: steps the core clock down and back up (see above)
+void CCD_Clock_Poll(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_CLOCK_H */
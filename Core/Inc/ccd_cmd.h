@@ -0,0 +1,382 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_cmd.h
+ * @brief          : Binary command protocol (framed TLV, acknowledged)
+ ******************************************************************************
+ * Next to the ASCII commands, the host can send binary frames:
+ *
+ *   CCD_CMD_SYNC | seq | type | len | value[len] | check
+ *
+ * seq is the host's sequence number, echoed in the acknowledgement; type is
+ * a CCD_CMD_* command and value its little-endian argument; check is the
+ * 8-bit one's complement of the sum of seq .. value. CCD_CMD_SYNC is not an
+ * ASCII command letter, so a USB packet starting with it (or continuing a
+ * frame) goes to the binary path. Frames are sent back to back and may span
+ * packets, so many commands can be pipelined in one write.
+ *
+ * The USB RX interrupt only reassembles frames into an RX ring. The main
+ * loop executes them in order, before the mode switch, so a batch of
+ * changes that each need a restart costs a single one. Every frame gets a
+ * CCD_CmdAck_t with its status (and a payload for queries). When the ring
+ * cannot take another packet the OUT endpoint is left un-armed: the host is
+ * NAKed until there is room, so no command is lost.
+ *
+ * CCD_CMD_INFO describes the firmware: the protocol version, which command
+ * types it knows and the build options, so a host can check what it talks
+ * to before it sends anything else, and the sensor it was built for
+ * (ccd_sensor.h) with the layout of its line.
+ *
+ * CCD_CMD_PROBE reads the cycle probes of ccd_probe.h, one per command; a
+ * batch of them with reset set gives a consistent "since last time" view.
+ * CCD_CMD_TELEMETRY reads the frame latency and re-arm jitter windows of
+ * ccd_lat.h the same way, and the loss and fault counters of ccd_fault.h.
+ * Its CCD_TELEM_KERNEL times one processing kernel from each memory region
+ * (CCD_Proc_Bench() in ccd_proc.h) and holds the main loop while it does.
+ * CCD_TELEM_ADCCAL reads the ADC calibration state (ccd_adccal.h), or
+ * makes a recalibration due. CCD_TELEM_EXPOSE follows a mode 1 long
+ * exposure ("JX<ms>"), for a progress bar and its abort, and
+ * CCD_TELEM_LINE the encoder line scan of CCD_ENCODER builds (ccd_line.h)
+ * and CCD_TELEM_JPEG its compressed previews in CCD_JPEG builds
+ * (ccd_jpeg.h). CCD_TELEM_DESPIKE sets the spike rejection stage of
+ * ccd_proc.h and reads how many pixels it replaced, CCD_TELEM_BASELINE
+ * its baseline removal and CCD_TELEM_FOCUS the lines whose widths replace
+ * the frames. CCD_TELEM_AUTOROI places the ROI windows around the
+ * strongest lines by itself. CCD_TELEM_PTC loads, starts and follows a photon
+ * transfer run (ccd_ptc.h). CCD_TELEM_DEFECT finds, uploads, reads back
+ * and stores the defect pixel map, and CCD_TELEM_DRIFT sets the drift
+ * band, takes its reference and reads the shift measured against it.
+ * CCD_TELEM_MATCH builds, stores and applies the reference spectrum
+ * library of ccd_match.h. CCD_TELEM_TXN groups setting commands into one
+ * change, swapped in at a frame (ccd_txn.h).
+ * CCD_TELEM_INPUTS reads the digital inputs latched with each frame in
+ * CCD_DIN builds (ccd_din.h), and CCD_TELEM_MAINS sets and follows the
+ * mains line sync of CCD_LINE_SYNC builds (ccd_mains.h). CCD_TELEM_SELFTEST
+ * reads the timer chain's last check against its profile (ccd_selftest.h).
+ * CCD_TELEM_SHUTTER schedules the shutter of CCD_SHUTTER builds and the
+ * live dark its closed frames keep (ccd_shutter.h).
+ *
+ * CCD_CMD_CONFIG saves or resets the settings restored at boot
+ * (ccd_config.h); a save or an erase holds the main loop for the flash.
+ *
+ * CCD_CMD_TIME is an NTP-style ping for aligning the frame timestamps
+ * (CCD_FrameInfo_t, CCD_Time_Now()) with the host clock. Its ack carries
+ * the timestamp when the request arrived (USB RX interrupt) and when the ack
+ * was queued. Queued is not sent: frames ahead of it in the TX queue can
+ * hold it back for milliseconds. So every TIME ack also carries the time
+ * the previous one finished on the bus, taken at its TX completion, so the
+ * host can correct that exchange afterwards (two-step, as in PTP).
+ ******************************************************************************
+ */
+
+#ifndef __CCD_CMD_H
+#define __CCD_CMD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ccd_proc.h"
+#include "main.h"
+
+#define CCD_CMD_SYNC 0xC3
+#define CCD_CMD_VALUE_MAX 60 // Longest value a frame may carry
+#define CCD_CMD_RX_SIZE 1024 // RX ring bytes, power of two
+
+#define CCD_CMD_ACK_MAGIC 0xABD6 // CCD_CmdAck_t
+#define CCD_CMD_ACK_PAYLOAD_MAX 96 // The profile of CCD_PROC_STAGES stages
+
+// Commands (value)
+#define CCD_CMD_PING 0x00        // none
+#define CCD_CMD_MODE 0x01        // u8 ccd_mode
+#define CCD_CMD_EXPOSURE 0x02    // u32 SH period us, u32 pulse us ("L")
+#define CCD_CMD_INTEGRATION 0x03 // u32 fast-shutter integration time, us
+#define CCD_CMD_ROI 0x04         // u16 start, u16 len per window ("W")
+#define CCD_CMD_BINNING 0x05     // u8 1, 2, 4 or 8 ("B")
+#define CCD_CMD_COADD 0x06       // u16 frames per output ("N")
+#define CCD_CMD_ROLLING 0x07     // u16 window ("R")
+#define CCD_CMD_TRIGGER 0x08     // u8 CCD_CMD_TRIG_*
+#define CCD_CMD_TRANSPORT 0x09   // u8 tx_mode ("T")
+#define CCD_CMD_CONFIG 0x0A      // u8 CCD_CONFIG_*, u8 arg -> its status
+#define CCD_CMD_DARK_TEMP 0x0B   // u8 knots (CCD_DARKT_STATUS = read),
+                                 // CCD_PROC_DARKT_KNOTS CCD_DarkTempKnot_t
+                                 // -> CCD_DarkTempStatus_t (ccd_proc.h)
+#define CCD_CMD_BLACK 0x0C       // u8 0/1 (CCD_BLACK_STATUS = read)
+                                 // -> CCD_BlackStatus_t (ccd_proc.h)
+#define CCD_CMD_STATS 0x10       // none; the ack carries a CCD_CmdStats_t
+#define CCD_CMD_TIME 0x11        // none; the ack carries a CCD_CmdTime_t
+#define CCD_CMD_FLOW 0x12        // u8 CCD_FLOW_* policy (ccd_flow.h)
+#define CCD_CMD_CREDIT 0x13      // u32 frames allowed since CCD_CMD_FLOW
+#define CCD_CMD_INFO 0x14        // none; the ack carries a CCD_CmdInfo_t
+#define CCD_CMD_RECORD 0x15      // u8 CCD_REC_CMD_*; ack: CCD_RecStatus_t
+#define CCD_CMD_PROFILE 0x16     // none; the ack carries a CCD_CmdProfile_t
+#define CCD_CMD_FRAME_STATS 0x17 // u8 CCD_PROC_STATS_*, u16 saturation level
+#define CCD_CMD_PEAKS 0x18       // u8 CCD_PROC_PEAKS_*, u8 CCD_PROC_FIT_*,
+                                 // u16 threshold, u16 min distance
+#define CCD_CMD_SMOOTH 0x19      // u8 window (0 = off), u8 order
+#define CCD_CMD_WAVELENGTH 0x1A  // u8 CCD_WL_CMD_*, CCD_Wavelength_t -> same
+#define CCD_CMD_ABSORBANCE 0x1B  // u8 CCD_PROC_ABS_*, u16 reference frames
+                                 // (0 = keep) -> CCD_CmdAbsorbance_t
+#define CCD_CMD_LINEARITY 0x1C   // u8 CCD_LIN_CMD_*, u16 offset,
+                                 // CCD_LIN_CHUNK u16 knots -> u8 enabled
+#define CCD_CMD_BENCH 0x1D       // u8 CCD_BENCH_*, u32 frames/s, u32 count
+                                 // -> u32 frames, u32 replay stalls of the
+                                 // previous run
+#define CCD_CMD_PROBE 0x1E       // u8 CCD_PROBE_*, u8 reset -> CCD_CmdProbe_t
+#define CCD_CMD_TELEMETRY 0x1F   // u8 CCD_TELEM_*, u8 argument -> its report
+
+// CCD_CMD_TELEMETRY reports. The last command type, so new reports are
+// selectors here rather than commands. The value is the selector and its
+// argument; only CCD_TELEM_BANDS and CCD_TELEM_FOCUS take more, whole
+// CCD_Band_t and CCD_FocusLine_t entries, CCD_TELEM_PTC its levels and
+// frame count, CCD_TELEM_DEFECT its limits or map bytes, CCD_TELEM_DRIFT,
+// CCD_TELEM_MATCH and CCD_TELEM_MODEL their arguments, and CCD_TELEM_DESPIKE,
+// CCD_TELEM_SATURATION and CCD_TELEM_REFERENCE, optionally,
+// CCD_TXN_FORMAT its packing and codec, a CCD_TELEM_LOOP test its port
+// and count, CCD_MAINS_SET its phase and periods and CCD_PROC_AUTOROI_ON,
+// optionally, its settings.
+#define CCD_TELEM_LATENCY 0     // reset -> CCD_LatReport_t (ccd_lat.h)
+#define CCD_TELEM_FAULTS 1      // In-stream period in 100 ms (0 = off,
+                                // CCD_TELEM_KEEP) -> CCD_FaultReport_t
+#define CCD_TELEM_KERNEL 2      // CCD_PROC_KERNEL_* -> CCD_ProcBench_t
+#define CCD_TELEM_ADCCAL 3      // 1 = recalibrate -> CCD_AdcCalStatus_t
+#define CCD_TELEM_PREVIEW 4     // Frames/s (0 = off, CCD_TELEM_KEEP)
+                                // -> CCD_PreviewStatus_t (ccd_preview.h)
+#define CCD_TELEM_PREVIEW_BIN 5 // 1, 2, 4, 8 (CCD_TELEM_KEEP) -> the same
+#define CCD_TELEM_BANDS 6       // CCD_BANDS_* (CCD_TELEM_KEEP = read), then
+                                // CCD_Band_t entries -> CCD_BandsStatus_t
+#define CCD_TELEM_EXPOSE 7      // 1 = abort -> CCD_ExposeStatus_t
+                                // (ccd_snap.h)
+#define CCD_TELEM_LINE 8        // Unused -> CCD_LineStatus_t (ccd_line.h)
+#define CCD_TELEM_JPEG 9        // Quality 1-100 (0 = off, CCD_TELEM_KEEP)
+                                // -> CCD_JpegStatus_t (ccd_jpeg.h)
+#define CCD_TELEM_DESPIKE 10    // CCD_PROC_DESPIKE_* (CCD_TELEM_KEEP =
+                                // read), then u8 sigma in tenths and u16
+                                // floor, or both kept -> CCD_DespikeStatus_t
+#define CCD_TELEM_PTC 11        // CCD_PTC_* (CCD_TELEM_KEEP = read), then
+                                // its arguments -> CCD_PtcStatus_t
+#define CCD_TELEM_DEFECT 12     // CCD_DEFECT_* (CCD_TELEM_KEEP = read), then
+                                // its arguments -> CCD_DefectStatus_t
+#define CCD_TELEM_DRIFT 13      // CCD_DRIFT_* (CCD_TELEM_KEEP = read), then
+                                // its arguments -> CCD_DriftStatus_t
+#define CCD_TELEM_MATCH 14      // CCD_MATCH_* (CCD_TELEM_KEEP = read), then
+                                // its arguments -> CCD_MatchStatus_t
+#define CCD_TELEM_WIDE 15       // CCD_PROC_WIDE_* (CCD_TELEM_KEEP = read)
+                                // -> CCD_WideStatus_t (ccd_proc.h)
+#define CCD_TELEM_MEMORY 16     // CCD_MEM_CLEAR (CCD_TELEM_KEEP = read)
+                                // -> CCD_MemStatus_t (ccd_mem.h)
+#define CCD_TELEM_SATURATION 17 // CCD_ACQ_SAT_* (CCD_TELEM_KEEP = read),
+                                // then u16 level, or kept
+                                // -> CCD_SatStatus_t (ccd_acq.h)
+#define CCD_TELEM_REFERENCE 18  // CCD_REF_* (CCD_TELEM_KEEP = read), then
+                                // u32 target, or kept
+                                // -> CCD_RefStatus_t (ccd_ref.h)
+#define CCD_TELEM_TXN 19        // CCD_TXN_* (CCD_TELEM_KEEP = read), then
+                                // CCD_TXN_FORMAT's two bytes
+                                // -> CCD_TxnStatus_t (ccd_txn.h)
+#define CCD_TELEM_INPUTS 20     // CCD_DIN_EDGE_* (CCD_TELEM_KEEP = read)
+                                // -> CCD_DinStatus_t (ccd_din.h)
+#define CCD_TELEM_LOOP 21       // CCD_LOOP_* (CCD_TELEM_KEEP = read), then
+                                // u8 port and u32 count
+                                // -> CCD_LoopStatus_t (ccd_loop.h)
+#define CCD_TELEM_MAINS 22      // CCD_MAINS_SET (CCD_TELEM_KEEP = read),
+                                // then u16 phase and u8 periods
+                                // -> CCD_MainsStatus_t (ccd_mains.h)
+#define CCD_TELEM_SELFTEST 23   // CCD_SELFTEST_* (CCD_TELEM_KEEP = read)
+                                // -> CCD_SelftestStatus_t (ccd_selftest.h)
+#define CCD_TELEM_BASELINE 24   // CCD_PROC_BASE_* (CCD_TELEM_KEEP = read),
+                                // then u16 width, or kept
+                                // -> CCD_BaselineStatus_t (ccd_proc.h)
+#define CCD_TELEM_FOCUS 25      // As CCD_TELEM_BANDS, CCD_FocusLine_t
+                                // entries -> CCD_FocusStatus_t
+#define CCD_TELEM_AUTOROI 26    // CCD_PROC_AUTOROI_* (CCD_TELEM_KEEP =
+                                // read) -> CCD_AutoRoiStatus_t
+#define CCD_TELEM_SHUTTER 27    // CCD_SHUTTER_* (CCD_TELEM_KEEP = read),
+                                // ON then u16 every, u8 settle, darks, shift
+                                // -> CCD_ShutterStatus_t (ccd_shutter.h)
+#define CCD_TELEM_MODEL 28      // CCD_MODEL_* (CCD_TELEM_KEEP = read), then
+                                // its arguments -> CCD_ModelStatus_t
+                                // (ccd_model.h)
+#define CCD_TELEM_KEEP 0xFF
+
+// CCD_CmdInfo_t.protocol: bumped when a command or record changes in a way
+// an older host would misread. New commands and fields appended to a
+// payload are not breaking; hosts check commands and the payload length.
+// 2: burst header and status with 16-bit counts (CCD_BURST_PSRAM)
+#define CCD_CMD_PROTOCOL 2
+
+// CCD_CmdInfo_t.build: options this firmware was built with (main.h)
+#define CCD_CMD_BUILD_CACHE 0x01U    // CCD_CACHE_ENABLE
+#define CCD_CMD_BUILD_VENDOR 0x02U   // CCD_USB_VENDOR
+#define CCD_CMD_BUILD_ULPI 0x04U     // CCD_USB_ULPI
+#define CCD_CMD_BUILD_HS_DMA 0x08U   // CCD_USB_HS_DMA
+#define CCD_CMD_BUILD_ETH 0x10U      // CCD_ETH
+#define CCD_CMD_BUILD_SD 0x20U       // CCD_SD
+#define CCD_CMD_BUILD_PSRAM 0x40U    // CCD_BURST_PSRAM
+#define CCD_CMD_BUILD_EXT_ADC 0x80U  // CCD_EXT_ADC
+#define CCD_CMD_BUILD_TRACE 0x100U   // CCD_ITM_TRACE
+#define CCD_CMD_BUILD_NTC 0x200U     // CCD_TEMP_NTC
+#define CCD_CMD_BUILD_ENCODER 0x400U // CCD_ENCODER
+#define CCD_CMD_BUILD_JPEG 0x800U    // CCD_JPEG
+#define CCD_CMD_BUILD_REF 0x1000U    // CCD_REF_PD
+#define CCD_CMD_BUILD_DIN 0x2000U    // CCD_DIN
+#define CCD_CMD_BUILD_ISO 0x4000U    // CCD_USB_ISO
+#define CCD_CMD_BUILD_MAINS 0x8000U  // CCD_LINE_SYNC
+#define CCD_CMD_BUILD_SHUTTER 0x10000U // CCD_SHUTTER
+#define CCD_CMD_BUILD_MODEL 0x20000U   // CCD_MODEL
+
+// CCD_CmdInfo_t.formats: frame records this firmware can send
+#define CCD_CMD_FMT_RAW 0x0001UL      // CCD_Frame_t
+#define CCD_CMD_FMT_SHAPED 0x0002UL   // Binned / ROI (CCD_ShapedHeader_t)
+#define CCD_CMD_FMT_PACKED 0x0004UL   // 12/14-bit packed pixels ("P")
+#define CCD_CMD_FMT_RICE 0x0008UL     // CCD_PROC_CODEC_RICE
+#define CCD_CMD_FMT_TEMPORAL 0x0010UL // CCD_PROC_CODEC_TEMPORAL
+#define CCD_CMD_FMT_WIDE 0x0020UL     // int32 sums / float32 means
+#define CCD_CMD_FMT_HDR 0x0040UL      // Float bracket merges
+#define CCD_CMD_FMT_STATS 0x0080UL    // CCD_PROC_STATS_ONLY records
+#define CCD_CMD_FMT_PEAKS 0x0100UL
+#define CCD_CMD_FMT_BANDS 0x0200UL
+#define CCD_CMD_FMT_DRIFT 0x0400UL
+#define CCD_CMD_FMT_MATCH 0x0800UL
+#define CCD_CMD_FMT_PTC 0x1000UL
+#define CCD_CMD_FMT_LINE 0x2000UL     // CCD_ENCODER
+#define CCD_CMD_FMT_JPEG 0x4000UL     // CCD_JPEG
+#define CCD_CMD_FMT_BURST 0x8000UL    // Bursts from the capture store
+#define CCD_CMD_FMT_DUAL 0x10000UL    // Sensor B frames (CCD_DUAL_SENSOR)
+#define CCD_CMD_FMT_DARK 0x20000UL    // Closed-shutter frames (CCD_SHUTTER)
+#define CCD_CMD_FMT_MODEL 0x40000UL   // Model values (CCD_MODEL)
+
+// CCD_CmdInfo_t.sinks: where frames can go (CCD_CMD_TRANSPORT, "D")
+#define CCD_CMD_SINK_USB_FS 0x01U // FS port, always
+#define CCD_CMD_SINK_USB_HS 0x02U // OTG_HS port, CCD_TX_DUAL, always
+#define CCD_CMD_SINK_HS_480 0x04U // Of those, 480 Mbit/s (CCD_USB_ULPI)
+#define CCD_CMD_SINK_ETH 0x08U    // UDP, CCD_TX_ETH (CCD_ETH)
+#define CCD_CMD_SINK_SD 0x10U     // Recording (CCD_SD)
+#define CCD_CMD_SINK_PSRAM 0x20U  // Bursts to PSRAM (CCD_BURST_PSRAM)
+
+// CCD_CmdInfo_t.sensor_flags
+#define CCD_CMD_SENSOR_SHUTTER 0x01U // SH sets the integration (modes 0, 1)
+#define CCD_CMD_SENSOR_RISES 0x02U   // Output rises with light, inverted
+
+// CCD_CMD_TRIGGER targets
+#define CCD_CMD_TRIG_SNAP 0  // Mode 1 snap ("J")
+#define CCD_CMD_TRIG_BURST 1 // Armed burst ("XT")
+#define CCD_CMD_TRIG_SEQ 2   // Sequence step waiting for its trigger ("ZT")
+
+// CCD_CmdAck_t.status
+#define CCD_CMD_OK 0
+#define CCD_CMD_REJECTED 1   // Value out of range, or not possible now
+#define CCD_CMD_UNKNOWN 2    // No such command
+#define CCD_CMD_BAD_LENGTH 3 // Value length wrong for the command
+#define CCD_CMD_BAD_CHECK 4  // Check byte mismatch, not executed
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic; // CCD_CMD_ACK_MAGIC
+  uint8_t seq;    // As sent
+  uint8_t type;
+  uint8_t status; // CCD_CMD_OK ...
+  uint8_t len;    // Payload bytes that follow
+} CCD_CmdAck_t;
+
+typedef struct {
+  uint32_t produced;   // frame_ring_stats
+  uint32_t released;
+  uint32_t dropped;
+  uint32_t resyncs;    // ccd_acq_stats
+  uint32_t dma_errors;
+  uint32_t coadded;    // ccd_proc_stats
+  uint32_t commands;   // Binary frames executed
+  uint32_t cmd_errors; // Binary frames refused, or bytes outside a frame
+  uint32_t uptime_ms;
+  uint32_t throttled;  // ccd_flow_stats: frames skipped or merged
+  uint32_t loop_max_us; // Longest main loop pass since the last STATS
+  uint32_t late;       // ccd_acq_stats: deferred frame work overran
+  uint32_t irq_fixes;  // Interrupt levels set again (ccd_irq.h)
+  uint32_t packed;     // ccd_pack_stats: small frames sent in a pack
+  uint32_t packs;      // Transfers they took
+  uint32_t icg_count;  // ICG periods counted by TIM1 (CCD_Acq_IcgCount)
+  uint32_t missed;     // ccd_acq_stats: of those, ended with no frame
+  uint32_t dual_dropped; // Sensor B frames not sent (CCD_Dual_Dropped)
+} CCD_CmdStats_t;
+
+typedef struct {
+  uint64_t rx_cycles;   // This request received
+  uint64_t tx_cycles;   // This ack queued
+  uint64_t prev_cycles; // Previous TIME ack sent, 0 = none yet
+  uint8_t prev_seq;     // Its seq
+  uint8_t reserved[3];
+  uint32_t tick_hz;     // Timestamp rate (CCD_TIME_HZ)
+} CCD_CmdTime_t;
+typedef struct {
+  uint16_t protocol;  // CCD_CMD_PROTOCOL
+  uint16_t pixels;    // CCD_BUFFER_SIZE
+  uint32_t commands;  // Bit n set: binary command type n is known
+  uint32_t build;     // CCD_CMD_BUILD_*
+  uint32_t clock_hz;  // Timestamp rate (CCD_TIME_HZ)
+  uint8_t ring_slots; // FRAME_RING_SLOTS
+  uint8_t tx_last;    // Highest transport mode (CCD_TX_LAST)
+  uint8_t value_max;  // CCD_CMD_VALUE_MAX
+  uint8_t reserved;
+  // Capabilities (protocol 2, appended): what a host needs to pick the
+  // fastest settings the build and link allow
+  uint32_t formats;      // CCD_CMD_FMT_*
+  uint16_t burst_frames; // CCD_BURST_FRAMES
+  uint16_t frame_bytes;  // sizeof(CCD_Frame_t), a raw record
+  uint8_t sinks;         // CCD_CMD_SINK_*
+  uint8_t timing;        // CCD_TIMING_PROFILE
+  uint8_t profiles;      // Readout speed profiles ("O"), CCD_LN_COUNT
+  uint8_t reserved2;
+  uint32_t fm_hz;        // CCD_FM_HZ, profile 0
+  uint32_t frame_us;     // Shortest frame period, profile 0
+  // Sensor (appended)
+  uint8_t sensor;        // CCD_SENSOR
+  uint8_t sensor_flags;  // CCD_CMD_SENSOR_*
+  uint16_t shield_start; // Light-shielded outputs
+  uint16_t shield_count;
+  uint16_t active_start; // Effective pixels
+  uint16_t active_count;
+} CCD_CmdInfo_t;
+
+// Processing cost per stage (ccd_proc.h), worst cases since the last
+// PROFILE. A configuration fits when max_total stays below frame_cycles.
+typedef struct {
+  uint32_t frame_cycles;   // Current ICG period in CPU cycles
+  uint32_t frames;         // Frames processed
+  uint32_t max_total;      // Longest pass through the pipeline
+  uint32_t max_cycles[CCD_PROC_STAGES]; // CCD_PROC_STAGE_* order
+} CCD_CmdProfile_t;
+
+// One probe (ccd_probe.h); mean and histogram since its last reset
+typedef struct {
+  uint8_t probe; // CCD_PROBE_*
+  uint8_t bins;  // CCD_PROBE_BINS
+  uint16_t reserved;
+  uint32_t count;
+  uint32_t min_cycles; // 0 when count is 0
+  uint32_t max_cycles;
+  uint32_t mean_cycles;
+  uint32_t hist[11]; // Bin k from CCD_PROBE_BIN0 << (k - 1) cycles
+} CCD_CmdProbe_t;
+
+typedef struct {
+  uint8_t mode;  // CCD_PROC_ABS_*
+  uint8_t state; // CCD_ABS_*
+} CCD_CmdAbsorbance_t;
+#pragma pack(pop)
+
+// USB RX interrupt: 1 if the packet belongs to the binary path. After
+// every packet CCD_Cmd_RxReady() says whether to re-arm the OUT endpoint;
+// if not, CCD_Cmd_Poll() re-arms it once the ring has room.
+uint8_t CCD_Cmd_Receive(const uint8_t *buf, uint32_t len);
+uint8_t CCD_Cmd_RxReady(void);
+uint32_t CCD_Cmd_Errors(void); // CCD_CmdStats_t.cmd_errors
+uint32_t CCD_Cmd_Stalls(void); // Packets RxReady() held back
+
+// Main loop, ahead of the mode switch
+void CCD_Cmd_Poll(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_CMD_H */
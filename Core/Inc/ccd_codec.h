@@ -0,0 +1,55 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_codec.h
+ * @brief          : Binning, packing and Rice kernels of the shaped frames
+ ******************************************************************************
+ * The pure pixel kernels behind CCD_Proc_Frame()'s shaping and codec
+ * (ccd_proc.h): they touch nothing but their arguments. So this header and
+ * ccd_codec.c stay clear of main.h and the HAL, and tests/host builds the
+ * same source for x86 with the one CMSIS intrinsic they use emulated, to
+ * check a kernel change bit for bit against a reference decoder before it
+ * is timed on the target (CCD_TELEM_KERNEL).
+ *
+ * Input lines are read two pixels per word load, so an odd count reads
+ * one pixel past its end (the pixel is not used).
+ ******************************************************************************
+ */
+
+#ifndef __CCD_CODEC_H
+#define __CCD_CODEC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "cmsis_compiler.h"
+#include <stdint.h>
+
+// main.h's CCD_ITCM, which this header cannot include
+#define CCD_CODEC_ITCM __attribute__((section(".itcm_text")))
+
+// Rice stream: per block of CCD_PROC_RICE_BLOCK pixels a 5-bit k, then one
+// code per pixel. k = CCD_PROC_RICE_ESCAPE stores the block verbatim.
+#define CCD_PROC_RICE_BLOCK 16
+#define CCD_PROC_RICE_ESCAPE 31
+
+// Mean of each run of b adjacent pixels, rounded; returns count / b. The
+// kernel for b = 1, 2, 4 or 8, as the commands setting it allow.
+typedef uint32_t (*CCD_Codec_BinKernel_t)(uint16_t *out, const uint16_t *in,
+                                          uint32_t count);
+CCD_Codec_BinKernel_t CCD_Codec_BinKernel(uint32_t b);
+
+// Top 12 or 14 bits of each pixel, packed; returns the bytes written
+uint32_t CCD_Codec_Pack12(uint8_t *dst, const uint16_t *px, uint32_t count);
+uint32_t CCD_Codec_Pack14(uint8_t *dst, const uint16_t *px, uint32_t count);
+
+// Returns the bytes written, 0 if the stream would not fit in limit bytes
+uint32_t CCD_Codec_RiceEncode(uint8_t *dst, uint32_t limit,
+                              const uint16_t *px, const uint16_t *ref,
+                              uint32_t count, uint8_t bits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_CODEC_H */
@@ -0,0 +1,139 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_config.h
+ * @brief          : Settings kept in flash, restored at boot
+ ******************************************************************************
+ * The acquisition and processing settings a host sets up (modes, exposure,
+ * strobe, sampling, ROI and its auto placement, binning, packing,
+ * co-adding and its wide output, statistics, peaks, smoothing, spike
+ * rejection, baseline removal, spectrum matching, auto-exposure and the
+ * saturation flag, black level, the dark temperature table, the reference
+ * photodiode) are one CCD_Config_t. The main loop compares it against
+ * the last saved copy every CCD_CONFIG_POLL_MS and, once a change has held
+ * for CCD_CONFIG_SETTLE_MS, appends it to the settings log sector
+ * (CCD_STORE_CONFIG). A burst of commands therefore costs one record, and
+ * a record costs a few flash words, not an erase.
+ *
+ * CCD_Config_Init() applies the newest record before the timers start, so
+ * the device comes up streaming in the configuration it was left in, with
+ * no host command. Settings that depend on a table (flat field,
+ * linearity, defect map) are only switched off by a record, never on
+ * without their table; the match mode is kept, and with an empty library
+ * it classifies nothing. Not kept: the flow-control policy (it needs host
+ * credits), dark, absorbance and drift references, bursts, sequences,
+ * exposure brackets, the spectral bands, the focus lines and the USB
+ * preview (ccd_preview.h).
+ *
+ * CCD_CMD_CONFIG reads the status, saves at once, turns the automatic
+ * saves off or on, or erases the log so the next boot starts from the
+ * built-in defaults.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_CONFIG_H
+#define __CCD_CONFIG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ccd_ae.h"
+#include "ccd_proc.h"
+#include "main.h"
+
+#define CCD_CONFIG_VERSION 11 // CCD_Config_t layout
+#define CCD_CONFIG_POLL_MS 250U
+#ifndef CCD_CONFIG_SETTLE_MS
+#define CCD_CONFIG_SETTLE_MS 2000U // Unchanged this long before a save
+#endif
+
+// CCD_CMD_CONFIG actions
+#define CCD_CONFIG_STATUS 0
+#define CCD_CONFIG_SAVE 1     // Now, whatever the automatic saves
+#define CCD_CONFIG_AUTO 2     // arg 0/1; saved at once with the settings
+#define CCD_CONFIG_DEFAULTS 3 // Erase the log: defaults from the next boot
+
+#pragma pack(push, 1)
+typedef struct {
+  uint8_t version; // CCD_CONFIG_VERSION
+  uint8_t auto_save;
+  uint8_t ccd_mode;
+  uint8_t tx_mode;
+  uint8_t acq_mode;
+  uint8_t sync_mode;
+  uint8_t adc_samples;   // "I"
+  uint8_t cds;           // "K"
+  uint8_t noise_profile; // "O"
+  uint8_t source;        // "V"
+  uint8_t bin;           // "B"
+  uint8_t bits;          // "P"
+  uint8_t codec;         // "C"
+  uint8_t flat_enable;   // "G0"/"G1"
+  uint8_t lin_enable;
+  uint8_t black_enable;  // CCD_CMD_BLACK
+  uint8_t smooth_window;
+  uint8_t smooth_order;
+  uint8_t stats;
+  uint8_t peaks;
+  uint8_t peak_fit;
+  uint16_t stats_level;
+  uint16_t peak_threshold;
+  uint16_t peak_distance;
+  uint16_t coadd_n;         // "N"
+  uint16_t rolling_n;       // "R"
+  uint16_t event_threshold; // "E"
+  uint16_t heartbeat_ms;    // "H"
+  uint32_t sh_period_us;    // "L"
+  uint32_t sh_pulse_us;
+  uint32_t strobe_delay_us; // "S"
+  uint32_t strobe_width_us;
+  CCD_AESettings_t ae;
+  uint8_t roi_count; // "W"
+  CCD_RoiWindow_t roi[CCD_PROC_ROI_MAX];
+  uint8_t darkt_count; // CCD_CMD_DARK_TEMP
+  CCD_DarkTempKnot_t darkt[CCD_PROC_DARKT_KNOTS];
+  uint8_t despike; // CCD_TELEM_DESPIKE
+  uint8_t despike_sigma;
+  uint16_t despike_floor;
+  uint8_t defect_enable; // CCD_TELEM_DEFECT
+  uint8_t match_mode;    // CCD_TELEM_MATCH
+  uint16_t match_threshold;
+  uint8_t wide;      // CCD_TELEM_WIDE
+  uint8_t sat_mode;  // CCD_TELEM_SATURATION
+  uint16_t sat_level;
+  uint8_t ref_mode;  // CCD_TELEM_REFERENCE (CCD_REF_PD)
+  uint32_t ref_target;
+  uint8_t baseline; // CCD_TELEM_BASELINE
+  uint16_t base_width;
+  uint8_t auto_roi; // CCD_TELEM_AUTOROI
+  uint8_t auto_lines;
+  uint8_t auto_frames;
+  uint16_t auto_margin;
+  uint16_t auto_interval;
+} CCD_Config_t;
+
+// CCD_CMD_CONFIG ack payload
+typedef struct {
+  uint8_t auto_save;
+  uint8_t restored;   // The settings at boot came from flash
+  uint8_t warm_boot;  // No power-on or brown-out reset before this boot
+  uint8_t adc_cached; // ADC calibration from flash (ccd_adccal.h)
+  uint8_t pending;    // A change not saved yet
+  uint8_t reserved[3];
+  uint32_t saves;     // Records written since boot
+  uint32_t free;      // Log bytes left before the next erase
+} CCD_ConfigStatus_t;
+#pragma pack(pop)
+
+void CCD_Config_Init(void); // Boot, after CCD_Acq_ApplySampling()
+void CCD_Config_Poll(void);
+
+// Main loop: a CCD_CONFIG_* action, 0 if unknown or the flash failed
+uint8_t CCD_Config_Command(uint8_t action, uint8_t arg,
+                           CCD_ConfigStatus_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_CONFIG_H */
@@ -0,0 +1,39 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_crc.h
+ * @brief          : Frame CRC-32 on the CRC peripheral
+ ******************************************************************************
+ * Every frame leaves with CCD_FrameInfo_t.crc set to the standard CRC-32
+ * (zlib, IEEE 802.3) of its header_len + payload_len bytes, computed with
+ * the crc field itself as 0. The CRC unit is set up for that polynomial
+ * with bit-reflected input and output, and the CPU feeds it a word per
+ * write: a raw frame is 1856 writes and no table lookups.
+ *
+ * A frame is stamped once it is final, just before it is queued for USB:
+ * after processing, in every frame of a batch, and in burst frames as they
+ * are drained.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_CRC_H
+#define __CCD_CRC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+void CCD_Crc_Init(void);
+
+// Main loop only (the unit holds one computation). data needs no alignment.
+uint32_t CCD_Crc_Compute(const void *data, uint32_t len);
+
+// Raw or shaped frame: both carry CCD_FrameInfo_t at the same offset
+void CCD_Crc_Stamp(void *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_CRC_H */
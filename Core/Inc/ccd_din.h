@@ -0,0 +1,93 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_din.h
+ * @brief          : Digital inputs latched per frame, edges on the frame clock
+ ******************************************************************************
+ * With CCD_DIN, CCD_DIN_COUNT inputs (PE8-PE11) tell each spectrum what
+ * the rest of the setup was doing: a valve open, a sample in place. The
+ * TIM2 update interrupt reads the port as its first access, at the ICG
+ * edge that starts a frame's readout (its info.timestamp), and the
+ * handoff keeps the value with the frame's seq. The double-buffer path and
+ * mode 3 take no interrupt at that edge, so there the port is read as the
+ * frame completes instead, and the level is marked CCD_DIN_LATE.
+ *
+ * The first input (PE8) can also raise EXTI8 on its edges (CCD_DIN_EDGE_*),
+ * whose interrupt takes CCD_Time_Now(): the clock the frame timestamps
+ * are in, so nothing depends on the host clock. As each frame
+ * is published, the edges before its ICG are given to the frame before it
+ * with their offset from that one's ICG, to within the interrupt latency
+ * (the capture interrupts come first, CCD_IRQ_PRIO_TRIG). TIM2's four
+ * channels are all taken, so no capture channel runs in step with the ICG.
+ *
+ * CCD_FrameInfo_t has no room left, so the levels are kept by seq for the
+ * last CCD_DIN_HIST frames and read back through CCD_TELEM_INPUTS, with the
+ * last CCD_DIN_EDGES edges (the saturation flag does the same). The edge
+ * setting is not kept in flash.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_DIN_H
+#define __CCD_DIN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "frame_ring.h"
+#include "main.h"
+
+#define CCD_DIN_HIST FRAME_RING_SLOTS // Frames whose levels are kept
+#define CCD_DIN_LEVELS 16U            // Of those, in the status
+#define CCD_DIN_EDGES 6U              // Edges in the status
+#define CCD_DIN_QUEUE 16U // Edges waiting for their frame, a power of 2
+#define CCD_DIN_LATE 0x80U // Level read at the completion, not the ICG
+#define CCD_DIN_NONE 0xFFU // No level kept for the frame
+
+// CCD_TELEM_INPUTS edge settings
+#define CCD_DIN_EDGE_OFF 0
+#define CCD_DIN_EDGE_RISING 1
+#define CCD_DIN_EDGE_FALLING 2
+#define CCD_DIN_EDGE_BOTH 3
+
+#pragma pack(push, 1)
+typedef struct {
+  uint32_t seq;    // Frame whose ICG period the edge fell in
+  uint32_t offset; // CCD_TIME_HZ ticks after its ICG, 0xFFFFFFFF = later
+} CCD_DinEdge_t;
+
+// CCD_TELEM_INPUTS reply
+typedef struct {
+  uint8_t edge;   // CCD_DIN_EDGE_*
+  uint8_t inputs; // Levels now, bit 0 = PE8
+  uint8_t rising; // Bit i: edges[i] was a rising edge
+  uint8_t missed; // Edges lost with the queue full, saturating
+  uint32_t seq;   // Newest frame latched
+  uint32_t count; // Edges since boot
+  uint8_t level[CCD_DIN_LEVELS];      // From seq down, or CCD_DIN_NONE
+  CCD_DinEdge_t edges[CCD_DIN_EDGES]; // Newest first, the first count
+} CCD_DinStatus_t;
+#pragma pack(pop)
+
+// Boot: the inputs, and EXTI8 off
+void CCD_Din_Init(void);
+
+// TIM2 update interrupt, the port as read on entry, running chain only
+void CCD_Din_Icg(uint32_t port);
+
+// Handoff (capture interrupts): the levels of frame seq
+void CCD_Din_Latch(uint32_t seq);
+
+// PendSV, with the header stamped: the edges before the frame's ICG
+void CCD_Din_Frame(const CCD_Frame_t *frame);
+
+// EXTI9_5 interrupt (stm32h7xx_it.c)
+void CCD_Din_EdgeIRQ(void);
+
+uint8_t CCD_Din_SetEdge(uint8_t edge); // 0 = not a CCD_DIN_EDGE_*
+void CCD_Din_Status(CCD_DinStatus_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_DIN_H */
@@ -0,0 +1,55 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_dual.h
+ * @brief          : Second sensor head on ADC2, sent beside the first
+ ******************************************************************************
+ * With CCD_DUAL_SENSOR and sample source CCD_ACQ_SRC_DUAL ("V3"), ADC1
+ * converts sensor A (PA3, or PC4 with the ULPI PHY) and ADC2 sensor B (PC5)
+ * at the same instant of every TIM4 period, and the stream takes both as
+ * one CDR word per pixel into the staging buffer. The heads share fM, SH
+ * and ICG, so both frames integrate over the same time.
+ *
+ * PendSV splits the words: sensor A's pixels go to the ring slot and on
+ * through the usual path (processing, bursts, flow control), and sensor
+ * B's to one of two companion buffers here. Once A is in the ring, B gets
+ * a copy of its header with magic CCD_DUAL_MAGIC and goes out raw from the
+ * main loop, outside the flow credits, with the same seq: the host pairs
+ * the two into one two-channel frame. A ring slot cannot hold both lines
+ * (2 x 7424 bytes), which is why they travel apart.
+ *
+ * B is dropped, and counted (CCD_CmdStats_t.dual_dropped), when both
+ * companion buffers are still queued for USB, or when A itself does not
+ * reach the ring (ring full, or held in a burst store).
+ ******************************************************************************
+ */
+
+#ifndef __CCD_DUAL_H
+#define __CCD_DUAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_DUAL_MAGIC 0xABE1 // Sensor B: a CCD_Frame_t beside sensor A's
+#define CCD_DUAL_BUFS 2
+
+// PendSV, as a dual frame completes: the buffer for sensor B's pixels, or
+// NULL (counted as dropped)
+CCD_Frame_t *CCD_Dual_Claim(void);
+
+// PendSV, after the claim: a is sensor A's frame, stamped and in the ring,
+// or NULL to drop B
+void CCD_Dual_Complete(const CCD_Frame_t *a);
+
+// Main loop: queue completed B frames for USB, lowest seq first
+void CCD_Dual_Send(void);
+
+uint32_t CCD_Dual_Dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_DUAL_H */
@@ -0,0 +1,66 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_eth.h
+ * @brief          : Frame streaming over Ethernet (UDP multicast, LwIP)
+ ******************************************************************************
+ * Built with CCD_ETH=1 on top of the CubeMX ETH (RMII) and LwIP middleware,
+ * without an RTOS (NO_SYS): MX_LWIP_Process() runs from the main loop and
+ * every LwIP call here does too. In transport mode CCD_TX_ETH ("T4") frames
+ * go out as UDP datagrams to the group CCD_ETH_GROUP, so any number of hosts
+ * can subscribe. Commands, acks and reports stay on USB.
+ *
+ * One datagram is one CCD_Frame_t, byte for byte what USB carries, so the
+ * host parser and the CRC check are shared. It is larger than the MTU and
+ * LwIP fragments it (IP_FRAG); a lost fragment loses the whole frame, which
+ * the host sees as a gap in seq.
+ *
+ * No copy: each datagram is a PBUF_REF custom pbuf whose payload is the ring
+ * slot. LwIP prepends the UDP/IP/MAC headers in a pbuf of their own and the
+ * fragments reference the slot, so the ETH DMA reads the pixels where the
+ * ADC DMA wrote them. The slot is released from the pbuf free callback once
+ * the last reference is gone, whether the driver sends before udp_sendto()
+ * returns or after. CCD_ETH_INFLIGHT bounds the frames held that way.
+ *
+ * In CCD_TX_FANOUT ("T5") USB streams as in CCD_TX_FRAME and keeps the
+ * flow control, and each frame it sends also goes to the group from the
+ * same slot, which holds a reference for each (frame_ring.h). A frame
+ * Ethernet has no room for when USB takes it is skipped on Ethernet only.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_ETH_H
+#define __CCD_ETH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_ETH_GROUP "239.255.67.68" // Administratively scoped multicast
+#define CCD_ETH_PORT 50067U
+#define CCD_ETH_TTL 4U      // Hops, for routed multicast
+#define CCD_ETH_INFLIGHT 4U // Frames handed to LwIP and not yet freed
+
+typedef struct {
+  uint32_t sent;   // Datagrams handed to LwIP
+  uint32_t failed; // udp_sendto() errors, frame released unsent
+  uint32_t skipped; // CCD_TX_FANOUT: frames not mirrored, no room
+} CCD_Eth_Stats_t;
+
+extern CCD_Eth_Stats_t ccd_eth_stats;
+
+// After MX_LWIP_Init()
+void CCD_Eth_Init(void);
+
+// Send path (main loop)
+uint32_t CCD_Eth_Space(void); // 0 while the link is down or all slots are out
+void CCD_Eth_Send(CCD_Frame_t *frame, uint32_t len);
+// The frame's own holder keeps it; Ethernet takes one more, or skips it
+void CCD_Eth_Mirror(CCD_Frame_t *frame, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_ETH_H */
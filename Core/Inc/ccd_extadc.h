@@ -0,0 +1,83 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_extadc.h
+ * @brief          : External 16-bit SPI ADC front end (CNVST + SPI4 + DMA)
+ ******************************************************************************
+ * Built with CCD_EXT_ADC=1 for a sensor board with its own differential
+ * 16-bit SAR converter (AD4001 class, 2 MSPS, 3-wire "CS mode" with CNV as
+ * the chip select), as in the TCD1304 reference design with the
+ * differential ADC. As sample source CCD_ACQ_SRC_SPI (ccd_acq.h), the
+ * default of the build, it feeds DMA1_Stream0 in place of ADC1, so the
+ * restart and double-buffer paths, the frame ring, the header and the
+ * transports are unchanged. No CPU runs per pixel:
+ *  - TIM4 CH3 (CCD_CNVST) is high from the sample phase for the conversion
+ *    time, in combined PWM mode 2 with CH4 like the strobe output on TIM2.
+ *  - TIM4 CC1 falls where the conversion ends. DMAMUX routes its request to
+ *    DMA1_Stream1, which writes one dummy word to SPI4 TXDR, and the master
+ *    clocks out one 16-bit sample. With TSIZE = 0 and an empty TX FIFO the
+ *    SPI waits between pixels with SCK idle.
+ *  - The SPI4 RX request moves the sample into the ring slot through
+ *    DMA1_Stream0, CCD_BUFFER_SIZE halfwords per frame as from ADC1.
+ * TIM4 is reset by TIM2 TRGO as before, so every frame holds exactly
+ * CCD_BUFFER_SIZE samples, pixel-aligned. The restart path drops what a
+ * resync left in the RX FIFO before it re-arms the stream.
+ *
+ * The TX data never leave the chip (no MOSI pin). SPI4 runs from its reset
+ * kernel clock (APB2) at the fastest divider within CCD_EXT_ADC_SCK_MAX_HZ.
+ * A sample phase that leaves no room for the conversion and the read
+ * before the next pixel is moved back. Multi-sampling, CDS and the ADC1
+ * oversampler of the low-noise profiles do not apply; their fM dividers
+ * do.
+ *
+ * A two's complement converter (CCD_EXT_ADC_TWOS) gets its sign bit flipped
+ * once per frame, two pixels per XOR, so frames stay offset binary like
+ * the ADC1 ones.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_EXTADC_H
+#define __CCD_EXTADC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#ifndef CCD_EXT_ADC_CONV_NS
+#define CCD_EXT_ADC_CONV_NS 320U // CNV high, tCONV max (AD4001)
+#endif
+#ifndef CCD_EXT_ADC_SCK_MAX_HZ
+#define CCD_EXT_ADC_SCK_MAX_HZ 80000000UL
+#endif
+#ifndef CCD_EXT_ADC_TWOS
+#define CCD_EXT_ADC_TWOS 1 // Samples in two's complement (differential)
+#endif
+#define CCD_EXT_ADC_BITS 16U
+#define CCD_EXT_ADC_SLACK_TICKS 4U // DMA request to the first SCK edge
+
+#if CCD_EXT_ADC
+
+// Source CCD_ACQ_SRC_SPI of ccd_acq.h; init after MX_TIM4_Init(): pins,
+// SPI4, TIM4 CH1/CH3 and the TX stream. 0 if a conversion and its read
+// cannot fit in one pixel.
+uint8_t CCD_ExtAdc_Init(void);
+
+// Sample at TIM4 tick start (moved back if needed) in a TIM4 period of
+// arr + 1 ticks; returns the tick by which the sample has reached memory
+uint32_t CCD_ExtAdc_SetPhase(uint32_t start, uint32_t arr);
+
+void CCD_ExtAdc_Stream(void);
+void CCD_ExtAdc_Start(void); // Before the timers run
+void CCD_ExtAdc_Arm(void);
+void CCD_ExtAdc_Stop(void);
+void CCD_ExtAdc_Done(CCD_Frame_t *frame); // CCD_EXT_ADC_TWOS
+uint8_t CCD_ExtAdc_Overrun(void);          // SPI4 RX FIFO overrun
+
+#endif /* CCD_EXT_ADC */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_EXTADC_H */
@@ -0,0 +1,89 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_fault.h
+ * @brief          : Loss and fault counters, in the stream and on request
+ ******************************************************************************
+ * Every path that loses a frame, a sample or a byte, or gives up on the
+ * firmware, counts into one CCD_FaultReport_t. The counters only ever grow
+ * (from boot; boots and faults from power-up), so a host takes differences
+ * and never misses an event between two reads. The report goes out on the
+ * control link every CCD_FAULT_PERIOD_MS (CCD_TELEM_FAULTS of
+ * CCD_CMD_TELEMETRY changes the period or turns it off) and in the ack of
+ * that command. A misaligned frame (ccd_watch.h) brings the next in-stream
+ * report forward, CCD_FAULT_ALERT_MS at the soonest after the last one, so
+ * a desync shows within a few frames.
+ *
+ * Error_Handler() and the HardFault handler count the fault and its cause
+ * into a record in .dtcm_noinit, which the startup leaves alone, and reset
+ * the chip rather than spin with the interrupts masked (to the host, a
+ * stalled link). With a debugger attached they stop where they are, for
+ * it to look at. A reset by the independent watchdog (ccd_watch.h) is
+ * counted at the next boot. A record that does not carry
+ * CCD_FAULT_REC_MAGIC (power-up) starts over from zero.
+ *
+ * Not counted here: the Ethernet and SD transports, whose losses are in
+ * their own status (ccd_eth.h, ccd_rec.h).
+ ******************************************************************************
+ */
+
+#ifndef __CCD_FAULT_H
+#define __CCD_FAULT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_FAULT_MAGIC 0xABD9 // CCD_FaultReport_t
+#define CCD_FAULT_REC_MAGIC 0x544C4643UL // "CFLT"
+#ifndef CCD_FAULT_PERIOD_MS
+#define CCD_FAULT_PERIOD_MS 1000U // In-stream report, 0 = only on request
+#endif
+#define CCD_FAULT_ALERT_MS 100U // Earliest report after a misaligned frame
+
+// CCD_FaultReport_t.last_fault
+#define CCD_FAULT_NONE 0
+#define CCD_FAULT_ERROR 1    // Error_Handler(): a HAL call failed
+#define CCD_FAULT_HARD 2     // HardFault
+#define CCD_FAULT_WATCHDOG 3 // IWDG1: capture stalled or main loop stuck
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;      // CCD_FAULT_MAGIC
+  uint8_t last_fault;  // CCD_FAULT_* of the latest fault reset
+  uint8_t reserved;
+  uint32_t uptime_ms;
+  uint32_t dropped;    // Ring full: capture into the scratch frame
+  uint32_t resyncs;    // ICG found the DMA mid-frame (pixel 0 missed)
+  uint32_t overruns;   // of those, with the ADC or SPI sample overrun
+  uint32_t dma_errors; // Transfer errors, frame discarded
+  uint32_t usb_busy;   // Transfers the USB stack refused, retried
+  uint32_t usb_full;   // Buffers refused by a full TX queue
+  uint32_t usb_aborted; // Buffers handed back unsent on a disconnect, or
+                        // cut short by a lost iso packet (CCD_USB_ISO)
+  uint32_t cmd_errors; // Binary frames refused, or bytes outside a frame
+  uint32_t cmd_stalls; // Command RX ring full: OUT endpoint NAKed
+  uint32_t throttled;  // Flow control: frames skipped or merged
+  uint32_t boots;
+  uint32_t faults;     // Error_Handler(), HardFault and watchdog resets
+  uint32_t rearms;     // Capture chain re-armed by the supervisor
+  uint32_t misaligned; // Frames failing its dummy output check
+} CCD_FaultReport_t;
+#pragma pack(pop)
+
+void CCD_Fault_Init(void); // Boot: counts the boot in the record
+
+// Main loop; ms 0 turns the in-stream report off
+void CCD_Fault_SetPeriod(uint32_t ms);
+void CCD_Fault_Read(CCD_FaultReport_t *out);
+void CCD_Fault_Poll(void);
+
+// Any context, interrupts masked: records cause and resets (debugger: halts)
+void CCD_Fault_Reset(uint8_t cause) __attribute__((noreturn));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_FAULT_H */
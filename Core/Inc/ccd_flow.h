@@ -0,0 +1,68 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_flow.h
+ * @brief          : Credit-based flow control (host backpressure)
+ ******************************************************************************
+ * Without flow control the device sends every frame as fast as USB takes
+ * it, and a host that cannot keep up loses them somewhere in its own
+ * buffers. With it, the host grants credits: CCD_CMD_CREDIT carries the
+ * total number of frames it allows since CCD_CMD_FLOW switched flow control
+ * on (frames received + the buffers it has free), so a lost or late grant
+ * is made good by the next one. Frames are only queued for USB while the
+ * count sent is below the limit; the comparison wraps.
+ *
+ * Out of credit, the frames at the head of the ring are handled by the
+ * policy:
+ *  - HOLD: left in the ring; once it is full, acquisition drops as usual
+ *    (frame_ring_stats.dropped) and the host sees the gap in seq
+ *  - DECIMATE: released unsent, counted in ccd_flow_stats.skipped
+ *  - COADD: summed, and the mean goes out when credit comes back, with
+ *    CCD_FRAME_F_COADD and info.coadd the number of frames in it
+ * Either way the frames that do go out are whole and in order.
+ *
+ * The credit check sits at the head of the send path, ahead of the
+ * processing stages, and one credit is spent per frame queued for USB (a
+ * frame a stage absorbs costs none). Exposure brackets are always held
+ * rather than merged; their output and bursts do not spend credit.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_FLOW_H
+#define __CCD_FLOW_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+// CCD_CMD_FLOW policies
+#define CCD_FLOW_OFF 0      // No credit needed (default)
+#define CCD_FLOW_HOLD 1     // Keep frames in the ring
+#define CCD_FLOW_DECIMATE 2 // Drop frames
+#define CCD_FLOW_COADD 3    // Average frames
+
+typedef struct {
+  uint32_t skipped; // Frames released unsent (DECIMATE)
+  uint32_t merged;  // Frames summed into a later output (COADD)
+} CCD_Flow_Stats_t;
+
+extern CCD_Flow_Stats_t ccd_flow_stats;
+
+// Command side (main loop, CCD_Cmd_Poll). A new policy restarts the count
+// with no credit; the host follows it with a grant.
+uint8_t CCD_Flow_SetPolicy(uint8_t policy);
+void CCD_Flow_Grant(uint32_t limit);
+
+// Send path (main loop)
+uint32_t CCD_Flow_Credits(void);   // Frames that may be queued now
+uint8_t CCD_Flow_Starve(void);     // Out of credit: 1 if a frame was taken
+CCD_Frame_t *CCD_Flow_Take(void);  // A COADD mean waiting to go out
+void CCD_Flow_Spend(uint32_t n);   // n frames queued for USB
+void CCD_Flow_Reset(void);         // Acquisition restarted
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_FLOW_H */
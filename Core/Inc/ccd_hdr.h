@@ -0,0 +1,71 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_hdr.h
+ * @brief          : Extended dynamic range from exposure brackets
+ ******************************************************************************
+ * While the acquisition driver brackets the exposure ("Q", ccd_acq.h),
+ * Send_CCD_Frames() hands every raw frame to CCD_HDR_Frame() instead of the
+ * processing stages. The frames of one bracket (entries 0 .. k-1 in order)
+ * are merged into a float frame sent once per bracket, at 1/k of the frame
+ * rate:
+ *  - each pixel's signal is the frame's shielded-pixel mean minus the
+ *    pixel (light lowers the value), 0 at most
+ *  - samples at or below the saturation level ("QS<level>", raw counts)
+ *    are left out, and the rest are combined as sum(signal) / sum(t),
+ *    which weights each exposure by its integration time
+ *  - a pixel saturated in every frame takes its shortest-exposure signal
+ *  - the result is scaled to counts at the longest exposure, so unsaturated
+ *    pixels keep their usual scale and bright ones read above 65535
+ * A bracket broken by a dropped frame is discarded. Merged frames go out as
+ * a CCD_HDRHeader_t and CCD_BUFFER_SIZE little-endian floats; if both output
+ * buffers are still queued for USB the bracket is counted as dropped.
+ *
+ * The sums and the output buffers live in the shared scratch (ccd_mem.h),
+ * claimed at the first bracket's first entry and released by
+ * CCD_HDR_Poll() once bracketing has stopped and the last merged frame has
+ * gone out. A bracket that finds the scratch held counts as dropped.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_HDR_H
+#define __CCD_HDR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ccd_acq.h"
+#include "main.h"
+
+#define CCD_HDR_MAGIC 0xABD3
+#define CCD_HDR_SAT_LEVEL 2048U // Default saturation level, raw counts
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;     // CCD_HDR_MAGIC
+  uint16_t frame_num; // Last frame of the bracket
+  uint8_t count;      // Exposures merged
+  uint8_t reserved;
+  uint16_t dropped;   // Brackets lost so far (broken or no output buffer)
+  uint32_t t_us[CCD_ACQ_BRACKET_MAX]; // Integration times, 0 = unused
+} CCD_HDRHeader_t;
+#pragma pack(pop)
+
+// Command side (USB RX interrupt)
+void CCD_HDR_SetSaturation(uint16_t level);
+
+// 1 while bracketed frames are merged (send frames singly)
+uint8_t CCD_HDR_Active(void);
+
+// Every raw frame while active. The slot is always consumed: merged output
+// is queued from the stage's own buffers, and the slot is released here.
+void CCD_HDR_Frame(CCD_Frame_t *frame);
+
+// Main loop: gives the scratch back once the brackets stopped and sent
+void CCD_HDR_Poll(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_HDR_H */
@@ -0,0 +1,69 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_irq.h
+ * @brief          : Interrupt priority scheme
+ ******************************************************************************
+ * Preemption levels (NVIC group 4 from HAL_Init(), no subpriorities), from
+ * the highest:
+ *  - CCD_IRQ_PRIO_TIMING: TIM2 (ICG re-arm) and TIM5 (SH preload). The
+ *    re-arm must land between the ICG edge and the first sample trigger
+ *    (ccd_lat.h), the SH write before the ICG. Both are a few register
+ *    writes; at one level neither preempts the other, and when both are
+ *    pending TIM2, the lower IRQ number, goes first.
+ *  - CCD_IRQ_PRIO_DMA: DMA1_Stream0 frame complete. It only takes the
+ *    finished slot off the stream and hands it on; on the restart path the
+ *    ICG interrupt takes it itself when it gets there first. TIM7, the
+ *    timestamp wraps (ccd_time.h), a counter increment.
+ *  - CCD_IRQ_PRIO_TRIG: EXTI0 trigger input (bursts, sequences, snaps),
+ *    the TIM8 line-scan encoder (CCD_ENCODER, ccd_line.h) or mains
+ *    crossings (CCD_LINE_SYNC, ccd_mains.h) and the EXTI8 digital input
+ *    edges (CCD_DIN, ccd_din.h).
+ *  - CCD_IRQ_PRIO_USB: OTG_FS and OTG_HS, with the CDC command parser. One
+ *    level, which ccd_lat.h and usb_tx.c rely on.
+ *  - CCD_IRQ_PRIO_PERIPH: SDMMC1 and QUADSPI when enabled (CUBEMX_NOTES.md).
+ *  - CCD_IRQ_PRIO_TICK: TIM6, the HAL time base (TICK_INT_PRIORITY).
+ *  - CCD_IRQ_PRIO_DEFER: PendSV, the frame work the capture interrupts pend
+ *    (CCD_Acq_DeferredIRQ(): multi-sample and CDS reduction, the source's
+ *    done hook, the header and the publish). It runs once every interrupt
+ *    is done and before the main loop resumes.
+ *
+ * So however busy USB is, the re-arm waits at most for a TIM5 handler and
+ * the longest stretch with interrupts masked (ring, probe, time and
+ * handoff updates, tens of cycles each); ccd_lat.h measures what it
+ * actually got, worst case included. The deferred work has until the next
+ * frame completes; a frame it had not finished by then is finished by the
+ * handoff and counted (ccd_acq_stats.late).
+ *
+ * The CubeMX inits and main() set these levels, and CCD_Irq_Check() reads
+ * every one back at the end of boot and with each CCD_CMD_STATS: a level
+ * something left different is set again and counted
+ * (CCD_CmdStats_t.irq_fixes, next to the late frames).
+ ******************************************************************************
+ */
+
+#ifndef __CCD_IRQ_H
+#define __CCD_IRQ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_IRQ_PRIO_TIMING 0U
+#define CCD_IRQ_PRIO_DMA 1U
+#define CCD_IRQ_PRIO_TRIG 2U
+#define CCD_IRQ_PRIO_USB 3U
+#define CCD_IRQ_PRIO_PERIPH 7U
+#define CCD_IRQ_PRIO_TICK 15U
+#define CCD_IRQ_PRIO_DEFER 15U // The lowest there is
+
+// Main loop (boot, last, and CCD_CMD_STATS): sets any level found changed;
+// returns how many were since boot
+uint32_t CCD_Irq_Check(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_IRQ_H */
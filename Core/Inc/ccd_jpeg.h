@@ -0,0 +1,114 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_jpeg.h
+ * @brief          : Hardware JPEG previews of the encoder line scan
+ ******************************************************************************
+ * With CCD_JPEG, and a quality set (CCD_TELEM_JPEG, 1 to 100, 0 = off),
+ * the lines of the encoder line scan (ccd_line.h) are previewed rather
+ * than shipped whole: each line's light (65535 - raw) is taken to 8 bits
+ * and written straight into a strip of CCD_JPEG_LINES lines in the order
+ * the codec reads it, 8x8 blocks left to right (the width padded to whole
+ * blocks with the last pixel). A full strip goes through the H743's JPEG
+ * codec, grayscale baseline with the tables of the JPEG standard (annex
+ * K) and the quantization scaled as the IJG library does; one MDMA
+ * channel feeds the input FIFO and another drains the output FIFO
+ * (CCD_JPEG_MDMA_IN and _OUT), so the CPU only polls for the end. The
+ * codec writes its own headers: each strip is a complete JPEG image of
+ * CCD_BUFFER_SIZE x lines pixels, typically a few percent of the raw
+ * tile at quality 50.
+ *
+ * While recording (CCD_SD) the raw lines go to the card as any frames,
+ * and the recorder hands each line it wrote to the preview; otherwise the
+ * preview takes the place of the raw tiles on USB. A partial strip is
+ * closed CCD_JPEG_FLUSH_MS after its last line and at every mode change,
+ * its missing rows copies of its last, cut off again by the image height.
+ * On the wire a strip is a CCD_JpegHeader_t, CRC stamped, and then the
+ * JPEG image. Lines with both strips full, strips with both output
+ * buffers queued or the port closed, are skipped and counted; a strip the
+ * codec has not finished in CCD_JPEG_TIMEOUT_MS (its image larger than
+ * CCD_JPEG_OUT_SIZE, at a high quality) is abandoned and counted too.
+ * The HAL JPEG driver is not part of this tree: the codec and its tables
+ * are set up by register.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_JPEG_H
+#define __CCD_JPEG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_JPEG_MAGIC 0xABDC
+#ifndef CCD_JPEG_LINES
+#define CCD_JPEG_LINES 8U // Lines per strip, 8 or 16
+#endif
+#define CCD_JPEG_WIDTH ((CCD_BUFFER_SIZE + 7U) / 8U * 8U) // Whole blocks
+#define CCD_JPEG_OUT_SIZE (CCD_JPEG_LINES * CCD_JPEG_WIDTH / 2U) // 4 bpp
+#define CCD_JPEG_FLUSH_MS 100U  // A partial strip waits this long at most
+#define CCD_JPEG_TIMEOUT_MS 10U // An encode takes well under 1 ms
+#define CCD_JPEG_QUALITY 50U    // Tables loaded at boot
+#define CCD_JPEG_MDMA_IN MDMA_Channel14
+#define CCD_JPEG_MDMA_OUT MDMA_Channel15
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;         // CCD_JPEG_MAGIC
+  uint16_t frame_num;     // Of the last line
+  CCD_FrameInfo_t info;   // Of the last line; payload_len = the image
+  uint8_t lines;          // Image height
+  uint8_t quality;        // Of its quantization tables
+  uint16_t width;         // Image width, CCD_BUFFER_SIZE
+  uint32_t strip;         // Strips closed so far, this one included
+  uint32_t first_seq;     // Seq of its first line
+  int32_t first_position; // Encoder counts, CCD_LINE_POS_NONE if unmatched
+  int32_t last_position;
+  uint32_t skipped; // Lines lost so far
+  uint32_t failed;  // Strips abandoned so far
+} CCD_JpegHeader_t;
+
+// CCD_TELEM_JPEG reply
+typedef struct {
+  uint8_t quality;    // 0 = off
+  uint8_t lines;      // CCD_JPEG_LINES
+  uint16_t width;     // CCD_BUFFER_SIZE
+  uint32_t strips;    // Queued on USB
+  uint32_t bytes_in;  // 8-bit pixels of those strips
+  uint32_t bytes_out; // Their JPEG images
+  uint32_t lines_in;  // Lines offered
+  uint32_t skipped;
+  uint32_t failed;
+} CCD_JpegStatus_t;
+#pragma pack(pop)
+
+// Boot, in USER CODE 2: the codec with its Huffman and quantization
+// tables, and its two MDMA channels
+void CCD_Jpeg_Init(void);
+
+// Command side (main loop): 1-100, 0 = off. A new quality is loaded
+// before the next strip.
+uint8_t CCD_Jpeg_SetQuality(uint8_t quality);
+
+void CCD_Jpeg_Status(CCD_JpegStatus_t *out);
+
+// 1 while lines are previewed
+uint8_t CCD_Jpeg_Enabled(void);
+
+// A line of the scan and its encoder position, while enabled. Copied into
+// the open strip; the caller keeps the slot.
+void CCD_Jpeg_Line(const CCD_Frame_t *frame, int32_t position);
+
+// Mode change: closes the open strip
+void CCD_Jpeg_Flush(void);
+
+// Send path, each pass: collects a finished image and queues it, starts
+// the next full strip, closes the open one once it has waited
+void CCD_Jpeg_Poll(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_JPEG_H */
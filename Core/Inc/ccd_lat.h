@@ -0,0 +1,92 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_lat.h
+ * @brief          : Frame latency and re-arm jitter telemetry
+ ******************************************************************************
+ * Every frame sent over USB is timed at four points, in CCD_Time_Now() ticks:
+ *  - the ICG edge, info.timestamp of its header
+ *  - DMA complete, that plus the readout (CCD_Acq_Publish() works back the
+ *    other way, so this is the interrupt's own time)
+ *  - ready: processing stages and CRC done, as Send_CCD_Frames() submits it
+ *  - sent: the TX completion interrupt of its transfer
+ * and the ICG interrupt of the restart path times the re-arm: TIM2 ticks
+ * from the ICG edge to the stream being enabled again. The re-arm must
+ * land before the first pixel's sample trigger, or the frame is lost to a
+ * resync; it varies with what the interrupt had to wait for, so the spread
+ * of this window is the sync jitter. A re-arm later than
+ * CCD_LAT_ARM_MARGIN_PCT of the time to the first sample counts an alarm:
+ * the configuration (sample phase, interrupt load) is close to losing
+ * frames even while none are.
+ *
+ * The latest CCD_LAT_WINDOW values of each are kept; CCD_CMD_TELEMETRY
+ * reads the median, 99th percentile and maximum of each window, and the
+ * longest re-arm since the reset however many windows ago: the worst case
+ * the priority scheme (ccd_irq.h) has to bound. Frames
+ * sent over Ethernet or from the burst store, and the double-buffer path's
+ * re-arms (done by hardware), are not measured.
+ *
+ * Each window has one writer (the TIM2 interrupt, or the USB ones, which
+ * share a priority), so recording takes no locking; the main loop reads
+ * them unlocked and a reset is picked up by each writer at its next value,
+ * so the ICG interrupt is never held off.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_LAT_H
+#define __CCD_LAT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_LAT_WINDOW 64 // Values per window, a power of two
+#ifndef CCD_LAT_ARM_MARGIN_PCT
+#define CCD_LAT_ARM_MARGIN_PCT 75U
+#endif
+
+// CCD_LatReport_t.stat order
+#define CCD_LAT_ARM 0   // ICG edge to the stream re-armed
+#define CCD_LAT_READY 1 // DMA complete to processed
+#define CCD_LAT_SENT 2  // Processed to the TX completion
+#define CCD_LAT_TOTAL 3 // ICG edge to the TX completion
+#define CCD_LAT_COUNT 4
+
+#pragma pack(push, 1)
+typedef struct {
+  uint32_t p50; // Cycles, 0 for an empty window
+  uint32_t p99;
+  uint32_t max;
+} CCD_LatStat_t;
+
+// CCD_CMD_TELEMETRY, CCD_TELEM_LATENCY
+typedef struct {
+  uint16_t frames;    // Values in the frame windows
+  uint16_t arms;      // Values in the re-arm window
+  uint32_t alarms;    // Late re-arms since the last reset
+  uint32_t arm_limit; // Cycles from the ICG edge to the first sample trigger
+  CCD_LatStat_t stat[CCD_LAT_COUNT];
+  uint32_t arm_worst; // Longest re-arm since the last reset, cycles
+} CCD_LatReport_t;
+#pragma pack(pop)
+
+// ICG interrupt, after the re-arm: TIM2 ticks since the ICG edge
+void CCD_Lat_Arm(uint32_t ticks);
+// Main loop (CCD_Acq_ApplySampling()): ticks to the first sample trigger
+void CCD_Lat_SetArmLimit(uint32_t ticks);
+
+// Main loop: frame is final and about to be submitted; icg is the
+// timestamp it came with, read before the processing stages
+void CCD_Lat_Ready(const CCD_Frame_t *frame, uint64_t icg);
+// TX completion: n frames from first are sent
+void CCD_Lat_Sent(const CCD_Frame_t *first, uint32_t n);
+
+// Main loop; reset starts every window over after the read
+void CCD_Lat_Read(CCD_LatReport_t *out, uint8_t reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_LAT_H */
@@ -0,0 +1,122 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_line.h
+ * @brief          : Encoder-synchronised line scan, shipped in 2D tiles
+ ******************************************************************************
+ * With CCD_ENCODER a quadrature encoder on TIM8 (CH1/CH2, x4 encoder mode)
+ * can take the place of the mode 3 edge on CCD_EXT_TRIG: "ME<counts>" sets
+ * the counts per line, TIM8's ARR, and TIM8 signals each line boundary it
+ * crosses, up or down, as an update on TRGO. In mode 3 TIM2 takes that on
+ * ITR1 instead of ETRF (CCD_ACQ_TRIG_ENCODER), so each pitch of travel of
+ * the conveyor or stage starts one frame in hardware, at any speed and in
+ * either direction. "ME0" goes back to the PA15 edge; the pitch is not
+ * kept in flash.
+ *
+ * The same update interrupts (CCD_IRQ_PRIO_TRIG) to keep the position in
+ * counts, signed, from boot or the last pitch change. A boundary that
+ * started a frame finds TIM2 counting from just 0 and is queued with its
+ * position and time; one crossed during a readout (the encoder faster than
+ * the line rate) was ignored by TIM2 and is counted as missed.
+ *
+ * Send_CCD_Frames() hands every frame to CCD_Line_Frame() while the
+ * encoder drives mode 3. Its raw pixels, as captured (no processing
+ * stage), are copied into the open tile with a CCD_LineEntry_t: seq,
+ * timestamp and the position of the boundary whose time matches the frame
+ * start, and the slot goes back at once. A tile is queued on USB, CRC
+ * stamped, once it holds CCD_LINE_TILE_LINES lines, or CCD_LINE_FLUSH_MS
+ * after its last line when the motion stops, and at every mode change.
+ * On the wire it is a CCD_LineTileHeader_t, capacity entries (the unused
+ * ones zero) and then lines rows of CCD_BUFFER_SIZE pixels. A line with
+ * both tile buffers still queued, the port closed, or the scratch the
+ * tiles are in (ccd_mem.h) held by an HDR or photon transfer run, is
+ * dropped and counted. Tiles take no flow-control credit, as merged
+ * brackets. With CCD_JPEG previews on, the lines go to ccd_jpeg.h instead
+ * of tiles.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_LINE_H
+#define __CCD_LINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_LINE_MAGIC 0xABDB
+#ifndef CCD_LINE_TILE_LINES
+#define CCD_LINE_TILE_LINES 4U // Lines per tile, at most 8
+#endif
+#define CCD_LINE_TILE_BUFS 2U
+#define CCD_LINE_FLUSH_MS 100U // A partial tile waits this long at most
+#define CCD_LINE_ACCEPT_US 20U // Boundary to its TIM2 start, in interrupt
+#define CCD_LINE_MATCH_US 500U // Boundary time to its frame's ICG
+#define CCD_LINE_POS_NONE ((int32_t)0x80000000) // No boundary matched
+
+#pragma pack(push, 1)
+typedef struct {
+  uint32_t seq;       // As in the frame's info
+  int32_t position;   // Encoder counts, CCD_LINE_POS_NONE if unmatched
+  uint64_t timestamp; // The frame's ICG, CCD_Time_Now()
+} CCD_LineEntry_t;
+
+typedef struct {
+  uint16_t magic;       // CCD_LINE_MAGIC
+  uint16_t frame_num;   // Of the last line
+  CCD_FrameInfo_t info; // Of the last line; payload_len = capacity
+                        // entries + lines rows
+  uint8_t lines;        // Rows in this tile
+  uint8_t capacity;     // Entries, CCD_LINE_TILE_LINES
+  uint16_t pitch;       // Encoder counts per line
+  uint32_t missed;      // Boundaries crossed during a readout, so far
+  uint32_t dropped;     // Lines lost with no tile buffer, so far
+} CCD_LineTileHeader_t;
+
+// CCD_TELEM_LINE reply
+typedef struct {
+  uint16_t pitch;   // Encoder counts per line, 0 = PA15 edge
+  uint8_t active;   // Mode 3 lines come from the encoder
+  uint8_t lines;    // CCD_LINE_TILE_LINES
+  int32_t position; // Encoder counts now
+  uint32_t tiles;   // Tiles queued on USB
+  uint32_t missed;
+  uint32_t dropped;
+} CCD_LineStatus_t;
+#pragma pack(pop)
+
+// Boot, in USER CODE 2: TIM8 in encoder mode on its pins, counting
+void CCD_Line_Init(void);
+
+// Command side (USB RX interrupt): counts per line, 0 = off. Takes
+// effect at the next mode change.
+void CCD_Line_SetPitch(uint16_t pitch);
+
+// Mode change, capture stopped: loads a new pitch, sends the open tile.
+// Returns 1 if triggered (mode 3) lines now come from the encoder.
+uint8_t CCD_Line_Apply(uint8_t triggered);
+
+void CCD_Line_Status(CCD_LineStatus_t *out);
+
+// 1 while frames are assembled into tiles
+uint8_t CCD_Line_Active(void);
+
+// Every frame while active. The slot is always consumed: tiles are queued
+// from the stage's own buffers, and the slot is released here.
+void CCD_Line_Frame(CCD_Frame_t *frame);
+
+// Recorder (CCD_SD), each line it wrote while active: matched to its
+// boundary like a sent line, and previewed with CCD_JPEG (ccd_jpeg.h)
+void CCD_Line_Recorded(const CCD_Frame_t *frame);
+
+// Send path, each pass: the open tile once it has waited CCD_LINE_FLUSH_MS
+void CCD_Line_Poll(void);
+
+// TIM8 update interrupt
+void CCD_Line_EncoderIRQ(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_LINE_H */
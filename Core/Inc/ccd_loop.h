@@ -0,0 +1,96 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_loop.h
+ * @brief          : USB link tests: echo, sink and source
+ ******************************************************************************
+ * CCD_TELEM_LOOP measures one USB port at a time with no frames in the
+ * way, so a host can tell the link from the pipeline behind it:
+ *  - ECHO: every packet the port receives that starts with a
+ *    CCD_LoopHeader_t is sent straight back, count packets in all; the
+ *    host times the round trip. Other packets still reach the command
+ *    parser, so the test can be stopped or read while it runs. The RX
+ *    interrupt copies the packet and the main loop queues it, one at a
+ *    time: a packet that finds the copy still queued is dropped, and the
+ *    time each waited for the main loop is kept apart (hold_*_us).
+ *  - SINK: the next count bytes the port receives are counted and thrown
+ *    away, whatever they hold, in the RX interrupt.
+ *  - SOURCE: count bytes (rounded up to a whole header) go out at the
+ *    rate the link takes them, as messages of up to CCD_LOOP_CHUNK bytes,
+ *    each a header and zeros. The messages are built in the shared scratch
+ *    (ccd_mem.h); the test is refused while another mode holds it.
+ * Port CCD_LOOP_FS is the command port, CDC or the vendor class
+ * (CCD_USB_VENDOR: the source on its frame endpoint, the echo on its
+ * command one); CCD_LOOP_HS is the HS CDC port, which must be open.
+ *
+ * While a test runs, Send_CCD_Frames() holds the frames in the ring, where
+ * they are dropped and counted once it is full. A test ends at its count,
+ * with CCD_LOOP_STOP, or after CCD_LOOP_TIMEOUT_MS with nothing moving.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_LOOP_H
+#define __CCD_LOOP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_LOOP_MAGIC 0xABE2  // Echoed and source messages
+#define CCD_LOOP_ECHO_MAX 512U // Echoed packet bytes kept: one HS packet
+#define CCD_LOOP_CHUNK 4096U   // Bytes per source message at most
+#define CCD_LOOP_BUFS 4U       // Source messages queued at once
+#define CCD_LOOP_TIMEOUT_MS 2000U
+
+// CCD_TELEM_LOOP operations, then u8 CCD_LOOP_FS/HS and u32 count
+#define CCD_LOOP_ECHO 0    // count packets
+#define CCD_LOOP_SINK 1    // count bytes
+#define CCD_LOOP_SOURCE 2  // count bytes
+#define CCD_LOOP_STOP 3    // Alone
+#define CCD_LOOP_NONE 0xFF // CCD_LoopStatus_t.test: none since boot
+
+#define CCD_LOOP_FS 0
+#define CCD_LOOP_HS 1
+
+#pragma pack(push, 1)
+// Starts every echoed and source message
+typedef struct {
+  uint16_t magic; // CCD_LOOP_MAGIC
+  uint16_t len;   // Of the whole message, this header included
+  uint32_t seq;   // The host's (echo), or from 0 per test (source)
+} CCD_LoopHeader_t;
+
+// CCD_TELEM_LOOP reply
+typedef struct {
+  uint8_t test;         // CCD_LOOP_* of the last test, or CCD_LOOP_NONE
+  uint8_t port;         // CCD_LOOP_FS/HS
+  uint8_t running;
+  uint32_t count;       // Asked for
+  uint32_t done;        // Packets echoed, bytes taken or sent
+  uint32_t packets;     // USB packets taken (echo, sink), messages sent
+  uint32_t elapsed_us;  // First byte in or out to the last
+  uint32_t dropped;     // Echo packets that found the copy queued
+  uint32_t hold_max_us; // Echo: RX interrupt to the queue, longest
+  uint32_t hold_sum_us; // and in all
+  uint32_t tests;       // Started since boot
+} CCD_LoopStatus_t;
+#pragma pack(pop)
+
+// CCD_TELEM_LOOP (main loop), 0 = refused: a test or its buffers still
+// out, a port not open, or count 0
+uint8_t CCD_Loop_Start(uint8_t test, uint8_t port, uint32_t count);
+void CCD_Loop_Stop(void);
+void CCD_Loop_Status(CCD_LoopStatus_t *out);
+
+// RX interrupt of the port, first: the bytes of buf the test took
+uint32_t CCD_Loop_Receive(uint8_t port, const uint8_t *buf, uint32_t len);
+
+// Send_CCD_Frames(): queues the echo and the source, 1 = frames held
+uint8_t CCD_Loop_Poll(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_LOOP_H */
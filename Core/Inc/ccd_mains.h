@@ -0,0 +1,93 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_mains.h
+ * @brief          : Frames locked to the mains zero crossing
+ ******************************************************************************
+ * Lamps on AC flicker at twice the line frequency; a frame whose exposure
+ * starts anywhere in that cycle sees a different share of it, and the
+ * spectra wobble by far more than their noise. With CCD_LINE_SYNC a zero
+ * crossing detector (one rising edge per mains period, opto-isolated) on
+ * CCD_MAINS_Pin (TIM8_CH1) locks the frames to the line instead: "Y3".
+ *
+ * TIM8 counts microseconds and captures every crossing on CH1. Its
+ * capture interrupt (CCD_IRQ_PRIO_TRIG) checks each period against
+ * CCD_MAINS_MIN_US..CCD_MAINS_MAX_US: an edge too early is a glitch and
+ * ignored, one too late (a dropout) starts the count again. The period is
+ * averaged, and after CCD_MAINS_LOCK good periods in a row the line is
+ * locked. From then on every used-th crossing arms CH2 to go active the
+ * phase offset later; CH2's reference is TIM8's TRGO, which TIM2 takes on
+ * ITR1 as a sync slave takes its master's ICG (CCD_ACQ_TRIG_LINE). The
+ * ICG period so starts at the same mains phase, in hardware, every time:
+ * the interrupt only decides which crossing, ahead of time.
+ *
+ * used is the smallest number of mains periods, periods at least, that
+ * covers the ICG period of the profile; TIM2 runs that long plus a
+ * quarter period (CCD_Mains_IcgTicks()), so each trigger finds it still
+ * counting. In mode 2 the exposure is the whole frame, a whole number of
+ * mains periods, and every frame integrates the same light; in mode 0 the
+ * SH periods keep a fixed mains phase. Without a lock TIM2 carries on at
+ * that period, or one pixel past the ICG period before the first, and the
+ * first lock after a mode change reconfigures the chain (a restart).
+ *
+ * Phase is in 0.1 degree from the rising edge, at least CCD_MAINS_LEAD_US
+ * after it; an arm the interrupt got to too late still fires, at once,
+ * and is counted. The setting is not kept in flash, "Y3" is.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_MAINS_H
+#define __CCD_MAINS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_MAINS_MIN_US 14286U  // Shortest period taken: 70 Hz
+#define CCD_MAINS_MAX_US 25000U  // Longest: 40 Hz
+#define CCD_MAINS_LOCK 4U        // Good periods in a row to lock
+#define CCD_MAINS_LEAD_US 20U    // Trigger after the crossing, at least
+#define CCD_MAINS_STALE_MS 100U  // No crossing for this long: unlocked
+#define CCD_MAINS_PHASE_MAX 3599 // 0.1 degree
+
+// CCD_TELEM_MAINS operation, then u16 phase and u8 periods
+#define CCD_MAINS_SET 0
+
+#pragma pack(push, 1)
+// CCD_TELEM_MAINS reply
+typedef struct {
+  uint8_t active;      // CCD_ACQ_TRIG_LINE applied
+  uint8_t locked;
+  uint8_t periods;     // Set: mains periods per frame, at least
+  uint8_t used;        // Applied: covering the ICG period
+  uint16_t phase;      // 0.1 degree
+  uint32_t period_us;  // Averaged
+  uint32_t freq_mhz;   // From it, millihertz
+  uint32_t crossings;  // Since boot
+  uint32_t glitches;   // Edges too early, ignored
+  uint32_t triggers;   // Frames started
+  uint32_t dev_max_us; // Locked period off the average, largest
+  uint32_t late;       // Arms past their phase
+} CCD_MainsStatus_t;
+#pragma pack(pop)
+
+// Boot: CCD_MAINS_Pin and TIM8, capturing
+void CCD_Mains_Init(void);
+
+uint8_t CCD_Mains_Set(uint16_t phase, uint8_t periods); // 0 = out of range
+void CCD_Mains_Status(CCD_MainsStatus_t *out);
+
+// CCD_Acq_ConfigTrigger(), chain stopped: TIM2's ARR while locked to the
+// line, and the triggers on or off
+uint32_t CCD_Mains_IcgTicks(void);
+void CCD_Mains_Enable(uint8_t enable);
+
+// TIM8_CC interrupt (stm32h7xx_it.c)
+void CCD_Mains_IRQ(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_MAINS_H */
@@ -0,0 +1,125 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_match.h
+ * @brief          : Reference spectrum library: per-frame classification
+ ******************************************************************************
+ * A library of up to CCD_MATCH_REFS reference spectra, each the effective
+ * pixels binned by CCD_MATCH_BIN into CCD_MATCH_BINS values, classifies
+ * every frame on the device (CCD_TELEM_MATCH). The frame is binned the same
+ * way, its mean removed, and its normalised dot product taken with each
+ * reference (one SMLALD per two bins, read halved from the library itself,
+ * its mean taken off through the frame's sum, with its norm). The best one,
+ * if its score reaches the threshold, is the frame's class; the runner-up's
+ * score gives the margin. Normalised, the score does not follow the light
+ * level, only the shape of the spectrum. The stage runs after resampling,
+ * on the frame as the other stages left it; the decision is ready as the
+ * frame is processed, well within a frame period, with no host in the loop.
+ *
+ * With CCD_MATCH_TRACK frames are sent as they are and the last decision
+ * is read with the status; with CCD_MATCH_ONLY a CCD_MatchFrame_t takes
+ * the place of each frame, a 44-byte record a sorter can act on. The
+ * latency there runs from the start of the frame's readout (its
+ * timestamp) to the decision.
+ *
+ * A reference is averaged over M frames as they reach the stage
+ * (CCD_MATCH_CAPTURE), or uploaded as bin values (CCD_MATCH_WRITE).
+ * CCD_MATCH_SAVE keeps the library in flash (CCD_STORE_MATCH); it is
+ * loaded at boot. The mode and threshold are kept with the settings
+ * (ccd_config.h).
+ ******************************************************************************
+ */
+
+#ifndef __CCD_MATCH_H
+#define __CCD_MATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_MATCH_MAGIC 0xABDF
+#define CCD_MATCH_REFS 24U
+#define CCD_MATCH_BIN 16U   // Effective pixels per bin
+#define CCD_MATCH_BINS                                                         \
+  ((CCD_SENSOR_ACTIVE_COUNT / CCD_MATCH_BIN) & ~1U) // 228 on the TCD1304
+#define CCD_MATCH_CHUNK 16U // Bin values per status
+#define CCD_MATCH_NONE 0xFF // No class: no reference, or under the threshold
+#define CCD_MATCH_REF_MAX 256U     // Frames per captured reference
+#define CCD_MATCH_THRESHOLD 29491U // Q15, 0.9
+#define CCD_MATCH_LATENCY_MAX 0xFFFFU // Where latency_us of a record stops
+
+// Modes
+#define CCD_MATCH_OFF 0
+#define CCD_MATCH_TRACK 1 // Frames go on; the decision in the status
+#define CCD_MATCH_ONLY 2  // A CCD_MatchFrame_t instead of the frame
+
+// CCD_TELEM_MATCH actions (CCD_TELEM_KEEP = only the status)
+#define CCD_MATCH_MODE 0    // u8 mode, u16 threshold (Q15)
+#define CCD_MATCH_CAPTURE 1 // u8 index, u16 frames
+#define CCD_MATCH_WRITE 2   // u8 index, u16 first bin, u16 values
+#define CCD_MATCH_READ 3    // u8 index, u16 first bin
+#define CCD_MATCH_CLEAR 4   // u8 index (CCD_MATCH_NONE = all)
+#define CCD_MATCH_SAVE 5
+#define CCD_MATCH_LOAD 6
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;       // CCD_MATCH_MAGIC
+  uint16_t frame_num;   // As in CCD_Frame_t
+  CCD_FrameInfo_t info; // payload_len = 8
+  uint8_t best;         // Reference index, or CCD_MATCH_NONE
+  uint8_t second;       // Runner-up, or CCD_MATCH_NONE
+  int16_t score;        // Of the best reference, Q15
+  int16_t second_score; // Of the runner-up, Q15
+  uint16_t latency_us;  // Readout start to decision, saturating
+} CCD_MatchFrame_t;
+
+// CCD_TELEM_MATCH reply
+typedef struct {
+  uint8_t mode;
+  uint8_t refs;  // Defined
+  uint8_t best;  // Of the last frame, as in CCD_MatchFrame_t
+  uint8_t second;
+  int16_t score; // Q15
+  int16_t second_score;
+  uint16_t threshold; // Q15
+  uint8_t capture;    // Index being averaged, or CCD_MATCH_NONE
+  uint8_t stored;     // The library matches the one in flash
+  uint32_t defined;   // Bit per reference
+  uint32_t frames;    // Classified since boot
+  uint32_t unmatched; // Of those, under the threshold
+  uint32_t latency_us;     // Of the last frame
+  uint32_t max_latency_us; // Since boot
+  uint8_t index;           // Of the bins below
+  uint8_t reserved;
+  uint16_t offset; // First bin
+  uint16_t bins[CCD_MATCH_CHUNK];
+} CCD_MatchStatus_t;
+#pragma pack(pop)
+
+void CCD_Match_Init(void); // Boot: the library from flash
+
+// Command side (main loop): 0 if out of range
+uint8_t CCD_Match_SetMode(uint8_t mode, uint16_t threshold);
+void CCD_Match_GetMode(uint8_t *mode, uint16_t *threshold);
+uint8_t CCD_Match_Capture(uint8_t index, uint16_t frames);
+uint8_t CCD_Match_Write(uint8_t index, uint16_t first, const uint8_t *v,
+                        uint32_t n); // n values, little-endian u16
+uint8_t CCD_Match_Clear(uint8_t index);
+uint8_t CCD_Match_Save(void);
+uint8_t CCD_Match_Load(void);
+void CCD_Match_Status(uint8_t index, uint16_t offset, CCD_MatchStatus_t *out);
+
+// 1 while frames must reach the stage (a mode set, or a capture)
+uint8_t CCD_Match_Active(void);
+
+// Processing stage: classifies the frame; returns the length of the
+// record written over the slot in CCD_MATCH_ONLY, else 0
+uint32_t CCD_Match_Frame(CCD_Frame_t *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_MATCH_H */
@@ -0,0 +1,119 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_mem.h
+ * @brief          : Memory budget: stack high-water, heap, static use, ring
+ ******************************************************************************
+ * The budget of the build and of the run so far, read through
+ * CCD_TELEM_MEMORY, to size buffers against what is really left:
+ *  - Stack: CCD_Mem_Init(), first thing in main(), paints the free RAM
+ *    between the end of the static data and the stack pointer with
+ *    CCD_MEM_PAINT. The high-water mark is the lowest word above the heap
+ *    no longer painted; the scan runs on each read, in the main loop.
+ *  - Heap: the newlib heap's end (_sbrk, sysmem.c), and the room it may
+ *    grow into, up to the _Min_Stack_Size reserve below _estack.
+ *  - Static allocation per output section group, from the linker symbols:
+ *    ITCM code, DTCM (data, bss, noinit), .data + .bss (RAM_D1) and the
+ *    RAM_D2 sections, and the image in flash. The region sizes are fixed
+ *    by the linker script.
+ *  - Frame ring: occupancy as each frame was published, in FRAME_RING_HIST
+ *    bins, and the peak (frame_ring.h). A full ring shows in the last bin
+ *    long before frames are dropped.
+ *
+ * The stack shares its RAM with nothing else above the heap, and every
+ * interrupt runs on it (MSP), so the mark covers the deepest nesting seen.
+ * A frame that never writes the lowest words it reserves (a large local
+ * array left unused) is missed; the mark is a lower bound.
+ *
+ * The scratch is one AXI SRAM buffer lent in turn to the modes that never
+ * run together: the processing stages' history (CCD_MEM_PROC), the HDR
+ * merge, the photon transfer run and the line scan tiles, whose frames
+ * bypass CCD_Proc_Frame(), and the USB source test, which holds the frames
+ * back. A mode claims it as
+ * it starts and releases it once done and its output has gone out. A holder
+ * that passed a yield callback gives it up to the next claim if the
+ * callback agrees (dropping what it kept there, to start over when it
+ * claims it back); one that passed NULL keeps it until it releases it, and
+ * the claim is refused. Each user checks its layout against
+ * CCD_MEM_SCRATCH_SIZE. Main loop only.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_MEM_H
+#define __CCD_MEM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ccd_line.h"
+#include "frame_ring.h"
+#include "main.h"
+
+#define CCD_MEM_PAINT 0xC5C5C5C5UL
+#define CCD_MEM_MARGIN 64U // Bytes below the stack pointer left unpainted
+
+// Sixteen bytes a pixel, the HDR merge's (a 32-bit sum, two 16-bit lines
+// and two float outputs), and room for the headers; that holds two line
+// scan tiles of up to 4 lines, and longer ones set the size
+#if CCD_ENCODER && CCD_LINE_TILE_LINES > 4U
+#define CCD_MEM_SCRATCH_SIZE                                                   \
+  (CCD_LINE_TILE_BUFS *                                                        \
+   (sizeof(CCD_LineTileHeader_t) +                                             \
+    CCD_LINE_TILE_LINES * (sizeof(CCD_LineEntry_t) + 2U * CCD_BUFFER_SIZE)))
+#else
+#define CCD_MEM_SCRATCH_SIZE (16U * CCD_BUFFER_SIZE + 256U)
+#endif
+
+// Holders of the scratch
+typedef enum {
+  CCD_MEM_NONE = 0,
+  CCD_MEM_PROC, // Processing stages (ccd_proc.c), yield
+  CCD_MEM_HDR,  // Bracket merge (ccd_hdr.c)
+  CCD_MEM_PTC,  // Photon transfer run (ccd_ptc.c)
+  CCD_MEM_LOOP, // USB source test (ccd_loop.c)
+  CCD_MEM_LINE, // Line scan tiles (ccd_line.c)
+} CCD_MemOwner_t;
+
+// 1: what the holder kept in the scratch is dropped, it may go
+typedef uint8_t (*CCD_MemYield_t)(void);
+
+// CCD_TELEM_MEMORY argument (CCD_TELEM_KEEP = read)
+#define CCD_MEM_CLEAR 1 // Restart the ring occupancy bins and peak
+
+#pragma pack(push, 1)
+// CCD_TELEM_MEMORY reply
+typedef struct {
+  uint32_t stack_size; // _estack down to the heap's end at boot
+  uint32_t stack_peak; // High-water mark, bytes below _estack
+  uint32_t heap_used;  // _sbrk end above _end
+  uint32_t heap_free;  // Left before the stack reserve
+  uint32_t image;      // Loaded from flash: code, constants, initial data
+  uint32_t itcm;       // Static bytes: CCD_ITCM code
+  uint32_t dtcm;       // .dtcm_data, .dtcm_bss, .dtcm_noinit
+  uint32_t ram_d1;     // .data and .bss
+  uint32_t ram_d2;     // .sram3 and .ram_d2
+  uint8_t ring_slots;  // FRAME_RING_SLOTS
+  uint8_t ring_now;    // Published, not yet handed out
+  uint8_t ring_peak;   // Since boot or CCD_MEM_CLEAR
+  uint8_t reserved;
+  uint32_t ring_hist[FRAME_RING_HIST]; // Publishes per occupancy bin
+} CCD_MemStatus_t;
+#pragma pack(pop)
+
+// Boot, before anything else runs: paints the free stack
+void CCD_Mem_Init(void);
+
+// Main loop: the budget (scans the stack); clear as CCD_MEM_CLEAR
+void CCD_Mem_Status(CCD_MemStatus_t *out, uint8_t clear);
+
+// The scratch for owner, taken from its holder if that one yields; NULL if
+// it does not. A holder claiming again gets it at once (and may change its
+// callback). Release gives it back only if owner holds it.
+void *CCD_Mem_Claim(CCD_MemOwner_t owner, CCD_MemYield_t yield);
+void CCD_Mem_Release(CCD_MemOwner_t owner);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_MEM_H */
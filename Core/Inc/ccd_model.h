@@ -0,0 +1,124 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_model.h
+ * @brief          : Linear models (PLS, PCA) applied to every frame
+ ******************************************************************************
+ * Process control wants a concentration per frame, not the spectrum. With
+ * CCD_MODEL up to CCD_MODEL_OUTPUTS linear models, PLS regressions or PCA
+ * scores as the host compiles them, are applied on the device to every
+ * frame (CCD_TELEM_MODEL). The effective pixels are binned CCD_MODEL_BIN
+ * at a time, as ccd_match.h bins them; each output is
+ *
+ *   value = scale * (w . p(bins)) + offset
+ *
+ * with int16 loadings w, one per bin, and p the preprocessing the model
+ * was built with: none, the mean of the bins divided out (AREA), or the
+ * standard normal variate (SNV, the mean taken off and the standard
+ * deviation divided out, both over the bins). Any centring, scaling or
+ * derivative filter of the variables is linear and folded into w, scale
+ * and offset by the host. The dot products run two bins per SMLALD,
+ * against the bins less 32768 so they fit int16; the mean and deviation
+ * are worked out once for all the outputs.
+ *
+ * The stage runs where CCD_MATCH's does, after it. With CCD_MODEL_TRACK
+ * frames are sent as they are and the last values are read with the
+ * status; with CCD_MODEL_ONLY a CCD_ModelFrame_t takes the place of each
+ * frame, the values with the frame's seq and timestamps in 56 bytes.
+ * CCD_MODEL_SAVE keeps the loadings, the mode and the preprocessing in
+ * flash (CCD_STORE_MODEL); they are loaded at boot.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_MODEL_H
+#define __CCD_MODEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_MODEL_MAGIC 0xABE5
+#define CCD_MODEL_OUTPUTS 4U
+#define CCD_MODEL_BIN 4U // Effective pixels per bin
+#define CCD_MODEL_BINS                                                         \
+  ((CCD_SENSOR_ACTIVE_COUNT / CCD_MODEL_BIN) & ~1U) // 912 on the TCD1304
+#define CCD_MODEL_CHUNK 16U // Loadings per status
+#define CCD_MODEL_NONE 0xFF // CCD_MODEL_CLEAR: every output
+#define CCD_MODEL_LATENCY_MAX 0xFFFFU
+
+// Modes
+#define CCD_MODEL_OFF 0
+#define CCD_MODEL_TRACK 1 // Frames go on; the values in the status
+#define CCD_MODEL_ONLY 2  // A CCD_ModelFrame_t instead of the frame
+
+// Preprocessing, over the bins
+#define CCD_MODEL_PREP_NONE 0
+#define CCD_MODEL_PREP_AREA 1 // Divided by their mean
+#define CCD_MODEL_PREP_SNV 2  // Mean off, divided by their deviation
+
+// CCD_TELEM_MODEL actions (CCD_TELEM_KEEP = only the status)
+#define CCD_MODEL_MODE 0  // u8 mode, u8 preprocessing
+#define CCD_MODEL_WRITE 1 // u8 output, u16 first bin, i16 loadings
+#define CCD_MODEL_SCALE 2 // u8 output, f32 scale, f32 offset: defines it
+#define CCD_MODEL_READ 3  // u8 output, u16 first bin
+#define CCD_MODEL_CLEAR 4 // u8 output (CCD_MODEL_NONE = all)
+#define CCD_MODEL_SAVE 5
+#define CCD_MODEL_LOAD 6
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;                  // CCD_MODEL_MAGIC
+  uint16_t frame_num;              // As in CCD_Frame_t
+  CCD_FrameInfo_t info;            // payload_len = 20
+  float values[CCD_MODEL_OUTPUTS]; // NaN for an undefined output
+  uint8_t defined;                 // Bit per output
+  uint8_t prep;                    // CCD_MODEL_PREP_*
+  uint16_t latency_us;             // Readout start to the values, saturating
+} CCD_ModelFrame_t;
+
+// CCD_TELEM_MODEL reply
+typedef struct {
+  uint8_t mode;
+  uint8_t prep;
+  uint8_t defined; // Bit per output
+  uint8_t stored;  // The model matches the one in flash
+  uint32_t frames;                 // Evaluated since boot
+  uint32_t seq;                    // Of the last frame
+  uint32_t latency_us;             // Of the last frame
+  uint32_t max_latency_us;         // Since boot
+  uint32_t invalid;                // Frames with a value NaN (flat, dark)
+  float values[CCD_MODEL_OUTPUTS]; // Of the last frame
+  float scale;                     // Of the output below
+  float offset;
+  uint8_t index; // Output of the loadings below
+  uint8_t reserved;
+  uint16_t first; // First bin
+  int16_t loadings[CCD_MODEL_CHUNK];
+} CCD_ModelStatus_t;
+#pragma pack(pop)
+
+void CCD_Model_Init(void); // Boot: the model from flash
+
+// Command side (main loop): 0 if out of range
+uint8_t CCD_Model_SetMode(uint8_t mode, uint8_t prep);
+uint8_t CCD_Model_Write(uint8_t output, uint16_t first, const uint8_t *v,
+                        uint32_t n); // n loadings, little-endian i16
+uint8_t CCD_Model_Scale(uint8_t output, float scale, float offset);
+uint8_t CCD_Model_Clear(uint8_t output);
+uint8_t CCD_Model_Save(void);
+uint8_t CCD_Model_Load(void);
+void CCD_Model_Status(uint8_t output, uint16_t first, CCD_ModelStatus_t *out);
+
+// 1 while frames must reach the stage
+uint8_t CCD_Model_Active(void);
+
+// Processing stage: evaluates the frame; returns the length of the
+// record written over the slot in CCD_MODEL_ONLY, else 0
+uint32_t CCD_Model_Frame(CCD_Frame_t *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_MODEL_H */
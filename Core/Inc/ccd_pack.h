@@ -0,0 +1,66 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_pack.h
+ * @brief          : Small frames packed into full-size USB transfers
+ ******************************************************************************
+ * Statistics-only and peaks-only frames, and shaped frames of narrow
+ * windows, are tens to a few hundred bytes. Sent one per transfer, each
+ * costs a TX completion interrupt and leaves most of a 1 ms FS frame
+ * unused. Instead, an output of at most CCD_PACK_RECORD_MAX bytes for the
+ * frame link is copied, CRC and all, behind the previous ones into a pack
+ * buffer and its ring slot goes back at once. A pack is queued as one
+ * transfer when the next record would not fit, after CCD_PACK_RECORDS
+ * records, or CCD_PACK_FLUSH_US after its first record, whichever comes
+ * first, so a record waits that long at most.
+ *
+ * Nothing changes on the wire: every record is the frame it was, with its
+ * own magic, timestamp and CRC, and the receiver's parser takes them back
+ * to back as before. A larger frame flushes the open pack first and then
+ * goes out from its slot, so the order holds. With all CCD_PACK_BUFS
+ * packs queued the records go out one per transfer again until one frees.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_PACK_H
+#define __CCD_PACK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+#include "usb_tx.h"
+
+#define CCD_PACK_SIZE 2048U      // Bytes per pack, 32 FS packets
+#define CCD_PACK_BUFS 4U
+#define CCD_PACK_RECORDS 32U     // Records per pack at most
+#define CCD_PACK_RECORD_MAX 512U // Larger outputs go out on their own
+#ifndef CCD_PACK_FLUSH_US
+#define CCD_PACK_FLUSH_US 1000U // Longest a record waits in an open pack
+#endif
+
+typedef struct {
+  uint32_t records;   // Frames that went out in a pack
+  uint32_t transfers; // Packs queued
+  uint32_t timeouts;  // Of those, flushed by CCD_PACK_FLUSH_US
+} CCD_Pack_Stats_t;
+
+extern CCD_Pack_Stats_t ccd_pack_stats;
+
+// Send path (main loop), for a stamped output about to be queued on link:
+// 1 if packed (its slot is released), 0 if the caller queues it
+uint8_t CCD_Pack_Frame(UsbTx_Link_t *link, CCD_Frame_t *frame, uint32_t len);
+
+// Send path, each pass (the 1 ms tick wakes the loop for it): queues a
+// pack that has waited long enough, drops the open one when the port is
+// closed
+void CCD_Pack_Poll(void);
+
+// TX queue entries on link kept for the open pack's flush
+uint32_t CCD_Pack_Reserved(const UsbTx_Link_t *link);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_PACK_H */
@@ -0,0 +1,48 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_pattern.h
+ * @brief          : Synthetic test line as an acquisition source
+ ******************************************************************************
+ * Sample source CCD_ACQ_SRC_PATTERN ("V2"): a made-up spectrum moved into
+ * the ring by the same DMA1_Stream0 and timer chain as real samples, so
+ * frames keep their rate, timing, headers and ring behaviour, and
+ * transport or processing can be measured without a sensor. TIM4 CC1 at
+ * the sample phase is the DMA request (routed by DMAMUX); the stream reads
+ * the line from memory with the source address incrementing. No CPU runs
+ * per pixel or per frame.
+ *
+ * The line has the sensor's polarity: a dark level near full scale, dummy
+ * pixels at the dark, and CCD_PATTERN_LINES Gaussian lines that lower it,
+ * with a fixed pseudo-random noise. The line is stored twice, and on the
+ * restart path every frame starts CCD_PATTERN_STEP pixels further into it,
+ * so the lines drift across the sensor and frames differ from one to the
+ * next; the double-buffer path keeps it still.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_PATTERN_H
+#define __CCD_PATTERN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_PATTERN_DARK 60000U // Dark level (light lowers the value)
+#define CCD_PATTERN_NOISE 15U   // Peak-to-peak noise, counts
+#define CCD_PATTERN_LINES 4
+#define CCD_PATTERN_STEP 1U     // Pixels of drift per frame
+
+uint8_t CCD_Pattern_Init(void);
+uint32_t CCD_Pattern_Apply(uint32_t ccr, uint32_t arr);
+void CCD_Pattern_Stream(void);
+void CCD_Pattern_Start(void);
+void CCD_Pattern_Arm(void);
+void CCD_Pattern_Stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_PATTERN_H */
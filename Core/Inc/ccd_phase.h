@@ -0,0 +1,88 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_phase.h
+ * @brief          : ADC sample-phase calibration sweep
+ ******************************************************************************
+ * "F1" sweeps the ADC trigger (TIM4 CCR4) across the pixel period in
+ * CCD_PHASE_STEPS steps, at each ADC sampling time, under whatever constant
+ * illumination is on the sensor. Each setting restarts acquisition, drops
+ * CCD_PHASE_SETTLE frames and measures CCD_PHASE_FRAMES more:
+ *  - signal: shielded-pixel mean minus active-pixel mean (light lowers the
+ *    value)
+ *  - noise: mean absolute difference of each active pixel between
+ *    consecutive frames
+ * The setting with the best signal / noise is applied and a
+ * CCD_PhaseReport_t with every result is sent. "FS" stores the applied
+ * setting in flash (loaded at boot), "FL" reloads it, "F0" aborts a sweep
+ * and restores the setting it started from.
+ *
+ * Frames keep flowing to the host during the sweep. Run it in a continuous
+ * mode (M0/M2); a mode 3 sweep advances only as triggers arrive.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_PHASE_H
+#define __CCD_PHASE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ccd_acq.h"
+#include "main.h"
+
+#define CCD_PHASE_STEPS 16 // Phase step = CCD_PIXEL_TICKS / 16; phase 0 skipped
+#define CCD_PHASE_SETTINGS ((CCD_PHASE_STEPS - 1) * CCD_ACQ_SMP_COUNT)
+#define CCD_PHASE_SETTLE 2 // Frames dropped after each restart
+#define CCD_PHASE_FRAMES 8 // Frames measured per setting
+
+#define CCD_PHASE_MAGIC 0xABD1 // CCD_PhaseReport_t
+
+// Pixel classes of the line (CCD_BUFFER_SIZE elements, ccd_sensor.h)
+#define CCD_PHASE_SHIELD_START CCD_SENSOR_SHIELD_START
+#define CCD_PHASE_SHIELD_COUNT CCD_SENSOR_SHIELD_COUNT
+#define CCD_PHASE_ACTIVE_START CCD_SENSOR_ACTIVE_START
+#define CCD_PHASE_ACTIVE_COUNT CCD_SENSOR_ACTIVE_COUNT
+
+// ccd_phase_request values
+#define CCD_PHASE_REQ_SWEEP '1'
+#define CCD_PHASE_REQ_ABORT '0'
+#define CCD_PHASE_REQ_SAVE 'S'
+#define CCD_PHASE_REQ_LOAD 'L'
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t phase; // TIM4 CCR4 (timer ticks into the pixel)
+  uint8_t sample; // acq_adc_sample
+  uint8_t reserved;
+  uint32_t signal; // Counts x 256, mean over the measured frames
+  uint32_t noise;  // Counts x 256 per pixel, mean over the frame pairs
+} CCD_PhaseResult_t;
+
+typedef struct {
+  uint16_t magic; // CCD_PHASE_MAGIC
+  uint8_t count;  // Results that follow
+  uint8_t best;   // Index of the applied result
+  CCD_PhaseResult_t result[CCD_PHASE_SETTINGS];
+} CCD_PhaseReport_t;
+#pragma pack(pop)
+
+extern volatile uint8_t ccd_phase_request; // CCD_PHASE_REQ_*, 0 = none
+
+// Boot: load the stored setting into acq_adc_phase / acq_adc_sample
+void CCD_Phase_Init(void);
+
+// Main loop: requests, restarts between settings and the report
+void CCD_Phase_Poll(void);
+
+// 1 while a sweep is measuring (frames must reach CCD_Phase_Frame() singly)
+uint8_t CCD_Phase_Busy(void);
+
+// Every raw frame, before processing
+void CCD_Phase_Frame(const CCD_Frame_t *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_PHASE_H */
@@ -0,0 +1,62 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_preview.h
+ * @brief          : Low-rate binned preview next to a full-rate sink
+ ******************************************************************************
+ * While the SD recorder (ccd_rec.h) or Ethernet (CCD_TX_ETH) takes every
+ * raw frame, USB can carry a preview of its own: the frame a sink has just
+ * been handed, binned (mean of bin pixels, as "B") into a shaped frame of
+ * the whole line, 16-bit and uncoded, at most rate frames per second of
+ * capture time. Set with CCD_CMD_TELEMETRY, CCD_TELEM_PREVIEW (rate,
+ * 0 = off) and CCD_TELEM_PREVIEW_BIN; not kept in flash.
+ *
+ * The preview never holds the ring: the slot is only read, in the sink's
+ * own pass, into one of CCD_PREVIEW_BUFS buffers of this module, which go
+ * to USB CRC-stamped. A preview due while both buffers are still queued
+ * (slow or closed port) is skipped and counted, never waited for, so
+ * however slow the preview reader is the recording keeps the full rate.
+ * Its frames keep their seq; the host expects the gaps (set_preview()).
+ *
+ * Off, the recorder falls back to its raw frame every CCD_REC_PREVIEW.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_PREVIEW_H
+#define __CCD_PREVIEW_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_PREVIEW_BUFS 2U
+#define CCD_PREVIEW_RATE_MAX 60U // Frames per second
+
+#pragma pack(push, 1)
+// CCD_TELEM_PREVIEW and CCD_TELEM_PREVIEW_BIN reply
+typedef struct {
+  uint8_t rate; // Frames per second, 0 = off
+  uint8_t bin;  // 1, 2, 4 or 8
+  uint8_t busy; // Buffers queued on USB
+  uint8_t reserved;
+  uint32_t sent;    // Previews queued on USB
+  uint32_t skipped; // Due but no buffer free or the port closed
+} CCD_PreviewStatus_t;
+#pragma pack(pop)
+
+// Main loop: 0 if out of range, the setting is unchanged then
+uint8_t CCD_Preview_SetRate(uint8_t rate);
+uint8_t CCD_Preview_SetBin(uint8_t bin);
+void CCD_Preview_Status(CCD_PreviewStatus_t *out);
+uint8_t CCD_Preview_Enabled(void);
+
+// Full-rate sink, main loop: a raw frame going out; previewed when due.
+// Shaped frames are ignored.
+void CCD_Preview_Offer(const CCD_Frame_t *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_PREVIEW_H */
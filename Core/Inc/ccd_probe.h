@@ -0,0 +1,86 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_probe.h
+ * @brief          : Cycle probes on interrupts and main loop stages (DWT)
+ ******************************************************************************
+ * Every interrupt handler on the frame and USB paths and every main loop
+ * stage reads DWT CYCCNT as it starts and hands the cycles it took to
+ * CCD_Probe_End() as it ends. Per probe that keeps the count, minimum,
+ * maximum, sum and a log2 histogram: bin 0 holds passes under
+ * CCD_PROBE_BIN0 cycles, bin k those from CCD_PROBE_BIN0 << (k - 1), and
+ * the last one everything longer. Recording costs a few tens of cycles and
+ * no locking (a probe belongs to one handler), so the probes are always
+ * built in.
+ *
+ * Times are inclusive: an interrupt that preempts a probed handler adds to
+ * it, and the main loop stages include the interrupts taken while they
+ * ran, as the latency they cause is what counts there.
+ *
+ * CCD_CMD_PROBE reads one probe at a time, optionally resetting it, so the
+ * host can read them all before and after a change.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_PROBE_H
+#define __CCD_PROBE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+// Interrupt handlers (stm32h7xx_it.c)
+#define CCD_PROBE_ICG 0    // TIM2 update: re-arm the stream
+#define CCD_PROBE_DMA 1    // DMA1_Stream0: frame complete
+#define CCD_PROBE_SH 2     // TIM5 update: exposure change
+#define CCD_PROBE_USB_FS 3 // OTG_FS, with the CDC command parser
+#define CCD_PROBE_USB_HS 4 // OTG_HS
+#define CCD_PROBE_TRIG 5   // EXTI0 trigger input
+// Main loop (main.c): a whole pass, then each stage
+#define CCD_PROBE_LOOP 6
+#define CCD_PROBE_CMD 7
+#define CCD_PROBE_MODE 8
+#define CCD_PROBE_BENCH 9
+#define CCD_PROBE_PROC 10
+#define CCD_PROBE_PHASE 11
+#define CCD_PROBE_AE 12
+#define CCD_PROBE_SEQ 13
+#define CCD_PROBE_REC 14
+#define CCD_PROBE_ETH 15
+#define CCD_PROBE_SEND 16 // Processing stages, CRC and USB submission
+#define CCD_PROBE_SNAP 17
+#define CCD_PROBE_CLOCK 18
+#define CCD_PROBE_FAULT 19
+#define CCD_PROBE_CONFIG 20
+#define CCD_PROBE_ADCCAL 21
+#define CCD_PROBE_TEMP 22
+#define CCD_PROBE_WATCH 23
+#define CCD_PROBE_DEFER 24 // PendSV: frame work left by the capture ISRs
+#define CCD_PROBE_SELFTEST 25
+#define CCD_PROBE_COUNT 26
+
+#define CCD_PROBE_BINS 11
+#define CCD_PROBE_BIN0 64U // Cycles below which a pass lands in bin 0
+
+typedef struct {
+  uint32_t count;
+  uint32_t min; // UINT32_MAX before the first pass
+  uint32_t max;
+  uint64_t sum;
+  uint32_t hist[CCD_PROBE_BINS];
+} CCD_Probe_t;
+
+// Any context: the pass that started at DWT->CYCCNT == start ends now
+void CCD_Probe_End(uint8_t probe, uint32_t start);
+
+// Main loop. A copy taken with interrupts masked; reset zeroes the probe
+// in the same step, so no pass is lost between the two.
+void CCD_Probe_Read(uint8_t probe, CCD_Probe_t *out, uint8_t reset);
+void CCD_Probe_Init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_PROBE_H */
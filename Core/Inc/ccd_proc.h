@@ -0,0 +1,919 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_proc.h
+ * @brief          : On-device frame processing between the ring and USB
+ ******************************************************************************
+ * Send_CCD_Frames() passes every completed ring frame through
+ * CCD_Proc_Frame() before queueing it for USB. A stage either edits the frame
+ * in place and passes it on, or absorbs it (the slot goes straight back to
+ * the ring) and later emits its result in a slot it was handed. Processing
+ * therefore needs no frame buffers of its own.
+ *
+ * Stages, in order (co-add and rolling run before shaping):
+ *  - Linearity: CCD_CMD_LINEARITY uploads a piecewise-linear correction of
+ *    the raw ADC value, CCD_LIN_KNOTS knots 256 counts apart, applied to
+ *    every pixel before anything else (so darks are taken linearised). The
+ *    knots are kept in flash (ccd_store.h); the 1 KB segment table runs
+ *    from DTCM. A full 64K-entry table would fill DTCM, and 256-count
+ *    segments follow the smooth bend near saturation to about a count.
+ *  - Black level: the mean of the leading dummy outputs, which have no
+ *    photodiode, is every frame's own black. With CCD_CMD_BLACK on, the
+ *    frame is shifted so that it lands on CCD_PROC_BLACK_LEVEL, which
+ *    takes out offset and amplifier drift from frame to frame, before the
+ *    dark (so a master dark is taken at that level too).
+ *  - Dark: "D<m>" averages the next M raw frames into a master dark, which
+ *    is then subtracted from every frame with saturating SIMD adds ("D0"
+ *    clears it). With a dark temperature table (CCD_CMD_DARK_TEMP: the
+ *    relative dark current at a few sensor temperatures) the master dark
+ *    follows the temperature (ccd_temp.h): its signal below the zero-dark
+ *    level of the leading dummy outputs is scaled by the table's ratio
+ *    between the capture temperature and now, in the main loop whenever
+ *    the sensor has moved CCD_PROC_DARKT_STEP. One dark then serves a
+ *    warming lab.
+ *  - Flat field: per-pixel Q15 gains correct PRNU. Uploaded with "GW" and
+ *    applied with "GA", or loaded from flash (ccd_store.h) at boot.
+ *  - Source normalization: with CCD_REF_PD in CCD_REF_NORMALIZE, one Q15
+ *    gain per frame, the reference photodiode's target over the level it
+ *    read during the frame's integration (ccd_ref.h), takes lamp flicker
+ *    and drift out of the signal. A frame without a level passes as is.
+ *  - Defect pixels: a bitmap of the line, one bit per pixel, marks hot and
+ *    dead pixels, and each is replaced by linear interpolation between its
+ *    nearest good neighbours. The map becomes a list of (pixel, neighbours,
+ *    weight) whenever it changes, so a frame costs a few cycles per defect
+ *    and nothing for the other pixels. CCD_TELEM_DEFECT finds the defects
+ *    among the effective pixels, in the master dark (hot: further than a
+ *    threshold in counts from the median of its four neighbours) and in
+ *    the flat-field gains (dead or weak: a gain that far from theirs), or
+ *    takes a map from the host. The map is kept in flash (ccd_store.h) and
+ *    applied at boot.
+ *  - Spike rejection: CCD_TELEM_DESPIKE keeps the two frames that reached
+ *    the stage before this one. CCD_PROC_DESPIKE_MEDIAN sends every pixel
+ *    as the median of the three; CCD_PROC_DESPIKE_SIGMA replaces by that
+ *    median only the pixels more than sigma noise sigmas away from it, the
+ *    noise taken as 1.4826 times the median absolute deviation of the
+ *    three (rough over three samples, so nothing within a floor in counts
+ *    is replaced). A cosmic-ray hit or any other one-frame spike then never
+ *    reaches the co-add or the rolling mean. Pixel pairs go through USUB16
+ *    + SEL sorting networks, with no branch per pixel. A frame_num gap
+ *    restarts the history, and the two frames after it pass as they are.
+ *    Kept in flash.
+ *  - Co-add and rolling average (below).
+ *  - Change detection: "E<t>" sends a frame only when its mean absolute
+ *    difference to the last frame sent exceeds t counts per pixel, or
+ *    "H<ms>" has passed since then (heartbeat). "E0" sends every frame.
+ *  - ROI: "W<start>:<len>,..." keeps only up to CCD_PROC_ROI_MAX pixel
+ *    windows ("W" alone sends the whole line again).
+ *  - Auto ROI: with CCD_TELEM_AUTOROI on, the windows place themselves.
+ *    The next frames frames go out whole and are averaged; the peak search
+ *    (the threshold and distance of CCD_CMD_PEAKS) then runs on the mean,
+ *    and a window of margin pixels either side, widened to
+ *    CCD_PROC_AUTOROI_ALIGN pixels for every binning, goes around each of
+ *    the lines strongest lines. Overlapping windows merge. The frames from
+ *    then on carry only those windows, until interval seconds later the
+ *    search runs again (0: until CCD_PROC_AUTOROI_AGAIN). A search that
+ *    finds no line starts over. The windows of "W" come back when it is
+ *    turned off; they stay the ones saved, the auto settings are kept too.
+ *  - Binning: "B<b>" (2, 4, 8) averages b adjacent pixels, per window.
+ *  - Packing: "P12" / "P14" send the top 12 or 14 bits of each pixel as a
+ *    little-endian bit stream ("P16" = plain uint16_t).
+ *  - Compression: "C1" Rice-codes the pixel deltas losslessly (at the
+ *    packing's bit depth), "C0" = off. See CCD_Codec_RiceEncode(). "C2"
+ *    codes pixels against the previous frame sent instead, with a spatially
+ *    coded keyframe every CCD_PROC_KEYFRAME_INTERVAL frames or on "CK".
+ *
+ *  - Absorbance: CCD_CMD_ABSORBANCE averages M frames, as they reach this
+ *    stage (so dark-subtracted, flat-fielded, co-added as set), into a
+ *    reference I0, then sends every frame as the transmittance I / I0
+ *    (unsigned Q15) or the absorbance -log10(I / I0) (offset binary Q12),
+ *    with I = 65535 - pixel. CCD_FRAME_F_ABSORB marks those frames; the
+ *    command's reply says which of the two they are. Take the dark first,
+ *    so the D in (I - D) / (I0 - D) is already out of both.
+ *  - Smoothing: CCD_CMD_SMOOTH runs a Savitzky-Golay FIR over the line
+ *    (window 5..25, order 2..5, the sets PeakDetector's savgol_filter uses,
+ *    with the end pixels repeated past the edges). It comes before the
+ *    statistics, peaks and shaping, so all of them see the smoothed line;
+ *    the smoother deltas also code shorter.
+ *  - Drift: CCD_TELEM_DRIFT averages M frames into a reference of a band
+ *    of pixels, then cross-correlates every frame's band with it at each
+ *    lag within +-lag pixels (mean removed, one SMLALD per pixel pair and
+ *    lag) and reports the shift of the correlation peak, refined by a
+ *    parabola through it and its neighbours to a fraction of a pixel. With
+ *    CCD_PROC_DRIFT_ONLY a CCD_DriftFrame_t replaces the frame, for a rig
+ *    that only follows the drift; with correct set, the main loop moves
+ *    the resampling grid under the wavelength calibration by the smoothed
+ *    shift whenever it has changed by CCD_PROC_DRIFT_STEP, so resampled
+ *    frames stay on their wavelengths. Before the reference is complete
+ *    the frames pass as they are. The reference is not kept.
+ *  - Wavelength: CCD_CMD_WAVELENGTH holds a pixel -> nm polynomial of up to
+ *    4th order (saved in flash next to the flat field). With resampling on,
+ *    every frame is interpolated onto the uniform grid start_nm + i *
+ *    step_nm (CCD_BUFFER_SIZE points) from a table built when the
+ *    calibration is set, and carries CCD_FRAME_F_RESAMPLED. The host reads
+ *    the grid back from the command's reply.
+ *  - Baseline: CCD_TELEM_BASELINE takes the slowly varying background
+ *    (fluorescence, stray light) out from under the peaks. The lower
+ *    envelope of the light is found on a decimated copy: the least light
+ *    of every CCD_PROC_BASE_DECIM pixels, opened (a rolling minimum, then
+ *    a rolling maximum) over width pixels so that nothing narrower than
+ *    width survives, then box-smoothed over the same span. Between block
+ *    centres the level is interpolated, and every pixel sends only its
+ *    light above it (CCD_PROC_BASE_SUBTRACT), or the baseline itself
+ *    (CCD_PROC_BASE_ESTIMATE) while width is tuned. Pick width well above
+ *    the widest peak: a peak narrower than it keeps its height. It comes
+ *    after the resampling, so matching, statistics, peaks, bands and the
+ *    codec all see the residual line, where the dark pixels code short.
+ *    No flag bit is left to mark the frames; the setting is kept in flash.
+ *  - Matching: CCD_TELEM_MATCH classifies every frame against a library
+ *    of reference spectra (ccd_match.h) and can replace it with the
+ *    decision, a CCD_MatchFrame_t. Statistics, peaks and bands then see
+ *    no frame.
+ *  - Models: with CCD_MODEL, CCD_TELEM_MODEL applies up to four linear
+ *    models, PLS or PCA loadings, to every frame (ccd_model.h) and can
+ *    replace it with their values, a CCD_ModelFrame_t.
+ *  - Statistics: CCD_CMD_FRAME_STATS replaces every frame with a
+ *    CCD_StatsFrame_t (min, max, sum, mean, saturated pixels and the
+ *    centroid of the light), 56 bytes instead of 7.4 KB. Shaping is then
+ *    skipped.
+ *  - Peaks: CCD_CMD_PEAKS replaces every frame with its peak list: local
+ *    maxima of the light (65535 - pixel) above a threshold, at least
+ *    min_distance apart (greedy from the left, as PeakDetector in
+ *    ccd_monitor), each refined to a sub-pixel position by a parabola
+ *    through it and its neighbours, or their logarithms (Gaussian fit).
+ *    The statistics win when both are on.
+ *  - Bands: CCD_TELEM_BANDS defines up to CCD_PROC_BANDS_MAX pixel ranges,
+ *    and every frame is then replaced by one uint32_t per band: its light
+ *    (65535 - pixel, summed) times the band's Q12 weight, a few dozen bytes
+ *    with the frame's timestamp. Spectral channels of a photometer at the
+ *    full frame rate (the small frames pack into shared transfers,
+ *    ccd_pack.h). The statistics and peaks win over the bands.
+ *  - Focus: CCD_TELEM_FOCUS defines up to CCD_PROC_FOCUS_MAX pixel windows,
+ *    one line in each, and every frame is then replaced by each line's
+ *    height and width: the light of its brightest pixel over the least
+ *    light in the window, and the full width at half that height between
+ *    the two crossings of the half level either side, each interpolated
+ *    between the pixels it falls between. Their midpoint is the centre. A
+ *    line that does not fall below half within its window on both sides
+ *    has no width. Eight bytes a line at the full frame rate, for tuning
+ *    focus and alignment as fast as the sensor reads out. Statistics,
+ *    peaks and bands win over the lines; they are not kept in flash.
+ *
+ * ROI, binning, packing and compression send a shaped frame: a CCD_ShapedHeader_t, the
+ * window list (CCD_RoiWindow_t each), then the pixels of every window in
+ * order.
+ *  - Co-add: sums N consecutive frames into a 32-bit accumulator and sends
+ *    their rounded mean in the slot of the N-th frame ("N<n>", 1 = off).
+ *  - Rolling average: keeps the last K frames in their ring slots with a
+ *    running sum and emits the moving mean for every new frame ("R<k>",
+ *    1 = off).
+ *  - Wide output: with CCD_TELEM_WIDE set, a co-add or rolling output
+ *    leaves as a CCD_WideHeader_t and CCD_BUFFER_SIZE 32-bit values in
+ *    place of its rounded 16-bit mean: the exact sum (CCD_PROC_WIDE_SUM)
+ *    or the mean as a float (CCD_PROC_WIDE_FLOAT), in wire polarity. The
+ *    16-bit stages after the average (change detection to shaping) are
+ *    passed by. At 14.8 KB a wide frame does not fit a ring slot, so it is
+ *    queued for USB from one of two buffers in the shared scratch
+ *    (ccd_mem.h), as HDR frames are; with both still queued the output is
+ *    dropped and counted. Other outputs go out as before. The buffers
+ *    overlay the I0, drift and auto ROI sums: a wide output restarts a
+ *    capture or search, which waits while one is queued.
+ *
+ * Every stage is timed with the cycle counter (ccd_proc_profile, binary
+ * CCD_CMD_PROFILE), so the host can check that a configuration fits the
+ * frame period before relying on it. A stage that is off costs a few
+ * cycles; absorbed frames end the pass at their stage.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_PROC_H
+#define __CCD_PROC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+#include "ccd_codec.h"
+
+#define CCD_PROC_COADD_MAX 256 // Keeps the reciprocal divide exact
+
+// Held frames pin ring slots. 16 of FRAME_RING_SLOTS leaves room for the DMA
+// claims and a full USB TX queue.
+#define CCD_PROC_ROLLING_MAX 16
+
+#define CCD_PROC_DARK_MAX 256     // Frames per master dark
+#define CCD_DARK_CLEAR_REQ 0xFFFFU // proc_dark_request: drop the master dark
+
+// proc_dark_state bits
+#define CCD_DARK_NONE 0x00
+#define CCD_DARK_READY 0x01     // A master dark is applied to every frame
+#define CCD_DARK_CAPTURING 0x02 // A new master dark is being averaged
+
+// Dark temperature model (CCD_DarkTempKnot_t table)
+#define CCD_PROC_DARKT_KNOTS 8
+#define CCD_PROC_DARKT_STEP 10  // 0.01 degC the sensor moves before a rescale
+#define CCD_PROC_DARKT_REF CCD_SENSOR_SHIELD_START // Dummies: no photodiode
+#define CCD_PROC_DARKT_UNITY 4096U // Q12 ratio 1.0
+#define CCD_DARKT_STATUS 0xFF   // CCD_CMD_DARK_TEMP count: only the reply
+
+// Black level (CCD_CMD_BLACK)
+#define CCD_PROC_BLACK_REF CCD_PROC_DARKT_REF // The same dummy outputs
+#define CCD_PROC_BLACK_LEVEL 60000U // Where the black is moved to
+#define CCD_BLACK_STATUS 0xFF       // CCD_CMD_BLACK: only the reply
+
+// Linearity correction: knot i is the output for raw value i * 256
+#define CCD_LIN_KNOTS 257
+#define CCD_LIN_CHUNK 24 // Knots per CCD_CMD_LINEARITY upload
+
+// CCD_CMD_LINEARITY actions
+#define CCD_LIN_CMD_WRITE 0 // Knots into the upload table at offset
+#define CCD_LIN_CMD_APPLY 1 // Swap in the uploaded table and enable
+#define CCD_LIN_CMD_OFF 2
+#define CCD_LIN_CMD_SAVE 3 // Store the applied table in flash
+#define CCD_LIN_CMD_LOAD 4 // Reload the table from flash and enable
+
+// Flat-field gains are unsigned Q15 (CCD_FLAT_UNITY = 1.0, max ~2.0)
+#define CCD_FLAT_UNITY 0x8000U
+
+// proc_flat_request values, handled by CCD_Proc_Poll()
+#define CCD_FLAT_REQ_APPLY 'A' // Swap in the uploaded table and enable
+#define CCD_FLAT_REQ_SAVE 'S'  // Store the applied table in flash
+#define CCD_FLAT_REQ_LOAD 'L'  // Reload the table from flash
+
+#define CCD_PROC_HEARTBEAT_MS 1000U // Default proc_heartbeat_ms
+
+#define CCD_PROC_ROI_MAX 4 // Windows per shaped frame ("W" fits one packet)
+
+// Auto ROI (CCD_TELEM_AUTOROI operations)
+#define CCD_PROC_AUTOROI_OFF 0
+#define CCD_PROC_AUTOROI_ON 1    // Then u8 lines, u8 frames, u16 margin,
+                                 // u16 interval in seconds, or kept
+#define CCD_PROC_AUTOROI_AGAIN 2 // Search again now
+#define CCD_PROC_AUTOROI_FRAMES_MAX 64U
+#define CCD_PROC_AUTOROI_ALIGN 8U // Window start and length, pixels
+// 256, or less where the widest windows would not fit a shaped frame
+#define CCD_PROC_AUTOROI_MARGIN_FIT                                            \
+  ((CCD_PROC_ROI_PIXELS / CCD_PROC_ROI_MAX - 2U * CCD_PROC_AUTOROI_ALIGN) / 2U)
+#define CCD_PROC_AUTOROI_MARGIN_MAX                                            \
+  ((CCD_PROC_AUTOROI_MARGIN_FIT < 256U) ? CCD_PROC_AUTOROI_MARGIN_FIT : 256U)
+
+// CCD_AutoRoiStatus_t.state
+#define CCD_AUTOROI_IDLE 0
+#define CCD_AUTOROI_SEARCH 1 // Averaging whole frames
+#define CCD_AUTOROI_SET 2    // Sending the windows found
+
+// Pixel packings (proc_bits): 2 pixels in 3 bytes, 4 pixels in 7 bytes
+#define CCD_PROC_PACK_12 12
+#define CCD_PROC_PACK_14 14
+#define CCD_PROC_PACK_NONE 16
+
+// proc_codec values (CCD_ShapedHeader_t.codec)
+#define CCD_PROC_CODEC_NONE 0
+#define CCD_PROC_CODEC_RICE 1     // Deltas to the previous pixel
+#define CCD_PROC_CODEC_TEMPORAL 2 // Deltas to the same pixel in frame ref
+
+// Temporal coding sends a keyframe at least this often, so a receiver that
+// lost its reference (or joined late) resynchronises on its own
+#define CCD_PROC_KEYFRAME_INTERVAL 64
+
+// Shaped frames (ROI/binned) replace the CCD_Frame_t header on the wire
+#define CCD_SHAPED_MAGIC 0xABCE
+
+// Statistics frames, header as a raw frame's and a CCD_FrameStats_t payload
+#define CCD_STATS_MAGIC 0xABD7
+
+// proc_stats values
+#define CCD_PROC_STATS_OFF 0
+#define CCD_PROC_STATS_ONLY 1 // Send the statistics instead of the frame
+
+// Default proc_stats_level: light lowers the output, so a pixel below this
+// counts as saturated
+#define CCD_PROC_SAT_LEVEL 2048U
+
+// Peak list frames: CCD_PeaksHeader_t, then count CCD_Peak_t
+#define CCD_PEAKS_MAGIC 0xABD8
+#define CCD_PROC_PEAKS_MAX 64 // Peaks per frame, the rest are dropped
+
+// proc_peaks values
+#define CCD_PROC_PEAKS_OFF 0
+#define CCD_PROC_PEAKS_ONLY 1 // Send the peak list instead of the frame
+
+// Drift records replace the frame with CCD_PROC_DRIFT_ONLY
+#define CCD_DRIFT_MAGIC 0xABDE
+
+// proc_drift values
+#define CCD_PROC_DRIFT_OFF 0
+#define CCD_PROC_DRIFT_TRACK 1 // Frames go on; the shift in the status
+#define CCD_PROC_DRIFT_ONLY 2  // A CCD_DriftFrame_t instead of the frame
+
+// Band and lag window. The default band is the effective pixels less a
+// lag at either end, so that every lag reads effective pixels only.
+#define CCD_PROC_DRIFT_LAG_MAX 32
+#define CCD_PROC_DRIFT_LAG 16
+#define CCD_PROC_DRIFT_START (CCD_PHASE_ACTIVE_START + CCD_PROC_DRIFT_LAG)
+#define CCD_PROC_DRIFT_LEN (CCD_PHASE_ACTIVE_COUNT - 2 * CCD_PROC_DRIFT_LAG)
+#define CCD_PROC_DRIFT_LEN_MIN 16 // Even, as every band
+#define CCD_PROC_DRIFT_REF_MAX 256 // Frames per reference
+#define CCD_PROC_DRIFT_STEP 1311   // Q16, 0.02 pixel: moves the grid
+
+// CCD_TELEM_DRIFT actions
+#define CCD_DRIFT_MODE 0 // u8 CCD_PROC_DRIFT_*, u8 correct
+#define CCD_DRIFT_REF 1  // u16 frames for a new reference
+#define CCD_DRIFT_BAND 2 // u16 start, u16 len, u8 lag; drops the reference
+
+// proc_drift_state values
+#define CCD_DRIFT_NONE 0
+#define CCD_DRIFT_READY 1     // Frames are correlated against a reference
+#define CCD_DRIFT_CAPTURING 2 // A new reference is being averaged
+
+// Wide frames: CCD_WideHeader_t, then CCD_BUFFER_SIZE int32_t or float
+#define CCD_WIDE_MAGIC 0xABE0
+
+// proc_wide values (CCD_WideHeader_t.format)
+#define CCD_PROC_WIDE_OFF 0
+#define CCD_PROC_WIDE_SUM 1   // int32_t: the sum of terms frames, exact
+#define CCD_PROC_WIDE_FLOAT 2 // float: the sum / terms
+
+// Band frames: CCD_BandsHeader_t, then count uint32_t band values
+#define CCD_BANDS_MAGIC 0xABDA
+#define CCD_PROC_BANDS_MAX 16
+#define CCD_PROC_BAND_UNITY 4096U // Q12 weight 1.0
+
+// Focus frames: CCD_FocusHeader_t, then count CCD_FocusValue_t
+#define CCD_FOCUS_MAGIC 0xABE3
+#define CCD_PROC_FOCUS_MAX 16
+#define CCD_PROC_FOCUS_LEN_MIN 3U   // A peak pixel and a crossing each side
+#define CCD_PROC_FOCUS_LEN_MAX 255U // Keeps the Q8.8 width in range
+
+// CCD_TELEM_BANDS argument: CCD_Band_t entries that follow go to the
+// staged list from index (arg & CCD_BANDS_FIRST); with CCD_BANDS_APPLY the
+// staged list up to the last of them is applied (none: bands off).
+// CCD_TELEM_FOCUS takes its CCD_FocusLine_t entries the same way.
+#define CCD_BANDS_FIRST 0x1FU
+#define CCD_BANDS_APPLY 0x80U
+
+// proc_peak_fit values (CCD_PeaksHeader_t.fit)
+#define CCD_PROC_FIT_PARABOLA 0
+#define CCD_PROC_FIT_GAUSS 1 // Parabola through ln(light); needs light > 0
+
+// Defaults, as PeakDetector in ccd_monitor
+#define CCD_PROC_PEAK_THRESHOLD 15000U
+#define CCD_PROC_PEAK_DISTANCE 100U
+
+// Wavelength calibration (CCD_Wavelength_t)
+#define CCD_WL_ORDER_MAX 4
+
+// CCD_Wavelength_t.state
+#define CCD_WL_NONE 0
+#define CCD_WL_READY 1 // Calibrated; resampled if resample is set
+
+// CCD_CMD_WAVELENGTH actions
+#define CCD_WL_CMD_SET 0
+#define CCD_WL_CMD_STATUS 1 // Only the reply
+#define CCD_WL_CMD_SAVE 2   // Store the calibration in use in flash
+
+// Defect map: pixel i is bit (i & 7) of byte i / 8
+#define CCD_PROC_DEFECT_BYTES ((CCD_BUFFER_SIZE + 7U) / 8U)
+#define CCD_PROC_DEFECT_MAX 256U  // Replaced per frame; the rest only mapped
+#define CCD_PROC_DEFECT_CHUNK 32U // Map bytes in a CCD_DefectStatus_t
+
+// CCD_TELEM_DEFECT actions
+#define CCD_DEFECT_OFF 0
+#define CCD_DEFECT_ON 1
+#define CCD_DEFECT_DETECT 2 // u16 hot in counts, u16 dead in Q15 (0 = skip)
+#define CCD_DEFECT_WRITE 3  // u16 byte offset, then map bytes
+#define CCD_DEFECT_READ 4   // u16 byte offset of the reply's bitmap
+#define CCD_DEFECT_SAVE 5   // Blocks for the sector erase
+#define CCD_DEFECT_LOAD 6
+#define CCD_DEFECT_CLEAR 7
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;       // CCD_SHAPED_MAGIC
+  uint16_t frame_num;   // As in CCD_Frame_t
+  CCD_FrameInfo_t info; // As in CCD_Frame_t
+  uint8_t bin;          // Sensor pixels averaged into each output pixel
+  uint8_t windows;      // CCD_RoiWindow_t entries that follow, 0 = whole line
+  uint16_t count;       // Output pixels after the window list
+  uint8_t bits;         // 16 = uint16_t pixels, 12/14 = packed
+  uint8_t codec;        // CCD_PROC_CODEC_*
+  uint16_t size;        // Pixel data bytes after the window list
+  uint16_t ref;         // CCD_PROC_CODEC_TEMPORAL: frame_num of the reference
+} CCD_ShapedHeader_t;
+
+typedef struct {
+  uint16_t min;       // Smallest pixel: the brightest, in wire polarity
+  uint16_t max;       // Largest pixel: the darkest
+  uint32_t sum;       // Of all CCD_BUFFER_SIZE pixels
+  uint16_t mean;      // sum / CCD_BUFFER_SIZE, rounded
+  uint16_t saturated; // Pixels below proc_stats_level
+  uint32_t centroid;  // Light-weighted pixel position, Q16.16
+  uint32_t signal;    // Total light: sum of (max - pixel)
+} CCD_FrameStats_t;
+
+typedef struct {
+  uint16_t magic;       // CCD_STATS_MAGIC
+  uint16_t frame_num;   // As in CCD_Frame_t
+  CCD_FrameInfo_t info; // payload_len = sizeof(CCD_FrameStats_t)
+  CCD_FrameStats_t stats;
+} CCD_StatsFrame_t;
+
+typedef struct {
+  uint16_t magic;       // CCD_PEAKS_MAGIC
+  uint16_t frame_num;   // As in CCD_Frame_t
+  CCD_FrameInfo_t info; // As in CCD_Frame_t
+  uint16_t count;       // CCD_Peak_t entries that follow
+  uint8_t fit;          // CCD_PROC_FIT_*
+  uint8_t truncated;    // 1 if more than CCD_PROC_PEAKS_MAX were found
+} CCD_PeaksHeader_t;
+
+typedef struct {
+  uint32_t position; // Sub-pixel centre, Q16.16 pixels
+  uint16_t height;   // Light (65535 - pixel) at the peak pixel
+} CCD_Peak_t;
+
+typedef struct {
+  uint16_t start;  // First sensor pixel
+  uint16_t len;    // Pixels, >= 1
+  uint16_t weight; // Q12, CCD_PROC_BAND_UNITY = 1.0
+} CCD_Band_t;
+
+typedef struct {
+  uint16_t magic;       // CCD_BANDS_MAGIC
+  uint16_t frame_num;   // As in CCD_Frame_t
+  CCD_FrameInfo_t info; // payload_len = count * 4
+  uint16_t count;       // Band values that follow
+} CCD_BandsHeader_t;
+
+typedef struct {
+  uint16_t start; // First pixel of the window
+  uint16_t len;   // CCD_PROC_FOCUS_LEN_MIN..CCD_PROC_FOCUS_LEN_MAX
+} CCD_FocusLine_t;
+
+typedef struct {
+  uint16_t magic;       // CCD_FOCUS_MAGIC
+  uint16_t frame_num;   // As in CCD_Frame_t
+  CCD_FrameInfo_t info; // payload_len = count * 8
+  uint16_t count;       // CCD_FocusValue_t entries that follow
+} CCD_FocusHeader_t;
+
+typedef struct {
+  uint32_t centre; // Midpoint of the half-height crossings, Q16.16 pixels;
+                   // without a width the brightest pixel
+  uint16_t height; // Light: the window's largest pixel less its smallest
+  uint16_t fwhm;   // Q8.8 pixels, 0 = no crossing on one side
+} CCD_FocusValue_t;
+
+typedef struct {
+  uint16_t magic;       // CCD_DRIFT_MAGIC
+  uint16_t frame_num;   // As in CCD_Frame_t
+  CCD_FrameInfo_t info; // payload_len = 8
+  int32_t shift;        // Q16 pixels; features moved to higher pixels: > 0
+  uint16_t score;       // Normalised correlation at the peak, Q15
+  uint8_t clipped;      // 1 = the peak at the end of the lag window
+  uint8_t reserved;
+} CCD_DriftFrame_t;
+
+// CCD_TELEM_DRIFT reply
+typedef struct {
+  uint8_t mode;    // CCD_PROC_DRIFT_*
+  uint8_t correct; // The resampling grid follows the shift
+  uint8_t lag;
+  uint8_t state;   // CCD_DRIFT_*
+  uint16_t start;  // Band
+  uint16_t len;
+  int32_t shift;   // Of the last frame, Q16 pixels
+  int32_t min;     // Since the reference
+  int32_t max;
+  int32_t mean;
+  int32_t applied; // Shift the resampling grid has moved by
+  uint16_t score;  // Of the last frame, Q15
+  uint16_t ref_frames;
+  uint32_t frames;   // Correlated since the reference
+  uint32_t clipped;  // Of those, peaks at the end of the lag window
+  uint32_t rebuilds; // Grid moves
+} CCD_DriftStatus_t;
+
+typedef struct {
+  uint16_t magic;       // CCD_WIDE_MAGIC
+  uint16_t frame_num;   // As in CCD_Frame_t
+  CCD_FrameInfo_t info; // As the 16-bit output's; payload_len = the values
+  uint8_t format;       // CCD_PROC_WIDE_SUM or CCD_PROC_WIDE_FLOAT
+  uint8_t reserved;
+  uint16_t terms;       // Frames in the sum: N, or K for a rolling output
+} CCD_WideHeader_t;
+
+// CCD_TELEM_WIDE reply
+typedef struct {
+  uint8_t format;   // CCD_PROC_WIDE_*
+  uint8_t queued;   // Output buffers waiting for USB
+  uint16_t dropped; // Outputs lost, both buffers queued
+} CCD_WideStatus_t;
+
+// CCD_TELEM_BANDS reply
+typedef struct {
+  uint8_t count;  // Bands applied, 0 = off
+  uint8_t staged; // Bands in the staged list
+  uint16_t reserved;
+  uint32_t frames; // Band frames sent since boot
+} CCD_BandsStatus_t;
+
+// CCD_TELEM_FOCUS reply
+typedef struct {
+  uint8_t count;       // Lines applied, 0 = off
+  uint8_t staged;      // Lines in the staged list
+  uint32_t frames;     // Focus frames sent since boot
+  uint32_t unresolved; // Line values sent without a width
+  uint16_t fwhm;       // Last frame: mean over its lines with one, Q8.8
+  uint16_t resolved;   // Its lines with a width
+} CCD_FocusStatus_t;
+
+// CCD_TELEM_DESPIKE reply
+typedef struct {
+  uint8_t mode;   // CCD_PROC_DESPIKE_*
+  uint8_t sigma;  // Tenths
+  uint16_t floor; // Counts
+  uint8_t held;   // Frames in the history, 2 = full
+  uint8_t reserved[3];
+  uint32_t frames;   // Frames through the stage with a full history
+  uint32_t spiked;   // Of those, frames with a pixel replaced (sigma mode)
+  uint32_t replaced; // Pixels replaced (sigma mode)
+  uint32_t worst;    // Most pixels replaced in one frame
+  uint32_t last;     // Pixels replaced in the last frame
+  uint32_t restarts; // Histories dropped on a frame gap
+} CCD_DespikeStatus_t;
+
+// CCD_TELEM_BASELINE reply
+typedef struct {
+  uint8_t mode;    // CCD_PROC_BASE_*
+  uint8_t reserved;
+  uint16_t width;  // Pixels
+  uint32_t frames; // Through the stage since boot
+  uint16_t low;    // Baseline of the last frame, as light: least
+  uint16_t high;   // most
+  uint16_t mean;
+  uint32_t clipped; // Pixels of the last frame below it, sent as no light
+} CCD_BaselineStatus_t;
+
+// CCD_TELEM_DEFECT reply
+typedef struct {
+  uint8_t enabled;
+  uint8_t stored;   // The map is the one in flash
+  uint16_t defects; // Pixels in the map
+  uint16_t listed;  // Of them, replaced (CCD_PROC_DEFECT_MAX at most)
+  uint16_t hot;     // Found by the last detection in the master dark
+  uint16_t dead;    // and in the flat-field gains
+  uint16_t offset;  // Byte of the map in bitmap[0]
+  uint32_t frames;  // Frames corrected since boot
+  uint8_t bitmap[CCD_PROC_DEFECT_CHUNK]; // Past the map's end: 0
+} CCD_DefectStatus_t;
+
+// CCD_FrameStats_t.centroid when the frame is flat (signal = 0)
+#define CCD_PROC_NO_CENTROID 0xFFFFFFFFUL
+
+typedef struct {
+  float coef[CCD_WL_ORDER_MAX + 1]; // nm = sum of coef[k] * pixel^k
+  float start_nm;   // Resampling grid: sample i at start_nm + i * step_nm,
+  float step_nm;    // 0 = from the calibration at the first and last pixel
+  uint8_t resample; // 1 = frames go out on the grid
+  uint8_t state;    // CCD_WL_*, set by the device
+} CCD_Wavelength_t;
+
+typedef struct {
+  int16_t temp;  // 0.01 degC, rising from knot to knot
+  uint16_t gain; // Dark current in any unit; only ratios are used
+} CCD_DarkTempKnot_t;
+
+// CCD_CMD_DARK_TEMP reply
+typedef struct {
+  uint8_t count;     // Knots, 0 = model off
+  uint8_t active;    // The master dark is scaled to the sensor temperature
+  int16_t dark_temp; // Sensor at the master dark, CCD_TEMP_NONE = none
+  int16_t temp;      // Sensor temperature the dark is scaled to
+  uint16_t ratio;    // Dark current there / at the master dark, Q12
+  uint16_t ref;      // Zero-dark level of the master dark
+  uint16_t reserved;
+} CCD_DarkTempStatus_t;
+
+// CCD_CMD_BLACK reply
+typedef struct {
+  uint8_t enabled;
+  uint8_t reserved;
+  uint16_t black; // Of the last frame, before the shift
+  uint16_t level; // CCD_PROC_BLACK_LEVEL
+} CCD_BlackStatus_t;
+
+typedef struct {
+  uint16_t start; // First sensor pixel
+  uint16_t len;   // Sensor pixels (output: len / bin)
+} CCD_RoiWindow_t;
+
+// CCD_TELEM_AUTOROI reply
+typedef struct {
+  uint8_t mode;        // CCD_PROC_AUTOROI_OFF or ON
+  uint8_t state;       // CCD_AUTOROI_*
+  uint8_t lines;       // Windows wanted
+  uint8_t frames;      // Averaged per search
+  uint16_t margin;     // Pixels either side of a line
+  uint16_t interval;   // Seconds between searches, 0 = only on request
+  uint8_t windows;     // In roi, after merging
+  uint8_t found;       // Lines the last search found
+  uint32_t searches;   // Finished since boot
+  CCD_RoiWindow_t roi[CCD_PROC_ROI_MAX];
+} CCD_AutoRoiStatus_t;
+#pragma pack(pop)
+
+// Pixels all windows may add up to, so that header, window list and pixels
+// still fit in one slot
+#define CCD_PROC_ROI_PIXELS                                                    \
+  ((sizeof(CCD_Frame_t) - sizeof(CCD_ShapedHeader_t) -                        \
+    CCD_PROC_ROI_MAX * sizeof(CCD_RoiWindow_t)) /                              \
+   sizeof(uint16_t))
+
+// proc_abs_mode values
+#define CCD_PROC_ABS_OFF 0
+#define CCD_PROC_ABS_TRANSMITTANCE 1 // 32768 = 1.0, saturating at 65535
+#define CCD_PROC_ABS_ABSORBANCE 2    // 32768 + 4096 per AU
+#define CCD_PROC_ABS_REF_MAX 256     // Frames per reference
+
+// proc_abs_state values
+#define CCD_ABS_NONE 0
+#define CCD_ABS_READY 1     // A reference is applied in the modes above
+#define CCD_ABS_CAPTURING 2 // A new reference is being averaged
+
+#define CCD_ABS_K 1233.0189f // 4096 * log10(2): output counts per octave
+
+// proc_despike values
+#define CCD_PROC_DESPIKE_OFF 0
+#define CCD_PROC_DESPIKE_MEDIAN 1 // Median of this frame and the two before
+#define CCD_PROC_DESPIKE_SIGMA 2  // Only the outliers to it replaced by it
+
+// proc_despike_sigma, in tenths, and proc_despike_floor, in counts
+#define CCD_PROC_DESPIKE_SIGMA_MIN 10U // 1.0
+#define CCD_PROC_DESPIKE_SIGMA_DEF 50U // 5.0
+#define CCD_PROC_DESPIKE_FLOOR 200U
+
+// proc_baseline values
+#define CCD_PROC_BASE_OFF 0
+#define CCD_PROC_BASE_SUBTRACT 1 // The light above the baseline
+#define CCD_PROC_BASE_ESTIMATE 2 // The baseline in place of the frame
+
+// proc_base_width, in pixels: the span of the opening and of the smoothing
+#define CCD_PROC_BASE_DECIM 16 // Pixels per block of the decimated copy
+#define CCD_PROC_BASE_BLOCKS                                                   \
+  ((CCD_BUFFER_SIZE + CCD_PROC_BASE_DECIM - 1) / CCD_PROC_BASE_DECIM)
+#define CCD_PROC_BASE_WIDTH_MIN (2 * CCD_PROC_BASE_DECIM)
+#define CCD_PROC_BASE_WIDTH_MAX 2048
+#define CCD_PROC_BASE_WIDTH_DEF 256
+
+// Savitzky-Golay smoothing (proc_smooth_window: odd, 0 = off; order 4 and 5
+// need a window of 7 or more)
+#define CCD_PROC_SMOOTH_MIN 5
+#define CCD_PROC_SMOOTH_MAX 25
+#define CCD_PROC_SMOOTH_SETS                                                   \
+  ((CCD_PROC_SMOOTH_MAX - CCD_PROC_SMOOTH_MIN) / 2 + 1) // Windows with a set
+#define CCD_PROC_SMOOTH_ORDER 3 // Default, as PeakDetector in ccd_monitor
+
+// CCD_Proc_Profile_t.max_cycles entries, in pipeline order
+#define CCD_PROC_STAGE_LINEARITY 0
+#define CCD_PROC_STAGE_DARK 1    // Black level, dark capture and subtraction
+#define CCD_PROC_STAGE_FLAT 2
+#define CCD_PROC_STAGE_COADD 3
+#define CCD_PROC_STAGE_ROLLING 4
+#define CCD_PROC_STAGE_CHANGE 5
+#define CCD_PROC_STAGE_ABSORB 6
+#define CCD_PROC_STAGE_SMOOTH 7
+#define CCD_PROC_STAGE_RESAMPLE 8
+#define CCD_PROC_STAGE_STATS 9
+#define CCD_PROC_STAGE_PEAKS 10
+#define CCD_PROC_STAGE_SHAPE 11  // ROI, binning, packing and compression
+#define CCD_PROC_STAGE_BANDS 12  // Appended: runs between peaks and shaping
+#define CCD_PROC_STAGE_DESPIKE 13 // Appended: between flat field and co-add
+#define CCD_PROC_STAGE_DEFECT 14  // Appended: between flat field and despike
+#define CCD_PROC_STAGE_DRIFT 15   // Appended: between smoothing and resampling
+#define CCD_PROC_STAGE_MATCH 16   // Appended: between resampling and stats
+#define CCD_PROC_STAGE_REF 17     // Appended: between flat field and defects
+#define CCD_PROC_STAGE_BASELINE 18 // Appended: between resampling and matching
+#define CCD_PROC_STAGE_FOCUS 19   // Appended: between bands and shaping
+#define CCD_PROC_STAGE_MODEL 20   // Appended: between matching and stats
+#define CCD_PROC_STAGES 21
+
+typedef struct {
+  volatile uint32_t coadded;        // Frames absorbed into co-add outputs
+  volatile uint32_t coadd_restarts; // Partial sums dropped on a frame gap
+  volatile uint32_t rice_fallbacks; // Frames sent uncompressed (no gain)
+  volatile uint32_t unchanged;      // Frames dropped by change detection
+} CCD_Proc_Stats_t;
+
+extern CCD_Proc_Stats_t ccd_proc_stats;
+
+// Worst cases since the last CCD_Proc_ProfileReset(), in CPU cycles. Main
+// loop only, like CCD_Proc_Frame().
+typedef struct {
+  uint32_t frames;                      // Passes through CCD_Proc_Frame()
+  uint32_t max_total;                   // Longest pass
+  uint32_t max_cycles[CCD_PROC_STAGES]; // Longest time in each stage
+} CCD_Proc_Profile_t;
+
+extern CCD_Proc_Profile_t ccd_proc_profile;
+
+// Kernel benchmark (CCD_TELEM_KERNEL): one kernel, CCD_PROC_BENCH_RUNS
+// times over a test line in each region below, from the main loop (about
+// 10 ms at worst; frames wait in the ring meanwhile). The runs are the
+// pipeline's own code on its own tables, so the result is a baseline for
+// the kernels as built, not a model of them. Each region also returns a
+// check of the first run's output (the line, the shaping buffer and the
+// kernel's result), so a rewritten kernel can be shown bit-exact against
+// the build before it, on the same tables, before its timings count.
+// COADD's sum and DESPIKE's history carry over from run to run and call
+// to call, so their checks only compare right after a reset.
+#define CCD_PROC_KERNEL_LINEARITY 0 // In place, as the stages below
+#define CCD_PROC_KERNEL_DARK 1      // Subtraction
+#define CCD_PROC_KERNEL_FLAT 2
+#define CCD_PROC_KERNEL_COADD 3  // Accumulate into the DTCM sum (restarts it)
+#define CCD_PROC_KERNEL_CHANGE 4 // Difference to the last frame passed
+#define CCD_PROC_KERNEL_STATS 5
+#define CCD_PROC_KERNEL_BIN 6    // By 4, into the shaping buffer (DTCM)
+#define CCD_PROC_KERNEL_PACK12 7 // Shaping buffer -> region, as P12
+#define CCD_PROC_KERNEL_RICE 8   // Shaping buffer -> region, as C1
+#define CCD_PROC_KERNEL_CRC 9    // CRC-32 of the pixels (CCD_Crc_Compute())
+#define CCD_PROC_KERNEL_DESPIKE 10 // Sigma mode on the history (restarts it)
+#define CCD_PROC_KERNELS 11
+
+// Where the line is. The code runs from ITCM in every case; the tables and
+// the shaping buffer stay in DTCM.
+#define CCD_PROC_REGION_DTCM 0 // The temporal reference (next frame: a key)
+#define CCD_PROC_REGION_AXI 1  // AXI SRAM, as a ring slot; cached and warm
+#define CCD_PROC_REGION_AXI_COLD 2 // Cleaned and invalidated before each run,
+                                   // as a slot after its DMA (cached build)
+#define CCD_PROC_REGION_D2 3 // Non-cacheable RAM_D2 (cached build; without
+                             // the cache the ring fills RAM_D2, and AXI is
+                             // the uncached case)
+#define CCD_PROC_REGIONS 4
+
+#define CCD_PROC_BENCH_RUNS 16 // Per region
+
+#pragma pack(push, 1)
+typedef struct {
+  uint8_t kernel;  // CCD_PROC_KERNEL_*
+  uint8_t regions; // CCD_PROC_REGIONS
+  uint16_t runs;   // CCD_PROC_BENCH_RUNS
+  struct {
+    uint32_t min_cycles; // Fastest run, least disturbed by interrupts
+    uint32_t mean_cycles;
+    uint32_t check; // CRC-32s of the output, XORed
+  } region[CCD_PROC_REGIONS]; // 0, 0, 0 = not in this build, or (AXI)
+                              // the scratch line was busy
+} CCD_ProcBench_t;
+#pragma pack(pop)
+extern volatile uint16_t proc_coadd_n;   // Frames per co-add output, 1 = off
+extern volatile uint16_t proc_rolling_n; // Rolling window length, 1 = off
+extern volatile uint16_t proc_dark_request; // Frames for a new dark, 0 = none
+extern volatile uint8_t proc_dark_state;    // CCD_DARK_* bits
+extern volatile uint8_t proc_flat_enable;
+extern volatile uint8_t proc_flat_request; // CCD_FLAT_REQ_*, 0 = none
+extern volatile uint8_t proc_lin_enable;
+extern volatile uint8_t proc_black_enable; // CCD_CMD_BLACK
+extern volatile uint16_t proc_event_threshold; // Counts per pixel, 0 = off
+extern volatile uint16_t proc_heartbeat_ms;    // Longest gap between frames
+extern volatile uint8_t proc_bin;              // Bin factor, 1 = off
+extern volatile uint8_t proc_bits;         // CCD_PROC_PACK_*
+extern volatile uint8_t proc_codec;        // CCD_PROC_CODEC_*
+extern volatile uint8_t proc_keyframe_request; // Next frame is a keyframe
+extern volatile uint8_t proc_stats;            // CCD_PROC_STATS_*
+extern volatile uint16_t proc_stats_level;     // Saturation threshold
+extern volatile uint8_t proc_peaks;           // CCD_PROC_PEAKS_*
+extern volatile uint8_t proc_peak_fit;        // CCD_PROC_FIT_*
+extern volatile uint16_t proc_peak_threshold; // Light above which a peak counts
+extern volatile uint16_t proc_peak_distance;  // Pixels between peaks, >= 1
+extern volatile uint8_t proc_abs_mode;      // CCD_PROC_ABS_*
+extern volatile uint16_t proc_abs_request;  // Frames for a new I0, 0 = none
+extern volatile uint8_t proc_abs_state;     // CCD_ABS_*
+extern volatile uint8_t proc_smooth_window;   // Savitzky-Golay taps, 0 = off
+extern volatile uint8_t proc_smooth_order;
+extern volatile uint8_t proc_despike;        // CCD_PROC_DESPIKE_*
+extern volatile uint8_t proc_despike_sigma;  // Tenths
+extern volatile uint16_t proc_despike_floor; // Counts
+extern volatile uint8_t proc_baseline;    // CCD_PROC_BASE_*
+extern volatile uint16_t proc_base_width; // Pixels
+extern volatile uint8_t proc_defect_enable;
+extern volatile uint8_t proc_drift;         // CCD_PROC_DRIFT_*
+extern volatile uint8_t proc_drift_correct; // Move the resampling grid
+extern volatile uint16_t proc_drift_request; // Frames for a new reference
+extern volatile uint8_t proc_drift_state;    // CCD_DRIFT_*
+extern volatile uint8_t proc_wide;           // CCD_PROC_WIDE_*
+
+void CCD_Proc_Init(void);
+void CCD_Proc_Poll(void);
+
+void CCD_Proc_Reset(void);
+uint8_t CCD_Proc_Active(void);
+void CCD_Proc_ProfileReset(void);
+
+// Main loop, between frames; 0 for an unknown kernel
+uint8_t CCD_Proc_Bench(uint8_t kernel, CCD_ProcBench_t *out);
+
+// Returns the frame to transmit and its length in bytes, or NULL if a stage
+// absorbed it
+CCD_Frame_t *CCD_Proc_Frame(CCD_Frame_t *frame, uint32_t *len);
+
+// A raw frame binned (bin 1, 2, 4 or 8) into dst as a 16-bit shaped frame
+// of the whole line, none of the stages applied; returns its length
+uint32_t CCD_Proc_Preview(CCD_Frame_t *dst, const CCD_Frame_t *src,
+                          uint8_t bin);
+
+// Stage n ROI windows for the next frame; 0 if any window is out of range
+uint8_t CCD_Proc_SetRoi(const CCD_RoiWindow_t *w, uint8_t n);
+uint8_t CCD_Proc_RoiValid(const CCD_RoiWindow_t *w, uint8_t n); // Unstaged
+uint8_t CCD_Proc_GetRoi(CCD_RoiWindow_t *w); // Windows set last, 0 = line
+
+// Main loop: auto ROI on or off with its settings, see
+// CCD_PROC_AUTOROI_ON; 0 if one is out of range, nothing changes. A change
+// starts a new search.
+uint8_t CCD_Proc_SetAutoRoi(uint8_t mode, uint8_t lines, uint8_t frames,
+                            uint16_t margin, uint16_t interval);
+void CCD_Proc_AutoRoiAgain(void);
+void CCD_Proc_GetAutoRoi(CCD_AutoRoiStatus_t *out);
+
+// Main loop: n bands into the staged list from first, then applied with
+// apply (see CCD_BANDS_APPLY); 0 if a band is out of range, nothing changes
+uint8_t CCD_Proc_SetBands(uint8_t first, const CCD_Band_t *b, uint8_t n,
+                          uint8_t apply);
+void CCD_Proc_GetBands(CCD_BandsStatus_t *out);
+
+// Main loop: the same for the focus lines; 0 if a window is out of range
+uint8_t CCD_Proc_SetFocus(uint8_t first, const CCD_FocusLine_t *l, uint8_t n,
+                          uint8_t apply);
+void CCD_Proc_GetFocus(CCD_FocusStatus_t *out);
+
+// A smoothing window and order with a coefficient set
+uint8_t CCD_Proc_SmoothValid(uint8_t window, uint8_t order);
+
+// Main loop: a CCD_PROC_DESPIKE_* mode, sigma in tenths and the floor
+// level in counts; 0 if the mode is unknown or sigma below
+// CCD_PROC_DESPIKE_SIGMA_MIN, nothing changes. A new mode keeps the history.
+uint8_t CCD_Proc_SetDespike(uint8_t mode, uint8_t sigma, uint16_t level);
+void CCD_Proc_GetDespike(CCD_DespikeStatus_t *out);
+
+// Main loop: a CCD_PROC_BASE_* mode and the width in pixels; 0 if the mode
+// is unknown or the width out of range, nothing changes
+uint8_t CCD_Proc_SetBaseline(uint8_t mode, uint16_t width);
+void CCD_Proc_GetBaseline(CCD_BaselineStatus_t *out);
+
+// Main loop. Detection replaces the map with the pixels beyond hot counts
+// in the master dark and beyond dead (Q15) in the flat-field gains, and
+// turns the replacement on; 0 if both are 0, or one is set without its
+// dark or flat field. Write edits n map bytes from offset (0 if past its
+// end). Every change rebuilds the list and leaves flash as it was.
+uint8_t CCD_Proc_DetectDefects(uint16_t hot, uint16_t dead);
+uint8_t CCD_Proc_WriteDefects(uint32_t offset, const uint8_t *map,
+                              uint32_t n);
+void CCD_Proc_ClearDefects(void);
+uint8_t CCD_Proc_SaveDefects(void); // Blocks for the sector erase
+uint8_t CCD_Proc_LoadDefects(void); // 0 if none is stored
+void CCD_Proc_GetDefects(uint32_t offset, CCD_DefectStatus_t *out);
+
+// Main loop: the drift band, even len pixels from start, and the lag
+// window; 0 if a lag would read past the line, nothing changes. A new
+// band drops the reference.
+uint8_t CCD_Proc_SetDriftBand(uint16_t start, uint16_t len, uint8_t lag);
+void CCD_Proc_GetDrift(CCD_DriftStatus_t *out);
+
+void CCD_Proc_GetWide(CCD_WideStatus_t *out);
+
+// Main loop. Set validates the calibration, fills in a default grid and
+// builds the resampling table; 0 (and the old one kept) if the polynomial is
+// not monotonic over the line or the grid runs against it.
+uint8_t CCD_Proc_SetWavelength(const CCD_Wavelength_t *cal);
+void CCD_Proc_GetWavelength(CCD_Wavelength_t *cal);
+uint8_t CCD_Proc_SaveWavelength(void); // Blocks for the sector erase
+
+// Main loop. count 0 turns the dark temperature model off; otherwise 2 ..
+// CCD_PROC_DARKT_KNOTS knots with rising temperatures and non-zero gains,
+// or 0 and the table in use kept
+uint8_t CCD_Proc_SetDarkTemp(const CCD_DarkTempKnot_t *k, uint8_t count);
+uint8_t CCD_Proc_GetDarkTemp(CCD_DarkTempKnot_t *k); // Returns the count
+void CCD_Proc_DarkTempStatus(CCD_DarkTempStatus_t *out);
+void CCD_Proc_BlackStatus(CCD_BlackStatus_t *out);
+
+#if CCD_SHUTTER
+// Main loop, a closed-shutter frame (ccd_shutter.h): linearised and
+// black-levelled in place, and folded into the master dark 1 / 2^shift of
+// the way; 0 while a "D<m>" capture runs and it is left out
+uint8_t CCD_Proc_LiveDark(CCD_Frame_t *frame, uint8_t shift);
+uint8_t CCD_Proc_LiveDarkValid(void); // The master dark is the estimate
+#endif
+
+// Store count little-endian knots at offset into the linearity upload
+// table; the other actions are CCD_LIN_CMD_* and return 0 on failure (no
+// table in flash, flash error)
+void CCD_Proc_LinWrite(uint32_t offset, const uint8_t *data, uint32_t count);
+uint8_t CCD_Proc_LinService(uint8_t action);
+
+// Store count little-endian Q15 gains at pixel offset into the upload table
+void CCD_Proc_FlatWrite(uint32_t offset, const uint8_t *data, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_PROC_H */
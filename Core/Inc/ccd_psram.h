@@ -0,0 +1,55 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_psram.h
+ * @brief          : External QSPI PSRAM on QUADSPI (burst frame store)
+ ******************************************************************************
+ * Built with CCD_BURST_PSRAM=1 for an APS6404L-class 8 MB QSPI PSRAM on
+ * QUADSPI bank 1, set up by CubeMX (hqspi, MDMA channel for its TX). The
+ * H743 QUADSPI cannot write in memory-mapped mode, so the device has two
+ * phases:
+ *  - writing: indirect quad writes (0x38), data moved by the MDMA. A write
+ *    is split into CCD_PSRAM_CHUNK pieces, because the PSRAM must see its
+ *    chip select high at least every 8 us (tCEM) and QUADSPI cannot break a
+ *    transfer by itself. The next piece starts from the TX complete
+ *    interrupt.
+ *  - reading: memory-mapped quad reads (0xEB) at CCD_PSRAM_BASE, so the
+ *    USB engine sends straight from the PSRAM. The CS timeout releases the
+ *    chip between the short accesses the USB copy makes.
+ * The D-cache may hold lines of the mapped window from an earlier read
+ * phase. CCD_PSRAM_Map() does not drop them; the reader invalidates what
+ * it reads.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_PSRAM_H
+#define __CCD_PSRAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_PSRAM_BASE 0x90000000UL // QUADSPI memory-mapped window
+#define CCD_PSRAM_SIZE (8UL << 20)
+#define CCD_PSRAM_CHUNK 256U // Bytes per write command: ~5 us at 100 MHz
+
+// After MX_QUADSPI_Init(): reset the chip and put it in quad mode
+uint8_t CCD_PSRAM_Init(void);
+
+// Writing phase (main loop). Starts an asynchronous write; 0 if one is
+// still running or the device is mapped. src must not be in DTCM.
+uint8_t CCD_PSRAM_Write(uint32_t addr, const void *src, uint32_t len);
+uint8_t CCD_PSRAM_Busy(void);
+uint8_t CCD_PSRAM_Failed(void); // The last write hit a QUADSPI error
+
+// Reading phase: map for reads, unmap to write again
+uint8_t CCD_PSRAM_Map(void);
+void CCD_PSRAM_Unmap(void);
+uint8_t CCD_PSRAM_Mapped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_PSRAM_H */
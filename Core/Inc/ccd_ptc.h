@@ -0,0 +1,123 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_ptc.h
+ * @brief          : Photon transfer curves: per-pixel mean and variance maps
+ ******************************************************************************
+ * A characterization run (CCD_TELEM_PTC) takes up to CCD_PTC_LEVELS
+ * integration times in turn and, at each, N consecutive raw frames into
+ * per-pixel sums in the shared scratch (ccd_mem.h). Only the result crosses
+ * USB: one CCD_PtcHeader_t per level, CRC stamped, and every pixel's mean
+ * and sample variance (CCD_PtcPixel_t, float) behind it, 29.5 KB where the
+ * frames would have been N x 7.4 KB. Over an exposure sweep from dark to
+ * near saturation the levels are the points of a photon transfer curve;
+ * each header has the curve point ready, the light and the variance
+ * averaged over the effective pixels, the light taken against the mean of
+ * the light-shielded ones. Gain in e-/count is light / variance along the
+ * shot-noise part, read noise the square root of the dark variance.
+ *
+ * The sums are exact: each pixel's offset from its value in the first
+ * frame of the level, and the square of it, in int32 and uint64, so the
+ * mean and variance come out in double at the end with neither the
+ * rounding of a running float update nor the cancellation of raw sums.
+ * A frame_num gap restarts the level.
+ *
+ * The run switches to mode 0 with auto-exposure off; a bracket ("Q") or
+ * a sequence ("Z") must be off. Each level sets its time through the
+ * preloaded SH path, skips the frames until it took effect, and waits
+ * for the maps of the level before to be on their way (they share the
+ * buffer with the squares). Frames do not reach the host meanwhile. At
+ * the end the integration time from before the run is set again. Not
+ * kept in flash. The start is refused while another mode holds the
+ * scratch; the run gives it back once it ended and its last maps went out.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_PTC_H
+#define __CCD_PTC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_PTC_MAGIC 0xABDD
+#define CCD_PTC_LEVELS 32U
+#define CCD_PTC_FRAMES_MIN 2U // Per level, for a sample variance
+
+// CCD_TELEM_PTC argument (CCD_TELEM_KEEP = only the status)
+#define CCD_PTC_SET 0   // u8 first level, then u32 t_us each (0 = as set)
+#define CCD_PTC_START 1 // u16 frames per level
+#define CCD_PTC_STOP 2
+
+// CCD_PtcStatus_t.state
+#define CCD_PTC_IDLE 0
+#define CCD_PTC_STARTING 1 // Waiting for the switch to mode 0
+#define CCD_PTC_SETTLE 2   // Waiting for the level's exposure and buffer
+#define CCD_PTC_RUN 3      // Summing the level's frames
+#define CCD_PTC_SENDING 4  // Maps waiting for room on USB
+#define CCD_PTC_DONE 5     // Every level sent, or stopped
+#define CCD_PTC_ERROR 6    // An integration time is not reachable
+
+#pragma pack(push, 1)
+typedef struct {
+  float mean;     // Raw counts (light lowers them)
+  float variance; // Sample variance, counts^2
+} CCD_PtcPixel_t;
+
+typedef struct {
+  uint16_t magic;       // CCD_PTC_MAGIC
+  uint16_t frame_num;   // Of the level's last frame
+  CCD_FrameInfo_t info; // Of the level's last frame; payload_len = the maps
+  uint8_t level;
+  uint8_t levels;
+  uint16_t frames;      // In the sums
+  uint32_t t_us;        // Integration time
+  uint32_t first_seq;   // Of the level's first frame
+  float black;          // Mean of the shielded pixels' means
+  float light;          // black - mean, over the effective pixels
+  float variance;       // Mean variance over the effective pixels
+  uint32_t restarts;    // Of the run so far
+} CCD_PtcHeader_t;
+
+// CCD_TELEM_PTC reply
+typedef struct {
+  uint8_t state;  // CCD_PTC_*
+  uint8_t level;  // Running, or the last one
+  uint8_t levels; // Set
+  uint8_t reserved;
+  uint16_t frames;     // Per level
+  uint16_t count;      // In the level's sums so far
+  uint32_t t_us;       // The level's integration time
+  uint32_t maps;       // Levels sent since boot
+  uint32_t dropped;    // Levels lost, the port closed
+  uint32_t restarts;   // Levels restarted on a frame gap
+  uint32_t elapsed_ms; // Since the run started
+  float black;         // Of the last level sent
+  float light;
+  float variance;
+} CCD_PtcStatus_t;
+#pragma pack(pop)
+
+// Command side (main loop): 0 if out of range or a run is in progress
+uint8_t CCD_Ptc_SetLevels(uint8_t first, const uint32_t *t_us, uint8_t n);
+uint8_t CCD_Ptc_Start(uint16_t frames);
+void CCD_Ptc_Stop(void);
+void CCD_Ptc_Status(CCD_PtcStatus_t *out);
+
+// 1 while frames go to the run instead of the host (send them singly)
+uint8_t CCD_Ptc_Active(void);
+
+// Every frame while active. The slot is always consumed: the maps are
+// queued from the stage's own buffer, and the slot is released here.
+void CCD_Ptc_Frame(CCD_Frame_t *frame);
+
+// Send path, each pass: starts the run after the mode switch, queues the
+// maps of a finished level, and moves to the next one
+void CCD_Ptc_Poll(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_PTC_H */
@@ -0,0 +1,95 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_rec.h
+ * @brief          : Recording to an SD card (SDMMC1, IDMA)
+ ******************************************************************************
+ * Built with CCD_SD=1 on top of the CubeMX SDMMC1 driver (4-bit bus, hsd1).
+ * While recording, the completed frames go from the ring to the card
+ * instead of USB, CRC-stamped but otherwise raw (no processing stages).
+ * Like the USB transport there is no copy: the IDMA reads the ring slots
+ * and they are released when the write completes.
+ *
+ * The card holds one recording in a raw area from block CCD_REC_BASE on,
+ * no file system:
+ *   block CCD_REC_BASE      CCD_RecHeader_t, zero-padded to a block
+ *   from CCD_REC_BASE + 1   frames back to back, byte for byte CCD_Frame_t
+ * A CCD_Frame_t is 14.5 blocks, so frames go out in adjacent pairs (29
+ * blocks) and runs of up to CCD_REC_BATCH frames per multi-block write.
+ * An odd frame left at the end of the ring is skipped once, and after that
+ * every run starts on an even slot. The header is written at the start with
+ * frames = 0 and again at the stop with the count. A reader that finds 0
+ * (power lost mid-recording) takes frames until the first one whose CRC or
+ * seq does not follow.
+ *
+ * Every CCD_REC_PREVIEW frames the newest frame of a run also goes to USB,
+ * as a normal frame, when the link has room; with the binned preview on
+ * (ccd_preview.h) that goes instead, at its own rate. Status and control
+ * are the binary CCD_CMD_RECORD command. Recording stops by itself when
+ * the card is full or on a write error (state CCD_REC_ERROR, sd_error).
+ ******************************************************************************
+ */
+
+#ifndef __CCD_REC_H
+#define __CCD_REC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_REC_BASE 2048U   // First block of the area: 1 MB into the card
+#define CCD_REC_BATCH 8U     // Frames per write at most (even, 58 KB)
+#define CCD_REC_PREVIEW 32U  // Frames per USB preview
+#define CCD_REC_MAGIC 0x52444343UL // "CCDR"
+#define CCD_REC_VERSION 1
+
+// CCD_RecStatus_t.state
+#define CCD_REC_IDLE 0
+#define CCD_REC_RECORDING 1
+#define CCD_REC_STOPPING 2 // Last write and the final header in flight
+#define CCD_REC_ERROR 3    // Stopped on a card error; the next start clears it
+
+// CCD_CMD_RECORD actions
+#define CCD_REC_CMD_STOP 0
+#define CCD_REC_CMD_START 1
+#define CCD_REC_CMD_STATUS 2 // Only the ack payload
+
+#pragma pack(push, 1)
+typedef struct {
+  uint32_t magic;       // CCD_REC_MAGIC
+  uint16_t version;     // CCD_REC_VERSION
+  uint16_t frame_size;  // sizeof(CCD_Frame_t)
+  uint32_t first_block; // Of the first frame
+  uint32_t frames;      // Recorded, 0 while recording
+  uint32_t first_seq;   // info.seq of the first frame
+  uint32_t tick_hz;     // info.timestamp clock
+} CCD_RecHeader_t;
+
+typedef struct {
+  uint8_t state;      // CCD_REC_*
+  uint8_t reserved[3];
+  uint32_t frames;    // Written so far
+  uint32_t capacity;  // Frames that fit in the area
+  uint32_t skipped;   // Released unwritten to realign on the ring
+  uint32_t dropped;   // Lost in the ring (card too slow) since the start
+  uint32_t first_seq;
+  uint32_t sd_error;  // HAL_SD_GetError() of the failed write
+} CCD_RecStatus_t;
+#pragma pack(pop)
+
+// Command side (main loop)
+uint8_t CCD_Rec_Start(void); // 0 if not idle, no card or the card too small
+void CCD_Rec_Stop(void);
+void CCD_Rec_Status(CCD_RecStatus_t *st);
+
+// Main loop stage, ahead of Send_CCD_Frames(). While it runs the ring is
+// the recorder's and Send_CCD_Frames() leaves it alone.
+void CCD_Rec_Poll(void);
+uint8_t CCD_Rec_Active(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_REC_H */
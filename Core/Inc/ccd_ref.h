@@ -0,0 +1,96 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_ref.h
+ * @brief          : Reference photodiode on ADC3, per-frame source level
+ ******************************************************************************
+ * With CCD_REF_PD, a photodiode looking at the lamp (PC1, ADC3_INP11)
+ * tracks the source, so that a flicker or a drift of the lamp can be told
+ * apart from a change in the sample. TIM15 triggers one conversion of
+ * ADC3's regular group every 1 / CCD_REF_RATE_HZ, the oversampler sums
+ * 2^shift of them into each result (no shift, so nothing is lost), and
+ * DMA1_Stream2 writes the results round a ring of CCD_REF_SLOTS words. No
+ * interrupt runs: the core only reads the ring.
+ *
+ * CCD_Acq_ApplySampling() restarts the chain and picks the smallest shift
+ * whose half ring spans twice the longer of the ICG period and the fast
+ * shutter, about 2.6 s at the top shift. As each frame is published, the
+ * results that completed during its integration (the exposure_us before
+ * info.timestamp) are found from the time since then and the DMA's write
+ * position, and their mean, in 1/16 counts, is the frame's level. Each
+ * result is 5 us << shift long, so the window is right to one result; the
+ * newest part of a longer exposure is taken.
+ *
+ * CCD_FrameInfo_t has no room left, so the level is kept by seq for the
+ * last CCD_REF_HIST frames and read back through CCD_TELEM_REFERENCE (the
+ * saturation flag does the same). CCD_REF_NORMALIZE also divides it out:
+ * a processing stage after the flat field (ccd_proc.h) scales each
+ * frame's signal by target / level, at most 2x, so frames read as if the
+ * lamp were at the target. A target of 0 takes the next frame's level.
+ * Frames without a level pass as they are, and are counted.
+ *
+ * The temperatures convert on ADC3's injected group in between
+ * (ccd_temp.h); each holds the triggers off for under 0.1 ms every
+ * CCD_TEMP_MS, which delays the results by as much and leaves their means
+ * as they are.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_REF_H
+#define __CCD_REF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "frame_ring.h"
+#include "main.h"
+
+#define CCD_REF_RATE_HZ 200000U // TIM15 triggers, one conversion each
+#define CCD_REF_SLOTS 1024U     // Results in the DMA ring, a power of 2
+#define CCD_REF_SHIFT_MAX 10U   // 2^10 conversions per result at most
+#define CCD_REF_HIST FRAME_RING_SLOTS // Frames whose level is kept
+#define CCD_REF_LEVELS 15U            // Of those, in the status
+
+// CCD_TELEM_REFERENCE modes
+#define CCD_REF_OFF 0
+#define CCD_REF_MEASURE 1   // Level of every frame, in the status
+#define CCD_REF_NORMALIZE 2 // And divided out of the frame
+
+#pragma pack(push, 1)
+// CCD_TELEM_REFERENCE reply
+typedef struct {
+  uint8_t mode;       // CCD_REF_*
+  uint8_t shift;      // 2^shift conversions per result
+  uint16_t results;   // Results in the newest frame's level
+  uint32_t target;    // Normalization level, 1/16 counts (0 = the next)
+  uint32_t seq;       // Newest frame measured
+  uint32_t frames;    // Measured since boot
+  uint32_t unmatched; // Normalized without a level, passed as they were
+  uint32_t level[CCD_REF_LEVELS]; // 1/16 counts from seq down, 0 = none
+} CCD_RefStatus_t;
+#pragma pack(pop)
+
+// Boot, after CCD_Temp_Init(): TIM15, the DMA and the regular group
+void CCD_Ref_Init(void);
+
+// CCD_Acq_ApplySampling(): restarts the chain for the period, or stops it
+void CCD_Ref_Apply(void);
+
+// PendSV, with the header stamped: the frame's level
+void CCD_Ref_Frame(const CCD_Frame_t *frame);
+
+// Any mode; a change to or from CCD_REF_OFF takes a restart
+uint8_t CCD_Ref_Set(uint8_t mode, uint32_t target);
+void CCD_Ref_Get(uint8_t *mode, uint32_t *target);
+
+// Main loop, processing: frame seq's Q15 gain to the target, 0 = no level
+uint8_t CCD_Ref_Active(void); // Normalizing
+uint32_t CCD_Ref_Gain(uint32_t seq);
+
+void CCD_Ref_Status(CCD_RefStatus_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_REF_H */
@@ -0,0 +1,110 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_selftest.h
+ * @brief          : Timer chain self-test: fM, ADC trigger, SH and ICG timed
+ ******************************************************************************
+ * A timer left with a wrong period gives frames that look like frames:
+ * the pixels land in the wrong place or integrate for the wrong time and
+ * nothing fails. So after boot and after every mode switch (profiles,
+ * clock divisors, exposure and sync changes all go through one) the
+ * waveforms the chain actually produces are timed and compared with what
+ * the applied profile should give (CCD_Acq_Periods()), within
+ * CCD_SELFTEST_TOL_PPM and the capture resolution:
+ *  - fM: TIM3's OC1REF on its TRGO, captured on TIM15 through ITR1, every
+ *    CCD_SELFTEST_PRESCALE edges. TIM15 is the reference photodiode's
+ *    converter clock, so CCD_REF_PD builds leave fM untested.
+ *  - ADC trigger: TIM4's OC4REF, on TIM12 ITR0, the same way.
+ *  - SH: TIM5's OC3REF, on TIM12 ITR1, every edge. The ICG restarts TIM5
+ *    mid-period, so the longest of the periods taken must match (fM and
+ *    the ADC trigger: the median). An exposure AE changes while it is
+ *    timed is timed again.
+ *  - ICG: TIM1's hardware count of TIM2 TRGO (CCD_Acq_InitIcgCounter())
+ *    with TIM2's count, against the timestamp clock (ccd_time.h) over
+ *    CCD_SELFTEST_ICG_PERIODS periods.
+ * Each channel takes CCD_SELFTEST_PERIODS periods. Fast ones are spun on
+ * in the main loop, at most CCD_SELFTEST_SPIN_US each, once per switch;
+ * slower ones are read one capture per pass. A capture an
+ * interrupt made the loop miss (overcapture) starts the channel again,
+ * CCD_SELFTEST_RETRIES times, and then leaves it untested rather than
+ * failed. A channel with no edge in CCD_SELFTEST_TIMEOUT_MS fails.
+ *
+ * Only a free-running chain has fixed periods: in mode 1 and 3, as a sync
+ * or line slave and during a benchmark the test waits, due, until the
+ * chain free-runs again. With the guard on (default), a readout profile
+ * other than "O0" that fails is dropped for "O0", a restart, and counted;
+ * the default timing has nothing safer to go back to. CCD_TELEM_SELFTEST
+ * reads the last result with every expected and measured period, turns
+ * the guard off or on, or runs the test again.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_SELFTEST_H
+#define __CCD_SELFTEST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_SELFTEST_SETTLE_MS 20U   // After the switch, before the first
+#define CCD_SELFTEST_PERIODS 3U      // Captured per channel
+#define CCD_SELFTEST_PRESCALE 8U     // fM and ADC edges per capture
+#define CCD_SELFTEST_SPIN_US 20000U  // Spun on per channel at most
+#define CCD_SELFTEST_RETRIES 8U      // Overcaptures before giving up
+#define CCD_SELFTEST_TIMEOUT_MS 500U // No edge: failed
+#define CCD_SELFTEST_TOL_PPM 1000U   // Same crystal: only rounding
+#define CCD_SELFTEST_ICG_PERIODS 4U
+
+// Channels: bit n of the failed and tested masks
+#define CCD_SELFTEST_FM 0
+#define CCD_SELFTEST_ADC 1
+#define CCD_SELFTEST_SH 2
+#define CCD_SELFTEST_ICG 3
+#define CCD_SELFTEST_CHANNELS 4U
+
+// CCD_SelftestStatus_t.state
+#define CCD_SELFTEST_NONE 0 // Not run since boot
+#define CCD_SELFTEST_DUE 1  // Waiting for a free-running chain to settle
+#define CCD_SELFTEST_RUN 2
+#define CCD_SELFTEST_PASS 3
+#define CCD_SELFTEST_FAIL 4
+
+// CCD_TELEM_SELFTEST operations
+#define CCD_SELFTEST_GUARD_OFF 0
+#define CCD_SELFTEST_GUARD_ON 1
+#define CCD_SELFTEST_AGAIN 2
+
+#pragma pack(push, 1)
+// CCD_TELEM_SELFTEST reply
+typedef struct {
+  uint8_t state;     // CCD_SELFTEST_NONE..FAIL
+  uint8_t failed;    // Channels off their expected period
+  uint8_t tested;    // Channels timed in the last run
+  uint8_t guard;     // A failed profile falls back to "O0"
+  uint32_t runs;     // Finished since boot
+  uint32_t passes;
+  uint32_t failures;
+  uint32_t fallbacks; // Profiles the guard dropped
+  uint32_t retries;   // Overcaptures
+  uint32_t expected[CCD_SELFTEST_CHANNELS]; // Timer ticks, last run
+  uint32_t measured[CCD_SELFTEST_CHANNELS]; // 0 = no edge or untested
+  uint32_t age_ms; // Since the last run ended
+} CCD_SelftestStatus_t;
+#pragma pack(pop)
+
+// Boot, before the timers start: the TRGO outputs and capture timers
+void CCD_Selftest_Init(void);
+
+// After every start of the chain: the next free-running stretch is timed
+void CCD_Selftest_Start(void);
+
+void CCD_Selftest_Poll(void);
+uint8_t CCD_Selftest_Set(uint8_t op); // 0 = not a CCD_SELFTEST_* op
+void CCD_Selftest_Status(CCD_SelftestStatus_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_SELFTEST_H */
@@ -0,0 +1,158 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_sensor.h
+ * @brief          : Compile-time descriptor of the linear sensor
+ ******************************************************************************
+ * Everything the firmware assumes about the sensor is defined here and
+ * only here: the line length (CCD_BUFFER_SIZE, read a few outputs past it
+ * to whole cache lines, so the frame record, every DMA length and each
+ * frame header's payload_len), which outputs are dummies, light-shielded
+ * or effective (the classes ccd_phase.h passes on to AE, HDR, the PTC and
+ * the pipeline), the clock range and clocks per pixel behind ccd_timing.h's
+ * periods and asserts, the pulse limits and both polarities. Select one
+ * with -DCCD_SENSOR=<n>. The buffers are sized for it, so it cannot change
+ * at run time; CCD_CmdInfo_t reports it.
+ *
+ * Each sensor is driven on the same three pins and timers:
+ *  - TCD1304, TCD1254 (Toshiba): fM, ICG and SH as named, 4 fM cycles per
+ *    pixel, electronic shutter on SH.
+ *  - ILX511 (Sony): CLK on the fM pin, ROG on ICG, one clock per pixel.
+ *    No shutter: the integration is the ROG period, SH is left open.
+ *  - S11639 (Hamamatsu CMOS): CLK on fM, ST on ICG, one clock per pixel.
+ *    Its integration follows ST, so SH is left open as well. There are no
+ *    shielded pixels; the idle output before the video, with no
+ *    photodiode behind it, stands in for them, as the leading dummies do
+ *    for the dark level on the others.
+ * A sensor without a shutter integrates over the whole frame in every
+ * mode, as in mode 2; exposure_us then only holds in mode 2.
+ *
+ * Output polarity: the pipeline, its dark and black levels and the host
+ * take "light lowers the value", as the CCDs' output does. With
+ * CCD_SENSOR_RISES (the CMOS part) each frame is inverted as it is handed
+ * off, before any consumer sees it.
+ *
+ * Drive polarity is at the pin, as this board wires the TCD1304 (through
+ * an inverting buffer for ICG and SH); set it to the buffer another head
+ * has. The geometry and limits are from the datasheets.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_SENSOR_H
+#define __CCD_SENSOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CCD_SENSOR_TCD1304 0
+#define CCD_SENSOR_TCD1254 1
+#define CCD_SENSOR_ILX511 2
+#define CCD_SENSOR_S11639 3
+
+#ifndef CCD_SENSOR
+#define CCD_SENSOR CCD_SENSOR_TCD1304
+#endif
+
+// Per sensor:
+//  OUTPUTS        Elements of the line, dummies included
+//  SHIELD_START/COUNT, ACTIVE_START/COUNT: pixel classes, in outputs
+//  FM_MIN/MAX_HZ  Clock range
+//  FM_PER_PIXEL   Clock cycles per output
+//  ADC_PHASE_HALF Default ADC trigger, in half clock cycles into the pixel
+//  INT_MIN_US     Shortest integration the shutter may set
+//  SH_MIN_US      Shortest SH pulse
+//  SH_IN_ICG      1: every SH pulse must lie within the ICG pulse
+//  SHUTTER        1: SH sets the integration (modes 0 and 1)
+//  RISES          1: the output rises with light
+//  ICG_LOW/SH_LOW 1: the pin is active low
+#if CCD_SENSOR == CCD_SENSOR_TCD1304
+#define CCD_SENSOR_NAME "TCD1304"
+#define CCD_SENSOR_OUTPUTS 3694 // 32 dummies + 3648 pixels + 14 dummies
+#define CCD_SENSOR_SHIELD_START 16 // 13 light-shielded elements
+#define CCD_SENSOR_SHIELD_COUNT 13
+#define CCD_SENSOR_ACTIVE_START 32
+#define CCD_SENSOR_ACTIVE_COUNT 3648
+#define CCD_SENSOR_FM_MIN_HZ 800000U
+#define CCD_SENSOR_FM_MAX_HZ 4000000U
+#define CCD_SENSOR_FM_PER_PIXEL 4U
+#define CCD_SENSOR_ADC_PHASE_HALF 2U // 1 fM cycle
+#define CCD_SENSOR_INT_MIN_US 10U
+#define CCD_SENSOR_SH_MIN_US 1U
+#define CCD_SENSOR_SH_IN_ICG 1
+#define CCD_SENSOR_SHUTTER 1
+#define CCD_SENSOR_RISES 0
+#define CCD_SENSOR_ICG_LOW 1
+#define CCD_SENSOR_SH_LOW 1
+#elif CCD_SENSOR == CCD_SENSOR_TCD1254
+#define CCD_SENSOR_NAME "TCD1254"
+#define CCD_SENSOR_OUTPUTS 2546 // 32 dummies + 2500 pixels + 14 dummies
+#define CCD_SENSOR_SHIELD_START 16
+#define CCD_SENSOR_SHIELD_COUNT 13
+#define CCD_SENSOR_ACTIVE_START 32
+#define CCD_SENSOR_ACTIVE_COUNT 2500
+#define CCD_SENSOR_FM_MIN_HZ 800000U
+#define CCD_SENSOR_FM_MAX_HZ 4000000U
+#define CCD_SENSOR_FM_PER_PIXEL 4U
+#define CCD_SENSOR_ADC_PHASE_HALF 2U
+#define CCD_SENSOR_INT_MIN_US 10U
+#define CCD_SENSOR_SH_MIN_US 1U
+#define CCD_SENSOR_SH_IN_ICG 1
+#define CCD_SENSOR_SHUTTER 1
+#define CCD_SENSOR_RISES 0
+#define CCD_SENSOR_ICG_LOW 1
+#define CCD_SENSOR_SH_LOW 1
+#elif CCD_SENSOR == CCD_SENSOR_ILX511
+#define CCD_SENSOR_NAME "ILX511"
+#define CCD_SENSOR_OUTPUTS 2086 // 32 dummies + 2048 pixels + 6 dummies
+#define CCD_SENSOR_SHIELD_START 13 // 18 optical black elements
+#define CCD_SENSOR_SHIELD_COUNT 18
+#define CCD_SENSOR_ACTIVE_START 32
+#define CCD_SENSOR_ACTIVE_COUNT 2048
+#define CCD_SENSOR_FM_MIN_HZ 50000U
+#define CCD_SENSOR_FM_MAX_HZ 2000000U
+#define CCD_SENSOR_FM_PER_PIXEL 1U
+#define CCD_SENSOR_ADC_PHASE_HALF 1U // Mid-clock, output settled
+#define CCD_SENSOR_INT_MIN_US 10U
+#define CCD_SENSOR_SH_MIN_US 1U
+#define CCD_SENSOR_SH_IN_ICG 0
+#define CCD_SENSOR_SHUTTER 0
+#define CCD_SENSOR_RISES 0
+#define CCD_SENSOR_ICG_LOW 1 // ROG
+#define CCD_SENSOR_SH_LOW 1
+#elif CCD_SENSOR == CCD_SENSOR_S11639
+#define CCD_SENSOR_NAME "S11639"
+#define CCD_SENSOR_OUTPUTS 2144 // 88 idle + 2048 pixels + 8 idle
+#define CCD_SENSOR_SHIELD_START 48 // Idle output, in place of shielding
+#define CCD_SENSOR_SHIELD_COUNT 16
+#define CCD_SENSOR_ACTIVE_START 88
+#define CCD_SENSOR_ACTIVE_COUNT 2048
+#define CCD_SENSOR_FM_MIN_HZ 200000U
+#define CCD_SENSOR_FM_MAX_HZ 10000000U
+#define CCD_SENSOR_FM_PER_PIXEL 1U
+#define CCD_SENSOR_ADC_PHASE_HALF 1U
+#define CCD_SENSOR_INT_MIN_US 10U
+#define CCD_SENSOR_SH_MIN_US 1U
+#define CCD_SENSOR_SH_IN_ICG 0
+#define CCD_SENSOR_SHUTTER 0
+#define CCD_SENSOR_RISES 1
+#define CCD_SENSOR_ICG_LOW 0 // ST
+#define CCD_SENSOR_SH_LOW 1
+#else
+#error "Unknown CCD_SENSOR"
+#endif
+
+_Static_assert(CCD_SENSOR_SHIELD_COUNT > 0 &&
+                   CCD_SENSOR_SHIELD_START + CCD_SENSOR_SHIELD_COUNT <=
+                       CCD_SENSOR_ACTIVE_START,
+               CCD_SENSOR_NAME ": shielded outputs come before the pixels");
+_Static_assert(CCD_SENSOR_ACTIVE_START + CCD_SENSOR_ACTIVE_COUNT <=
+                   CCD_SENSOR_OUTPUTS,
+               CCD_SENSOR_NAME ": effective pixels must lie in the line");
+_Static_assert(CCD_SENSOR_ADC_PHASE_HALF < 2U * CCD_SENSOR_FM_PER_PIXEL,
+               CCD_SENSOR_NAME ": ADC phase must fall inside the pixel");
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_SENSOR_H */
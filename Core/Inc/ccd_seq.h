@@ -0,0 +1,93 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_seq.h
+ * @brief          : Exposure / readout sequence engine (kinetic series)
+ ******************************************************************************
+ * A table of up to CCD_SEQ_STEPS steps is uploaded once and then run by the
+ * firmware in mode 0, with every frame timed by the ICG period. Each step:
+ *  - optionally waits for a trigger: a rising edge on CCD_TRIG_IN or "ZT"
+ *    (the first frame sent is the second one read out after it)
+ *  - sets its integration time through the preloaded SH path and skips the
+ *    frames captured before it took effect
+ *  - sends frames outputs, each the co-add of coadd raw frames (proc_coadd_n,
+ *    so the rest of the processing chain applies as usual)
+ *  - after each output skips delay_ms, rounded up to whole ICG periods, so
+ *    time-lapse intervals stay on the frame clock
+ * Frames outside the steps are dropped. The table runs repeats times
+ * (0 = until "Z0"). A CCD_SeqStatus_t goes out at the start of every step,
+ * at the end, and on "ZS".
+ *
+ * Commands: "ZW<i>:<t_us>:<outputs>:<coadd>:<delay_ms>:<trigger>" writes
+ * step i, "ZN<n>" sets the number of steps, "ZR<n>" the repeat count, "ZG"
+ * starts (switching to mode 0, auto-exposure off), "Z0" stops. Exposure bracketing ("Q") must
+ * be off.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_SEQ_H
+#define __CCD_SEQ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_SEQ_STEPS 16
+#define CCD_SEQ_MAGIC 0xABD4 // CCD_SeqStatus_t
+#define CCD_SEQ_DELAY_MAX_MS 3600000U // 1 h between outputs
+
+// CCD_SeqStatus_t.state
+#define CCD_SEQ_IDLE 0
+#define CCD_SEQ_STARTING 1 // Waiting for the switch to mode 0
+#define CCD_SEQ_TRIGGER 2  // Step waiting for its trigger
+#define CCD_SEQ_SETTLE 3   // Waiting for a frame with the step's exposure
+#define CCD_SEQ_RUN 4      // Sending the step's frames
+#define CCD_SEQ_DONE 5     // Table finished, or stopped
+#define CCD_SEQ_ERROR 6    // A step's integration time is not reachable
+
+typedef struct {
+  uint32_t t_us;     // Integration time (CCD_Acq_SetIntegration)
+  uint16_t outputs;  // Frames sent
+  uint16_t coadd;    // Raw frames per output, 1 = none
+  uint32_t delay_ms; // Gap after each output
+  uint8_t trigger;   // Wait for a trigger before the first frame
+} CCD_SeqStep_t;
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;     // CCD_SEQ_MAGIC
+  uint8_t state;      // CCD_SEQ_*
+  uint8_t step;       // Step running (or last run)
+  uint8_t steps;      // Table length
+  uint8_t reserved;
+  uint16_t pass;      // Table passes completed
+  uint16_t repeats;   // 0 = endless
+  uint16_t outputs;   // Frames sent in this step
+  uint16_t frame_num; // Last frame sent, or the frame the step started at
+} CCD_SeqStatus_t;
+#pragma pack(pop)
+
+// Command side (USB RX interrupt): 0 if the request is out of range
+uint8_t CCD_Seq_SetStep(uint8_t index, const CCD_SeqStep_t *step);
+uint8_t CCD_Seq_SetLength(uint8_t steps);
+void CCD_Seq_SetRepeats(uint16_t repeats);
+uint8_t CCD_Seq_Start(void);
+void CCD_Seq_Stop(void);
+void CCD_Seq_Trigger(void);
+void CCD_Seq_RequestStatus(void);
+
+// EXTI0 interrupt (stm32h7xx_it.c)
+void CCD_Seq_PinIRQ(void);
+
+// Main loop
+void CCD_Seq_Poll(void);
+uint8_t CCD_Seq_Running(void); // Frames must reach CCD_Seq_Frame() singly
+uint8_t CCD_Seq_Frame(const CCD_Frame_t *frame); // 0 = drop the frame
+void CCD_Seq_Output(const CCD_Frame_t *frame);   // A step frame was queued
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_SEQ_H */
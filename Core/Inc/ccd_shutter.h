@@ -0,0 +1,115 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_shutter.h
+ * @brief          : External shutter and a live dark from closed frames
+ ******************************************************************************
+ * A master dark ("D<m>") is only right at the temperature and the
+ * offsets it was taken at; over a long run it goes stale even with the
+ * temperature model of ccd_proc.h. With CCD_SHUTTER a shutter in front of
+ * the sensor, driven from CCD_SHUTTER_Pin (high = closed), takes a few
+ * frames in the dark every so often, and those keep the dark current,
+ * without stopping acquisition for a capture.
+ *
+ * The schedule runs on the frames as they are handed off: after every
+ * every-th light frame the shutter closes, the next settle frames are the
+ * shutter moving (the one integrating at that moment and those within its
+ * travel), then darks frames are dark, then it opens and settle frames
+ * move it back. The kind of each frame is kept by seq for the last
+ * CCD_SHUTTER_HIST frames. In the main loop the moving ones are dropped
+ * and counted; the host sees them as missing seqs. A dark one skips the
+ * stages and goes out raw (linearised and black-levelled as the light ones
+ * would be) under CCD_SHUTTER_MAGIC, a CCD_Frame_t otherwise, so nothing
+ * takes it for a spectrum. Each also moves the dark estimate
+ * (CCD_Proc_LiveDark()) 1 / 2^shift of the way to it: the estimate is the
+ * master dark subtracted from every light frame, started from the master
+ * dark in place, or from the first dark frame. The temperature model
+ * still scales it in between.
+ *
+ * AE looks at light frames only. A "D<m>" capture runs as before and
+ * replaces the estimate; the dark frames during it go out unused. Set the
+ * cadence so the shutter's life and the dark frames it costs fit the run:
+ * 2 * settle + darks frames of every cycle carry no spectrum. The setting
+ * is not kept in flash; off opens the shutter and leaves the estimate
+ * applied as a master dark ("D0" drops it).
+ ******************************************************************************
+ */
+
+#ifndef __CCD_SHUTTER_H
+#define __CCD_SHUTTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "frame_ring.h"
+#include "main.h"
+
+#define CCD_SHUTTER_MAGIC 0xABE4 // A dark frame: CCD_Frame_t, its own magic
+#define CCD_SHUTTER_HIST FRAME_RING_SLOTS // Frames whose kind is kept
+#define CCD_SHUTTER_EVERY_MIN 2U // Light frames between closings
+#define CCD_SHUTTER_SETTLE_MAX 16U
+#define CCD_SHUTTER_DARKS_MAX 16U
+#define CCD_SHUTTER_SHIFT_MAX 8U // 1/256 of the way per dark frame
+
+// CCD_TELEM_SHUTTER operations
+#define CCD_SHUTTER_OFF 0
+#define CCD_SHUTTER_ON 1 // Then u16 every, u8 settle, u8 darks, u8 shift
+#define CCD_SHUTTER_AGAIN 2 // Close at the next frame
+
+// CCD_ShutterStatus_t.state
+#define CCD_SHUTTER_IDLE 0 // Off, open
+#define CCD_SHUTTER_OPEN 1
+#define CCD_SHUTTER_CLOSING 2
+#define CCD_SHUTTER_DARK 3
+#define CCD_SHUTTER_OPENING 4
+
+// CCD_Shutter_Kind()
+#define CCD_SHUTTER_LIGHT 0
+#define CCD_SHUTTER_MOVING 1
+#define CCD_SHUTTER_CLOSED 2
+
+#pragma pack(push, 1)
+// CCD_TELEM_SHUTTER reply
+typedef struct {
+  uint8_t state; // CCD_SHUTTER_IDLE..OPENING
+  uint8_t settle;
+  uint8_t darks;
+  uint8_t shift;
+  uint16_t every;
+  uint8_t closed;       // CCD_SHUTTER_Pin high
+  uint8_t estimate;     // The dark frames make the master dark
+  int16_t temp;         // Sensor at the newest dark frame, 0.01 degC
+  uint32_t cycles;      // Closings since boot
+  uint32_t dark_frames; // Folded into the estimate
+  uint32_t dropped;     // Frames the shutter moved in
+  uint32_t seq;         // Newest dark frame
+} CCD_ShutterStatus_t;
+#pragma pack(pop)
+
+// Boot: CCD_SHUTTER_Pin, open
+void CCD_Shutter_Init(void);
+
+// Main loop or command context; 0 = out of range
+uint8_t CCD_Shutter_Set(uint8_t op, uint16_t every, uint8_t settle,
+                        uint8_t darks, uint8_t shift);
+uint8_t CCD_Shutter_Active(void);
+void CCD_Shutter_Status(CCD_ShutterStatus_t *out);
+
+// PendSV, as each frame is published: the schedule, and the frame's kind
+void CCD_Shutter_Frame(const CCD_Frame_t *frame);
+
+// CCD_SHUTTER_* kind of a frame still in the history, else LIGHT
+uint8_t CCD_Shutter_Kind(uint32_t seq);
+
+// Main loop, a CCD_SHUTTER_CLOSED frame: into the estimate and out under
+// CCD_SHUTTER_MAGIC, as CCD_Proc_Frame() returns a record
+CCD_Frame_t *CCD_Shutter_Dark(CCD_Frame_t *frame, uint32_t *len);
+
+// Main loop, a CCD_SHUTTER_MOVING frame
+void CCD_Shutter_Drop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_SHUTTER_H */
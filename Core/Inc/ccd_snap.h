@@ -0,0 +1,81 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_snap.h
+ * @brief          : Event-driven single shots (mode 1)
+ ******************************************************************************
+ * In mode 1 the timer chain waits parked (CCD_Acq_StartSnap()) and a snap
+ * starts it straight from the interrupt that asks for it: "J" from the USB
+ * RX interrupt, or a rising edge on CCD_TRIG_IN once "JE1" is set. One ICG
+ * period clears the sensor, the next reads out a frame with the
+ * fast-shutter integration time ("L"), and the DMA completion parks the
+ * chain again. The main loop only transmits, and sleeps in between.
+ *
+ * Every snap frame is followed by a CCD_SnapReport_t with the time from the
+ * snap to the frame being queued for USB: about two ICG periods plus the
+ * transport. Snaps while one is still running are counted as missed.
+ *
+ * "JX<ms>" is a snap with a long exposure of its own (CCD_Acq_Expose()):
+ * no frames at all until the exposure is over, then one frame, its
+ * exposure_us the time asked for, and the report (latency includes the
+ * exposure). CCD_TELEM_EXPOSE reads its progress, or aborts it like "JA";
+ * an abort sends nothing.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_SNAP_H
+#define __CCD_SNAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_SNAP_MAGIC 0xABD5 // CCD_SnapReport_t
+
+#pragma pack(push, 1)
+typedef struct {
+  uint16_t magic;      // CCD_SNAP_MAGIC
+  uint16_t frame_num;  // Frame the snap produced
+  uint32_t latency_us; // Snap to the frame queued for USB
+  uint32_t t_us;       // Integration time of the frame
+  uint16_t snaps;      // Snaps taken so far
+  uint16_t missed;     // Snaps refused (one still running, or not mode 1)
+} CCD_SnapReport_t;
+
+// CCD_TELEM_EXPOSE reply
+typedef struct {
+  uint8_t state; // CCD_EXPOSE_*
+  uint8_t reserved[3];
+  uint32_t t_ms;       // Of the running or the last exposure
+  uint32_t elapsed_ms; // Integrated so far, while CCD_EXPOSE_RUNNING
+  uint16_t exposures;  // Started
+  uint16_t aborted;
+} CCD_ExposeStatus_t;
+#pragma pack(pop)
+
+#define CCD_EXPOSE_IDLE 0
+#define CCD_EXPOSE_RUNNING 1 // Integrating, nothing read out
+#define CCD_EXPOSE_READING 2 // Its frame (or a snap's) being read out
+
+// Command side (USB RX interrupt)
+void CCD_Snap_Fire(void);
+void CCD_Snap_SetPinTrigger(uint8_t enable);
+void CCD_Snap_Expose(uint32_t t_ms); // Counted as missed if refused
+uint8_t CCD_Snap_Abort(void);        // 0 if no exposure was running
+
+// Main loop (CCD_TELEM_EXPOSE)
+void CCD_Snap_ExposeStatus(CCD_ExposeStatus_t *out);
+
+// EXTI0 interrupt (stm32h7xx_it.c)
+void CCD_Snap_PinIRQ(void);
+
+// Main loop
+void CCD_Snap_Poll(void);
+void CCD_Snap_Sent(const CCD_Frame_t *frame); // A mode 1 frame was queued
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_SNAP_H */
@@ -0,0 +1,70 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_store.h
+ * @brief          : Calibration tables persisted in internal flash
+ ******************************************************************************
+ * Each table owns one 128 KB sector at the top of flash, bank 2 and then
+ * the last sector of bank 1. The linker scripts end FLASH below
+ * CCD_STORE_BASE, so code can never land there.
+ *
+ * A record is a 32-byte header (magic, id, length, checksum) followed by the
+ * data, programmed in 256-bit flash words. Saving erases the sector first,
+ * which blocks for up to ~2 s; it is meant for calibration, not streaming.
+ *
+ * A log sector (CCD_STORE_CONFIG, CCD_STORE_ADCCAL) takes small records
+ * back to back instead: an append programs the next blank words without an
+ * erase, loading takes the newest valid record, and only an append that no longer fits erases
+ * the sector and starts over at its base. That spreads the erase cycles
+ * (and their ~2 s) over a thousand or so saves.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_STORE_H
+#define __CCD_STORE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+typedef enum {
+  CCD_STORE_FLAT = 0,       // Flat-field gain table (ccd_proc.c)
+  CCD_STORE_PHASE = 1,      // ADC sample point (ccd_phase.c)
+  CCD_STORE_WAVELENGTH = 2, // Pixel -> nm calibration (ccd_proc.c)
+  CCD_STORE_LINEARITY = 3,  // ADC linearity knots (ccd_proc.c)
+  CCD_STORE_CONFIG = 4,     // Settings log (ccd_config.c)
+  CCD_STORE_ADCCAL = 5,     // ADC calibration factors log (ccd_adccal.c)
+  CCD_STORE_DEFECT = 6,     // Defect pixel map (ccd_proc.c)
+  CCD_STORE_MATCH = 7,      // Reference spectrum library (ccd_match.c)
+  CCD_STORE_MODEL = 8,      // Linear models (ccd_model.c), in bank 1
+  CCD_STORE_COUNT
+} CCD_Store_Id_t;
+
+// Sectors used from the top of flash down: table id uses sector 7 - id % 8
+// of bank 2, then of bank 1
+#define CCD_STORE_SECTORS 9U
+#define CCD_STORE_BASE                                                         \
+  (FLASH_BANK2_BASE + 0x100000U - CCD_STORE_SECTORS * 0x20000U)
+#define CCD_STORE_MAX_LEN (0x20000U - 32U) // Data bytes per record
+
+// Copy a valid record of exactly len bytes into data. Returns 0 if there is
+// none (erased sector, other length, bad checksum).
+uint8_t CCD_Store_Load(CCD_Store_Id_t id, void *data, uint32_t len);
+
+// Erase the table's sector and program a new record. Returns 0 on error.
+uint8_t CCD_Store_Save(CCD_Store_Id_t id, const void *data, uint32_t len);
+
+// Log sectors. LoadLast copies the newest valid record of exactly len
+// bytes (0: none). Append blocks for the erase when the sector is full;
+// Erase empties it. Both return 0 on a flash error.
+uint8_t CCD_Store_LoadLast(CCD_Store_Id_t id, void *data, uint32_t len);
+uint8_t CCD_Store_Append(CCD_Store_Id_t id, const void *data, uint32_t len);
+uint8_t CCD_Store_Erase(CCD_Store_Id_t id);
+uint32_t CCD_Store_Free(CCD_Store_Id_t id); // Bytes left before an erase
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_STORE_H */
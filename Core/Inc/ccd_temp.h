@@ -0,0 +1,66 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_temp.h
+ * @brief          : Die and board temperature (ADC3)
+ ******************************************************************************
+ * ADC3, which the capture does not use, converts the internal temperature
+ * sensor and, with CCD_TEMP_NTC, a thermistor next to the CCD, one
+ * software-started conversion per CCD_TEMP_MS from the main loop. ADC1 and
+ * ADC2 keep their triggers and their DMA to themselves, so the readings
+ * come between frames without touching a sample. The conversions are on
+ * ADC3's injected group, leaving the regular one, its trigger and its DMA
+ * to the reference photodiode (ccd_ref.h); each holds the reference off
+ * for the 810.5-cycle sampling (under 0.1 ms).
+ *
+ * The latest readings are in every frame header (CCD_FrameInfo_t) in
+ * 0.01 degC, CCD_TEMP_NONE for a sensor the build does not have. The dark
+ * frame compensation (ccd_proc.h) follows CCD_Temp_Sensor(): the
+ * thermistor when there is one, else the die.
+ *
+ * The thermistor sits at the bottom of a divider from VREF+ through
+ * CCD_TEMP_NTC_SERIES ohms, and converts with the beta equation.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_TEMP_H
+#define __CCD_TEMP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_TEMP_MS 500U // Per conversion; each sensor in turn
+#define CCD_TEMP_VREF_MV 3300U // VREF+, for the internal sensor
+#define CCD_TEMP_NONE INT16_MIN
+
+#ifndef CCD_TEMP_NTC_CHANNEL
+#define CCD_TEMP_NTC_CHANNEL ADC_CHANNEL_10 // PC0, ADC3_INP10
+#endif
+#ifndef CCD_TEMP_NTC_R25
+#define CCD_TEMP_NTC_R25 10000.0f // Ohms at 25 degC
+#endif
+#ifndef CCD_TEMP_NTC_BETA
+#define CCD_TEMP_NTC_BETA 3950.0f
+#endif
+#ifndef CCD_TEMP_NTC_SERIES
+#define CCD_TEMP_NTC_SERIES 10000.0f
+#endif
+
+// 0.01 degC, CCD_TEMP_NONE until read or without the sensor
+extern volatile int16_t ccd_temp_die;
+extern volatile int16_t ccd_temp_board;
+
+// Boot, before CCD_AdcCal_Init(): takes a first reading of each sensor
+void CCD_Temp_Init(void);
+void CCD_Temp_Poll(void);
+
+// The temperature closest to the CCD: the thermistor's, else the die's
+int16_t CCD_Temp_Sensor(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_TEMP_H */
@@ -0,0 +1,49 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_time.h
+ * @brief          : 64-bit timestamps (TIM7 extended by its wraps)
+ ******************************************************************************
+ * TIM7 runs free from CCD_TIM_CLK_HZ / 8 and its update interrupt counts
+ * the wraps (every 4.4 ms at 120 MHz timers, 2.2 ms at 240). CCD_Time_Now()
+ * joins the two and scales the result to ticks of the profile's core clock,
+ * so timestamps keep the unit the host reads from clock_hz
+ * (CCD_DeviceInfo_t) while their resolution is one TIM7 count, 64 or
+ * 33 ns. A wrap that is pending when it reads is counted from UIFCPY.
+ *
+ * A timer rather than the DWT cycle counter: CYCCNT stops with the core
+ * clock in every sleep of the idle main loop, and keeping it running
+ * (DBGMCU D1 sleep) costs most of what sleeping saves. TIM2 and TIM5, the
+ * 32-bit timers, restart at every ICG. CYCCNT stays the counter for CPU
+ * cycles within a pass (ccd_probe.h, CCD_CMD_PROFILE); CCD_Time_Init()
+ * enables it too.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_TIME_H
+#define __CCD_TIME_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+#include "ccd_clock.h"
+
+// Timestamp ticks per second: the profile's core clock
+#define CCD_TIME_HZ (CCD_CLOCK_PROFILE * 1000000U)
+// Timestamp ticks per CCD timer tick (ccd_timing.h)
+#define CCD_TIME_PER_TICK (CCD_TIME_HZ / CCD_TIM_CLK_HZ)
+
+void CCD_Time_Init(void);
+
+// Any context. CCD_TIME_HZ ticks since CCD_Time_Init()
+uint64_t CCD_Time_Now(void);
+
+// TIM7 update interrupt
+void CCD_Time_WrapIRQ(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_TIME_H */
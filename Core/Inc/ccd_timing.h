@@ -0,0 +1,165 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_timing.h
+ * @brief          : Compile-time timing profiles and timer registers
+ ******************************************************************************
+ * Every PSC/ARR/CCR used for the CCD timer chain is computed here from:
+ *  - the timer kernel clock (CCD_TIM_CLK_HZ, from the clock profile)
+ *  - the pixel rate, and the sensor's clocks per pixel, pixel count
+ *    (CCD_BUFFER_SIZE) and default ADC sampling phase (ccd_sensor.h)
+ *  - the ICG and SH pulse widths and the integration time
+ *
+ *   TIM3 CH1  fM master clock        TIM4 CH4  ADC trigger, one per pixel
+ *   TIM2 CH1  ICG, one frame period  TIM5 CH3  SH (electronic shutter)
+ *
+ * Select a profile with -DCCD_TIMING_PROFILE=<n>. The profiles set the
+ * pixel rate; fM follows from the sensor, so each keeps its frame period
+ * per pixel on every head. The _Static_asserts below reject profiles that
+ * break the sensor's datasheet limits or the
+ * "one ICG period = CCD_BUFFER_SIZE ADC triggers" rule that keeps every DMA
+ * transfer frame-aligned.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_TIMING_H
+#define __CCD_TIMING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ccd_clock.h"
+#include "main.h"
+
+#define CCD_TIMING_STD 0  // 500 kpixel/s, fM 2 MHz on the TCD1304
+#define CCD_TIMING_FAST 1 // 1 Mpixel/s, its fM maximum of 4 MHz
+
+#ifndef CCD_TIMING_PROFILE
+#define CCD_TIMING_PROFILE CCD_TIMING_STD
+#endif
+
+// 1: TIM3 (fM) is a reset slave of TIM2 like TIM4/TIM5, so fM, ADC trigger,
+// ICG and SH all restart from the same TRGO edge. Required for a fixed ADC
+// sample phase in mode 3 and as a sync slave, whose ICG starts at arbitrary
+// fM phase; free-running, the reset always lands on an fM period boundary.
+// 0: fM runs free from boot and is only aligned by the counter resets.
+#ifndef CCD_FM_LOCK
+#define CCD_FM_LOCK 1
+#endif
+
+// ========== PROFILE INPUTS ==========
+#if CCD_TIMING_PROFILE == CCD_TIMING_STD
+#define CCD_PIXEL_HZ 500000U
+#define CCD_ICG_PULSE_US 10     // ICG low pulse
+#define CCD_SH_PERIOD_US 20     // Integration time, modes 0 and 1
+#define CCD_SH_PULSE_US 4       // SH pulse, modes 0 and 1
+#define CCD_SH_LONG_PULSE_US 10 // SH pulse, mode 2 (one per ICG)
+// fM 2, 1, 1, 2, 1 MHz (TCD1304); 0.8 MHz is not a whole divider of 2 MHz
+#define CCD_LN_TABLE                                                           \
+  {{1, 0, 0}, {2, 2, 0}, {2, 3, 0}, {1, 0, 3}, {2, 0, 4}}
+#define CCD_LN_COUNT 5
+#define CCD_LN_MAX_DIV 2
+#elif CCD_TIMING_PROFILE == CCD_TIMING_FAST
+#define CCD_PIXEL_HZ 1000000U
+#define CCD_ICG_PULSE_US 5
+#define CCD_SH_PERIOD_US 10
+#define CCD_SH_PULSE_US 2
+#define CCD_SH_LONG_PULSE_US 5
+// fM 4, 2, 1, 2, 1, 0.8, 0.8 MHz (TCD1304)
+#define CCD_LN_TABLE                                                           \
+  {{1, 0, 0}, {2, 2, 0}, {4, 3, 0}, {2, 0, 3},                                 \
+   {4, 0, 4}, {5, 0, 4}, {5, 3, 0}}
+#define CCD_LN_COUNT 7
+#define CCD_LN_MAX_DIV 5
+#else
+#error "Unknown CCD_TIMING_PROFILE"
+#endif
+
+// Readout speed profiles ("O<n>"), CCD_LN_TABLE entries {fM divider, log2
+// of the ADC oversampling ratio, shortest ADC sampling time}. Entry 0 is
+// the profile above. The others slow fM (and with it every pixel and the
+// frame) and spend the longer pixel either on the ADC1 hardware
+// oversampler, averaging that many back-to-back conversions per trigger
+// at the shortest sampling time, or on one conversion with a sampling time
+// of at least the third field (an acq_sample_times index past the "S"
+// choices), which lets the CCD output settle further. Each keeps its
+// conversions inside the pixel from the default ADC phase.
+
+// ========== DERIVED (timer ticks) ==========
+#define CCD_TICKS_PER_US (CCD_TIM_CLK_HZ / 1000000U)
+#define CCD_US_TICKS(us) ((us) * CCD_TICKS_PER_US)
+
+#define CCD_FM_HZ (CCD_PIXEL_HZ * CCD_SENSOR_FM_PER_PIXEL)
+#define CCD_FM_TICKS (CCD_TIM_CLK_HZ / CCD_FM_HZ)
+#define CCD_PIXEL_TICKS (CCD_SENSOR_FM_PER_PIXEL * CCD_FM_TICKS)
+#define CCD_ICG_TICKS (CCD_BUFFER_SIZE * CCD_PIXEL_TICKS)
+
+// ========== TIMER REGISTERS ==========
+// TIM3: fM, 50 % duty
+#define CCD_TIM3_PSC 0U
+#define CCD_TIM3_ARR (CCD_FM_TICKS - 1U)
+#define CCD_TIM3_CCR1 (CCD_FM_TICKS / 2U)
+
+// TIM4: ADC trigger, reset by TIM2 TRGO
+#define CCD_TIM4_PSC 0U
+#define CCD_TIM4_ARR (CCD_PIXEL_TICKS - 1U)
+#define CCD_TIM4_CCR4 (CCD_SENSOR_ADC_PHASE_HALF * CCD_FM_TICKS / 2U)
+
+// TIM2: ICG (frame period)
+#define CCD_TIM2_PSC 0U
+#define CCD_TIM2_ARR (CCD_ICG_TICKS - 1U)
+#define CCD_TIM2_CCR1 (CCD_US_TICKS(CCD_ICG_PULSE_US) - 1U)
+
+// TIM2 in external trigger mode (mode 3): one-pulse, started by ETR. ICG is
+// CH1 in combined PWM mode 2, active for TRIG_CCR1 <= CNT < TRIG_CCR2, so the
+// stopped counter (CNT = 0) leaves it idle. The 1-tick delay is the only
+// offset against the free-running ICG.
+#define CCD_TIM2_TRIG_CCR1 1U
+#define CCD_TIM2_TRIG_CCR2 (CCD_TIM2_TRIG_CCR1 + CCD_TIM2_CCR1)
+
+// TIM5: SH, reset by TIM2 TRGO. Fast shutter (modes 0/1) repeats every
+// CCD_SH_PERIOD_US; long exposure (mode 2) fires once per ICG period.
+#define CCD_TIM5_PSC 0U
+#define CCD_TIM5_ARR (CCD_US_TICKS(CCD_SH_PERIOD_US) - 1U)
+#define CCD_TIM5_CCR3 (CCD_US_TICKS(CCD_SH_PULSE_US) - 1U)
+#define CCD_TIM5_LONG_CCR3 (CCD_US_TICKS(CCD_SH_LONG_PULSE_US) - 1U)
+
+// ========== STATIC VALIDATION ==========
+_Static_assert(CCD_TIM_CLK_HZ % CCD_FM_HZ == 0,
+               "fM must divide the timer clock exactly");
+_Static_assert(CCD_TIM_CLK_HZ % 1000000U == 0,
+               "timer clock must be a whole number of MHz");
+_Static_assert(CCD_FM_HZ >= CCD_SENSOR_FM_MIN_HZ &&
+                   CCD_FM_HZ <= CCD_SENSOR_FM_MAX_HZ,
+               CCD_SENSOR_NAME ": fM out of the datasheet range");
+_Static_assert(CCD_FM_TICKS >= 2U, "fM needs at least 2 ticks per cycle");
+_Static_assert(CCD_FM_HZ / CCD_LN_MAX_DIV >= CCD_SENSOR_FM_MIN_HZ,
+               CCD_SENSOR_NAME ": speed profiles must keep fM in range");
+_Static_assert(CCD_LN_MAX_DIV * CCD_PIXEL_TICKS <= 0x10000U,
+               "TIM4 is 16-bit at the slowest profile fM");
+_Static_assert((CCD_TIM2_ARR + 1U) % (CCD_TIM3_ARR + 1U) == 0,
+               "ICG period must be a whole number of fM cycles");
+_Static_assert(CCD_TIM3_ARR <= 0xFFFFU && CCD_TIM4_ARR <= 0xFFFFU,
+               "TIM3/TIM4 are 16-bit");
+_Static_assert((CCD_TIM2_ARR + 1U) == CCD_BUFFER_SIZE * (CCD_TIM4_ARR + 1U),
+               "ICG period must be exactly CCD_BUFFER_SIZE ADC triggers, or "
+               "frames drift against the DMA length");
+_Static_assert(CCD_SH_PERIOD_US >= CCD_SENSOR_INT_MIN_US,
+               CCD_SENSOR_NAME ": integration time too short");
+_Static_assert(CCD_SH_PULSE_US >= CCD_SENSOR_SH_MIN_US &&
+                   CCD_SH_LONG_PULSE_US >= CCD_SENSOR_SH_MIN_US,
+               CCD_SENSOR_NAME ": SH pulse too short");
+_Static_assert(CCD_SH_PULSE_US < CCD_SH_PERIOD_US,
+               "SH pulse must be shorter than the SH period");
+_Static_assert(!CCD_SENSOR_SH_IN_ICG ||
+                   (CCD_SH_PULSE_US <= CCD_ICG_PULSE_US &&
+                    CCD_SH_LONG_PULSE_US <= CCD_ICG_PULSE_US),
+               CCD_SENSOR_NAME ": SH pulse must lie within the ICG pulse");
+_Static_assert(CCD_US_TICKS(CCD_ICG_PULSE_US) < CCD_ICG_TICKS,
+               "ICG pulse must be shorter than the frame period");
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_TIMING_H */
@@ -0,0 +1,70 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_trace.h
+ * @brief          : ITM event trace over SWO (CCD_ITM_TRACE)
+ ******************************************************************************
+ * Built with CCD_ITM_TRACE=1, the acquisition and transport events below go
+ * out on ITM stimulus ports, one port per event, so any SWV / SWO viewer
+ * (CubeIDE, Orbuculum, pyOCD) can plot or log them live without touching
+ * the USB data path. Each event is a 32-bit write of the low half of
+ * CCD_Time_Now(), the clock of the frame timestamps, followed on events
+ * with an argument by a 16-bit write of it; trace tools keep the two apart
+ * by the packet size.
+ *
+ * Nothing blocks: a write that finds the ITM FIFO full is dropped and
+ * counted in ccd_trace_dropped, so a slow SWO clock costs trace data and
+ * never timing (at 2 Mbit/s an event takes 25-40 us on the pin). Port 0
+ * carries printf() text (_write() in syscalls.c), which does wait for the
+ * FIFO, so print from the main loop only.
+ *
+ * A debug probe usually programs the SWO baud rate itself. With
+ * CCD_ITM_SWO_HZ set the firmware does so as well (NRZ, trace clock
+ * pll1_r_ck, which equals the system clock in every profile), so a plain
+ * USB-serial adapter on PB3 (TRACESWO) can take the trace too.
+ * With CCD_ITM_TRACE=0 the macros compile to nothing.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_TRACE_H
+#define __CCD_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+// ITM stimulus ports
+#define CCD_TRACE_TEXT 0     // printf()
+#define CCD_TRACE_ICG 1      // ICG interrupt (restart path re-arm)
+#define CCD_TRACE_FRAME 2    // Frame complete (DMA), arg: low half of seq
+#define CCD_TRACE_TX_START 3 // USB transfer started, arg: bytes
+#define CCD_TRACE_TX_DONE 4  // USB transfer complete, arg: bytes
+#define CCD_TRACE_CMD 5      // Command received, arg: binary type, or
+                             // 0x100 + the letter of an ASCII packet
+#define CCD_TRACE_PORTS 6
+
+#ifndef CCD_ITM_SWO_HZ
+#define CCD_ITM_SWO_HZ 2000000U // 0 = leave the SWO setup to the probe
+#endif
+
+#if CCD_ITM_TRACE
+
+extern volatile uint32_t ccd_trace_dropped;
+
+void CCD_Trace_Init(void); // Boot, after CCD_Time_Init()
+void CCD_Trace_Event(uint8_t port);
+void CCD_Trace_EventArg(uint8_t port, uint16_t arg);
+
+#define CCD_TRACE(port) CCD_Trace_Event(port)
+#define CCD_TRACE_ARG(port, arg) CCD_Trace_EventArg((port), (uint16_t)(arg))
+#else
+#define CCD_TRACE(port) ((void)0)
+#define CCD_TRACE_ARG(port, arg) ((void)0)
+#endif /* CCD_ITM_TRACE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_TRACE_H */
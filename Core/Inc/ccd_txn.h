@@ -0,0 +1,106 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_txn.h
+ * @brief          : Configuration transactions, swapped at a frame boundary
+ ******************************************************************************
+ * Changing the exposure, the ROI and the binning one command at a time
+ * leaves frames in between that have some of the new settings and not the
+ * rest. CCD_TELEM_TXN opens a transaction instead: until it is committed,
+ * CCD_CMD_EXPOSURE, CCD_CMD_INTEGRATION, CCD_CMD_ROI, CCD_CMD_BINNING,
+ * CCD_CMD_COADD and CCD_CMD_ROLLING are checked as usual but only stored
+ * here, and CCD_TXN_FORMAT stores the packing and the codec ("P", "C").
+ * The ASCII commands still apply at once. A staged command that is
+ * refused marks the transaction, and its commit is refused in turn,
+ * applying none of it: a host can send the whole transaction in one write.
+ *
+ * A commit writes the new SH timing to TIM5's preloads, which load at an
+ * ICG (CCD_Acq_SetExposure()), and arms the swap. The first frame the
+ * transport takes that was both read out after the commit and integrated
+ * with the new timing gets every staged setting at once, before anything
+ * processes it: each frame is all old or all new, and none is dropped.
+ * Frames still in the ring from before go out with the old settings.
+ * While bracketing runs the timing is kept back (ccd_acq.h) and the swap
+ * does not wait for it.
+ *
+ * CCD_FrameInfo_t has no room left for a generation, so the seq of the
+ * first frame of each of the last CCD_TXN_HIST generations is kept and
+ * read back through CCD_TELEM_TXN: a frame belongs to the newest
+ * generation that started at or before its seq.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_TXN_H
+#define __CCD_TXN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ccd_proc.h"
+#include "main.h"
+
+#define CCD_TXN_HIST 10U // Generations whose first seq is kept
+
+// CCD_TELEM_TXN operations
+#define CCD_TXN_BEGIN 0  // Open, or drop what is staged
+#define CCD_TXN_COMMIT 1 // Arm the swap
+#define CCD_TXN_ABORT 2  // Drop what is staged and close
+#define CCD_TXN_FORMAT 3 // Then u8 CCD_PROC_PACK_*, u8 CCD_PROC_CODEC_*,
+                         // either 0xFF = kept
+
+// CCD_TxnStatus_t.state
+#define CCD_TXN_IDLE 0
+#define CCD_TXN_OPEN 1    // Staging
+#define CCD_TXN_ARMED 2   // Committed, waiting for the frame to swap at
+#define CCD_TXN_REFUSED 3 // Open, but a staged command was refused
+
+// CCD_TxnStatus_t.staged
+#define CCD_TXN_F_EXPOSURE 0x01U    // CCD_CMD_EXPOSURE
+#define CCD_TXN_F_INTEGRATION 0x02U // CCD_CMD_INTEGRATION
+#define CCD_TXN_F_ROI 0x04U         // CCD_CMD_ROI
+#define CCD_TXN_F_BIN 0x08U         // CCD_CMD_BINNING
+#define CCD_TXN_F_COADD 0x10U       // CCD_CMD_COADD
+#define CCD_TXN_F_ROLLING 0x20U     // CCD_CMD_ROLLING
+#define CCD_TXN_F_PACK 0x40U        // CCD_TXN_FORMAT packing
+#define CCD_TXN_F_CODEC 0x80U       // CCD_TXN_FORMAT codec
+
+#pragma pack(push, 1)
+// CCD_TELEM_TXN reply
+typedef struct {
+  uint8_t state;       // CCD_TXN_*
+  uint8_t staged;      // CCD_TXN_F_* of the open or armed transaction
+  uint16_t from;       // Armed: first frame_num the swap may take
+  uint32_t generation; // Commits swapped in since boot
+  uint32_t rejected;   // Commits refused, with nothing applied
+  uint32_t aborted;
+  uint32_t start[CCD_TXN_HIST]; // First seq of generation down, 0 = none
+} CCD_TxnStatus_t;
+#pragma pack(pop)
+
+// Main loop, CCD_Cmd_Poll(): the command handlers stage while it is open
+uint8_t CCD_Txn_Open(void); // CCD_TXN_OPEN or CCD_TXN_REFUSED
+uint8_t CCD_Txn_Armed(void);
+uint8_t CCD_Txn_Begin(void);  // 0 while armed
+uint8_t CCD_Txn_Commit(void); // 0 unless open; closes it when refused
+uint8_t CCD_Txn_Abort(void);  // 0 while armed
+void CCD_Txn_Refuse(void);    // A staged command failed its checks
+
+// Checked as the commands check them; 0 = refused, nothing staged
+uint8_t CCD_Txn_SetExposure(uint32_t period_us, uint32_t pulse_us);
+void CCD_Txn_SetIntegration(uint32_t t_us); // Checked at the commit
+uint8_t CCD_Txn_SetRoi(const CCD_RoiWindow_t *w, uint8_t n);
+void CCD_Txn_SetBin(uint8_t bin);
+void CCD_Txn_SetCoadd(uint16_t n);
+void CCD_Txn_SetRolling(uint16_t n);
+uint8_t CCD_Txn_SetFormat(uint8_t bits, uint8_t codec);
+
+// Main loop, each frame the transport takes, before any stage
+void CCD_Txn_Frame(const CCD_Frame_t *frame);
+
+void CCD_Txn_Status(CCD_TxnStatus_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_TXN_H */
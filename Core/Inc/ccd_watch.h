@@ -0,0 +1,78 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_watch.h
+ * @brief          : Capture chain supervisor and independent watchdog
+ ******************************************************************************
+ * The capture runs from the timer and DMA interrupts, and once TIM2/TIM4
+ * and DMA1_Stream0 lose step nothing but a mode switch or a reset brings
+ * them back. While the chain free-runs (modes 0 and 2, not a sync slave,
+ * no benchmark) the supervisor looks for two signs of that:
+ *  - Stall: no frame published for CCD_WATCH_STALL_FRAMES ICG periods
+ *    (every frame counts, the ones the full ring drops too).
+ *  - Misalignment: CCD_Watch_Frame() checks the leading dummy outputs of
+ *    every published frame, which a frame that starts at the wrong pixel
+ *    fills with photosites: they must be flat within CCD_WATCH_DUMMY_SPREAD
+ *    and at the level of the trailing dummies. CCD_WATCH_BAD_FRAMES in a
+ *    row count. The synthetic line moves its dummies, so it is not checked.
+ *    On the double-buffer path a stream off the ICG phase counts as well
+ *    (CCD_Acq_HwSyncSlipped(), ccd_acq.h).
+ *
+ * Either sign makes the next CCD_Mode_Poll() re-arm the timers, the ADC
+ * and the DMA of the current mode, within a frame period of the detection
+ * and without the processing and flow-control resets of a mode switch;
+ * the frames in flight are lost, as in any restart.
+ *
+ * After CCD_WATCH_RETRIES re-arms with no good frame in between the
+ * supervisor stops trying. A stall then leaves the independent watchdog
+ * (IWDG1) unfed, which resets the chip CCD_WATCH_IWDG_MS later and shows
+ * as CCD_FAULT_WATCHDOG in the fault report (ccd_fault.h); misaligned
+ * frames are only counted, since a missing sensor board looks the same.
+ * The watchdog also resets a main loop that stops; its period covers the
+ * longest blocking pass, a flash sector erase (ccd_store.h). It is frozen
+ * while a debugger halts the core.
+ ******************************************************************************
+ */
+
+#ifndef __CCD_WATCH_H
+#define __CCD_WATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CCD_WATCH_STALL_FRAMES 2U // ICG periods without a frame (plus 2 ms)
+#define CCD_WATCH_LEAD 32U        // Leading dummy outputs
+#define CCD_WATCH_TRAIL 14U       // Trailing dummy outputs
+#ifndef CCD_WATCH_DUMMY_SPREAD
+#define CCD_WATCH_DUMMY_SPREAD 4096U // Counts
+#endif
+#define CCD_WATCH_BAD_FRAMES 3U
+#define CCD_WATCH_RETRIES 3U
+#ifndef CCD_WATCH_IWDG_MS
+#define CCD_WATCH_IWDG_MS 8000U // 0 = no watchdog; at most 16000
+#endif
+
+typedef struct {
+  volatile uint32_t rearms;     // Chain re-armed by the supervisor
+  volatile uint32_t misaligned; // Frames failing the dummy check
+} CCD_Watch_Stats_t;
+
+extern CCD_Watch_Stats_t ccd_watch_stats;
+
+void CCD_Watch_Init(void); // Boot, last: starts the watchdog
+void CCD_Watch_Poll(void);
+
+// CCD_Mode_Poll(): a re-arm is due; the chain was (re)started
+uint8_t CCD_Watch_RearmDue(void);
+void CCD_Watch_Restarted(void);
+
+// Capture interrupt, each published frame
+void CCD_Watch_Frame(const CCD_Frame_t *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CCD_WATCH_H */
@@ -0,0 +1,87 @@
+/**
+ ******************************************************************************
+ * @file           : frame_ring.h
+ * @brief          : Lock-free SPSC frame ring between ADC DMA and USB
+ ******************************************************************************
+ * The producer is the ADC DMA. It claims a slot before each capture and
+ * completes it from the DMA complete interrupt; claimed slots are never
+ * visible to the consumer. When no slot is free the DMA is given a scratch
+ * frame instead, and that capture is counted as dropped.
+ *
+ * The consumer side has two cursors: Peek/Advance in the main loop hands
+ * frames to the processing stages and the USB TX engine, Release (from the
+ * TX completion interrupt or the main loop) returns them to the producer.
+ * Slots may be released in any order; a slot is reused once every older one
+ * has been released too.
+ *
+ * A slot can have several holders at once: Advance gives each frame its
+ * first reference, and every further sink that is to read the same slot
+ * (USB and Ethernet in CCD_TX_FANOUT, the recorder's preview) takes one
+ * with FrameRing_Retain(). Each holder releases from its own completion
+ * callback (TX done, pbuf free, SD write), in whatever order they finish,
+ * and the last release recycles the slot. The counts live beside the
+ * slots, so fan-out costs no memory and no copy; at most
+ * FRAME_RING_MAX_REFS holders per slot.
+ *
+ * Frames are never copied on the way: the DMA writes the slot that the
+ * stages process in place and the TX engine sends from, so there is no
+ * domain-to-domain move to hand to the MDMA. The one store that needs a
+ * copy, the burst PSRAM, moves its frames with the QUADSPI MDMA channel
+ * (ccd_psram.h).
+ ******************************************************************************
+ */
+
+#ifndef __FRAME_RING_H
+#define __FRAME_RING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+// 33 x 7424 bytes (with scratch) = 239 KB of RAM_D1 (512 KB), or of RAM_D2
+// (288 KB) when CCD_CACHE_ENABLE is 0. Must be a power of two.
+#define FRAME_RING_SLOTS 32
+#define FRAME_RING_MAX_REFS 4 // Holders of one slot at a time
+#define FRAME_RING_HIST 8     // Occupancy bins, FRAME_RING_SLOTS / 8 each
+
+typedef struct {
+  volatile uint32_t produced; // Frames completed by the DMA
+  volatile uint32_t released; // Frames given back by the consumer side
+  volatile uint32_t dropped;  // Frames discarded because the ring was full
+} FrameRing_Stats_t;
+
+extern FrameRing_Stats_t frame_ring_stats;
+
+void FrameRing_Init(void);
+
+// Producer side (DMA arm and DMA complete ISR)
+CCD_Frame_t *FrameRing_Claim(void);
+uint32_t FrameRing_Free(void); // Claims that would get a slot
+uint8_t FrameRing_Complete(CCD_Frame_t *frame);
+void FrameRing_CancelClaims(void);
+
+// Consumer side (main loop hands out, TX completion and processing release)
+CCD_Frame_t *FrameRing_Peek(void);
+CCD_Frame_t *FrameRing_PeekNewest(void);
+uint32_t FrameRing_PeekBatch(CCD_Frame_t **first, uint32_t max);
+void FrameRing_Advance(uint32_t n);
+void FrameRing_Release(const CCD_Frame_t *first, uint32_t n);
+// Main loop: one more holder for n handed-out frames from first; 0 (none
+// taken) for a frame outside the ring or one at FRAME_RING_MAX_REFS
+uint8_t FrameRing_Retain(const CCD_Frame_t *first, uint32_t n);
+uint32_t FrameRing_Count(void);
+// Occupancy as each frame was published (slots published and not yet
+// released, the new one included): bin (n - 1) * FRAME_RING_HIST /
+// FRAME_RING_SLOTS counts it. Copies the bins, returns the peak; clear
+// restarts both.
+uint32_t FrameRing_Occupancy(uint32_t *hist, uint8_t clear);
+// Any context: slot index of a ring frame, FRAME_RING_SLOTS for any other
+uint32_t FrameRing_Slot(const CCD_Frame_t *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FRAME_RING_H */
@@ -31,25 +31,293 @@ extern "C" {
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
-
+#include "ccd_sensor.h"
 /* USER CODE END Includes */
 
 /* Exported types ------------------------------------------------------------*/
 /* USER CODE BEGIN ET */
+// The sensor's outputs (ccd_sensor.h), dummies included, and as many after
+// the line as round a frame to whole 32-byte cache lines with its 36-byte
+// header: 3694 on the TCD1304, which needs none
+#define CCD_BUFFER_SIZE ((CCD_SENSOR_OUTPUTS + 17) / 16 * 16 - 2)
+
+#define CCD_FRAME_MAGIC 0xABCD
+#define CCD_FRAME_VERSION 4 // CCD_FrameInfo_t layout
+
+// CCD_FrameInfo_t.flags: what acquisition and processing did to the pixels
+#define CCD_FRAME_F_MULTISAMPLE 0x0001 // "I2"/"I4" averaging
+#define CCD_FRAME_F_OVERSAMPLE 0x0002  // Low-noise profile ("O1"/"O2")
+#define CCD_FRAME_F_CDS 0x0004         // Correlated double sampling
+#define CCD_FRAME_F_ABSORB 0x0008      // Transmittance or absorbance vs I0
+#define CCD_FRAME_F_DARK 0x0010        // Dark subtracted
+#define CCD_FRAME_F_FLAT 0x0020        // Flat-field corrected
+#define CCD_FRAME_F_COADD 0x0040       // Co-add mean ("N")
+#define CCD_FRAME_F_ROLLING 0x0080     // Rolling mean ("R")
+#define CCD_FRAME_F_BINNED 0x0100      // Binned ("B")
+#define CCD_FRAME_F_ROI 0x0200         // Windows only ("W")
+#define CCD_FRAME_F_PACKED 0x0400      // 12/14-bit packing ("P")
+#define CCD_FRAME_F_CODED 0x0800       // Rice / temporal coding ("C")
+#define CCD_FRAME_F_STATS 0x1000       // Statistics only (CCD_CMD_FRAME_STATS)
+#define CCD_FRAME_F_PEAKS 0x2000       // Peak list only (CCD_CMD_PEAKS)
+#define CCD_FRAME_F_SMOOTH 0x4000      // Savitzky-Golay smoothed
+#define CCD_FRAME_F_RESAMPLED 0x8000   // On the uniform nm grid
 
+#pragma pack(push, 1)
+// Per-frame metadata, in raw and shaped frames alike, right after the magic
+// and frame_num. The magic gives the payload format. A receiver that lost
+// sync checks a candidate header (version, header_len, frame_num against
+// seq) before reading payload_len more bytes and the CRC.
+typedef struct {
+  uint8_t version;      // CCD_FRAME_VERSION
+  uint8_t header_len;   // Bytes from the magic to the payload
+  uint16_t flags;       // CCD_FRAME_F_*
+  uint32_t seq;         // Frame sequence (frame_num is its low half)
+  uint64_t timestamp;   // CCD_Time_Now() at the ICG that started readout,
+                        // CCD_TIME_HZ (CCD_CmdInfo_t.clock_hz) per second
+  int16_t die_temp;     // 0.01 degC at readout (ccd_temp.h)
+  int16_t board_temp;   // Thermistor, CCD_TEMP_NONE without CCD_TEMP_NTC
+  uint32_t exposure_us; // Integration time
+  uint16_t coadd;       // Raw frames averaged into this one
+  uint16_t payload_len; // Bytes after the header
+  uint32_t crc;         // CRC-32 of header and payload, taken with crc = 0
+} CCD_FrameInfo_t;
+
+typedef struct {
+  uint16_t magic;     // CCD_FRAME_MAGIC
+  uint16_t frame_num; // Rolling frame counter
+  CCD_FrameInfo_t info;
+  uint16_t pixels[CCD_BUFFER_SIZE];
+} CCD_Frame_t;
+#pragma pack(pop)
 /* USER CODE END ET */
 
 /* Exported constants --------------------------------------------------------*/
 /* USER CODE BEGIN EC */
+// Build configuration: 1 = I/D-cache on, frame ring in cached AXI SRAM with
+// explicit maintenance; 0 = caches off, frame ring in non-cacheable RAM_D2
+#ifndef CCD_CACHE_ENABLE
+#define CCD_CACHE_ENABLE 1
+#endif
+
+// USB class on the FS port: 0 = CDC ACM (virtual COM port); 1 = vendor bulk
+// interface (usbd_vendor.c) with MS OS 2.0 descriptors, so Windows binds
+// WinUSB by itself and hosts stream through libusb instead of a tty
+#ifndef CCD_USB_VENDOR
+#define CCD_USB_VENDOR 0
+#endif
+
+// With the vendor class, alternate setting 1 of its data interface turns the
+// frame endpoint isochronous (usbd_vendor.h): one packet per 1 ms frame is
+// reserved on the bus, and a packet the host misses is dropped, not resent
+#ifndef CCD_USB_ISO
+#define CCD_USB_ISO 0
+#endif
+#if CCD_USB_ISO && !CCD_USB_VENDOR
+#error "CCD_USB_ISO is an alternate setting of the vendor class"
+#endif
+
+// Board variant with an external ULPI PHY (e.g. USB3300) on OTG_HS: 480
+// Mbit/s, 512-byte bulk packets and the core's internal DMA. The ULPI bus
+// takes PA3, PB0 and PB10, so the CCD output moves to PC4 (ADC12_INP4), the
+// burst trigger to PD0 and the strobe output is not available. 0 = OTG_HS
+// on its internal full-speed PHY (PB14/PB15).
+#ifndef CCD_USB_ULPI
+#define CCD_USB_ULPI 0
+#endif
+
+// OTG_HS internal DMA: the core moves IN data from memory into its TX FIFO
+// itself, so the OTG interrupt runs once per transfer instead of once per
+// packet with the CPU copying every byte. Only the HS core has one; it gets
+// a TX FIFO sized for whole frames either way. On with the ULPI PHY.
+#ifndef CCD_USB_HS_DMA
+#define CCD_USB_HS_DMA CCD_USB_ULPI
+#endif
+
+// Ethernet transport (ccd_eth.c): frames as UDP multicast through the ETH
+// MAC (RMII) and LwIP, from CubeMX like the USB middleware. RMII takes PA1,
+// PA2, PA7, PC1, PC4, PC5 and PB11-PB13, so it needs a board with SH and the
+// sync output routed off PA2/PA1, and cannot share the ULPI pins.
+#ifndef CCD_ETH
+#define CCD_ETH 0
+#endif
+#if CCD_ETH && CCD_USB_ULPI
+#error "CCD_ETH and CCD_USB_ULPI share PB11-PB13 and PC4"
+#endif
+
+// SD card recording (ccd_rec.c): frames from the ring to a card on SDMMC1
+// (4-bit, PC8-PC12 and PD2) through the CubeMX SD driver. Needs the cached
+// build: the SDMMC1 IDMA reaches AXI SRAM but not RAM_D2.
+#ifndef CCD_SD
+#define CCD_SD 0
+#endif
+
+// Long bursts (ccd_psram.c): the burst store moves to an 8 MB QSPI PSRAM on
+// QUADSPI bank 1 (CubeMX, with an MDMA channel for its TX). The RAM_D2
+// store then only stages the captures until the main loop copies them out.
+#ifndef CCD_BURST_PSRAM
+#define CCD_BURST_PSRAM 0
+#endif
+
+// External 16-bit SAR ADC on SPI4 (ccd_extadc.c) in place of ADC1: CNVST
+// from TIM4 CH3, the sample read by DMA on a TIM4 request per pixel, into
+// the same frame ring. For sensor boards with their own differential ADC.
+#ifndef CCD_EXT_ADC
+#define CCD_EXT_ADC 0
+#endif
+
+// Second sensor head (ccd_dual.c): its OS on PC5 into ADC2, converted
+// together with ADC1 (dual regular simultaneous) on the TIM4 trigger, with
+// fM, SH and ICG wired to both heads. Selected as sample source "V3". RMII
+// takes PC5.
+#ifndef CCD_DUAL_SENSOR
+#define CCD_DUAL_SENSOR 0
+#endif
+#if CCD_DUAL_SENSOR && CCD_ETH
+#error "CCD_DUAL_SENSOR and CCD_ETH share PC5"
+#endif
+
+// Reference photodiode (ccd_ref.c): a lamp monitor on PC1 into ADC3,
+// sampled by TIM15 and accumulated by DMA, its level over each frame's
+// integration in the status and, optionally, divided out of the frame.
+// The temperatures move to ADC3's injected group. RMII takes PC1.
+#ifndef CCD_REF_PD
+#define CCD_REF_PD 0
+#endif
+#if CCD_REF_PD && CCD_ETH
+#error "CCD_REF_PD and CCD_ETH share PC1"
+#endif
+
+// Digital inputs (ccd_din.c): PE8-PE11 read at every ICG edge in the
+// acquisition interrupt, kept by seq, and PE8's edges timestamped on the
+// frame clock (EXTI8), for valves, sample changers and the like
+#ifndef CCD_DIN
+#define CCD_DIN 0
+#endif
+
+// ITM event trace over SWO (ccd_trace.c): ICG, frame, USB TX and command
+// events with their cycle times, and printf() text, for SWV viewers. PB3
+// (TRACESWO) keeps its debug function.
+#ifndef CCD_ITM_TRACE
+#define CCD_ITM_TRACE 0
+#endif
+
+// Board thermistor next to the CCD (ccd_temp.c) on PC0 (ADC3_INP10),
+// converted by ADC3 with the die sensor. PC0 is ULPI_STP on the ULPI
+// boards.
+#ifndef CCD_TEMP_NTC
+#define CCD_TEMP_NTC 0
+#endif
 
+// Line-scan encoder (ccd_line.c) on TIM8 CH1/CH2, PC6/PC7: in mode 3 the
+// quadrature counts of a conveyor or stage start the frames, which go out
+// as 2D tiles with their positions
+#ifndef CCD_ENCODER
+#define CCD_ENCODER 0
+#endif
+
+// Hardware JPEG previews of the line scan (ccd_jpeg.c): strips of lines
+// mapped to 8 bits go through the JPEG codec by MDMA, and only the
+// compressed strips to USB while the raw lines go to the card (CCD_SD)
+#ifndef CCD_JPEG
+#define CCD_JPEG 0
+#endif
+#if CCD_JPEG && !CCD_ENCODER
+#error "CCD_JPEG previews the CCD_ENCODER line scan"
+#endif
+
+// Mains line sync (ccd_mains.c): a zero crossing detector on PC6
+// (TIM8_CH1) and "Y3" start every frame at one phase of the AC line, its
+// length whole mains periods, against lamp flicker
+#ifndef CCD_LINE_SYNC
+#define CCD_LINE_SYNC 0
+#endif
+#if CCD_LINE_SYNC && CCD_ENCODER
+#error "CCD_LINE_SYNC and CCD_ENCODER share TIM8 and PC6"
+#endif
+
+// Live dark (ccd_shutter.c): a shutter driven from PE15 (high = closed)
+// closes every so often and the closed frames keep the master dark current
+#ifndef CCD_SHUTTER
+#define CCD_SHUTTER 0
+#endif
+
+// Linear models (ccd_model.c): PLS or PCA loadings applied to every frame,
+// a few values per frame in place of the spectrum
+#ifndef CCD_MODEL
+#define CCD_MODEL 0
+#endif
+
+// Frame transport modes (tx_mode, "T<d>" command)
+#define CCD_TX_CHUNKED 0 // 512-byte transfers
+#define CCD_TX_FRAME 1   // One transfer per frame
+#define CCD_TX_BATCH 2   // Adjacent ring slots merged into one transfer
+#define CCD_TX_DUAL 3    // Whole frames spread over the FS and HS ports
+#define CCD_TX_ETH 4     // UDP multicast, one datagram per frame (CCD_ETH)
+#define CCD_TX_FANOUT 5  // As CCD_TX_FRAME, and the same slots to Ethernet
+#if CCD_ETH
+#define CCD_TX_LAST CCD_TX_FANOUT
+#else
+#define CCD_TX_LAST CCD_TX_DUAL
+#endif
+
+// Acquisition modes for continuous capture (acq_mode, "A<d>" command)
+#define CCD_ACQ_RESTART 0 // CPU restarts the DMA from the TIM2 ICG interrupt
+#define CCD_ACQ_HWSYNC 1  // DMA runs free in double-buffer mode
+
+// ccd_mode values ("M<d>" command)
+#define CCD_MODE_FAST 0        // Continuous, fast shutter
+#define CCD_MODE_ONESHOT 1     // One frame per snap ("J", ccd_snap.h)
+#define CCD_MODE_LONG 2        // Continuous, one SH per ICG period
+#define CCD_MODE_EXT_TRIGGER 3 // One frame per rising edge on CCD_EXT_TRIG
+
+// Frame sync between boards (sync_mode, "Y<d>" command), see ccd_acq.h
+#define CCD_SYNC_OFF 0
+#define CCD_SYNC_MASTER 1 // ICG start exported on CCD_SYNC_OUT
+#define CCD_SYNC_SLAVE 2  // ICG restarted by edges on CCD_EXT_TRIG
+#define CCD_SYNC_LINE 3   // ICG locked to the mains (CCD_LINE_SYNC)
+#if CCD_LINE_SYNC
+#define CCD_SYNC_LAST CCD_SYNC_LINE
+#else
+#define CCD_SYNC_LAST CCD_SYNC_SLAVE
+#endif
 /* USER CODE END EC */
 
 extern volatile uint8_t ccd_mode;
 extern volatile uint8_t mode_update_pending;
+extern volatile uint8_t tx_mode;
+extern volatile uint8_t acq_mode;
+extern volatile uint8_t sync_mode;
+extern uint32_t loop_max_cycles;
 
 /* Exported macro ------------------------------------------------------------*/
 /* USER CODE BEGIN EM */
+// D-cache maintenance for buffers written by a DMA master. Buffers must be
+// 32-byte aligned and a multiple of 32 bytes so no line is shared.
+#if CCD_CACHE_ENABLE
+#define CCD_DCACHE_INVALIDATE(addr, size)                                      \
+  SCB_InvalidateDCache_by_Addr((void *)(addr), (int32_t)(size))
+#define CCD_DCACHE_CLEAN(addr, size)                                           \
+  SCB_CleanDCache_by_Addr((uint32_t *)(addr), (int32_t)(size))
+#else
+#define CCD_DCACHE_INVALIDATE(addr, size) ((void)0)
+#define CCD_DCACHE_CLEAN(addr, size) ((void)0)
+#endif
+
+// Placement in tightly-coupled memory (zero wait state, independent of the
+// caches). DTCM is CPU-only: DMA1/DMA2 cannot reach it. CCD_DTCM_NOINIT is
+// never written by the startup, so it keeps its contents over a reset.
+#define CCD_ITCM __attribute__((section(".itcm_text")))
+#define CCD_DTCM __attribute__((section(".dtcm_data")))
+#define CCD_DTCM_BSS __attribute__((section(".dtcm_bss")))
+#define CCD_DTCM_NOINIT __attribute__((section(".dtcm_noinit")))
 
+// State the OTG_HS DMA writes (CCD_USB_HS_DMA): non-cacheable RAM_D2, so
+// setup packets and received commands need no maintenance
+#if CCD_USB_HS_DMA
+#define CCD_USB_DMA __attribute__((section(".sram3"), aligned(32)))
+#else
+#define CCD_USB_DMA
+#endif
 /* USER CODE END EM */
 
 void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim);
@@ -64,6 +332,82 @@ void Error_Handler(void);
 /* Private defines -----------------------------------------------------------*/
 
 /* USER CODE BEGIN Private defines */
+// CCD output (OS) into ADC1/ADC2
+#if CCD_USB_ULPI
+#define CCD_ADC_Pin GPIO_PIN_4
+#define CCD_ADC_GPIO_Port GPIOC
+#define CCD_ADC_CHANNEL ADC_CHANNEL_4
+#define CCD_ADC_LL_CHANNEL LL_ADC_CHANNEL_4
+#else
+#define CCD_ADC_Pin GPIO_PIN_3
+#define CCD_ADC_GPIO_Port GPIOA
+#define CCD_ADC_CHANNEL ADC_CHANNEL_15
+#define CCD_ADC_LL_CHANNEL LL_ADC_CHANNEL_15
+#endif
+
+// Second sensor's OS into ADC2 (CCD_DUAL_SENSOR), ADC12_INP8
+#define CCD_ADC_B_Pin GPIO_PIN_5
+#define CCD_ADC_B_GPIO_Port GPIOC
+#define CCD_ADC_B_LL_CHANNEL LL_ADC_CHANNEL_8
+
+// Reference photodiode into ADC3 (CCD_REF_PD), ADC123_INP11
+#define CCD_REF_Pin GPIO_PIN_1
+#define CCD_REF_GPIO_Port GPIOC
+#define CCD_REF_LL_CHANNEL LL_ADC_CHANNEL_11
+
+// Digital inputs (CCD_DIN): a run of CCD_DIN_COUNT pins of one port from
+// CCD_DIN_SHIFT, the first also on its EXTI line, see ccd_din.h
+#define CCD_DIN_GPIO_Port GPIOE
+#define CCD_DIN_SHIFT 8U
+#define CCD_DIN_COUNT 4U
+#define CCD_DIN_EDGE_Pin GPIO_PIN_8
+#define CCD_DIN_EXTI_IRQn EXTI9_5_IRQn
+
+// Burst trigger input (rising edge, EXTI0), see ccd_burst.h
+#define CCD_TRIG_IN_Pin GPIO_PIN_0
+#if CCD_USB_ULPI
+#define CCD_TRIG_IN_GPIO_Port GPIOD
+#else
+#define CCD_TRIG_IN_GPIO_Port GPIOB
+#endif
+#define CCD_TRIG_IN_EXTI_IRQn EXTI0_IRQn
+
+// Frame start input for mode 3 and sync slaves (TIM2_ETR, AF1), see
+// CCD_Acq_ConfigTrigger()
+#define CCD_EXT_TRIG_Pin GPIO_PIN_15
+#define CCD_EXT_TRIG_GPIO_Port GPIOA
+
+// Sync master output (TIM2_CH2, AF1), see CCD_Acq_SetSyncOut()
+#define CCD_SYNC_OUT_Pin GPIO_PIN_1
+#define CCD_SYNC_OUT_GPIO_Port GPIOA
+
+// Strobe output (TIM2_CH3, AF1), see CCD_Acq_SetStrobe(). TIM2_CH3 has no
+// pin left with the ULPI PHY fitted.
+#if !CCD_USB_ULPI
+#define CCD_STROBE_Pin GPIO_PIN_10
+#define CCD_STROBE_GPIO_Port GPIOB
+#endif
+
+// External ADC (CCD_EXT_ADC): CNVST on TIM4_CH3 (AF2), SPI4 SCK and MISO
+// (AF5). The converter's SDI is tied high, no MOSI.
+#define CCD_CNVST_Pin GPIO_PIN_14
+#define CCD_CNVST_GPIO_Port GPIOD
+#define CCD_EXTADC_SCK_Pin GPIO_PIN_12
+#define CCD_EXTADC_MISO_Pin GPIO_PIN_13
+#define CCD_EXTADC_GPIO_Port GPIOE
+
+// Line-scan encoder (CCD_ENCODER): A and B on TIM8_CH1/CH2 (AF3)
+#define CCD_ENC_A_Pin GPIO_PIN_6
+#define CCD_ENC_B_Pin GPIO_PIN_7
+#define CCD_ENC_GPIO_Port GPIOC
+
+// Mains zero crossing detector (CCD_LINE_SYNC): TIM8_CH1 (AF3)
+#define CCD_MAINS_Pin GPIO_PIN_6
+#define CCD_MAINS_GPIO_Port GPIOC
+
+// Shutter drive (CCD_SHUTTER), push-pull, high = closed
+#define CCD_SHUTTER_Pin GPIO_PIN_15
+#define CCD_SHUTTER_GPIO_Port GPIOE
 
 /* USER CODE END Private defines */
 
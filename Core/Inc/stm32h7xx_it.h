@@ -57,10 +57,15 @@ void PendSV_Handler(void);
 void SysTick_Handler(void);
 void DMA1_Stream0_IRQHandler(void);
 void TIM2_IRQHandler(void);
+void TIM5_IRQHandler(void);
 void TIM6_DAC_IRQHandler(void);
 void OTG_HS_IRQHandler(void);
 void OTG_FS_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void EXTI0_IRQHandler(void);
+void EXTI9_5_IRQHandler(void);
+void TIM8_UP_TIM13_IRQHandler(void);
+void TIM8_CC_IRQHandler(void);
 
 /* USER CODE END EFP */
 
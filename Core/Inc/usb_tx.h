@@ -0,0 +1,98 @@
+/**
+ ******************************************************************************
+ * @file           : usb_tx.h
+ * @brief          : Non-blocking, completion-driven USB CDC transmit engine
+ ******************************************************************************
+ * Buffers are queued from the main loop with UsbTx_Submit(). The first
+ * transfer is started by UsbTx_Poll(), every following one is chained from the
+ * CDC TransmitCplt callback, so the main loop never waits on the endpoint.
+ * When a buffer has been fully sent its done callback runs (in USB interrupt
+ * context) so the owner can recycle it.
+ ******************************************************************************
+ */
+
+#ifndef __USB_TX_H
+#define __USB_TX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define USB_TX_QUEUE_LEN 16   // Must be a power of two
+#define USB_TX_CHUNK_SIZE 512 // Bytes per CDC transfer (chunked mode)
+
+// Largest single CDC transfer: CDC_Transmit_FS/HS take a uint16_t length.
+// Kept a multiple of the 64-byte FS packet so a split transfer still ends on
+// a packet boundary; the CDC class sends the ZLP when a transfer does.
+#define USB_TX_MAX_TRANSFER (65536U - 64U)
+
+// The same for the HS port, whose packets are 512 bytes at high speed
+#if CCD_USB_ULPI
+#define USB_TX_MAX_TRANSFER_HS (65536U - 512U)
+#else
+#define USB_TX_MAX_TRANSFER_HS USB_TX_MAX_TRANSFER
+#endif
+
+// Runs once per submitted buffer with the ctx and len it was queued with
+typedef void (*UsbTx_DoneCallback)(void *ctx, uint32_t len);
+
+typedef struct {
+  const uint8_t *buf;
+  uint32_t len;
+  UsbTx_DoneCallback done;
+  void *ctx;
+} UsbTx_Desc_t;
+
+typedef struct {
+  uint8_t (*transmit)(uint8_t *buf, uint16_t len); // CDC_Transmit_FS / _HS
+  IRQn_Type irq;                                   // OTG interrupt of the link
+  uint32_t max_transfer; // Largest single CDC transfer in bytes
+
+  UsbTx_Desc_t queue[USB_TX_QUEUE_LEN];
+  volatile uint32_t head; // Written by UsbTx_Submit (main loop)
+  volatile uint32_t tail; // Written by the completion path
+  uint32_t offset;        // Bytes of queue[tail] already sent
+  uint32_t inflight;      // Bytes of the transfer in progress
+  volatile uint8_t busy;
+
+  // Statistics
+  volatile uint32_t bytes_sent;
+  volatile uint32_t transfers;
+  volatile uint32_t busy_retries;
+  volatile uint32_t full;    // Submits refused, queue full
+  volatile uint32_t aborted; // Buffers handed back unsent
+  volatile uint32_t lost;    // Isochronous packets dropped (CCD_USB_ISO)
+} UsbTx_Link_t;
+
+extern UsbTx_Link_t usb_tx_fs;
+extern UsbTx_Link_t usb_tx_hs;
+
+#if CCD_USB_VENDOR
+// Frame data on its own endpoint (usbd_vendor.h); usb_tx_fs then carries
+// only acks and reports, which no longer queue behind frames
+extern UsbTx_Link_t usb_tx_data;
+#define USB_TX_FRAMES (&usb_tx_data)
+#else
+#define USB_TX_FRAMES (&usb_tx_fs) // The link frames are sent on
+#endif
+
+void UsbTx_Init(void);
+uint8_t UsbTx_Submit(UsbTx_Link_t *link, const uint8_t *buf, uint32_t len,
+                     UsbTx_DoneCallback done, void *ctx);
+uint32_t UsbTx_Space(const UsbTx_Link_t *link);
+void UsbTx_Poll(UsbTx_Link_t *link);
+
+// Called from usbd_cdc_if.c (USB interrupt context)
+void UsbTx_OnComplete(UsbTx_Link_t *link);
+void UsbTx_Abort(UsbTx_Link_t *link);
+#if CCD_USB_ISO
+void UsbTx_OnLost(UsbTx_Link_t *link);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __USB_TX_H */
@@ -0,0 +1,1635 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_acq.c
+ * @brief          : CCD acquisition driver (ADC1 + DMA1_Stream0 into the ring)
+ ******************************************************************************
+ */
+
+#include "ccd_acq.h"
+#include "ccd_burst.h"
+#include "ccd_din.h"
+#include "ccd_dual.h"
+#include "ccd_ref.h"
+#include "ccd_extadc.h"
+#include "ccd_lat.h"
+#include "ccd_mains.h"
+#include "ccd_pattern.h"
+#include "ccd_shutter.h"
+#include "ccd_temp.h"
+#include "ccd_time.h"
+#include "ccd_trace.h"
+#include "ccd_watch.h"
+#include "frame_ring.h"
+#include "stm32h7xx_ll_adc.h"
+#include "stm32h7xx_ll_dma.h"
+#include "stm32h7xx_ll_gpio.h"
+#include "stm32h7xx_ll_tim.h"
+#include <stddef.h>
+#include <string.h>
+
+extern ADC_HandleTypeDef hadc1;
+extern DMA_HandleTypeDef hdma_adc1;
+
+#define ACQ_DMA CCD_ACQ_DMA
+#define ACQ_STREAM CCD_ACQ_STREAM
+
+// Staging buffer, whole cache lines: one ADC12 CDR word (ADC1 low half,
+// ADC2 high half) per trigger when multi-sampling or with two sensors, one
+// ADC1 halfword per trigger for CDS
+#define ACQ_STAGE_WORDS                                                        \
+  (((CCD_BUFFER_SIZE * CCD_ACQ_SAMPLES_MAX / 2U) + 7U) & ~7U)
+
+_Static_assert((CCD_BUFFER_SIZE % 2U) == 0,
+               "the averaging loop produces two pixels per pass");
+_Static_assert((CCD_PIXEL_TICKS % 2U) == 0,
+               "I4 splits the pixel into two TIM4 periods");
+
+static ADC_HandleTypeDef hadc2; // Multi-sampling slave, not set up by CubeMX
+
+// Driver state is CPU-only and read on every frame, so it lives in DTCM
+CCD_DTCM_BSS CCD_Acq_Stats_t ccd_acq_stats;
+CCD_DTCM_BSS volatile uint8_t frame_ready = 0;
+
+// Frame sequence; frame_num is its low half
+CCD_DTCM_BSS static uint32_t frame_counter = 0;
+
+// TIM1 counts TIM2 TRGO, one edge per ICG period: the ICG number of the
+// last frame handed off, its 32-bit extension, and whether it is valid
+// for the gap to the next (cleared by CCD_Acq_Stop)
+CCD_DTCM_BSS static uint16_t acq_hw_icg;
+CCD_DTCM_BSS static uint32_t acq_hw_count;
+CCD_DTCM_BSS static uint8_t acq_hw_valid;
+
+// ADC sample point, applied by CCD_Acq_ApplySampling()
+volatile uint16_t acq_adc_phase = CCD_TIM4_CCR4;
+volatile uint8_t acq_adc_sample = 0;
+volatile uint8_t acq_adc_samples = 1;
+volatile uint8_t acq_noise_profile = 0;
+volatile uint8_t acq_cds = 0;
+
+// CCD_LN_TABLE entries
+typedef struct {
+  uint8_t fm_div;
+  uint8_t ovs_shift; // Oversampling ratio 1 << ovs_shift, averaged
+  uint8_t smp_min;   // acq_sample_times index, without oversampling
+} Acq_LowNoise_t;
+
+static const Acq_LowNoise_t acq_low_noise[CCD_LN_COUNT] = CCD_LN_TABLE;
+
+// acq_adc_sample -> SMPR. Even the longest keeps one 16-bit conversion
+// inside the pixel period of the fast timing profile. The entries past
+// CCD_ACQ_SMP_COUNT only fit the slower pixels of CCD_LN_TABLE profiles.
+#define ACQ_SMP_TIMES (CCD_ACQ_SMP_COUNT + 2U)
+static const uint32_t acq_sample_times[ACQ_SMP_TIMES] = {
+    LL_ADC_SAMPLINGTIME_2CYCLES_5,  LL_ADC_SAMPLINGTIME_8CYCLES_5,
+    LL_ADC_SAMPLINGTIME_16CYCLES_5, LL_ADC_SAMPLINGTIME_32CYCLES_5,
+    LL_ADC_SAMPLINGTIME_64CYCLES_5};
+CCD_DTCM_BSS static volatile uint8_t acq_path = CCD_ACQ_RESTART; // Running
+
+// Latched by CCD_Acq_ApplySampling() for the capture that follows
+CCD_DTCM_BSS static uint8_t acq_run_samples;
+CCD_DTCM_BSS static uint8_t acq_run_cds;
+CCD_DTCM_BSS static uint8_t acq_run_ovs;
+CCD_DTCM_BSS static uint8_t acq_run_smp;
+CCD_DTCM_BSS static uint8_t acq_run_dual; // CCD_ACQ_SRC_DUAL
+CCD_DTCM_BSS static uint8_t acq_run_adc2; // ADC2 converts, dual mode
+CCD_DTCM_BSS static const CCD_AcqSource_t *acq_src; // Source of the capture
+CCD_DTCM_BSS static uint8_t acq_run_staged; // DMA into acq_stage_buf
+CCD_DTCM_BSS static uint16_t acq_run_flags;  // CCD_FRAME_F_* of the capture
+CCD_DTCM_BSS static uint32_t acq_readout_cycles; // ICG edge to DMA complete
+CCD_DTCM_BSS static uint32_t acq_dma_len; // DMA transfers per frame
+CCD_DTCM static uint32_t acq_fm_div = 1U; // Valid before the first apply
+
+// Fast-shutter SH timing ("L"), TIM5 ARR / CCR3. A change is loaded into
+// the preload registers by CCD_Acq_ShIRQ() and takes effect at an ICG.
+CCD_DTCM static volatile uint32_t acq_sh_arr = CCD_TIM5_ARR;
+CCD_DTCM static volatile uint32_t acq_sh_ccr = CCD_TIM5_CCR3;
+CCD_DTCM_BSS static volatile uint8_t acq_sh_long; // Mode 2: one SH per ICG
+CCD_DTCM_BSS static volatile uint16_t acq_sh_frame; // First frame_num with it
+CCD_DTCM_BSS static volatile uint32_t acq_sh_us;      // Integration with it
+CCD_DTCM_BSS static volatile uint32_t acq_sh_prev_us; // Before
+CCD_DTCM_BSS static uint64_t acq_icg_last; // ICG of frame acq_icg_seq, mode 2
+CCD_DTCM_BSS static uint32_t acq_icg_seq;
+CCD_DTCM_BSS static uint8_t acq_icg_valid; // Cleared by a mode switch
+
+// Saturation flag (CCD_TELEM_SATURATION). The setting, and as latched for
+// the capture; the flag of each frame handed off, bit 0 the last, and the
+// counters behind CCD_SatStatus_t. acq_sat_seen_frame is the frame_num the
+// main loop last saw flagged mid-readout.
+static volatile uint8_t acq_sat_mode = CCD_ACQ_SAT_OFF;
+static volatile uint16_t acq_sat_level = CCD_ACQ_SAT_LEVEL;
+CCD_DTCM_BSS static uint8_t acq_sat_armed;
+CCD_DTCM_BSS static uint32_t acq_sat_history;
+static uint32_t acq_sat_frames;
+static uint32_t acq_sat_count;
+static uint32_t acq_sat_last;
+static uint32_t acq_sat_early;
+static uint32_t acq_sat_seen_us;
+static uint16_t acq_sat_seen_frame;
+static uint8_t acq_sat_seen;
+
+// Strobe ("S") as last accepted, for CCD_Acq_GetStrobe()
+static uint32_t acq_strobe_delay_us;
+static uint32_t acq_strobe_width_us;
+
+// Exposure bracketing ("Q"): integration times cycled one per ICG period in
+// mode 0. acq_hdr_seq is the entry loaded at the next ICG; acq_hdr_frame is
+// a frame_num integrated with entry 0.
+CCD_DTCM_BSS static uint8_t acq_hdr_count; // Requested entries, 0 = off
+CCD_DTCM_BSS static uint16_t acq_hdr_us[CCD_ACQ_BRACKET_MAX];
+CCD_DTCM_BSS static uint32_t acq_hdr_arr[CCD_ACQ_BRACKET_MAX];
+CCD_DTCM_BSS static volatile uint8_t acq_hdr_run; // Entries cycling, 0 = off
+CCD_DTCM_BSS static volatile uint8_t acq_hdr_seq;
+CCD_DTCM_BSS static uint16_t acq_hdr_frame;
+CCD_DTCM_BSS static uint32_t acq_hdr_start; // Its sequence, for the header
+
+// Mode 1 snap: CCD_ACQ_SNAP_* state of the parked timer chain
+CCD_DTCM_BSS static volatile uint8_t acq_snap;
+
+// Long exposure ("JX"): timer ticks left after the TIM5 period running,
+// its length for the header and the frame that gets it
+CCD_DTCM_BSS static uint64_t acq_exp_left;
+CCD_DTCM_BSS static uint32_t acq_exp_us;
+CCD_DTCM_BSS static uint32_t acq_exp_seq;
+CCD_DTCM_BSS static uint8_t acq_exp_frame; // acq_exp_seq still to come
+CCD_DTCM_BSS static uint64_t acq_exp_start; // CCD_Time_Now() at its first SH
+
+// Two staging buffers, so one is reduced while the DMA fills the other.
+// acq_stage is the one the restart path arms next. A finished frame waits
+// in acq_pending for PendSV (ccd_irq.h), with the staging buffer it is to
+// be reduced from, or ACQ_STAGE_NONE if the DMA wrote it in place.
+#define ACQ_STAGE_NONE 0xFFU
+__attribute__((aligned(32))) static uint32_t acq_stage_buf[2][ACQ_STAGE_WORDS];
+CCD_DTCM_BSS static uint8_t acq_stage;
+CCD_DTCM_BSS static uint8_t acq_pending_stage;
+CCD_DTCM_BSS static CCD_Frame_t *volatile acq_pending;
+CCD_DTCM_BSS static uint64_t acq_pending_time;
+CCD_DTCM_BSS static uint32_t acq_pending_seq;
+CCD_DTCM_BSS static volatile uint8_t acq_deferring; // PendSV on a frame
+
+// Ring slots the DMA is filling: acq_target for the restart path,
+// hwsync_target[0/1] for the Memory0/Memory1 halves of double-buffer mode
+CCD_DTCM_BSS static CCD_Frame_t *volatile acq_target = NULL;
+CCD_DTCM_BSS static CCD_Frame_t *hwsync_target[2];
+
+// Double-buffer alignment: the TIM2 count (ICG phase) at which completions
+// land, the earliest seen; completions off it in a row; a re-arm is due
+CCD_DTCM_BSS static uint32_t hwsync_phase;
+CCD_DTCM_BSS static uint8_t hwsync_phased;
+CCD_DTCM_BSS static uint8_t hwsync_off;
+CCD_DTCM_BSS static volatile uint8_t hwsync_slipped;
+
+// Capture target: the burst store while a burst is recording, else the ring
+CCD_ITCM static CCD_Frame_t *CCD_Acq_Claim(void) {
+  CCD_Frame_t *frame = CCD_Burst_Claim();
+  return (frame != NULL) ? frame : FrameRing_Claim();
+}
+
+// Mode 2 integrates from one ICG to the next, so its exposure is measured
+// between the ICG edges of consecutive frames: exact whatever sets the
+// period (a sync master, or the pixel longer free-running period without
+// one). The completion interrupt's jitter is far below a whole us.
+CCD_ITCM static uint32_t CCD_Acq_IcgInterval(uint32_t seq, uint64_t icg) {
+  uint8_t chained = acq_icg_valid && seq == acq_icg_seq + 1U;
+  uint32_t cycles = (uint32_t)(icg - acq_icg_last);
+  acq_icg_last = icg;
+  acq_icg_seq = seq;
+  acq_icg_valid = 1;
+  if (!chained) {
+    return CCD_Acq_IcgTicks() / CCD_TICKS_PER_US;
+  }
+  uint32_t per_us = CCD_TIME_HZ / 1000000U;
+  return (cycles + per_us / 2U) / per_us;
+}
+
+// Integration time of frame seq, read out from the ICG at icg: the ICG
+// interval in mode 2, the ICG period for the unshuttered frame after a
+// mode switch, else the bracketing entry or the fast shutter it was read
+// out with
+CCD_ITCM static uint32_t CCD_Acq_ExposureOf(uint32_t seq, uint64_t icg) {
+  uint32_t icg_us = CCD_Acq_IcgTicks() / CCD_TICKS_PER_US;
+  if (acq_exp_frame && seq == acq_exp_seq) {
+    acq_exp_frame = 0;
+    return acq_exp_us;
+  }
+  if (acq_sh_long) {
+    return CCD_Acq_IcgInterval(seq, icg);
+  }
+  uint8_t count = acq_hdr_run;
+  if (count) {
+    int32_t d = (int32_t)(seq - acq_hdr_start);
+    return (d < 0) ? icg_us : acq_hdr_us[(uint32_t)d % count];
+  }
+  return ((int16_t)((uint16_t)seq - acq_sh_frame) >= 0) ? acq_sh_us
+                                                        : acq_sh_prev_us;
+}
+
+#if CCD_SENSOR_RISES
+// An output that rises with light, turned to the falling one the pipeline
+// and the host take (ccd_sensor.h): 65535 - x is ~x, two pixels a word
+CCD_ITCM static void CCD_Acq_Invert(CCD_Frame_t *done) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t w;
+    memcpy(&w, &done->pixels[i], sizeof(w));
+    w = ~w;
+    memcpy(&done->pixels[i], &w, sizeof(w));
+  }
+}
+#endif
+
+// Stamp the header in place (no copy) and publish the frame to the transport.
+// A frame captured while the ring was full is counted as dropped. seq was
+// given at the handoff, so numbering keeps to the capture whenever PendSV
+// runs. done_time is the DMA completion; on every path (the double-buffer
+// one and mode 3 have no interrupt at the frame start) the ICG edge is
+// taken as that minus the readout, which is exact to within the conversion
+// time.
+CCD_ITCM static void CCD_Acq_Publish(CCD_Frame_t *done, uint64_t done_time,
+                                     uint32_t seq) {
+  CCD_TRACE_ARG(CCD_TRACE_FRAME, seq);
+#if CCD_SENSOR_RISES
+  CCD_Acq_Invert(done);
+#endif
+  done->magic = CCD_FRAME_MAGIC;
+  done->frame_num = (uint16_t)seq;
+  done->info.version = CCD_FRAME_VERSION;
+  done->info.header_len = offsetof(CCD_Frame_t, pixels);
+  done->info.flags = acq_run_flags;
+  done->info.seq = seq;
+  done->info.timestamp = done_time - acq_readout_cycles;
+  done->info.die_temp = ccd_temp_die;
+  done->info.board_temp = ccd_temp_board;
+  done->info.exposure_us = CCD_Acq_ExposureOf(seq, done->info.timestamp);
+  done->info.coadd = 1;
+  done->info.payload_len = sizeof(done->pixels);
+  done->info.crc = 0; // Stamped by CCD_Crc_Stamp() once the frame is final
+#if CCD_REF_PD
+  CCD_Ref_Frame(done); // Lamp level over this integration, kept by seq
+#endif
+#if CCD_DIN
+  CCD_Din_Frame(done); // The edges of the period before, kept by seq
+#endif
+#if CCD_SHUTTER
+  CCD_Shutter_Frame(done); // Light, moving or dark, kept by seq
+#endif
+  CCD_Watch_Frame(done);
+  if (CCD_Burst_Complete(done)) {
+    done = NULL; // Stays in the burst store until the burst is drained
+  } else if (FrameRing_Complete(done)) {
+    frame_ready = 1;
+  } else {
+    done = NULL;
+  }
+#if CCD_DUAL_SENSOR
+  if (acq_run_dual) {
+    CCD_Dual_Complete(done); // Sensor B goes out beside it, or not at all
+  }
+#endif
+}
+
+// Frame written by the DMA: lines the core fetched speculatively during the
+// capture are discarded first, then the source finishes the samples
+CCD_ITCM static void CCD_Acq_FrameDone(CCD_Frame_t *done, uint64_t t,
+                                       uint32_t seq) {
+  CCD_DCACHE_INVALIDATE(done, sizeof(CCD_Frame_t));
+  if (acq_src->done != NULL) {
+    acq_src->done(done);
+  }
+  CCD_Acq_Publish(done, t, seq);
+}
+
+// CDS: each word holds a pixel's reset sample (low half) and its signal
+// sample (high half). UQSUB16 takes reset - signal for two pixels at once,
+// saturating at 0, and the inversion restores "light lowers the value"
+// from a dark level of 0xFFFF.
+CCD_ITCM static void CCD_Acq_CdsReduce(const uint32_t *src, CCD_Frame_t *done) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t a = src[i];
+    uint32_t b = src[i + 1];
+    uint32_t w = ~__UQSUB16(__PKHBT(a, b, 16), __PKHTB(b, a, 16));
+    memcpy(&done->pixels[i], &w, sizeof(w));
+  }
+}
+
+#if CCD_DUAL_SENSOR
+// Two sensors: each word holds a pixel of sensor A (ADC1, low half) and the
+// same pixel of sensor B (ADC2, high half). PKHBT/PKHTB regroup two words
+// into two pixels of each; B's go to a companion frame, or are dropped
+// when none is free.
+CCD_ITCM static void CCD_Acq_DualSplit(const uint32_t *src, CCD_Frame_t *done) {
+  CCD_Frame_t *b = CCD_Dual_Claim();
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t x = src[i];
+    uint32_t y = src[i + 1];
+    uint32_t w = __PKHBT(x, y, 16);
+    memcpy(&done->pixels[i], &w, sizeof(w));
+    if (b != NULL) {
+      w = __PKHTB(y, x, 16);
+#if CCD_SENSOR_RISES
+      w = ~w; // Sensor B never passes CCD_Acq_Publish()
+#endif
+      memcpy(&b->pixels[i], &w, sizeof(w));
+    }
+  }
+}
+#endif
+
+// Reduce a completed staging buffer into its frame slot, two pixels per
+// pass. PKHBT/PKHTB gather the ADC1 and the ADC2 halves of two words, and a
+// halving add averages both pixels at once (truncating). With 4 samples the
+// two words of each pixel are halved together first.
+CCD_ITCM static void CCD_Acq_StageDone(uint8_t stage, CCD_Frame_t *done,
+                                       uint64_t t, uint32_t seq) {
+  const uint32_t *src = acq_stage_buf[stage];
+  CCD_DCACHE_INVALIDATE(src, sizeof(acq_stage_buf[0]));
+  if (acq_run_cds) {
+    CCD_Acq_CdsReduce(src, done);
+    CCD_Acq_Publish(done, t, seq);
+    return;
+  }
+#if CCD_DUAL_SENSOR
+  if (acq_run_dual) {
+    CCD_Acq_DualSplit(src, done);
+    CCD_Acq_Publish(done, t, seq);
+    return;
+  }
+#endif
+  uint8_t quad = (acq_run_samples == 4);
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t a;
+    uint32_t b;
+    if (quad) {
+      a = __UHADD16(src[2 * i], src[2 * i + 1]);
+      b = __UHADD16(src[2 * i + 2], src[2 * i + 3]);
+    } else {
+      a = src[i];
+      b = src[i + 1];
+    }
+    uint32_t w = __UHADD16(__PKHBT(a, b, 16), __PKHTB(b, a, 16));
+    memcpy(&done->pixels[i], &w, sizeof(w));
+  }
+  CCD_Acq_Publish(done, t, seq);
+}
+
+CCD_ITCM static void CCD_Acq_Finish(CCD_Frame_t *done, uint8_t stage,
+                                    uint64_t t, uint32_t seq) {
+  if (stage == ACQ_STAGE_NONE) {
+    CCD_Acq_FrameDone(done, t, seq);
+  } else {
+    CCD_Acq_StageDone(stage, done, t, seq);
+  }
+}
+
+// Hardware ICG number of the period a completing frame was read out in.
+// A completion handled after the next ICG has its edge counted already, so
+// one early in a running period belongs to the period before. A stopped
+// TIM2 (one-pulse, mode 3) has ended the frame's own period.
+CCD_ITCM static uint16_t CCD_Acq_IcgNumber(void) {
+  uint16_t n;
+  uint32_t cnt;
+  do {
+    n = (uint16_t)LL_TIM_GetCounter(TIM1);
+    cnt = LL_TIM_GetCounter(TIM2);
+  } while (n != (uint16_t)LL_TIM_GetCounter(TIM1));
+  if (LL_TIM_IsEnabledCounter(TIM2) &&
+      cnt < (LL_TIM_GetAutoReload(TIM2) + 1U) / 2U) {
+    n--;
+  }
+  return n;
+}
+
+// Every ICG period of a continuous or triggered run reads out one frame,
+// so a gap in the hardware count since the last handoff is frames the
+// acquisition lost (a resync discarded them, or no completion came) before
+// the ring or the transport could. Snaps flush a period before each frame
+// and are only counted.
+CCD_ITCM static void CCD_Acq_CountIcg(void) {
+  uint16_t n = CCD_Acq_IcgNumber();
+  uint16_t gap = (uint16_t)(n - acq_hw_icg);
+  if (acq_hw_valid) {
+    acq_hw_count += gap;
+    if (gap > 1U && ccd_mode != CCD_MODE_ONESHOT) {
+      ccd_acq_stats.missed += gap - 1U;
+    }
+  }
+  acq_hw_icg = n;
+  acq_hw_valid = 1;
+}
+
+// The watchdog flag of the frame handed off: set by any conversion of its
+// readout at or below the level, cleared here and by the restart path's arm
+CCD_ITCM static void CCD_Acq_SatLatch(void) {
+  uint32_t sat = 0;
+  if (acq_sat_armed) {
+    sat = LL_ADC_IsActiveFlag_AWD1(ADC1);
+    LL_ADC_ClearFlag_AWD1(ADC1);
+    acq_sat_frames++;
+    if (sat) {
+      acq_sat_count++;
+      acq_sat_last = frame_counter;
+    }
+  }
+  acq_sat_history = (acq_sat_history << 1) | sat;
+}
+
+// Hand a finished frame to PendSV. One waits at a time, and it must be
+// done within the frame period: the next completion re-arms its staging
+// buffer. One still waiting then is finished here, late, and counted, as
+// is one PendSV is still on.
+CCD_ITCM static void CCD_Acq_Defer(CCD_Frame_t *done, uint8_t stage,
+                                   uint64_t t) {
+  CCD_Frame_t *late = acq_pending;
+  if (late != NULL || acq_deferring) {
+    ccd_acq_stats.late++;
+  }
+  if (late != NULL) {
+    acq_pending = NULL;
+    CCD_Acq_Finish(late, acq_pending_stage, acq_pending_time,
+                   acq_pending_seq);
+  }
+  CCD_Acq_CountIcg();
+  CCD_Acq_SatLatch();
+#if CCD_DIN
+  CCD_Din_Latch(frame_counter);
+#endif
+  acq_pending_stage = stage;
+  acq_pending_time = t;
+  acq_pending_seq = frame_counter++;
+  acq_pending = done;
+  SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+// PendSV: the frame waiting, taken with interrupts masked so a handoff
+// meanwhile finds it gone
+CCD_ITCM void CCD_Acq_DeferredIRQ(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  CCD_Frame_t *done = acq_pending;
+  uint8_t stage = acq_pending_stage;
+  uint64_t t = acq_pending_time;
+  uint32_t seq = acq_pending_seq;
+  acq_pending = NULL;
+  acq_deferring = (done != NULL);
+  __set_PRIMASK(primask);
+  if (done != NULL) {
+    CCD_Acq_Finish(done, stage, t, seq);
+    acq_deferring = 0;
+  }
+}
+
+CCD_ITCM static void CCD_Acq_ClearStreamFlags(void) {
+  LL_DMA_ClearFlag_TC0(ACQ_DMA);
+  LL_DMA_ClearFlag_HT0(ACQ_DMA);
+  LL_DMA_ClearFlag_TE0(ACQ_DMA);
+  LL_DMA_ClearFlag_DME0(ACQ_DMA);
+  LL_DMA_ClearFlag_FE0(ACQ_DMA);
+}
+
+CCD_ITCM static void CCD_Acq_DisableStream(void) {
+  LL_DMA_DisableStream(ACQ_DMA, ACQ_STREAM);
+  while (LL_DMA_IsEnabledStream(ACQ_DMA, ACQ_STREAM)) {
+  }
+}
+
+// ========== SAMPLE SOURCES ==========
+
+// ADC1 source: TIM4 CC4 triggers a conversion, or one on each ADC in dual
+// mode. Sampling time, oversampler and dual mode can only change while
+// both ADCs are stopped and disabled, which they are when this runs.
+static uint32_t CCD_Acq_AdcApply(uint32_t ccr, uint32_t arr) {
+  (void)arr;
+  uint8_t ovs = acq_run_ovs;
+  LL_TIM_OC_SetCompareCH4(TIM4, ccr);
+  if (ovs > 0) {
+    LL_ADC_ConfigOverSamplingRatioShift(
+        ADC1, 1UL << ovs, (uint32_t)ovs << ADC_CFGR2_OVSS_Pos);
+    LL_ADC_SetOverSamplingDiscont(ADC1, LL_ADC_OVS_REG_CONT);
+    LL_ADC_SetOverSamplingScope(ADC1, LL_ADC_OVS_GRP_REGULAR_CONTINUED);
+  } else {
+    LL_ADC_SetOverSamplingScope(ADC1, LL_ADC_OVS_DISABLE);
+  }
+  // Analog watchdog 1 on every regular conversion, below the low threshold
+  // only; with the oversampler it compares the sum, before the shift
+  uint32_t low = 0;
+  if (acq_sat_mode != CCD_ACQ_SAT_OFF) {
+    low = ((uint32_t)acq_sat_level + 1U) << ovs;
+  }
+  LL_ADC_SetAnalogWDThresholds(ADC1, LL_ADC_AWD1, LL_ADC_AWD_THRESHOLD_LOW,
+                               low);
+  LL_ADC_SetAnalogWDThresholds(ADC1, LL_ADC_AWD1, LL_ADC_AWD_THRESHOLD_HIGH,
+                               ADC_HTR_HT);
+  LL_ADC_SetAnalogWDMonitChannels(ADC1, LL_ADC_AWD1,
+                                  low ? LL_ADC_AWD_ALL_CHANNELS_REG
+                                      : LL_ADC_AWD_DISABLE);
+  LL_ADC_ClearFlag_AWD1(ADC1);
+  LL_ADC_SetChannelSamplingTime(ADC1, CCD_ADC_LL_CHANNEL, // As in MX_ADC1_Init
+                                acq_sample_times[acq_run_smp]);
+  LL_ADC_SetChannelSamplingTime(ADC2, CCD_ADC_LL_CHANNEL,
+                                acq_sample_times[acq_run_smp]);
+#if CCD_DUAL_SENSOR
+  LL_ADC_REG_SetSequencerRanks(ADC2, LL_ADC_REG_RANK_1, CCD_ADC_LL_CHANNEL);
+#endif
+  if (acq_run_samples > 1) {
+    LL_ADC_SetMultimode(ADC12_COMMON, LL_ADC_MULTI_DUAL_REG_INTERL);
+    LL_ADC_SetMultiDMATransfer(ADC12_COMMON, LL_ADC_MULTI_REG_DMA_RES_32_10B);
+    LL_ADC_SetMultiTwoSamplingDelay(ADC12_COMMON,
+                                    LL_ADC_MULTI_TWOSMP_DELAY_9CYCLES);
+  } else {
+    LL_ADC_SetMultimode(ADC12_COMMON, LL_ADC_MULTI_INDEPENDENT);
+    LL_ADC_SetMultiDMATransfer(ADC12_COMMON, LL_ADC_MULTI_REG_DMA_EACH_ADC);
+  }
+  return ccr;
+}
+
+// DMA source and element size: ADC1 DR halfwords, or ADC12 CDR words when
+// ADC2 converts as well
+static void CCD_Acq_AdcStream(void) {
+  LL_DMA_SetPeriphRequest(ACQ_DMA, ACQ_STREAM, LL_DMAMUX1_REQ_ADC1);
+  if (acq_run_adc2) {
+    LL_DMA_SetPeriphAddress(ACQ_DMA, ACQ_STREAM,
+                            (uint32_t)&ADC12_COMMON->CDR);
+    LL_DMA_SetPeriphSize(ACQ_DMA, ACQ_STREAM, LL_DMA_PDATAALIGN_WORD);
+    LL_DMA_SetMemorySize(ACQ_DMA, ACQ_STREAM, LL_DMA_MDATAALIGN_WORD);
+  } else {
+    LL_DMA_SetPeriphAddress(ACQ_DMA, ACQ_STREAM, (uint32_t)&ADC1->DR);
+    LL_DMA_SetPeriphSize(ACQ_DMA, ACQ_STREAM, LL_DMA_PDATAALIGN_HALFWORD);
+    LL_DMA_SetMemorySize(ACQ_DMA, ACQ_STREAM, LL_DMA_MDATAALIGN_HALFWORD);
+  }
+}
+
+// Start ADC conversions once. DMA requests never stop at the end of a
+// frame; between frames the stream is simply disabled. In dual mode ADC2
+// only has to be enabled: ADC1 starts and triggers both.
+static void CCD_Acq_AdcStart(void) {
+  if (LL_ADC_REG_IsConversionOngoing(ADC1)) {
+    return;
+  }
+  if (acq_run_adc2 && !LL_ADC_IsEnabled(ADC2)) {
+    LL_ADC_ClearFlag_ADRDY(ADC2);
+    LL_ADC_Enable(ADC2);
+    while (!LL_ADC_IsActiveFlag_ADRDY(ADC2)) {
+    }
+  }
+  LL_ADC_REG_SetDataTransferMode(ADC1, LL_ADC_REG_DMA_TRANSFER_UNLIMITED);
+  HAL_ADC_Start(&hadc1);
+}
+
+// The ADC blocks DMA requests while OVR is set, so clearing it once the
+// stream is enabled lets the next conversion land in pixel 0
+CCD_ITCM static void CCD_Acq_AdcArm(void) {
+  LL_DMA_EnableStream(ACQ_DMA, ACQ_STREAM);
+  LL_ADC_ClearFlag_OVR(ADC1);
+  LL_ADC_ClearFlag_AWD1(ADC1); // Not from a snap's flush
+  if (acq_run_adc2) {
+    LL_ADC_ClearFlag_OVR(ADC2);
+  }
+}
+
+// Set mid-frame only: the arm clears it, and the DMA reads every conversion
+// up to the last pixel, while OVR blocks its next request
+CCD_ITCM static uint8_t CCD_Acq_AdcOverrun(void) {
+  return LL_ADC_IsActiveFlag_OVR(ADC1) ||
+         (acq_run_adc2 && LL_ADC_IsActiveFlag_OVR(ADC2));
+}
+
+static void CCD_Acq_AdcStop(void) {
+  HAL_ADC_Stop(&hadc1); // In dual mode this stops ADC2 as well
+  if (LL_ADC_IsEnabled(ADC2)) {
+    LL_ADC_Disable(ADC2);
+    while (LL_ADC_IsEnabled(ADC2)) {
+    }
+  }
+  LL_ADC_REG_SetDataTransferMode(ADC1, LL_ADC_REG_DR_TRANSFER);
+}
+
+#if CCD_DUAL_SENSOR
+static uint8_t CCD_Acq_DualInit(void) {
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  GPIO_InitTypeDef gpio = {0};
+  gpio.Pin = CCD_ADC_B_Pin;
+  gpio.Mode = GPIO_MODE_ANALOG;
+  gpio.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(CCD_ADC_B_GPIO_Port, &gpio);
+  return 1;
+}
+
+// Two sensors: ADC1 as for one, and ADC2 on sensor B's input, converting
+// at the same instant on ADC1's trigger (dual regular simultaneous). The
+// mode needs the same sampling time on both.
+static uint32_t CCD_Acq_DualApply(uint32_t ccr, uint32_t arr) {
+  uint32_t sampled = CCD_Acq_AdcApply(ccr, arr);
+  LL_ADC_SetChannelPreselection(ADC2, CCD_ADC_B_LL_CHANNEL);
+  LL_ADC_REG_SetSequencerRanks(ADC2, LL_ADC_REG_RANK_1, CCD_ADC_B_LL_CHANNEL);
+  LL_ADC_SetChannelSamplingTime(ADC2, CCD_ADC_B_LL_CHANNEL,
+                                acq_sample_times[acq_run_smp]);
+  LL_ADC_SetMultimode(ADC12_COMMON, LL_ADC_MULTI_DUAL_REG_SIMULT);
+  LL_ADC_SetMultiDMATransfer(ADC12_COMMON, LL_ADC_MULTI_REG_DMA_RES_32_10B);
+  return sampled;
+}
+#endif
+
+// Indexed by CCD_ACQ_SRC_*; an entry without apply is not in this build
+static const CCD_AcqSource_t acq_sources[CCD_ACQ_SRC_COUNT] = {
+    [CCD_ACQ_SRC_ADC] = {NULL, CCD_Acq_AdcApply, CCD_Acq_AdcStream,
+                         CCD_Acq_AdcStart, CCD_Acq_AdcArm, CCD_Acq_AdcStop,
+                         NULL, CCD_Acq_AdcOverrun},
+#if CCD_EXT_ADC
+    [CCD_ACQ_SRC_SPI] = {CCD_ExtAdc_Init, CCD_ExtAdc_SetPhase,
+                         CCD_ExtAdc_Stream, CCD_ExtAdc_Start, CCD_ExtAdc_Arm,
+                         CCD_ExtAdc_Stop,
+                         CCD_EXT_ADC_TWOS ? CCD_ExtAdc_Done : NULL,
+                         CCD_ExtAdc_Overrun},
+#endif
+    [CCD_ACQ_SRC_PATTERN] = {CCD_Pattern_Init, CCD_Pattern_Apply,
+                             CCD_Pattern_Stream, CCD_Pattern_Start,
+                             CCD_Pattern_Arm, CCD_Pattern_Stop, NULL, NULL},
+#if CCD_DUAL_SENSOR
+    [CCD_ACQ_SRC_DUAL] = {CCD_Acq_DualInit, CCD_Acq_DualApply,
+                          CCD_Acq_AdcStream, CCD_Acq_AdcStart, CCD_Acq_AdcArm,
+                          CCD_Acq_AdcStop, NULL, CCD_Acq_AdcOverrun},
+#endif
+};
+
+volatile uint8_t acq_source = CCD_EXT_ADC ? CCD_ACQ_SRC_SPI : CCD_ACQ_SRC_ADC;
+static uint8_t acq_sources_fitted; // Bit per CCD_ACQ_SRC_*
+
+// Every source is brought up once; one that reports no hardware cannot be
+// selected, and a default without its hardware falls back to ADC1
+void CCD_Acq_InitSources(void) {
+  for (uint8_t i = 0; i < CCD_ACQ_SRC_COUNT; i++) {
+    const CCD_AcqSource_t *src = &acq_sources[i];
+    if (src->apply != NULL && (src->init == NULL || src->init())) {
+      acq_sources_fitted |= 1U << i;
+    }
+  }
+  if (!(acq_sources_fitted & (1U << acq_source))) {
+    acq_source = CCD_ACQ_SRC_ADC;
+  }
+  acq_src = &acq_sources[acq_source];
+}
+
+// TIM1 in external clock mode 1 on ITR1 (TIM2 TRGO): it counts ICG
+// periods in hardware, whatever the interrupts and the DMA made of them.
+// TRGO is the update, or the counter enable in mode 3; either gives one
+// rising edge per period.
+void CCD_Acq_InitIcgCounter(void) {
+  __HAL_RCC_TIM1_CLK_ENABLE();
+  LL_TIM_SetPrescaler(TIM1, 0);
+  LL_TIM_SetAutoReload(TIM1, 0xFFFFU);
+  LL_TIM_SetTriggerInput(TIM1, LL_TIM_TS_ITR1);
+  LL_TIM_SetClockSource(TIM1, LL_TIM_CLOCKSOURCE_EXT_MODE1);
+  LL_TIM_GenerateEvent_UPDATE(TIM1);
+  LL_TIM_EnableCounter(TIM1);
+}
+
+uint32_t CCD_Acq_IcgCount(void) { return acq_hw_count; }
+
+// Takes effect at the next CCD_Acq_ApplySampling()
+uint8_t CCD_Acq_SetSource(uint8_t source) {
+  if (source >= CCD_ACQ_SRC_COUNT ||
+      !(acq_sources_fitted & (1U << source))) {
+    return 0;
+  }
+  acq_source = source;
+  return 1;
+}
+
+// The stream reads a fixed register unless the source says otherwise. With
+// CCD_ACQ_FIFO the FIFO packs halfword samples into word writes, so the
+// stream takes the bus half as often and rides out up to 8 samples of a
+// busy memory instead of 1. Bursts need a length in whole beats, which
+// CCD_BUFFER_SIZE is not, so the writes stay single.
+static void CCD_Acq_SetStreamFormat(void) {
+  LL_DMA_SetPeriphIncMode(ACQ_DMA, ACQ_STREAM, LL_DMA_PERIPH_NOINCREMENT);
+  acq_src->stream();
+  LL_DMA_SetStreamPriorityLevel(ACQ_DMA, ACQ_STREAM,
+                                LL_DMA_PRIORITY_VERYHIGH);
+#if CCD_ACQ_FIFO
+  LL_DMA_SetMemorySize(ACQ_DMA, ACQ_STREAM, LL_DMA_MDATAALIGN_WORD);
+  LL_DMA_SetMemoryBurstxfer(ACQ_DMA, ACQ_STREAM, LL_DMA_MBURST_SINGLE);
+  LL_DMA_SetFIFOThreshold(ACQ_DMA, ACQ_STREAM, LL_DMA_FIFOTHRESHOLD_1_2);
+  LL_DMA_EnableFifoMode(ACQ_DMA, ACQ_STREAM);
+#else
+  LL_DMA_DisableFifoMode(ACQ_DMA, ACQ_STREAM);
+#endif
+}
+
+// ========== RESTART PATH (register level) ==========
+
+// Stream settings that HAL_DMA_Init leaves alone or a double-buffer run
+// may have changed. Done once per start, not per frame.
+static void CCD_Acq_SetupStream(void) {
+  CCD_Acq_DisableStream();
+  LL_DMA_DisableDoubleBufferMode(ACQ_DMA, ACQ_STREAM);
+  LL_DMA_SetMode(ACQ_DMA, ACQ_STREAM, LL_DMA_MODE_NORMAL);
+  CCD_Acq_SetStreamFormat();
+  LL_DMA_DisableIT_HT(ACQ_DMA, ACQ_STREAM);
+  LL_DMA_DisableIT_DME(ACQ_DMA, ACQ_STREAM);
+  LL_DMA_DisableIT_FE(ACQ_DMA, ACQ_STREAM);
+  LL_DMA_EnableIT_TC(ACQ_DMA, ACQ_STREAM);
+  LL_DMA_EnableIT_TE(ACQ_DMA, ACQ_STREAM);
+  CCD_Acq_ClearStreamFlags();
+}
+
+// Point the (disabled) stream at the claimed slot, or at the next staging
+// buffer when multi-sampling, and let the source enable it
+static inline void CCD_Acq_Arm(void) {
+  if (acq_target == NULL) {
+    acq_target = CCD_Acq_Claim();
+  }
+  CCD_Acq_ClearStreamFlags();
+  uint32_t dst = acq_run_staged ? (uint32_t)acq_stage_buf[acq_stage]
+                               : (uint32_t)acq_target->pixels;
+  LL_DMA_SetMemoryAddress(ACQ_DMA, ACQ_STREAM, dst);
+  LL_DMA_SetDataLength(ACQ_DMA, ACQ_STREAM, acq_dma_len);
+  acq_src->arm();
+}
+
+// Mode 1 between snaps: TIM2 and TIM4 stop one pixel before the end of an
+// ICG period, so ICG stays inactive and the ADC gets no triggers. TIM5
+// keeps running and its SH pulses go on clearing the sensor.
+CCD_ITCM static void CCD_Acq_SnapPark(void) {
+  LL_TIM_DisableCounter(TIM2);
+  LL_TIM_DisableCounter(TIM4);
+  LL_TIM_DisableIT_UPDATE(TIM2);
+  LL_TIM_SetCounter(TIM2, LL_TIM_GetAutoReload(TIM2) - CCD_PIXEL_TICKS);
+  LL_TIM_ClearFlag_UPDATE(TIM2);
+}
+
+// Restart path: take the frame the DMA finished off the stream, with its
+// staging buffer. The DMA interrupt and the ICG one (which preempts it)
+// both do, so the flags and acq_target change with interrupts masked.
+// NULL if no full transfer completed.
+CCD_ITCM static CCD_Frame_t *CCD_Acq_Take(uint8_t *stage) {
+  CCD_Frame_t *done = NULL;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint8_t tc = LL_DMA_IsActiveFlag_TC0(ACQ_DMA);
+  if (LL_DMA_IsActiveFlag_TE0(ACQ_DMA)) {
+    ccd_acq_stats.dma_errors++;
+    tc = 0; // Slot stays claimed and is refilled on the next arm
+  }
+  CCD_Acq_ClearStreamFlags();
+  // A software disable (resync) also raises TC; only a full transfer counts
+  if (tc && LL_DMA_GetDataLength(ACQ_DMA, ACQ_STREAM) == 0) {
+    done = acq_target;
+    acq_target = NULL;
+    *stage = ACQ_STAGE_NONE;
+    if (acq_run_staged) {
+      *stage = acq_stage;
+      acq_stage ^= 1U;
+    }
+  }
+  __set_PRIMASK(primask);
+  return done;
+}
+
+// The reduction and the publish take longer than the gap to the next ICG,
+// which must re-arm the stream within a pixel, so they go to PendSV
+CCD_ITCM static void CCD_Acq_Handoff(CCD_Frame_t *done, uint8_t stage,
+                                     uint64_t t) {
+  if (acq_snap == CCD_ACQ_SNAP_READ) {
+    CCD_Acq_SnapPark(); // Also masks the ICG interrupt
+    acq_snap = CCD_ACQ_SNAP_READY;
+  }
+  CCD_Acq_Defer(done, stage, t);
+}
+
+// TIM2 update (ICG): frame start. The previous transfer has normally
+// completed already; if it has not, pixel 0 was missed and the partial
+// frame is discarded so the next one starts aligned again. In external
+// trigger mode the update is the end of the one-pulse period instead, and
+// the stream is armed for the next edge. This preempts the DMA interrupt,
+// so a completion that is still to be handled is taken off the stream
+// first and handed on after the re-arm, with this interrupt's time (late
+// by the gap before the ICG).
+CCD_ITCM void CCD_Acq_IcgIRQ(void) {
+#if CCD_DIN
+  uint32_t din = LL_GPIO_ReadInputPort(CCD_DIN_GPIO_Port); // At the edge
+#endif
+  CCD_TRACE(CCD_TRACE_ICG);
+  CCD_Frame_t *done = NULL;
+  uint8_t stage = ACQ_STAGE_NONE;
+  if (LL_DMA_IsActiveFlag_TC0(ACQ_DMA)) {
+    done = CCD_Acq_Take(&stage);
+  }
+  if (acq_snap == CCD_ACQ_SNAP_FLUSH) {
+    acq_snap = CCD_ACQ_SNAP_READ; // The flush period cleared the sensor
+  }
+  if (LL_DMA_IsEnabledStream(ACQ_DMA, ACQ_STREAM)) {
+    CCD_Acq_DisableStream();
+    ccd_acq_stats.resyncs++;
+    if (acq_src->overrun != NULL && acq_src->overrun()) {
+      ccd_acq_stats.overruns++; // Not a late arm: the bus fell behind
+    }
+  }
+  CCD_Acq_Arm();
+  if (LL_TIM_IsEnabledCounter(TIM2)) { // One-pulse (edge) runs have stopped
+    CCD_Lat_Arm(LL_TIM_GetCounter(TIM2));
+  }
+  if (done != NULL) {
+    CCD_Acq_Handoff(done, stage, CCD_Time_Now()); // Completed before this
+  }
+#if CCD_DIN
+  if (LL_TIM_IsEnabledCounter(TIM2)) {
+    CCD_Din_Icg(din); // For the frame just armed, at its handoff
+  }
+#endif
+}
+
+// DMA1_Stream0 interrupt. Returns 0 if the HAL handler should run instead
+// (double-buffer path).
+CCD_ITCM uint8_t CCD_Acq_DmaIRQ(void) {
+  if (acq_path != CCD_ACQ_RESTART) {
+    return 0;
+  }
+  uint64_t t = CCD_Time_Now();
+  uint8_t stage;
+  CCD_Frame_t *done = CCD_Acq_Take(&stage);
+  if (done != NULL) {
+    CCD_Acq_Handoff(done, stage, t);
+  }
+  return 1;
+}
+
+// ========== DOUBLE-BUFFER PATH ==========
+
+// Double-buffer complete: the stream has already switched to the other
+// memory register in hardware, so the finished one is re-pointed at the next
+// free slot. Multi-sampling keeps the two staging buffers as the DMA
+// memories and averages the finished one into a freshly claimed slot. Either
+// way the frame work is left to PendSV, as on the restart path; it has the
+// frame time the DMA takes to come back to that memory.
+// Nothing restarts the double-buffered stream at the ICG, so it is checked
+// against it instead: every completion should land at the same TIM2 count,
+// late only by the interrupt latency. A missed or extra ADC sample moves
+// all later ones by a pixel, where latency moves only one, so
+// CCD_ACQ_SLIP_FRAMES completions off in a row count as a resync and ask
+// the supervisor (ccd_watch.h) for a re-arm.
+CCD_ITCM static void CCD_Acq_HwSyncCheck(void) {
+  uint32_t period = LL_TIM_GetAutoReload(TIM2) + 1U;
+  uint32_t half_px = period / (2U * CCD_BUFFER_SIZE);
+  uint32_t cnt = LL_TIM_GetCounter(TIM2);
+  if (!hwsync_phased) {
+    hwsync_phase = cnt;
+    hwsync_phased = 1;
+    return;
+  }
+  int32_t d = (int32_t)(cnt + period - hwsync_phase) % (int32_t)period;
+  if (d >= (int32_t)(period / 2U)) {
+    d -= (int32_t)period;
+  }
+  if (d < 0 && d > -(int32_t)half_px) {
+    hwsync_phase = cnt; // Less latency than before
+  }
+  if (d > -(int32_t)half_px && d < (int32_t)half_px) {
+    hwsync_off = 0;
+  } else if (++hwsync_off == CCD_ACQ_SLIP_FRAMES && !hwsync_slipped) {
+    hwsync_slipped = 1;
+    ccd_acq_stats.resyncs++;
+  }
+}
+
+CCD_ITCM static void CCD_Acq_HwSyncDone(uint32_t half) {
+  uint64_t t = CCD_Time_Now();
+  CCD_Acq_HwSyncCheck();
+  if (acq_run_staged) {
+    CCD_Acq_Defer(CCD_Acq_Claim(), (uint8_t)half, t);
+    return;
+  }
+  CCD_Frame_t *done = hwsync_target[half];
+  hwsync_target[half] = CCD_Acq_Claim();
+  HAL_DMAEx_ChangeMemory(&hdma_adc1, (uint32_t)hwsync_target[half]->pixels,
+                         (half == 0) ? MEMORY0 : MEMORY1);
+  CCD_Acq_Defer(done, ACQ_STAGE_NONE, t);
+}
+
+static void CCD_Acq_HwSyncM0Cplt(DMA_HandleTypeDef *hdma) {
+  CCD_Acq_HwSyncDone(0);
+}
+
+static void CCD_Acq_HwSyncM1Cplt(DMA_HandleTypeDef *hdma) {
+  CCD_Acq_HwSyncDone(1);
+}
+
+// The ADC is triggered by TIM4, which TIM2 TRGO resets every ICG period, and
+// an ICG period is exactly CCD_BUFFER_SIZE triggers (asserted in
+// ccd_timing.h).
+// So a free-running double-buffered DMA of CCD_BUFFER_SIZE samples per
+// buffer stays pixel-aligned once it is armed before the timers start.
+static void CCD_Acq_StartHwSync(void) {
+  uint32_t m0 = (uint32_t)acq_stage_buf[0];
+  uint32_t m1 = (uint32_t)acq_stage_buf[1];
+  if (!acq_run_staged) {
+    hwsync_target[0] = CCD_Acq_Claim();
+    hwsync_target[1] = CCD_Acq_Claim();
+    m0 = (uint32_t)hwsync_target[0]->pixels;
+    m1 = (uint32_t)hwsync_target[1]->pixels;
+  }
+
+  hwsync_phased = 0;
+  hwsync_off = 0;
+  hwsync_slipped = 0;
+  hdma_adc1.XferCpltCallback = CCD_Acq_HwSyncM0Cplt;
+  hdma_adc1.XferM1CpltCallback = CCD_Acq_HwSyncM1Cplt;
+  hdma_adc1.XferHalfCpltCallback = NULL;
+  hdma_adc1.XferM1HalfCpltCallback = NULL;
+  CCD_Acq_SetStreamFormat();
+  HAL_DMAEx_MultiBufferStart_IT(&hdma_adc1,
+                                LL_DMA_GetPeriphAddress(ACQ_DMA, ACQ_STREAM),
+                                m0, m1, acq_dma_len);
+  acq_src->start();
+}
+
+uint8_t CCD_Acq_HwSyncSlipped(void) {
+  return acq_path == CCD_ACQ_HWSYNC && hwsync_slipped;
+}
+
+// ========== CONTROL ==========
+
+// Arm continuous capture (modes 0 and 2) in the selected acquisition mode.
+// Only the restart path needs the TIM2 ICG interrupt.
+void CCD_Acq_StartContinuous(void) {
+  acq_path = acq_mode;
+  LL_TIM_ClearFlag_UPDATE(TIM2);
+  if (acq_path == CCD_ACQ_HWSYNC) {
+    LL_TIM_DisableIT_UPDATE(TIM2);
+    CCD_Acq_StartHwSync();
+  } else {
+    CCD_Acq_SetupStream();
+    acq_src->start();
+    CCD_Acq_Arm();
+    LL_TIM_EnableIT_UPDATE(TIM2);
+  }
+}
+
+// Mode 1: call once the chain has been started and aligned like a
+// continuous one. It is parked at once, with the ADC running and the stream
+// set up, and every CCD_Acq_Snap() then takes one frame on the restart path.
+void CCD_Acq_StartSnap(void) {
+  acq_path = CCD_ACQ_RESTART;
+  CCD_Acq_SnapPark();
+  CCD_Acq_SetupStream();
+  acq_src->start();
+  acq_snap = CCD_ACQ_SNAP_READY;
+}
+
+// Mode 1 snap, from an interrupt with the others masked. The TIM2 update
+// starts an ICG period at once, with TIM3/TIM4/TIM5 restarted by its TRGO as
+// in CCD_Acq_AlignTimers(); that period flushes the charge collected while
+// parked. The next ICG arms the stream, and the frame it reads out holds the
+// fast-shutter integration time. Its DMA completion parks the chain again,
+// so a snap costs two ICG periods and no main loop work. 0 while a snap is
+// still running, or outside mode 1.
+CCD_ITCM uint8_t CCD_Acq_Snap(void) {
+  if (acq_snap != CCD_ACQ_SNAP_READY) {
+    return 0;
+  }
+  acq_snap = CCD_ACQ_SNAP_FLUSH;
+  LL_TIM_EnableCounter(TIM2);
+  LL_TIM_GenerateEvent_UPDATE(TIM2);
+  LL_TIM_ClearFlag_UPDATE(TIM2);
+  LL_TIM_EnableIT_UPDATE(TIM2);
+  return 1;
+}
+
+// Frames on an external edge (mode 3) or a sync slave: the restart path,
+// with the TIM2 update interrupt re-arming the stream after every edge
+void CCD_Acq_StartTriggered(void) {
+  acq_path = CCD_ACQ_RESTART;
+  LL_TIM_ClearFlag_UPDATE(TIM2);
+  CCD_Acq_SetupStream();
+  acq_src->start();
+  CCD_Acq_Arm();
+  LL_TIM_EnableIT_UPDATE(TIM2);
+}
+
+// Switch the timer chain between its free-running ICG and the two uses of
+// TIM2_ETR (CCD_EXT_TRIG, rising edge):
+//  - CCD_ACQ_TRIG_EDGE (mode 3): TIM2 runs one-pulse in trigger mode, so
+//    the edge starts the ICG period in hardware (ETR resync and filter, then
+//    CCD_TIM2_TRIG_CCR1: about 60 ns, no CPU involved). Edges during a frame
+//    are ignored. TRGO is the counter enable: TIM5 (SH) resets on its rising
+//    edge as it does on the update otherwise, and TIM4 (ADC) is gated by it
+//    so it fires exactly CCD_BUFFER_SIZE times per edge, ending at CNT = 0.
+//  - CCD_ACQ_TRIG_SYNC (sync slave): TIM2 free-runs one pixel longer than
+//    its master and is reset by every master ICG, so its frames keep the
+//    master's rate and phase. URS is cleared for the reset to interrupt.
+//    Without a master it carries on at the longer period.
+// CCD_ACQ_TRIG_ENCODER is mode 3 with TIM8's TRGO on ITR1 in place of ETRF,
+// CCD_ACQ_TRIG_LINE a sync slave on it, its period whole mains periods.
+void CCD_Acq_ConfigTrigger(uint8_t source) {
+  uint32_t slave_ticks = CCD_Acq_IcgTicks() + CCD_PIXEL_TICKS * acq_fm_div;
+#if CCD_LINE_SYNC
+  CCD_Mains_Enable(0);
+  if (source == CCD_ACQ_TRIG_LINE) {
+    uint32_t ticks = CCD_Mains_IcgTicks();
+    if (ticks != 0) {
+      slave_ticks = ticks; // Else as a slave without its master
+    }
+  }
+#endif
+  LL_TIM_ConfigETR(TIM2, LL_TIM_ETR_POLARITY_NONINVERTED,
+                   LL_TIM_ETR_PRESCALER_DIV1, LL_TIM_ETR_FILTER_FDIV1_N4);
+  LL_TIM_SetTriggerInput(TIM2, (source == CCD_ACQ_TRIG_ENCODER ||
+                                source == CCD_ACQ_TRIG_LINE)
+                                   ? LL_TIM_TS_ITR1
+                                   : LL_TIM_TS_ETRF);
+  LL_TIM_SetAutoReload(TIM2, CCD_Acq_IcgTicks() - 1U);
+  if (source == CCD_ACQ_TRIG_EDGE || source == CCD_ACQ_TRIG_ENCODER) {
+    LL_TIM_SetSlaveMode(TIM2, LL_TIM_SLAVEMODE_TRIGGER);
+    LL_TIM_SetOnePulseMode(TIM2, LL_TIM_ONEPULSEMODE_SINGLE);
+    LL_TIM_OC_SetMode(TIM2, LL_TIM_CHANNEL_CH2, LL_TIM_OCMODE_PWM1);
+    LL_TIM_OC_SetCompareCH2(TIM2, CCD_TIM2_TRIG_CCR2);
+    LL_TIM_OC_SetMode(TIM2, LL_TIM_CHANNEL_CH1, LL_TIM_OCMODE_COMBINED_PWM2);
+    LL_TIM_OC_SetCompareCH1(TIM2, CCD_TIM2_TRIG_CCR1);
+    LL_TIM_SetTriggerOutput(TIM2, LL_TIM_TRGO_ENABLE);
+    LL_TIM_SetSlaveMode(TIM4, LL_TIM_SLAVEMODE_GATED);
+    return;
+  }
+
+  LL_TIM_SetOnePulseMode(TIM2, LL_TIM_ONEPULSEMODE_REPETITIVE);
+  LL_TIM_OC_SetMode(TIM2, LL_TIM_CHANNEL_CH1, LL_TIM_OCMODE_PWM1);
+  LL_TIM_OC_SetCompareCH1(TIM2, CCD_TIM2_CCR1);
+  LL_TIM_SetTriggerOutput(TIM2, LL_TIM_TRGO_UPDATE);
+  LL_TIM_SetSlaveMode(TIM4, LL_TIM_SLAVEMODE_COMBINED_RESETTRIGGER);
+  if (source == CCD_ACQ_TRIG_SYNC || source == CCD_ACQ_TRIG_LINE) {
+    LL_TIM_SetAutoReload(TIM2, slave_ticks - 1U);
+    LL_TIM_SetUpdateSource(TIM2, LL_TIM_UPDATESOURCE_REGULAR);
+    LL_TIM_SetSlaveMode(TIM2, LL_TIM_SLAVEMODE_RESET);
+#if CCD_LINE_SYNC
+    CCD_Mains_Enable(source == CCD_ACQ_TRIG_LINE);
+#endif
+  } else {
+    LL_TIM_SetSlaveMode(TIM2, LL_TIM_SLAVEMODE_DISABLED);
+    LL_TIM_SetUpdateSource(TIM2, LL_TIM_UPDATESOURCE_COUNTER);
+  }
+}
+
+// Start the chain from one hardware event once every timer is enabled: a
+// TIM2 update restarts the ICG period, and its TRGO resets TIM3 (with
+// CCD_FM_LOCK) and TIM5 and starts TIM4 on the same clock edge. The ADC
+// sample point relative to fM and ICG is then fixed by the timer registers
+// alone, whatever the delays between the HAL start calls. The update
+// interrupt is masked so the restart path does not see it as a frame.
+// Mode 3 needs none of this (its edge does the same) and is unaffected.
+void CCD_Acq_AlignTimers(void) {
+  uint8_t irq = LL_TIM_IsEnabledIT_UPDATE(TIM2);
+  LL_TIM_DisableIT_UPDATE(TIM2);
+  LL_TIM_GenerateEvent_UPDATE(TIM2);
+  LL_TIM_ClearFlag_UPDATE(TIM2);
+  if (irq) {
+    LL_TIM_EnableIT_UPDATE(TIM2);
+  }
+}
+
+// Sync master: TIM2 CH2 (CCD_SYNC_OUT) goes high for CCD_SYNC_PULSE_US at
+// the start of every ICG period, in step with the ICG output. Free-running
+// timer chain only; mode 3 uses CH2 internally.
+void CCD_Acq_SetSyncOut(uint8_t enable) {
+  if (enable) {
+    LL_TIM_OC_SetMode(TIM2, LL_TIM_CHANNEL_CH2, LL_TIM_OCMODE_PWM1);
+    LL_TIM_OC_SetCompareCH2(TIM2, CCD_US_TICKS(CCD_SYNC_PULSE_US));
+    LL_TIM_CC_EnableChannel(TIM2, LL_TIM_CHANNEL_CH2);
+  } else {
+    LL_TIM_CC_DisableChannel(TIM2, LL_TIM_CHANNEL_CH2);
+  }
+}
+
+// Strobe output on TIM2 CH3: combined PWM mode 2 with CH4, so it is active
+// for CCR3 <= CNT < CCR4 of every ICG period (every edge in mode 3), with no
+// CPU involvement. CCR3 is never 0, which keeps it idle while the mode 3
+// counter waits at 0. Width 0 turns it off.
+uint8_t CCD_Acq_SetStrobe(uint32_t delay_us, uint32_t width_us) {
+  uint32_t start = CCD_US_TICKS(delay_us) + CCD_TIM2_TRIG_CCR1;
+  uint32_t end = start + CCD_US_TICKS(width_us);
+  if (delay_us > CCD_STROBE_MAX_US || width_us > CCD_STROBE_MAX_US ||
+      end > CCD_Acq_IcgTicks()) {
+    return 0;
+  }
+  if (width_us == 0) {
+    LL_TIM_OC_SetMode(TIM2, LL_TIM_CHANNEL_CH3, LL_TIM_OCMODE_FORCED_INACTIVE);
+    acq_strobe_delay_us = delay_us;
+    acq_strobe_width_us = 0;
+    return 1;
+  }
+#ifndef CCD_STROBE_Pin
+  return 0; // No pin for TIM2_CH3 on this board
+#endif
+  LL_TIM_OC_SetCompareCH3(TIM2, start);
+  LL_TIM_OC_SetCompareCH4(TIM2, end);
+  LL_TIM_OC_SetMode(TIM2, LL_TIM_CHANNEL_CH4, LL_TIM_OCMODE_PWM1);
+  LL_TIM_OC_SetMode(TIM2, LL_TIM_CHANNEL_CH3, LL_TIM_OCMODE_COMBINED_PWM2);
+  acq_strobe_delay_us = delay_us;
+  acq_strobe_width_us = width_us;
+  return 1;
+}
+
+void CCD_Acq_GetStrobe(uint32_t *delay_us, uint32_t *width_us) {
+  *delay_us = acq_strobe_delay_us;
+  *width_us = acq_strobe_width_us;
+}
+
+// TIM5 runs with ARR and CCR3 preloaded, so written values wait for its
+// next update event: either an SH period boundary or the TIM2 TRGO reset at
+// the ICG. The TIM5 update interrupt is enabled only while a change is
+// pending; it writes the new values once no SH period boundary is left
+// before the next ICG, and they load exactly there. The frame read out at
+// that ICG keeps the old exposure and every frame after it has the new
+// one, with the timer chain running throughout.
+uint8_t CCD_Acq_ExposureValid(uint32_t period_us, uint32_t pulse_us) {
+  return period_us >= CCD_SH_MIN_PERIOD_US &&
+         period_us <= CCD_SH_MAX_PERIOD_US && pulse_us != 0 &&
+         pulse_us < period_us && pulse_us <= CCD_ICG_PULSE_US;
+}
+
+uint8_t CCD_Acq_SetExposure(uint32_t period_us, uint32_t pulse_us) {
+  if (!CCD_Acq_ExposureValid(period_us, pulse_us)) {
+    return 0;
+  }
+  // Then kept for after the bracketing or the long exposure
+  uint8_t cycling = acq_hdr_run || acq_snap >= CCD_ACQ_SNAP_ARM;
+  if (!cycling) {
+    LL_TIM_DisableIT_UPDATE(TIM5);
+  }
+  acq_sh_arr = CCD_US_TICKS(period_us) - 1U;
+  acq_sh_ccr = CCD_US_TICKS(pulse_us) - 1U;
+  if (!acq_sh_long && !cycling) {
+    LL_TIM_ClearFlag_UPDATE(TIM5);
+    LL_TIM_EnableIT_UPDATE(TIM5);
+  }
+  return 1;
+}
+
+// The fast shutter integrates from the last SH pulse before an ICG to the
+// ICG: the remainder of the ICG period after whole SH periods, or a full
+// SH period when they divide it
+CCD_ITCM static uint32_t CCD_Acq_ShutterUs(uint32_t arr) {
+  uint32_t icg = CCD_Acq_IcgTicks();
+  uint32_t period = arr + 1U;
+  if (period >= icg) {
+    return icg / CCD_TICKS_PER_US;
+  }
+  uint32_t rem = icg % period;
+  return (rem ? rem : period) / CCD_TICKS_PER_US;
+}
+
+uint32_t CCD_Acq_IntegrationUs(void) { return CCD_Acq_ShutterUs(acq_sh_arr); }
+
+// The "L" setting, as CCD_Acq_SetExposure() takes it
+void CCD_Acq_GetExposure(uint32_t *period_us, uint32_t *pulse_us) {
+  *period_us = (acq_sh_arr + 1U) / CCD_TICKS_PER_US;
+  *pulse_us = (acq_sh_ccr + 1U) / CCD_TICKS_PER_US;
+}
+
+// SH pulses at the ICG and once more t before the next: an SH period of
+// the ICG period minus t, keeping the pulse width
+static uint8_t CCD_Acq_Reachable(uint32_t t_us) {
+  uint32_t pulse_us = (acq_sh_ccr + 1U) / CCD_TICKS_PER_US;
+  return t_us >= CCD_SH_MIN_PERIOD_US && t_us > pulse_us &&
+         2U * t_us < CCD_Acq_IcgTicks() / CCD_TICKS_PER_US;
+}
+
+uint8_t CCD_Acq_SetIntegration(uint32_t t_us) {
+  if (!CCD_Acq_Reachable(t_us)) {
+    return 0;
+  }
+  uint32_t icg_us = CCD_Acq_IcgTicks() / CCD_TICKS_PER_US;
+  return CCD_Acq_SetExposure(icg_us - t_us,
+                             (acq_sh_ccr + 1U) / CCD_TICKS_PER_US);
+}
+
+// Takes effect at the next mode switch, which starts the cycle at entry 0
+uint8_t CCD_Acq_SetBracket(const uint32_t *t_us, uint8_t count) {
+  if (count > CCD_ACQ_BRACKET_MAX || count == 1) {
+    return 0;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    if (!CCD_Acq_Reachable(t_us[i])) {
+      return 0;
+    }
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    acq_hdr_us[i] = (uint16_t)t_us[i];
+  }
+  acq_hdr_count = count;
+  return 1;
+}
+
+uint8_t CCD_Acq_BracketCount(void) { return acq_hdr_run; }
+
+uint32_t CCD_Acq_BracketUs(uint8_t index) { return acq_hdr_us[index]; }
+
+// Entry a frame was integrated with, or CCD_ACQ_BRACKET_NONE. Main loop
+// only: the reference frame is moved up now and then, in whole cycles, so
+// the 16-bit distance never wraps.
+uint8_t CCD_Acq_BracketIndex(uint16_t frame_num) {
+  uint8_t count = acq_hdr_run;
+  int16_t d = (int16_t)(frame_num - acq_hdr_frame);
+  if (count == 0 || d < 0) {
+    return CCD_ACQ_BRACKET_NONE;
+  }
+  if (d >= 0x4000) {
+    acq_hdr_frame += (uint16_t)((0x2000U / count) * count);
+  }
+  return (uint8_t)((uint16_t)d % count);
+}
+
+// The change is loaded at the end of the frame being read out when
+// CCD_Acq_ShIRQ() writes it, so the frame after that one still integrated
+// with the old timing
+uint8_t CCD_Acq_ExposureSettled(uint16_t frame_num) {
+  return !LL_TIM_IsEnabledIT_UPDATE(TIM5) &&
+         (int16_t)(frame_num - acq_sh_frame) >= 0;
+}
+
+// Mode switch, TIM5 stopped: load mode 2's single SH per ICG, the first
+// bracketing entry or the fast shutter directly (the update event copies
+// the preloads). A bracketing cycle keeps the TIM5 update interrupt on.
+// Mode 2's SH period is TIM2's as CCD_Acq_ConfigTrigger() left it, so a
+// sync slave's longer period never fits a second SH before the reset.
+void CCD_Acq_ConfigShutter(uint8_t mode) {
+  LL_TIM_DisableIT_UPDATE(TIM5);
+  acq_sh_long = (mode == CCD_MODE_LONG);
+  acq_icg_valid = 0;
+  acq_hdr_run = 0;
+  uint8_t count = acq_hdr_count;
+  if (mode == CCD_MODE_FAST && count > 0) {
+    for (uint8_t i = 0; i < count; i++) {
+      if (!CCD_Acq_Reachable(acq_hdr_us[i])) {
+        count = 0; // The ICG period has shortened since "Q"
+      }
+      acq_hdr_arr[i] = CCD_Acq_IcgTicks() - CCD_US_TICKS(acq_hdr_us[i]) - 1U;
+    }
+  } else {
+    count = 0;
+  }
+
+  if (acq_sh_long) {
+    LL_TIM_SetAutoReload(TIM5, LL_TIM_GetAutoReload(TIM2));
+    LL_TIM_OC_SetCompareCH3(TIM5, CCD_TIM5_LONG_CCR3);
+  } else {
+    LL_TIM_SetAutoReload(TIM5, count ? acq_hdr_arr[0] : acq_sh_arr);
+    LL_TIM_OC_SetCompareCH3(TIM5, acq_sh_ccr);
+  }
+  LL_TIM_GenerateEvent_UPDATE(TIM5);
+  LL_TIM_ClearFlag_UPDATE(TIM5);
+  acq_sh_frame = frame_counter + 1U; // The first readout integrated unshuttered
+  acq_sh_prev_us = CCD_Acq_IcgTicks() / CCD_TICKS_PER_US;
+  acq_sh_us = CCD_Acq_ShutterUs(acq_sh_arr);
+  if (count) {
+    // The first ICG period integrates entry 0 for the frame after the
+    // unshuttered one
+    acq_hdr_seq = 0;
+    acq_hdr_frame = frame_counter + 1U;
+    acq_hdr_start = frame_counter + 1U;
+    acq_hdr_run = count;
+    LL_TIM_EnableIT_UPDATE(TIM5);
+  }
+}
+
+// Long exposure TIM5 periods: at most 2^31 ticks, and a last one of at
+// least 2^30, far longer than its update interrupt takes to load it
+#define ACQ_EXP_PERIOD 0x80000000ULL
+
+CCD_ITCM static void CCD_Acq_ExposePeriod(void) {
+  uint64_t ticks = acq_exp_left;
+  if (ticks > 3U * (ACQ_EXP_PERIOD / 2U)) {
+    ticks = ACQ_EXP_PERIOD;
+  }
+  acq_exp_left -= ticks;
+  LL_TIM_SetAutoReload(TIM5, (uint32_t)(ticks - 1U));
+}
+
+// Mode 1 long exposure, from an interrupt with the others masked. The
+// parked chain's next SH pulse (TIM5 runs free while TIM2 is stopped)
+// starts it; 0 while a snap or exposure is running, outside mode 1 or out
+// of range.
+CCD_ITCM uint8_t CCD_Acq_Expose(uint32_t t_ms) {
+  if (acq_snap != CCD_ACQ_SNAP_READY || t_ms < CCD_ACQ_EXPOSE_MIN_MS ||
+      t_ms > CCD_ACQ_EXPOSE_MAX_MS) {
+    return 0;
+  }
+  acq_exp_us = t_ms * 1000U;
+  acq_exp_left = (uint64_t)acq_exp_us * CCD_TICKS_PER_US;
+  acq_snap = CCD_ACQ_SNAP_ARM;
+  LL_TIM_ClearFlag_UPDATE(TIM5);
+  LL_TIM_EnableIT_UPDATE(TIM5);
+  return 1;
+}
+
+// TIM5 update during a long exposure. The first starts the SH pulse that
+// clears the sensor, and the exposure with it: from then on TIM5 counts
+// it out with preload off, its SH output held inactive once that pulse is
+// over (CCD_Acq_ShPulseIRQ()). The update at the end starts the readout
+// ICG period as a snap does, with the stream armed already, and only then
+// gives SH back, so ICG is low first and the pulse transfers the charge.
+// TIM5 is back on the fast shutter, with an "L" sent meanwhile.
+CCD_ITCM static void CCD_Acq_ExposeIRQ(void) {
+  if (acq_snap == CCD_ACQ_SNAP_ARM) {
+    acq_exp_start = CCD_Time_Now();
+    LL_TIM_DisableARRPreload(TIM5);
+    CCD_Acq_ExposePeriod();
+    LL_TIM_ClearFlag_CC3(TIM5);
+    LL_TIM_EnableIT_CC3(TIM5);
+    acq_snap = CCD_ACQ_SNAP_EXPOSE;
+    return;
+  }
+  if (acq_exp_left > 0) {
+    CCD_Acq_ExposePeriod();
+    return;
+  }
+  LL_TIM_DisableIT_UPDATE(TIM5);
+  LL_TIM_SetAutoReload(TIM5, acq_sh_arr);
+  LL_TIM_EnableARRPreload(TIM5);
+  LL_TIM_OC_SetCompareCH3(TIM5, acq_sh_ccr); // Loaded by the TRGO reset
+  acq_exp_seq = frame_counter;
+  acq_exp_frame = 1;
+  acq_sh_prev_us = acq_sh_us;
+  acq_sh_us = CCD_Acq_ShutterUs(acq_sh_arr);
+  acq_sh_frame = frame_counter + 1U;
+  acq_snap = CCD_ACQ_SNAP_READ;
+  CCD_Acq_Arm();
+  LL_TIM_EnableCounter(TIM2);
+  LL_TIM_GenerateEvent_UPDATE(TIM2);
+  LL_TIM_ClearFlag_UPDATE(TIM2);
+  LL_TIM_EnableIT_UPDATE(TIM2);
+  LL_TIM_OC_SetMode(TIM5, LL_TIM_CHANNEL_CH3, LL_TIM_OCMODE_PWM1);
+}
+
+// TIM5 CC3: the SH pulse that started a long exposure is over
+CCD_ITCM void CCD_Acq_ShPulseIRQ(void) {
+  LL_TIM_ClearFlag_CC3(TIM5);
+  LL_TIM_DisableIT_CC3(TIM5);
+  if (acq_snap == CCD_ACQ_SNAP_EXPOSE) {
+    LL_TIM_OC_SetMode(TIM5, LL_TIM_CHANNEL_CH3,
+                      LL_TIM_OCMODE_FORCED_INACTIVE);
+  }
+}
+
+// Interrupts masked (or TIM5 stopped). TIM5 restarts on the fast shutter
+// with an SH pulse, which clears what the exposure had collected.
+uint8_t CCD_Acq_ExposeAbort(void) {
+  if (acq_snap != CCD_ACQ_SNAP_ARM && acq_snap != CCD_ACQ_SNAP_EXPOSE) {
+    return 0;
+  }
+  LL_TIM_DisableIT_UPDATE(TIM5);
+  LL_TIM_DisableIT_CC3(TIM5);
+  LL_TIM_SetAutoReload(TIM5, acq_sh_arr);
+  LL_TIM_OC_SetCompareCH3(TIM5, acq_sh_ccr);
+  LL_TIM_EnableARRPreload(TIM5);
+  LL_TIM_GenerateEvent_UPDATE(TIM5);
+  LL_TIM_ClearFlag_UPDATE(TIM5);
+  LL_TIM_OC_SetMode(TIM5, LL_TIM_CHANNEL_CH3, LL_TIM_OCMODE_PWM1);
+  acq_snap = CCD_ACQ_SNAP_READY;
+  return 1;
+}
+
+// Main loop: elapsed_ms is how long the running long exposure has
+// integrated, 0 outside one
+uint8_t CCD_Acq_SnapState(uint32_t *elapsed_ms) {
+  uint8_t state = acq_snap;
+  *elapsed_ms = 0;
+  if (state == CCD_ACQ_SNAP_EXPOSE) {
+    *elapsed_ms = (uint32_t)((CCD_Time_Now() - acq_exp_start) /
+                             (CCD_TIME_HZ / 1000U));
+  }
+  return state;
+}
+
+// TIM5 update with a change pending. TIM5 restarts at every ICG, so its
+// boundaries fall on the ICG start plus whole SH periods: once the next
+// ICG is at most one period away, this update was the last boundary. The
+// ICG is then at least 1 us ahead (periods and the ICG are whole us), far
+// more than the write takes. With TIM2 stopped (mode 3 between edges, mode 1
+// between shots) the values are written at once.
+CCD_ITCM void CCD_Acq_ShIRQ(void) {
+  LL_TIM_ClearFlag_UPDATE(TIM5);
+  if (acq_snap >= CCD_ACQ_SNAP_ARM) {
+    CCD_Acq_ExposeIRQ(); // An "L" meanwhile waits for its end
+    return;
+  }
+  if (LL_TIM_IsEnabledCounter(TIM2)) {
+    uint32_t left = CCD_ICG_TICKS * acq_fm_div - LL_TIM_GetCounter(TIM2);
+    if (left > LL_TIM_GetAutoReload(TIM5) + 1U) {
+      return; // Another SH period starts before the ICG
+    }
+  }
+  uint8_t count = acq_hdr_run;
+  if (count) {
+    // Bracketing: exactly one such update per ICG period (at ICG - t), so
+    // the entries follow the periods
+    uint8_t seq = acq_hdr_seq + 1U;
+    seq = (seq == count) ? 0 : seq;
+    acq_hdr_seq = seq;
+    LL_TIM_SetAutoReload(TIM5, acq_hdr_arr[seq]);
+    return;
+  }
+  LL_TIM_SetAutoReload(TIM5, acq_sh_arr);
+  LL_TIM_OC_SetCompareCH3(TIM5, acq_sh_ccr);
+  acq_sh_prev_us = acq_sh_us;
+  acq_sh_us = CCD_Acq_ShutterUs(acq_sh_arr);
+  acq_sh_frame = frame_counter + 2U;
+  LL_TIM_DisableIT_UPDATE(TIM5);
+}
+
+// ADC2 mirrors ADC1 on the same input (PA3 is ADC12_INP15). As the dual
+// mode slave it takes its trigger from ADC1, and its data leaves through
+// the common data register.
+void CCD_Acq_InitSlaveAdc(void) {
+  hadc2.Instance = ADC2;
+  hadc2.Init = hadc1.Init;
+  hadc2.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+  hadc2.Init.ConversionDataManagement = ADC_CONVERSIONDATA_DR;
+  if (HAL_ADC_Init(&hadc2) != HAL_OK) {
+    Error_Handler();
+  }
+  ADC_ChannelConfTypeDef sConfig = {0};
+  sConfig.Channel = CCD_ADC_CHANNEL;
+  sConfig.Rank = ADC_REGULAR_RANK_1;
+  sConfig.SamplingTime = ADC_SAMPLETIME_2CYCLES_5;
+  sConfig.SingleDiff = ADC_SINGLE_ENDED;
+  sConfig.OffsetNumber = ADC_OFFSET_NONE;
+  sConfig.Offset = 0;
+  sConfig.OffsetSignedSaturation = DISABLE;
+  if (HAL_ADC_ConfigChannel(&hadc2, &sConfig) != HAL_OK) {
+    Error_Handler();
+  }
+  MODIFY_REG(ADC2->CR, ADC_CR_BOOST_Msk, (0x3UL << ADC_CR_BOOST_Pos));
+}
+
+ADC_HandleTypeDef *CCD_Acq_SlaveAdc(void) { return &hadc2; }
+
+// Latches the selected source for the capture that follows. TIM4 compares
+// are preloaded, so a new phase takes effect at a pixel boundary. ADC2
+// samples 9 ADC cycles after ADC1 (the longest interleave delay at 16
+// bits); the sampling phases must not overlap, so multi-sampling uses 8.5
+// cycles in place of anything longer. TIM3 (fM) takes the profile's
+// divider here; TIM2 gets it from CCD_Acq_ConfigTrigger(), which runs after
+// this. CDS and oversampling profiles use ADC1 alone; a profile's sampling
+// time is a floor under the "S" one. Other sources take one sample per
+// pixel and only the fM divider of a profile; two sensors keep the
+// sampling time as well.
+void CCD_Acq_ApplySampling(void) {
+  const Acq_LowNoise_t *ln = &acq_low_noise[acq_noise_profile];
+  uint32_t div = ln->fm_div;
+  uint8_t ovs = ln->ovs_shift;
+  uint8_t cds = acq_cds;
+  uint8_t samples = cds ? 1 : acq_adc_samples;
+  uint8_t smp = acq_adc_sample;
+  if (smp < ln->smp_min) {
+    smp = ln->smp_min;
+  }
+  acq_src = &acq_sources[acq_source];
+  uint8_t dual = (acq_src == &acq_sources[CCD_ACQ_SRC_DUAL]);
+  if (acq_src != &acq_sources[CCD_ACQ_SRC_ADC]) {
+    ovs = 0;
+    cds = 0;
+    samples = 1;
+  }
+  if (ovs > 0) {
+    samples = 1;
+    smp = 0;
+  }
+  uint32_t ccr = acq_adc_phase * div;
+  uint32_t arr = CCD_PIXEL_TICKS * div - 1U;
+  if (samples > 1 && smp > 1U) {
+    smp = 1U; // 8.5 cycles, under the ADC2 delay
+  }
+  if (samples == 4 || cds) { // Two TIM4 periods per pixel
+    arr = (arr + 1U) / 2U - 1U;
+    if (ccr > arr) {
+      ccr -= arr + 1U;
+    }
+    if (ccr == 0) {
+      ccr = 1; // A compare at 0 would coincide with the TIM4 reset
+    }
+  }
+  LL_TIM_SetAutoReload(TIM3, CCD_FM_TICKS * div - 1U);
+  LL_TIM_OC_SetCompareCH1(TIM3, CCD_FM_TICKS * div / 2U);
+  LL_TIM_SetAutoReload(TIM4, arr);
+  acq_run_samples = samples;
+  acq_run_ovs = ovs;
+  acq_run_smp = smp;
+  acq_run_dual = dual;
+  acq_run_adc2 = (samples > 1 || dual);
+  uint32_t sampled = acq_src->apply(ccr, arr); // Sample in memory
+  CCD_Lat_SetArmLimit(ccr);
+  acq_fm_div = div;
+  acq_run_cds = cds;
+  acq_run_staged = (samples > 1 || cds || dual);
+  acq_sat_armed = ((acq_src == &acq_sources[CCD_ACQ_SRC_ADC] || dual) &&
+                   acq_sat_mode != CCD_ACQ_SAT_OFF);
+  acq_run_flags = ((samples > 1) ? CCD_FRAME_F_MULTISAMPLE : 0U) |
+                  ((ovs > 0) ? CCD_FRAME_F_OVERSAMPLE : 0U) |
+                  (cds ? CCD_FRAME_F_CDS : 0U);
+  // The last sample reaches memory at the tick the source returned, in the
+  // last pixel
+  acq_readout_cycles =
+      ((CCD_BUFFER_SIZE - 1U) * CCD_PIXEL_TICKS * div + sampled) *
+      CCD_TIME_PER_TICK;
+  acq_dma_len = CCD_BUFFER_SIZE * ((samples > 1) ? samples / 2U : 1U);
+  if (cds) {
+    acq_dma_len = 2U * CCD_BUFFER_SIZE; // Reset and signal halfwords
+  }
+#if CCD_REF_PD
+  CCD_Ref_Apply(); // Resized to the period just set
+#endif
+}
+
+uint32_t CCD_Acq_IcgTicks(void) { return CCD_ICG_TICKS * acq_fm_div; }
+
+// From the settings, not the timer registers the check compares against
+void CCD_Acq_Periods(CCD_AcqPeriods_t *out) {
+  out->fm = CCD_FM_TICKS * acq_fm_div;
+  out->adc = CCD_PIXEL_TICKS * acq_fm_div;
+  out->icg = CCD_Acq_IcgTicks();
+  if (acq_sh_long) {
+    out->sh = out->icg;
+  } else if (LL_TIM_IsEnabledIT_UPDATE(TIM5) || acq_hdr_run ||
+             acq_snap >= CCD_ACQ_SNAP_ARM) {
+    out->sh = 0;
+  } else {
+    out->sh = acq_sh_arr + 1U;
+  }
+}
+
+uint8_t CCD_Acq_SetSaturation(uint8_t mode, uint16_t level) {
+  if (mode > CCD_ACQ_SAT_AE) {
+    return 0;
+  }
+  acq_sat_mode = mode;
+  acq_sat_level = level;
+  return 1;
+}
+
+void CCD_Acq_GetSaturation(uint8_t *mode, uint16_t *level) {
+  *mode = acq_sat_mode;
+  *level = acq_sat_level;
+}
+
+// The history and its seq together, as one frame's handoff leaves them
+void CCD_Acq_SatStatus(CCD_SatStatus_t *out) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  out->seq = frame_counter - 1U;
+  out->history = acq_sat_history;
+  out->frames = acq_sat_frames;
+  out->saturated = acq_sat_count;
+  out->last = acq_sat_last;
+  __set_PRIMASK(primask);
+  out->mode = acq_sat_mode;
+  out->armed = acq_sat_armed;
+  out->level = acq_sat_level;
+  out->early = acq_sat_early;
+  out->seen_us = acq_sat_seen_us;
+  out->readout_us = acq_readout_cycles / (CCD_TIME_HZ / 1000000U);
+}
+
+// The frame being read out is frame_counter; a handoff between the two
+// reads took the flag with its frame, so the sighting does not count
+uint8_t CCD_Acq_SatPoll(void) {
+  uint16_t n = (uint16_t)frame_counter;
+  if (!acq_sat_armed || (acq_sat_seen && n == acq_sat_seen_frame) ||
+      !LL_ADC_IsActiveFlag_AWD1(ADC1)) {
+    return 0;
+  }
+  uint32_t cnt = LL_TIM_GetCounter(TIM2);
+  if (n != (uint16_t)frame_counter) {
+    return 0;
+  }
+  acq_sat_seen = 1;
+  acq_sat_seen_frame = n;
+  acq_sat_early++;
+  acq_sat_seen_us = cnt / CCD_TICKS_PER_US;
+  return 1;
+}
+
+uint32_t CCD_Acq_ReadoutCycles(void) { return acq_readout_cycles; }
+
+// frame_num the next completed frame will get
+uint16_t CCD_Acq_FrameCount(void) { return (uint16_t)frame_counter; }
+
+// Stop the ADC/DMA (either path) and give back slots claimed for frames that
+// will never complete
+void CCD_Acq_Stop(void) {
+  CCD_Acq_ExposeAbort();
+  acq_snap = CCD_ACQ_SNAP_OFF;
+  acq_exp_frame = 0;
+  LL_TIM_DisableIT_UPDATE(TIM2);
+  acq_src->stop();
+  if (hdma_adc1.State == HAL_DMA_STATE_BUSY) {
+    HAL_DMA_Abort(&hdma_adc1);
+  } else {
+    CCD_Acq_DisableStream();
+  }
+  CCD_Acq_ClearStreamFlags();
+
+  acq_path = CCD_ACQ_RESTART;
+  acq_target = NULL;
+  acq_hw_valid = 0; // The stopped periods are no loss
+  acq_pending = NULL; // A PendSV still to come finds nothing
+  acq_stage = 0;
+  FrameRing_CancelClaims();
+  CCD_Burst_CancelClaims();
+}
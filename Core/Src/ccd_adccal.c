@@ -0,0 +1,168 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_adccal.c
+ * @brief          : ADC offset and linearity calibration, kept in flash
+ ******************************************************************************
+ */
+
+#include "ccd_adccal.h"
+#include "ccd_acq.h"
+#include "ccd_bench.h"
+#include "ccd_phase.h"
+#include "ccd_seq.h"
+#include "ccd_store.h"
+#include "ccd_temp.h"
+#include "stm32h7xx_ll_adc.h"
+#include <string.h>
+
+#define ADCCAL_ADCS 2 // ADC1, ADC2
+
+extern ADC_HandleTypeDef hadc1;
+
+// Flash record (CCD_STORE_ADCCAL)
+typedef struct {
+  uint32_t adc_hz; // Kernel clock the factors were measured at
+  int32_t temp_c;
+  uint32_t offset[ADCCAL_ADCS];
+  uint32_t linear[ADCCAL_ADCS][ADC_LINEAR_CALIB_REG_COUNT];
+} AdcCal_Record_t;
+
+static ADC_HandleTypeDef *adccal_adc[ADCCAL_ADCS];
+static AdcCal_Record_t adccal_rec; // In use
+static uint8_t adccal_source;
+static uint8_t adccal_request; // Host request or drift, until serviced
+static uint32_t adccal_count;
+static uint32_t adccal_tick; // HAL_GetTick() of the calibration in use
+static uint32_t adccal_due;
+static int16_t adccal_temp; // At the last check
+
+// Whole degrees from ccd_temp.h, which reads the sensor
+static int16_t AdcCal_Temp(void) { return (int16_t)(ccd_temp_die / 100); }
+
+// ========== CALIBRATION ==========
+
+// Calibration and factor access leave the ADC disabled, as they found it
+static uint8_t AdcCal_Measure(AdcCal_Record_t *rec) {
+  for (uint32_t i = 0; i < ADCCAL_ADCS; i++) {
+    ADC_HandleTypeDef *hadc = adccal_adc[i];
+    if (HAL_ADCEx_Calibration_Start(hadc, ADC_CALIB_OFFSET_LINEARITY,
+                                    ADC_SINGLE_ENDED) != HAL_OK) {
+      return 0;
+    }
+    rec->offset[i] = HAL_ADCEx_Calibration_GetValue(hadc, ADC_SINGLE_ENDED);
+    HAL_StatusTypeDef st =
+        HAL_ADCEx_LinearCalibration_GetValue(hadc, rec->linear[i]);
+    if (ADC_Disable(hadc) != HAL_OK || st != HAL_OK) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static uint8_t AdcCal_Apply(const AdcCal_Record_t *rec) {
+  for (uint32_t i = 0; i < ADCCAL_ADCS; i++) {
+    ADC_HandleTypeDef *hadc = adccal_adc[i];
+    uint32_t linear[ADC_LINEAR_CALIB_REG_COUNT];
+    memcpy(linear, rec->linear[i], sizeof(linear));
+    if (ADC_Enable(hadc) != HAL_OK) {
+      return 0;
+    }
+    HAL_StatusTypeDef st =
+        HAL_ADCEx_Calibration_SetValue(hadc, ADC_SINGLE_ENDED, rec->offset[i]);
+    if (st == HAL_OK) {
+      st = HAL_ADCEx_LinearCalibration_SetValue(hadc, linear);
+    }
+    if (ADC_Disable(hadc) != HAL_OK || st != HAL_OK) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// A failed run keeps the factors in use (and ADC1/ADC2 as the HAL left
+// them, for the next start to report)
+static void AdcCal_Run(void) {
+  AdcCal_Record_t rec;
+  rec.adc_hz = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_ADC);
+  rec.temp_c = adccal_temp;
+  adccal_request = 0;
+  adccal_tick = HAL_GetTick();
+  // Each ADC on its own; CCD_Acq_ApplySampling() sets the dual mode again
+  LL_ADC_SetMultimode(ADC12_COMMON, LL_ADC_MULTI_INDEPENDENT);
+  if (!AdcCal_Measure(&rec)) {
+    adccal_rec.temp_c = rec.temp_c; // No retry before it drifts again
+    return;
+  }
+  adccal_rec = rec;
+  adccal_source = CCD_ADCCAL_MEASURED;
+  adccal_count++;
+  CCD_Store_Append(CCD_STORE_ADCCAL, &rec, sizeof(rec));
+}
+
+static int32_t AdcCal_Drift(void) {
+  int32_t d = adccal_temp - adccal_rec.temp_c;
+  return (d < 0) ? -d : d;
+}
+
+void CCD_AdcCal_Init(void) {
+  adccal_adc[0] = &hadc1;
+  adccal_adc[1] = CCD_Acq_SlaveAdc();
+  adccal_temp = AdcCal_Temp();
+
+  uint32_t hz = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_ADC);
+  if (CCD_Store_LoadLast(CCD_STORE_ADCCAL, &adccal_rec, sizeof(adccal_rec)) &&
+      adccal_rec.adc_hz == hz && AdcCal_Drift() < CCD_ADCCAL_DRIFT_C &&
+      AdcCal_Apply(&adccal_rec)) {
+    adccal_source = CCD_ADCCAL_STORED;
+    adccal_tick = HAL_GetTick();
+  } else {
+    AdcCal_Run();
+  }
+  adccal_due = HAL_GetTick() + CCD_ADCCAL_TEMP_MS;
+}
+
+// Nothing is forced while a sweep, sequence or benchmark runs the capture
+static uint8_t AdcCal_Busy(void) {
+  return CCD_Phase_Busy() || CCD_Seq_Running() || CCD_Bench_Running();
+}
+
+void CCD_AdcCal_Poll(void) {
+  uint32_t now = HAL_GetTick();
+  if ((int32_t)(now - adccal_due) < 0) {
+    return;
+  }
+  adccal_due = now + CCD_ADCCAL_TEMP_MS;
+  adccal_temp = AdcCal_Temp();
+  if (AdcCal_Drift() >= CCD_ADCCAL_DRIFT_C) {
+    adccal_request = 1;
+  }
+#if CCD_ADCCAL_PERIOD_S
+  if (now - adccal_tick >= CCD_ADCCAL_PERIOD_S * 1000U) {
+    adccal_request = 1;
+  }
+#endif
+  if (adccal_request && !AdcCal_Busy()) {
+    mode_update_pending = 1; // CCD_AdcCal_Service() runs in the restart
+  }
+}
+
+void CCD_AdcCal_Service(void) {
+  if (adccal_request && !AdcCal_Busy()) {
+    AdcCal_Run();
+  }
+}
+
+void CCD_AdcCal_Read(CCD_AdcCalStatus_t *out, uint8_t recalibrate) {
+  if (recalibrate) {
+    adccal_request = 1;
+  }
+  memset(out, 0, sizeof(*out));
+  out->temp_c = adccal_temp;
+  out->cal_temp_c = (int16_t)adccal_rec.temp_c;
+  out->source = adccal_source;
+  out->pending = adccal_request;
+  out->calibrations = adccal_count;
+  out->age_s = (HAL_GetTick() - adccal_tick) / 1000U;
+  out->offset[0] = adccal_rec.offset[0];
+  out->offset[1] = adccal_rec.offset[1];
+}
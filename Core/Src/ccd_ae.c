@@ -0,0 +1,191 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_ae.c
+ * @brief          : Closed-loop auto-exposure on the device
+ ******************************************************************************
+ */
+
+#include "ccd_ae.h"
+#include "ccd_acq.h"
+#include "ccd_phase.h" // Pixel classes
+#include "ccd_shutter.h"
+#include "frame_ring.h"
+#include "usb_tx.h"
+#include <string.h>
+
+#define AE_BINS 256 // Histogram of the top 8 bits
+
+static volatile uint8_t ae_enabled;
+static volatile uint8_t ae_percentile = CCD_AE_PERCENTILE;
+static volatile uint16_t ae_target = CCD_AE_TARGET;
+static volatile uint32_t ae_min_us = CCD_SH_MIN_PERIOD_US;
+static volatile uint32_t ae_max_us = CCD_SH_MAX_PERIOD_US;
+
+// Loop state, main loop only
+static uint8_t ae_running; // ae_last is valid
+static uint16_t ae_last;   // frame_num of the last frame measured
+static uint16_t ae_signal;
+static uint16_t ae_hist[AE_BINS];
+static uint16_t ae_sat_cuts;
+
+static volatile uint8_t ae_status_request;
+static volatile uint8_t ae_status_busy;
+static CCD_AEStatus_t ae_status; // Read by the USB engine while queued
+
+// ========== COMMANDS ==========
+
+void CCD_AE_Enable(uint8_t enable) { ae_enabled = enable; }
+
+uint8_t CCD_AE_SetLimits(uint32_t min_us, uint32_t max_us) {
+  if (min_us < CCD_SH_MIN_PERIOD_US || max_us < min_us ||
+      max_us > CCD_SH_MAX_PERIOD_US) {
+    return 0;
+  }
+  ae_min_us = min_us;
+  ae_max_us = max_us;
+  return 1;
+}
+
+uint8_t CCD_AE_SetTarget(uint32_t target) {
+  if (target == 0 || target > 0xFFFFU) {
+    return 0;
+  }
+  ae_target = (uint16_t)target;
+  return 1;
+}
+
+uint8_t CCD_AE_SetPercentile(uint32_t pct) {
+  if (pct < 50U || pct > 100U) {
+    return 0;
+  }
+  ae_percentile = (uint8_t)pct;
+  return 1;
+}
+
+void CCD_AE_RequestStatus(void) { ae_status_request = 1; }
+
+void CCD_AE_GetSettings(CCD_AESettings_t *out) {
+  out->enabled = ae_enabled;
+  out->percentile = ae_percentile;
+  out->target = ae_target;
+  out->min_us = ae_min_us;
+  out->max_us = ae_max_us;
+}
+
+// ========== MEASUREMENT ==========
+
+// Shielded-pixel mean minus the percentile level of the active pixels. The
+// level is the middle of the first histogram bin (from the bright, low end)
+// past the pixels the percentile ignores.
+static uint16_t AE_Signal(const CCD_Frame_t *frame) {
+  uint32_t dark = 0;
+  for (uint32_t i = 0; i < CCD_PHASE_SHIELD_COUNT; i++) {
+    dark += frame->pixels[CCD_PHASE_SHIELD_START + i];
+  }
+  dark /= CCD_PHASE_SHIELD_COUNT;
+
+  memset(ae_hist, 0, sizeof(ae_hist));
+  const uint16_t *px = &frame->pixels[CCD_PHASE_ACTIVE_START];
+  for (uint32_t i = 0; i < CCD_PHASE_ACTIVE_COUNT; i++) {
+    ae_hist[px[i] >> 8]++;
+  }
+  uint32_t skip = CCD_PHASE_ACTIVE_COUNT * (100U - ae_percentile) / 100U;
+  uint32_t seen = 0;
+  uint32_t bin = 0;
+  for (; bin < AE_BINS - 1U; bin++) {
+    seen += ae_hist[bin];
+    if (seen > skip) {
+      break;
+    }
+  }
+  uint32_t level = (bin << 8) + 128U;
+  return (dark > level) ? (uint16_t)(dark - level) : 0;
+}
+
+// Proportional step on the integration time: the signal scales with it
+// until the sensor saturates, and a saturated signal still reads above any
+// reachable target, so the loop comes back down. The time in use is read
+// back from the SH timing each step, so an "L" in between is picked up.
+static void AE_Adjust(uint16_t signal) {
+  uint32_t t = CCD_Acq_IntegrationUs();
+  uint32_t target = ae_target;
+  if (signal * 16U >= target * 15U && signal * 16U <= target * 17U) {
+    return; // Inside the deadband
+  }
+  uint64_t next = (signal != 0) ? ((uint64_t)t * target) / signal
+                                : (uint64_t)t * CCD_AE_MAX_STEP;
+  uint64_t lo = t / CCD_AE_MAX_STEP;
+  uint64_t hi = (uint64_t)t * CCD_AE_MAX_STEP;
+  next = (next < lo) ? lo : (next > hi) ? hi : next;
+
+  // Longest the fast shutter reaches: half the ICG period
+  uint32_t reach = (CCD_Acq_IcgTicks() / CCD_TICKS_PER_US - 1U) / 2U;
+  uint32_t max = (ae_max_us < reach) ? ae_max_us : reach;
+  uint32_t min = ae_min_us;
+  next = (next > max) ? max : (next < min) ? min : next;
+  if (next != t) {
+    CCD_Acq_SetIntegration((uint32_t)next);
+  }
+}
+
+// The frame being read out saturated: divide the time it was captured with,
+// down to the lower bound
+static void AE_SatCut(void) {
+  uint32_t t = CCD_Acq_IntegrationUs();
+  uint32_t next = t / CCD_AE_SAT_STEP;
+  next = (next < ae_min_us) ? ae_min_us : next;
+  if (next < t && CCD_Acq_SetIntegration(next)) {
+    ae_sat_cuts++;
+  }
+}
+
+static void AE_StatusSent(void *ctx, uint32_t len) { ae_status_busy = 0; }
+
+void CCD_AE_Poll(void) {
+  uint8_t active = ae_enabled && !CCD_Phase_Busy() &&
+                   (ccd_mode == CCD_MODE_FAST || ccd_mode == CCD_MODE_ONESHOT);
+  uint8_t flagged = CCD_Acq_SatPoll();
+  uint8_t sat_mode;
+  uint16_t sat_level;
+  CCD_Acq_GetSaturation(&sat_mode, &sat_level);
+  if (!active) {
+    ae_running = 0;
+  } else {
+    if (flagged && sat_mode == CCD_ACQ_SAT_AE &&
+        CCD_Acq_ExposureSettled(CCD_Acq_FrameCount())) {
+      AE_SatCut();
+    }
+    // Newest frame only: a backlog behind the USB link is already stale
+    const CCD_Frame_t *frame = FrameRing_PeekNewest();
+#if CCD_SHUTTER
+    if (frame != NULL &&
+        CCD_Shutter_Kind(frame->info.seq) != CCD_SHUTTER_LIGHT) {
+      frame = NULL; // Shutter moving or closed: nothing to expose for
+    }
+#endif
+    if (frame != NULL && (!ae_running || frame->frame_num != ae_last) &&
+        CCD_Acq_ExposureSettled(frame->frame_num)) {
+      ae_running = 1;
+      ae_last = frame->frame_num;
+      ae_signal = AE_Signal(frame);
+      AE_Adjust(ae_signal);
+    }
+  }
+
+  if (ae_status_request && !ae_status_busy && UsbTx_Space(&usb_tx_fs) > 0) {
+    ae_status_request = 0;
+    ae_status.magic = CCD_AE_MAGIC;
+    ae_status.enabled = ae_enabled;
+    ae_status.percentile = ae_percentile;
+    ae_status.min_us = ae_min_us;
+    ae_status.max_us = ae_max_us;
+    ae_status.t_us = CCD_Acq_IntegrationUs();
+    ae_status.target = ae_target;
+    ae_status.signal = ae_signal;
+    ae_status.frame_num = ae_last;
+    ae_status.sat_cuts = ae_sat_cuts;
+    ae_status_busy = 1;
+    UsbTx_Submit(&usb_tx_fs, (const uint8_t *)&ae_status, sizeof(ae_status),
+                 AE_StatusSent, NULL);
+  }
+}
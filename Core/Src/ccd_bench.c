@@ -0,0 +1,292 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_bench.c
+ * @brief          : Frame generator for link and pipeline benchmarks
+ ******************************************************************************
+ */
+
+#include "ccd_bench.h"
+#include "ccd_acq.h"
+#include "ccd_temp.h"
+#include "ccd_time.h"
+#include "ccd_cmd.h"
+#include "frame_ring.h"
+#include "usbd_cdc_if.h"
+#include <stddef.h>
+#include <string.h>
+
+// Main loop only: commands execute from CCD_Cmd_Poll(). The pattern and
+// the count of frames made are also the FS RX interrupt's in a replay.
+static volatile uint8_t bench_pattern = CCD_BENCH_OFF;
+static uint32_t bench_rate;  // frames/s, 0 = while the ring has room
+static uint32_t bench_count; // Frames per run, 0 = until stopped
+static volatile uint32_t bench_made; // Frames of the run, and the next seq
+static uint64_t bench_due;   // Cycle time of the next frame
+static uint32_t bench_period; // Whole cycles per frame
+static uint32_t bench_frac;   // and the remainder, in 1/rate cycles
+static uint32_t bench_acc;
+
+// Replay: the frame being filled by the RX interrupt, and a packet left
+// waiting for a slot (the OUT endpoint is un-armed meanwhile)
+static CCD_Frame_t *replay_frame;
+static uint32_t replay_pos; // Bytes of it in
+static volatile uint8_t replay_armed; // Capture stopped: frames are taken
+static const uint8_t *volatile replay_held;
+static volatile uint32_t replay_held_len;
+static volatile uint32_t replay_stalls;
+static uint32_t replay_seen; // bench_made at replay_tick
+static uint32_t replay_tick;
+
+// Pixel i of frame seq: an integer hash (multiply-xorshift)
+static uint32_t Bench_Prbs(uint32_t seq, uint32_t i) {
+  uint32_t x = seq * 0x9E3779B1U + i * 0x85EBCA77U;
+  x ^= x >> 15;
+  x *= 0x2C1B3C6DU;
+  x ^= x >> 12;
+  x *= 0x297A2D39U;
+  x ^= x >> 15;
+  return x & 0xFFFFU;
+}
+
+// Two pixels per word, as the host packs them
+static void Bench_Fill(uint16_t *px, uint32_t seq) {
+  uint32_t w;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    if (bench_pattern == CCD_BENCH_RAMP) {
+      w = ((seq + i) & 0xFFFFU) | ((seq + i + 1U) << 16);
+    } else if (bench_pattern == CCD_BENCH_COUNTER) {
+      w = seq;
+    } else {
+      w = Bench_Prbs(seq, i) | (Bench_Prbs(seq, i + 1U) << 16);
+    }
+    memcpy(&px[i], &w, sizeof(w));
+  }
+}
+
+// The header of a capture without its acquisition details
+static void Bench_Publish(CCD_Frame_t *frame, uint64_t now) {
+  uint32_t seq = bench_made++;
+  Bench_Fill(frame->pixels, seq);
+  frame->magic = CCD_FRAME_MAGIC;
+  frame->frame_num = (uint16_t)seq;
+  frame->info.version = CCD_FRAME_VERSION;
+  frame->info.header_len = offsetof(CCD_Frame_t, pixels);
+  frame->info.flags = 0;
+  frame->info.seq = seq;
+  frame->info.timestamp = now;
+  frame->info.die_temp = ccd_temp_die;
+  frame->info.board_temp = ccd_temp_board;
+  frame->info.exposure_us = 0;
+  frame->info.coadd = 1;
+  frame->info.payload_len = sizeof(frame->pixels);
+  frame->info.crc = 0; // Stamped on the send path like a capture's
+  if (FrameRing_Complete(frame)) {
+    frame_ready = 1;
+  }
+}
+
+// ========== REPLAY ==========
+
+// A frame whole: the header of a capture around what the host sent
+static void Bench_Replayed(CCD_Frame_t *frame) {
+  frame->magic = CCD_FRAME_MAGIC;
+  frame->info.version = CCD_FRAME_VERSION;
+  frame->info.header_len = offsetof(CCD_Frame_t, pixels);
+  frame->info.timestamp = CCD_Time_Now();
+  if (frame->info.coadd == 0) {
+    frame->info.coadd = 1;
+  }
+  frame->info.payload_len = sizeof(frame->pixels);
+  frame->info.crc = 0;
+  bench_made++;
+  if (FrameRing_Complete(frame)) {
+    frame_ready = 1;
+  }
+}
+
+// Frames start on a packet or behind the last one's end; a packet that
+// starts one with no slot free is held whole
+uint32_t CCD_Bench_Receive(const uint8_t *buf, uint32_t len) {
+  if (bench_pattern != CCD_BENCH_REPLAY) {
+    return 0;
+  }
+  uint32_t taken = 0;
+  while (taken < len) {
+    if (replay_pos == 0) {
+      if (len - taken < 2U ||
+          buf[taken] != (CCD_BENCH_REPLAY_MAGIC & 0xFFU) ||
+          buf[taken + 1U] != (CCD_BENCH_REPLAY_MAGIC >> 8)) {
+        break; // A command
+      }
+      if (bench_count != 0 && bench_made >= bench_count) {
+        return len; // Past the count: dropped
+      }
+      if (!replay_armed || FrameRing_Free() == 0) {
+        replay_held = &buf[taken];
+        replay_held_len = len - taken;
+        replay_stalls++;
+        return len;
+      }
+      replay_frame = FrameRing_Claim();
+    }
+    uint32_t n = sizeof(CCD_Frame_t) - replay_pos;
+    if (n > len - taken) {
+      n = len - taken;
+    }
+    memcpy((uint8_t *)replay_frame + replay_pos, &buf[taken], n);
+    replay_pos += n;
+    taken += n;
+    if (replay_pos == sizeof(CCD_Frame_t)) {
+      replay_pos = 0;
+      Bench_Replayed(replay_frame);
+    }
+  }
+  return taken;
+}
+
+uint8_t CCD_Bench_Held(void) { return replay_held != NULL; }
+
+uint32_t CCD_Bench_Stalls(void) { return replay_stalls; }
+
+// Main loop, the endpoint un-armed: the rest of a held packet goes to the
+// commands, as from the interrupt
+static void Bench_Resume(const uint8_t *buf, uint32_t len) {
+  if (len > 0) {
+    CCD_Cmd_Receive(buf, len);
+  }
+  if (CCD_Cmd_RxReady()) {
+    CDC_ResumeRx_FS();
+  }
+}
+
+// Pattern off first: the interrupt takes nothing after it, so the claim
+// and the held packet are the main loop's
+static void Bench_EndReplay(void) {
+  bench_pattern = CCD_BENCH_OFF;
+  __DMB();
+  replay_armed = 0;
+  if (replay_pos != 0) {
+    FrameRing_CancelClaims();
+    replay_pos = 0;
+  }
+  if (replay_held != NULL) {
+    replay_held = NULL;
+    Bench_Resume(NULL, 0); // The packet is dropped
+  }
+}
+
+static void Bench_ReplayPoll(void) {
+  uint32_t tick = HAL_GetTick();
+  if (!replay_armed) {
+    replay_tick = tick;
+    __DMB();
+    replay_armed = 1;
+  }
+  const uint8_t *held = replay_held;
+  if (held != NULL && FrameRing_Free() > 0) {
+    uint32_t len = replay_held_len;
+    replay_held = NULL;
+    uint32_t n = CCD_Bench_Receive(held, len);
+    if (replay_held == NULL) {
+      Bench_Resume(&held[n], len - n);
+    }
+  }
+  if (bench_made != replay_seen) {
+    replay_seen = bench_made;
+    replay_tick = tick;
+  }
+  uint8_t waiting = replay_held != NULL || replay_pos != 0;
+  if ((bench_count != 0 && bench_made >= bench_count && !waiting) ||
+      (waiting && tick - replay_tick >= CCD_BENCH_REPLAY_TIMEOUT_MS)) {
+    Bench_EndReplay();
+    mode_update_pending = 1; // Capture resumes
+  }
+}
+
+// ========== RUNS ==========
+
+// The mode switch stops the capture chain and leaves it stopped while a run
+// is on; the one at the end restarts it. A replay starts with nothing held
+// and its pattern set last, for the interrupt.
+uint8_t CCD_Bench_Start(uint8_t pattern, uint32_t rate, uint32_t count) {
+  if (pattern > CCD_BENCH_REPLAY || rate > CCD_BENCH_RATE_MAX) {
+    return 0;
+  }
+  if (pattern == CCD_BENCH_OFF && bench_pattern == CCD_BENCH_OFF) {
+    return 1;
+  }
+  if (bench_pattern == CCD_BENCH_REPLAY) {
+    Bench_EndReplay();
+  }
+  if (pattern == CCD_BENCH_REPLAY) {
+    bench_made = 0;
+    bench_count = count;
+    replay_stalls = 0;
+    replay_seen = 0;
+    __DMB();
+    bench_pattern = pattern;
+    mode_update_pending = 1;
+    return 1;
+  }
+  bench_pattern = pattern;
+  bench_rate = rate;
+  bench_count = count;
+  if (pattern != CCD_BENCH_OFF) {
+    bench_made = 0;
+    bench_acc = 0;
+    if (rate != 0) {
+      bench_period = CCD_TIME_HZ / rate;
+      bench_frac = CCD_TIME_HZ % rate;
+    }
+    bench_due = CCD_Time_Now();
+  }
+  mode_update_pending = 1;
+  return 1;
+}
+
+uint32_t CCD_Bench_Made(void) { return bench_made; }
+
+uint8_t CCD_Bench_Running(void) { return bench_pattern != CCD_BENCH_OFF; }
+
+// Next frame due CCD_BENCH_BATCH periods ago or more: the loop cannot keep
+// the rate, and the schedule restarts from now rather than bursting
+static uint8_t Bench_Due(uint64_t now) {
+  if (bench_rate == 0) {
+    return FrameRing_Free() > 0;
+  }
+  if ((int64_t)(now - bench_due) < 0) {
+    return 0;
+  }
+  if (now - bench_due > (uint64_t)bench_period * CCD_BENCH_BATCH) {
+    bench_due = now;
+  }
+  bench_due += bench_period;
+  bench_acc += bench_frac;
+  if (bench_acc >= bench_rate) {
+    bench_acc -= bench_rate;
+    bench_due++;
+  }
+  return 1;
+}
+
+void CCD_Bench_Poll(void) {
+  if (bench_pattern == CCD_BENCH_OFF || mode_update_pending) {
+    return; // Off, or capture not stopped yet
+  }
+  if (bench_pattern == CCD_BENCH_REPLAY) {
+    Bench_ReplayPoll();
+    return;
+  }
+  for (uint32_t n = 0; n < CCD_BENCH_BATCH; n++) {
+    if (bench_count != 0 && bench_made == bench_count) {
+      bench_pattern = CCD_BENCH_OFF;
+      mode_update_pending = 1; // Capture resumes
+      return;
+    }
+    uint64_t now = CCD_Time_Now();
+    if (!Bench_Due(now)) {
+      return;
+    }
+    Bench_Publish(FrameRing_Claim(), now);
+  }
+}
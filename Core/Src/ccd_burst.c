@@ -0,0 +1,369 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_burst.c
+ * @brief          : Burst capture into a RAM frame store, drained afterwards
+ ******************************************************************************
+ */
+
+#include "ccd_burst.h"
+#include "ccd_crc.h"
+#include "ccd_psram.h"
+#include "ccd_time.h"
+#include "usb_tx.h"
+#include <stddef.h>
+#include <string.h>
+
+// One stored frame with room for its wire header in front, so a drained
+// frame goes out as a single transfer straight from the store. Whole cache
+// lines per slot, as in the frame ring.
+typedef struct {
+  CCD_BurstHeader_t hdr;
+  CCD_Frame_t frame;
+  uint8_t pad[20];
+} Burst_Slot_t;
+
+_Static_assert((sizeof(Burst_Slot_t) % 32) == 0,
+               "burst slots must be whole 32-byte cache lines");
+_Static_assert(CCD_BURST_FRAMES <= 0xFFFF, "burst indices are 16-bit");
+
+// The DMA targets: the whole store, or the staging slots of the PSRAM store
+__attribute__((section(".ram_d2"), aligned(32))) static Burst_Slot_t
+    burst_store[CCD_BURST_STAGE];
+
+#if CCD_BURST_PSRAM
+_Static_assert(CCD_BURST_FRAMES * sizeof(Burst_Slot_t) <= CCD_PSRAM_SIZE,
+               "the burst must fit in the PSRAM");
+
+// Same slot layout, read through the memory-mapped window when draining
+#define BURST_PSRAM ((Burst_Slot_t *)CCD_PSRAM_BASE)
+
+// burst_copying: what the PSRAM write in flight carries
+#define BURST_COPY_NONE 0
+#define BURST_COPY_FRAME 1  // Staging slot of claim burst_copied
+#define BURST_COPY_HEADER 2 // Drain header burst_headers
+#endif
+
+// Capture state. Claims and completions come from the acquisition ISRs in
+// the same order; "claim" and "done" count them from the arm.
+CCD_DTCM_BSS static volatile uint8_t burst_state = CCD_BURST_IDLE;
+CCD_DTCM_BSS static volatile uint8_t burst_trigger; // CCD_BURST_SRC_* fired
+CCD_DTCM_BSS static volatile uint8_t burst_pin;      // Pin trigger enabled
+CCD_DTCM_BSS static volatile uint16_t burst_level;   // Level trigger, 0 = off
+CCD_DTCM_BSS static uint16_t burst_count; // Store slots in use
+CCD_DTCM_BSS static uint16_t burst_pre;
+CCD_DTCM_BSS static volatile uint32_t burst_claim;
+CCD_DTCM_BSS static volatile uint32_t burst_done;
+CCD_DTCM_BSS static uint32_t burst_trig; // Claim number of the trigger frame
+CCD_DTCM_BSS static uint32_t burst_end;  // Claim number to stop at
+// Completion times, the low half of CCD_Time_Now()
+CCD_DTCM_BSS static uint32_t burst_cycles[CCD_BURST_FRAMES];
+
+// Drain state. queued is only written by the main loop and sent only by the
+// TX completion, so queued - sent is the number of frames in flight.
+CCD_DTCM_BSS static uint32_t burst_first; // Claim number of the oldest kept
+CCD_DTCM_BSS static uint16_t burst_kept;
+CCD_DTCM_BSS static volatile uint16_t burst_queued;
+CCD_DTCM_BSS static volatile uint16_t burst_sent;
+
+#if CCD_BURST_PSRAM
+// PSRAM copy, main loop only apart from the claims reading burst_copied:
+// claims burst_copied..burst_claim - 1 hold staging slots
+CCD_DTCM_BSS static volatile uint32_t burst_copied;
+CCD_DTCM_BSS static volatile uint8_t burst_copying; // BURST_COPY_*
+CCD_DTCM_BSS static uint16_t burst_headers;         // Drain headers written
+CCD_DTCM_BSS static volatile uint32_t burst_overruns;
+CCD_DTCM_BSS static uint8_t burst_failed;
+static CCD_BurstHeader_t burst_header; // MDMA source of a header write
+#endif
+
+CCD_DTCM_BSS static volatile uint8_t status_request;
+CCD_DTCM_BSS static volatile uint8_t status_busy;
+static CCD_BurstStatus_t status_buf; // Read by the USB engine while queued
+
+void CCD_Burst_Init(void) {
+  burst_state = CCD_BURST_IDLE;
+}
+
+// ========== COMMANDS ==========
+
+// The previous burst is still being sent, or copied after an abort
+static uint8_t CCD_Burst_StoreBusy(void) {
+#if CCD_BURST_PSRAM
+  if (burst_copying != BURST_COPY_NONE) {
+    return 1;
+  }
+#endif
+  return burst_queued != burst_sent;
+}
+
+// Only from idle, and only once the previous burst has left the store
+uint8_t CCD_Burst_Arm(uint16_t count, uint16_t pre) {
+  if (count == 0 || count > CCD_BURST_FRAMES || pre >= count ||
+      burst_state != CCD_BURST_IDLE || CCD_Burst_StoreBusy()) {
+    return 0;
+  }
+#if CCD_BURST_PSRAM
+  burst_copied = 0;
+  burst_headers = 0;
+  burst_overruns = 0;
+  burst_failed = 0;
+#endif
+  burst_queued = 0;
+  burst_sent = 0;
+  burst_count = count;
+  burst_pre = pre;
+  burst_claim = 0;
+  burst_done = 0;
+  burst_trigger = (pre == 0) ? CCD_BURST_SRC_HOST : 0; // Nothing to wait for
+  __DMB();
+  burst_state = CCD_BURST_ARMED;
+  return 1;
+}
+
+// Record the first trigger while armed; the next claim acts on it
+static void CCD_Burst_Fire(uint8_t source) {
+  if (burst_state == CCD_BURST_ARMED && burst_trigger == 0) {
+    burst_trigger = source;
+  }
+}
+
+void CCD_Burst_Trigger(void) { CCD_Burst_Fire(CCD_BURST_SRC_HOST); }
+
+void CCD_Burst_SetPinTrigger(uint8_t enable) { burst_pin = enable; }
+
+void CCD_Burst_SetLevelTrigger(uint16_t level) { burst_level = level; }
+
+CCD_ITCM void CCD_Burst_PinIRQ(void) {
+  if (burst_pin) {
+    CCD_Burst_Fire(CCD_BURST_SRC_PIN);
+  }
+}
+
+// Stop recording or draining. Transfers already queued still complete, and
+// late DMA completions into the store are discarded.
+void CCD_Burst_Abort(void) { burst_state = CCD_BURST_IDLE; }
+
+void CCD_Burst_RequestStatus(void) { status_request = 1; }
+
+// ========== PRODUCER ==========
+
+// Darkest-is-brightest: smallest pixel of the frame. USUB16 sets the GE
+// flags per halfword where px >= min, SEL then keeps the smaller of each
+// pair.
+CCD_ITCM static uint32_t CCD_Burst_Min(const uint16_t *px) {
+  uint32_t m = 0xFFFFFFFFU;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t w;
+    memcpy(&w, &px[i], sizeof(w));
+    (void)__USUB16(w, m);
+    m = __SEL(m, w);
+  }
+  uint32_t lo = m & 0xFFFFU;
+  uint32_t hi = m >> 16;
+  return (lo < hi) ? lo : hi;
+}
+
+// Next store slot for the DMA, or NULL once the burst is complete (the
+// capture then goes to the frame ring). A pending trigger takes effect at
+// the next claim, so the trigger frame is the first one started after it.
+CCD_ITCM CCD_Frame_t *CCD_Burst_Claim(void) {
+  uint8_t state = burst_state;
+  if (state == CCD_BURST_ARMED && burst_trigger) {
+    burst_trig = burst_claim;
+    burst_end = burst_claim + (uint32_t)(burst_count - burst_pre);
+    state = CCD_BURST_CAPTURING;
+    burst_state = state;
+  }
+  if (state != CCD_BURST_ARMED &&
+      (state != CCD_BURST_CAPTURING || burst_claim == burst_end)) {
+    return NULL;
+  }
+
+#if CCD_BURST_PSRAM
+  if (burst_claim - burst_copied >= CCD_BURST_STAGE) {
+    burst_overruns++; // Copy behind: this capture goes to the ring
+    return NULL;
+  }
+  Burst_Slot_t *slot = &burst_store[burst_claim % CCD_BURST_STAGE];
+#else
+  Burst_Slot_t *slot = &burst_store[burst_claim % burst_count];
+#endif
+  burst_claim++;
+  // Drop lines the CPU dirtied (header, CRC) before the DMA refills it
+  CCD_DCACHE_INVALIDATE(slot, sizeof(*slot));
+  return &slot->frame;
+}
+
+// Returns 1 if the frame belongs to the store (it never enters the ring).
+// The last frame of a triggered burst hands the store over to the drain.
+CCD_ITCM uint8_t CCD_Burst_Complete(CCD_Frame_t *frame) {
+  const uint8_t *p = (const uint8_t *)frame;
+  if (p < (const uint8_t *)burst_store ||
+      p >= (const uint8_t *)&burst_store[CCD_BURST_STAGE]) {
+    return 0;
+  }
+  if (burst_state != CCD_BURST_ARMED && burst_state != CCD_BURST_CAPTURING) {
+    return 1; // Aborted
+  }
+
+  burst_cycles[burst_done % burst_count] = (uint32_t)CCD_Time_Now();
+  burst_done++;
+  uint16_t level = burst_level;
+  if (level != 0 && burst_state == CCD_BURST_ARMED && burst_trigger == 0 &&
+      CCD_Burst_Min(frame->pixels) < level) {
+    CCD_Burst_Fire(CCD_BURST_SRC_LEVEL);
+  }
+  if (burst_state == CCD_BURST_CAPTURING && burst_done == burst_end) {
+    burst_kept = (burst_end < burst_count) ? (uint16_t)burst_end : burst_count;
+    burst_first = burst_end - burst_kept;
+    burst_state = CCD_BURST_DRAINING;
+  }
+  return 1;
+}
+
+// Acquisition stopped mid-frame: slots claimed but never filled are free
+void CCD_Burst_CancelClaims(void) { burst_claim = burst_done; }
+
+// ========== DRAIN ==========
+
+// Wire header of the kept frame at index. Signed difference: pre-trigger
+// frames come out negative.
+static void CCD_Burst_Header(CCD_BurstHeader_t *hdr, uint16_t index) {
+  int32_t cycles_per_us = (int32_t)(CCD_TIME_HZ / 1000000U);
+  uint32_t t0 = burst_cycles[burst_trig % burst_count];
+  uint32_t n = burst_first + index;
+  hdr->magic = CCD_BURST_MAGIC;
+  hdr->index = index;
+  hdr->count = burst_kept;
+  hdr->trigger = (uint16_t)(burst_trig - burst_first);
+  hdr->t_us = (int32_t)(burst_cycles[n % burst_count] - t0) / cycles_per_us;
+}
+
+#if CCD_BURST_PSRAM
+// PSRAM address of claim n's slot
+static uint32_t CCD_Burst_PsramSlot(uint32_t n) {
+  return (n % burst_count) * (uint32_t)sizeof(Burst_Slot_t);
+}
+
+// One PSRAM write at a time, from the main loop: the staged captures while
+// the burst records, then the drain headers into the kept slots, then the
+// PSRAM is mapped for reading. Returns 1 once the kept frames can be read
+// at CCD_PSRAM_BASE.
+static uint8_t CCD_Burst_Copy(void) {
+  if (burst_copying != BURST_COPY_NONE) {
+    if (CCD_PSRAM_Busy()) {
+      return 0;
+    }
+    if (CCD_PSRAM_Failed()) {
+      burst_failed = 1;
+      burst_state = CCD_BURST_IDLE;
+    } else if (burst_copying == BURST_COPY_FRAME) {
+      burst_copied++;
+    } else {
+      burst_headers++;
+    }
+    burst_copying = BURST_COPY_NONE;
+  }
+  uint8_t state = burst_state;
+  if (state == CCD_BURST_IDLE) {
+    return 0; // Aborted: the staged rest is dropped
+  }
+
+  uint32_t n = burst_copied;
+  const void *src;
+  uint32_t addr;
+  uint32_t len;
+  if (n != burst_done) {
+    Burst_Slot_t *stage = &burst_store[n % CCD_BURST_STAGE];
+    CCD_Crc_Stamp(&stage->frame); // Final here, as it is never drained
+    src = &stage->frame;
+    addr = CCD_Burst_PsramSlot(n) + offsetof(Burst_Slot_t, frame);
+    len = sizeof(CCD_Frame_t);
+    burst_copying = BURST_COPY_FRAME;
+  } else if (state != CCD_BURST_DRAINING) {
+    return 0;
+  } else if (burst_headers < burst_kept) {
+    CCD_Burst_Header(&burst_header, burst_headers);
+    src = &burst_header;
+    addr = CCD_Burst_PsramSlot(burst_first + burst_headers);
+    len = sizeof(CCD_BurstHeader_t);
+    burst_copying = BURST_COPY_HEADER;
+  } else {
+    if (!CCD_PSRAM_Map()) {
+      burst_failed = 1;
+      burst_state = CCD_BURST_IDLE;
+      return 0;
+    }
+    return 1;
+  }
+
+  CCD_PSRAM_Unmap(); // Still mapped from the previous drain
+  if (!CCD_PSRAM_Write(addr, src, len)) {
+    burst_copying = BURST_COPY_NONE;
+    burst_failed = 1;
+    burst_state = CCD_BURST_IDLE;
+  }
+  return 0;
+}
+#endif
+
+static void CCD_Burst_Sent(void *ctx, uint32_t len) {
+  if (++burst_sent == burst_kept && burst_state == CCD_BURST_DRAINING) {
+    burst_state = CCD_BURST_IDLE;
+  }
+}
+
+static void CCD_Burst_StatusSent(void *ctx, uint32_t len) { status_busy = 0; }
+
+// Status first (it is short), then as many stored frames as the TX queue
+// takes, oldest first
+void CCD_Burst_Send(void) {
+  if (status_request && !status_busy && UsbTx_Space(&usb_tx_fs) > 0) {
+    status_request = 0;
+    uint32_t stored = burst_done;
+    status_buf.magic = CCD_BURST_STATUS;
+    status_buf.state = burst_state;
+    status_buf.sources = CCD_BURST_SRC_HOST |
+                         (burst_pin ? CCD_BURST_SRC_PIN : 0) |
+                         (burst_level ? CCD_BURST_SRC_LEVEL : 0);
+    status_buf.cause = burst_trigger;
+    status_buf.count = burst_count;
+    status_buf.pre = burst_pre;
+    status_buf.stored = (stored < burst_count) ? (uint16_t)stored : burst_count;
+    status_buf.sent = burst_sent;
+    status_buf.max = CCD_BURST_FRAMES;
+    status_buf.level = burst_level;
+#if CCD_BURST_PSRAM
+    status_buf.failed = burst_failed;
+    status_buf.overruns = burst_overruns;
+#endif
+    status_busy = 1;
+    UsbTx_Submit(&usb_tx_fs, (const uint8_t *)&status_buf, sizeof(status_buf),
+                 CCD_Burst_StatusSent, NULL);
+  }
+
+#if CCD_BURST_PSRAM
+  if (!CCD_Burst_Copy()) {
+    return;
+  }
+#endif
+  while (burst_state == CCD_BURST_DRAINING && burst_queued < burst_kept &&
+         UsbTx_Space(USB_TX_FRAMES) > 0) {
+    uint32_t n = burst_first + burst_queued;
+#if CCD_BURST_PSRAM
+    // Header and CRC are already in the PSRAM. Drop lines of this window
+    // cached from an earlier burst.
+    Burst_Slot_t *slot = &BURST_PSRAM[n % burst_count];
+    CCD_DCACHE_INVALIDATE(slot, sizeof(*slot));
+#else
+    Burst_Slot_t *slot = &burst_store[n % burst_count];
+    CCD_Burst_Header(&slot->hdr, burst_queued);
+    CCD_Crc_Stamp(&slot->frame);
+#endif
+
+    burst_queued++;
+    UsbTx_Submit(USB_TX_FRAMES, (const uint8_t *)slot,
+                 sizeof(CCD_BurstHeader_t) + sizeof(CCD_Frame_t),
+                 CCD_Burst_Sent, slot);
+  }
+}
@@ -0,0 +1,67 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_clock.c
+ * @brief          : Core clock step-down for slow exposures
+ ******************************************************************************
+ */
+
+#include "ccd_clock.h"
+#include "ccd_acq.h"
+#include "ccd_bench.h"
+
+#if CCD_CLK_SLOW && CCD_CLOCK_SLOW_MS
+
+static uint8_t clock_slow;
+
+// Nothing to process between frames, or too little for the full clock
+static uint8_t Clock_WantSlow(void) {
+  if (CCD_Bench_Running()) {
+    return 0;
+  }
+  if (ccd_mode == CCD_MODE_ONESHOT) {
+    return 1;
+  }
+  return CCD_Acq_IcgTicks() >=
+         (uint64_t)CCD_CLOCK_SLOW_MS * (CCD_TIM_CLK_HZ / 1000U);
+}
+
+static void Clock_Vos(uint32_t vos) {
+  if (CCD_CLK_SLOW_VOS == CCD_CLK_VOS) {
+    return;
+  }
+  __HAL_PWR_VOLTAGESCALING_CONFIG(vos);
+  while (!__HAL_PWR_GET_FLAG(PWR_FLAG_VOSRDY)) {
+  }
+}
+
+// D1CPRE and HPRE in one write, so HCLK never moves. The voltage goes down
+// after the core clock and up before it.
+static void Clock_Set(uint8_t slow) {
+  uint32_t cfgr = RCC->D1CFGR & ~(RCC_D1CFGR_D1CPRE | RCC_D1CFGR_HPRE);
+  if (slow) {
+    RCC->D1CFGR = cfgr | RCC_SYSCLK_DIV2 | RCC_HCLK_DIV1;
+    Clock_Vos(CCD_CLK_SLOW_VOS);
+  } else {
+    Clock_Vos(CCD_CLK_VOS);
+    RCC->D1CFGR = cfgr | RCC_SYSCLK_DIV1 | CCD_CLK_HPRE;
+  }
+  SystemCoreClockUpdate();
+  clock_slow = slow;
+}
+
+// A mode switch in progress keeps the clock it has
+void CCD_Clock_Poll(void) {
+  if (mode_update_pending) {
+    return;
+  }
+  uint8_t slow = Clock_WantSlow();
+  if (slow != clock_slow) {
+    Clock_Set(slow);
+  }
+}
+
+#else
+
+void CCD_Clock_Poll(void) {}
+
+#endif /* CCD_CLK_SLOW && CCD_CLOCK_SLOW_MS */
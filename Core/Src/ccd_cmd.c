@@ -0,0 +1,1418 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_cmd.c
+ * @brief          : Binary command protocol (framed TLV, acknowledged)
+ ******************************************************************************
+ */
+
+#include "ccd_cmd.h"
+#include "ccd_acq.h"
+#include "ccd_adccal.h"
+#include "ccd_bench.h"
+#include "ccd_burst.h"
+#include "ccd_clock.h"
+#include "ccd_config.h"
+#include "ccd_din.h"
+#include "ccd_dual.h"
+#include "ccd_fault.h"
+#include "ccd_flow.h"
+#include "ccd_irq.h"
+#include "ccd_lat.h"
+#include "ccd_jpeg.h"
+#include "ccd_line.h"
+#include "ccd_loop.h"
+#include "ccd_mains.h"
+#include "ccd_selftest.h"
+#include "ccd_match.h"
+#include "ccd_model.h"
+#include "ccd_mem.h"
+#include "ccd_pack.h"
+#include "ccd_preview.h"
+#include "ccd_probe.h"
+#include "ccd_proc.h"
+#include "ccd_ptc.h"
+#include "ccd_rec.h"
+#include "ccd_ref.h"
+#include "ccd_seq.h"
+#include "ccd_shutter.h"
+#include "ccd_snap.h"
+#include "ccd_time.h"
+#include "ccd_timing.h"
+#include "ccd_trace.h"
+#include "ccd_txn.h"
+#include "frame_ring.h"
+#include "stm32h7xx_ll_tim.h"
+#include "usb_tx.h"
+#include "usbd_cdc_if.h"
+#include <string.h>
+
+#define CMD_HEADER 4U // sync, seq, type, len
+#define CMD_FRAME_MAX (CMD_HEADER + CCD_CMD_VALUE_MAX + 1U)
+#define CMD_RX_MASK (CCD_CMD_RX_SIZE - 1U)
+#define CMD_ACK_BUFS 8
+#define CMD_TIME_SLOTS 8 // TIME requests received and not yet executed
+
+_Static_assert((CCD_CMD_RX_SIZE & CMD_RX_MASK) == 0,
+               "the RX ring wraps with a mask");
+_Static_assert(CCD_CMD_RX_SIZE >= CMD_FRAME_MAX + CDC_DATA_FS_MAX_PACKET_SIZE,
+               "a stalled ring must still hold a whole frame");
+_Static_assert(sizeof(CCD_CmdStats_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "stats travel in the ack payload");
+_Static_assert(sizeof(CCD_CmdTime_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "time replies travel in the ack payload");
+_Static_assert(sizeof(CCD_CmdInfo_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the info reply travels in the ack payload");
+_Static_assert(sizeof(CCD_RecStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the record status travels in the ack payload");
+_Static_assert(sizeof(CCD_Wavelength_t) <= CCD_CMD_ACK_PAYLOAD_MAX &&
+                   1U + sizeof(CCD_Wavelength_t) <= CCD_CMD_VALUE_MAX,
+               "the calibration travels in one frame and its ack");
+_Static_assert(3U + 2U * CCD_LIN_CHUNK <= CCD_CMD_VALUE_MAX,
+               "a linearity chunk fits one frame");
+_Static_assert(sizeof(CCD_CmdProbe_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "a probe travels in the ack payload");
+_Static_assert(sizeof(CCD_CmdProfile_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the profile travels in the ack payload");
+_Static_assert(sizeof(((CCD_CmdProbe_t *)0)->hist) ==
+                   CCD_PROBE_BINS * sizeof(uint32_t),
+               "one reply entry per histogram bin");
+_Static_assert(sizeof(CCD_LatReport_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the latency report travels in the ack payload");
+_Static_assert(sizeof(CCD_FaultReport_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the fault counters travel in the ack payload");
+_Static_assert(sizeof(CCD_ProcBench_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "a kernel benchmark travels in the ack payload");
+_Static_assert(sizeof(CCD_AdcCalStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the ADC calibration status travels in the ack payload");
+_Static_assert(1U + CCD_PROC_DARKT_KNOTS * sizeof(CCD_DarkTempKnot_t) <=
+                   CCD_CMD_VALUE_MAX,
+               "a dark temperature table fits one command");
+_Static_assert(sizeof(CCD_DarkTempStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the dark temperature status travels in the ack payload");
+_Static_assert(sizeof(CCD_DefectStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the defect status travels in the ack payload");
+_Static_assert(sizeof(CCD_DriftStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the drift status travels in the ack payload");
+_Static_assert(sizeof(CCD_MatchStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the match status travels in the ack payload");
+_Static_assert(sizeof(CCD_MemStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the memory budget travels in the ack payload");
+_Static_assert(sizeof(CCD_SatStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the saturation status travels in the ack payload");
+_Static_assert(sizeof(CCD_DinStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "input status fits an ack");
+_Static_assert(sizeof(CCD_TxnStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "transaction status fits an ack");
+_Static_assert(sizeof(CCD_LoopStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the link test status fits an ack");
+_Static_assert(sizeof(CCD_MainsStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the line sync status fits an ack");
+_Static_assert(sizeof(CCD_SelftestStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the self-test result fits an ack");
+_Static_assert(sizeof(CCD_BaselineStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the baseline status fits an ack");
+_Static_assert(sizeof(CCD_FocusStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the focus status fits an ack");
+_Static_assert(sizeof(CCD_AutoRoiStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the auto ROI status fits an ack");
+_Static_assert(sizeof(CCD_ShutterStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the shutter status fits an ack");
+_Static_assert(sizeof(CCD_ModelStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the model status fits an ack");
+_Static_assert(sizeof(CCD_RefStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the reference status travels in the ack payload");
+_Static_assert(sizeof(CCD_PtcStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the PTC status travels in the ack payload");
+_Static_assert(3U + 14U * sizeof(uint32_t) <= CCD_CMD_VALUE_MAX,
+               "a PTC level command carries 14 integration times");
+_Static_assert(sizeof(CCD_ConfigStatus_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the config status travels in the ack payload");
+_Static_assert(sizeof(CCD_CmdProfile_t) <= CCD_CMD_ACK_PAYLOAD_MAX,
+               "the profile travels in the ack payload");
+_Static_assert(sizeof(((CCD_CmdProfile_t *)0)->max_cycles) ==
+                   CCD_PROC_STAGES * sizeof(uint32_t),
+               "one profile entry per processing stage");
+
+typedef struct {
+  CCD_CmdAck_t hdr;
+  uint8_t payload[CCD_CMD_ACK_PAYLOAD_MAX];
+} Cmd_Ack_t;
+
+// RX ring. The interrupt appends at rx_wr and moves rx_head past each whole
+// frame, so the main loop never sees a partial one.
+static uint8_t cmd_rx[CCD_CMD_RX_SIZE];
+static volatile uint32_t rx_wr;
+static volatile uint32_t rx_head;
+static volatile uint32_t rx_tail; // Main loop
+static uint32_t rx_pos;           // Bytes in of the frame being reassembled
+static uint32_t rx_need;          // Its length, once its len byte is in
+static volatile uint8_t rx_stalled; // OUT endpoint left un-armed
+
+static volatile uint32_t cmd_count;
+static volatile uint32_t cmd_errors;
+static volatile uint32_t cmd_stalls;
+
+static Cmd_Ack_t cmd_ack[CMD_ACK_BUFS]; // Read by the USB engine while queued
+static volatile uint8_t cmd_ack_busy[CMD_ACK_BUFS];
+
+// Arrival times of TIME requests, by seq (an entry is free once its time
+// is 0). The slot is taken by the RX interrupt, so a full set overwrites
+// the oldest.
+typedef struct {
+  uint64_t cycles;
+  uint8_t seq;
+} Cmd_TimeSlot_t;
+
+static Cmd_TimeSlot_t time_rx[CMD_TIME_SLOTS];
+static uint32_t time_rx_wr;
+static volatile uint64_t time_sent; // Last TIME ack's TX completion
+static volatile uint8_t time_sent_seq;
+
+// ========== RX INTERRUPT ==========
+
+uint8_t CCD_Cmd_Receive(const uint8_t *buf, uint32_t len) {
+  if (rx_pos == 0 && buf[0] != CCD_CMD_SYNC) {
+    CCD_TRACE_ARG(CCD_TRACE_CMD, 0x100U + buf[0]);
+    return 0; // ASCII command
+  }
+  uint64_t now = CCD_Time_Now();
+  for (uint32_t i = 0; i < len; i++) {
+    uint8_t b = buf[i];
+    if (rx_pos == 0) {
+      if (b != CCD_CMD_SYNC) {
+        cmd_errors++; // Junk between frames: skip to the next sync byte
+        continue;
+      }
+      rx_need = CMD_HEADER;
+    }
+    cmd_rx[rx_wr++ & CMD_RX_MASK] = b;
+    rx_pos++;
+    if (rx_pos == CMD_HEADER) {
+      if (b > CCD_CMD_VALUE_MAX) {
+        rx_wr = rx_head; // Not a frame after all
+        rx_pos = 0;
+        cmd_errors++;
+        continue;
+      }
+      rx_need = CMD_HEADER + b + 1U;
+    } else if (rx_pos == rx_need) {
+      uint32_t start = rx_head;
+      if (cmd_rx[(start + 2U) & CMD_RX_MASK] == CCD_CMD_TIME) {
+        Cmd_TimeSlot_t *slot = &time_rx[time_rx_wr++ % CMD_TIME_SLOTS];
+        slot->cycles = now;
+        slot->seq = cmd_rx[(start + 1U) & CMD_RX_MASK];
+      }
+      CCD_TRACE_ARG(CCD_TRACE_CMD, cmd_rx[(start + 2U) & CMD_RX_MASK]);
+      rx_head = rx_wr;
+      rx_pos = 0;
+    }
+  }
+  return 1;
+}
+
+static uint32_t Cmd_RxFree(void) {
+  return CCD_CMD_RX_SIZE - (rx_wr - rx_tail);
+}
+
+uint8_t CCD_Cmd_RxReady(void) {
+  if (Cmd_RxFree() >= CDC_DATA_FS_MAX_PACKET_SIZE) {
+    return 1;
+  }
+  rx_stalled = 1;
+  cmd_stalls++;
+  return 0;
+}
+
+uint32_t CCD_Cmd_Errors(void) { return cmd_errors; }
+
+uint32_t CCD_Cmd_Stalls(void) { return cmd_stalls; }
+
+// ========== EXECUTION ==========
+
+static uint16_t Cmd_U16(const uint8_t *v) { return v[0] | (v[1] << 8); }
+
+static uint32_t Cmd_U32(const uint8_t *v) {
+  return v[0] | (v[1] << 8) | (v[2] << 16) | ((uint32_t)v[3] << 24);
+}
+
+static uint8_t Cmd_Stats(Cmd_Ack_t *ack) {
+  CCD_CmdStats_t st = {
+      .produced = frame_ring_stats.produced,
+      .released = frame_ring_stats.released,
+      .dropped = frame_ring_stats.dropped,
+      .resyncs = ccd_acq_stats.resyncs,
+      .dma_errors = ccd_acq_stats.dma_errors,
+      .coadded = ccd_proc_stats.coadded,
+      .commands = cmd_count,
+      .cmd_errors = cmd_errors,
+      .uptime_ms = HAL_GetTick(),
+      .throttled = ccd_flow_stats.skipped + ccd_flow_stats.merged,
+      .loop_max_us = loop_max_cycles / (SystemCoreClock / 1000000U),
+      .late = ccd_acq_stats.late,
+      .irq_fixes = CCD_Irq_Check(),
+      .packed = ccd_pack_stats.records,
+      .packs = ccd_pack_stats.transfers,
+      .icg_count = CCD_Acq_IcgCount(),
+      .missed = ccd_acq_stats.missed,
+#if CCD_DUAL_SENSOR
+      .dual_dropped = CCD_Dual_Dropped(),
+#endif
+  };
+  loop_max_cycles = 0;
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+// Worst cases since the last PROFILE, against the frame period as TIM2 runs
+// it now (low-noise profiles stretch it)
+static uint8_t Cmd_Profile(Cmd_Ack_t *ack) {
+  uint64_t ticks = (uint64_t)(LL_TIM_GetAutoReload(TIM2) + 1U) *
+                   (LL_TIM_GetPrescaler(TIM2) + 1U);
+  CCD_CmdProfile_t pr = {
+      .frame_cycles = (uint32_t)(ticks * SystemCoreClock / CCD_TIM_CLK_HZ),
+      .frames = ccd_proc_profile.frames,
+      .max_total = ccd_proc_profile.max_total,
+  };
+  memcpy(pr.max_cycles, ccd_proc_profile.max_cycles, sizeof(pr.max_cycles));
+  CCD_Proc_ProfileReset();
+  memcpy(ack->payload, &pr, sizeof(pr));
+  ack->hdr.len = sizeof(pr);
+  return CCD_CMD_OK;
+}
+
+// Main loop: the RX interrupt does not touch a slot it has filled until it
+// wraps round to it again. The newest match wins; older ones are left over
+// from requests that were never executed (bad check) and are dropped too.
+static uint64_t Cmd_TimeTake(uint8_t seq) {
+  uint64_t t = 0;
+  for (uint32_t i = 0; i < CMD_TIME_SLOTS; i++) {
+    if (time_rx[i].seq == seq && time_rx[i].cycles > t) {
+      t = time_rx[i].cycles;
+    }
+    if (time_rx[i].seq == seq) {
+      time_rx[i].cycles = 0;
+    }
+  }
+  return t;
+}
+
+static uint8_t Cmd_Time(uint8_t seq, Cmd_Ack_t *ack) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq(); // time_sent and its seq together
+  CCD_CmdTime_t t = {
+      .rx_cycles = Cmd_TimeTake(seq),
+      .prev_cycles = time_sent,
+      .prev_seq = time_sent_seq,
+      .tick_hz = CCD_TIME_HZ,
+  };
+  __set_PRIMASK(primask);
+  t.tx_cycles = CCD_Time_Now();
+  memcpy(ack->payload, &t, sizeof(t));
+  ack->hdr.len = sizeof(t);
+  return CCD_CMD_OK;
+}
+
+// Value length + 1 per command, 0 = no such command. CCD_CMD_ROI takes any
+// number of windows.
+static const uint8_t value_len[] = {
+    [CCD_CMD_PING] = 1,      [CCD_CMD_MODE] = 2,
+    [CCD_CMD_EXPOSURE] = 9,  [CCD_CMD_INTEGRATION] = 5,
+    [CCD_CMD_ROI] = 1,       [CCD_CMD_BINNING] = 2,
+    [CCD_CMD_COADD] = 3,     [CCD_CMD_ROLLING] = 3,
+    [CCD_CMD_TRIGGER] = 2,   [CCD_CMD_TRANSPORT] = 2,
+    [CCD_CMD_CONFIG] = 3,
+    [CCD_CMD_DARK_TEMP] = 2 + CCD_PROC_DARKT_KNOTS * sizeof(CCD_DarkTempKnot_t),
+    [CCD_CMD_BLACK] = 2,
+    [CCD_CMD_STATS] = 1,     [CCD_CMD_TIME] = 1,
+    [CCD_CMD_FLOW] = 2,      [CCD_CMD_CREDIT] = 5,
+    [CCD_CMD_INFO] = 1,
+#if CCD_SD
+    [CCD_CMD_RECORD] = 2,
+#endif
+    [CCD_CMD_PROFILE] = 1,
+    [CCD_CMD_FRAME_STATS] = 4,
+    [CCD_CMD_PEAKS] = 7,
+    [CCD_CMD_SMOOTH] = 3,
+    [CCD_CMD_WAVELENGTH] = 1 + 1 + sizeof(CCD_Wavelength_t),
+    [CCD_CMD_ABSORBANCE] = 4,
+    [CCD_CMD_LINEARITY] = 4 + 2 * CCD_LIN_CHUNK,
+    [CCD_CMD_BENCH] = 10,
+    [CCD_CMD_PROBE] = 3,
+    [CCD_CMD_TELEMETRY] = 3,
+};
+_Static_assert(sizeof(value_len) <= 32, "commands fit CCD_CmdInfo_t");
+
+static uint8_t Cmd_Wavelength(const uint8_t *v, Cmd_Ack_t *ack) {
+  uint8_t ok = 1;
+  if (v[0] == CCD_WL_CMD_SET) {
+    CCD_Wavelength_t cal;
+    memcpy(&cal, &v[1], sizeof(cal));
+    ok = CCD_Proc_SetWavelength(&cal);
+  } else if (v[0] == CCD_WL_CMD_SAVE) {
+    ok = CCD_Proc_SaveWavelength();
+  } else if (v[0] != CCD_WL_CMD_STATUS) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_Wavelength_t cal;
+  CCD_Proc_GetWavelength(&cal);
+  memcpy(ack->payload, &cal, sizeof(cal));
+  ack->hdr.len = sizeof(cal);
+  return ok ? CCD_CMD_OK : CCD_CMD_REJECTED;
+}
+
+// A new reference restarts the capture; the mode applies once one is ready
+static uint8_t Cmd_Absorbance(const uint8_t *v, Cmd_Ack_t *ack) {
+  uint16_t frames = Cmd_U16(&v[1]);
+  if (v[0] > CCD_PROC_ABS_ABSORBANCE || frames > CCD_PROC_ABS_REF_MAX) {
+    return CCD_CMD_REJECTED;
+  }
+  proc_abs_mode = v[0];
+  if (frames != 0) {
+    proc_abs_request = frames;
+  }
+  CCD_CmdAbsorbance_t st = {
+      .mode = proc_abs_mode,
+      .state = (frames != 0) ? CCD_ABS_CAPTURING : proc_abs_state,
+  };
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+// WRITE stages knots; every other action ends with the table applied (or
+// not, for OFF and a failed LOAD)
+static uint8_t Cmd_Linearity(const uint8_t *v, Cmd_Ack_t *ack) {
+  uint8_t ok = 1;
+  if (v[0] == CCD_LIN_CMD_WRITE) {
+    CCD_Proc_LinWrite(Cmd_U16(&v[1]), &v[3], CCD_LIN_CHUNK);
+  } else {
+    ok = CCD_Proc_LinService(v[0]);
+  }
+  ack->payload[0] = proc_lin_enable;
+  ack->hdr.len = 1;
+  return ok ? CCD_CMD_OK : CCD_CMD_REJECTED;
+}
+
+// The ack counts the frames of the run before (stopped or finished), and
+// for a replay the packets it held, so CCD_BENCH_OFF also reads the result
+// of a completed run
+static uint8_t Cmd_Bench(const uint8_t *v, Cmd_Ack_t *ack) {
+  uint32_t made[2] = {CCD_Bench_Made(), CCD_Bench_Stalls()};
+  if (!CCD_Bench_Start(v[0], Cmd_U32(&v[1]), Cmd_U32(&v[5]))) {
+    return CCD_CMD_REJECTED;
+  }
+  memcpy(ack->payload, made, sizeof(made));
+  ack->hdr.len = sizeof(made);
+  return CCD_CMD_OK;
+}
+
+static uint8_t Cmd_Config(const uint8_t *v, Cmd_Ack_t *ack) {
+  CCD_ConfigStatus_t st;
+  if (!CCD_Config_Command(v[0], v[1], &st)) {
+    return CCD_CMD_REJECTED;
+  }
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+static uint8_t Cmd_DarkTemp(const uint8_t *v, Cmd_Ack_t *ack) {
+  uint8_t ok = 1;
+  if (v[0] != CCD_DARKT_STATUS) {
+    CCD_DarkTempKnot_t k[CCD_PROC_DARKT_KNOTS];
+    memcpy(k, &v[1], sizeof(k));
+    ok = CCD_Proc_SetDarkTemp(k, v[0]);
+  }
+  CCD_DarkTempStatus_t st;
+  CCD_Proc_DarkTempStatus(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return ok ? CCD_CMD_OK : CCD_CMD_REJECTED;
+}
+
+static uint8_t Cmd_Black(uint8_t v, Cmd_Ack_t *ack) {
+  if (v > 1 && v != CCD_BLACK_STATUS) {
+    return CCD_CMD_REJECTED;
+  }
+  if (v != CCD_BLACK_STATUS) {
+    proc_black_enable = v;
+  }
+  CCD_BlackStatus_t st;
+  CCD_Proc_BlackStatus(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+static uint8_t Cmd_Probe(const uint8_t *v, Cmd_Ack_t *ack) {
+  if (v[0] >= CCD_PROBE_COUNT) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_Probe_t p;
+  CCD_Probe_Read(v[0], &p, v[1]);
+  CCD_CmdProbe_t pr = {
+      .probe = v[0],
+      .bins = CCD_PROBE_BINS,
+      .count = p.count,
+      .min_cycles = p.count ? p.min : 0,
+      .max_cycles = p.max,
+      .mean_cycles = p.count ? (uint32_t)(p.sum / p.count) : 0,
+  };
+  memcpy(pr.hist, p.hist, sizeof(pr.hist));
+  memcpy(ack->payload, &pr, sizeof(pr));
+  ack->hdr.len = sizeof(pr);
+  return CCD_CMD_OK;
+}
+
+// The bands a command carries go to the staged list as they are
+static uint8_t Cmd_Bands(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  if ((len - 2U) % sizeof(CCD_Band_t) != 0) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  if (v[1] != CCD_TELEM_KEEP) {
+    CCD_Band_t b[CCD_PROC_BANDS_MAX];
+    uint32_t n = (len - 2U) / sizeof(CCD_Band_t);
+    if (n > CCD_PROC_BANDS_MAX) {
+      return CCD_CMD_REJECTED;
+    }
+    memcpy(b, &v[2], n * sizeof(CCD_Band_t));
+    if (!CCD_Proc_SetBands(v[1] & CCD_BANDS_FIRST, b, (uint8_t)n,
+                           (v[1] & CCD_BANDS_APPLY) != 0)) {
+      return CCD_CMD_REJECTED;
+    }
+  }
+  CCD_BandsStatus_t st;
+  CCD_Proc_GetBands(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+static uint8_t Cmd_Focus(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  if ((len - 2U) % sizeof(CCD_FocusLine_t) != 0) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  if (v[1] != CCD_TELEM_KEEP) {
+    CCD_FocusLine_t l[CCD_PROC_FOCUS_MAX];
+    uint32_t n = (len - 2U) / sizeof(CCD_FocusLine_t);
+    if (n > CCD_PROC_FOCUS_MAX) {
+      return CCD_CMD_REJECTED;
+    }
+    memcpy(l, &v[2], n * sizeof(CCD_FocusLine_t));
+    if (!CCD_Proc_SetFocus(v[1] & CCD_BANDS_FIRST, l, (uint8_t)n,
+                           (v[1] & CCD_BANDS_APPLY) != 0)) {
+      return CCD_CMD_REJECTED;
+    }
+  }
+  CCD_FocusStatus_t st;
+  CCD_Proc_GetFocus(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+static uint8_t Cmd_AutoRoi(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  if (len != 2U && !(v[1] == CCD_PROC_AUTOROI_ON && len == 8U)) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  CCD_AutoRoiStatus_t st;
+  CCD_Proc_GetAutoRoi(&st);
+  if (v[1] == CCD_PROC_AUTOROI_AGAIN) {
+    CCD_Proc_AutoRoiAgain();
+  } else if (v[1] != CCD_TELEM_KEEP) {
+    if (len == 8U) {
+      st.lines = v[2];
+      st.frames = v[3];
+      st.margin = Cmd_U16(&v[4]);
+      st.interval = Cmd_U16(&v[6]);
+    }
+    if (!CCD_Proc_SetAutoRoi(v[1], st.lines, st.frames, st.margin,
+                             st.interval)) {
+      return CCD_CMD_REJECTED;
+    }
+  }
+  CCD_Proc_GetAutoRoi(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+static uint8_t Cmd_Despike(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  if (len != 2U && len != 5U) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  if (v[1] != CCD_TELEM_KEEP) {
+    uint8_t sigma = proc_despike_sigma;
+    uint16_t level = proc_despike_floor;
+    if (len == 5U) {
+      sigma = v[2];
+      level = Cmd_U16(&v[3]);
+    }
+    if (!CCD_Proc_SetDespike(v[1], sigma, level)) {
+      return CCD_CMD_REJECTED;
+    }
+  }
+  CCD_DespikeStatus_t st;
+  CCD_Proc_GetDespike(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+static uint8_t Cmd_Baseline(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  if (len != 2U && len != 4U) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  if (v[1] != CCD_TELEM_KEEP) {
+    uint16_t width = (len == 4U) ? Cmd_U16(&v[2]) : proc_base_width;
+    if (!CCD_Proc_SetBaseline(v[1], width)) {
+      return CCD_CMD_REJECTED;
+    }
+  }
+  CCD_BaselineStatus_t st;
+  CCD_Proc_GetBaseline(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+// A changed watchdog setting is written with the ADC stopped: a restart
+static uint8_t Cmd_Saturation(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  if (len != 2U && len != 4U) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  if (v[1] != CCD_TELEM_KEEP) {
+    uint8_t mode;
+    uint16_t level;
+    CCD_Acq_GetSaturation(&mode, &level);
+    uint16_t next = (len == 4U) ? Cmd_U16(&v[2]) : level;
+    if (!CCD_Acq_SetSaturation(v[1], next)) {
+      return CCD_CMD_REJECTED;
+    }
+    if (v[1] != mode || next != level) {
+      mode_update_pending = 1;
+    }
+  }
+  CCD_SatStatus_t st;
+  CCD_Acq_SatStatus(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+static uint8_t Cmd_Txn(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  if (len != ((v[1] == CCD_TXN_FORMAT) ? 4U : 2U)) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  uint8_t ok = 1;
+  if (v[1] == CCD_TXN_BEGIN) {
+    ok = CCD_Txn_Begin();
+  } else if (v[1] == CCD_TXN_COMMIT) {
+    ok = CCD_Txn_Commit();
+  } else if (v[1] == CCD_TXN_ABORT) {
+    ok = CCD_Txn_Abort();
+  } else if (v[1] == CCD_TXN_FORMAT) {
+    ok = CCD_Txn_Open() && CCD_Txn_SetFormat(v[2], v[3]);
+    if (!ok && CCD_Txn_Open()) {
+      CCD_Txn_Refuse();
+    }
+  } else if (v[1] != CCD_TELEM_KEEP) {
+    ok = 0;
+  }
+  if (!ok) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_TxnStatus_t st;
+  CCD_Txn_Status(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+// A test runs until its count, a stop or its timeout; a new one waits
+// for the buffers of the last to come back
+static uint8_t Cmd_Loop(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  uint8_t start = (v[1] <= CCD_LOOP_SOURCE);
+  if (len != (start ? 7U : 2U)) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  if (start) {
+    if (!CCD_Loop_Start(v[1], v[2], Cmd_U32(&v[3]))) {
+      return CCD_CMD_REJECTED;
+    }
+  } else if (v[1] == CCD_LOOP_STOP) {
+    CCD_Loop_Stop();
+  } else if (v[1] != CCD_TELEM_KEEP) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_LoopStatus_t st;
+  CCD_Loop_Status(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+#if CCD_REF_PD
+// Switching the photodiode on or off restarts ADC3 with the capture: a
+// restart. A new target or the other mode do without one.
+static uint8_t Cmd_Reference(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  if (len != 2U && len != 6U) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  if (v[1] != CCD_TELEM_KEEP) {
+    uint8_t mode;
+    uint32_t target;
+    CCD_Ref_Get(&mode, &target);
+    if (!CCD_Ref_Set(v[1], (len == 6U) ? Cmd_U32(&v[2]) : target)) {
+      return CCD_CMD_REJECTED;
+    }
+    if ((v[1] == CCD_REF_OFF) != (mode == CCD_REF_OFF)) {
+      mode_update_pending = 1;
+    }
+  }
+  CCD_RefStatus_t st;
+  CCD_Ref_Status(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+#endif
+
+#if CCD_LINE_SYNC
+// Phase takes effect at the next arm; other periods change TIM2's, with a
+// restart while the frames follow the line
+static uint8_t Cmd_Mains(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  uint8_t set = (v[1] == CCD_MAINS_SET);
+  if (len != (set ? 5U : 2U)) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  CCD_MainsStatus_t st;
+  if (set) {
+    CCD_Mains_Status(&st);
+    if (!CCD_Mains_Set(Cmd_U16(&v[2]), v[4])) {
+      return CCD_CMD_REJECTED;
+    }
+    if (st.active && v[4] != st.periods) {
+      mode_update_pending = 1;
+    }
+  } else if (v[1] != CCD_TELEM_KEEP) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_Mains_Status(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+#endif
+
+#if CCD_SHUTTER
+// The schedule restarts open on every CCD_SHUTTER_ON
+static uint8_t Cmd_Shutter(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  if (len != (v[1] == CCD_SHUTTER_ON ? 7U : 2U)) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+  if (v[1] != CCD_TELEM_KEEP &&
+      !CCD_Shutter_Set(v[1], Cmd_U16(&v[2]), v[4], v[5], v[6])) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_ShutterStatus_t st;
+  CCD_Shutter_Status(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+#endif
+
+// Up to 14 integration times per CCD_PTC_SET, from the level given
+static uint8_t Cmd_Ptc(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  uint8_t ok = 1;
+  if (v[1] == CCD_PTC_SET) {
+    uint32_t t[(CCD_CMD_VALUE_MAX - 3U) / sizeof(uint32_t)];
+    if (len < 3U || (len - 3U) % sizeof(uint32_t) != 0) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    uint32_t n = (len - 3U) / sizeof(uint32_t);
+    memcpy(t, &v[3], n * sizeof(uint32_t));
+    ok = CCD_Ptc_SetLevels(v[2], t, (uint8_t)n);
+  } else if (v[1] == CCD_PTC_START) {
+    if (len != 4U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    ok = CCD_Ptc_Start(Cmd_U16(&v[2]));
+  } else if (len != 2U) {
+    return CCD_CMD_BAD_LENGTH;
+  } else if (v[1] == CCD_PTC_STOP) {
+    CCD_Ptc_Stop();
+  } else if (v[1] != CCD_TELEM_KEEP) {
+    return CCD_CMD_REJECTED;
+  }
+  if (!ok) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_PtcStatus_t st;
+  CCD_Ptc_Status(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+// The reply carries the map bytes from the offset read, or from 0
+static uint8_t Cmd_Defect(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  uint8_t ok = 1;
+  uint32_t offset = 0;
+  if (v[1] == CCD_DEFECT_DETECT) {
+    if (len != 6U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    ok = CCD_Proc_DetectDefects(Cmd_U16(&v[2]), Cmd_U16(&v[4]));
+  } else if (v[1] == CCD_DEFECT_WRITE) {
+    if (len < 4U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    ok = CCD_Proc_WriteDefects(Cmd_U16(&v[2]), &v[4], len - 4U);
+  } else if (v[1] == CCD_DEFECT_READ) {
+    if (len != 4U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    offset = Cmd_U16(&v[2]);
+  } else if (len != 2U) {
+    return CCD_CMD_BAD_LENGTH;
+  } else if (v[1] == CCD_DEFECT_OFF || v[1] == CCD_DEFECT_ON) {
+    proc_defect_enable = v[1];
+  } else if (v[1] == CCD_DEFECT_SAVE) {
+    ok = CCD_Proc_SaveDefects();
+  } else if (v[1] == CCD_DEFECT_LOAD) {
+    ok = CCD_Proc_LoadDefects();
+  } else if (v[1] == CCD_DEFECT_CLEAR) {
+    CCD_Proc_ClearDefects();
+  } else if (v[1] != CCD_TELEM_KEEP) {
+    return CCD_CMD_REJECTED;
+  }
+  if (!ok) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_DefectStatus_t st;
+  CCD_Proc_GetDefects(offset, &st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+static uint8_t Cmd_Drift(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  uint8_t ok = 1;
+  if (v[1] == CCD_DRIFT_MODE) {
+    if (len != 4U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    if (v[2] > CCD_PROC_DRIFT_ONLY || v[3] > 1U) {
+      return CCD_CMD_REJECTED;
+    }
+    proc_drift = v[2];
+    proc_drift_correct = v[3];
+  } else if (v[1] == CCD_DRIFT_REF) {
+    if (len != 4U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    uint16_t frames = Cmd_U16(&v[2]);
+    if (frames == 0 || frames > CCD_PROC_DRIFT_REF_MAX) {
+      return CCD_CMD_REJECTED;
+    }
+    proc_drift_request = frames;
+  } else if (v[1] == CCD_DRIFT_BAND) {
+    if (len != 7U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    ok = CCD_Proc_SetDriftBand(Cmd_U16(&v[2]), Cmd_U16(&v[4]), v[6]);
+  } else if (len != 2U) {
+    return CCD_CMD_BAD_LENGTH;
+  } else if (v[1] != CCD_TELEM_KEEP) {
+    return CCD_CMD_REJECTED;
+  }
+  if (!ok) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_DriftStatus_t st;
+  CCD_Proc_GetDrift(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+// The reply carries the bins of the reference read, or none
+static uint8_t Cmd_Match(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  uint8_t ok = 1;
+  uint8_t index = CCD_MATCH_NONE;
+  uint16_t offset = 0;
+  if (v[1] == CCD_MATCH_MODE || v[1] == CCD_MATCH_CAPTURE ||
+      v[1] == CCD_MATCH_READ) {
+    if (len != 5U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    if (v[1] == CCD_MATCH_MODE) {
+      ok = CCD_Match_SetMode(v[2], Cmd_U16(&v[3]));
+    } else if (v[1] == CCD_MATCH_CAPTURE) {
+      ok = CCD_Match_Capture(v[2], Cmd_U16(&v[3]));
+    } else {
+      index = v[2];
+      offset = Cmd_U16(&v[3]);
+    }
+  } else if (v[1] == CCD_MATCH_WRITE) {
+    if (len < 5U || (len - 5U) % 2U != 0) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    ok = CCD_Match_Write(v[2], Cmd_U16(&v[3]), &v[5], (len - 5U) / 2U);
+  } else if (v[1] == CCD_MATCH_CLEAR) {
+    if (len != 3U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    ok = CCD_Match_Clear(v[2]);
+  } else if (len != 2U) {
+    return CCD_CMD_BAD_LENGTH;
+  } else if (v[1] == CCD_MATCH_SAVE) {
+    ok = CCD_Match_Save();
+  } else if (v[1] == CCD_MATCH_LOAD) {
+    ok = CCD_Match_Load();
+  } else if (v[1] != CCD_TELEM_KEEP) {
+    return CCD_CMD_REJECTED;
+  }
+  if (!ok) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_MatchStatus_t st;
+  CCD_Match_Status(index, offset, &st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+
+#if CCD_MODEL
+// The reply carries the loadings of the output read, or none
+static uint8_t Cmd_Model(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  uint8_t ok = 1;
+  uint8_t output = CCD_MODEL_NONE;
+  uint16_t first = 0;
+  if (v[1] == CCD_MODEL_MODE) {
+    if (len != 4U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    ok = CCD_Model_SetMode(v[2], v[3]);
+  } else if (v[1] == CCD_MODEL_WRITE) {
+    if (len < 5U || (len - 5U) % 2U != 0) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    ok = CCD_Model_Write(v[2], Cmd_U16(&v[3]), &v[5], (len - 5U) / 2U);
+  } else if (v[1] == CCD_MODEL_SCALE) {
+    if (len != 11U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    float scale;
+    float offset;
+    memcpy(&scale, &v[3], sizeof(scale));
+    memcpy(&offset, &v[7], sizeof(offset));
+    ok = CCD_Model_Scale(v[2], scale, offset);
+    output = v[2];
+  } else if (v[1] == CCD_MODEL_READ) {
+    if (len != 5U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    output = v[2];
+    first = Cmd_U16(&v[3]);
+  } else if (v[1] == CCD_MODEL_CLEAR) {
+    if (len != 3U) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+    ok = CCD_Model_Clear(v[2]);
+  } else if (len != 2U) {
+    return CCD_CMD_BAD_LENGTH;
+  } else if (v[1] == CCD_MODEL_SAVE) {
+    ok = CCD_Model_Save();
+  } else if (v[1] == CCD_MODEL_LOAD) {
+    ok = CCD_Model_Load();
+  } else if (v[1] != CCD_TELEM_KEEP) {
+    return CCD_CMD_REJECTED;
+  }
+  if (!ok) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_ModelStatus_t st;
+  CCD_Model_Status(output, first, &st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return CCD_CMD_OK;
+}
+#endif
+
+static uint8_t Cmd_Telemetry(const uint8_t *v, uint8_t len, Cmd_Ack_t *ack) {
+  if (v[0] == CCD_TELEM_BANDS) {
+    return Cmd_Bands(v, len, ack);
+  } else if (v[0] == CCD_TELEM_FOCUS) {
+    return Cmd_Focus(v, len, ack);
+  } else if (v[0] == CCD_TELEM_AUTOROI) {
+    return Cmd_AutoRoi(v, len, ack);
+  } else if (v[0] == CCD_TELEM_DESPIKE) {
+    return Cmd_Despike(v, len, ack);
+  } else if (v[0] == CCD_TELEM_BASELINE) {
+    return Cmd_Baseline(v, len, ack);
+  } else if (v[0] == CCD_TELEM_PTC) {
+    return Cmd_Ptc(v, len, ack);
+  } else if (v[0] == CCD_TELEM_DEFECT) {
+    return Cmd_Defect(v, len, ack);
+  } else if (v[0] == CCD_TELEM_DRIFT) {
+    return Cmd_Drift(v, len, ack);
+  } else if (v[0] == CCD_TELEM_MATCH) {
+    return Cmd_Match(v, len, ack);
+  } else if (v[0] == CCD_TELEM_SATURATION) {
+    return Cmd_Saturation(v, len, ack);
+  } else if (v[0] == CCD_TELEM_TXN) {
+    return Cmd_Txn(v, len, ack);
+  } else if (v[0] == CCD_TELEM_LOOP) {
+    return Cmd_Loop(v, len, ack);
+#if CCD_REF_PD
+  } else if (v[0] == CCD_TELEM_REFERENCE) {
+    return Cmd_Reference(v, len, ack);
+#endif
+#if CCD_LINE_SYNC
+  } else if (v[0] == CCD_TELEM_MAINS) {
+    return Cmd_Mains(v, len, ack);
+#endif
+#if CCD_SHUTTER
+  } else if (v[0] == CCD_TELEM_SHUTTER) {
+    return Cmd_Shutter(v, len, ack);
+#endif
+#if CCD_MODEL
+  } else if (v[0] == CCD_TELEM_MODEL) {
+    return Cmd_Model(v, len, ack);
+#endif
+  } else if (len != 2U) {
+    return CCD_CMD_BAD_LENGTH;
+  } else if (v[0] == CCD_TELEM_LATENCY) {
+    CCD_LatReport_t lat;
+    CCD_Lat_Read(&lat, v[1]);
+    memcpy(ack->payload, &lat, sizeof(lat));
+    ack->hdr.len = sizeof(lat);
+  } else if (v[0] == CCD_TELEM_FAULTS) {
+    if (v[1] != CCD_TELEM_KEEP) {
+      CCD_Fault_SetPeriod(v[1] * 100U);
+    }
+    CCD_FaultReport_t faults;
+    CCD_Fault_Read(&faults);
+    memcpy(ack->payload, &faults, sizeof(faults));
+    ack->hdr.len = sizeof(faults);
+  } else if (v[0] == CCD_TELEM_KERNEL) {
+    CCD_ProcBench_t bench;
+    if (!CCD_Proc_Bench(v[1], &bench)) {
+      return CCD_CMD_REJECTED;
+    }
+    memcpy(ack->payload, &bench, sizeof(bench));
+    ack->hdr.len = sizeof(bench);
+  } else if (v[0] == CCD_TELEM_ADCCAL) {
+    CCD_AdcCalStatus_t cal;
+    CCD_AdcCal_Read(&cal, v[1]);
+    memcpy(ack->payload, &cal, sizeof(cal));
+    ack->hdr.len = sizeof(cal);
+  } else if (v[0] == CCD_TELEM_PREVIEW || v[0] == CCD_TELEM_PREVIEW_BIN) {
+    if (v[1] != CCD_TELEM_KEEP &&
+        !(v[0] == CCD_TELEM_PREVIEW ? CCD_Preview_SetRate(v[1])
+                                    : CCD_Preview_SetBin(v[1]))) {
+      return CCD_CMD_REJECTED;
+    }
+    CCD_PreviewStatus_t st;
+    CCD_Preview_Status(&st);
+    memcpy(ack->payload, &st, sizeof(st));
+    ack->hdr.len = sizeof(st);
+  } else if (v[0] == CCD_TELEM_EXPOSE) {
+    if (v[1] == 1U) {
+      CCD_Snap_Abort();
+    }
+    CCD_ExposeStatus_t st;
+    CCD_Snap_ExposeStatus(&st);
+    memcpy(ack->payload, &st, sizeof(st));
+    ack->hdr.len = sizeof(st);
+  } else if (v[0] == CCD_TELEM_WIDE) {
+    if (v[1] != CCD_TELEM_KEEP) {
+      if (v[1] > CCD_PROC_WIDE_FLOAT) {
+        return CCD_CMD_REJECTED;
+      }
+      proc_wide = v[1];
+    }
+    CCD_WideStatus_t st;
+    CCD_Proc_GetWide(&st);
+    memcpy(ack->payload, &st, sizeof(st));
+    ack->hdr.len = sizeof(st);
+  } else if (v[0] == CCD_TELEM_MEMORY) {
+    if (v[1] != CCD_TELEM_KEEP && v[1] != CCD_MEM_CLEAR) {
+      return CCD_CMD_REJECTED;
+    }
+    CCD_MemStatus_t st;
+    CCD_Mem_Status(&st, v[1] == CCD_MEM_CLEAR);
+    memcpy(ack->payload, &st, sizeof(st));
+    ack->hdr.len = sizeof(st);
+#if CCD_ENCODER
+  } else if (v[0] == CCD_TELEM_LINE) {
+    CCD_LineStatus_t st;
+    CCD_Line_Status(&st);
+    memcpy(ack->payload, &st, sizeof(st));
+    ack->hdr.len = sizeof(st);
+#endif
+#if CCD_DIN
+  } else if (v[0] == CCD_TELEM_INPUTS) {
+    if (v[1] != CCD_TELEM_KEEP && !CCD_Din_SetEdge(v[1])) {
+      return CCD_CMD_REJECTED;
+    }
+    CCD_DinStatus_t st;
+    CCD_Din_Status(&st);
+    memcpy(ack->payload, &st, sizeof(st));
+    ack->hdr.len = sizeof(st);
+#endif
+#if CCD_JPEG
+  } else if (v[0] == CCD_TELEM_JPEG) {
+    if (v[1] != CCD_TELEM_KEEP && !CCD_Jpeg_SetQuality(v[1])) {
+      return CCD_CMD_REJECTED;
+    }
+    CCD_JpegStatus_t st;
+    CCD_Jpeg_Status(&st);
+    memcpy(ack->payload, &st, sizeof(st));
+    ack->hdr.len = sizeof(st);
+#endif
+  } else if (v[0] == CCD_TELEM_SELFTEST) {
+    if (v[1] != CCD_TELEM_KEEP && !CCD_Selftest_Set(v[1])) {
+      return CCD_CMD_REJECTED;
+    }
+    CCD_SelftestStatus_t st;
+    CCD_Selftest_Status(&st);
+    memcpy(ack->payload, &st, sizeof(st));
+    ack->hdr.len = sizeof(st);
+  } else {
+    return CCD_CMD_REJECTED;
+  }
+  return CCD_CMD_OK;
+}
+
+static uint8_t Cmd_Info(Cmd_Ack_t *ack) {
+  CCD_CmdInfo_t info = {
+      .protocol = CCD_CMD_PROTOCOL,
+      .pixels = CCD_BUFFER_SIZE,
+      .build = (CCD_CACHE_ENABLE ? CCD_CMD_BUILD_CACHE : 0) |
+               (CCD_USB_VENDOR ? CCD_CMD_BUILD_VENDOR : 0) |
+               (CCD_USB_ULPI ? CCD_CMD_BUILD_ULPI : 0) |
+               (CCD_USB_HS_DMA ? CCD_CMD_BUILD_HS_DMA : 0) |
+               (CCD_ETH ? CCD_CMD_BUILD_ETH : 0) |
+               (CCD_SD ? CCD_CMD_BUILD_SD : 0) |
+               (CCD_BURST_PSRAM ? CCD_CMD_BUILD_PSRAM : 0) |
+               (CCD_EXT_ADC ? CCD_CMD_BUILD_EXT_ADC : 0) |
+               (CCD_ITM_TRACE ? CCD_CMD_BUILD_TRACE : 0) |
+               (CCD_TEMP_NTC ? CCD_CMD_BUILD_NTC : 0) |
+               (CCD_ENCODER ? CCD_CMD_BUILD_ENCODER : 0) |
+               (CCD_JPEG ? CCD_CMD_BUILD_JPEG : 0) |
+               (CCD_REF_PD ? CCD_CMD_BUILD_REF : 0) |
+               (CCD_DIN ? CCD_CMD_BUILD_DIN : 0) |
+               (CCD_USB_ISO ? CCD_CMD_BUILD_ISO : 0) |
+               (CCD_LINE_SYNC ? CCD_CMD_BUILD_MAINS : 0) |
+               (CCD_SHUTTER ? CCD_CMD_BUILD_SHUTTER : 0) |
+               (CCD_MODEL ? CCD_CMD_BUILD_MODEL : 0),
+      .clock_hz = CCD_TIME_HZ,
+      .ring_slots = FRAME_RING_SLOTS,
+      .tx_last = CCD_TX_LAST,
+      .value_max = CCD_CMD_VALUE_MAX,
+      .formats = CCD_CMD_FMT_RAW | CCD_CMD_FMT_SHAPED | CCD_CMD_FMT_PACKED |
+                 CCD_CMD_FMT_RICE | CCD_CMD_FMT_TEMPORAL | CCD_CMD_FMT_WIDE |
+                 CCD_CMD_FMT_HDR | CCD_CMD_FMT_STATS | CCD_CMD_FMT_PEAKS |
+                 CCD_CMD_FMT_BANDS | CCD_CMD_FMT_DRIFT | CCD_CMD_FMT_MATCH |
+                 CCD_CMD_FMT_PTC | CCD_CMD_FMT_BURST |
+                 (CCD_ENCODER ? CCD_CMD_FMT_LINE : 0) |
+                 (CCD_JPEG ? CCD_CMD_FMT_JPEG : 0) |
+                 (CCD_DUAL_SENSOR ? CCD_CMD_FMT_DUAL : 0) |
+                 (CCD_SHUTTER ? CCD_CMD_FMT_DARK : 0) |
+                 (CCD_MODEL ? CCD_CMD_FMT_MODEL : 0),
+      .burst_frames = CCD_BURST_FRAMES,
+      .frame_bytes = sizeof(CCD_Frame_t),
+      .sinks = CCD_CMD_SINK_USB_FS | CCD_CMD_SINK_USB_HS |
+               (CCD_USB_ULPI ? CCD_CMD_SINK_HS_480 : 0) |
+               (CCD_ETH ? CCD_CMD_SINK_ETH : 0) |
+               (CCD_SD ? CCD_CMD_SINK_SD : 0) |
+               (CCD_BURST_PSRAM ? CCD_CMD_SINK_PSRAM : 0),
+      .timing = CCD_TIMING_PROFILE,
+      .profiles = CCD_LN_COUNT,
+      .fm_hz = CCD_FM_HZ,
+      .frame_us = CCD_ICG_TICKS / CCD_TICKS_PER_US,
+      .sensor = CCD_SENSOR,
+      .sensor_flags = (CCD_SENSOR_SHUTTER ? CCD_CMD_SENSOR_SHUTTER : 0) |
+                      (CCD_SENSOR_RISES ? CCD_CMD_SENSOR_RISES : 0),
+      .shield_start = CCD_SENSOR_SHIELD_START,
+      .shield_count = CCD_SENSOR_SHIELD_COUNT,
+      .active_start = CCD_SENSOR_ACTIVE_START,
+      .active_count = CCD_SENSOR_ACTIVE_COUNT,
+  };
+  for (uint32_t i = 0; i < sizeof(value_len); i++) {
+    if (value_len[i] != 0) {
+      info.commands |= 1UL << i;
+    }
+  }
+  memcpy(ack->payload, &info, sizeof(info));
+  ack->hdr.len = sizeof(info);
+  return CCD_CMD_OK;
+}
+
+#if CCD_SD
+// Every action answers with the status after it
+static uint8_t Cmd_Record(uint8_t action, Cmd_Ack_t *ack) {
+  uint8_t ok = 1;
+  if (action == CCD_REC_CMD_START) {
+    ok = CCD_Rec_Start();
+  } else if (action == CCD_REC_CMD_STOP) {
+    CCD_Rec_Stop();
+  } else if (action != CCD_REC_CMD_STATUS) {
+    return CCD_CMD_REJECTED;
+  }
+  CCD_RecStatus_t st;
+  CCD_Rec_Status(&st);
+  memcpy(ack->payload, &st, sizeof(st));
+  ack->hdr.len = sizeof(st);
+  return ok ? CCD_CMD_OK : CCD_CMD_REJECTED;
+}
+#endif
+
+// The same checks as the ASCII commands
+static uint8_t Cmd_Run(uint8_t type, const uint8_t *v, uint8_t len,
+                       Cmd_Ack_t *ack) {
+  if (type == CCD_CMD_ROI) {
+    if ((len % sizeof(CCD_RoiWindow_t)) != 0) {
+      return CCD_CMD_BAD_LENGTH;
+    }
+  } else if (type == CCD_CMD_TELEMETRY) {
+    if (len < 2U) {
+      return CCD_CMD_BAD_LENGTH; // Cmd_Telemetry() checks the rest
+    }
+  } else if (type >= sizeof(value_len) || value_len[type] == 0) {
+    return CCD_CMD_UNKNOWN;
+  } else if (len + 1U != value_len[type]) {
+    return CCD_CMD_BAD_LENGTH;
+  }
+
+  uint32_t n;
+  switch (type) {
+  case CCD_CMD_PING:
+    return CCD_CMD_OK;
+  case CCD_CMD_MODE:
+    if (v[0] > CCD_MODE_EXT_TRIGGER) {
+      return CCD_CMD_REJECTED;
+    }
+    ccd_mode = v[0];
+    mode_update_pending = 1;
+    return CCD_CMD_OK;
+  case CCD_CMD_EXPOSURE:
+    if (CCD_Txn_Open()) {
+      return CCD_Txn_SetExposure(Cmd_U32(v), Cmd_U32(v + 4))
+                 ? CCD_CMD_OK
+                 : CCD_CMD_REJECTED;
+    }
+    return CCD_Acq_SetExposure(Cmd_U32(v), Cmd_U32(v + 4)) ? CCD_CMD_OK
+                                                            : CCD_CMD_REJECTED;
+  case CCD_CMD_INTEGRATION:
+    if (CCD_Txn_Open()) {
+      CCD_Txn_SetIntegration(Cmd_U32(v)); // Reachable is for the commit
+      return CCD_CMD_OK;
+    }
+    return CCD_Acq_SetIntegration(Cmd_U32(v)) ? CCD_CMD_OK : CCD_CMD_REJECTED;
+  case CCD_CMD_ROI: {
+    CCD_RoiWindow_t w[CCD_PROC_ROI_MAX];
+    n = len / sizeof(CCD_RoiWindow_t);
+    if (n > CCD_PROC_ROI_MAX) {
+      return CCD_CMD_REJECTED;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      w[i].start = Cmd_U16(v + 4 * i);
+      w[i].len = Cmd_U16(v + 4 * i + 2);
+    }
+    if (CCD_Txn_Open()) {
+      return CCD_Txn_SetRoi(w, (uint8_t)n) ? CCD_CMD_OK : CCD_CMD_REJECTED;
+    }
+    return CCD_Proc_SetRoi(w, (uint8_t)n) ? CCD_CMD_OK : CCD_CMD_REJECTED;
+  }
+  case CCD_CMD_BINNING:
+    if (v[0] != 1 && v[0] != 2 && v[0] != 4 && v[0] != 8) {
+      return CCD_CMD_REJECTED;
+    }
+    if (CCD_Txn_Open()) {
+      CCD_Txn_SetBin(v[0]);
+    } else {
+      proc_bin = v[0];
+    }
+    return CCD_CMD_OK;
+  case CCD_CMD_COADD:
+    n = Cmd_U16(v);
+    if (n < 1 || n > CCD_PROC_COADD_MAX) {
+      return CCD_CMD_REJECTED;
+    }
+    if (CCD_Txn_Open()) {
+      CCD_Txn_SetCoadd((uint16_t)n);
+    } else {
+      proc_coadd_n = (uint16_t)n;
+    }
+    return CCD_CMD_OK;
+  case CCD_CMD_ROLLING:
+    n = Cmd_U16(v);
+    if (n < 1 || n > CCD_PROC_ROLLING_MAX) {
+      return CCD_CMD_REJECTED;
+    }
+    if (CCD_Txn_Open()) {
+      CCD_Txn_SetRolling((uint16_t)n);
+    } else {
+      proc_rolling_n = (uint16_t)n;
+    }
+    return CCD_CMD_OK;
+  case CCD_CMD_TRIGGER:
+    if (v[0] == CCD_CMD_TRIG_SNAP && ccd_mode == CCD_MODE_ONESHOT) {
+      CCD_Snap_Fire();
+    } else if (v[0] == CCD_CMD_TRIG_BURST) {
+      CCD_Burst_Trigger();
+    } else if (v[0] == CCD_CMD_TRIG_SEQ) {
+      CCD_Seq_Trigger();
+    } else {
+      return CCD_CMD_REJECTED;
+    }
+    return CCD_CMD_OK;
+  case CCD_CMD_TRANSPORT:
+    if (v[0] > CCD_TX_LAST) {
+      return CCD_CMD_REJECTED;
+    }
+    tx_mode = v[0];
+    return CCD_CMD_OK;
+  case CCD_CMD_CONFIG:
+    return Cmd_Config(v, ack);
+  case CCD_CMD_DARK_TEMP:
+    return Cmd_DarkTemp(v, ack);
+  case CCD_CMD_BLACK:
+    return Cmd_Black(v[0], ack);
+  case CCD_CMD_STATS:
+    return Cmd_Stats(ack);
+  case CCD_CMD_TIME:
+    return Cmd_Time(ack->hdr.seq, ack);
+  case CCD_CMD_FLOW:
+    return CCD_Flow_SetPolicy(v[0]) ? CCD_CMD_OK : CCD_CMD_REJECTED;
+  case CCD_CMD_CREDIT:
+    CCD_Flow_Grant(Cmd_U32(v));
+    return CCD_CMD_OK;
+  case CCD_CMD_INFO:
+    return Cmd_Info(ack);
+#if CCD_SD
+  case CCD_CMD_RECORD:
+    return Cmd_Record(v[0], ack);
+#endif
+  case CCD_CMD_PROFILE:
+    return Cmd_Profile(ack);
+  case CCD_CMD_FRAME_STATS:
+    if (v[0] > CCD_PROC_STATS_ONLY) {
+      return CCD_CMD_REJECTED;
+    }
+    proc_stats_level = Cmd_U16(&v[1]);
+    proc_stats = v[0];
+    return CCD_CMD_OK;
+  case CCD_CMD_PEAKS:
+    if (v[0] > CCD_PROC_PEAKS_ONLY || v[1] > CCD_PROC_FIT_GAUSS ||
+        Cmd_U16(&v[4]) == 0) {
+      return CCD_CMD_REJECTED;
+    }
+    proc_peak_fit = v[1];
+    proc_peak_threshold = Cmd_U16(&v[2]);
+    proc_peak_distance = Cmd_U16(&v[4]);
+    proc_peaks = v[0];
+    return CCD_CMD_OK;
+  case CCD_CMD_SMOOTH:
+    if (v[0] != 0 && !CCD_Proc_SmoothValid(v[0], v[1])) {
+      return CCD_CMD_REJECTED;
+    }
+    proc_smooth_window = 0; // The stage never sees a half-set pair
+    proc_smooth_order = v[1];
+    proc_smooth_window = v[0];
+    return CCD_CMD_OK;
+  case CCD_CMD_WAVELENGTH:
+    return Cmd_Wavelength(v, ack);
+  case CCD_CMD_ABSORBANCE:
+    return Cmd_Absorbance(v, ack);
+  case CCD_CMD_LINEARITY:
+    return Cmd_Linearity(v, ack);
+  case CCD_CMD_BENCH:
+    return Cmd_Bench(v, ack);
+  case CCD_CMD_PROBE:
+    return Cmd_Probe(v, ack);
+  case CCD_CMD_TELEMETRY:
+    return Cmd_Telemetry(v, len, ack);
+  default:
+    return CCD_CMD_UNKNOWN;
+  }
+}
+
+static void Cmd_Execute(const uint8_t *f, Cmd_Ack_t *ack) {
+  uint8_t len = f[3];
+  uint8_t check = 0xFF; // One's complement of the sum
+  for (uint32_t i = 1; i < CMD_HEADER + len; i++) {
+    check -= f[i];
+  }
+  ack->hdr.magic = CCD_CMD_ACK_MAGIC;
+  ack->hdr.seq = f[1];
+  ack->hdr.type = f[2];
+  ack->hdr.len = 0;
+  uint8_t status = (check == f[CMD_HEADER + len])
+                       ? Cmd_Run(f[2], &f[CMD_HEADER], len, ack)
+                       : CCD_CMD_BAD_CHECK;
+  ack->hdr.status = status;
+  if (status != CCD_CMD_OK && CCD_Txn_Open() && f[2] >= CCD_CMD_EXPOSURE &&
+      f[2] <= CCD_CMD_ROLLING) {
+    CCD_Txn_Refuse(); // The rest staged must not go in without it
+  }
+  if (status == CCD_CMD_OK) {
+    cmd_count++;
+  } else {
+    cmd_errors++;
+  }
+}
+
+// USB interrupt, once the host has taken the ack
+static void Cmd_AckSent(void *ctx, uint32_t len) {
+  Cmd_Ack_t *ack = ctx;
+  if (ack->hdr.type == CCD_CMD_TIME && ack->hdr.status == CCD_CMD_OK) {
+    time_sent = CCD_Time_Now();
+    time_sent_seq = ack->hdr.seq;
+  }
+  cmd_ack_busy[ack - cmd_ack] = 0;
+}
+
+static Cmd_Ack_t *Cmd_AckBuf(void) {
+  for (uint32_t b = 0; b < CMD_ACK_BUFS; b++) {
+    if (!cmd_ack_busy[b]) {
+      return &cmd_ack[b];
+    }
+  }
+  return NULL;
+}
+
+// Every frame in the ring, in order, as long as its ack can be queued.
+// Otherwise the rest wait for the next pass, and the host for its acks.
+void CCD_Cmd_Poll(void) {
+  uint32_t head = rx_head;
+  uint32_t tail = rx_tail;
+  while (tail != head) {
+    Cmd_Ack_t *ack = Cmd_AckBuf();
+    if (ack == NULL || UsbTx_Space(&usb_tx_fs) == 0) {
+      break;
+    }
+    uint8_t f[CMD_FRAME_MAX];
+    uint32_t n = CMD_HEADER + cmd_rx[(tail + 3U) & CMD_RX_MASK] + 1U;
+    for (uint32_t i = 0; i < n; i++) {
+      f[i] = cmd_rx[(tail + i) & CMD_RX_MASK];
+    }
+    tail += n;
+    Cmd_Execute(f, ack);
+    cmd_ack_busy[ack - cmd_ack] = 1;
+    UsbTx_Submit(&usb_tx_fs, (const uint8_t *)ack,
+                 sizeof(CCD_CmdAck_t) + ack->hdr.len, Cmd_AckSent, ack);
+  }
+  rx_tail = tail;
+
+  if (rx_stalled && Cmd_RxFree() >= CDC_DATA_FS_MAX_PACKET_SIZE) {
+    rx_stalled = 0;
+    CDC_ResumeRx_FS();
+  }
+}
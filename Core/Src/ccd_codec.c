@@ -0,0 +1,196 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_codec.c
+ * @brief          : Binning, packing and Rice kernels of the shaped frames
+ ******************************************************************************
+ */
+
+#include "ccd_codec.h"
+#include <string.h>
+
+// Two adjacent pixels as one 32-bit load (pixel i in the low half)
+static inline uint32_t Codec_Load2(const uint16_t *p) {
+  uint32_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+// ========== BINNING ==========
+
+// Mean of each run of 2^shift adjacent pixels, rounded. The mean keeps the
+// 16-bit pixel scale and wire polarity; the bits dropped are below the ADC
+// noise once the pixels are combined. Pairs are summed from one word load
+// each. Forced inline into one kernel per bin factor, so that with shift a
+// constant the inner loop unrolls into its word loads and the divide is a
+// shift: the C counterpart of a template over the bin factor.
+__STATIC_FORCEINLINE uint32_t Codec_BinRuns(uint16_t *out, const uint16_t *in,
+                                            uint32_t count, uint32_t shift) {
+  uint32_t b = 1U << shift;
+  uint32_t n = count >> shift;
+  for (uint32_t j = 0; j < n; j++) {
+    const uint16_t *p = &in[j << shift];
+    uint32_t sum = b / 2U;
+    for (uint32_t i = 0; i < b; i += 2) {
+      uint32_t w = Codec_Load2(&p[i]);
+      sum += (w & 0xFFFFU) + (w >> 16);
+    }
+    out[j] = (uint16_t)(sum >> shift);
+  }
+  return n;
+}
+
+CCD_CODEC_ITCM static uint32_t Codec_Bin1(uint16_t *out,
+                                          const uint16_t *in, uint32_t count) {
+  memcpy(out, in, count * sizeof(uint16_t));
+  return count;
+}
+
+CCD_CODEC_ITCM static uint32_t Codec_Bin2(uint16_t *out,
+                                          const uint16_t *in, uint32_t count) {
+  return Codec_BinRuns(out, in, count, 1U);
+}
+
+CCD_CODEC_ITCM static uint32_t Codec_Bin4(uint16_t *out,
+                                          const uint16_t *in, uint32_t count) {
+  return Codec_BinRuns(out, in, count, 2U);
+}
+
+CCD_CODEC_ITCM static uint32_t Codec_Bin8(uint16_t *out,
+                                          const uint16_t *in, uint32_t count) {
+  return Codec_BinRuns(out, in, count, 3U);
+}
+
+// By log2 of the bin factor
+static const CCD_Codec_BinKernel_t codec_bin_kernels[] = {
+    Codec_Bin1, Codec_Bin2, Codec_Bin4, Codec_Bin8};
+
+// b = 1, 2, 4 or 8, as the commands setting it allow
+CCD_Codec_BinKernel_t CCD_Codec_BinKernel(uint32_t b) {
+  return codec_bin_kernels[__builtin_ctz(b) & 3U];
+}
+
+// ========== PACKING AND RICE ==========
+
+// Keep the top 12 bits of each pixel, two pixels per 24-bit group:
+// p0 | p1 << 12, little-endian. One word load per group.
+CCD_CODEC_ITCM uint32_t CCD_Codec_Pack12(uint8_t *dst, const uint16_t *px,
+                                         uint32_t count) {
+  uint8_t *out = dst;
+  for (uint32_t i = 0; i < count; i += 2) {
+    uint32_t w = Codec_Load2(&px[i]);
+    if (i + 1 >= count) {
+      w &= 0xFFFFU; // Odd tail: pad with a zero pixel
+    }
+    uint32_t v = ((w & 0xFFFFU) >> 4) | ((w >> 20) << 12);
+    out[0] = (uint8_t)v;
+    out[1] = (uint8_t)(v >> 8);
+    out[2] = (uint8_t)(v >> 16);
+    out += 3;
+  }
+  return (uint32_t)(out - dst);
+}
+
+// Keep the top 14 bits, four pixels per 56-bit group:
+// p0 | p1 << 14 | p2 << 28 | p3 << 42, little-endian
+CCD_CODEC_ITCM uint32_t CCD_Codec_Pack14(uint8_t *dst, const uint16_t *px,
+                                         uint32_t count) {
+  uint8_t *out = dst;
+  for (uint32_t i = 0; i < count; i += 4) {
+    uint64_t v = 0;
+    for (uint32_t k = 0; k < 4 && i + k < count; k++) {
+      v |= (uint64_t)(px[i + k] >> 2) << (14U * k);
+    }
+    uint32_t lo = (uint32_t)v;
+    uint32_t hi = (uint32_t)(v >> 32);
+    memcpy(out, &lo, 4);
+    out[4] = (uint8_t)hi;
+    out[5] = (uint8_t)(hi >> 8);
+    out[6] = (uint8_t)(hi >> 16);
+    out += 7;
+  }
+  return (uint32_t)(out - dst);
+}
+
+// MSB-first bit writer for the Rice stream. n <= 24 keeps acc within 32 bits.
+typedef struct {
+  uint8_t *out;
+  uint8_t *end;
+  uint32_t acc;
+  uint32_t nbits;
+} Codec_Bits_t;
+
+static inline void Codec_Put(Codec_Bits_t *bw, uint32_t v, uint32_t n) {
+  bw->acc = (bw->acc << n) | v;
+  bw->nbits += n;
+  while (bw->nbits >= 8) {
+    bw->nbits -= 8;
+    if (bw->out < bw->end) {
+      *bw->out = (uint8_t)(bw->acc >> bw->nbits);
+    }
+    bw->out++; // Past end = over budget, checked by the caller
+  }
+}
+
+// Lossless delta + Rice coding of count values at bits depth (the top bits
+// of each pixel, as in packing). Deltas are to the previous pixel, or with a
+// ref to the same pixel of the reference frame. Each block of
+// CCD_PROC_RICE_BLOCK zigzagged deltas u gets k ~ log2(mean u) and codes
+// every u as (u >> k) one bits, a zero, then the k low bits. A block that
+// would not shrink is stored verbatim instead, so no block costs more than
+// 5 bits over its packed size. Returns the bytes written, or 0 if the stream
+// would not fit in limit bytes (the caller then sends the frame plain).
+CCD_CODEC_ITCM uint32_t CCD_Codec_RiceEncode(uint8_t *dst, uint32_t limit,
+                                             const uint16_t *px,
+                                             const uint16_t *ref,
+                                             uint32_t count, uint8_t bits) {
+  Codec_Bits_t bw = {dst, dst + limit, 0, 0};
+  uint32_t shift = 16U - bits;
+  int32_t prev = 0;
+  for (uint32_t i = 0; i < count; i += CCD_PROC_RICE_BLOCK) {
+    uint32_t n = count - i;
+    if (n > CCD_PROC_RICE_BLOCK) {
+      n = CCD_PROC_RICE_BLOCK;
+    }
+    uint32_t u[CCD_PROC_RICE_BLOCK];
+    uint32_t sum = 0;
+    for (uint32_t j = 0; j < n; j++) {
+      int32_t v = px[i + j] >> shift;
+      int32_t d = v - (ref ? ref[i + j] : prev);
+      prev = v;
+      u[j] = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+      sum += u[j];
+    }
+    uint32_t mean = sum / n;
+    uint32_t k = mean ? 31U - __CLZ(mean) : 0U;
+    uint32_t cost = n * (k + 1U);
+    for (uint32_t j = 0; j < n; j++) {
+      cost += u[j] >> k;
+    }
+
+    if (cost >= n * bits) {
+      Codec_Put(&bw, CCD_PROC_RICE_ESCAPE, 5);
+      for (uint32_t j = 0; j < n; j++) {
+        Codec_Put(&bw, px[i + j] >> shift, bits);
+      }
+    } else {
+      Codec_Put(&bw, k, 5);
+      for (uint32_t j = 0; j < n; j++) {
+        uint32_t q = u[j] >> k;
+        for (; q >= 24U; q -= 24U) {
+          Codec_Put(&bw, 0xFFFFFFU, 24);
+        }
+        Codec_Put(&bw, ((1U << q) - 1U) << 1, q + 1U);
+        if (k != 0) {
+          Codec_Put(&bw, u[j] & ((1U << k) - 1U), k);
+        }
+      }
+    }
+    if (bw.out > bw.end) {
+      return 0;
+    }
+  }
+  if (bw.nbits > 0) {
+    Codec_Put(&bw, 0, 8U - bw.nbits); // Zero-pad the last byte
+  }
+  return (bw.out <= bw.end) ? (uint32_t)(bw.out - dst) : 0;
+}
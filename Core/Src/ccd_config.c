@@ -0,0 +1,310 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_config.c
+ * @brief          : Settings kept in flash, restored at boot
+ ******************************************************************************
+ */
+
+#include "ccd_config.h"
+#include "ccd_acq.h"
+#include "ccd_adccal.h"
+#include "ccd_bench.h"
+#include "ccd_match.h"
+#include "ccd_phase.h"
+#include "ccd_ptc.h"
+#include "ccd_ref.h"
+#include "ccd_seq.h"
+#include "ccd_store.h"
+#include <string.h>
+
+#define CONFIG_BOOT_UNKNOWN 0
+#define CONFIG_BOOT_COLD 1
+#define CONFIG_BOOT_WARM 2
+
+static uint8_t cfg_boot; // CONFIG_BOOT_*, from RCC_RSR on first use
+static uint8_t cfg_restored;
+static uint8_t cfg_auto = 1;
+static uint32_t cfg_saves;
+static uint32_t cfg_due;     // Next comparison
+static uint32_t cfg_changed; // Tick the pending settings were first seen
+static CCD_Config_t cfg_saved;   // In flash (or the boot defaults)
+static CCD_Config_t cfg_pending; // Last capture
+
+// The reset flags are read once and cleared, so the next boot sees only
+// its own cause
+static uint8_t Config_WarmBoot(void) {
+  if (cfg_boot == CONFIG_BOOT_UNKNOWN) {
+    uint32_t rsr = RCC->RSR;
+    cfg_boot = (rsr & (RCC_RSR_PORRSTF | RCC_RSR_BORRSTF)) ? CONFIG_BOOT_COLD
+                                                          : CONFIG_BOOT_WARM;
+    RCC->RSR |= RCC_RSR_RMVF;
+  }
+  return cfg_boot == CONFIG_BOOT_WARM;
+}
+
+// ========== SETTINGS ==========
+
+// The auto-exposure loop moves the exposure every frame; while it runs the
+// saved one is kept, for the loop to start again from
+static void Config_Capture(CCD_Config_t *c) {
+  uint32_t period = cfg_saved.sh_period_us;
+  uint32_t pulse = cfg_saved.sh_pulse_us;
+  CCD_AESettings_t ae;
+  CCD_AE_GetSettings(&ae);
+  if (!ae.enabled) {
+    CCD_Acq_GetExposure(&period, &pulse);
+  }
+  memset(c, 0, sizeof(*c));
+  c->version = CCD_CONFIG_VERSION;
+  c->auto_save = cfg_auto;
+  c->ccd_mode = ccd_mode;
+  c->tx_mode = tx_mode;
+  c->acq_mode = acq_mode;
+  c->sync_mode = sync_mode;
+  c->adc_samples = acq_adc_samples;
+  c->cds = acq_cds;
+  c->noise_profile = acq_noise_profile;
+  c->source = acq_source;
+  c->bin = proc_bin;
+  c->bits = proc_bits;
+  c->codec = proc_codec;
+  c->flat_enable = proc_flat_enable;
+  c->lin_enable = proc_lin_enable;
+  c->black_enable = proc_black_enable;
+  c->smooth_window = proc_smooth_window;
+  c->smooth_order = proc_smooth_order;
+  c->stats = proc_stats;
+  c->peaks = proc_peaks;
+  c->peak_fit = proc_peak_fit;
+  c->stats_level = proc_stats_level;
+  c->peak_threshold = proc_peak_threshold;
+  c->peak_distance = proc_peak_distance;
+  c->coadd_n = proc_coadd_n;
+  c->rolling_n = proc_rolling_n;
+  c->event_threshold = proc_event_threshold;
+  c->heartbeat_ms = proc_heartbeat_ms;
+  CCD_Acq_GetStrobe(&c->strobe_delay_us, &c->strobe_width_us);
+  c->sh_period_us = period;
+  c->sh_pulse_us = pulse;
+  c->ae = ae;
+  c->roi_count = CCD_Proc_GetRoi(c->roi);
+  c->darkt_count = CCD_Proc_GetDarkTemp(c->darkt);
+  c->despike = proc_despike;
+  c->despike_sigma = proc_despike_sigma;
+  c->despike_floor = proc_despike_floor;
+  c->baseline = proc_baseline;
+  c->base_width = proc_base_width;
+  CCD_AutoRoiStatus_t autoroi;
+  CCD_Proc_GetAutoRoi(&autoroi);
+  c->auto_roi = autoroi.mode;
+  c->auto_lines = autoroi.lines;
+  c->auto_frames = autoroi.frames;
+  c->auto_margin = autoroi.margin;
+  c->auto_interval = autoroi.interval;
+  c->defect_enable = proc_defect_enable;
+  uint8_t match_mode;
+  uint16_t match_threshold;
+  CCD_Match_GetMode(&match_mode, &match_threshold);
+  c->match_mode = match_mode;
+  c->match_threshold = match_threshold;
+  c->wide = proc_wide;
+  uint8_t sat_mode;
+  uint16_t sat_level;
+  CCD_Acq_GetSaturation(&sat_mode, &sat_level);
+  c->sat_mode = sat_mode;
+  c->sat_level = sat_level;
+#if CCD_REF_PD
+  uint8_t ref_mode;
+  uint32_t ref_target;
+  CCD_Ref_Get(&ref_mode, &ref_target);
+  c->ref_mode = ref_mode;
+  c->ref_target = ref_target;
+#endif
+}
+
+// Field by field, with the checks of the commands that set them, so a
+// record from another build only loses what this one cannot take
+static void Config_Apply(const CCD_Config_t *c) {
+  if (c->ccd_mode <= CCD_MODE_EXT_TRIGGER) {
+    ccd_mode = c->ccd_mode;
+  }
+  if (c->tx_mode <= CCD_TX_LAST) {
+    tx_mode = c->tx_mode;
+  }
+  if (c->acq_mode <= CCD_ACQ_HWSYNC) {
+    acq_mode = c->acq_mode;
+  }
+  if (c->sync_mode <= CCD_SYNC_LAST) {
+    sync_mode = c->sync_mode;
+  }
+  if (c->adc_samples == 1 || c->adc_samples == 2 ||
+      c->adc_samples == CCD_ACQ_SAMPLES_MAX) {
+    acq_adc_samples = c->adc_samples;
+  }
+  acq_cds = (c->cds != 0);
+  if (c->noise_profile < CCD_LN_COUNT) {
+    acq_noise_profile = c->noise_profile;
+  }
+  CCD_Acq_SetSource(c->source);
+  if (c->bin == 1 || c->bin == 2 || c->bin == 4 || c->bin == 8) {
+    proc_bin = c->bin;
+  }
+  if (c->bits == CCD_PROC_PACK_12 || c->bits == CCD_PROC_PACK_14 ||
+      c->bits == CCD_PROC_PACK_NONE) {
+    proc_bits = c->bits;
+  }
+  if (c->codec <= CCD_PROC_CODEC_TEMPORAL) {
+    proc_codec = c->codec;
+  }
+  proc_flat_enable = proc_flat_enable && c->flat_enable;
+  proc_lin_enable = proc_lin_enable && c->lin_enable;
+  proc_defect_enable = proc_defect_enable && c->defect_enable;
+  proc_black_enable = (c->black_enable != 0);
+  if (c->smooth_window == 0 ||
+      CCD_Proc_SmoothValid(c->smooth_window, c->smooth_order)) {
+    proc_smooth_order = c->smooth_order;
+    proc_smooth_window = c->smooth_window;
+  }
+  if (c->stats <= CCD_PROC_STATS_ONLY) {
+    proc_stats_level = c->stats_level;
+    proc_stats = c->stats;
+  }
+  if (c->peaks <= CCD_PROC_PEAKS_ONLY && c->peak_fit <= CCD_PROC_FIT_GAUSS &&
+      c->peak_distance != 0) {
+    proc_peak_fit = c->peak_fit;
+    proc_peak_threshold = c->peak_threshold;
+    proc_peak_distance = c->peak_distance;
+    proc_peaks = c->peaks;
+  }
+  if (c->coadd_n >= 1 && c->coadd_n <= CCD_PROC_COADD_MAX) {
+    proc_coadd_n = c->coadd_n;
+  }
+  if (c->rolling_n >= 1 && c->rolling_n <= CCD_PROC_ROLLING_MAX) {
+    proc_rolling_n = c->rolling_n;
+  }
+  proc_event_threshold = c->event_threshold;
+  if (c->heartbeat_ms != 0) {
+    proc_heartbeat_ms = c->heartbeat_ms;
+  }
+  CCD_Acq_SetExposure(c->sh_period_us, c->sh_pulse_us);
+  CCD_AE_SetLimits(c->ae.min_us, c->ae.max_us);
+  CCD_AE_SetTarget(c->ae.target);
+  CCD_AE_SetPercentile(c->ae.percentile);
+  CCD_AE_Enable(c->ae.enabled != 0);
+  if (c->roi_count <= CCD_PROC_ROI_MAX) {
+    CCD_Proc_SetRoi(c->roi, c->roi_count);
+  }
+  CCD_Proc_SetDarkTemp(c->darkt, c->darkt_count);
+  CCD_Proc_SetDespike(c->despike, c->despike_sigma, c->despike_floor);
+  CCD_Proc_SetBaseline(c->baseline, c->base_width);
+  CCD_Proc_SetAutoRoi(c->auto_roi, c->auto_lines, c->auto_frames,
+                      c->auto_margin, c->auto_interval);
+  CCD_Match_SetMode(c->match_mode, c->match_threshold);
+  if (c->wide <= CCD_PROC_WIDE_FLOAT) {
+    proc_wide = c->wide;
+  }
+  CCD_Acq_SetSaturation(c->sat_mode, c->sat_level);
+#if CCD_REF_PD
+  CCD_Ref_Set(c->ref_mode, c->ref_target); // Started by the apply below
+#endif
+  cfg_auto = (c->auto_save != 0);
+
+  // The strobe is checked against the ICG period of the restored profile
+  CCD_Acq_ApplySampling();
+  CCD_Acq_SetStrobe(c->strobe_delay_us, c->strobe_width_us);
+}
+
+// The boot sequence starts the default free-running chain; the first main
+// loop pass restarts it in the restored mode
+void CCD_Config_Init(void) {
+  Config_WarmBoot();
+  CCD_Config_t c;
+  if (CCD_Store_LoadLast(CCD_STORE_CONFIG, &c, sizeof(c)) &&
+      c.version == CCD_CONFIG_VERSION) {
+    cfg_saved = c; // The exposure an AE record keeps
+    Config_Apply(&c);
+    cfg_restored = 1;
+    mode_update_pending = 1;
+  }
+  Config_Capture(&cfg_saved);
+  cfg_pending = cfg_saved;
+  cfg_due = HAL_GetTick() + CCD_CONFIG_POLL_MS;
+}
+
+static uint8_t Config_Save(const CCD_Config_t *c) {
+  if (!CCD_Store_Append(CCD_STORE_CONFIG, c, sizeof(*c))) {
+    return 0;
+  }
+  cfg_saved = *c;
+  cfg_saves++;
+  return 1;
+}
+
+// Nothing is saved while a sweep, sequence or benchmark is changing the
+// settings for itself, or a restart is still to come
+static uint8_t Config_Busy(void) {
+  return mode_update_pending || CCD_Phase_Busy() || CCD_Seq_Running() ||
+         CCD_Bench_Running() || CCD_Ptc_Active();
+}
+
+void CCD_Config_Poll(void) {
+  uint32_t now = HAL_GetTick();
+  if ((int32_t)(now - cfg_due) < 0) {
+    return;
+  }
+  cfg_due = now + CCD_CONFIG_POLL_MS;
+  if (Config_Busy()) {
+    return;
+  }
+  CCD_Config_t c;
+  Config_Capture(&c);
+  if (memcmp(&c, &cfg_pending, sizeof(c)) != 0) {
+    cfg_pending = c;
+    cfg_changed = now;
+    return;
+  }
+  if (cfg_auto && now - cfg_changed >= CCD_CONFIG_SETTLE_MS &&
+      memcmp(&c, &cfg_saved, sizeof(c)) != 0) {
+    Config_Save(&c);
+  }
+}
+
+uint8_t CCD_Config_Command(uint8_t action, uint8_t arg,
+                           CCD_ConfigStatus_t *out) {
+  uint8_t ok = 1;
+  CCD_Config_t c;
+  switch (action) {
+  case CCD_CONFIG_STATUS:
+    break;
+  case CCD_CONFIG_AUTO:
+    if (arg > 1) {
+      return 0;
+    }
+    cfg_auto = arg;
+    // fall through
+  case CCD_CONFIG_SAVE:
+    Config_Capture(&c);
+    ok = Config_Save(&c);
+    cfg_pending = c;
+    break;
+  case CCD_CONFIG_DEFAULTS:
+    ok = CCD_Store_Erase(CCD_STORE_CONFIG);
+    Config_Capture(&cfg_saved); // Not saved again until it changes
+    cfg_pending = cfg_saved;
+    break;
+  default:
+    return 0;
+  }
+  Config_Capture(&c);
+  memset(out, 0, sizeof(*out));
+  out->auto_save = cfg_auto;
+  out->restored = cfg_restored;
+  out->warm_boot = Config_WarmBoot();
+  CCD_AdcCalStatus_t adc;
+  CCD_AdcCal_Read(&adc, 0);
+  out->adc_cached = (adc.source == CCD_ADCCAL_STORED);
+  out->pending = memcmp(&c, &cfg_saved, sizeof(c)) != 0;
+  out->saves = cfg_saves;
+  out->free = CCD_Store_Free(CCD_STORE_CONFIG);
+  return ok;
+}
@@ -0,0 +1,47 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_crc.c
+ * @brief          : Frame CRC-32 on the CRC peripheral
+ ******************************************************************************
+ */
+
+#include "ccd_crc.h"
+#include "ccd_proc.h"
+#include <stddef.h>
+#include <string.h>
+
+_Static_assert(offsetof(CCD_ShapedHeader_t, info) ==
+                   offsetof(CCD_Frame_t, info),
+               "raw and shaped frames share the info offset");
+
+// Default 0x04C11DB7 polynomial, 32-bit, initial value all ones
+void CCD_Crc_Init(void) {
+  __HAL_RCC_CRC_CLK_ENABLE();
+  CRC->INIT = 0xFFFFFFFFU;
+  CRC->POL = 0x04C11DB7U;
+  // Input reversed per byte, so words go in byte-swapped (the first byte
+  // in the high lane) and so do single tail bytes
+  CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT;
+}
+
+CCD_ITCM uint32_t CCD_Crc_Compute(const void *data, uint32_t len) {
+  const uint8_t *p = data;
+  CRC->CR |= CRC_CR_RESET;
+  for (; len >= 4U; len -= 4U, p += 4) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));
+    CRC->DR = __REV(w);
+  }
+  for (; len > 0; len--) {
+    *(__IO uint8_t *)&CRC->DR = *p++;
+  }
+  return ~CRC->DR;
+}
+
+CCD_ITCM void CCD_Crc_Stamp(void *frame) {
+  CCD_FrameInfo_t *info =
+      (CCD_FrameInfo_t *)((uint8_t *)frame + offsetof(CCD_Frame_t, info));
+  info->crc = 0;
+  info->crc = CCD_Crc_Compute(frame, (uint32_t)info->header_len +
+                                         info->payload_len);
+}
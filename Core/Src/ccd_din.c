@@ -0,0 +1,197 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_din.c
+ * @brief          : Digital inputs latched per frame, edges on the frame clock
+ ******************************************************************************
+ */
+
+#include "ccd_din.h"
+
+#if CCD_DIN
+
+#include "ccd_irq.h"
+#include "ccd_time.h"
+#include "stm32h7xx_ll_exti.h"
+#include "stm32h7xx_ll_gpio.h"
+#include "stm32h7xx_ll_system.h"
+
+// CCD_DIN_EDGE_Pin of CCD_DIN_GPIO_Port
+#define DIN_EXTI_LINE LL_EXTI_LINE_8
+#define DIN_EXTI_PORT LL_SYSCFG_EXTI_PORTE
+#define DIN_EXTI_SOURCE LL_SYSCFG_EXTI_LINE8
+#define DIN_MASK ((1U << CCD_DIN_COUNT) - 1U)
+
+_Static_assert((CCD_DIN_HIST & (CCD_DIN_HIST - 1U)) == 0 &&
+                   (CCD_DIN_QUEUE & (CCD_DIN_QUEUE - 1U)) == 0,
+               "the history and the queue index by mask");
+_Static_assert(CCD_DIN_HIST >= CCD_DIN_LEVELS,
+               "the status levels come from the history");
+_Static_assert(CCD_DIN_COUNT <= 7U, "levels keep bit 7 for CCD_DIN_LATE");
+_Static_assert(CCD_DIN_EDGES <= 8U, "the rising bits fit a byte");
+
+typedef struct {
+  uint64_t time; // CCD_Time_Now() in the interrupt
+  uint8_t rising;
+} Din_Event_t;
+
+static volatile uint8_t din_edge = CCD_DIN_EDGE_OFF;
+
+// Capture interrupts
+static volatile uint32_t din_port; // As the TIM2 update read it
+static volatile uint8_t din_fresh; // Not yet given to a frame
+static uint8_t din_level[CCD_DIN_HIST];
+static uint32_t din_seq[CCD_DIN_HIST];
+static volatile uint32_t din_newest;
+static volatile uint32_t din_frames;
+
+// Edge interrupt to PendSV
+static Din_Event_t din_queue[CCD_DIN_QUEUE];
+static volatile uint32_t din_head; // Written by the interrupt only
+static uint32_t din_tail;          // PendSV only
+static volatile uint32_t din_missed;
+
+// PendSV
+static uint32_t din_prev_seq; // Frame published last, and its ICG
+static uint64_t din_prev_icg;
+static uint8_t din_prev_valid;
+static CCD_DinEdge_t din_edges[CCD_DIN_EDGES];
+static uint8_t din_rising; // Bit i: din_edges[i]
+static volatile uint32_t din_count;
+
+void CCD_Din_Init(void) {
+  __HAL_RCC_GPIOE_CLK_ENABLE();
+  GPIO_InitTypeDef gpio = {0};
+  gpio.Pin = DIN_MASK << CCD_DIN_SHIFT;
+  gpio.Mode = GPIO_MODE_INPUT;
+  gpio.Pull = GPIO_PULLDOWN; // Unwired inputs read 0
+  HAL_GPIO_Init(CCD_DIN_GPIO_Port, &gpio);
+
+  __HAL_RCC_SYSCFG_CLK_ENABLE();
+  LL_SYSCFG_SetEXTISource(DIN_EXTI_PORT, DIN_EXTI_SOURCE);
+  CCD_Din_SetEdge(CCD_DIN_EDGE_OFF);
+  HAL_NVIC_SetPriority(CCD_DIN_EXTI_IRQn, CCD_IRQ_PRIO_TRIG, 0);
+  HAL_NVIC_EnableIRQ(CCD_DIN_EXTI_IRQn);
+}
+
+CCD_ITCM void CCD_Din_Icg(uint32_t port) {
+  din_port = port;
+  din_fresh = 1;
+}
+
+// The TIM2 update of the frame's ICG ran after the previous handoff, or
+// there is none on this path and the port is read now
+CCD_ITCM void CCD_Din_Latch(uint32_t seq) {
+  uint32_t v;
+  if (din_fresh) {
+    din_fresh = 0;
+    v = (din_port >> CCD_DIN_SHIFT) & DIN_MASK;
+  } else {
+    v = ((LL_GPIO_ReadInputPort(CCD_DIN_GPIO_Port) >> CCD_DIN_SHIFT) &
+         DIN_MASK) |
+        CCD_DIN_LATE;
+  }
+  uint32_t slot = seq & (CCD_DIN_HIST - 1U);
+  din_level[slot] = (uint8_t)v;
+  din_seq[slot] = seq;
+  din_newest = seq;
+  din_frames++;
+}
+
+// Frames are published in seq order, so an edge before this frame's ICG
+// fell in the period of the one published before it. One older than that
+// frame's ICG came during a gap in the capture and goes unassigned.
+CCD_ITCM void CCD_Din_Frame(const CCD_Frame_t *frame) {
+  uint64_t icg = frame->info.timestamp;
+  while (din_tail != din_head) {
+    const Din_Event_t *e = &din_queue[din_tail & (CCD_DIN_QUEUE - 1U)];
+    if (e->time >= icg) {
+      break; // In this frame's period, or later
+    }
+    din_tail++;
+    if (!din_prev_valid || e->time < din_prev_icg) {
+      continue;
+    }
+    uint64_t off = e->time - din_prev_icg;
+    uint32_t i = din_count % CCD_DIN_EDGES;
+    din_edges[i].seq = din_prev_seq;
+    din_edges[i].offset = (off > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)off;
+    din_rising = (uint8_t)((din_rising & ~(1U << i)) | (e->rising << i));
+    din_count++;
+  }
+  din_prev_seq = frame->info.seq;
+  din_prev_icg = icg;
+  din_prev_valid = 1;
+}
+
+CCD_ITCM void CCD_Din_EdgeIRQ(void) {
+  uint64_t now = CCD_Time_Now();
+  LL_EXTI_ClearFlag_0_31(DIN_EXTI_LINE);
+  uint8_t edge = din_edge;
+  uint32_t head = din_head;
+  if (head - din_tail >= CCD_DIN_QUEUE) {
+    din_missed++;
+    return;
+  }
+  Din_Event_t *e = &din_queue[head & (CCD_DIN_QUEUE - 1U)];
+  e->time = now;
+  e->rising = (edge == CCD_DIN_EDGE_BOTH)
+                  ? (uint8_t)LL_GPIO_IsInputPinSet(CCD_DIN_GPIO_Port,
+                                                   CCD_DIN_EDGE_Pin)
+                  : (edge == CCD_DIN_EDGE_RISING);
+  din_head = head + 1U;
+}
+
+uint8_t CCD_Din_SetEdge(uint8_t edge) {
+  if (edge > CCD_DIN_EDGE_BOTH) {
+    return 0;
+  }
+  LL_EXTI_DisableIT_0_31(DIN_EXTI_LINE);
+  if (edge & CCD_DIN_EDGE_RISING) {
+    LL_EXTI_EnableRisingTrig_0_31(DIN_EXTI_LINE);
+  } else {
+    LL_EXTI_DisableRisingTrig_0_31(DIN_EXTI_LINE);
+  }
+  if (edge & CCD_DIN_EDGE_FALLING) {
+    LL_EXTI_EnableFallingTrig_0_31(DIN_EXTI_LINE);
+  } else {
+    LL_EXTI_DisableFallingTrig_0_31(DIN_EXTI_LINE);
+  }
+  din_edge = edge;
+  LL_EXTI_ClearFlag_0_31(DIN_EXTI_LINE);
+  if (edge != CCD_DIN_EDGE_OFF) {
+    LL_EXTI_EnableIT_0_31(DIN_EXTI_LINE);
+  }
+  return 1;
+}
+
+void CCD_Din_Status(CCD_DinStatus_t *out) {
+  uint32_t seq = din_newest;
+  uint32_t n = din_count;
+  uint32_t missed = din_missed;
+  out->edge = din_edge;
+  out->inputs = (uint8_t)((LL_GPIO_ReadInputPort(CCD_DIN_GPIO_Port) >>
+                           CCD_DIN_SHIFT) &
+                          DIN_MASK);
+  out->rising = 0;
+  out->missed = (missed > 0xFFU) ? 0xFFU : (uint8_t)missed;
+  out->seq = seq;
+  out->count = n;
+  for (uint32_t i = 0; i < CCD_DIN_LEVELS; i++) {
+    uint32_t slot = (seq - i) & (CCD_DIN_HIST - 1U);
+    out->level[i] = (din_frames > i && din_seq[slot] == seq - i)
+                        ? din_level[slot]
+                        : CCD_DIN_NONE;
+  }
+  for (uint32_t i = 0; i < CCD_DIN_EDGES; i++) {
+    if (n > i) {
+      uint32_t k = (n - 1U - i) % CCD_DIN_EDGES;
+      out->edges[i] = din_edges[k];
+      out->rising |= (uint8_t)(((din_rising >> k) & 1U) << i);
+    } else {
+      out->edges[i].seq = 0;
+      out->edges[i].offset = 0;
+    }
+  }
+}
+
+#endif /* CCD_DIN */
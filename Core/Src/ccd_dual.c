@@ -0,0 +1,87 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_dual.c
+ * @brief          : Second sensor head on ADC2, sent beside the first
+ ******************************************************************************
+ */
+
+#include "ccd_dual.h"
+
+#if CCD_DUAL_SENSOR
+
+#include "ccd_crc.h"
+#include "usb_tx.h"
+#include <stddef.h>
+#include <string.h>
+
+// dual_state[]
+#define DUAL_FREE 0
+#define DUAL_CLAIMED 1 // Being filled by PendSV
+#define DUAL_READY 2   // Complete, waiting for USB
+#define DUAL_SENDING 3 // Queued; freed by its completion
+
+_Static_assert((sizeof(CCD_Frame_t) % 32) == 0,
+               "companion frames must be whole 32-byte cache lines");
+
+__attribute__((aligned(32))) static CCD_Frame_t dual_frames[CCD_DUAL_BUFS];
+static volatile uint8_t dual_state[CCD_DUAL_BUFS];
+static CCD_Frame_t *dual_claimed; // PendSV only
+static volatile uint32_t dual_dropped;
+
+CCD_ITCM CCD_Frame_t *CCD_Dual_Claim(void) {
+  for (uint32_t i = 0; i < CCD_DUAL_BUFS; i++) {
+    if (dual_state[i] == DUAL_FREE) {
+      dual_state[i] = DUAL_CLAIMED;
+      dual_claimed = &dual_frames[i];
+      return dual_claimed;
+    }
+  }
+  dual_dropped++;
+  return NULL;
+}
+
+CCD_ITCM void CCD_Dual_Complete(const CCD_Frame_t *a) {
+  CCD_Frame_t *b = dual_claimed;
+  if (b == NULL) {
+    return; // Dropped at the claim
+  }
+  dual_claimed = NULL;
+  if (a == NULL) {
+    dual_dropped++;
+    dual_state[b - dual_frames] = DUAL_FREE;
+    return;
+  }
+  memcpy(b, a, offsetof(CCD_Frame_t, pixels));
+  b->magic = CCD_DUAL_MAGIC;
+  __DMB(); // Frame contents visible before the state
+  dual_state[b - dual_frames] = DUAL_READY;
+}
+
+static void CCD_Dual_Sent(void *ctx, uint32_t len) {
+  (void)len;
+  dual_state[(CCD_Frame_t *)ctx - dual_frames] = DUAL_FREE;
+}
+
+void CCD_Dual_Send(void) {
+  while (UsbTx_Space(USB_TX_FRAMES) > 0) {
+    CCD_Frame_t *next = NULL;
+    for (uint32_t i = 0; i < CCD_DUAL_BUFS; i++) {
+      CCD_Frame_t *f = &dual_frames[i];
+      if (dual_state[i] == DUAL_READY &&
+          (next == NULL || (int32_t)(f->info.seq - next->info.seq) < 0)) {
+        next = f;
+      }
+    }
+    if (next == NULL) {
+      return;
+    }
+    CCD_Crc_Stamp(next);
+    dual_state[next - dual_frames] = DUAL_SENDING;
+    UsbTx_Submit(USB_TX_FRAMES, (const uint8_t *)next, sizeof(*next),
+                 CCD_Dual_Sent, next);
+  }
+}
+
+uint32_t CCD_Dual_Dropped(void) { return dual_dropped; }
+
+#endif /* CCD_DUAL_SENSOR */
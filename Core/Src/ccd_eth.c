@@ -0,0 +1,91 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_eth.c
+ * @brief          : Frame streaming over Ethernet (UDP multicast, LwIP)
+ ******************************************************************************
+ */
+
+#include "ccd_eth.h"
+
+#if CCD_ETH
+
+#include "frame_ring.h"
+#include "lwip/ip_addr.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+#if !NO_SYS || !IP_FRAG || !LWIP_SUPPORT_CUSTOM_PBUF ||                       \
+    !LWIP_MULTICAST_TX_OPTIONS
+#error "CCD_ETH needs NO_SYS, IP_FRAG, custom pbufs and multicast TX"
+#endif
+
+CCD_Eth_Stats_t ccd_eth_stats;
+
+// A ring slot lent to LwIP. The pbuf comes first, so the free callback's
+// struct pbuf * is the Eth_Ref_t.
+typedef struct {
+  struct pbuf_custom p;
+  CCD_Frame_t *frame; // NULL while unused
+} Eth_Ref_t;
+
+// Main loop only, the free callback included (NO_SYS)
+static Eth_Ref_t eth_refs[CCD_ETH_INFLIGHT];
+static uint32_t eth_free = CCD_ETH_INFLIGHT;
+static struct udp_pcb *eth_pcb;
+static ip_addr_t eth_group;
+
+static void Eth_Free(struct pbuf *p) {
+  Eth_Ref_t *ref = (Eth_Ref_t *)p;
+  FrameRing_Release(ref->frame, 1);
+  ref->frame = NULL;
+  eth_free++;
+}
+
+void CCD_Eth_Init(void) {
+  ipaddr_aton(CCD_ETH_GROUP, &eth_group);
+  eth_pcb = udp_new();
+  if (eth_pcb != NULL) {
+    udp_set_multicast_ttl(eth_pcb, CCD_ETH_TTL);
+  }
+}
+
+uint32_t CCD_Eth_Space(void) {
+  struct netif *netif = netif_default;
+  if (eth_pcb == NULL || netif == NULL || !netif_is_up(netif) ||
+      !netif_is_link_up(netif)) {
+    return 0; // Frames wait in the ring, as with the USB port closed
+  }
+  return eth_free;
+}
+
+// Only after CCD_Eth_Space() > 0. The CRC is already stamped: the slot is
+// cleaned once for the ETH DMA and invalidated again by its release.
+void CCD_Eth_Send(CCD_Frame_t *frame, uint32_t len) {
+  Eth_Ref_t *ref = eth_refs;
+  while (ref->frame != NULL) {
+    ref++;
+  }
+  ref->frame = frame;
+  ref->p.custom_free_function = Eth_Free;
+  eth_free--;
+  CCD_DCACHE_CLEAN(frame, len);
+  struct pbuf *p = pbuf_alloced_custom(PBUF_RAW, (u16_t)len, PBUF_REF, &ref->p,
+                                       frame, (u16_t)len);
+  if (udp_sendto(eth_pcb, p, &eth_group, CCD_ETH_PORT) == ERR_OK) {
+    ccd_eth_stats.sent++;
+  } else {
+    ccd_eth_stats.failed++;
+  }
+  pbuf_free(p); // Ours; the slot goes back with the last fragment's
+}
+
+void CCD_Eth_Mirror(CCD_Frame_t *frame, uint32_t len) {
+  if (CCD_Eth_Space() == 0 || !FrameRing_Retain(frame, 1)) {
+    ccd_eth_stats.skipped++;
+    return;
+  }
+  CCD_Eth_Send(frame, len);
+}
+
+#endif /* CCD_ETH */
@@ -0,0 +1,186 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_extadc.c
+ * @brief          : External 16-bit SPI ADC front end (CNVST + SPI4 + DMA)
+ ******************************************************************************
+ */
+
+#include "ccd_extadc.h"
+
+#if CCD_EXT_ADC
+
+#include "ccd_acq.h"
+#include "ccd_timing.h"
+#include "stm32h7xx_ll_dma.h"
+#include "stm32h7xx_ll_tim.h"
+#include <string.h>
+
+#define EXTADC_DMA CCD_ACQ_DMA
+#define EXTADC_TX_STREAM LL_DMA_STREAM_1
+#define EXTADC_SUSP_WAIT 1000U // Polls for the SPI to suspend at a stop
+
+// Read by DMA1 for every pixel; the value is never sent anywhere
+static uint16_t extadc_dummy = 0xFFFFU;
+
+static uint32_t extadc_conv_ticks; // CNVST high
+static uint32_t extadc_busy_ticks; // CNVST rise to the sample in memory
+
+static void ExtAdc_Pins(void) {
+  GPIO_InitTypeDef gpio = {0};
+  __HAL_RCC_GPIOD_CLK_ENABLE();
+  __HAL_RCC_GPIOE_CLK_ENABLE();
+  gpio.Pin = CCD_CNVST_Pin;
+  gpio.Mode = GPIO_MODE_AF_PP;
+  gpio.Pull = GPIO_NOPULL;
+  gpio.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+  gpio.Alternate = GPIO_AF2_TIM4;
+  HAL_GPIO_Init(CCD_CNVST_GPIO_Port, &gpio);
+  gpio.Pin = CCD_EXTADC_SCK_Pin | CCD_EXTADC_MISO_Pin;
+  gpio.Alternate = GPIO_AF5_SPI4;
+  HAL_GPIO_Init(CCD_EXTADC_GPIO_Port, &gpio);
+}
+
+// Master, full duplex, mode 0, 16-bit frames, software NSS. AFCNTR keeps
+// SCK driven low while the SPI is disabled.
+static uint32_t ExtAdc_SetupSpi(void) {
+  __HAL_RCC_SPI4_CLK_ENABLE();
+  __HAL_RCC_SPI4_FORCE_RESET();
+  __HAL_RCC_SPI4_RELEASE_RESET();
+  uint32_t clk = HAL_RCC_GetPCLK2Freq();
+  uint32_t mbr = 0; // SCK = clk / (2 << mbr)
+  while (mbr < 7U && clk / (2UL << mbr) > CCD_EXT_ADC_SCK_MAX_HZ) {
+    mbr++;
+  }
+  SPI4->CFG1 = (mbr << SPI_CFG1_MBR_Pos) |
+               ((CCD_EXT_ADC_BITS - 1U) << SPI_CFG1_DSIZE_Pos) |
+               SPI_CFG1_RXDMAEN;
+  SPI4->CFG2 = SPI_CFG2_AFCNTR | SPI_CFG2_SSM | SPI_CFG2_MASTER;
+  SPI4->CR1 = SPI_CR1_SSI;
+  SPI4->CR2 = 0; // TSIZE = 0: no end of transfer
+  return clk / (2UL << mbr);
+}
+
+// DMA1_Stream1 on the TIM4 CC1 request: one dummy word into TXDR per pixel
+static void ExtAdc_SetupTxStream(void) {
+  LL_DMA_DisableStream(EXTADC_DMA, EXTADC_TX_STREAM);
+  while (LL_DMA_IsEnabledStream(EXTADC_DMA, EXTADC_TX_STREAM)) {
+  }
+  LL_DMA_ConfigTransfer(EXTADC_DMA, EXTADC_TX_STREAM,
+                        LL_DMA_DIRECTION_MEMORY_TO_PERIPH |
+                            LL_DMA_MODE_CIRCULAR | LL_DMA_PERIPH_NOINCREMENT |
+                            LL_DMA_MEMORY_NOINCREMENT |
+                            LL_DMA_PDATAALIGN_HALFWORD |
+                            LL_DMA_MDATAALIGN_HALFWORD |
+                            LL_DMA_PRIORITY_HIGH);
+  LL_DMA_SetPeriphRequest(EXTADC_DMA, EXTADC_TX_STREAM,
+                          LL_DMAMUX1_REQ_TIM4_CH1);
+  LL_DMA_SetPeriphAddress(EXTADC_DMA, EXTADC_TX_STREAM,
+                          (uint32_t)&SPI4->TXDR);
+  LL_DMA_SetMemoryAddress(EXTADC_DMA, EXTADC_TX_STREAM,
+                          (uint32_t)&extadc_dummy);
+  LL_DMA_SetDataLength(EXTADC_DMA, EXTADC_TX_STREAM, 1);
+}
+
+uint8_t CCD_ExtAdc_Init(void) {
+  ExtAdc_Pins();
+  uint32_t sck = ExtAdc_SetupSpi();
+  ExtAdc_SetupTxStream();
+
+  // CNVST = OC3REF AND OC4REF: high for CCR3 <= CNT < CCR4. CC1 is only a
+  // DMA request. All three compares are preloaded, like CCR4 for ADC1.
+  LL_TIM_OC_SetMode(TIM4, LL_TIM_CHANNEL_CH1, LL_TIM_OCMODE_FROZEN);
+  LL_TIM_OC_SetMode(TIM4, LL_TIM_CHANNEL_CH4, LL_TIM_OCMODE_PWM1);
+  LL_TIM_OC_SetMode(TIM4, LL_TIM_CHANNEL_CH3, LL_TIM_OCMODE_COMBINED_PWM2);
+  LL_TIM_OC_EnablePreload(TIM4, LL_TIM_CHANNEL_CH1);
+  LL_TIM_OC_EnablePreload(TIM4, LL_TIM_CHANNEL_CH3);
+  LL_TIM_OC_EnablePreload(TIM4, LL_TIM_CHANNEL_CH4);
+  LL_TIM_CC_EnableChannel(TIM4, LL_TIM_CHANNEL_CH3);
+
+  uint64_t clk = CCD_TIM_CLK_HZ;
+  extadc_conv_ticks =
+      (uint32_t)((CCD_EXT_ADC_CONV_NS * clk + 999999999U) / 1000000000U);
+  extadc_busy_ticks = extadc_conv_ticks + CCD_EXT_ADC_SLACK_TICKS +
+                      (uint32_t)((CCD_EXT_ADC_BITS * clk + sck - 1U) / sck);
+  return extadc_busy_ticks < CCD_PIXEL_TICKS;
+}
+
+uint32_t CCD_ExtAdc_SetPhase(uint32_t start, uint32_t arr) {
+  if (start + extadc_busy_ticks > arr + 1U) {
+    start = arr + 1U - extadc_busy_ticks;
+  }
+  if (start == 0) {
+    start = 1; // A compare at 0 would coincide with the TIM4 reset
+  }
+  LL_TIM_OC_SetCompareCH3(TIM4, start);
+  LL_TIM_OC_SetCompareCH4(TIM4, start + extadc_conv_ticks);
+  LL_TIM_OC_SetCompareCH1(TIM4, start + extadc_conv_ticks);
+  return start + extadc_busy_ticks;
+}
+
+void CCD_ExtAdc_Stream(void) {
+  LL_DMA_SetPeriphRequest(CCD_ACQ_DMA, CCD_ACQ_STREAM, LL_DMAMUX1_REQ_SPI4_RX);
+  LL_DMA_SetPeriphAddress(CCD_ACQ_DMA, CCD_ACQ_STREAM, (uint32_t)&SPI4->RXDR);
+  LL_DMA_SetPeriphSize(CCD_ACQ_DMA, CCD_ACQ_STREAM,
+                       LL_DMA_PDATAALIGN_HALFWORD);
+  LL_DMA_SetMemorySize(CCD_ACQ_DMA, CCD_ACQ_STREAM,
+                       LL_DMA_MDATAALIGN_HALFWORD);
+}
+
+// The master only clocks when TIM4 has put a word in the TX FIFO, so it can
+// start ahead of the timers
+void CCD_ExtAdc_Start(void) {
+  if (SPI4->CR1 & SPI_CR1_SPE) {
+    return;
+  }
+  LL_DMA_ClearFlag_TC1(EXTADC_DMA);
+  LL_DMA_ClearFlag_HT1(EXTADC_DMA);
+  LL_DMA_ClearFlag_TE1(EXTADC_DMA);
+  LL_DMA_ClearFlag_DME1(EXTADC_DMA);
+  LL_DMA_ClearFlag_FE1(EXTADC_DMA);
+  SPI4->CR1 = SPI_CR1_SSI | SPI_CR1_SPE;
+  SPI4->CR1 = SPI_CR1_SSI | SPI_CR1_SPE | SPI_CR1_CSTART;
+  LL_DMA_EnableStream(EXTADC_DMA, EXTADC_TX_STREAM);
+  LL_TIM_EnableDMAReq_CC1(TIM4);
+}
+
+// Samples a resync left in the RX FIFO are dropped first, so the stream
+// starts at pixel 0
+CCD_ITCM void CCD_ExtAdc_Arm(void) {
+  while (SPI4->SR & SPI_SR_RXP) {
+    (void)*(volatile uint16_t *)&SPI4->RXDR;
+  }
+  SPI4->IFCR = SPI_IFCR_OVRC;
+  LL_DMA_EnableStream(CCD_ACQ_DMA, CCD_ACQ_STREAM);
+}
+
+CCD_ITCM uint8_t CCD_ExtAdc_Overrun(void) {
+  return (SPI4->SR & SPI_SR_OVR) != 0;
+}
+
+// Two's complement samples to offset binary, two pixels per XOR
+CCD_ITCM void CCD_ExtAdc_Done(CCD_Frame_t *frame) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t w;
+    memcpy(&w, &frame->pixels[i], sizeof(w));
+    w ^= 0x80008000U;
+    memcpy(&frame->pixels[i], &w, sizeof(w));
+  }
+}
+
+// Disabling the SPI flushes both FIFOs, so a restart begins at pixel 0
+void CCD_ExtAdc_Stop(void) {
+  LL_TIM_DisableDMAReq_CC1(TIM4);
+  LL_DMA_DisableStream(EXTADC_DMA, EXTADC_TX_STREAM);
+  while (LL_DMA_IsEnabledStream(EXTADC_DMA, EXTADC_TX_STREAM)) {
+  }
+  if (SPI4->CR1 & SPI_CR1_CSTART) {
+    SPI4->CR1 |= SPI_CR1_CSUSP;
+    for (uint32_t i = 0; i < EXTADC_SUSP_WAIT && !(SPI4->SR & SPI_SR_SUSP);
+         i++) {
+    }
+    SPI4->IFCR = SPI_IFCR_SUSPC;
+  }
+  SPI4->CR1 = SPI_CR1_SSI;
+}
+
+#endif /* CCD_EXT_ADC */
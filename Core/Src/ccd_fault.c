@@ -0,0 +1,116 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_fault.c
+ * @brief          : Loss and fault counters, in the stream and on request
+ ******************************************************************************
+ */
+
+#include "ccd_fault.h"
+#include "ccd_acq.h"
+#include "ccd_cmd.h"
+#include "ccd_flow.h"
+#include "ccd_watch.h"
+#include "frame_ring.h"
+#include "usb_tx.h"
+#include <string.h>
+
+typedef struct {
+  uint32_t magic; // CCD_FAULT_REC_MAGIC once initialised
+  uint32_t boots;
+  uint32_t faults;
+  uint32_t last_fault;
+} Fault_Record_t;
+
+CCD_DTCM_NOINIT static Fault_Record_t fault_rec;
+
+static uint32_t fault_period = CCD_FAULT_PERIOD_MS;
+static uint32_t fault_due;
+static uint32_t fault_sent;       // HAL_GetTick() of the last report
+static uint32_t fault_misaligned; // ccd_watch_stats.misaligned in it
+static volatile uint8_t fault_busy;
+static CCD_FaultReport_t fault_report; // Read by the USB engine while queued
+
+// Before CCD_Config_Init(), which clears the reset flags
+void CCD_Fault_Init(void) {
+  if (fault_rec.magic != CCD_FAULT_REC_MAGIC) {
+    memset(&fault_rec, 0, sizeof(fault_rec));
+    fault_rec.magic = CCD_FAULT_REC_MAGIC;
+  }
+  if (RCC->RSR & RCC_RSR_IWDG1RSTF) {
+    fault_rec.faults++;
+    fault_rec.last_fault = CCD_FAULT_WATCHDOG;
+  }
+  fault_rec.boots++;
+  fault_due = HAL_GetTick() + fault_period;
+}
+
+void CCD_Fault_SetPeriod(uint32_t ms) {
+  fault_period = ms;
+  fault_due = HAL_GetTick() + ms;
+}
+
+void CCD_Fault_Read(CCD_FaultReport_t *out) {
+  memset(out, 0, sizeof(*out));
+  out->magic = CCD_FAULT_MAGIC;
+  out->last_fault = (uint8_t)fault_rec.last_fault;
+  out->uptime_ms = HAL_GetTick();
+  out->dropped = frame_ring_stats.dropped;
+  out->resyncs = ccd_acq_stats.resyncs;
+  out->overruns = ccd_acq_stats.overruns;
+  out->dma_errors = ccd_acq_stats.dma_errors;
+  out->usb_busy = usb_tx_fs.busy_retries + usb_tx_hs.busy_retries;
+  out->usb_full = usb_tx_fs.full + usb_tx_hs.full;
+  out->usb_aborted = usb_tx_fs.aborted + usb_tx_hs.aborted;
+#if CCD_USB_VENDOR
+  out->usb_busy += usb_tx_data.busy_retries;
+  out->usb_full += usb_tx_data.full;
+  out->usb_aborted += usb_tx_data.aborted + usb_tx_data.lost;
+#endif
+  out->cmd_errors = CCD_Cmd_Errors();
+  out->cmd_stalls = CCD_Cmd_Stalls();
+  out->throttled = ccd_flow_stats.skipped + ccd_flow_stats.merged;
+  out->boots = fault_rec.boots;
+  out->faults = fault_rec.faults;
+  out->rearms = ccd_watch_stats.rearms;
+  out->misaligned = ccd_watch_stats.misaligned;
+}
+
+static void Fault_Sent(void *ctx, uint32_t len) { fault_busy = 0; }
+
+// A report still queued from the last period skips this one
+void CCD_Fault_Poll(void) {
+  uint32_t now = HAL_GetTick();
+  if (fault_period == 0) {
+    return;
+  }
+  uint8_t alert = ccd_watch_stats.misaligned != fault_misaligned &&
+                  now - fault_sent >= CCD_FAULT_ALERT_MS;
+  if (!alert && (int32_t)(now - fault_due) < 0) {
+    return;
+  }
+  fault_due = now + fault_period;
+  if (fault_busy || UsbTx_Space(&usb_tx_fs) == 0) {
+    return;
+  }
+  CCD_Fault_Read(&fault_report);
+  fault_sent = now;
+  fault_misaligned = fault_report.misaligned;
+  fault_busy = 1;
+  UsbTx_Submit(&usb_tx_fs, (const uint8_t *)&fault_report,
+               sizeof(fault_report), Fault_Sent, NULL);
+}
+
+void CCD_Fault_Reset(uint8_t cause) {
+  __disable_irq();
+  if (fault_rec.magic != CCD_FAULT_REC_MAGIC) {
+    memset(&fault_rec, 0, sizeof(fault_rec));
+    fault_rec.magic = CCD_FAULT_REC_MAGIC;
+  }
+  fault_rec.faults++;
+  fault_rec.last_fault = cause;
+  if (CoreDebug->DHCSR & CoreDebug_DHCSR_C_DEBUGEN_Msk) {
+    while (1) { // Left for the debugger, as it was found
+    }
+  }
+  NVIC_SystemReset(); // DTCM is not cached: the record is already in RAM
+}
@@ -0,0 +1,112 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_flow.c
+ * @brief          : Credit-based flow control (host backpressure)
+ ******************************************************************************
+ */
+
+#include "ccd_flow.h"
+#include "frame_ring.h"
+
+CCD_Flow_Stats_t ccd_flow_stats;
+
+// Main loop only: commands execute from CCD_Cmd_Poll()
+static uint8_t flow_policy = CCD_FLOW_OFF;
+static uint32_t flow_limit; // Frames the host allows in total
+static uint32_t flow_sent;  // Frames queued since the policy was set
+
+// COADD: sum of the frames merged while out of credit. The newest of them
+// stays claimed and carries the mean.
+static uint32_t flow_acc[CCD_BUFFER_SIZE];
+static CCD_Frame_t *flow_held;
+static uint16_t flow_count; // Frames in flow_acc
+
+// ========== COMMANDS ==========
+
+uint8_t CCD_Flow_SetPolicy(uint8_t policy) {
+  if (policy > CCD_FLOW_COADD) {
+    return 0;
+  }
+  CCD_Flow_Reset();
+  flow_policy = policy;
+  flow_sent = 0;
+  flow_limit = 0;
+  return 1;
+}
+
+void CCD_Flow_Grant(uint32_t limit) {
+  if ((int32_t)(limit - flow_limit) > 0) {
+    flow_limit = limit; // Grants overtaken by a newer one are ignored
+  }
+}
+
+// ========== SEND PATH ==========
+
+uint32_t CCD_Flow_Credits(void) {
+  if (flow_policy == CCD_FLOW_OFF) {
+    return UINT32_MAX;
+  }
+  int32_t left = (int32_t)(flow_limit - flow_sent);
+  return left > 0 ? (uint32_t)left : 0;
+}
+
+static void Flow_Accumulate(const uint16_t *px, uint8_t first) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    flow_acc[i] = first ? px[i] : flow_acc[i] + px[i];
+  }
+}
+
+// The sum cannot overflow: 65535 frames of 16-bit pixels fit in 32 bits.
+// Past that the frames are dropped instead.
+uint8_t CCD_Flow_Starve(void) {
+  CCD_Frame_t *frame;
+  if (flow_policy == CCD_FLOW_OFF || flow_policy == CCD_FLOW_HOLD ||
+      FrameRing_PeekBatch(&frame, 1) == 0) {
+    return 0;
+  }
+  FrameRing_Advance(1);
+  if (flow_policy == CCD_FLOW_DECIMATE || flow_count == UINT16_MAX) {
+    FrameRing_Release(frame, 1);
+    ccd_flow_stats.skipped++;
+    return 1;
+  }
+  Flow_Accumulate(frame->pixels, flow_count == 0);
+  if (flow_held != NULL) {
+    FrameRing_Release(flow_held, 1);
+    ccd_flow_stats.merged++;
+  }
+  flow_held = frame;
+  flow_count++;
+  return 1;
+}
+
+// The mean goes out in the newest frame's slot, keeping its header
+CCD_Frame_t *CCD_Flow_Take(void) {
+  CCD_Frame_t *frame = flow_held;
+  if (frame == NULL) {
+    return NULL;
+  }
+  uint32_t n = flow_count;
+  if (n > 1) {
+    uint32_t half = n / 2U;
+    for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+      frame->pixels[i] = (uint16_t)((flow_acc[i] + half) / n);
+    }
+    frame->info.flags |= CCD_FRAME_F_COADD;
+    frame->info.coadd = (uint16_t)n;
+  }
+  flow_held = NULL;
+  flow_count = 0;
+  return frame;
+}
+
+void CCD_Flow_Spend(uint32_t n) { flow_sent += n; }
+
+// Drop a partial mean; the credit count carries on
+void CCD_Flow_Reset(void) {
+  if (flow_held != NULL) {
+    FrameRing_Release(flow_held, 1);
+    flow_held = NULL;
+  }
+  flow_count = 0;
+}
@@ -0,0 +1,167 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_hdr.c
+ * @brief          : Extended dynamic range from exposure brackets
+ ******************************************************************************
+ */
+
+#include "ccd_hdr.h"
+#include "ccd_mem.h"
+#include "ccd_phase.h" // Pixel classes
+#include "frame_ring.h"
+#include "usb_tx.h"
+
+#define HDR_OUT_BUFS 2
+
+_Static_assert(CCD_ACQ_BRACKET_MAX * CCD_SH_MAX_PERIOD_US <= 0xFFFFU,
+               "per-pixel time sums are 16-bit");
+
+typedef struct {
+  CCD_HDRHeader_t hdr;
+  float pixels[CCD_BUFFER_SIZE];
+} HDR_Out_t;
+
+// The merge's share of the scratch (ccd_mem.h), held from the first
+// bracket until the brackets stop and the last output is sent
+typedef struct {
+  uint32_t sum_s[CCD_BUFFER_SIZE]; // Unsaturated signal
+  uint16_t sum_t[CCD_BUFFER_SIZE]; // Their integration times, us
+  uint16_t short_s[CCD_BUFFER_SIZE]; // Shortest-exposure signal
+  HDR_Out_t out[HDR_OUT_BUFS]; // Read by the USB engine while queued
+} HDR_Scratch_t;
+
+_Static_assert(sizeof(HDR_Scratch_t) <= CCD_MEM_SCRATCH_SIZE,
+               "the merge fits the scratch");
+
+static volatile uint16_t hdr_sat = CCD_HDR_SAT_LEVEL;
+
+// Bracket being merged, main loop only
+static uint8_t hdr_next;     // Entry expected next
+static uint16_t hdr_last;    // frame_num of the previous entry
+static uint8_t hdr_shortest; // Entry with the shortest integration time
+static uint16_t hdr_dropped;
+static HDR_Scratch_t *hdr_buf; // NULL while the scratch is not held
+static volatile uint8_t hdr_out_busy[HDR_OUT_BUFS];
+
+void CCD_HDR_SetSaturation(uint16_t level) { hdr_sat = level; }
+
+uint8_t CCD_HDR_Active(void) { return CCD_Acq_BracketCount() != 0; }
+
+static void HDR_Accumulate(const CCD_Frame_t *frame, uint8_t entry) {
+  uint32_t dark = 0;
+  for (uint32_t i = 0; i < CCD_PHASE_SHIELD_COUNT; i++) {
+    dark += frame->pixels[CCD_PHASE_SHIELD_START + i];
+  }
+  dark /= CCD_PHASE_SHIELD_COUNT;
+
+  uint16_t t = (uint16_t)CCD_Acq_BracketUs(entry);
+  uint16_t sat = hdr_sat;
+  uint8_t first = (entry == 0);
+  uint8_t shortest = (entry == hdr_shortest);
+  HDR_Scratch_t *b = hdr_buf;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    uint32_t px = frame->pixels[i];
+    uint32_t s = (dark > px) ? dark - px : 0;
+    uint32_t sum_s = first ? 0 : b->sum_s[i];
+    uint16_t sum_t = first ? 0 : b->sum_t[i];
+    if (px > sat) {
+      sum_s += s;
+      sum_t += t;
+    }
+    b->sum_s[i] = sum_s;
+    b->sum_t[i] = sum_t;
+    if (shortest) {
+      b->short_s[i] = (uint16_t)s;
+    }
+  }
+}
+
+static void HDR_Sent(void *ctx, uint32_t len) {
+  hdr_out_busy[(HDR_Out_t *)ctx - hdr_buf->out] = 0;
+}
+
+static void HDR_Emit(uint16_t frame_num, uint8_t count) {
+  HDR_Scratch_t *buf = hdr_buf;
+  HDR_Out_t *out = NULL;
+  for (uint32_t b = 0; b < HDR_OUT_BUFS; b++) {
+    if (!hdr_out_busy[b]) {
+      out = &buf->out[b];
+      break;
+    }
+  }
+  if (out == NULL || UsbTx_Space(USB_TX_FRAMES) == 0) {
+    hdr_dropped++;
+    return;
+  }
+
+  uint32_t t_long = 0;
+  for (uint8_t j = 0; j < CCD_ACQ_BRACKET_MAX; j++) {
+    uint32_t t = (j < count) ? CCD_Acq_BracketUs(j) : 0;
+    out->hdr.t_us[j] = t;
+    t_long = (t > t_long) ? t : t_long;
+  }
+  float scale_short = (float)t_long / (float)CCD_Acq_BracketUs(hdr_shortest);
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    uint16_t sum_t = buf->sum_t[i];
+    out->pixels[i] = sum_t ? (float)buf->sum_s[i] * (float)t_long / sum_t
+                           : (float)buf->short_s[i] * scale_short;
+  }
+  out->hdr.magic = CCD_HDR_MAGIC;
+  out->hdr.frame_num = frame_num;
+  out->hdr.count = count;
+  out->hdr.reserved = 0;
+  out->hdr.dropped = hdr_dropped;
+  hdr_out_busy[out - buf->out] = 1;
+  UsbTx_Submit(USB_TX_FRAMES, (const uint8_t *)out, sizeof(*out), HDR_Sent,
+               out);
+}
+
+void CCD_HDR_Frame(CCD_Frame_t *frame) {
+  uint16_t num = frame->frame_num;
+  uint8_t count = CCD_Acq_BracketCount();
+  uint8_t entry = CCD_Acq_BracketIndex(num);
+  if (hdr_buf == NULL && entry == 0 && count != 0) {
+    hdr_buf = CCD_Mem_Claim(CCD_MEM_HDR, NULL);
+    hdr_dropped += (hdr_buf == NULL); // Held by another mode
+  }
+  if (hdr_buf != NULL && entry != CCD_ACQ_BRACKET_NONE && count != 0) {
+    // Entries must arrive in order from consecutive frames
+    if (entry != hdr_next || (entry != 0 && num != (uint16_t)(hdr_last + 1U))) {
+      if (hdr_next != 0) {
+        hdr_dropped++;
+      }
+      hdr_next = 0;
+    }
+    if (entry == hdr_next) {
+      if (entry == 0) {
+        hdr_shortest = 0;
+        for (uint8_t j = 1; j < count; j++) {
+          if (CCD_Acq_BracketUs(j) < CCD_Acq_BracketUs(hdr_shortest)) {
+            hdr_shortest = j;
+          }
+        }
+      }
+      HDR_Accumulate(frame, entry);
+      hdr_last = num;
+      if (++hdr_next == count) {
+        hdr_next = 0;
+        HDR_Emit(num, count);
+      }
+    }
+  }
+  FrameRing_Release(frame, 1);
+}
+
+void CCD_HDR_Poll(void) {
+  if (hdr_buf == NULL || CCD_HDR_Active()) {
+    return;
+  }
+  for (uint32_t b = 0; b < HDR_OUT_BUFS; b++) {
+    if (hdr_out_busy[b]) {
+      return;
+    }
+  }
+  hdr_next = 0;
+  hdr_buf = NULL;
+  CCD_Mem_Release(CCD_MEM_HDR);
+}
@@ -0,0 +1,62 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_irq.c
+ * @brief          : Interrupt priority scheme
+ ******************************************************************************
+ */
+
+#include "ccd_irq.h"
+
+#define IRQ_LOWEST ((1U << __NVIC_PRIO_BITS) - 1U)
+
+_Static_assert(CCD_IRQ_PRIO_TIMING < CCD_IRQ_PRIO_DMA &&
+                   CCD_IRQ_PRIO_DMA < CCD_IRQ_PRIO_TRIG &&
+                   CCD_IRQ_PRIO_TRIG < CCD_IRQ_PRIO_USB &&
+                   CCD_IRQ_PRIO_USB < CCD_IRQ_PRIO_PERIPH &&
+                   CCD_IRQ_PRIO_PERIPH < CCD_IRQ_PRIO_TICK,
+               "capture before DMA before USB before the rest");
+_Static_assert(CCD_IRQ_PRIO_TICK == TICK_INT_PRIORITY,
+               "TICK_INT_PRIORITY is set in stm32h7xx_hal_conf.h");
+_Static_assert(CCD_IRQ_PRIO_DEFER == IRQ_LOWEST,
+               "deferred work must not preempt any interrupt");
+
+typedef struct {
+  IRQn_Type irq;
+  uint8_t prio;
+} Irq_Level_t;
+
+static const Irq_Level_t irq_levels[] = {
+    {TIM2_IRQn, CCD_IRQ_PRIO_TIMING},
+    {TIM5_IRQn, CCD_IRQ_PRIO_TIMING},
+    {DMA1_Stream0_IRQn, CCD_IRQ_PRIO_DMA},
+    {TIM7_IRQn, CCD_IRQ_PRIO_DMA},
+    {CCD_TRIG_IN_EXTI_IRQn, CCD_IRQ_PRIO_TRIG},
+#if CCD_DIN
+    {CCD_DIN_EXTI_IRQn, CCD_IRQ_PRIO_TRIG},
+#endif
+#if CCD_ENCODER
+    {TIM8_UP_TIM13_IRQn, CCD_IRQ_PRIO_TRIG},
+#endif
+#if CCD_LINE_SYNC
+    {TIM8_CC_IRQn, CCD_IRQ_PRIO_TRIG},
+#endif
+    {OTG_FS_IRQn, CCD_IRQ_PRIO_USB},
+    {OTG_HS_IRQn, CCD_IRQ_PRIO_USB},
+    {TIM6_DAC_IRQn, CCD_IRQ_PRIO_TICK},
+    {PendSV_IRQn, CCD_IRQ_PRIO_DEFER},
+};
+
+static uint32_t irq_fixes;
+
+// NVIC_GetPriority() returns the level without the unimplemented low bits,
+// all preemption in group 4
+uint32_t CCD_Irq_Check(void) {
+  for (uint32_t i = 0; i < sizeof(irq_levels) / sizeof(irq_levels[0]); i++) {
+    const Irq_Level_t *l = &irq_levels[i];
+    if (NVIC_GetPriority(l->irq) != l->prio) {
+      HAL_NVIC_SetPriority(l->irq, l->prio, 0);
+      irq_fixes++;
+    }
+  }
+  return irq_fixes;
+}
@@ -0,0 +1,460 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_jpeg.c
+ * @brief          : Hardware JPEG previews of the encoder line scan
+ ******************************************************************************
+ */
+
+#include "ccd_jpeg.h"
+
+#if CCD_JPEG
+
+#include "ccd_crc.h"
+#include "usb_tx.h"
+#include "usbd_cdc_if.h"
+#include <string.h>
+
+#define JPEG_BLOCKS (CCD_JPEG_WIDTH / 8U) // 8x8 blocks, one MCU each
+#define JPEG_ROW_BYTES (8U * CCD_JPEG_WIDTH) // A row of blocks
+#define JPEG_FIFO_BYTES 32U  // MDMA buffer per FIFO threshold request
+#define JPEG_DRAIN_SPINS 64U // For the MDMA to take the last full buffer
+#define JPEG_BUFS 2U
+
+_Static_assert(CCD_JPEG_LINES == 8U || CCD_JPEG_LINES == 16U,
+               "strips are whole block rows within one MDMA block");
+_Static_assert(CCD_JPEG_OUT_SIZE % JPEG_FIFO_BYTES == 0U,
+               "the output block must be whole MDMA buffers");
+_Static_assert(CCD_JPEG_OUT_SIZE + sizeof(CCD_JpegHeader_t) <= 0xFFFFU,
+               "the image must fit payload_len");
+
+enum { STRIP_FREE, STRIP_FILLING, STRIP_FULL, STRIP_CODING };
+
+typedef struct {
+  uint8_t pixels[CCD_JPEG_LINES * CCD_JPEG_WIDTH] __attribute__((aligned(32)));
+  CCD_FrameInfo_t info; // Of the last line
+  uint16_t frame_num;
+  uint8_t rows;
+  uint8_t state;
+  uint32_t number; // Strips closed before it, for the oldest full one
+  uint32_t first_seq;
+  int32_t first_position;
+  int32_t last_position;
+} Jpeg_Strip_t;
+
+#pragma pack(push, 1)
+typedef struct {
+  CCD_JpegHeader_t hdr;
+  uint8_t data[CCD_JPEG_OUT_SIZE];
+} Jpeg_Image_t;
+#pragma pack(pop)
+
+typedef union {
+  Jpeg_Image_t image;
+  uint8_t align[(sizeof(Jpeg_Image_t) + 31U) / 32U * 32U];
+} Jpeg_Out_t;
+
+// Annex K.3: luminance DC and AC Huffman tables, BITS then HUFFVAL
+static const uint8_t jpeg_dc_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1,
+                                         1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t jpeg_dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const uint8_t jpeg_ac_bits[16] = {0, 2, 1, 3, 3, 2, 4,    3,
+                                         5, 5, 4, 4, 0, 0, 1, 0x7D};
+static const uint8_t jpeg_ac_vals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+    0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08,
+    0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3,
+    0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6,
+    0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9,
+    0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4,
+    0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA};
+
+// Annex K.1: luminance quantization at quality 50, in natural order
+static const uint8_t jpeg_quant[64] = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+    14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+    18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+
+// Natural index of each zigzag position, the order QMEM is in
+static const uint8_t jpeg_zigzag[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+static MDMA_HandleTypeDef jpeg_mdma_in;
+static MDMA_HandleTypeDef jpeg_mdma_out;
+
+// Main loop only, apart from the busy flags the TX completion clears
+static uint8_t jpeg_quality;
+static uint8_t jpeg_loaded; // Quality in QMEM0
+static uint8_t jpeg_ready;  // Codec and MDMA set up
+static Jpeg_Strip_t *jpeg_open;   // Being filled, NULL if none
+static Jpeg_Strip_t *jpeg_coding; // In the codec, NULL if idle
+static Jpeg_Out_t *jpeg_coding_out;
+static uint32_t jpeg_started; // HAL_GetTick() at its start
+static uint32_t jpeg_last;    // HAL_GetTick() at the open strip's last line
+static uint32_t jpeg_closed;
+static CCD_JpegStatus_t jpeg_stats;
+static volatile uint8_t jpeg_out_busy[JPEG_BUFS];
+
+// Strips are written by the CPU and read by the MDMA, cleaned on start;
+// images written by the MDMA and read by the USB core, invalidated on
+// start and finish, cleaned on submit
+__attribute__((aligned(32))) static Jpeg_Strip_t jpeg_strip[JPEG_BUFS];
+__attribute__((aligned(32))) static Jpeg_Out_t jpeg_out[JPEG_BUFS];
+
+// Annex C: the code and length of each HUFFVAL entry from BITS
+static uint32_t Jpeg_Codes(const uint8_t bits[16], uint16_t *code,
+                           uint8_t *len) {
+  uint32_t k = 0;
+  uint32_t c = 0;
+  for (uint32_t l = 1; l <= 16U; l++) {
+    for (uint32_t i = 0; i < bits[l - 1U]; i++) {
+      code[k] = (uint16_t)c++;
+      len[k++] = (uint8_t)l;
+    }
+    c <<= 1;
+  }
+  return k;
+}
+
+// HUFFENC_ACx/DCx: 16 bits per symbol, length - 1 and the code's low
+// byte (the bits above it are all ones in these tables). AC symbols go
+// run * 10 + size - 1, EOB at 160, ZRL at 161; the entries after them are
+// the codec's own, set as the reference manual gives them.
+static void Jpeg_HuffEnc(volatile uint32_t *mem, uint32_t entries,
+                         const uint8_t *bits, const uint8_t *vals,
+                         uint8_t ac) {
+  uint16_t e[176];
+  uint16_t code[162];
+  uint8_t len[162];
+  for (uint32_t i = 0; i < entries; i++) {
+    e[i] = (ac && i >= 168U) ? (uint16_t)(0x0FD0U + i - 168U) : 0x0FFFU;
+  }
+  uint32_t n = Jpeg_Codes(bits, code, len);
+  for (uint32_t k = 0; k < n; k++) {
+    uint32_t s = vals[k];
+    uint32_t i = s;
+    if (ac) {
+      i = (s == 0x00U) ? 160U
+          : (s == 0xF0U) ? 161U
+                         : (s >> 4) * 10U + (s & 0x0FU) - 1U;
+    }
+    e[i] = (uint16_t)(((len[k] - 1U) << 8) | (code[k] & 0xFFU));
+  }
+  for (uint32_t i = 0; i < entries / 2U; i++) {
+    mem[i] = e[2U * i] | ((uint32_t)e[2U * i + 1U] << 16);
+  }
+}
+
+// DHTMEM, which the header is written from: BITS and HUFFVAL of DC0,
+// AC0, DC1 and AC1 back to back, bytes little-endian in 103 words. Table
+// 1 gets the same tables; only table 0 is used.
+static void Jpeg_DhtMem(void) {
+  const uint8_t *parts[4] = {jpeg_dc_bits, jpeg_dc_vals, jpeg_ac_bits,
+                             jpeg_ac_vals};
+  const uint32_t sizes[4] = {16U, 12U, 16U, 162U};
+  uint32_t word = 0;
+  uint32_t n = 0;
+  for (uint32_t t = 0; t < 2U; t++) {
+    for (uint32_t p = 0; p < 4U; p++) {
+      for (uint32_t i = 0; i < sizes[p]; i++, n++) {
+        word |= (uint32_t)parts[p][i] << (8U * (n % 4U));
+        if (n % 4U == 3U) {
+          JPEG->DHTMEM[n / 4U] = word;
+          word = 0;
+        }
+      }
+    }
+  }
+}
+
+// QMEM0 in zigzag order, scaled as the IJG library does
+static void Jpeg_Quant(uint8_t quality) {
+  uint32_t scale = (quality < 50U) ? 5000U / quality : 200U - 2U * quality;
+  for (uint32_t i = 0; i < 64U; i += 4U) {
+    uint32_t word = 0;
+    for (uint32_t j = 0; j < 4U; j++) {
+      uint32_t q = (jpeg_quant[jpeg_zigzag[i + j]] * scale + 50U) / 100U;
+      q = (q < 1U) ? 1U : (q > 255U) ? 255U : q;
+      word |= q << (8U * j);
+    }
+    JPEG->QMEM0[i / 4U] = word;
+  }
+  jpeg_loaded = quality;
+}
+
+// Bytes in, words to DIR; words from DOR, bytes out. The FIFO threshold
+// flags are the MDMA requests, each moving one JPEG_FIFO_BYTES buffer.
+static uint8_t Jpeg_Mdma(MDMA_HandleTypeDef *h, MDMA_Channel_TypeDef *ch,
+                         uint8_t in) {
+  h->Instance = ch;
+  h->Init = (MDMA_InitTypeDef){
+      .Request =
+          in ? MDMA_REQUEST_JPEG_INFIFO_TH : MDMA_REQUEST_JPEG_OUTFIFO_TH,
+      .TransferTriggerMode = MDMA_BUFFER_TRANSFER,
+      .Priority = MDMA_PRIORITY_HIGH,
+      .Endianness = MDMA_LITTLE_ENDIANNESS_PRESERVE,
+      .SourceInc = in ? MDMA_SRC_INC_BYTE : MDMA_SRC_INC_DISABLE,
+      .DestinationInc = in ? MDMA_DEST_INC_DISABLE : MDMA_DEST_INC_BYTE,
+      .SourceDataSize = in ? MDMA_SRC_DATASIZE_BYTE : MDMA_SRC_DATASIZE_WORD,
+      .DestDataSize = in ? MDMA_DEST_DATASIZE_WORD : MDMA_DEST_DATASIZE_BYTE,
+      .DataAlignment = MDMA_DATAALIGN_PACKENABLE,
+      .BufferTransferLength = JPEG_FIFO_BYTES,
+      .SourceBurst = in ? MDMA_SOURCE_BURST_16BEATS : MDMA_SOURCE_BURST_4BEATS,
+      .DestBurst = in ? MDMA_DEST_BURST_4BEATS : MDMA_DEST_BURST_16BEATS,
+  };
+  return HAL_MDMA_Init(h) == HAL_OK;
+}
+
+void CCD_Jpeg_Init(void) {
+  __HAL_RCC_MDMA_CLK_ENABLE();
+  __HAL_RCC_JPGDECEN_CLK_ENABLE();
+  JPEG->CR = JPEG_CR_JCEN; // The table memories need the core enabled
+  JPEG->CONFR0 = 0;
+  JPEG->CR |= JPEG_CR_IFF | JPEG_CR_OFF;
+  JPEG->CFR = JPEG_CFR_CEOCF | JPEG_CFR_CHPDF;
+  Jpeg_HuffEnc(JPEG->HUFFENC_AC0, 176U, jpeg_ac_bits, jpeg_ac_vals, 1);
+  Jpeg_HuffEnc(JPEG->HUFFENC_AC1, 176U, jpeg_ac_bits, jpeg_ac_vals, 1);
+  Jpeg_HuffEnc(JPEG->HUFFENC_DC0, 16U, jpeg_dc_bits, jpeg_dc_vals, 0);
+  Jpeg_HuffEnc(JPEG->HUFFENC_DC1, 16U, jpeg_dc_bits, jpeg_dc_vals, 0);
+  Jpeg_DhtMem();
+  Jpeg_Quant(CCD_JPEG_QUALITY);
+  jpeg_ready = Jpeg_Mdma(&jpeg_mdma_in, CCD_JPEG_MDMA_IN, 1) &&
+               Jpeg_Mdma(&jpeg_mdma_out, CCD_JPEG_MDMA_OUT, 0);
+}
+
+uint8_t CCD_Jpeg_SetQuality(uint8_t quality) {
+  if (quality > 100U || (quality != 0 && !jpeg_ready)) {
+    return 0;
+  }
+  jpeg_quality = quality;
+  return 1;
+}
+
+void CCD_Jpeg_Status(CCD_JpegStatus_t *out) {
+  *out = jpeg_stats;
+  out->quality = jpeg_quality;
+  out->lines = CCD_JPEG_LINES;
+  out->width = CCD_BUFFER_SIZE;
+}
+
+uint8_t CCD_Jpeg_Enabled(void) { return jpeg_quality != 0; }
+
+static void Jpeg_Sent(void *ctx, uint32_t len) {
+  jpeg_out_busy[(Jpeg_Out_t *)ctx - jpeg_out] = 0;
+}
+
+static void Jpeg_Stop(void) {
+  JPEG->CONFR0 = 0;
+  HAL_MDMA_Abort(&jpeg_mdma_in);
+  HAL_MDMA_Abort(&jpeg_mdma_out);
+  JPEG->CR |= JPEG_CR_IFF | JPEG_CR_OFF;
+  JPEG->CFR = JPEG_CFR_CEOCF | JPEG_CFR_CHPDF;
+}
+
+// The oldest full strip into the codec, once an image buffer is free. The
+// rows past the image height are part of its last block row only.
+static void Jpeg_Start(void) {
+  Jpeg_Strip_t *s = NULL;
+  for (uint32_t i = 0; i < JPEG_BUFS; i++) {
+    Jpeg_Strip_t *c = &jpeg_strip[i];
+    if (c->state == STRIP_FULL && (s == NULL || c->number < s->number)) {
+      s = c;
+    }
+  }
+  uint32_t o = 0;
+  while (o < JPEG_BUFS && jpeg_out_busy[o]) {
+    o++;
+  }
+  if (jpeg_coding != NULL || s == NULL || o == JPEG_BUFS) {
+    return;
+  }
+  Jpeg_Out_t *out = &jpeg_out[o];
+  if (jpeg_quality != 0 && jpeg_quality != jpeg_loaded) {
+    Jpeg_Quant(jpeg_quality);
+  }
+  uint32_t block_rows = (s->rows + 7U) / 8U;
+  uint32_t in_len = block_rows * JPEG_ROW_BYTES;
+  JPEG->CONFR0 = 0;
+  JPEG->CR |= JPEG_CR_IFF | JPEG_CR_OFF;
+  JPEG->CFR = JPEG_CFR_CEOCF | JPEG_CFR_CHPDF;
+  // Encoding, one grayscale component, 1x1 sampling, tables 0
+  JPEG->CONFR1 = JPEG_CONFR1_HDR | ((uint32_t)s->rows << JPEG_CONFR1_YSIZE_Pos);
+  JPEG->CONFR2 = block_rows * JPEG_BLOCKS - 1U;
+  JPEG->CONFR3 = (uint32_t)CCD_BUFFER_SIZE << JPEG_CONFR3_XSIZE_Pos;
+  JPEG->CONFR4 = JPEG_CONFR4_HSF_0 | JPEG_CONFR4_VSF_0;
+  JPEG->CONFR5 = 0;
+  JPEG->CONFR6 = 0;
+  JPEG->CONFR7 = 0;
+  CCD_DCACHE_CLEAN(s->pixels, in_len);
+  CCD_DCACHE_INVALIDATE(out, sizeof(*out));
+  if (HAL_MDMA_Start(&jpeg_mdma_out, (uint32_t)&JPEG->DOR,
+                     (uint32_t)out->image.data, CCD_JPEG_OUT_SIZE,
+                     1) != HAL_OK ||
+      HAL_MDMA_Start(&jpeg_mdma_in, (uint32_t)s->pixels,
+                     (uint32_t)&JPEG->DIR, in_len, 1) != HAL_OK) {
+    Jpeg_Stop();
+    s->state = STRIP_FREE;
+    jpeg_stats.failed++;
+    return;
+  }
+  jpeg_out_busy[o] = 1;
+  s->state = STRIP_CODING;
+  jpeg_coding = s;
+  jpeg_coding_out = out;
+  jpeg_started = HAL_GetTick();
+  JPEG->CONFR0 = JPEG_CONFR0_START;
+}
+
+// End of conversion: the MDMA has what reached the FIFO threshold, the
+// CPU takes the rest, and the image is cut after its EOI marker (the last
+// word read is padded).
+static void Jpeg_Finish(void) {
+  Jpeg_Strip_t *s = jpeg_coding;
+  Jpeg_Out_t *out = jpeg_coding_out;
+  for (uint32_t i = 0; (JPEG->SR & JPEG_SR_OFTF) && i < JPEG_DRAIN_SPINS;
+       i++) {
+  }
+  uint32_t len = CCD_JPEG_OUT_SIZE -
+                 (jpeg_mdma_out.Instance->CBNDTR & MDMA_CBNDTR_BNDT);
+  HAL_MDMA_Abort(&jpeg_mdma_out);
+  CCD_DCACHE_INVALIDATE(out, sizeof(*out));
+  uint8_t *data = out->image.data;
+  while ((JPEG->SR & JPEG_SR_OFNEF) && len + 4U <= CCD_JPEG_OUT_SIZE) {
+    uint32_t word = JPEG->DOR;
+    memcpy(&data[len], &word, sizeof(word));
+    len += sizeof(word);
+  }
+  for (uint32_t i = 0; i < 3U && len >= 2U &&
+                       !(data[len - 2U] == 0xFFU && data[len - 1U] == 0xD9U);
+       i++) {
+    len--;
+  }
+  Jpeg_Stop();
+  jpeg_coding = NULL;
+  uint32_t o = (uint32_t)(out - jpeg_out);
+  if (!CDC_IsOpen_FS() || UsbTx_Space(USB_TX_FRAMES) == 0) {
+    jpeg_out_busy[o] = 0;
+    jpeg_stats.skipped += s->rows;
+    s->state = STRIP_FREE;
+    return;
+  }
+  CCD_JpegHeader_t *h = &out->image.hdr;
+  h->magic = CCD_JPEG_MAGIC;
+  h->frame_num = s->frame_num;
+  h->info = s->info;
+  h->info.header_len = sizeof(*h);
+  h->info.payload_len = (uint16_t)len;
+  h->lines = s->rows;
+  h->quality = jpeg_loaded;
+  h->width = CCD_BUFFER_SIZE;
+  h->strip = s->number + 1U;
+  h->first_seq = s->first_seq;
+  h->first_position = s->first_position;
+  h->last_position = s->last_position;
+  h->skipped = jpeg_stats.skipped;
+  h->failed = jpeg_stats.failed;
+  CCD_Crc_Stamp(h);
+  uint32_t in_bytes = s->rows * CCD_BUFFER_SIZE;
+  s->state = STRIP_FREE;
+  if (UsbTx_Submit(USB_TX_FRAMES, (const uint8_t *)h, sizeof(*h) + len,
+                   Jpeg_Sent, out)) {
+    jpeg_stats.strips++;
+    jpeg_stats.bytes_in += in_bytes;
+    jpeg_stats.bytes_out += len;
+  } else {
+    jpeg_out_busy[o] = 0;
+    jpeg_stats.skipped += h->lines;
+  }
+}
+
+// Light to 8 bits, into row r of its block row: 8 bytes in each block
+CCD_ITCM static void Jpeg_Row(Jpeg_Strip_t *s, const uint16_t *px,
+                              uint32_t r) {
+  uint8_t *dst = &s->pixels[(r / 8U) * JPEG_ROW_BYTES + (r % 8U) * 8U];
+  for (uint32_t x = 0; x < CCD_JPEG_WIDTH; x++) {
+    uint32_t v = px[(x < CCD_BUFFER_SIZE) ? x : CCD_BUFFER_SIZE - 1U];
+    dst[(x / 8U) * 64U + x % 8U] = (uint8_t)((0xFFFFU - v) >> 8);
+  }
+}
+
+// The rest of the last block row repeats its last line, so the empty
+// rows add no edge to the blocks the decoder keeps
+static void Jpeg_Close(void) {
+  Jpeg_Strip_t *s = jpeg_open;
+  jpeg_open = NULL;
+  uint32_t last = s->rows - 1U;
+  const uint8_t *src =
+      &s->pixels[(last / 8U) * JPEG_ROW_BYTES + (last % 8U) * 8U];
+  for (uint32_t r = s->rows; r % 8U != 0; r++) {
+    uint8_t *dst = &s->pixels[(r / 8U) * JPEG_ROW_BYTES + (r % 8U) * 8U];
+    for (uint32_t b = 0; b < JPEG_BLOCKS; b++) {
+      memcpy(&dst[b * 64U], &src[b * 64U], 8U);
+    }
+  }
+  s->number = jpeg_closed++;
+  s->state = STRIP_FULL;
+}
+
+void CCD_Jpeg_Line(const CCD_Frame_t *frame, int32_t position) {
+  jpeg_stats.lines_in++;
+  Jpeg_Strip_t *s = jpeg_open;
+  for (uint32_t i = 0; s == NULL && i < JPEG_BUFS; i++) {
+    if (jpeg_strip[i].state == STRIP_FREE) {
+      s = &jpeg_strip[i];
+      s->rows = 0;
+      s->state = STRIP_FILLING;
+      s->first_seq = frame->info.seq;
+      s->first_position = position;
+      jpeg_open = s;
+    }
+  }
+  if (s == NULL) {
+    jpeg_stats.skipped++;
+    return;
+  }
+  Jpeg_Row(s, frame->pixels, s->rows++);
+  s->info = frame->info;
+  s->frame_num = frame->frame_num;
+  s->last_position = position;
+  jpeg_last = HAL_GetTick();
+  if (s->rows == CCD_JPEG_LINES) {
+    Jpeg_Close();
+    Jpeg_Start();
+  }
+}
+
+void CCD_Jpeg_Flush(void) {
+  if (jpeg_open != NULL) {
+    Jpeg_Close();
+  }
+}
+
+void CCD_Jpeg_Poll(void) {
+  if (jpeg_coding != NULL) {
+    if (JPEG->SR & JPEG_SR_EOCF) {
+      Jpeg_Finish();
+    } else if (HAL_GetTick() - jpeg_started >= CCD_JPEG_TIMEOUT_MS) {
+      Jpeg_Stop(); // Its image outgrew CCD_JPEG_OUT_SIZE
+      jpeg_out_busy[jpeg_coding_out - jpeg_out] = 0;
+      jpeg_coding->state = STRIP_FREE;
+      jpeg_coding = NULL;
+      jpeg_stats.failed++;
+    }
+  }
+  if (jpeg_open != NULL && HAL_GetTick() - jpeg_last >= CCD_JPEG_FLUSH_MS) {
+    Jpeg_Close();
+  }
+  Jpeg_Start();
+}
+
+#endif /* CCD_JPEG */
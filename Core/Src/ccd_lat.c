@@ -0,0 +1,150 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_lat.c
+ * @brief          : Frame latency and re-arm jitter telemetry
+ ******************************************************************************
+ */
+
+#include "ccd_lat.h"
+#include "ccd_acq.h"
+#include "ccd_clock.h"
+#include "ccd_time.h"
+#include "frame_ring.h"
+#include <string.h>
+
+#define LAT_MASK (CCD_LAT_WINDOW - 1U)
+
+_Static_assert((CCD_LAT_WINDOW & LAT_MASK) == 0,
+               "the windows wrap with a mask");
+
+typedef struct {
+  uint32_t values[CCD_LAT_WINDOW];
+  uint32_t next;  // Values ever written since the reset
+  uint32_t epoch; // lat_epoch the window was last started over for
+} Lat_Window_t;
+
+// A frame between Ready and Sent, per ring slot. Written by the main loop
+// before the submit and read by the TX completion after it.
+typedef struct {
+  uint32_t icg; // Low words of the cycle times; spans stay below 2^32
+  uint32_t dma;
+  uint32_t ready;
+  uint8_t valid;
+} Lat_Slot_t;
+
+// Written from the ICG and USB interrupts, so they live in DTCM
+CCD_DTCM_BSS static Lat_Window_t lat_win[CCD_LAT_COUNT];
+CCD_DTCM_BSS static Lat_Slot_t lat_slot[FRAME_RING_SLOTS];
+CCD_DTCM_BSS static volatile uint32_t lat_epoch;   // Bumped by a reset
+CCD_DTCM_BSS static volatile uint32_t lat_alarms;  // The re-arm writer's
+CCD_DTCM_BSS static volatile uint32_t lat_arm_worst; // Ticks, same writer
+CCD_DTCM_BSS static volatile uint32_t lat_arm_limit; // TIM2 ticks
+
+// Writer side: a reset since the window's last value clears it first
+CCD_ITCM static void Lat_Add(uint8_t metric, uint32_t cycles) {
+  Lat_Window_t *w = &lat_win[metric];
+  uint32_t epoch = lat_epoch;
+  if (w->epoch != epoch) {
+    w->epoch = epoch;
+    w->next = 0;
+    if (metric == CCD_LAT_ARM) {
+      lat_alarms = 0;
+      lat_arm_worst = 0;
+    }
+  }
+  w->values[w->next & LAT_MASK] = cycles;
+  w->next++;
+}
+
+CCD_ITCM void CCD_Lat_Arm(uint32_t ticks) {
+  uint32_t limit = lat_arm_limit;
+  Lat_Add(CCD_LAT_ARM, ticks * CCD_TIME_PER_TICK);
+  if (ticks > lat_arm_worst) {
+    lat_arm_worst = ticks;
+  }
+  if (ticks * 100U > limit * CCD_LAT_ARM_MARGIN_PCT) {
+    lat_alarms++;
+  }
+}
+
+void CCD_Lat_SetArmLimit(uint32_t ticks) { lat_arm_limit = ticks; }
+
+// Bench frames are made whole at their timestamp (ccd_bench.h)
+void CCD_Lat_Ready(const CCD_Frame_t *frame, uint64_t icg) {
+  uint32_t slot = FrameRing_Slot(frame);
+  if (slot == FRAME_RING_SLOTS) {
+    return;
+  }
+  Lat_Slot_t *s = &lat_slot[slot];
+  s->icg = (uint32_t)icg;
+  s->dma = s->icg;
+  if (frame->info.exposure_us != 0) {
+    s->dma += CCD_Acq_ReadoutCycles();
+  }
+  s->ready = (uint32_t)CCD_Time_Now();
+  s->valid = 1;
+}
+
+CCD_ITCM void CCD_Lat_Sent(const CCD_Frame_t *first, uint32_t n) {
+  uint32_t slot = FrameRing_Slot(first);
+  if (slot == FRAME_RING_SLOTS) {
+    return;
+  }
+  uint32_t now = (uint32_t)CCD_Time_Now();
+  for (uint32_t i = 0; i < n; i++) {
+    Lat_Slot_t *s = &lat_slot[(slot + i) % FRAME_RING_SLOTS];
+    if (!s->valid) {
+      continue;
+    }
+    s->valid = 0;
+    Lat_Add(CCD_LAT_READY, s->ready - s->dma);
+    Lat_Add(CCD_LAT_SENT, now - s->ready);
+    Lat_Add(CCD_LAT_TOTAL, now - s->icg);
+  }
+}
+
+// A sorted copy of the window; a value the writer replaces meanwhile only
+// swaps one sample for a newer one
+static uint32_t Lat_Stat(uint8_t metric, CCD_LatStat_t *out) {
+  const Lat_Window_t *w = &lat_win[metric];
+  uint32_t v[CCD_LAT_WINDOW];
+  uint32_t n = (w->epoch == lat_epoch) ? w->next : 0;
+  if (n > CCD_LAT_WINDOW) {
+    n = CCD_LAT_WINDOW;
+  }
+  memset(out, 0, sizeof(*out));
+  if (n == 0) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t x = w->values[i], j = i;
+    for (; j > 0 && v[j - 1U] > x; j--) {
+      v[j] = v[j - 1U];
+    }
+    v[j] = x;
+  }
+  out->p50 = v[(n - 1U) * 50U / 100U];
+  out->p99 = v[(n - 1U) * 99U / 100U];
+  out->max = v[n - 1U];
+  return n;
+}
+
+void CCD_Lat_Read(CCD_LatReport_t *out, uint8_t reset) {
+  memset(out, 0, sizeof(*out));
+  for (uint8_t m = 0; m < CCD_LAT_COUNT; m++) {
+    uint32_t n = Lat_Stat(m, &out->stat[m]);
+    if (m == CCD_LAT_ARM) {
+      out->arms = (uint16_t)n;
+    } else if (m == CCD_LAT_TOTAL) {
+      out->frames = (uint16_t)n;
+    }
+  }
+  uint32_t cycles = CCD_TIME_PER_TICK;
+  uint8_t fresh = (lat_win[CCD_LAT_ARM].epoch == lat_epoch);
+  out->alarms = fresh ? lat_alarms : 0;
+  out->arm_limit = lat_arm_limit * cycles;
+  out->arm_worst = fresh ? lat_arm_worst * cycles : 0;
+  if (reset) {
+    lat_epoch++;
+  }
+}
@@ -0,0 +1,296 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_line.c
+ * @brief          : Encoder-synchronised line scan, shipped in 2D tiles
+ ******************************************************************************
+ */
+
+#include "ccd_line.h"
+
+#if CCD_ENCODER
+
+#include "ccd_crc.h"
+#include "ccd_irq.h"
+#include "ccd_jpeg.h"
+#include "ccd_mem.h"
+#include "ccd_time.h"
+#include "ccd_timing.h"
+#include "frame_ring.h"
+#include "stm32h7xx_ll_tim.h"
+#include "usb_tx.h"
+#include "usbd_cdc_if.h"
+#include <string.h>
+
+#define LINE_EVENTS 8U // Boundaries queued for their frames, a power of 2
+#define LINE_FILTER LL_TIM_IC_FILTER_FDIV16_N8 // 8 samples at fDTS / 16
+
+#pragma pack(push, 1)
+typedef struct {
+  CCD_LineTileHeader_t hdr;
+  CCD_LineEntry_t lines[CCD_LINE_TILE_LINES];
+  uint16_t pixels[CCD_LINE_TILE_LINES][CCD_BUFFER_SIZE];
+} Line_Tile_t;
+#pragma pack(pop)
+
+_Static_assert(CCD_LINE_TILE_LINES >= 1U && CCD_LINE_TILE_LINES <= 8U,
+               "the tile payload must fit payload_len");
+_Static_assert(sizeof(Line_Tile_t) - sizeof(CCD_LineTileHeader_t) <= 0xFFFFU,
+               "the tile payload must fit payload_len");
+_Static_assert(CCD_LINE_TILE_BUFS * sizeof(Line_Tile_t) <= CCD_MEM_SCRATCH_SIZE,
+               "the tiles fit the scratch");
+
+typedef struct {
+  uint64_t time;    // CCD_Time_Now() in the update interrupt
+  int32_t position; // Encoder counts at the boundary
+} Line_Event_t;
+
+// Encoder interrupt and mode change
+static volatile uint16_t line_pitch; // Set, 0 = off
+static uint16_t line_applied;        // TIM8 counts at, 0 = the full range
+static volatile uint8_t line_armed;  // TIM2 takes ITR1
+static volatile int32_t line_base;   // Position at TIM8 CNT = 0
+static volatile uint32_t line_missed;
+static Line_Event_t line_events[LINE_EVENTS];
+static volatile uint32_t line_head; // Written by the interrupt only
+static uint32_t line_tail;          // Main loop only
+
+// Main loop only, apart from the busy flags the TX completion clears
+static Line_Tile_t *line_open; // Being filled, NULL if none
+static uint32_t line_last;     // HAL_GetTick() at its last line
+static uint32_t line_tiles;
+static uint32_t line_dropped;
+static volatile uint8_t line_busy[CCD_LINE_TILE_BUFS];
+
+// The scratch's (ccd_mem.h), claimed for the first line and released once
+// the scan is over and both tiles have gone out; NULL while not held.
+// Filled by the CPU and read by the USB core, cleaned on submit.
+static Line_Tile_t *line_tile;
+
+// x4 quadrature on TI1/TI2, ARR the counts per line (the whole 16 bits
+// while off) and TRGO on the update, which either direction gives. URS
+// keeps the counter resets here from interrupting.
+void CCD_Line_Init(void) {
+  GPIO_InitTypeDef gpio = {0};
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  gpio.Pin = CCD_ENC_A_Pin | CCD_ENC_B_Pin;
+  gpio.Mode = GPIO_MODE_AF_PP;
+  gpio.Pull = GPIO_PULLUP; // Open-collector encoder outputs
+  gpio.Speed = GPIO_SPEED_FREQ_LOW;
+  gpio.Alternate = GPIO_AF3_TIM8;
+  HAL_GPIO_Init(CCD_ENC_GPIO_Port, &gpio);
+
+  __HAL_RCC_TIM8_CLK_ENABLE();
+  __HAL_RCC_TIM8_FORCE_RESET();
+  __HAL_RCC_TIM8_RELEASE_RESET();
+  LL_TIM_IC_SetActiveInput(TIM8, LL_TIM_CHANNEL_CH1,
+                           LL_TIM_ACTIVEINPUT_DIRECTTI);
+  LL_TIM_IC_SetActiveInput(TIM8, LL_TIM_CHANNEL_CH2,
+                           LL_TIM_ACTIVEINPUT_DIRECTTI);
+  LL_TIM_IC_SetFilter(TIM8, LL_TIM_CHANNEL_CH1, LINE_FILTER);
+  LL_TIM_IC_SetFilter(TIM8, LL_TIM_CHANNEL_CH2, LINE_FILTER);
+  LL_TIM_SetEncoderMode(TIM8, LL_TIM_ENCODERMODE_X4_TI12);
+  LL_TIM_SetAutoReload(TIM8, 0xFFFFU);
+  LL_TIM_SetUpdateSource(TIM8, LL_TIM_UPDATESOURCE_COUNTER);
+  LL_TIM_SetTriggerOutput(TIM8, LL_TIM_TRGO_UPDATE);
+  LL_TIM_ClearFlag_UPDATE(TIM8);
+  LL_TIM_EnableIT_UPDATE(TIM8);
+  HAL_NVIC_SetPriority(TIM8_UP_TIM13_IRQn, CCD_IRQ_PRIO_TRIG, 0);
+  HAL_NVIC_EnableIRQ(TIM8_UP_TIM13_IRQn);
+  LL_TIM_EnableCounter(TIM8);
+}
+
+void CCD_Line_SetPitch(uint16_t pitch) { line_pitch = pitch; }
+
+// Which way the boundary was crossed comes from CNT, just past 0 going up
+// and just below ARR going down: DIR follows the last step, so a reversal
+// right at the boundary would count it the wrong way for good. A frame
+// started by this update finds TIM2 counting from just 0.
+CCD_ITCM void CCD_Line_EncoderIRQ(void) {
+  LL_TIM_ClearFlag_UPDATE(TIM8);
+  uint64_t now = CCD_Time_Now();
+  uint32_t pitch = LL_TIM_GetAutoReload(TIM8) + 1U;
+  uint8_t up = (pitch > 1U) ? (LL_TIM_GetCounter(TIM8) < pitch / 2U)
+                            : (LL_TIM_GetDirection(TIM8) ==
+                               LL_TIM_COUNTERDIRECTION_UP);
+  int32_t position = line_base;
+  if (up) {
+    position += (int32_t)pitch;
+    line_base = position;
+  } else {
+    line_base = position - (int32_t)pitch;
+  }
+  if (!line_armed) {
+    return;
+  }
+  if (!LL_TIM_IsEnabledCounter(TIM2) ||
+      LL_TIM_GetCounter(TIM2) >= CCD_US_TICKS(CCD_LINE_ACCEPT_US)) {
+    line_missed++;
+    return;
+  }
+  uint32_t head = line_head;
+  if (head - line_tail < LINE_EVENTS) {
+    Line_Event_t *e = &line_events[head % LINE_EVENTS];
+    e->time = now;
+    e->position = position;
+    line_head = head + 1U;
+  }
+}
+
+// The boundary that started the frame with this ICG time. Older ones
+// started frames the ring dropped.
+static int32_t Line_Match(uint64_t icg) {
+  uint64_t slack = (uint64_t)CCD_LINE_MATCH_US * (CCD_TIME_HZ / 1000000U);
+  while (line_tail != line_head) {
+    const Line_Event_t *e = &line_events[line_tail % LINE_EVENTS];
+    if (e->time > icg + slack) {
+      break; // A later frame's
+    }
+    line_tail++;
+    if (e->time + slack >= icg) {
+      return e->position;
+    }
+  }
+  return CCD_LINE_POS_NONE;
+}
+
+static uint8_t Line_Busy(void) {
+  for (uint32_t i = 0; i < CCD_LINE_TILE_BUFS; i++) {
+    if (line_busy[i]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void Line_Sent(void *ctx, uint32_t len) {
+  line_busy[(Line_Tile_t *)ctx - line_tile] = 0;
+}
+
+static void Line_Emit(void) {
+  Line_Tile_t *t = line_open;
+  line_open = NULL;
+  uint32_t lines = t->hdr.lines;
+  if (!CDC_IsOpen_FS() || UsbTx_Space(USB_TX_FRAMES) == 0) {
+    line_dropped += lines;
+    return;
+  }
+  memset(&t->lines[lines], 0,
+         (CCD_LINE_TILE_LINES - lines) * sizeof(CCD_LineEntry_t));
+  uint32_t payload = sizeof(t->lines) + lines * sizeof(t->pixels[0]);
+  t->hdr.magic = CCD_LINE_MAGIC;
+  t->hdr.info.header_len = sizeof(t->hdr);
+  t->hdr.info.payload_len = (uint16_t)payload;
+  t->hdr.capacity = CCD_LINE_TILE_LINES;
+  t->hdr.pitch = line_applied;
+  t->hdr.missed = line_missed;
+  t->hdr.dropped = line_dropped;
+  CCD_Crc_Stamp(t);
+  uint32_t i = (uint32_t)(t - line_tile);
+  line_busy[i] = 1;
+  if (UsbTx_Submit(USB_TX_FRAMES, (const uint8_t *)t, sizeof(t->hdr) + payload,
+                   Line_Sent, t)) {
+    line_tiles++;
+  } else {
+    line_busy[i] = 0;
+    line_dropped += lines;
+  }
+}
+
+uint8_t CCD_Line_Apply(uint8_t triggered) {
+  if (line_open != NULL) {
+    Line_Emit();
+  }
+#if CCD_JPEG
+  CCD_Jpeg_Flush();
+#endif
+  uint16_t pitch = line_pitch;
+  if (pitch != line_applied) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    LL_TIM_SetAutoReload(TIM8, (pitch != 0) ? pitch - 1U : 0xFFFFU);
+    LL_TIM_SetCounter(TIM8, 0);
+    line_base = 0;
+    __set_PRIMASK(primask);
+    line_applied = pitch;
+  }
+  line_armed = triggered && pitch != 0;
+  line_tail = line_head; // Boundaries of the last run
+  return line_armed;
+}
+
+void CCD_Line_Status(CCD_LineStatus_t *out) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  out->position = line_base + (int32_t)LL_TIM_GetCounter(TIM8);
+  __set_PRIMASK(primask);
+  out->pitch = line_pitch;
+  out->active = line_armed;
+  out->lines = CCD_LINE_TILE_LINES;
+  out->tiles = line_tiles;
+  out->missed = line_missed;
+  out->dropped = line_dropped;
+}
+
+uint8_t CCD_Line_Active(void) { return line_armed; }
+
+void CCD_Line_Frame(CCD_Frame_t *frame) {
+  int32_t position = Line_Match(frame->info.timestamp);
+#if CCD_JPEG
+  if (CCD_Jpeg_Enabled()) {
+    CCD_Jpeg_Line(frame, position); // Previewed instead of shipped whole
+    FrameRing_Release(frame, 1);
+    return;
+  }
+#endif
+  Line_Tile_t *t = line_open;
+  if (t == NULL && line_tile == NULL) {
+    line_tile = CCD_Mem_Claim(CCD_MEM_LINE, NULL); // NULL: a run has it
+  }
+  for (uint32_t i = 0; t == NULL && i < CCD_LINE_TILE_BUFS; i++) {
+    if (line_tile != NULL && !line_busy[i]) {
+      t = &line_tile[i];
+      t->hdr.lines = 0;
+      line_open = t;
+    }
+  }
+  if (t == NULL) {
+    line_dropped++;
+    FrameRing_Release(frame, 1);
+    return;
+  }
+  uint32_t k = t->hdr.lines++;
+  t->lines[k].seq = frame->info.seq;
+  t->lines[k].position = position;
+  t->lines[k].timestamp = frame->info.timestamp;
+  memcpy(t->pixels[k], frame->pixels, sizeof(frame->pixels));
+  t->hdr.frame_num = frame->frame_num;
+  t->hdr.info = frame->info;
+  line_last = HAL_GetTick();
+  FrameRing_Release(frame, 1);
+  if (t->hdr.lines == CCD_LINE_TILE_LINES) {
+    Line_Emit();
+  }
+}
+
+void CCD_Line_Recorded(const CCD_Frame_t *frame) {
+  int32_t position = Line_Match(frame->info.timestamp);
+#if CCD_JPEG
+  if (CCD_Jpeg_Enabled()) {
+    CCD_Jpeg_Line(frame, position);
+  }
+#else
+  (void)position;
+#endif
+}
+
+void CCD_Line_Poll(void) {
+  if (line_open != NULL && HAL_GetTick() - line_last >= CCD_LINE_FLUSH_MS) {
+    Line_Emit();
+  }
+  if (line_tile != NULL && !line_armed && line_open == NULL && !Line_Busy()) {
+    line_tile = NULL;
+    CCD_Mem_Release(CCD_MEM_LINE);
+  }
+}
+
+#endif /* CCD_ENCODER */
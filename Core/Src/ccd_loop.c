@@ -0,0 +1,275 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_loop.c
+ * @brief          : USB link tests: echo, sink and source
+ ******************************************************************************
+ */
+
+#include "ccd_loop.h"
+#include "ccd_mem.h"
+#include "ccd_time.h"
+#include "usb_tx.h"
+#include "usbd_cdc_if.h"
+#include <string.h>
+
+#define LOOP_HDR sizeof(CCD_LoopHeader_t)
+
+// loop_echo_state
+#define LOOP_ECHO_FREE 0
+#define LOOP_ECHO_READY 1 // Copied by the RX interrupt
+#define LOOP_ECHO_SENT 2  // Queued on the link
+
+typedef struct {
+  CCD_LoopHeader_t hdr;
+  uint8_t zero[CCD_LOOP_CHUNK - LOOP_HDR];
+} Loop_Msg_t;
+
+_Static_assert(CCD_LOOP_CHUNK <= 0xFFFFU, "the header length is 16 bits");
+_Static_assert(CCD_LOOP_BUFS * sizeof(Loop_Msg_t) <= CCD_MEM_SCRATCH_SIZE,
+               "the source messages fit the scratch");
+
+// The source's messages are in the scratch (ccd_mem.h), held from the
+// start of a source test until its last message has left
+static Loop_Msg_t *loop_src; // NULL while the scratch is not held
+__attribute__((aligned(32))) static uint8_t loop_echo[CCD_LOOP_ECHO_MAX];
+
+// Set by CCD_Loop_Start() before loop_running, read by the interrupts
+static volatile uint8_t loop_running;
+static volatile uint8_t loop_test = CCD_LOOP_NONE;
+static volatile uint8_t loop_port;
+static volatile uint32_t loop_count;
+static uint32_t loop_tests;
+
+// RX and TX completion interrupts of the port
+static volatile uint32_t loop_done;
+static volatile uint32_t loop_packets;
+static volatile uint32_t loop_dropped;
+static volatile uint8_t loop_started; // loop_first is set
+static volatile uint64_t loop_first;  // CCD_Time_Now()
+static volatile uint64_t loop_last;
+static volatile uint8_t loop_src_busy[CCD_LOOP_BUFS];
+static volatile uint8_t loop_echo_state;
+static volatile uint32_t loop_echo_len;
+static volatile uint64_t loop_echo_rx;
+
+// Main loop
+static uint32_t loop_sent; // Source bytes queued
+static uint32_t loop_seq;
+static uint32_t loop_hold_max; // us
+static uint32_t loop_hold_sum;
+static uint32_t loop_seen; // loop_done + loop_packets at loop_seen_tick
+static uint32_t loop_seen_tick;
+
+static uint32_t Loop_Us(uint64_t cycles) {
+  uint64_t us = cycles / (CCD_TIME_HZ / 1000000U);
+  return (us > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)us;
+}
+
+static void Loop_Moved(uint64_t now) {
+  if (!loop_started) {
+    loop_first = now;
+    loop_started = 1;
+  }
+  loop_last = now;
+}
+
+// The source on the frame endpoint, the echo with the acks
+static UsbTx_Link_t *Loop_Link(uint8_t source) {
+  if (loop_port == CCD_LOOP_HS) {
+    return &usb_tx_hs;
+  }
+  return source ? USB_TX_FRAMES : &usb_tx_fs;
+}
+
+static uint8_t Loop_Busy(void) {
+  if (loop_echo_state != LOOP_ECHO_FREE) {
+    return 1;
+  }
+  for (uint32_t i = 0; i < CCD_LOOP_BUFS; i++) {
+    if (loop_src_busy[i]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A test stopped or timed out still frees what it had on the link
+static void Loop_EchoSent(void *ctx, uint32_t len) {
+  UNUSED(ctx);
+  UNUSED(len);
+  loop_echo_state = LOOP_ECHO_FREE;
+  if (!loop_running) {
+    return;
+  }
+  Loop_Moved(CCD_Time_Now());
+  if (++loop_done >= loop_count) {
+    loop_running = 0;
+  }
+}
+
+static void Loop_SourceSent(void *ctx, uint32_t len) {
+  loop_src_busy[(Loop_Msg_t *)ctx - loop_src] = 0;
+  if (!loop_running) {
+    return;
+  }
+  Loop_Moved(CCD_Time_Now());
+  loop_packets++;
+  loop_done += len;
+  if (loop_done >= loop_count) {
+    loop_running = 0;
+  }
+}
+
+uint8_t CCD_Loop_Start(uint8_t test, uint8_t port, uint32_t count) {
+  if (test == CCD_LOOP_SOURCE) {
+    count = (count + LOOP_HDR - 1U) & ~(LOOP_HDR - 1U); // 0 past the top
+  }
+  if (loop_running || Loop_Busy() || test > CCD_LOOP_SOURCE ||
+      port > CCD_LOOP_HS || count == 0 ||
+      !((port == CCD_LOOP_HS) ? CDC_IsOpen_HS() : CDC_IsOpen_FS())) {
+    return 0;
+  }
+  if (test == CCD_LOOP_SOURCE) {
+    loop_src = CCD_Mem_Claim(CCD_MEM_LOOP, NULL);
+    if (loop_src == NULL) {
+      return 0; // Held by another mode
+    }
+    memset(loop_src, 0, CCD_LOOP_BUFS * sizeof(Loop_Msg_t));
+  }
+  loop_test = test;
+  loop_port = port;
+  loop_count = count;
+  loop_done = 0;
+  loop_packets = 0;
+  loop_dropped = 0;
+  loop_started = 0;
+  loop_sent = 0;
+  loop_seq = 0;
+  loop_hold_max = 0;
+  loop_hold_sum = 0;
+  loop_seen = 0;
+  loop_seen_tick = HAL_GetTick();
+  loop_tests++;
+  __DMB(); // The interrupts see the test whole
+  loop_running = 1;
+  return 1;
+}
+
+void CCD_Loop_Stop(void) { loop_running = 0; }
+
+// The sink takes what it still wants of the packet; the echo takes the
+// packets that are its own, whole, and leaves the rest to the commands
+uint32_t CCD_Loop_Receive(uint8_t port, const uint8_t *buf, uint32_t len) {
+  if (!loop_running || port != loop_port || loop_test == CCD_LOOP_SOURCE) {
+    return 0;
+  }
+  uint64_t now = CCD_Time_Now();
+  if (loop_test == CCD_LOOP_SINK) {
+    uint32_t n = loop_count - loop_done;
+    if (n > len) {
+      n = len;
+    }
+    Loop_Moved(now);
+    loop_packets++;
+    loop_done += n;
+    if (loop_done >= loop_count) {
+      loop_running = 0;
+    }
+    return n;
+  }
+  if (len < LOOP_HDR || buf[0] != (CCD_LOOP_MAGIC & 0xFFU) ||
+      buf[1] != (CCD_LOOP_MAGIC >> 8)) {
+    return 0;
+  }
+  loop_packets++;
+  if (loop_echo_state != LOOP_ECHO_FREE) {
+    loop_dropped++;
+    return len;
+  }
+  uint32_t n = (len > CCD_LOOP_ECHO_MAX) ? CCD_LOOP_ECHO_MAX : len;
+  memcpy(loop_echo, buf, n);
+  loop_echo_len = n;
+  loop_echo_rx = now;
+  Loop_Moved(now);
+  loop_echo_state = LOOP_ECHO_READY;
+  return len;
+}
+
+// The source leaves the FS command link a slot for the acks
+uint8_t CCD_Loop_Poll(void) {
+  if (!loop_running) {
+    if (loop_src != NULL && !Loop_Busy()) {
+      loop_src = NULL;
+      CCD_Mem_Release(CCD_MEM_LOOP);
+    }
+    return 0;
+  }
+  uint32_t tick = HAL_GetTick();
+  uint32_t seen = loop_done + loop_packets;
+  if (seen != loop_seen) {
+    loop_seen = seen;
+    loop_seen_tick = tick;
+  } else if (tick - loop_seen_tick >= CCD_LOOP_TIMEOUT_MS) {
+    loop_running = 0;
+    return 0;
+  }
+
+  if (loop_test == CCD_LOOP_ECHO && loop_echo_state == LOOP_ECHO_READY) {
+    UsbTx_Link_t *link = Loop_Link(0);
+    if (UsbTx_Space(link) > 0) {
+      uint32_t hold = Loop_Us(CCD_Time_Now() - loop_echo_rx);
+      loop_echo_state = LOOP_ECHO_SENT;
+      if (UsbTx_Submit(link, loop_echo, loop_echo_len, Loop_EchoSent, NULL)) {
+        loop_hold_sum += hold;
+        if (hold > loop_hold_max) {
+          loop_hold_max = hold;
+        }
+      } else {
+        loop_echo_state = LOOP_ECHO_READY;
+      }
+    }
+  } else if (loop_test == CCD_LOOP_SOURCE) {
+    UsbTx_Link_t *link = Loop_Link(1);
+    for (uint32_t i = 0; i < CCD_LOOP_BUFS && loop_sent < loop_count; i++) {
+      if (loop_src_busy[i]) {
+        continue;
+      }
+      if (UsbTx_Space(link) <= 1U) {
+        break;
+      }
+      uint32_t n = loop_count - loop_sent;
+      if (n > CCD_LOOP_CHUNK) {
+        n = CCD_LOOP_CHUNK;
+      }
+      Loop_Msg_t *m = &loop_src[i];
+      m->hdr.magic = CCD_LOOP_MAGIC;
+      m->hdr.len = (uint16_t)n;
+      m->hdr.seq = loop_seq;
+      loop_src_busy[i] = 1;
+      if (!loop_started) {
+        Loop_Moved(CCD_Time_Now()); // First byte out: the first queued
+      }
+      if (!UsbTx_Submit(link, (const uint8_t *)m, n, Loop_SourceSent, m)) {
+        loop_src_busy[i] = 0;
+        break;
+      }
+      loop_seq++;
+      loop_sent += n;
+    }
+  }
+  return 1;
+}
+
+void CCD_Loop_Status(CCD_LoopStatus_t *out) {
+  out->test = loop_test;
+  out->port = loop_port;
+  out->running = loop_running;
+  out->count = loop_count;
+  out->done = loop_done;
+  out->packets = loop_packets;
+  out->elapsed_us = loop_started ? Loop_Us(loop_last - loop_first) : 0;
+  out->dropped = loop_dropped;
+  out->hold_max_us = loop_hold_max;
+  out->hold_sum_us = loop_hold_sum;
+  out->tests = loop_tests;
+}
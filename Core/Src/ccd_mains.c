@@ -0,0 +1,234 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_mains.c
+ * @brief          : Frames locked to the mains zero crossing
+ ******************************************************************************
+ */
+
+#include "ccd_mains.h"
+
+#if CCD_LINE_SYNC
+
+#include "ccd_acq.h"
+#include "ccd_irq.h"
+#include "ccd_timing.h"
+#include "stm32h7xx_ll_tim.h"
+
+#define MAINS_FILTER LL_TIM_IC_FILTER_FDIV32_N8 // 8 samples at fDTS / 32
+#define MAINS_AVG_SHIFT 3U // Average over about 8 periods
+#define MAINS_SLACK_US 2U  // CNT to the compare, for the writes between
+
+// Settings
+static volatile uint16_t mains_phase;
+static volatile uint8_t mains_periods = 1;
+
+// Capture interrupt
+static uint8_t mains_seen;            // mains_last holds a crossing
+static uint16_t mains_last;           // TIM8 CNT at it
+static volatile uint32_t mains_tick;  // HAL_GetTick() at it
+static volatile uint32_t mains_good;  // Good periods in a row
+static volatile uint32_t mains_avg16; // Period, 1/16 us
+static volatile uint8_t mains_locked;
+static volatile uint8_t mains_armed; // CH2 waits for its compare
+static uint32_t mains_since;         // Crossings since the last arm
+static volatile uint32_t mains_crossings;
+static volatile uint32_t mains_glitches;
+static volatile uint32_t mains_triggers;
+static volatile uint32_t mains_dev_max;
+static volatile uint32_t mains_late;
+
+// Set with the chain stopped, read by the interrupt
+static volatile uint8_t mains_enabled;
+static volatile uint8_t mains_applied; // mains_used is from a lock
+static volatile uint8_t mains_used;
+
+// Rising edges on CH1, captured against a 1 us count; CH2 compares
+// without a pin, its reference on TRGO. CNT runs free: a glitch then
+// moves nothing, where a reset on TI1 would move the phase.
+void CCD_Mains_Init(void) {
+  GPIO_InitTypeDef gpio = {0};
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  gpio.Pin = CCD_MAINS_Pin;
+  gpio.Mode = GPIO_MODE_AF_PP;
+  gpio.Pull = GPIO_PULLUP; // Open-collector opto output
+  gpio.Speed = GPIO_SPEED_FREQ_LOW;
+  gpio.Alternate = GPIO_AF3_TIM8;
+  HAL_GPIO_Init(CCD_MAINS_GPIO_Port, &gpio);
+
+  __HAL_RCC_TIM8_CLK_ENABLE();
+  __HAL_RCC_TIM8_FORCE_RESET();
+  __HAL_RCC_TIM8_RELEASE_RESET();
+  LL_TIM_SetPrescaler(TIM8, CCD_TICKS_PER_US - 1U);
+  LL_TIM_SetAutoReload(TIM8, 0xFFFFU);
+  LL_TIM_IC_SetActiveInput(TIM8, LL_TIM_CHANNEL_CH1,
+                           LL_TIM_ACTIVEINPUT_DIRECTTI);
+  LL_TIM_IC_SetFilter(TIM8, LL_TIM_CHANNEL_CH1, MAINS_FILTER);
+  LL_TIM_IC_SetPolarity(TIM8, LL_TIM_CHANNEL_CH1, LL_TIM_IC_POLARITY_RISING);
+  LL_TIM_CC_EnableChannel(TIM8, LL_TIM_CHANNEL_CH1);
+  LL_TIM_OC_SetMode(TIM8, LL_TIM_CHANNEL_CH2, LL_TIM_OCMODE_FORCED_INACTIVE);
+  LL_TIM_SetTriggerOutput(TIM8, LL_TIM_TRGO_OC2REF);
+  LL_TIM_GenerateEvent_UPDATE(TIM8); // Loads the prescaler
+  LL_TIM_ClearFlag_UPDATE(TIM8);
+  LL_TIM_ClearFlag_CC1(TIM8);
+  LL_TIM_ClearFlag_CC2(TIM8);
+  LL_TIM_EnableIT_CC1(TIM8);
+  LL_TIM_EnableIT_CC2(TIM8);
+  HAL_NVIC_SetPriority(TIM8_CC_IRQn, CCD_IRQ_PRIO_TRIG, 0);
+  HAL_NVIC_EnableIRQ(TIM8_CC_IRQn);
+  LL_TIM_EnableCounter(TIM8);
+}
+
+uint8_t CCD_Mains_Set(uint16_t phase, uint8_t periods) {
+  if (phase > CCD_MAINS_PHASE_MAX || periods == 0) {
+    return 0;
+  }
+  mains_phase = phase;
+  mains_periods = periods;
+  return 1;
+}
+
+static uint8_t Mains_Locked(void) {
+  return mains_locked && HAL_GetTick() - mains_tick < CCD_MAINS_STALE_MS;
+}
+
+// Once set active on its compare, CH2's reference stays high until it is
+// forced low again: after the trigger, or before the next arm
+static void Mains_Disarm(void) {
+  LL_TIM_OC_SetMode(TIM8, LL_TIM_CHANNEL_CH2, LL_TIM_OCMODE_FORCED_INACTIVE);
+  mains_armed = 0;
+}
+
+// The crossing at cap starts the next frame. Too late for the compare,
+// the reference goes high at once.
+static void Mains_Arm(uint16_t cap, uint32_t period) {
+  uint32_t off = mains_phase * period / (CCD_MAINS_PHASE_MAX + 1U);
+  if (off < CCD_MAINS_LEAD_US) {
+    off = CCD_MAINS_LEAD_US;
+  }
+  if (mains_armed) {
+    mains_late++; // The last arm never came, the phase near 360
+  }
+  Mains_Disarm();
+  LL_TIM_ClearFlag_CC2(TIM8);
+  uint16_t elapsed = (uint16_t)(LL_TIM_GetCounter(TIM8) - cap);
+  if (elapsed + MAINS_SLACK_US >= off) {
+    LL_TIM_OC_SetMode(TIM8, LL_TIM_CHANNEL_CH2, LL_TIM_OCMODE_FORCED_ACTIVE);
+    mains_late++;
+    mains_triggers++;
+    return;
+  }
+  LL_TIM_OC_SetCompareCH2(TIM8, (uint16_t)(cap + off));
+  mains_armed = 1;
+  LL_TIM_OC_SetMode(TIM8, LL_TIM_CHANNEL_CH2, LL_TIM_OCMODE_ACTIVE);
+}
+
+// CC2 also matches with nothing armed, every wrap of the count
+CCD_ITCM void CCD_Mains_IRQ(void) {
+  if (LL_TIM_IsActiveFlag_CC2(TIM8)) {
+    LL_TIM_ClearFlag_CC2(TIM8);
+    if (mains_armed) {
+      Mains_Disarm();
+      mains_triggers++;
+    }
+  }
+  if (!LL_TIM_IsActiveFlag_CC1(TIM8)) {
+    return;
+  }
+  uint16_t cap = (uint16_t)LL_TIM_IC_GetCaptureCH1(TIM8); // Clears CC1IF
+  uint32_t tick = HAL_GetTick();
+  mains_crossings++;
+  uint16_t p = (uint16_t)(cap - mains_last);
+  if (mains_seen && tick - mains_tick < CCD_MAINS_STALE_MS &&
+      p < CCD_MAINS_MIN_US) {
+    mains_glitches++;
+    return;
+  }
+  uint8_t resync = !mains_seen || tick - mains_tick >= CCD_MAINS_STALE_MS ||
+                   p > CCD_MAINS_MAX_US; // The count wraps past 65 ms
+  mains_seen = 1;
+  mains_last = cap;
+  mains_tick = tick;
+  if (resync) {
+    mains_good = 0;
+    mains_locked = 0;
+    return;
+  }
+
+  uint32_t avg16 = mains_avg16;
+  if (mains_good == 0) {
+    avg16 = (uint32_t)p << 4;
+  } else {
+    int32_t d = (int32_t)((uint32_t)p << 4) - (int32_t)avg16;
+    if (mains_locked) {
+      uint32_t dev = (uint32_t)((d < 0) ? -d : d) >> 4;
+      if (dev > mains_dev_max) {
+        mains_dev_max = dev;
+      }
+    }
+    avg16 = (uint32_t)((int32_t)avg16 + (d >> MAINS_AVG_SHIFT));
+  }
+  mains_avg16 = avg16;
+  if (mains_good < CCD_MAINS_LOCK) {
+    if (++mains_good < CCD_MAINS_LOCK) {
+      return;
+    }
+    mains_locked = 1;
+    mains_since = 0;
+    if (mains_enabled && !mains_applied) {
+      mode_update_pending = 1; // TIM2's period, from the lock
+    }
+  }
+  if (!mains_enabled || !mains_applied || ++mains_since < mains_used) {
+    return;
+  }
+  mains_since = 0;
+  Mains_Arm(cap, avg16 >> 4);
+}
+
+// The fewest mains periods, periods at least, that hold the ICG period,
+// and a quarter period more for each trigger to find TIM2 counting
+uint32_t CCD_Mains_IcgTicks(void) {
+  if (!Mains_Locked()) {
+    mains_applied = 0;
+    return 0;
+  }
+  uint32_t t = (mains_avg16 >> 4) * CCD_TICKS_PER_US;
+  uint32_t n = (CCD_Acq_IcgTicks() + t - 1U) / t;
+  if (n < mains_periods) {
+    n = mains_periods;
+  }
+  if (n > 0xFFU) {
+    n = 0xFFU;
+  }
+  mains_used = (uint8_t)n;
+  mains_applied = 1;
+  return n * t + t / 4U;
+}
+
+void CCD_Mains_Enable(uint8_t enable) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  Mains_Disarm();
+  mains_since = 0;
+  mains_enabled = enable;
+  __set_PRIMASK(primask);
+}
+
+void CCD_Mains_Status(CCD_MainsStatus_t *out) {
+  uint32_t avg16 = mains_avg16;
+  out->active = mains_enabled;
+  out->locked = Mains_Locked();
+  out->periods = mains_periods;
+  out->used = (mains_enabled && mains_applied) ? mains_used : 0;
+  out->phase = mains_phase;
+  out->period_us = (mains_good > 0) ? avg16 >> 4 : 0;
+  out->freq_mhz =
+      (mains_good > 0) ? (uint32_t)(16000000000ULL / avg16) : 0;
+  out->crossings = mains_crossings;
+  out->glitches = mains_glitches;
+  out->triggers = mains_triggers;
+  out->dev_max_us = mains_dev_max;
+  out->late = mains_late;
+}
+
+#endif /* CCD_LINE_SYNC */
@@ -0,0 +1,337 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_match.c
+ * @brief          : Reference spectrum library: per-frame classification
+ ******************************************************************************
+ */
+
+#include "ccd_match.h"
+#include "ccd_phase.h" // Pixel classes
+#include "ccd_store.h"
+#include "ccd_time.h"
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+_Static_assert(CCD_MATCH_BINS * CCD_MATCH_BIN <= CCD_PHASE_ACTIVE_COUNT,
+               "the bins lie in the effective pixels");
+_Static_assert((CCD_MATCH_BINS & 1U) == 0, "two bins per SMLALD");
+_Static_assert(CCD_MATCH_REFS <= 32U, "one defined bit per reference");
+_Static_assert(sizeof(CCD_MatchFrame_t) <= sizeof(CCD_Frame_t),
+               "a match record fits its slot");
+
+// The library as saved: each reference's bin means, raw counts
+typedef struct {
+  uint32_t defined;
+  uint16_t bins[CCD_MATCH_REFS][CCD_MATCH_BINS];
+} Match_Library_t;
+
+_Static_assert(sizeof(Match_Library_t) <= CCD_STORE_MAX_LEN,
+               "the library fits its flash sector");
+
+// The library, AXI SRAM, classified against as it is: each reference's
+// halved bins, with their mean and the norm about it
+static Match_Library_t match_lib;
+static float match_mean[CCD_MATCH_REFS];
+static float match_norm[CCD_MATCH_REFS];
+static uint8_t match_stored;
+
+static volatile uint8_t match_mode = CCD_MATCH_OFF;
+static volatile uint16_t match_threshold = CCD_MATCH_THRESHOLD;
+
+// Capture in progress, main loop only
+static uint32_t match_acc[CCD_MATCH_BINS];
+static uint8_t match_capture = CCD_MATCH_NONE;
+static uint16_t match_m;
+static uint16_t match_count;
+
+// Last decision and totals
+static uint8_t match_best = CCD_MATCH_NONE;
+static uint8_t match_second = CCD_MATCH_NONE;
+static int16_t match_score;
+static int16_t match_second_score;
+static uint32_t match_frames;
+static uint32_t match_unmatched;
+static uint32_t match_latency_us;
+static uint32_t match_max_latency_us;
+
+static inline uint32_t Match_Load2(const void *p) {
+  uint32_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+// Bin means over the effective pixels, two pixels per word load
+CCD_ITCM static void Match_Bin(uint16_t *bins, const uint16_t *px) {
+  const uint16_t *p = &px[CCD_PHASE_ACTIVE_START];
+  for (uint32_t j = 0; j < CCD_MATCH_BINS; j++) {
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < CCD_MATCH_BIN; i += 2) {
+      uint32_t w = Match_Load2(&p[i]);
+      sum += (w & 0xFFFFU) + (w >> 16);
+    }
+    bins[j] = (uint16_t)((sum + CCD_MATCH_BIN / 2U) / CCD_MATCH_BIN);
+    p += CCD_MATCH_BIN;
+  }
+}
+
+// (bin - mean) / 2 into out, their sum into *total; returns the norm
+static float Match_Center(int16_t *out, const uint16_t *bins,
+                          int32_t *total) {
+  uint32_t sum = 0;
+  for (uint32_t j = 0; j < CCD_MATCH_BINS; j++) {
+    sum += bins[j];
+  }
+  int32_t mean = (int32_t)((sum + CCD_MATCH_BINS / 2U) / CCD_MATCH_BINS);
+  uint64_t energy = 0;
+  int32_t t = 0;
+  for (uint32_t j = 0; j < CCD_MATCH_BINS; j++) {
+    int32_t d = ((int32_t)bins[j] - mean) >> 1;
+    out[j] = (int16_t)d;
+    t += d;
+    energy += (uint64_t)((int64_t)d * d);
+  }
+  *total = t;
+  return sqrtf((float)energy);
+}
+
+// sum(x[j] * (bins[j] / 2)), two bin pairs per SMLALD: halved, the raw
+// bins fit the signed lanes
+CCD_ITCM static int64_t Match_Dot(const int16_t *x, const uint16_t *bins) {
+  uint64_t acc = 0;
+  for (uint32_t j = 0; j < CCD_MATCH_BINS; j += 2) {
+    uint32_t h = (Match_Load2(&bins[j]) >> 1) & 0x7FFF7FFFU;
+    acc = __SMLALD(Match_Load2(&x[j]), h, acc);
+  }
+  return (int64_t)acc;
+}
+
+// The mean of the halved bins, and their norm about it
+static void Match_Build(uint32_t k) {
+  match_mean[k] = 0.0f;
+  match_norm[k] = 0.0f;
+  if (((match_lib.defined >> k) & 1U) == 0) {
+    return;
+  }
+  const uint16_t *bins = match_lib.bins[k];
+  uint32_t sum = 0;
+  for (uint32_t j = 0; j < CCD_MATCH_BINS; j++) {
+    sum += bins[j] >> 1;
+  }
+  float mean = (float)sum / CCD_MATCH_BINS;
+  float energy = 0.0f;
+  for (uint32_t j = 0; j < CCD_MATCH_BINS; j++) {
+    float d = (float)(bins[j] >> 1) - mean;
+    energy += d * d;
+  }
+  match_mean[k] = mean;
+  match_norm[k] = sqrtf(energy);
+}
+
+static void Match_BuildAll(void) {
+  for (uint32_t k = 0; k < CCD_MATCH_REFS; k++) {
+    Match_Build(k);
+  }
+}
+
+// ========== COMMANDS ==========
+
+void CCD_Match_Init(void) { CCD_Match_Load(); }
+
+uint8_t CCD_Match_SetMode(uint8_t mode, uint16_t threshold) {
+  if (mode > CCD_MATCH_ONLY || threshold > 32768U) {
+    return 0;
+  }
+  match_threshold = threshold;
+  match_mode = mode;
+  return 1;
+}
+
+void CCD_Match_GetMode(uint8_t *mode, uint16_t *threshold) {
+  *mode = match_mode;
+  *threshold = match_threshold;
+}
+
+uint8_t CCD_Match_Capture(uint8_t index, uint16_t frames) {
+  if (index >= CCD_MATCH_REFS || frames == 0 ||
+      frames > CCD_MATCH_REF_MAX) {
+    return 0;
+  }
+  match_capture = index;
+  match_m = frames;
+  match_count = 0;
+  return 1;
+}
+
+uint8_t CCD_Match_Write(uint8_t index, uint16_t first, const uint8_t *v,
+                        uint32_t n) {
+  if (index >= CCD_MATCH_REFS || first + n > CCD_MATCH_BINS) {
+    return 0;
+  }
+  for (uint32_t j = 0; j < n; j++) {
+    match_lib.bins[index][first + j] = (uint16_t)(v[2 * j] | v[2 * j + 1] << 8);
+  }
+  match_lib.defined |= 1UL << index;
+  match_stored = 0;
+  Match_Build(index);
+  return 1;
+}
+
+uint8_t CCD_Match_Clear(uint8_t index) {
+  if (index == CCD_MATCH_NONE) {
+    memset(&match_lib, 0, sizeof(match_lib));
+  } else if (index < CCD_MATCH_REFS) {
+    memset(match_lib.bins[index], 0, sizeof(match_lib.bins[index]));
+    match_lib.defined &= ~(1UL << index);
+  } else {
+    return 0;
+  }
+  match_stored = 0;
+  Match_BuildAll();
+  return 1;
+}
+
+uint8_t CCD_Match_Save(void) {
+  if (!CCD_Store_Save(CCD_STORE_MATCH, &match_lib, sizeof(match_lib))) {
+    return 0;
+  }
+  match_stored = 1;
+  return 1;
+}
+
+uint8_t CCD_Match_Load(void) {
+  if (!CCD_Store_Load(CCD_STORE_MATCH, &match_lib, sizeof(match_lib))) {
+    return 0;
+  }
+  match_lib.defined &= (uint32_t)((1ULL << CCD_MATCH_REFS) - 1U);
+  match_stored = 1;
+  Match_BuildAll();
+  return 1;
+}
+
+void CCD_Match_Status(uint8_t index, uint16_t offset, CCD_MatchStatus_t *out) {
+  out->mode = match_mode;
+  out->refs = (uint8_t)__builtin_popcount(match_lib.defined);
+  out->best = match_best;
+  out->second = match_second;
+  out->score = match_score;
+  out->second_score = match_second_score;
+  out->threshold = match_threshold;
+  out->capture = match_capture;
+  out->stored = match_stored;
+  out->defined = match_lib.defined;
+  out->frames = match_frames;
+  out->unmatched = match_unmatched;
+  out->latency_us = match_latency_us;
+  out->max_latency_us = match_max_latency_us;
+  out->index = index;
+  out->reserved = 0;
+  out->offset = offset;
+  for (uint32_t j = 0; j < CCD_MATCH_CHUNK; j++) {
+    out->bins[j] = (index < CCD_MATCH_REFS && offset + j < CCD_MATCH_BINS)
+                       ? match_lib.bins[index][offset + j]
+                       : 0;
+  }
+}
+
+uint8_t CCD_Match_Active(void) {
+  return match_mode != CCD_MATCH_OFF || match_capture != CCD_MATCH_NONE;
+}
+
+// ========== STAGE ==========
+
+// Average M frames' bins into the reference being captured
+static void Match_Accumulate(const uint16_t *bins) {
+  for (uint32_t j = 0; j < CCD_MATCH_BINS; j++) {
+    match_acc[j] = (match_count == 0 ? 0U : match_acc[j]) + bins[j];
+  }
+  if (++match_count < match_m) {
+    return;
+  }
+  uint8_t k = match_capture;
+  for (uint32_t j = 0; j < CCD_MATCH_BINS; j++) {
+    match_lib.bins[k][j] = (uint16_t)((match_acc[j] + match_m / 2U) / match_m);
+  }
+  match_lib.defined |= 1UL << k;
+  match_stored = 0;
+  match_capture = CCD_MATCH_NONE;
+  Match_Build(k);
+}
+
+// Scores of every defined reference; the best two. The reference's mean
+// comes off the dot product through the frame's total: x . (r - m) =
+// x . r - m * sum(x).
+static void Match_Classify(const uint16_t *bins) {
+  int16_t x[CCD_MATCH_BINS];
+  int32_t total;
+  float norm = Match_Center(x, bins, &total);
+  int32_t s1 = -32768;
+  int32_t s2 = -32768;
+  uint8_t k1 = CCD_MATCH_NONE;
+  uint8_t k2 = CCD_MATCH_NONE;
+  for (uint32_t k = 0; k < CCD_MATCH_REFS && norm > 0.0f; k++) {
+    if (match_norm[k] == 0.0f) {
+      continue;
+    }
+    float dot = (float)Match_Dot(x, match_lib.bins[k]) -
+                match_mean[k] * (float)total;
+    float r = dot / (norm * match_norm[k]);
+    int32_t s = (int32_t)lrintf(r * 32768.0f);
+    s = (s > 32767) ? 32767 : (s < -32768) ? -32768 : s;
+    if (k1 == CCD_MATCH_NONE || s > s1) {
+      s2 = s1;
+      k2 = k1;
+      s1 = s;
+      k1 = (uint8_t)k;
+    } else if (k2 == CCD_MATCH_NONE || s > s2) {
+      s2 = s;
+      k2 = (uint8_t)k;
+    }
+  }
+  match_score = (int16_t)s1;
+  match_second_score = (int16_t)s2;
+  match_second = k2;
+  if (k1 != CCD_MATCH_NONE && s1 < (int32_t)match_threshold) {
+    k1 = CCD_MATCH_NONE;
+  }
+  match_best = k1;
+  match_frames++;
+  match_unmatched += (k1 == CCD_MATCH_NONE);
+}
+
+uint32_t CCD_Match_Frame(CCD_Frame_t *frame) {
+  uint16_t bins[CCD_MATCH_BINS];
+  Match_Bin(bins, frame->pixels);
+  if (match_capture != CCD_MATCH_NONE) {
+    Match_Accumulate(bins);
+  }
+  uint8_t mode = match_mode;
+  if (mode == CCD_MATCH_OFF) {
+    return 0;
+  }
+  Match_Classify(bins);
+  uint64_t cycles = CCD_Time_Now() - frame->info.timestamp;
+  uint32_t us = (uint32_t)(cycles / (CCD_TIME_HZ / 1000000U));
+  match_latency_us = us;
+  if (us > match_max_latency_us) {
+    match_max_latency_us = us;
+  }
+  if (mode != CCD_MATCH_ONLY) {
+    return 0;
+  }
+  CCD_MatchFrame_t mf;
+  mf.magic = CCD_MATCH_MAGIC;
+  mf.frame_num = frame->frame_num;
+  mf.info = frame->info;
+  mf.info.header_len = offsetof(CCD_MatchFrame_t, best);
+  mf.info.payload_len = sizeof(mf) - offsetof(CCD_MatchFrame_t, best);
+  mf.best = match_best;
+  mf.second = match_second;
+  mf.score = match_score;
+  mf.second_score = match_second_score;
+  mf.latency_us = (uint16_t)(us < CCD_MATCH_LATENCY_MAX
+                                 ? us
+                                 : CCD_MATCH_LATENCY_MAX);
+  memcpy(frame, &mf, sizeof(mf));
+  return sizeof(mf);
+}
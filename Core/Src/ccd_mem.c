@@ -0,0 +1,89 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_mem.c
+ * @brief          : Memory budget: stack high-water, heap, static use, ring
+ ******************************************************************************
+ */
+
+#include "ccd_mem.h"
+#include <stddef.h>
+#include <string.h>
+
+// Linker script symbols; only their addresses mean anything
+extern uint8_t g_pfnVectors[], _sidtcm[];
+extern uint8_t _sitcm[], _eitcm[];
+extern uint8_t _sdtcm[], _edtcm[], _edtcm_noinit[];
+extern uint8_t _sdata[], _edata[], _sbss[], _ebss[];
+extern uint8_t _sram_d2[], _eram_d2[];
+extern uint8_t _end[], _estack[], _Min_Stack_Size[];
+
+extern void *_sbrk(ptrdiff_t incr); // sysmem.c
+
+static uint32_t mem_paint_start; // Lowest painted word
+
+// The scratch, and who holds it
+__attribute__((aligned(32))) static uint8_t mem_scratch[CCD_MEM_SCRATCH_SIZE];
+static CCD_MemOwner_t mem_owner = CCD_MEM_NONE;
+static CCD_MemYield_t mem_yield;
+
+void CCD_Mem_Init(void) {
+  uint32_t start = ((uint32_t)_end + 3U) & ~3U;
+  uint32_t stop = (__get_MSP() - CCD_MEM_MARGIN) & ~3U;
+  for (volatile uint32_t *p = (volatile uint32_t *)start;
+       (uint32_t)p < stop; p++) {
+    *p = CCD_MEM_PAINT;
+  }
+  mem_paint_start = start;
+}
+
+// Lowest word above the heap that is no longer the paint
+static uint32_t Mem_StackLow(uint32_t heap_end) {
+  uint32_t a = (heap_end + 3U) & ~3U;
+  if (a < mem_paint_start) {
+    a = mem_paint_start;
+  }
+  while (a < (uint32_t)_estack && *(volatile uint32_t *)a == CCD_MEM_PAINT) {
+    a += 4U;
+  }
+  return a;
+}
+
+void CCD_Mem_Status(CCD_MemStatus_t *out, uint8_t clear) {
+  uint32_t heap_end = (uint32_t)_sbrk(0);
+  uint32_t top = (uint32_t)_estack;
+  uint32_t limit = top - (uint32_t)_Min_Stack_Size;
+  out->stack_size = top - mem_paint_start;
+  out->stack_peak = top - Mem_StackLow(heap_end);
+  out->heap_used = heap_end - (uint32_t)_end;
+  out->heap_free = (heap_end < limit) ? limit - heap_end : 0;
+  out->image = (uint32_t)(_sidtcm - g_pfnVectors) +
+               (uint32_t)(_edtcm - _sdtcm); // The last load image
+  out->itcm = (uint32_t)(_eitcm - _sitcm);
+  out->dtcm = (uint32_t)(_edtcm_noinit - _sdtcm);
+  out->ram_d1 = (uint32_t)(_edata - _sdata) + (uint32_t)(_ebss - _sbss);
+  out->ram_d2 = (uint32_t)(_eram_d2 - _sram_d2);
+  out->ring_slots = FRAME_RING_SLOTS;
+  out->ring_now = (uint8_t)FrameRing_Count();
+  uint32_t hist[FRAME_RING_HIST];
+  out->ring_peak = (uint8_t)FrameRing_Occupancy(hist, clear);
+  out->reserved = 0;
+  memcpy(out->ring_hist, hist, sizeof(hist));
+}
+
+void *CCD_Mem_Claim(CCD_MemOwner_t owner, CCD_MemYield_t yield) {
+  if (mem_owner != owner) {
+    if (mem_owner != CCD_MEM_NONE && (mem_yield == NULL || !mem_yield())) {
+      return NULL;
+    }
+    mem_owner = owner;
+  }
+  mem_yield = yield;
+  return mem_scratch;
+}
+
+void CCD_Mem_Release(CCD_MemOwner_t owner) {
+  if (mem_owner == owner) {
+    mem_owner = CCD_MEM_NONE;
+    mem_yield = NULL;
+  }
+}
@@ -0,0 +1,282 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_model.c
+ * @brief          : Linear models (PLS, PCA) applied to every frame
+ ******************************************************************************
+ */
+
+#include "ccd_model.h"
+
+#if CCD_MODEL
+
+#include "ccd_phase.h" // Pixel classes
+#include "ccd_store.h"
+#include "ccd_time.h"
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+_Static_assert(CCD_MODEL_BINS * CCD_MODEL_BIN <= CCD_PHASE_ACTIVE_COUNT,
+               "the bins lie in the effective pixels");
+_Static_assert((CCD_MODEL_BINS & 1U) == 0, "two bins per SMLALD");
+_Static_assert(CCD_MODEL_OUTPUTS <= 8U, "one defined bit per output");
+_Static_assert(sizeof(CCD_ModelFrame_t) <= sizeof(CCD_Frame_t),
+               "a model record fits its slot");
+
+// The model as saved
+typedef struct {
+  uint8_t mode;
+  uint8_t prep;
+  uint8_t defined;
+  uint8_t reserved;
+  float scale[CCD_MODEL_OUTPUTS];
+  float offset[CCD_MODEL_OUTPUTS];
+  int16_t w[CCD_MODEL_OUTPUTS][CCD_MODEL_BINS];
+} Model_Store_t;
+
+_Static_assert(sizeof(Model_Store_t) <= CCD_STORE_MAX_LEN,
+               "the model fits its flash sector");
+
+// The model, the sum of each output's loadings and the frame's bins less
+// 32768. AXI SRAM.
+static Model_Store_t model;
+static int32_t model_wsum[CCD_MODEL_OUTPUTS];
+static int16_t model_x[CCD_MODEL_BINS];
+static uint8_t model_stored;
+
+// Last values and totals
+static float model_values[CCD_MODEL_OUTPUTS];
+static uint32_t model_frames;
+static uint32_t model_seq;
+static uint32_t model_latency_us;
+static uint32_t model_max_latency_us;
+static uint32_t model_invalid;
+
+static inline uint32_t Model_Load2(const void *p) {
+  uint32_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+// Bin means less 32768 into model_x over the effective pixels; their sum
+// and sum of squares
+CCD_ITCM static void Model_Bin(const uint16_t *px, int64_t *sum,
+                               uint64_t *sq) {
+  const uint16_t *p = &px[CCD_PHASE_ACTIVE_START];
+  int64_t s = 0;
+  uint64_t q = 0;
+  for (uint32_t j = 0; j < CCD_MODEL_BINS; j++) {
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < CCD_MODEL_BIN; i += 2) {
+      uint32_t w = Model_Load2(&p[i]);
+      acc += (w & 0xFFFFU) + (w >> 16);
+    }
+    int32_t x = (int32_t)((acc + CCD_MODEL_BIN / 2U) / CCD_MODEL_BIN) - 32768;
+    model_x[j] = (int16_t)x;
+    s += x;
+    q += (uint64_t)((int64_t)x * x);
+    p += CCD_MODEL_BIN;
+  }
+  *sum = s;
+  *sq = q;
+}
+
+// sum(w[j] * x[j]), two bin pairs per SMLALD
+CCD_ITCM static int64_t Model_Dot(const int16_t *w) {
+  uint64_t acc = 0;
+  for (uint32_t j = 0; j < CCD_MODEL_BINS; j += 2) {
+    acc = __SMLALD(Model_Load2(&w[j]), Model_Load2(&model_x[j]), acc);
+  }
+  return (int64_t)acc;
+}
+
+static void Model_Sum(uint32_t k) {
+  int32_t s = 0;
+  for (uint32_t j = 0; j < CCD_MODEL_BINS; j++) {
+    s += model.w[k][j];
+  }
+  model_wsum[k] = s;
+}
+
+static void Model_SumAll(void) {
+  for (uint32_t k = 0; k < CCD_MODEL_OUTPUTS; k++) {
+    Model_Sum(k);
+  }
+}
+
+// ========== COMMANDS ==========
+
+void CCD_Model_Init(void) {
+  for (uint32_t k = 0; k < CCD_MODEL_OUTPUTS; k++) {
+    model_values[k] = NAN;
+  }
+  CCD_Model_Load();
+}
+
+uint8_t CCD_Model_SetMode(uint8_t mode, uint8_t prep) {
+  if (mode > CCD_MODEL_ONLY || prep > CCD_MODEL_PREP_SNV) {
+    return 0;
+  }
+  if (mode != model.mode || prep != model.prep) {
+    model_stored = 0;
+  }
+  model.prep = prep;
+  model.mode = mode;
+  return 1;
+}
+
+uint8_t CCD_Model_Write(uint8_t output, uint16_t first, const uint8_t *v,
+                        uint32_t n) {
+  if (output >= CCD_MODEL_OUTPUTS || first + n > CCD_MODEL_BINS) {
+    return 0;
+  }
+  for (uint32_t j = 0; j < n; j++) {
+    model.w[output][first + j] = (int16_t)(v[2 * j] | v[2 * j + 1] << 8);
+  }
+  model_stored = 0;
+  Model_Sum(output);
+  return 1;
+}
+
+uint8_t CCD_Model_Scale(uint8_t output, float scale, float offset) {
+  if (output >= CCD_MODEL_OUTPUTS || !isfinite(scale) || !isfinite(offset)) {
+    return 0;
+  }
+  model.scale[output] = scale;
+  model.offset[output] = offset;
+  model.defined |= (uint8_t)(1U << output);
+  model_stored = 0;
+  return 1;
+}
+
+uint8_t CCD_Model_Clear(uint8_t output) {
+  if (output == CCD_MODEL_NONE) {
+    uint8_t mode = model.mode;
+    uint8_t prep = model.prep;
+    memset(&model, 0, sizeof(model));
+    model.mode = mode;
+    model.prep = prep;
+  } else if (output < CCD_MODEL_OUTPUTS) {
+    memset(model.w[output], 0, sizeof(model.w[output]));
+    model.scale[output] = 0.0f;
+    model.offset[output] = 0.0f;
+    model.defined &= (uint8_t)~(1U << output);
+  } else {
+    return 0;
+  }
+  model_stored = 0;
+  Model_SumAll();
+  return 1;
+}
+
+uint8_t CCD_Model_Save(void) {
+  if (!CCD_Store_Save(CCD_STORE_MODEL, &model, sizeof(model))) {
+    return 0;
+  }
+  model_stored = 1;
+  return 1;
+}
+
+uint8_t CCD_Model_Load(void) {
+  if (!CCD_Store_Load(CCD_STORE_MODEL, &model, sizeof(model))) {
+    return 0;
+  }
+  if (model.mode > CCD_MODEL_ONLY || model.prep > CCD_MODEL_PREP_SNV) {
+    model.mode = CCD_MODEL_OFF;
+    model.prep = CCD_MODEL_PREP_NONE;
+  }
+  model.defined &= (uint8_t)((1U << CCD_MODEL_OUTPUTS) - 1U);
+  model_stored = 1;
+  Model_SumAll();
+  return 1;
+}
+
+void CCD_Model_Status(uint8_t output, uint16_t first, CCD_ModelStatus_t *out) {
+  uint8_t ok = output < CCD_MODEL_OUTPUTS;
+  out->mode = model.mode;
+  out->prep = model.prep;
+  out->defined = model.defined;
+  out->stored = model_stored;
+  out->frames = model_frames;
+  out->seq = model_seq;
+  out->latency_us = model_latency_us;
+  out->max_latency_us = model_max_latency_us;
+  out->invalid = model_invalid;
+  memcpy(out->values, model_values, sizeof(out->values));
+  out->scale = ok ? model.scale[output] : 0.0f;
+  out->offset = ok ? model.offset[output] : 0.0f;
+  out->index = output;
+  out->reserved = 0;
+  out->first = first;
+  for (uint32_t j = 0; j < CCD_MODEL_CHUNK; j++) {
+    out->loadings[j] =
+        (ok && first + j < CCD_MODEL_BINS) ? model.w[output][first + j] : 0;
+  }
+}
+
+uint8_t CCD_Model_Active(void) { return model.mode != CCD_MODEL_OFF; }
+
+// ========== STAGE ==========
+
+// Every defined output of the frame into model_values. The dot is taken
+// against bins less 32768: sum(w * bin) = dot + 32768 * sum(w).
+static void Model_Evaluate(const CCD_Frame_t *frame) {
+  int64_t sum;
+  uint64_t sq;
+  Model_Bin(frame->pixels, &sum, &sq);
+  double mean_x = (double)sum / CCD_MODEL_BINS;
+  double mean = mean_x + 32768.0;
+  double var = (double)sq / CCD_MODEL_BINS - mean_x * mean_x;
+  uint8_t prep = model.prep;
+  uint8_t invalid = 0;
+  for (uint32_t k = 0; k < CCD_MODEL_OUTPUTS; k++) {
+    if (!((model.defined >> k) & 1U)) {
+      model_values[k] = NAN;
+      continue;
+    }
+    double dot = (double)Model_Dot(model.w[k]);
+    double v;
+    if (prep == CCD_MODEL_PREP_SNV) {
+      v = (var > 0.0) ? (dot - mean_x * model_wsum[k]) / sqrt(var) : NAN;
+    } else {
+      v = dot + 32768.0 * model_wsum[k];
+      if (prep == CCD_MODEL_PREP_AREA) {
+        v = (mean > 0.0) ? v / mean : NAN;
+      }
+    }
+    model_values[k] = (float)(model.scale[k] * v + model.offset[k]);
+    invalid |= isnan(model_values[k]) ? 1U : 0U;
+  }
+  model_invalid += invalid;
+  model_seq = frame->info.seq;
+  model_frames++;
+}
+
+uint32_t CCD_Model_Frame(CCD_Frame_t *frame) {
+  Model_Evaluate(frame);
+  uint64_t cycles = CCD_Time_Now() - frame->info.timestamp;
+  uint32_t us = (uint32_t)(cycles / (CCD_TIME_HZ / 1000000U));
+  model_latency_us = us;
+  if (us > model_max_latency_us) {
+    model_max_latency_us = us;
+  }
+  if (model.mode != CCD_MODEL_ONLY) {
+    return 0;
+  }
+  CCD_ModelFrame_t mf;
+  mf.magic = CCD_MODEL_MAGIC;
+  mf.frame_num = frame->frame_num;
+  mf.info = frame->info;
+  mf.info.header_len = offsetof(CCD_ModelFrame_t, values);
+  mf.info.payload_len = sizeof(mf) - offsetof(CCD_ModelFrame_t, values);
+  memcpy(mf.values, model_values, sizeof(mf.values));
+  mf.defined = model.defined;
+  mf.prep = model.prep;
+  mf.latency_us = (uint16_t)(us < CCD_MODEL_LATENCY_MAX
+                                 ? us
+                                 : CCD_MODEL_LATENCY_MAX);
+  memcpy(frame, &mf, sizeof(mf));
+  return sizeof(mf);
+}
+
+#endif /* CCD_MODEL */
@@ -0,0 +1,114 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_pack.c
+ * @brief          : Small frames packed into full-size USB transfers
+ ******************************************************************************
+ */
+
+#include "ccd_pack.h"
+#include "ccd_lat.h"
+#include "ccd_time.h"
+#include "frame_ring.h"
+#include "usbd_cdc_if.h"
+#include <string.h>
+
+CCD_Pack_Stats_t ccd_pack_stats;
+
+typedef struct {
+  uint8_t data[CCD_PACK_SIZE];
+  const CCD_Frame_t *frames[CCD_PACK_RECORDS]; // For the latency record
+  uint32_t len;
+  uint32_t records;
+  volatile uint8_t busy; // Queued, until its transfer completes
+} Pack_t;
+
+// Filled by the CPU and read by the USB core, cleaned on submit
+__attribute__((aligned(32))) static Pack_t packs[CCD_PACK_BUFS];
+static Pack_t *pack_open;    // Being filled, NULL if none
+static uint32_t pack_opened; // Time at its first record, low half
+
+// USB interrupt. The slots went back when they were copied; one reused
+// since would need the ring to turn over within CCD_PACK_FLUSH_US.
+static void Pack_Sent(void *ctx, uint32_t len) {
+  Pack_t *p = (Pack_t *)ctx;
+  for (uint32_t i = 0; i < p->records; i++) {
+    CCD_Lat_Sent(p->frames[i], 1);
+  }
+  p->busy = 0;
+}
+
+// The queue entry was kept for it (CCD_Pack_Reserved())
+static void Pack_Flush(void) {
+  Pack_t *p = pack_open;
+  if (p == NULL) {
+    return;
+  }
+  pack_open = NULL;
+  p->busy = 1;
+  if (UsbTx_Submit(USB_TX_FRAMES, p->data, p->len, Pack_Sent, p)) {
+    ccd_pack_stats.transfers++;
+  } else {
+    p->busy = 0;
+  }
+}
+
+static Pack_t *Pack_Free(void) {
+  for (uint32_t i = 0; i < CCD_PACK_BUFS; i++) {
+    if (!packs[i].busy) {
+      return &packs[i];
+    }
+  }
+  return NULL;
+}
+
+uint32_t CCD_Pack_Reserved(const UsbTx_Link_t *link) {
+  return (link == USB_TX_FRAMES && pack_open != NULL) ? 1U : 0U;
+}
+
+uint8_t CCD_Pack_Frame(UsbTx_Link_t *link, CCD_Frame_t *frame, uint32_t len) {
+  if (link != USB_TX_FRAMES) {
+    return 0;
+  }
+  if (len > CCD_PACK_RECORD_MAX) {
+    Pack_Flush(); // Ahead of the frame
+    return 0;
+  }
+  Pack_t *p = pack_open;
+  if (p != NULL && p->len + len > CCD_PACK_SIZE) {
+    Pack_Flush();
+    p = NULL;
+  }
+  if (p == NULL) {
+    if ((p = Pack_Free()) == NULL) {
+      return 0;
+    }
+    p->len = 0;
+    p->records = 0;
+    pack_open = p;
+    pack_opened = (uint32_t)CCD_Time_Now();
+  }
+  memcpy(&p->data[p->len], frame, len);
+  p->frames[p->records++] = frame;
+  p->len += len;
+  ccd_pack_stats.records++;
+  FrameRing_Release(frame, 1);
+  if (p->records == CCD_PACK_RECORDS) {
+    Pack_Flush();
+  }
+  return 1;
+}
+
+void CCD_Pack_Poll(void) {
+  if (pack_open == NULL) {
+    return;
+  }
+  if (!CDC_IsOpen_FS()) {
+    pack_open = NULL; // Lost with the frames the closed port discards
+    return;
+  }
+  uint32_t limit = CCD_PACK_FLUSH_US * (CCD_TIME_HZ / 1000000U);
+  if ((uint32_t)CCD_Time_Now() - pack_opened >= limit) {
+    ccd_pack_stats.timeouts++;
+    Pack_Flush();
+  }
+}
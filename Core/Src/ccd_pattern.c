@@ -0,0 +1,88 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_pattern.c
+ * @brief          : Synthetic test line as an acquisition source
+ ******************************************************************************
+ */
+
+#include "ccd_pattern.h"
+#include "ccd_acq.h"
+#include "stm32h7xx_ll_dma.h"
+#include "stm32h7xx_ll_tim.h"
+#include <math.h>
+
+#define PATTERN_FIRST 32U // Dummy pixels ahead of the photosites
+#define PATTERN_LAST 14U  // and behind them
+#define PATTERN_WORDS ((2U * CCD_BUFFER_SIZE + 15U) & ~15U)
+
+// Line centre (pixel), depth (counts) and sigma (pixels)
+static const float pattern_lines[CCD_PATTERN_LINES][3] = {
+    {700.0f, 9000.0f, 2.5f},
+    {1510.0f, 42000.0f, 4.0f},
+    {2230.0f, 21000.0f, 1.6f},
+    {3050.0f, 30000.0f, 7.0f},
+};
+
+// The line twice over, read by DMA1 (so not in DTCM); whole cache lines
+__attribute__((aligned(32))) static uint16_t pattern_buf[PATTERN_WORDS];
+CCD_DTCM_BSS static uint32_t pattern_offset;
+
+uint8_t CCD_Pattern_Init(void) {
+  uint32_t lcg = 1U;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    float v = (float)CCD_PATTERN_DARK;
+    if (i >= PATTERN_FIRST && i < CCD_BUFFER_SIZE - PATTERN_LAST) {
+      for (uint32_t k = 0; k < CCD_PATTERN_LINES; k++) {
+        float d = ((float)i - pattern_lines[k][0]) / pattern_lines[k][2];
+        v -= pattern_lines[k][1] * expf(-0.5f * d * d);
+      }
+    }
+    lcg = lcg * 1664525U + 1013904223U;
+    v += (float)((lcg >> 16) % (CCD_PATTERN_NOISE + 1U)) -
+         (float)CCD_PATTERN_NOISE / 2.0f;
+    uint16_t px = (uint16_t)(v < 0.0f ? 0.0f : v);
+    pattern_buf[i] = px;
+    pattern_buf[i + CCD_BUFFER_SIZE] = px;
+  }
+  CCD_DCACHE_CLEAN(pattern_buf, sizeof(pattern_buf));
+  LL_TIM_OC_SetMode(TIM4, LL_TIM_CHANNEL_CH1, LL_TIM_OCMODE_FROZEN);
+  LL_TIM_OC_EnablePreload(TIM4, LL_TIM_CHANNEL_CH1);
+  return 1;
+}
+
+// CC1 stands in for the ADC trigger; the sample is in memory at once
+uint32_t CCD_Pattern_Apply(uint32_t ccr, uint32_t arr) {
+  LL_TIM_OC_SetCompareCH1(TIM4, ccr);
+  return ccr;
+}
+
+void CCD_Pattern_Stream(void) {
+  LL_DMA_SetPeriphRequest(CCD_ACQ_DMA, CCD_ACQ_STREAM,
+                          LL_DMAMUX1_REQ_TIM4_CH1);
+  LL_DMA_SetPeriphAddress(CCD_ACQ_DMA, CCD_ACQ_STREAM,
+                          (uint32_t)&pattern_buf[0]);
+  LL_DMA_SetPeriphIncMode(CCD_ACQ_DMA, CCD_ACQ_STREAM,
+                          LL_DMA_PERIPH_INCREMENT);
+  LL_DMA_SetPeriphSize(CCD_ACQ_DMA, CCD_ACQ_STREAM,
+                       LL_DMA_PDATAALIGN_HALFWORD);
+  LL_DMA_SetMemorySize(CCD_ACQ_DMA, CCD_ACQ_STREAM,
+                       LL_DMA_MDATAALIGN_HALFWORD);
+}
+
+void CCD_Pattern_Start(void) {
+  pattern_offset = 0;
+  LL_TIM_EnableDMAReq_CC1(TIM4);
+}
+
+// The next frame starts CCD_PATTERN_STEP pixels further into the line
+CCD_ITCM void CCD_Pattern_Arm(void) {
+  LL_DMA_SetPeriphAddress(CCD_ACQ_DMA, CCD_ACQ_STREAM,
+                          (uint32_t)&pattern_buf[pattern_offset]);
+  pattern_offset += CCD_PATTERN_STEP;
+  if (pattern_offset >= CCD_BUFFER_SIZE) {
+    pattern_offset -= CCD_BUFFER_SIZE;
+  }
+  LL_DMA_EnableStream(CCD_ACQ_DMA, CCD_ACQ_STREAM);
+}
+
+void CCD_Pattern_Stop(void) { LL_TIM_DisableDMAReq_CC1(TIM4); }
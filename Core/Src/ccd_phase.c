@@ -0,0 +1,195 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_phase.c
+ * @brief          : ADC sample-phase calibration sweep
+ ******************************************************************************
+ */
+
+#include "ccd_phase.h"
+#include "ccd_store.h"
+#include "usb_tx.h"
+#include <string.h>
+
+#define PHASE_IDLE 0
+#define PHASE_RESTART 1 // Setting posted, waiting for the main loop restart
+#define PHASE_MEASURE 2
+
+#define PHASE_STEP_TICKS (CCD_PIXEL_TICKS / CCD_PHASE_STEPS)
+
+_Static_assert(PHASE_STEP_TICKS >= 1, "pixel period too short to sweep");
+_Static_assert(CCD_PHASE_SETTINGS <= 255, "result indices are 8-bit");
+_Static_assert(CCD_PHASE_ACTIVE_START + CCD_PHASE_ACTIVE_COUNT <=
+                   CCD_BUFFER_SIZE,
+               "active pixels must lie inside the frame");
+
+// Flash record (CCD_STORE_PHASE)
+typedef struct {
+  uint16_t phase;
+  uint8_t sample;
+  uint8_t reserved;
+} Phase_Record_t;
+
+volatile uint8_t ccd_phase_request = 0;
+
+// Sweep state, main loop only
+static uint8_t phase_state = PHASE_IDLE;
+static uint8_t phase_index;       // Setting being measured
+static uint16_t phase_start;      // frame_num of the first frame after restart
+static uint8_t phase_seen;        // Frames measured for this setting
+static uint32_t phase_signal_acc; // Sums over the measured frames
+static uint32_t phase_noise_acc;
+static uint16_t phase_orig;       // Restored by "F0"
+static uint8_t phase_orig_sample;
+static uint16_t phase_prev[CCD_PHASE_ACTIVE_COUNT]; // Last frame's pixels
+
+static CCD_PhaseReport_t phase_report; // Read by the USB engine while queued
+static uint8_t phase_report_pending;
+static volatile uint8_t phase_report_busy;
+
+void CCD_Phase_Init(void) {
+  Phase_Record_t rec;
+  if (CCD_Store_Load(CCD_STORE_PHASE, &rec, sizeof(rec)) &&
+      rec.phase < CCD_PIXEL_TICKS && rec.sample < CCD_ACQ_SMP_COUNT) {
+    acq_adc_phase = rec.phase;
+    acq_adc_sample = rec.sample;
+  }
+}
+
+uint8_t CCD_Phase_Busy(void) { return phase_state != PHASE_IDLE; }
+
+// Post a sample point; the main loop restarts acquisition with it
+static void Phase_Apply(uint16_t phase, uint8_t sample) {
+  acq_adc_phase = phase;
+  acq_adc_sample = sample;
+  mode_update_pending = 1;
+}
+
+// Settings run phase-major, every sampling time at each phase
+static void Phase_Start(uint8_t index) {
+  phase_index = index;
+  Phase_Apply((uint16_t)((index / CCD_ACQ_SMP_COUNT + 1U) * PHASE_STEP_TICKS),
+              (uint8_t)(index % CCD_ACQ_SMP_COUNT));
+  phase_state = PHASE_RESTART;
+}
+
+// Best signal / noise, compared as cross products (a zero noise counts as
+// the smallest non-zero value)
+static uint8_t Phase_Best(void) {
+  uint8_t best = 0;
+  for (uint8_t i = 1; i < CCD_PHASE_SETTINGS; i++) {
+    const CCD_PhaseResult_t *a = &phase_report.result[i];
+    const CCD_PhaseResult_t *b = &phase_report.result[best];
+    uint64_t na = a->noise ? a->noise : 1U;
+    uint64_t nb = b->noise ? b->noise : 1U;
+    if ((uint64_t)a->signal * nb > (uint64_t)b->signal * na) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+static void Phase_Finish(void) {
+  uint8_t best = Phase_Best();
+  phase_report.magic = CCD_PHASE_MAGIC;
+  phase_report.count = CCD_PHASE_SETTINGS;
+  phase_report.best = best;
+  phase_report_pending = 1;
+  Phase_Apply(phase_report.result[best].phase,
+              phase_report.result[best].sample);
+  phase_state = PHASE_IDLE;
+}
+
+static void Phase_ReportSent(void *ctx, uint32_t len) {
+  phase_report_busy = 0;
+}
+
+void CCD_Phase_Poll(void) {
+  uint8_t req = ccd_phase_request;
+  if (req != 0) {
+    ccd_phase_request = 0;
+    if (req == CCD_PHASE_REQ_SWEEP && phase_state == PHASE_IDLE) {
+      phase_orig = acq_adc_phase;
+      phase_orig_sample = acq_adc_sample;
+      Phase_Start(0);
+    } else if (req == CCD_PHASE_REQ_ABORT && phase_state != PHASE_IDLE) {
+      phase_state = PHASE_IDLE;
+      Phase_Apply(phase_orig, phase_orig_sample);
+    } else if (req == CCD_PHASE_REQ_SAVE) {
+      Phase_Record_t rec = {acq_adc_phase, acq_adc_sample, 0};
+      CCD_Store_Save(CCD_STORE_PHASE, &rec, sizeof(rec));
+    } else if (req == CCD_PHASE_REQ_LOAD && phase_state == PHASE_IDLE) {
+      CCD_Phase_Init();
+      mode_update_pending = 1;
+    }
+  }
+
+  // The restart has run once the main loop has cleared the flag; frames
+  // numbered from here on were captured with the new setting
+  if (phase_state == PHASE_RESTART && !mode_update_pending) {
+    phase_start = CCD_Acq_FrameCount();
+    phase_seen = 0;
+    phase_signal_acc = 0;
+    phase_noise_acc = 0;
+    phase_state = PHASE_MEASURE;
+  }
+
+  if (phase_report_pending && !phase_report_busy &&
+      UsbTx_Space(&usb_tx_fs) > 0) {
+    phase_report_pending = 0;
+    phase_report_busy = 1;
+    UsbTx_Submit(&usb_tx_fs, (const uint8_t *)&phase_report,
+                 sizeof(phase_report), Phase_ReportSent, NULL);
+  }
+}
+
+void CCD_Phase_Frame(const CCD_Frame_t *frame) {
+  if (phase_state != PHASE_MEASURE) {
+    return;
+  }
+  uint16_t age = (uint16_t)(frame->frame_num - phase_start);
+  if (age >= 0x8000U || age < CCD_PHASE_SETTLE) {
+    return; // Captured before the restart, or still settling
+  }
+
+  const uint16_t *px = &frame->pixels[CCD_PHASE_ACTIVE_START];
+  uint32_t shield = 0;
+  for (uint32_t i = 0; i < CCD_PHASE_SHIELD_COUNT; i++) {
+    shield += frame->pixels[CCD_PHASE_SHIELD_START + i];
+  }
+  uint32_t active = 0;
+  uint32_t diff = 0;
+  for (uint32_t i = 0; i < CCD_PHASE_ACTIVE_COUNT; i++) {
+    active += px[i];
+    int32_t d = (int32_t)px[i] - (int32_t)phase_prev[i];
+    diff += (uint32_t)(d < 0 ? -d : d);
+  }
+  memcpy(phase_prev, px, sizeof(phase_prev));
+
+  // Means in counts x 256: (shield / 13 - active / 3648) * 256
+  int64_t contrast = (int64_t)shield * CCD_PHASE_ACTIVE_COUNT -
+                     (int64_t)active * CCD_PHASE_SHIELD_COUNT;
+  if (contrast > 0) {
+    phase_signal_acc += (uint32_t)((contrast * 256) /
+                                   (CCD_PHASE_SHIELD_COUNT *
+                                    CCD_PHASE_ACTIVE_COUNT));
+  }
+  if (phase_seen > 0) { // The first frame has no predecessor
+    phase_noise_acc +=
+        (uint32_t)(((uint64_t)diff * 256U) / CCD_PHASE_ACTIVE_COUNT);
+  }
+
+  if (++phase_seen < CCD_PHASE_FRAMES) {
+    return;
+  }
+  CCD_PhaseResult_t *r = &phase_report.result[phase_index];
+  r->phase = acq_adc_phase;
+  r->sample = acq_adc_sample;
+  r->reserved = 0;
+  r->signal = phase_signal_acc / CCD_PHASE_FRAMES;
+  r->noise = phase_noise_acc / (CCD_PHASE_FRAMES - 1U);
+  if (phase_index + 1U < CCD_PHASE_SETTINGS) {
+    Phase_Start(phase_index + 1U);
+  } else {
+    Phase_Finish();
+  }
+}
@@ -0,0 +1,95 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_preview.c
+ * @brief          : Low-rate binned preview next to a full-rate sink
+ ******************************************************************************
+ */
+
+#include "ccd_preview.h"
+#include "ccd_crc.h"
+#include "ccd_proc.h"
+#include "ccd_time.h"
+#include "usb_tx.h"
+#include "usbd_cdc_if.h"
+
+// Main loop only, apart from the busy flags the TX completion clears
+static uint8_t preview_rate;
+static uint8_t preview_bin = 4;
+static uint64_t preview_last; // Capture time of the last preview
+static uint8_t preview_started;
+static uint32_t preview_sent;
+static uint32_t preview_skipped;
+static volatile uint8_t preview_busy[CCD_PREVIEW_BUFS];
+
+// Filled by the CPU and read by the USB core, cleaned on submit
+__attribute__((aligned(32))) static CCD_Frame_t
+    preview_buf[CCD_PREVIEW_BUFS];
+
+static void Preview_Sent(void *ctx, uint32_t len) {
+  preview_busy[(CCD_Frame_t *)ctx - preview_buf] = 0;
+}
+
+uint8_t CCD_Preview_SetRate(uint8_t rate) {
+  if (rate > CCD_PREVIEW_RATE_MAX) {
+    return 0;
+  }
+  preview_rate = rate;
+  preview_started = 0; // The next offer goes out
+  return 1;
+}
+
+uint8_t CCD_Preview_SetBin(uint8_t bin) {
+  if (bin != 1 && bin != 2 && bin != 4 && bin != 8) {
+    return 0;
+  }
+  preview_bin = bin;
+  return 1;
+}
+
+void CCD_Preview_Status(CCD_PreviewStatus_t *out) {
+  out->rate = preview_rate;
+  out->bin = preview_bin;
+  out->busy = 0;
+  for (uint32_t i = 0; i < CCD_PREVIEW_BUFS; i++) {
+    out->busy += preview_busy[i];
+  }
+  out->reserved = 0;
+  out->sent = preview_sent;
+  out->skipped = preview_skipped;
+}
+
+uint8_t CCD_Preview_Enabled(void) { return preview_rate != 0; }
+
+// Paced on the capture timestamps, so the previews are evenly spaced in
+// time whatever the sink's batching
+void CCD_Preview_Offer(const CCD_Frame_t *frame) {
+  if (preview_rate == 0 || frame->magic != CCD_FRAME_MAGIC) {
+    return;
+  }
+  uint64_t t = frame->info.timestamp;
+  if (preview_started && t - preview_last < CCD_TIME_HZ / preview_rate) {
+    return;
+  }
+  preview_last = t; // A skipped preview waits a period too
+  preview_started = 1;
+  uint32_t i = 0;
+  while (i < CCD_PREVIEW_BUFS && preview_busy[i]) {
+    i++;
+  }
+  if (i == CCD_PREVIEW_BUFS || !CDC_IsOpen_FS() ||
+      UsbTx_Space(USB_TX_FRAMES) == 0) {
+    preview_skipped++;
+    return;
+  }
+  CCD_Frame_t *buf = &preview_buf[i];
+  uint32_t len = CCD_Proc_Preview(buf, frame, preview_bin);
+  CCD_Crc_Stamp(buf);
+  preview_busy[i] = 1;
+  if (UsbTx_Submit(USB_TX_FRAMES, (const uint8_t *)buf, len, Preview_Sent,
+                   buf)) {
+    preview_sent++;
+  } else {
+    preview_busy[i] = 0;
+    preview_skipped++;
+  }
+}
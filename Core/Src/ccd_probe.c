@@ -0,0 +1,49 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_probe.c
+ * @brief          : Cycle probes on interrupts and main loop stages (DWT)
+ ******************************************************************************
+ */
+
+#include "ccd_probe.h"
+#include <string.h>
+
+// Written from every probed handler, so it lives in DTCM
+CCD_DTCM_BSS static CCD_Probe_t probes[CCD_PROBE_COUNT];
+
+static void Probe_Clear(CCD_Probe_t *p) {
+  memset(p, 0, sizeof(*p));
+  p->min = UINT32_MAX;
+}
+
+void CCD_Probe_Init(void) {
+  for (uint32_t i = 0; i < CCD_PROBE_COUNT; i++) {
+    Probe_Clear(&probes[i]);
+  }
+}
+
+// Bin from the position of the highest set bit above CCD_PROBE_BIN0
+CCD_ITCM void CCD_Probe_End(uint8_t probe, uint32_t start) {
+  uint32_t cycles = DWT->CYCCNT - start;
+  CCD_Probe_t *p = &probes[probe];
+  p->count++;
+  p->sum += cycles;
+  if (cycles < p->min) {
+    p->min = cycles;
+  }
+  if (cycles > p->max) {
+    p->max = cycles;
+  }
+  uint32_t bin = 32U - __CLZ(cycles / CCD_PROBE_BIN0);
+  p->hist[(bin < CCD_PROBE_BINS) ? bin : CCD_PROBE_BINS - 1U]++;
+}
+
+void CCD_Probe_Read(uint8_t probe, CCD_Probe_t *out, uint8_t reset) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  *out = probes[probe];
+  if (reset) {
+    Probe_Clear(&probes[probe]);
+  }
+  __set_PRIMASK(primask);
+}
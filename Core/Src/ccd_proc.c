@@ -0,0 +1,2962 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_proc.c
+ * @brief          : On-device frame processing between the ring and USB
+ ******************************************************************************
+ */
+
+#include "ccd_proc.h"
+#include "ccd_crc.h"
+#include "ccd_flow.h"
+#include "ccd_match.h"
+#include "ccd_mem.h"
+#include "ccd_model.h"
+#include "ccd_phase.h" // Pixel classes, for the defect search
+#include "ccd_ref.h"
+#include "ccd_shutter.h"
+#include "ccd_store.h"
+#include "ccd_temp.h"
+#include "frame_ring.h"
+#include "usb_tx.h"
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+_Static_assert((CCD_BUFFER_SIZE % 2) == 0,
+               "kernels process pixels in 32-bit pairs");
+_Static_assert((offsetof(CCD_Frame_t, pixels) % 4) == 0,
+               "pixel data must be word aligned for pair loads");
+
+CCD_DTCM_BSS CCD_Proc_Stats_t ccd_proc_stats;
+CCD_DTCM_BSS CCD_Proc_Profile_t ccd_proc_profile;
+volatile uint16_t proc_coadd_n = 1;
+volatile uint16_t proc_rolling_n = 1;
+volatile uint16_t proc_dark_request = 0;
+volatile uint8_t proc_dark_state = CCD_DARK_NONE;
+volatile uint8_t proc_flat_enable = 0;
+volatile uint8_t proc_flat_request = 0;
+volatile uint8_t proc_lin_enable = 0;
+volatile uint8_t proc_black_enable = 0;
+volatile uint16_t proc_event_threshold = 0;
+volatile uint16_t proc_heartbeat_ms = CCD_PROC_HEARTBEAT_MS;
+volatile uint8_t proc_bin = 1;
+volatile uint8_t proc_bits = CCD_PROC_PACK_NONE;
+volatile uint8_t proc_codec = CCD_PROC_CODEC_NONE;
+volatile uint8_t proc_keyframe_request = 0;
+volatile uint8_t proc_stats = CCD_PROC_STATS_OFF;
+volatile uint16_t proc_stats_level = CCD_PROC_SAT_LEVEL;
+volatile uint8_t proc_peaks = CCD_PROC_PEAKS_OFF;
+volatile uint8_t proc_peak_fit = CCD_PROC_FIT_PARABOLA;
+volatile uint16_t proc_peak_threshold = CCD_PROC_PEAK_THRESHOLD;
+volatile uint16_t proc_peak_distance = CCD_PROC_PEAK_DISTANCE;
+volatile uint8_t proc_abs_mode = CCD_PROC_ABS_OFF;
+volatile uint16_t proc_abs_request = 0;
+volatile uint8_t proc_abs_state = CCD_ABS_NONE;
+volatile uint8_t proc_smooth_window = 0;
+volatile uint8_t proc_smooth_order = CCD_PROC_SMOOTH_ORDER;
+volatile uint8_t proc_despike = CCD_PROC_DESPIKE_OFF;
+volatile uint8_t proc_despike_sigma = CCD_PROC_DESPIKE_SIGMA_DEF;
+volatile uint16_t proc_despike_floor = CCD_PROC_DESPIKE_FLOOR;
+volatile uint8_t proc_baseline = CCD_PROC_BASE_OFF;
+volatile uint16_t proc_base_width = CCD_PROC_BASE_WIDTH_DEF;
+volatile uint8_t proc_defect_enable = 0;
+volatile uint8_t proc_drift = CCD_PROC_DRIFT_OFF;
+volatile uint8_t proc_drift_correct = 0;
+volatile uint16_t proc_drift_request = 0;
+volatile uint8_t proc_drift_state = CCD_DRIFT_NONE;
+volatile uint8_t proc_wide = CCD_PROC_WIDE_OFF;
+
+_Static_assert(CCD_PROC_ROLLING_MAX < 256,
+               "rolling mean uses the exact reciprocal divide");
+
+CCD_DTCM_BSS static uint16_t black_last; // Black of the last frame
+
+// Dark state. dark_comp holds 65535 - master dark, ready for the
+// saturating add in Proc_DarkSubtract().
+CCD_DTCM_BSS static uint32_t dark_acc[CCD_BUFFER_SIZE];
+CCD_DTCM_BSS static uint16_t dark_comp[CCD_BUFFER_SIZE];
+CCD_DTCM_BSS static uint16_t dark_m;     // Frames in the capture in progress
+CCD_DTCM_BSS static uint16_t dark_count; // Frames in dark_acc
+
+// Dark temperature model. dark_master is the master dark as averaged, for
+// dark_comp to be rebuilt at another temperature; only that reads it.
+static uint16_t dark_master[CCD_BUFFER_SIZE];
+static uint16_t dark_ref;                     // Its zero-dark level
+static int16_t dark_temp = CCD_TEMP_NONE;     // Sensor at the capture
+static int16_t dark_scaled = CCD_TEMP_NONE;   // Temperature of dark_comp
+static uint16_t dark_ratio = CCD_PROC_DARKT_UNITY;
+#if CCD_SHUTTER
+// Live dark (ccd_shutter.h): dark_acc holds the estimate in 24.8 fixed
+// point between captures
+static uint8_t dark_live;
+#endif
+static CCD_DarkTempKnot_t darkt_knot[CCD_PROC_DARKT_KNOTS];
+static uint8_t darkt_count;
+static uint8_t darkt_changed; // Rescale on the next poll
+
+// Flat-field gains, unsigned Q15 (32768 = 1.0). One table is applied while
+// the other is the upload target; "GA" swaps them between frames.
+CCD_DTCM_BSS static uint16_t flat_gain[2][CCD_BUFFER_SIZE];
+CCD_DTCM_BSS static uint8_t flat_active;
+
+// Change detection: copy of the last frame that passed, and when
+CCD_DTCM_BSS static uint16_t event_ref[CCD_BUFFER_SIZE];
+CCD_DTCM_BSS static uint32_t event_tick;
+CCD_DTCM_BSS static uint8_t event_valid;
+
+// ROI windows. The command parser fills roi_next and sets roi_update; the
+// pipeline copies it at the next frame so a frame never mixes two sets.
+CCD_DTCM_BSS static CCD_RoiWindow_t roi[CCD_PROC_ROI_MAX];
+CCD_DTCM_BSS static uint8_t roi_count;
+static CCD_RoiWindow_t roi_next[CCD_PROC_ROI_MAX];
+static volatile uint8_t roi_next_count;
+static volatile uint8_t roi_update;
+
+// Output of the shaping stages, copied behind the shaped header afterwards
+// (the header is longer than the slot's, so they cannot work in place)
+CCD_DTCM_BSS static uint16_t shape_buf[CCD_BUFFER_SIZE];
+
+// Temporal coding reference: the last frame sent, as the receiver decoded it
+// (values at its bit depth). Only valid while the frame shape is unchanged.
+CCD_DTCM_BSS static uint16_t temporal_ref[CCD_BUFFER_SIZE];
+CCD_DTCM_BSS static uint16_t ref_num;    // frame_num of temporal_ref
+CCD_DTCM_BSS static uint16_t ref_count;  // Values in temporal_ref
+CCD_DTCM_BSS static uint8_t ref_bin;
+CCD_DTCM_BSS static uint8_t ref_bits;
+CCD_DTCM_BSS static uint8_t ref_valid;
+CCD_DTCM_BSS static uint8_t ref_age; // Temporal frames since the keyframe
+
+// Co-add state. The accumulator is read and written once per pixel per
+// frame, so it lives in DTCM (14.8 KB).
+CCD_DTCM_BSS static uint32_t coadd_acc[CCD_BUFFER_SIZE];
+CCD_DTCM_BSS static uint16_t coadd_n;     // N the current sum was started with
+CCD_DTCM_BSS static uint16_t coadd_count; // Frames in coadd_acc
+CCD_DTCM_BSS static uint16_t coadd_next;  // frame_num expected next
+
+// Rolling state: the last K frames stay in their ring slots (oldest first)
+// and only their running sum is kept here
+CCD_DTCM_BSS static uint32_t roll_sum[CCD_BUFFER_SIZE];
+CCD_DTCM_BSS static CCD_Frame_t *roll_slots[CCD_PROC_ROLLING_MAX];
+CCD_DTCM_BSS static uint16_t roll_n;     // K the window was filled with
+CCD_DTCM_BSS static uint16_t roll_first; // Index of the oldest held frame
+CCD_DTCM_BSS static uint16_t roll_count; // Frames held
+CCD_DTCM_BSS static uint16_t roll_next;  // frame_num expected next
+
+// Two adjacent pixels as one 32-bit load (pixel i in the low half)
+static inline uint32_t Proc_Load2(const uint16_t *p) {
+  uint32_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+static inline void Proc_Store2(uint16_t *p, uint32_t w) {
+  memcpy(p, &w, sizeof(w));
+}
+
+// x / n as a multiply by ceil(2^32 / n), exact while x < 2^32 / n. For
+// x = sum of n 16-bit pixels + n/2 that holds for every n < 256 (and for
+// n = 256, where the reciprocal is exact).
+static inline uint32_t Proc_Recip(uint32_t n) {
+  return (uint32_t)((0x100000000ULL + n - 1U) / n);
+}
+
+static inline uint32_t Proc_Div(uint32_t x, uint32_t recip) {
+  return (uint32_t)(((uint64_t)x * recip) >> 32);
+}
+
+// acc += px, or acc = px for the first frame of a sum (saves a clear pass).
+// One word load per pixel pair; GCC folds the halfword extracts into
+// UXTAH/LSR + ADD, which the M7 dual-issues with the loads.
+CCD_ITCM static void Proc_Accumulate(uint32_t *acc, const uint16_t *px,
+                                     uint8_t first) {
+  if (first) {
+    for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+      uint32_t w = Proc_Load2(&px[i]);
+      acc[i] = w & 0xFFFFU;
+      acc[i + 1] = w >> 16;
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t w = Proc_Load2(&px[i]);
+    acc[i] += w & 0xFFFFU;
+    acc[i + 1] += w >> 16;
+  }
+}
+
+// ========== LINEARITY ==========
+
+// Knots of the correction: knot i is the output for a raw value of i * 256
+// (the last one only sets the slope of the top segment). One table is
+// applied while the other takes the upload, as with the flat field.
+static uint16_t lin_knot[2][CCD_LIN_KNOTS];
+CCD_DTCM_BSS static uint8_t lin_active;
+
+// Segment i as the knot at its start (low half) and the signed step to the
+// next (high half), so a pixel costs one table load. 1 KB, in DTCM.
+CCD_DTCM_BSS static uint32_t lin_seg[CCD_LIN_KNOTS - 1];
+
+static void Proc_LinBuild(const uint16_t *knot) {
+  for (uint32_t i = 0; i + 1U < CCD_LIN_KNOTS; i++) {
+    uint32_t step = (uint16_t)(knot[i + 1U] - knot[i]);
+    lin_seg[i] = knot[i] | (step << 16);
+  }
+}
+
+// Piecewise-linear map of every raw pixel, rounded and clamped to 16 bits.
+// The segment index and the fraction are the top and bottom byte.
+CCD_ITCM static void Proc_Linearize(uint16_t *px, const uint32_t *seg) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t w = Proc_Load2(&px[i]);
+    uint32_t a = seg[(w >> 8) & 0xFFU];
+    uint32_t b = seg[w >> 24];
+    int32_t dlo = ((int32_t)a >> 16) * (int32_t)(w & 0xFFU);
+    int32_t dhi = ((int32_t)b >> 16) * (int32_t)((w >> 16) & 0xFFU);
+    int32_t lo = (int32_t)(a & 0xFFFFU) + ((dlo + 128) >> 8);
+    int32_t hi = (int32_t)(b & 0xFFFFU) + ((dhi + 128) >> 8);
+    Proc_Store2(&px[i], __PKHBT(__USAT(lo, 16), __USAT(hi, 16), 16));
+  }
+}
+
+void CCD_Proc_LinWrite(uint32_t offset, const uint8_t *data, uint32_t count) {
+  uint16_t *staging = lin_knot[lin_active ^ 1U];
+  for (uint32_t i = 0; i < count && offset + i < CCD_LIN_KNOTS; i++) {
+    staging[offset + i] = (uint16_t)(data[2 * i] | (data[2 * i + 1] << 8));
+  }
+}
+
+// Main loop, between frames
+uint8_t CCD_Proc_LinService(uint8_t action) {
+  uint32_t size = sizeof(lin_knot[0]);
+  switch (action) {
+  case CCD_LIN_CMD_APPLY:
+    lin_active ^= 1U;
+    break;
+  case CCD_LIN_CMD_OFF:
+    proc_lin_enable = 0;
+    return 1;
+  case CCD_LIN_CMD_SAVE:
+    return CCD_Store_Save(CCD_STORE_LINEARITY, lin_knot[lin_active], size);
+  case CCD_LIN_CMD_LOAD:
+    if (!CCD_Store_Load(CCD_STORE_LINEARITY, lin_knot[lin_active], size)) {
+      return 0;
+    }
+    break;
+  default:
+    return 0;
+  }
+  Proc_LinBuild(lin_knot[lin_active]);
+  proc_lin_enable = 1;
+  // Later partial uploads edit a copy of what is applied now
+  memcpy(lin_knot[lin_active ^ 1U], lin_knot[lin_active], size);
+  return 1;
+}
+
+// ========== BLACK LEVEL ==========
+
+// The frame's black from its dummy outputs, and with proc_black_enable the
+// whole line moved by the difference to CCD_PROC_BLACK_LEVEL, saturating
+CCD_ITCM static void Proc_Black(uint16_t *px) {
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i < CCD_PROC_BLACK_REF; i++) {
+    sum += px[i];
+  }
+  uint32_t black = (sum + CCD_PROC_BLACK_REF / 2U) / CCD_PROC_BLACK_REF;
+  black_last = (uint16_t)black;
+  if (!proc_black_enable || black == CCD_PROC_BLACK_LEVEL) {
+    return;
+  }
+  uint8_t up = (black < CCD_PROC_BLACK_LEVEL);
+  uint32_t d =
+      up ? CCD_PROC_BLACK_LEVEL - black : black - CCD_PROC_BLACK_LEVEL;
+  d |= d << 16;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t w = Proc_Load2(&px[i]);
+    Proc_Store2(&px[i], up ? __UQADD16(w, d) : __UQSUB16(w, d));
+  }
+}
+
+void CCD_Proc_BlackStatus(CCD_BlackStatus_t *out) {
+  memset(out, 0, sizeof(*out));
+  out->enabled = proc_black_enable;
+  out->black = black_last;
+  out->level = CCD_PROC_BLACK_LEVEL;
+}
+
+// ========== DARK FRAME ==========
+
+// The CCD output falls with light, and frames keep that polarity (a rising
+// one is inverted at the handoff, ccd_sensor.h), so dark - raw is the
+// signal. raw + (65535 - dark), saturating at 65535 in UQADD16, is the
+// same correction in the wire polarity: the host's 65535 - x still gives
+// light = high, with the dark level at 0 and noise below it clamped there.
+CCD_ITCM static void Proc_DarkSubtract(uint16_t *px, const uint16_t *comp) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    Proc_Store2(&px[i], __UQADD16(Proc_Load2(&px[i]), Proc_Load2(&comp[i])));
+  }
+}
+
+// A new dark_master: its compensation, reference level and temperature
+static void Proc_DarkReady(void) {
+  uint32_t ref = 0;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    dark_comp[i] = (uint16_t)(0xFFFFU - dark_master[i]);
+  }
+  for (uint32_t i = 0; i < CCD_PROC_DARKT_REF; i++) {
+    ref += dark_master[i];
+  }
+  dark_ref = (uint16_t)(ref / CCD_PROC_DARKT_REF);
+  dark_temp = CCD_Temp_Sensor();
+  dark_scaled = dark_temp;
+  dark_ratio = CCD_PROC_DARKT_UNITY;
+  proc_dark_state = CCD_DARK_READY;
+}
+
+// Average M raw frames into a new master dark. Frames keep flowing (and the
+// previous dark, if any, stays applied) until the capture completes.
+static void Proc_DarkCapture(const CCD_Frame_t *frame) {
+  uint16_t req = proc_dark_request;
+  if (req == CCD_DARK_CLEAR_REQ) {
+    proc_dark_request = 0;
+    dark_m = 0;
+    proc_dark_state = CCD_DARK_NONE;
+#if CCD_SHUTTER
+    dark_live = 0;
+#endif
+    return;
+  }
+  if (req != 0) {
+    proc_dark_request = 0;
+    dark_m = req;
+#if CCD_SHUTTER
+    dark_live = 0; // Reseeded from the new master dark
+#endif
+    dark_count = 0;
+    proc_dark_state = (proc_dark_state & CCD_DARK_READY) | CCD_DARK_CAPTURING;
+  }
+  if (dark_m == 0) {
+    return;
+  }
+
+  Proc_Accumulate(dark_acc, frame->pixels, dark_count == 0);
+  if (++dark_count < dark_m) {
+    return;
+  }
+
+  uint32_t half = dark_m / 2U;
+  uint32_t recip = Proc_Recip(dark_m);
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    dark_master[i] = (uint16_t)Proc_Div(dark_acc[i] + half, recip);
+  }
+  dark_m = 0;
+  Proc_DarkReady();
+}
+
+#if CCD_SHUTTER
+// A closed-shutter frame, black-levelled as Proc_Frame would, moves the
+// estimate 1 / 2^shift of the way to it. A capture in progress owns
+// dark_acc; the frame is then left out.
+uint8_t CCD_Proc_LiveDark(CCD_Frame_t *frame, uint8_t shift) {
+  if (proc_lin_enable) {
+    Proc_Linearize(frame->pixels, lin_seg);
+  }
+  Proc_Black(frame->pixels);
+  if (proc_dark_state & CCD_DARK_CAPTURING) {
+    return 0;
+  }
+  const uint16_t *px = frame->pixels;
+  if (!dark_live) {
+    const uint16_t *seed =
+        (proc_dark_state & CCD_DARK_READY) ? dark_master : px;
+    for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+      dark_acc[i] = (uint32_t)seed[i] << 8;
+    }
+    dark_live = 1;
+  }
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    int32_t acc = (int32_t)dark_acc[i];
+    acc += (((int32_t)px[i] << 8) - acc) >> shift;
+    dark_acc[i] = (uint32_t)acc;
+    dark_master[i] = (uint16_t)((dark_acc[i] + 128U) >> 8);
+  }
+  Proc_DarkReady();
+  return 1;
+}
+
+uint8_t CCD_Proc_LiveDarkValid(void) {
+  return dark_live && (proc_dark_state & CCD_DARK_READY);
+}
+#endif
+
+// Relative dark current at temp: linear between knots, held past the ends
+static uint32_t Proc_DarkGain(int16_t temp) {
+  const CCD_DarkTempKnot_t *k = darkt_knot;
+  if (temp <= k[0].temp) {
+    return k[0].gain;
+  }
+  for (uint32_t i = 1; i < darkt_count; i++) {
+    if (temp <= k[i].temp) {
+      int32_t dg = (int32_t)k[i].gain - (int32_t)k[i - 1].gain;
+      int32_t dt = (int32_t)temp - k[i - 1].temp;
+      return (uint32_t)(k[i - 1].gain +
+                        dg * dt / ((int32_t)k[i].temp - k[i - 1].temp));
+    }
+  }
+  return k[darkt_count - 1U].gain;
+}
+
+// dark_comp for the sensor at temp. The dummy outputs have no photodiode,
+// so their level is the output with no dark charge: the offset below it
+// stays, the charge each pixel collected scales with the dark current.
+static void Proc_DarkScale(int16_t temp) {
+  uint32_t ratio = CCD_PROC_DARKT_UNITY;
+  if (darkt_count != 0 && temp != CCD_TEMP_NONE &&
+      dark_temp != CCD_TEMP_NONE) {
+    ratio = (Proc_DarkGain(temp) * CCD_PROC_DARKT_UNITY +
+             Proc_DarkGain(dark_temp) / 2U) /
+            Proc_DarkGain(dark_temp);
+    if (ratio > 0xFFFFU) {
+      ratio = 0xFFFFU;
+    }
+  }
+  int32_t ref = dark_ref;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    int64_t charge = (int64_t)(ref - (int32_t)dark_master[i]) * ratio;
+    int32_t d = ref - (int32_t)(charge / (int32_t)CCD_PROC_DARKT_UNITY);
+    d = (d < 0) ? 0 : (d > 0xFFFF) ? 0xFFFF : d;
+    dark_comp[i] = (uint16_t)(0xFFFFU - (uint32_t)d);
+  }
+  dark_ratio = (uint16_t)ratio;
+  dark_scaled = temp;
+}
+
+// Main loop, like CCD_Proc_Frame(), so no frame sees half a rebuild
+static void Proc_DarkFollow(void) {
+  if (!(proc_dark_state & CCD_DARK_READY)) {
+    return;
+  }
+  int16_t temp = (darkt_count != 0) ? CCD_Temp_Sensor() : dark_temp;
+  int32_t moved = (int32_t)temp - dark_scaled;
+  if (darkt_changed || moved >= CCD_PROC_DARKT_STEP ||
+      moved <= -CCD_PROC_DARKT_STEP) {
+    darkt_changed = 0;
+    Proc_DarkScale(temp);
+  }
+}
+
+uint8_t CCD_Proc_SetDarkTemp(const CCD_DarkTempKnot_t *k, uint8_t count) {
+  if (count == 1 || count > CCD_PROC_DARKT_KNOTS) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (k[i].gain == 0 || (i > 0 && k[i].temp <= k[i - 1].temp)) {
+      return 0;
+    }
+  }
+  memcpy(darkt_knot, k, count * sizeof(*k));
+  darkt_count = count;
+  darkt_changed = 1;
+  return 1;
+}
+
+uint8_t CCD_Proc_GetDarkTemp(CCD_DarkTempKnot_t *k) {
+  memcpy(k, darkt_knot, darkt_count * sizeof(*k));
+  return darkt_count;
+}
+
+void CCD_Proc_DarkTempStatus(CCD_DarkTempStatus_t *out) {
+  memset(out, 0, sizeof(*out));
+  out->count = darkt_count;
+  out->active = darkt_count != 0 && (proc_dark_state & CCD_DARK_READY) &&
+                dark_temp != CCD_TEMP_NONE;
+  out->dark_temp = dark_temp;
+  out->temp = dark_scaled;
+  out->ratio = dark_ratio;
+  out->ref = dark_ref;
+}
+
+// ========== FLAT FIELD ==========
+
+// signal = 65535 - x in wire polarity (see Proc_DarkSubtract), so the gain
+// scales the complement: x' = 65535 - min(65535, round(signal * g / 2^15)).
+// The M7 has no unsigned dual 16x16 multiply, so each pair is two MULs with
+// the loads, saturation (USAT) and repacking (PKHBT) done per word.
+CCD_ITCM static void Proc_FlatField(uint16_t *px, const uint16_t *gain) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t sig = ~Proc_Load2(&px[i]);
+    uint32_t g = Proc_Load2(&gain[i]);
+    uint32_t lo = ((sig & 0xFFFFU) * (g & 0xFFFFU) + 0x4000U) >> 15;
+    uint32_t hi = ((sig >> 16) * (g >> 16) + 0x4000U) >> 15;
+    Proc_Store2(&px[i], ~__PKHBT(__USAT((int32_t)lo, 16),
+                                 __USAT((int32_t)hi, 16), 16));
+  }
+}
+
+// One gain for the whole line, as Proc_FlatField() applies its own to each
+// pixel: the source normalization (ccd_ref.h)
+CCD_ITCM static void Proc_Normalize(uint16_t *px, uint32_t g) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t sig = ~Proc_Load2(&px[i]);
+    uint32_t lo = ((sig & 0xFFFFU) * g + 0x4000U) >> 15;
+    uint32_t hi = ((sig >> 16) * g + 0x4000U) >> 15;
+    Proc_Store2(&px[i], ~__PKHBT(__USAT((int32_t)lo, 16),
+                                 __USAT((int32_t)hi, 16), 16));
+  }
+}
+
+// Upload target for "GW" (USB interrupt context)
+void CCD_Proc_FlatWrite(uint32_t offset, const uint8_t *data, uint32_t count) {
+  uint16_t *staging = flat_gain[flat_active ^ 1U];
+  for (uint32_t i = 0; i < count && offset + i < CCD_BUFFER_SIZE; i++) {
+    staging[offset + i] = (uint16_t)(data[2 * i] | (data[2 * i + 1] << 8));
+  }
+}
+
+// Table requests posted by the command parser, run between frames
+static void Proc_FlatService(uint8_t req) {
+  uint32_t size = sizeof(flat_gain[0]);
+  switch (req) {
+  case CCD_FLAT_REQ_APPLY:
+    flat_active ^= 1U;
+    proc_flat_enable = 1;
+    break;
+  case CCD_FLAT_REQ_SAVE:
+    CCD_Store_Save(CCD_STORE_FLAT, flat_gain[flat_active], size);
+    break;
+  case CCD_FLAT_REQ_LOAD:
+    if (CCD_Store_Load(CCD_STORE_FLAT, flat_gain[flat_active], size)) {
+      proc_flat_enable = 1;
+    }
+    break;
+  default:
+    return;
+  }
+  // Later partial uploads edit a copy of what is applied now
+  memcpy(flat_gain[flat_active ^ 1U], flat_gain[flat_active], size);
+}
+
+// ========== DEFECT PIXELS ==========
+
+// A defect and the good pixels it is interpolated from; weight is right's
+// share, Q15. Left and right are never defects themselves, so the list
+// can be applied in any order.
+typedef struct {
+  uint16_t pixel;
+  uint16_t left;
+  uint16_t right;
+  uint16_t weight;
+} Proc_Defect_t;
+
+// Main loop only, as the frames. The map in AXI SRAM, the list that every
+// frame reads in DTCM.
+static uint8_t defect_map[CCD_PROC_DEFECT_BYTES];
+CCD_DTCM_BSS static Proc_Defect_t defect_list[CCD_PROC_DEFECT_MAX];
+static uint16_t defect_listed;
+static uint16_t defect_count;
+static uint16_t defect_hot;
+static uint16_t defect_dead;
+static uint8_t defect_stored;
+static uint32_t defect_frames;
+
+_Static_assert(CCD_BUFFER_SIZE <= 0xFFFFU, "defect entries are 16-bit");
+
+static inline uint32_t Proc_IsDefect(uint32_t i) {
+  return (defect_map[i >> 3] >> (i & 7U)) & 1U;
+}
+
+CCD_ITCM static void Proc_Defects(uint16_t *px, const Proc_Defect_t *d,
+                                  uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    int32_t a = px[d[i].left];
+    int32_t b = px[d[i].right];
+    px[d[i].pixel] = (uint16_t)(a + (((b - a) * d[i].weight + 0x4000) >> 15));
+  }
+}
+
+// Each defect between the nearest good pixels on either side; one at an
+// end of the line copies the neighbour it has. Past CCD_PROC_DEFECT_MAX
+// the defects are counted but not listed.
+static void Proc_DefectList(void) {
+  uint32_t n = 0;
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    if (!Proc_IsDefect(i)) {
+      continue;
+    }
+    count++;
+    int32_t l = (int32_t)i - 1;
+    uint32_t r = i + 1U;
+    while (l >= 0 && Proc_IsDefect((uint32_t)l)) {
+      l--;
+    }
+    while (r < CCD_BUFFER_SIZE && Proc_IsDefect(r)) {
+      r++;
+    }
+    if (n == CCD_PROC_DEFECT_MAX || (l < 0 && r >= CCD_BUFFER_SIZE)) {
+      continue;
+    }
+    uint32_t left = (l < 0) ? r : (uint32_t)l;
+    uint32_t right = (r >= CCD_BUFFER_SIZE) ? left : r;
+    defect_list[n].pixel = (uint16_t)i;
+    defect_list[n].left = (uint16_t)left;
+    defect_list[n].right = (uint16_t)right;
+    defect_list[n].weight =
+        (right == left) ? 0 : (uint16_t)(((i - left) << 15) / (right - left));
+    n++;
+  }
+  defect_count = (uint16_t)count;
+  defect_listed = (uint16_t)n;
+}
+
+// Median of the four pixels around i among the effective ones, mirrored
+// at their ends: the mean of the middle two
+static uint32_t Proc_NeighbourMedian(const uint16_t *v, uint32_t i) {
+  const int32_t lo = CCD_PHASE_ACTIVE_START;
+  const int32_t hi = CCD_PHASE_ACTIVE_START + CCD_PHASE_ACTIVE_COUNT - 1;
+  uint32_t n[4];
+  for (int32_t k = 0, d = -2; d <= 2; d++) {
+    int32_t j = (int32_t)i + d;
+    if (d == 0) {
+      continue;
+    }
+    j = (j < lo) ? 2 * lo - j : (j > hi) ? 2 * hi - j : j;
+    n[k++] = v[j];
+  }
+  uint32_t lo1 = n[0] < n[1] ? n[0] : n[1];
+  uint32_t hi1 = n[0] < n[1] ? n[1] : n[0];
+  uint32_t lo2 = n[2] < n[3] ? n[2] : n[3];
+  uint32_t hi2 = n[2] < n[3] ? n[3] : n[2];
+  uint32_t a = lo1 > lo2 ? lo1 : lo2;
+  uint32_t b = hi1 < hi2 ? hi1 : hi2;
+  return (a + b + 1U) / 2U;
+}
+
+static inline uint32_t Proc_Outlier(const uint16_t *v, uint32_t i,
+                                    uint32_t limit) {
+  uint32_t m = Proc_NeighbourMedian(v, i);
+  return (v[i] > m ? v[i] - m : m - v[i]) > limit;
+}
+
+uint8_t CCD_Proc_DetectDefects(uint16_t hot, uint16_t dead) {
+  if ((hot == 0 && dead == 0) ||
+      (hot != 0 && !(proc_dark_state & CCD_DARK_READY)) ||
+      (dead != 0 && !proc_flat_enable)) {
+    return 0;
+  }
+  const uint16_t *gain = flat_gain[flat_active];
+  memset(defect_map, 0, sizeof(defect_map));
+  defect_hot = 0;
+  defect_dead = 0;
+  for (uint32_t i = CCD_PHASE_ACTIVE_START;
+       i < CCD_PHASE_ACTIVE_START + CCD_PHASE_ACTIVE_COUNT; i++) {
+    if (hot != 0 && Proc_Outlier(dark_master, i, hot)) {
+      defect_hot++;
+    } else if (dead != 0 && Proc_Outlier(gain, i, dead)) {
+      defect_dead++;
+    } else {
+      continue;
+    }
+    defect_map[i >> 3] |= (uint8_t)(1U << (i & 7U));
+  }
+  defect_stored = 0;
+  Proc_DefectList();
+  proc_defect_enable = 1;
+  return 1;
+}
+
+uint8_t CCD_Proc_WriteDefects(uint32_t offset, const uint8_t *map,
+                              uint32_t n) {
+  if (offset + n > sizeof(defect_map)) {
+    return 0;
+  }
+  memcpy(&defect_map[offset], map, n);
+  if (offset + n == sizeof(defect_map)) {
+    // Bits past the last pixel
+    defect_map[sizeof(defect_map) - 1U] &=
+        (uint8_t)(0xFFU >> (sizeof(defect_map) * 8U - CCD_BUFFER_SIZE));
+  }
+  defect_stored = 0;
+  Proc_DefectList();
+  return 1;
+}
+
+void CCD_Proc_ClearDefects(void) {
+  memset(defect_map, 0, sizeof(defect_map));
+  defect_stored = 0;
+  Proc_DefectList();
+}
+
+uint8_t CCD_Proc_SaveDefects(void) {
+  if (!CCD_Store_Save(CCD_STORE_DEFECT, defect_map, sizeof(defect_map))) {
+    return 0;
+  }
+  defect_stored = 1;
+  return 1;
+}
+
+uint8_t CCD_Proc_LoadDefects(void) {
+  uint8_t map[sizeof(defect_map)];
+  if (!CCD_Store_Load(CCD_STORE_DEFECT, map, sizeof(map))) {
+    return 0;
+  }
+  memcpy(defect_map, map, sizeof(map));
+  defect_stored = 1;
+  Proc_DefectList();
+  return 1;
+}
+
+void CCD_Proc_GetDefects(uint32_t offset, CCD_DefectStatus_t *out) {
+  out->enabled = proc_defect_enable;
+  out->stored = defect_stored;
+  out->defects = defect_count;
+  out->listed = defect_listed;
+  out->hot = defect_hot;
+  out->dead = defect_dead;
+  out->offset = (uint16_t)offset;
+  out->frames = defect_frames;
+  for (uint32_t i = 0; i < CCD_PROC_DEFECT_CHUNK; i++) {
+    out->bitmap[i] =
+        (offset + i < sizeof(defect_map)) ? defect_map[offset + i] : 0;
+  }
+}
+
+// ========== SCRATCH ==========
+
+#define WIDE_OUT_BUFS 2
+
+typedef struct {
+  CCD_WideHeader_t hdr;
+  union {
+    int32_t sum[CCD_BUFFER_SIZE];
+    float mean[CCD_BUFFER_SIZE];
+  } u;
+} Proc_WideOut_t;
+
+_Static_assert(offsetof(Proc_WideOut_t, u) == sizeof(CCD_WideHeader_t),
+               "the values follow the header on the wire");
+
+// A benchmark line in whole cache lines, so the cold runs touch no
+// neighbour
+#define BENCH_BYTES ((CCD_BUFFER_SIZE * sizeof(uint16_t) + 31U) & ~31U)
+
+// The stages' share of the scratch (ccd_mem.h), claimed at each frame.
+// Another mode takes it through Proc_Yield(); what was kept in it starts
+// over when the stages have it back. Wide outputs stop the chain before
+// the captures, so the two share their space: a wide output restarts the
+// captures, and they wait while one is queued. The kernel benchmark's AXI
+// line is the third tenant, between frames.
+typedef struct {
+  uint16_t spike[2][CCD_BUFFER_SIZE]; // Spike rejection history
+  union {
+    Proc_WideOut_t wide[WIDE_OUT_BUFS]; // Read by the USB engine
+    struct {
+      uint32_t abs[CCD_BUFFER_SIZE];    // Absorbance I0 capture
+      uint32_t drift[CCD_BUFFER_SIZE];  // Drift reference capture
+      uint32_t search[CCD_BUFFER_SIZE]; // Auto ROI search frames, summed
+    } acc;
+    __attribute__((aligned(32))) uint16_t bench[BENCH_BYTES / 2U];
+  } u;
+} Proc_Scratch_t;
+
+_Static_assert(sizeof(Proc_Scratch_t) <= CCD_MEM_SCRATCH_SIZE,
+               "the stages' buffers fit the scratch");
+
+CCD_DTCM_BSS static Proc_Scratch_t *proc_scratch; // NULL: another mode's
+
+// ========== SPIKE REJECTION ==========
+
+// The two frames before this one are in the scratch (Proc_Scratch_t.spike):
+// DTCM has no room for two more lines, and each is read and written once
+// per frame, in order
+CCD_DTCM_BSS static uint8_t spike_held;   // Lines in the history
+CCD_DTCM_BSS static uint8_t spike_oldest; // Index of the older one
+CCD_DTCM_BSS static uint16_t spike_next;  // frame_num expected next
+CCD_DTCM_BSS static CCD_DespikeStatus_t spike_st;
+
+// Median of three pixel pairs, per halfword: USUB16 sets GE where a >= b,
+// so SEL takes the lower and the higher of each lane, then
+// max(min(a, b), min(max(a, b), c)). Seven instructions, no branch.
+static inline uint32_t Proc_Med3(uint32_t a, uint32_t b, uint32_t c) {
+  (void)__USUB16(a, b);
+  uint32_t lo = __SEL(b, a);
+  uint32_t hi = __SEL(a, b);
+  (void)__USUB16(hi, c);
+  hi = __SEL(c, hi);
+  (void)__USUB16(lo, hi);
+  return __SEL(lo, hi);
+}
+
+static inline uint32_t Proc_AbsDiff2(uint32_t a, uint32_t b) {
+  return __UQSUB16(a, b) | __UQSUB16(b, a);
+}
+
+// px = median of old, prev and px, whose own pixels replace old's
+CCD_ITCM static void Proc_Median3(uint16_t *px, uint16_t *old,
+                                  const uint16_t *prev) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t a = Proc_Load2(&old[i]);
+    uint32_t b = Proc_Load2(&prev[i]);
+    uint32_t c = Proc_Load2(&px[i]);
+    Proc_Store2(&old[i], c);
+    Proc_Store2(&px[i], Proc_Med3(a, b, c));
+  }
+}
+
+// As Proc_Median3(), but a pixel keeps its value unless it is further from
+// the median m than max(level, mad * k / 256), mad the median of the three
+// distances to m. The threshold takes two MULs per pair (no unsigned dual
+// 16x16 multiply); the keep-or-replace choice is one more USUB16 + SEL,
+// whose GE bits also count the replaced pixels. Returns that count.
+CCD_ITCM static uint32_t Proc_Despike(uint16_t *px, uint16_t *old,
+                                      const uint16_t *prev, uint32_t k,
+                                      uint32_t level) {
+  uint32_t fl = level | (level << 16);
+  uint32_t count = 0; // Two halfword counters
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t a = Proc_Load2(&old[i]);
+    uint32_t b = Proc_Load2(&prev[i]);
+    uint32_t c = Proc_Load2(&px[i]);
+    Proc_Store2(&old[i], c);
+    uint32_t m = Proc_Med3(a, b, c);
+    uint32_t d = Proc_AbsDiff2(c, m);
+    uint32_t mad = Proc_Med3(Proc_AbsDiff2(a, m), Proc_AbsDiff2(b, m), d);
+    uint32_t lo = ((mad & 0xFFFFU) * k) >> 8;
+    uint32_t hi = ((mad >> 16) * k) >> 8;
+    uint32_t t = __PKHBT(__USAT((int32_t)lo, 16), __USAT((int32_t)hi, 16), 16);
+    (void)__USUB16(t, fl);
+    t = __SEL(t, fl);
+    (void)__USUB16(t, d);
+    Proc_Store2(&px[i], __SEL(c, m));
+    count = __UADD16(count, __SEL(0U, 0x00010001U));
+  }
+  return (count & 0xFFFFU) + (count >> 16);
+}
+
+// sigma in tenths times 1.4826, in Q8
+static inline uint32_t Proc_DespikeGain(uint8_t sigma) {
+  return (sigma * 3795U + 50U) / 100U;
+}
+
+// The history restarts on a frame_num gap; until it holds two lines the
+// frame only goes into it
+static void Proc_DespikeFrame(CCD_Frame_t *frame, uint8_t mode) {
+  uint16_t(*hist)[CCD_BUFFER_SIZE] = proc_scratch->spike;
+  if (spike_held > 0 && frame->frame_num != spike_next) {
+    spike_held = 0;
+    spike_st.restarts++;
+  }
+  spike_next = (uint16_t)(frame->frame_num + 1U);
+  if (spike_held < 2U) {
+    memcpy(hist[(spike_oldest + spike_held) & 1U], frame->pixels,
+           sizeof(hist[0]));
+    spike_held++;
+    return;
+  }
+  uint16_t *old = hist[spike_oldest];
+  const uint16_t *prev = hist[spike_oldest ^ 1U];
+  spike_oldest ^= 1U;
+  spike_st.frames++;
+  if (mode == CCD_PROC_DESPIKE_MEDIAN) {
+    Proc_Median3(frame->pixels, old, prev);
+    return;
+  }
+  uint32_t n = Proc_Despike(frame->pixels, old, prev,
+                            Proc_DespikeGain(proc_despike_sigma),
+                            proc_despike_floor);
+  spike_st.last = n;
+  if (n != 0) {
+    spike_st.spiked++;
+    spike_st.replaced += n;
+    if (n > spike_st.worst) {
+      spike_st.worst = n;
+    }
+  }
+}
+
+uint8_t CCD_Proc_SetDespike(uint8_t mode, uint8_t sigma, uint16_t level) {
+  if (mode > CCD_PROC_DESPIKE_SIGMA || sigma < CCD_PROC_DESPIKE_SIGMA_MIN) {
+    return 0;
+  }
+  proc_despike_sigma = sigma;
+  proc_despike_floor = level;
+  proc_despike = mode;
+  return 1;
+}
+
+void CCD_Proc_GetDespike(CCD_DespikeStatus_t *out) {
+  *out = spike_st;
+  out->mode = proc_despike;
+  out->sigma = proc_despike_sigma;
+  out->floor = proc_despike_floor;
+  out->held = spike_held;
+}
+
+// ========== CO-ADD ==========
+
+// out = round(acc / n), packed back into pixel pairs with PKHBT
+CCD_ITCM static void Proc_CoaddMean(uint16_t *out, const uint32_t *acc,
+                                    uint32_t n) {
+  uint32_t half = n / 2U;
+  uint32_t recip = Proc_Recip(n);
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t lo = Proc_Div(acc[i] + half, recip);
+    uint32_t hi = Proc_Div(acc[i + 1] + half, recip);
+    Proc_Store2(&out[i], __PKHBT(lo, hi, 16));
+  }
+}
+
+// Sum N consecutive frames. A gap in frame_num (drop, resync, restart)
+// discards the partial sum so every output covers exactly N real frames.
+// Returns NULL while the sum is incomplete; those slots are released here.
+static CCD_Frame_t *Proc_Coadd(CCD_Frame_t *frame, uint16_t n) {
+  if (n != coadd_n) {
+    coadd_n = n;
+    coadd_count = 0;
+  }
+  if (coadd_count > 0 && frame->frame_num != coadd_next) {
+    ccd_proc_stats.coadd_restarts++;
+    coadd_count = 0;
+  }
+  coadd_next = (uint16_t)(frame->frame_num + 1U);
+
+  Proc_Accumulate(coadd_acc, frame->pixels, coadd_count == 0);
+  if (++coadd_count < n) {
+    FrameRing_Release(frame, 1);
+    ccd_proc_stats.coadded++;
+    return NULL;
+  }
+
+  // The mean goes out in the N-th frame's slot, keeping its header
+  coadd_count = 0;
+  Proc_CoaddMean(frame->pixels, coadd_acc, n);
+  frame->info.flags |= CCD_FRAME_F_COADD;
+  frame->info.coadd = n;
+  return frame;
+}
+
+// ========== ROLLING AVERAGE ==========
+
+// One window step in a single pass: sum += in - old, then the mean is
+// written over old, whose raw data is no longer needed. Cost is the same for
+// every K.
+CCD_ITCM static void Proc_RollingStep(uint32_t *sum, uint16_t *old,
+                                      const uint16_t *in, uint32_t k) {
+  uint32_t half = k / 2U;
+  uint32_t recip = Proc_Recip(k);
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t w_in = Proc_Load2(&in[i]);
+    uint32_t w_old = Proc_Load2(&old[i]);
+    uint32_t s0 = sum[i] + (w_in & 0xFFFFU) - (w_old & 0xFFFFU);
+    uint32_t s1 = sum[i + 1] + (w_in >> 16) - (w_old >> 16);
+    sum[i] = s0;
+    sum[i + 1] = s1;
+    Proc_Store2(&old[i],
+                __PKHBT(Proc_Div(s0 + half, recip), Proc_Div(s1 + half, recip),
+                        16));
+  }
+}
+
+// Give every held frame back to the ring and start an empty window
+static void Proc_RollingFlush(void) {
+  while (roll_count > 0) {
+    FrameRing_Release(roll_slots[roll_first], 1);
+    roll_first = (uint16_t)((roll_first + 1U) % CCD_PROC_ROLLING_MAX);
+    roll_count--;
+  }
+  roll_first = 0;
+}
+
+// Moving mean over the last K frames, one output per input once the window
+// is full. The integer running sum is exact, so it never drifts. The output
+// reuses the slot of the frame leaving the window, stamped with the newest
+// frame's header; a frame_num gap refills the window from scratch.
+static CCD_Frame_t *Proc_Rolling(CCD_Frame_t *frame, uint16_t k) {
+  if (k != roll_n || (roll_count > 0 && frame->frame_num != roll_next)) {
+    Proc_RollingFlush();
+    roll_n = k;
+  }
+  roll_next = (uint16_t)(frame->frame_num + 1U);
+
+  if (roll_count < k) {
+    Proc_Accumulate(roll_sum, frame->pixels, roll_count == 0);
+    roll_slots[(roll_first + roll_count) % CCD_PROC_ROLLING_MAX] = frame;
+    roll_count++;
+    return NULL; // Window still filling
+  }
+
+  CCD_Frame_t *out = roll_slots[roll_first];
+  Proc_RollingStep(roll_sum, out->pixels, frame->pixels, k);
+  out->magic = frame->magic;
+  out->frame_num = frame->frame_num;
+  out->info = frame->info;
+  out->info.flags |= CCD_FRAME_F_ROLLING;
+  out->info.coadd = (uint16_t)(out->info.coadd * k);
+  roll_slots[roll_first] = frame;
+  roll_first = (uint16_t)((roll_first + 1U) % CCD_PROC_ROLLING_MAX);
+  return out;
+}
+
+// ========== WIDE OUTPUT ==========
+
+// The output buffers are in the scratch (Proc_Scratch_t.u.wide)
+static volatile uint8_t wide_busy[WIDE_OUT_BUFS];
+static uint16_t wide_dropped;
+
+// out = acc / n, one VCVT and one VMUL per pixel
+CCD_ITCM static void Proc_WideMean(float *out, const uint32_t *acc,
+                                   uint32_t n) {
+  float scale = 1.0f / (float)n;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    out[i] = (float)acc[i] * scale;
+    out[i + 1] = (float)acc[i + 1] * scale;
+  }
+}
+
+static void Proc_WideSent(void *ctx, uint32_t len) {
+  wide_busy[(Proc_WideOut_t *)ctx - proc_scratch->u.wide] = 0;
+}
+
+static uint8_t Proc_WideQueued(void) {
+  uint8_t queued = 0;
+  for (uint32_t b = 0; b < WIDE_OUT_BUFS; b++) {
+    queued += wide_busy[b];
+  }
+  return queued;
+}
+
+// The sum behind a co-add or rolling output, queued for USB from the
+// stage's buffers; the slot goes back to the ring either way
+static void Proc_WideFrame(CCD_Frame_t *frame, uint8_t format) {
+  uint8_t rolling = (frame->info.flags & CCD_FRAME_F_ROLLING) != 0;
+  Proc_WideOut_t *out = NULL;
+  for (uint32_t b = 0; b < WIDE_OUT_BUFS && proc_scratch != NULL; b++) {
+    if (!wide_busy[b]) {
+      out = &proc_scratch->u.wide[b];
+      break;
+    }
+  }
+  if (out == NULL || UsbTx_Space(USB_TX_FRAMES) == 0) {
+    wide_dropped++;
+    FrameRing_Release(frame, 1);
+    return;
+  }
+  const uint32_t *acc = rolling ? roll_sum : coadd_acc;
+  uint16_t terms = rolling ? roll_n : coadd_n;
+  if (format == CCD_PROC_WIDE_SUM) {
+    memcpy(out->u.sum, acc, sizeof(out->u.sum));
+  } else {
+    Proc_WideMean(out->u.mean, acc, terms);
+  }
+  out->hdr.magic = CCD_WIDE_MAGIC;
+  out->hdr.frame_num = frame->frame_num;
+  out->hdr.info = frame->info;
+  out->hdr.info.header_len = sizeof(out->hdr);
+  out->hdr.info.payload_len = sizeof(out->u);
+  out->hdr.format = format;
+  out->hdr.reserved = 0;
+  out->hdr.terms = terms;
+  FrameRing_Release(frame, 1);
+  CCD_Crc_Stamp(&out->hdr);
+  wide_busy[out - proc_scratch->u.wide] = 1;
+  if (UsbTx_Submit(USB_TX_FRAMES, (const uint8_t *)out, sizeof(*out),
+                   Proc_WideSent, out)) {
+    CCD_Flow_Spend(1);
+  } else {
+    wide_busy[out - proc_scratch->u.wide] = 0;
+    wide_dropped++;
+  }
+}
+
+void CCD_Proc_GetWide(CCD_WideStatus_t *out) {
+  out->format = proc_wide;
+  out->queued = Proc_WideQueued();
+  out->dropped = wide_dropped;
+}
+
+// ========== CHANGE DETECTION ==========
+
+// Sum of absolute differences, two pixels per step: UQSUB16 both ways
+// leaves |a - b| in each halfword (the other order saturates to 0). This is
+// the 16-bit form of the USADA8 idiom; an 8-bit SAD would only see changes of
+// 256 counts and up.
+CCD_ITCM static uint32_t Proc_Sad(const uint16_t *a, const uint16_t *b) {
+  uint32_t sad = 0;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t x = Proc_Load2(&a[i]);
+    uint32_t y = Proc_Load2(&b[i]);
+    uint32_t d = __UQSUB16(x, y) | __UQSUB16(y, x);
+    sad += (d & 0xFFFFU) + (d >> 16);
+  }
+  return sad; // <= 3694 * 65535, no overflow
+}
+
+// Pass the frame if it differs from the last frame passed by more than the
+// threshold, or the heartbeat is due; otherwise release it and return NULL
+static CCD_Frame_t *Proc_ChangeDetect(CCD_Frame_t *frame, uint16_t t) {
+  uint32_t now = HAL_GetTick();
+  if (event_valid && now - event_tick < proc_heartbeat_ms &&
+      Proc_Sad(frame->pixels, event_ref) <= (uint32_t)t * CCD_BUFFER_SIZE) {
+    FrameRing_Release(frame, 1);
+    ccd_proc_stats.unchanged++;
+    return NULL;
+  }
+  memcpy(event_ref, frame->pixels, sizeof(event_ref));
+  event_tick = now;
+  event_valid = 1;
+  return frame;
+}
+
+// ========== ABSORBANCE ==========
+
+// Reference state. The tables sit in AXI SRAM, read once per frame in
+// order; the capture, rare, sums into the scratch (Proc_Scratch_t.u.acc).
+static uint16_t abs_i0[CCD_BUFFER_SIZE]; // Reference light, at least 1
+static float abs_ref[CCD_BUFFER_SIZE];   // Per pixel, for abs_ref_mode
+CCD_DTCM_BSS static uint16_t abs_m;       // Frames in the capture in progress
+CCD_DTCM_BSS static uint16_t abs_count;   // Frames in the sum
+CCD_DTCM_BSS static uint8_t abs_ref_mode; // Mode abs_ref was built for
+
+// log2(1 + i / 256), each the float nearest the exact value, in flash;
+// copied to DTCM at init, where the per-pixel lookups read it
+static const float abs_log2_rom[257] = {
+    0.0f, 0.005624549f, 0.011227256f, 0.016808288f, 0.022367813f, 0.027905997f,
+    0.033423003f, 0.03891899f, 0.04439412f, 0.04984855f, 0.055282436f,
+    0.06069593f, 0.06608919f, 0.07146236f, 0.0768156f, 0.08214904f, 0.08746284f,
+    0.09275714f, 0.09803208f, 0.10328781f, 0.10852446f, 0.113742165f,
+    0.118941076f, 0.12412131f, 0.12928301f, 0.13442633f, 0.13955136f,
+    0.14465824f, 0.14974712f, 0.1548181f, 0.15987134f, 0.16490693f, 0.169925f,
+    0.17492568f, 0.1799091f, 0.18487534f, 0.18982457f, 0.19475685f, 0.19967234f,
+    0.20457114f, 0.20945336f, 0.21431912f, 0.21916851f, 0.22400168f,
+    0.22881868f, 0.23361968f, 0.23840474f, 0.24317399f, 0.24792752f,
+    0.25266543f, 0.25738785f, 0.26209486f, 0.26678655f, 0.27146304f,
+    0.27612442f, 0.28077078f, 0.2854022f, 0.29001886f, 0.29462075f, 0.29920802f,
+    0.30378073f, 0.30833903f, 0.31288296f, 0.3174126f, 0.32192808f, 0.3264295f,
+    0.33091688f, 0.33539036f, 0.33985f, 0.34429592f, 0.34872815f, 0.35314682f,
+    0.357552f, 0.36194378f, 0.36632222f, 0.3706874f, 0.37503943f, 0.37937838f,
+    0.3837043f, 0.3880173f, 0.3923174f, 0.39660478f, 0.40087944f, 0.40514147f,
+    0.40939093f, 0.41362792f, 0.41785252f, 0.42206475f, 0.42626476f,
+    0.43045256f, 0.43462822f, 0.43879184f, 0.44294348f, 0.44708323f,
+    0.45121112f, 0.4553272f, 0.45943162f, 0.46352437f, 0.46760556f, 0.47167522f,
+    0.47573343f, 0.47978026f, 0.4838158f, 0.48784003f, 0.4918531f, 0.49585503f,
+    0.4998459f, 0.5038257f, 0.5077946f, 0.51175267f, 0.51569986f, 0.5196363f,
+    0.52356195f, 0.527477f, 0.5313815f, 0.5352754f, 0.5391588f, 0.5430318f,
+    0.54689443f, 0.5507468f, 0.55458885f, 0.5584207f, 0.56224245f, 0.56605405f,
+    0.56985563f, 0.5736472f, 0.5774288f, 0.5812006f, 0.5849625f, 0.58871466f,
+    0.59245706f, 0.59618974f, 0.5999128f, 0.6036264f, 0.6073303f, 0.6110248f,
+    0.61470985f, 0.6183855f, 0.62205184f, 0.6257088f, 0.6293566f, 0.6329952f,
+    0.63662463f, 0.64024496f, 0.64385617f, 0.64745843f, 0.6510517f, 0.654636f,
+    0.65821147f, 0.6617781f, 0.6653359f, 0.668885f, 0.6724253f, 0.675957f,
+    0.6794801f, 0.6829946f, 0.68650055f, 0.689998f, 0.6934869f, 0.69696754f,
+    0.7004397f, 0.70390356f, 0.70735914f, 0.7108064f, 0.7142455f, 0.7176764f,
+    0.7210992f, 0.7245138f, 0.7279205f, 0.731319f, 0.7347096f, 0.73809224f,
+    0.741467f, 0.7448338f, 0.74819285f, 0.75154406f, 0.7548875f, 0.75822324f,
+    0.76155126f, 0.7648716f, 0.7681843f, 0.77148944f, 0.77478707f, 0.7780771f,
+    0.78135973f, 0.7846348f, 0.78790253f, 0.7911629f, 0.7944159f, 0.79766154f,
+    0.8008999f, 0.80413103f, 0.8073549f, 0.8105716f, 0.8137812f, 0.81698364f,
+    0.820179f, 0.82336724f, 0.8265485f, 0.82972276f, 0.83289003f, 0.83605033f,
+    0.8392038f, 0.84235036f, 0.84549004f, 0.8486229f, 0.85174906f, 0.8548684f,
+    0.85798097f, 0.8610869f, 0.86418617f, 0.86727875f, 0.8703647f, 0.87344414f,
+    0.87651694f, 0.87958324f, 0.88264304f, 0.88569635f, 0.8887432f, 0.8917837f,
+    0.89481777f, 0.89784545f, 0.9008668f, 0.90388185f, 0.9068906f, 0.9098931f,
+    0.91288936f, 0.91587937f, 0.91886324f, 0.92184097f, 0.9248125f, 0.92777795f,
+    0.9307373f, 0.93369067f, 0.93663794f, 0.9395792f, 0.9425145f, 0.9454438f,
+    0.94836724f, 0.9512847f, 0.95419633f, 0.95710206f, 0.96000195f, 0.962896f,
+    0.9657843f, 0.9686668f, 0.97154355f, 0.9744146f, 0.9772799f, 0.98013955f,
+    0.9829936f, 0.98584193f, 0.9886847f, 0.99152184f, 0.9943534f, 0.9971795f,
+    1.0f,
+};
+CCD_DTCM_BSS static float abs_log2[257];
+
+// log2(x) for x >= 1 from the float's exponent and a table over the top 8
+// mantissa bits, interpolated with the next 15. Error < 3e-6, far below the
+// output's 1/4096 AU.
+static inline float Proc_Log2(uint32_t x) {
+  float f = (float)x;
+  uint32_t b;
+  memcpy(&b, &f, sizeof(b));
+  uint32_t i = (b >> 15) & 0xFFU;
+  float frac = (float)(b & 0x7FFFU) * (1.0f / 32768.0f);
+  float lo = abs_log2[i];
+  return (float)((int32_t)(b >> 23) - 127) + lo + (abs_log2[i + 1] - lo) * frac;
+}
+
+// The per-pixel factor of each mode: 32768 / I0 for the transmittance, and
+// 32768.5 + K * log2(I0) for the absorbance, K = 4096 * log10(2) (offset and
+// rounding folded in)
+static void Proc_AbsTable(uint8_t mode) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    abs_ref[i] = (mode == CCD_PROC_ABS_TRANSMITTANCE)
+                     ? 32768.0f / (float)abs_i0[i]
+                     : 32768.5f + CCD_ABS_K * Proc_Log2(abs_i0[i]);
+  }
+  abs_ref_mode = mode;
+}
+
+// Average M frames, as they reach this stage, into the reference I0. Frames
+// pass unchanged while it runs.
+static void Proc_AbsCapture(const CCD_Frame_t *frame) {
+  uint16_t req = proc_abs_request;
+  if (req != 0) {
+    proc_abs_request = 0;
+    abs_m = req;
+    abs_count = 0;
+    proc_abs_state = CCD_ABS_CAPTURING;
+  }
+  uint32_t *acc = proc_scratch->u.acc.abs;
+  Proc_Accumulate(acc, frame->pixels, abs_count == 0);
+  if (++abs_count < abs_m) {
+    return;
+  }
+  uint32_t half = abs_m / 2U;
+  uint32_t recip = Proc_Recip(abs_m);
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    uint32_t i0 = 0xFFFFU - Proc_Div(acc[i] + half, recip);
+    abs_i0[i] = (uint16_t)(i0 > 0 ? i0 : 1U);
+  }
+  abs_m = 0;
+  abs_ref_mode = CCD_PROC_ABS_OFF; // Tables follow on the next frame
+  proc_abs_state = CCD_ABS_READY;
+}
+
+// T = I / I0 as unsigned Q15 (32768 = 1, saturating just under 2), or
+// A = -log10(I / I0) as offset binary Q12 (32768 + 4096 * A, so -8..+8 AU),
+// with I = 65535 - pixel the light and I < 1 taken as 1
+CCD_ITCM static void Proc_Absorbance(uint16_t *px, const float *ref,
+                                     uint8_t mode) {
+  if (mode == CCD_PROC_ABS_TRANSMITTANCE) {
+    for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+      float t = (float)(0xFFFFU - px[i]) * ref[i] + 0.5f;
+      px[i] = (uint16_t)__USAT((int32_t)t, 16);
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    uint32_t light = 0xFFFFU - px[i];
+    float a = ref[i] - CCD_ABS_K * Proc_Log2(light > 0 ? light : 1U);
+    px[i] = (uint16_t)__USAT((int32_t)a, 16);
+  }
+}
+
+// ========== SMOOTHING ==========
+
+// Savitzky-Golay sets, Q15, centre tap first (the sets are symmetric). Rows
+// are windows 5, 7, ..., 25; orders 2 and 3 share a set, as do 4 and 5. The
+// centre tap absorbs the rounding, so every set sums to exactly 32768.
+static const int16_t sg_half[2][CCD_PROC_SMOOTH_SETS]
+                            [CCD_PROC_SMOOTH_MAX / 2 + 1] = {
+    {
+        {15916, 11235, -2809},
+        {10924, 9362, 4681, -3121},
+        {8370, 7660, 5532, 1986, -2979},
+        {6800, 6416, 5270, 3361, 687, -2750},
+        {5730, 5500, 4812, 3666, 2062, 0, -2521},
+        {4954, 4804, 4359, 3618, 2580, 1245, -386, -2313},
+        {4362, 4261, 3957, 3449, 2739, 1826, 710, -609, -2130},
+        {3898, 3826, 3609, 3246, 2739, 2087, 1290, 348, -739, -1971},
+        {3526, 3471, 3310, 3042, 2667, 2185, 1596, 900, 96, -814, -1832},
+        {3218, 3175, 3053, 2849, 2564, 2198, 1750, 1221, 611, -81, -855, -1710},
+        {2958, 2925, 2830, 2672, 2450, 2166, 1817, 1406, 931, 393, -209, -874,
+         -1602},
+    },
+    {
+        {0}, // Window 5 has no order 4 set
+        {18584, 10639, -4256, 709},
+        {13672, 10312, 2291, -4201, 1146},
+        {10922, 9166, 4583, -764, -3437, 1375},
+        {9124, 8088, 5257, 1483, -1820, -2669, 1483},
+        {7848, 7183, 5321, 2664, -117, -2084, -2029, 1522},
+        {6890, 6438, 5150, 3239, 1054, -913, -2029, -1522, 1522},
+        {6146, 5822, 4896, 3485, 1786, 79, -1279, -1853, -1125, 1500},
+        {5546, 5308, 4620, 3553, 2225, 804, -497, -1414, -1639, -814, 1465},
+        {5056, 4874, 4349, 3524, 2474, 1305, 150, -825, -1425, -1425, -570,
+         1425},
+        {4644, 4503, 4094, 3444, 2604, 1641, 644, -278, -999, -1370, -1225,
+         -377, 1381},
+    },
+};
+
+// Taps of the selected set as SMLAD pairs (c[2m] low), the last padded with
+// a zero tap
+CCD_DTCM_BSS static uint32_t smooth_taps[CCD_PROC_SMOOTH_MAX / 2 + 1];
+CCD_DTCM_BSS static uint8_t smooth_window; // Of smooth_taps, 0 = none yet
+CCD_DTCM_BSS static uint8_t smooth_order;
+
+// The line as signed Q15 (pixel - 32768), with copies of the end pixels for
+// the taps past either end (scipy's mode='nearest'), plus one for the pad tap
+CCD_DTCM_BSS __attribute__((aligned(4))) static uint16_t
+    smooth_line[CCD_BUFFER_SIZE + CCD_PROC_SMOOTH_MAX + 1];
+
+uint8_t CCD_Proc_SmoothValid(uint8_t w, uint8_t order) {
+  return (w & 1U) && w >= CCD_PROC_SMOOTH_MIN && w <= CCD_PROC_SMOOTH_MAX &&
+         order >= 2U && order <= 5U && (order < 4U || w >= 7U);
+}
+
+static void Proc_SmoothSelect(uint8_t w, uint8_t order) {
+  const int16_t *half = sg_half[order >= 4U][(w - CCD_PROC_SMOOTH_MIN) / 2U];
+  uint32_t h = w / 2U;
+  uint16_t c[CCD_PROC_SMOOTH_MAX + 1];
+  for (uint32_t k = 0; k < w; k++) {
+    c[k] = (uint16_t)half[k < h ? h - k : k - h];
+  }
+  c[w] = 0;
+  for (uint32_t m = 0; m <= h; m++) {
+    smooth_taps[m] = c[2U * m] | ((uint32_t)c[2U * m + 1U] << 16);
+  }
+  smooth_window = w;
+  smooth_order = order;
+}
+
+// FIR over the line, two outputs per step from one word load per tap pair:
+// SMLAD takes the pair (x[i+2m], x[i+2m+1]) for output i, and PKHBT of the
+// word and the next gives (x[i+2m+1], x[i+2m+2]) for output i + 1. The
+// accumulators cannot overflow (sum |c| < 1.6 for every set), and the result
+// is rounded, saturated and moved back to unsigned.
+CCD_ITCM static void Proc_Smooth(uint16_t *px, const uint32_t *taps,
+                                 uint32_t w) {
+  uint32_t h = w / 2U;
+  uint16_t *x = smooth_line;
+  for (uint32_t i = 0; i < h; i++) {
+    x[i] = px[0] ^ 0x8000U;
+  }
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    Proc_Store2(&x[h + i], Proc_Load2(&px[i]) ^ 0x80008000U);
+  }
+  for (uint32_t i = 0; i <= h + 1U; i++) {
+    x[h + CCD_BUFFER_SIZE + i] = px[CCD_BUFFER_SIZE - 1] ^ 0x8000U;
+  }
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    int32_t a0 = 0x4000, a1 = 0x4000;
+    uint32_t lo = Proc_Load2(&x[i]);
+    for (uint32_t m = 0; m <= h; m++) {
+      uint32_t hi = Proc_Load2(&x[i + 2U * m + 2U]);
+      a0 = __SMLAD(taps[m], lo, a0);
+      a1 = __SMLAD(taps[m], __PKHBT(lo >> 16, hi, 16), a1);
+      lo = hi;
+    }
+    Proc_Store2(&px[i], __PKHBT((uint32_t)(__SSAT(a0 >> 15, 16) + 0x8000),
+                                (uint32_t)(__SSAT(a1 >> 15, 16) + 0x8000),
+                                16));
+  }
+}
+
+// ========== BASELINE ==========
+
+_Static_assert(CCD_PROC_BASE_DECIM % 4 == 0,
+               "block centres fall on pixel pairs");
+
+// The decimated copy, in pixel values: the least light is the largest
+CCD_DTCM_BSS static uint16_t base_blk[CCD_PROC_BASE_BLOCKS];
+CCD_DTCM_BSS static uint16_t base_tmp[CCD_PROC_BASE_BLOCKS];
+CCD_DTCM_BSS static CCD_BaselineStatus_t base_st;
+
+// Largest pixel of each block, a pair at a time with USUB16 + SEL
+static void Base_Blocks(const uint16_t *px, uint16_t *blk) {
+  for (uint32_t b = 0; b < CCD_PROC_BASE_BLOCKS; b++) {
+    uint32_t i = b * CCD_PROC_BASE_DECIM;
+    uint32_t end = i + CCD_PROC_BASE_DECIM;
+    if (end > CCD_BUFFER_SIZE) {
+      end = CCD_BUFFER_SIZE;
+    }
+    uint32_t m = 0;
+    for (; i < end; i += 2) {
+      uint32_t x = Proc_Load2(&px[i]);
+      (void)__USUB16(x, m);
+      m = __SEL(x, m);
+    }
+    blk[b] = (uint16_t)(((m & 0xFFFFU) > (m >> 16)) ? m : m >> 16);
+  }
+}
+
+// out[b] = the largest (or the smallest) of in over b - h .. b + h, the
+// line's ends clamped. A few hundred blocks: the plain double loop.
+static void Base_Window(const uint16_t *in, uint16_t *out, uint32_t h,
+                        uint8_t largest) {
+  const int32_t n = CCD_PROC_BASE_BLOCKS;
+  for (int32_t b = 0; b < n; b++) {
+    int32_t lo = (b > (int32_t)h) ? b - (int32_t)h : 0;
+    int32_t hi = (b + (int32_t)h < n) ? b + (int32_t)h : n - 1;
+    uint16_t v = in[lo];
+    for (int32_t j = lo + 1; j <= hi; j++) {
+      if (largest ? in[j] > v : in[j] < v) {
+        v = in[j];
+      }
+    }
+    out[b] = v;
+  }
+}
+
+// Box mean over 2h + 1 blocks, the end blocks repeated past the ends
+static void Base_Box(const uint16_t *in, uint16_t *out, uint32_t h) {
+  const int32_t n = CCD_PROC_BASE_BLOCKS;
+  uint32_t taps = 2U * h + 1U;
+  uint32_t sum = 0;
+  for (int32_t j = -(int32_t)h; j <= (int32_t)h; j++) {
+    sum += in[(j < 0) ? 0 : (j < n) ? j : n - 1];
+  }
+  for (int32_t b = 0; b < n; b++) {
+    out[b] = (uint16_t)((sum + taps / 2U) / taps);
+    int32_t add = b + (int32_t)h + 1;
+    int32_t drop = b - (int32_t)h;
+    sum += in[(add < n) ? add : n - 1];
+    sum -= in[(drop > 0) ? drop : 0];
+  }
+}
+
+// The level, interpolated between block centres (held past the outer
+// ones), under every pixel pair. Subtracting in wire polarity, light above
+// it is level - pixel: UQSUB16 saturates the pixels above the level to no
+// light, and USUB16's GE bits count them. Returns that count.
+CCD_ITCM static uint32_t Proc_Baseline(uint16_t *px, const uint16_t *blk,
+                                       uint8_t mode) {
+  const uint32_t d = CCD_PROC_BASE_DECIM;
+  uint32_t count = 0; // Two halfword counters
+  uint32_t i = 0;
+  for (uint32_t b = 0; b <= CCD_PROC_BASE_BLOCKS; b++) {
+    uint32_t lo = blk[(b > 0) ? b - 1U : 0];
+    uint32_t hi = blk[(b < CCD_PROC_BASE_BLOCKS) ? b : b - 1U];
+    int32_t step = (int32_t)hi - (int32_t)lo; // Over d pixels
+    int32_t c = (int32_t)(b * d) - (int32_t)(d / 2U); // Centre of b - 1
+    uint32_t end = (b < CCD_PROC_BASE_BLOCKS) ? b * d + d / 2U
+                                              : CCD_BUFFER_SIZE;
+    if (end > CCD_BUFFER_SIZE) {
+      end = CCD_BUFFER_SIZE;
+    }
+    for (; i < end; i += 2) {
+      int32_t a = (int32_t)(lo * d) + step * ((int32_t)i - c);
+      uint32_t l0 = (uint32_t)(a + (int32_t)(d / 2U)) / d;
+      uint32_t l1 = (uint32_t)(a + step + (int32_t)(d / 2U)) / d;
+      uint32_t level = __PKHBT(l0, l1, 16);
+      if (mode == CCD_PROC_BASE_ESTIMATE) {
+        Proc_Store2(&px[i], level);
+        continue;
+      }
+      uint32_t x = Proc_Load2(&px[i]);
+      (void)__USUB16(level, x);
+      count = __UADD16(count, __SEL(0U, 0x00010001U));
+      Proc_Store2(&px[i], ~__UQSUB16(level, x));
+    }
+  }
+  return (count & 0xFFFFU) + (count >> 16);
+}
+
+static void Proc_BaselineFrame(CCD_Frame_t *frame, uint8_t mode) {
+  uint32_t h = proc_base_width / (2U * CCD_PROC_BASE_DECIM);
+  Base_Blocks(frame->pixels, base_blk);
+  Base_Window(base_blk, base_tmp, h, 1); // Least light over the span
+  Base_Window(base_tmp, base_blk, h, 0); // then the most of that
+  Base_Box(base_blk, base_tmp, h);
+  uint32_t sum = 0;
+  uint16_t lo = 0xFFFFU, hi = 0;
+  for (uint32_t b = 0; b < CCD_PROC_BASE_BLOCKS; b++) {
+    uint16_t v = base_tmp[b];
+    sum += v;
+    lo = (v < lo) ? v : lo;
+    hi = (v > hi) ? v : hi;
+  }
+  base_st.low = (uint16_t)(0xFFFFU - hi);
+  base_st.high = (uint16_t)(0xFFFFU - lo);
+  base_st.mean = (uint16_t)(0xFFFFU - (sum + CCD_PROC_BASE_BLOCKS / 2U) /
+                                          CCD_PROC_BASE_BLOCKS);
+  base_st.clipped = Proc_Baseline(frame->pixels, base_tmp, mode);
+  base_st.frames++;
+}
+
+uint8_t CCD_Proc_SetBaseline(uint8_t mode, uint16_t width) {
+  if (mode > CCD_PROC_BASE_ESTIMATE || width < CCD_PROC_BASE_WIDTH_MIN ||
+      width > CCD_PROC_BASE_WIDTH_MAX) {
+    return 0;
+  }
+  proc_base_width = width;
+  proc_baseline = mode;
+  return 1;
+}
+
+void CCD_Proc_GetBaseline(CCD_BaselineStatus_t *out) {
+  *out = base_st;
+  out->mode = proc_baseline;
+  out->width = proc_base_width;
+}
+
+// ========== WAVELENGTH ==========
+
+// The calibration in use, and its grid as a table: output sample j is
+// px[i] + (px[i + 1] - px[i]) * w / 2^14, with i in the low and w in the high
+// half of wl_map[j]. Read once per frame in order, so it stays in AXI SRAM.
+CCD_DTCM_BSS static CCD_Wavelength_t wl;
+static uint32_t wl_map[CCD_BUFFER_SIZE];
+static int32_t wl_shift; // Q16 pixels the map has been moved by (drift)
+
+// nm at pixel p, Horner in double (the M7 FPU has it)
+static double Proc_WlEval(const CCD_Wavelength_t *cal, double p) {
+  double nm = 0.0;
+  for (int32_t k = CCD_WL_ORDER_MAX; k >= 0; k--) {
+    nm = nm * p + (double)cal->coef[k];
+  }
+  return nm;
+}
+
+// Validate cal and fill in its default grid. The polynomial must be strictly
+// monotonic over the line and the grid must run the same way, so that each
+// grid point has one pixel position. The inverse is interpolated linearly
+// between whole pixels (the curve is all but straight over one). With the
+// lines shifted by shift pixels, pixel p is at the calibration's p - shift.
+static uint8_t Proc_WlBuild(CCD_Wavelength_t *cal, uint32_t *map,
+                            double shift) {
+  double first = Proc_WlEval(cal, -shift);
+  double last = Proc_WlEval(cal, CCD_BUFFER_SIZE - 1U - shift);
+  double dir = (last > first) ? 1.0 : -1.0;
+  if (cal->step_nm == 0.0f) {
+    cal->start_nm = (float)first;
+    cal->step_nm = (float)((last - first) / (CCD_BUFFER_SIZE - 1U));
+  }
+  if (!(cal->step_nm * dir > 0.0) || !isfinite(first) || !isfinite(last)) {
+    return 0;
+  }
+  double prev = first * dir;
+  for (uint32_t k = 1; k < CCD_BUFFER_SIZE; k++) {
+    double nm = Proc_WlEval(cal, k - shift) * dir;
+    if (!(nm > prev)) {
+      return 0;
+    }
+    prev = nm;
+  }
+  if (map == NULL) {
+    return 1;
+  }
+  // Grid points beyond either end of the line take the end pixel
+  uint32_t k = 0;
+  double lo = first * dir;
+  double hi = Proc_WlEval(cal, 1.0 - shift) * dir;
+  for (uint32_t j = 0; j < CCD_BUFFER_SIZE; j++) {
+    double t = ((double)cal->start_nm + (double)cal->step_nm * j) * dir;
+    while (t > hi && k < CCD_BUFFER_SIZE - 2U) {
+      k++;
+      lo = hi;
+      hi = Proc_WlEval(cal, k + 1U - shift) * dir;
+    }
+    uint32_t w;
+    if (t <= lo) {
+      w = 0;
+    } else if (t >= hi) {
+      w = 1U << 14;
+    } else {
+      w = (uint32_t)((t - lo) / (hi - lo) * (1U << 14) + 0.5);
+    }
+    map[j] = k | (w << 16);
+  }
+  return 1;
+}
+
+// One output per step: the pixel pair as signed Q15 (as in Proc_Smooth)
+// against the weights (2^14 - w, w) in one SMUAD. The result stays within
+// the pixel range, so no saturation is needed.
+CCD_ITCM static void Proc_Resample(uint16_t *out, const uint16_t *px,
+                                   const uint32_t *map) {
+  for (uint32_t j = 0; j < CCD_BUFFER_SIZE; j++) {
+    uint32_t e = map[j];
+    uint32_t w = e >> 16;
+    uint32_t s = Proc_Load2(&px[e & 0xFFFFU]) ^ 0x80008000U;
+    int32_t acc = (int32_t)__SMUAD(s, ((1U << 14) - w) | (w << 16));
+    out[j] = (uint16_t)(((acc + (1 << 13)) >> 14) + 0x8000);
+  }
+}
+
+uint8_t CCD_Proc_SetWavelength(const CCD_Wavelength_t *cal) {
+  CCD_Wavelength_t next = *cal;
+  if (!Proc_WlBuild(&next, next.resample ? wl_map : NULL, 0.0)) {
+    return 0;
+  }
+  next.state = CCD_WL_READY;
+  wl = next;
+  wl_shift = 0; // A new calibration is taken as it stands
+  return 1;
+}
+
+void CCD_Proc_GetWavelength(CCD_Wavelength_t *cal) { *cal = wl; }
+
+uint8_t CCD_Proc_SaveWavelength(void) {
+  return wl.state == CCD_WL_READY &&
+         CCD_Store_Save(CCD_STORE_WAVELENGTH, &wl, sizeof(wl));
+}
+
+// ========== DRIFT ==========
+
+_Static_assert(sizeof(CCD_DriftFrame_t) <= sizeof(CCD_Frame_t),
+               "a drift record fits its slot");
+_Static_assert(CCD_PROC_DRIFT_START >= CCD_PROC_DRIFT_LAG &&
+                   CCD_PROC_DRIFT_START + CCD_PROC_DRIFT_LEN +
+                           CCD_PROC_DRIFT_LAG <=
+                       CCD_BUFFER_SIZE &&
+                   (CCD_PROC_DRIFT_LEN & 1) == 0,
+               "the default band and its lags are within the line");
+
+// The reference and each frame's band with its lags, mean removed and
+// halved into int16, read once per lag in order: the reference in DTCM,
+// the frame's band in shape_buf. The capture sums into the scratch
+// (Proc_Scratch_t.u.acc.drift).
+CCD_DTCM_BSS static int16_t drift_ref[CCD_BUFFER_SIZE];
+static uint16_t drift_start = CCD_PROC_DRIFT_START;
+static uint16_t drift_len = CCD_PROC_DRIFT_LEN;
+static uint8_t drift_lag = CCD_PROC_DRIFT_LAG;
+static uint16_t drift_m;     // Frames in the capture in progress
+static uint16_t drift_count; // Frames in the sum
+static uint16_t drift_ref_frames;
+static double drift_ref_energy; // sum(r^2)
+static int32_t drift_shift;     // Last, Q16
+static int32_t drift_min;
+static int32_t drift_max;
+static int64_t drift_sum;
+static int32_t drift_smooth; // 1/8 EMA, what the grid follows
+static uint16_t drift_score;
+static uint32_t drift_frames;
+static uint32_t drift_clipped;
+static uint32_t drift_rebuilds;
+
+// sum(f[i] * r[i]), two pixel pairs per SMLALD
+CCD_ITCM static int64_t Proc_Xcorr(const int16_t *f, const int16_t *r,
+                                   uint32_t len) {
+  uint64_t acc = 0;
+  for (uint32_t i = 0; i < len; i += 2) {
+    acc = __SMLALD(Proc_Load2((const uint16_t *)&f[i]),
+                   Proc_Load2((const uint16_t *)&r[i]), acc);
+  }
+  return (int64_t)acc;
+}
+
+// (px - mean) / 2 for n pixels from first, into out
+static double Proc_DriftLine(int16_t *out, const uint16_t *px, uint32_t first,
+                             uint32_t n) {
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    sum += px[first + i];
+  }
+  int32_t mean = (int32_t)((sum + n / 2U) / n);
+  double energy = 0.0;
+  for (uint32_t i = 0; i < n; i++) {
+    int32_t d = ((int32_t)px[first + i] - mean) >> 1;
+    out[i] = (int16_t)d;
+    energy += (double)d * d;
+  }
+  return energy;
+}
+
+uint8_t CCD_Proc_SetDriftBand(uint16_t start, uint16_t len, uint8_t lag) {
+  if (lag == 0 || lag > CCD_PROC_DRIFT_LAG_MAX ||
+      len < CCD_PROC_DRIFT_LEN_MIN || (len & 1U) != 0 || start < lag ||
+      (uint32_t)start + len + lag > CCD_BUFFER_SIZE) {
+    return 0;
+  }
+  drift_start = start;
+  drift_len = len;
+  drift_lag = lag;
+  drift_m = 0;
+  proc_drift_state = CCD_DRIFT_NONE;
+  return 1;
+}
+
+// Average M frames into the reference, as with the absorbance I0; frames
+// pass unchanged while it runs
+static void Proc_DriftCapture(const CCD_Frame_t *frame) {
+  uint16_t req = proc_drift_request;
+  if (req != 0) {
+    proc_drift_request = 0;
+    drift_m = req;
+    drift_count = 0;
+    proc_drift_state = CCD_DRIFT_CAPTURING;
+  }
+  uint32_t *acc = proc_scratch->u.acc.drift;
+  Proc_Accumulate(acc, frame->pixels, drift_count == 0);
+  if (++drift_count < drift_m) {
+    return;
+  }
+  uint32_t half = drift_m / 2U;
+  uint32_t recip = Proc_Recip(drift_m);
+  uint16_t *avg = shape_buf; // Free between frames
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    avg[i] = (uint16_t)Proc_Div(acc[i] + half, recip);
+  }
+  drift_ref_energy = Proc_DriftLine(drift_ref, avg, drift_start, drift_len);
+  drift_ref_frames = drift_m;
+  drift_m = 0;
+  drift_frames = 0;
+  drift_clipped = 0;
+  drift_sum = 0;
+  drift_smooth = 0;
+  proc_drift_state = CCD_DRIFT_READY;
+}
+
+// The correlation at each lag; the best one, refined by the parabola
+// through it and its neighbours (at the end of the window it stands)
+static void Proc_Drift(const CCD_Frame_t *frame, uint8_t *clipped) {
+  uint32_t lag = drift_lag;
+  int16_t *line = (int16_t *)shape_buf; // Free between frames
+  double energy = Proc_DriftLine(line, frame->pixels, drift_start - lag,
+                                 drift_len + 2U * lag);
+  int64_t c[2U * CCD_PROC_DRIFT_LAG_MAX + 1U];
+  uint32_t best = 0;
+  for (uint32_t k = 0; k <= 2U * lag; k++) {
+    c[k] = Proc_Xcorr(&line[k], drift_ref, drift_len);
+    if (c[k] > c[best]) {
+      best = k;
+    }
+  }
+  double offset = 0.0;
+  *clipped = (best == 0 || best == 2U * lag);
+  if (!*clipped) {
+    double a = (double)c[best - 1U];
+    double b = (double)c[best];
+    double d = (double)c[best + 1U];
+    double curv = a - 2.0 * b + d;
+    if (curv < 0.0) {
+      offset = 0.5 * (a - d) / curv;
+    }
+  }
+  // The frame's feature at band pixel i matched the reference's at i - k
+  double shift = (double)best - lag + offset;
+  int32_t q = (int32_t)lrint(shift * 65536.0);
+  double norm = sqrt(energy * drift_ref_energy);
+  double score = (norm > 0.0 && c[best] > 0) ? (double)c[best] / norm : 0.0;
+  drift_score = (uint16_t)(score >= 1.0 ? 32767 : score * 32768.0);
+  drift_shift = q;
+  if (drift_frames == 0) {
+    drift_min = q;
+    drift_max = q;
+    drift_smooth = q;
+  } else {
+    drift_min = (q < drift_min) ? q : drift_min;
+    drift_max = (q > drift_max) ? q : drift_max;
+    drift_smooth += (q - drift_smooth) / 8;
+  }
+  drift_sum += q;
+  drift_frames++;
+  drift_clipped += *clipped;
+}
+
+// Rewrite the slot as a drift record and return its length in bytes
+static uint32_t Proc_DriftFrame(CCD_Frame_t *frame, uint8_t clipped) {
+  CCD_DriftFrame_t df;
+  df.magic = CCD_DRIFT_MAGIC;
+  df.frame_num = frame->frame_num;
+  df.info = frame->info;
+  df.info.header_len = offsetof(CCD_DriftFrame_t, shift);
+  df.info.payload_len = sizeof(df) - offsetof(CCD_DriftFrame_t, shift);
+  df.shift = drift_shift;
+  df.score = drift_score;
+  df.clipped = clipped;
+  df.reserved = 0;
+  memcpy(frame, &df, sizeof(df));
+  return sizeof(df);
+}
+
+// Main loop: move the resampling grid with the smoothed shift, or back once
+// the correction is off
+static void Proc_DriftFollow(void) {
+  if (!wl.resample) {
+    return;
+  }
+  int32_t target = 0;
+  if (proc_drift_correct && proc_drift != CCD_PROC_DRIFT_OFF &&
+      proc_drift_state == CCD_DRIFT_READY && drift_frames != 0) {
+    target = drift_smooth;
+  }
+  int32_t step = target - wl_shift;
+  if (step == 0 || (target != 0 && step < CCD_PROC_DRIFT_STEP &&
+                    step > -CCD_PROC_DRIFT_STEP)) {
+    return; // Back to 0 at once, else in steps
+  }
+  if (Proc_WlBuild(&wl, wl_map, target / 65536.0)) {
+    wl_shift = target;
+    drift_rebuilds++;
+  }
+}
+
+void CCD_Proc_GetDrift(CCD_DriftStatus_t *out) {
+  out->mode = proc_drift;
+  out->correct = proc_drift_correct;
+  out->lag = drift_lag;
+  out->state = proc_drift_state;
+  out->start = drift_start;
+  out->len = drift_len;
+  out->shift = drift_shift;
+  out->min = drift_min;
+  out->max = drift_max;
+  out->mean = drift_frames ? (int32_t)(drift_sum / (int64_t)drift_frames) : 0;
+  out->applied = wl_shift;
+  out->score = drift_score;
+  out->ref_frames = drift_ref_frames;
+  out->frames = drift_frames;
+  out->clipped = drift_clipped;
+  out->rebuilds = drift_rebuilds;
+}
+
+// ========== STATISTICS ==========
+
+_Static_assert(sizeof(CCD_StatsFrame_t) <= sizeof(CCD_Frame_t),
+               "a statistics frame fits its slot");
+
+// One pass, two pixels per step. USUB16 sets the GE flags per halfword and
+// SEL picks by them: the running min and max, and a per-halfword count of
+// pixels below the level. The first moment sum(i * px) gives the centroid
+// against max afterwards, so no second pass is needed.
+CCD_ITCM static void Proc_Stats(CCD_FrameStats_t *st, const uint16_t *px,
+                                uint16_t level) {
+  uint32_t mn = 0xFFFFFFFFU;
+  uint32_t mx = 0;
+  uint32_t lv = level | ((uint32_t)level << 16);
+  uint32_t sat = 0; // Two halfword counters
+  uint32_t sum = 0;
+  uint64_t moment = 0;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    uint32_t w = Proc_Load2(&px[i]);
+    (void)__USUB16(w, mn);
+    mn = __SEL(mn, w);
+    (void)__USUB16(w, mx);
+    mx = __SEL(w, mx);
+    (void)__USUB16(w, lv);
+    sat = __UADD16(sat, __SEL(0U, 0x00010001U));
+    uint32_t lo = w & 0xFFFFU;
+    uint32_t hi = w >> 16;
+    sum += lo + hi;
+    moment += i * lo + (i + 1U) * hi; // < 2^29 per step
+  }
+  uint32_t min = ((mn & 0xFFFFU) < (mn >> 16)) ? (mn & 0xFFFFU) : (mn >> 16);
+  uint32_t max = ((mx & 0xFFFFU) > (mx >> 16)) ? (mx & 0xFFFFU) : (mx >> 16);
+  st->min = (uint16_t)min;
+  st->max = (uint16_t)max;
+  st->sum = sum;
+  st->mean = (uint16_t)((sum + CCD_BUFFER_SIZE / 2U) / CCD_BUFFER_SIZE);
+  st->saturated = (uint16_t)((sat & 0xFFFFU) + (sat >> 16));
+
+  // Light above the darkest pixel: s_i = max - px_i
+  const uint64_t n = CCD_BUFFER_SIZE;
+  uint32_t signal = max * CCD_BUFFER_SIZE - sum;
+  uint64_t weighted = (uint64_t)max * (n * (n - 1U) / 2U) - moment;
+  st->signal = signal;
+  st->centroid = (signal != 0) ? (uint32_t)((weighted << 16) / signal)
+                               : CCD_PROC_NO_CENTROID;
+}
+
+// Rewrite the slot as a statistics frame and return its length in bytes
+static uint32_t Proc_StatsFrame(CCD_Frame_t *frame) {
+  CCD_StatsFrame_t sf;
+  sf.magic = CCD_STATS_MAGIC;
+  sf.frame_num = frame->frame_num;
+  sf.info = frame->info;
+  sf.info.header_len = offsetof(CCD_StatsFrame_t, stats);
+  sf.info.payload_len = sizeof(sf.stats);
+  sf.info.flags |= CCD_FRAME_F_STATS;
+  Proc_Stats(&sf.stats, frame->pixels, proc_stats_level);
+  memcpy(frame, &sf, sizeof(sf));
+  return sizeof(sf);
+}
+
+// ========== PEAKS ==========
+
+_Static_assert(sizeof(CCD_PeaksHeader_t) +
+                       CCD_PROC_PEAKS_MAX * sizeof(CCD_Peak_t) <=
+                   sizeof(CCD_Frame_t),
+               "a peak list fits its slot");
+
+// Found peaks, copied behind the header once the scan is done (the list
+// would overrun pixels still to be read if written in place)
+CCD_DTCM_BSS static CCD_Peak_t peaks_buf[CCD_PROC_PEAKS_MAX];
+
+// Offset of the vertex of the parabola through (-1, a), (0, b), (1, c),
+// Q16. b > a and b >= c, so the curvature is negative and |offset| <= 0.5.
+static int32_t Proc_Vertex(int32_t a, int32_t b, int32_t c) {
+  return (int32_t)(((int64_t)(a - c) << 15) / (a - 2 * b + c));
+}
+
+static int32_t Proc_GaussVertex(uint32_t a, uint32_t b, uint32_t c) {
+  if (a == 0 || c == 0) {
+    return Proc_Vertex((int32_t)a, (int32_t)b, (int32_t)c); // No ln(0)
+  }
+  float la = logf((float)a);
+  float lb = logf((float)b);
+  float lc = logf((float)c);
+  return (int32_t)(0.5f * (la - lc) / (la - 2.0f * lb + lc) * 65536.0f);
+}
+
+// Local maxima of the light above threshold, greedy from the left with at
+// least dist pixels between peaks. In wire polarity a peak is a local
+// minimum below 65535 - threshold. Pairs with no pixel below that level
+// are skipped with one USUB16, which is most of a line. A flat top counts
+// at its left edge. Returns the peaks found; more than max sets *truncated.
+CCD_ITCM static uint32_t Proc_FindPeaks(CCD_Peak_t *out, uint32_t max,
+                                        const uint16_t *px, uint16_t threshold,
+                                        uint16_t dist, uint8_t fit,
+                                        uint8_t *truncated) {
+  uint32_t limit = 65535U - threshold;
+  uint32_t lv = limit | (limit << 16);
+  uint32_t n = 0;
+  uint32_t next = 1; // First pixel the distance rule allows
+  *truncated = 0;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i += 2) {
+    (void)__USUB16(Proc_Load2(&px[i]), lv);
+    if (__SEL(0U, 0xFFFFFFFFU) == 0) {
+      continue; // Both pixels at or above the level
+    }
+    for (uint32_t j = i; j < i + 2U; j++) {
+      uint32_t b = px[j];
+      if (j < next || j + 1U >= CCD_BUFFER_SIZE || b >= limit ||
+          b >= px[j - 1U] || b > px[j + 1U]) {
+        continue;
+      }
+      if (n == max) {
+        *truncated = 1;
+        return n;
+      }
+      uint32_t la = 65535U - px[j - 1U];
+      uint32_t lb = 65535U - b;
+      uint32_t lc = 65535U - px[j + 1U];
+      int32_t off = (fit == CCD_PROC_FIT_GAUSS)
+                        ? Proc_GaussVertex(la, lb, lc)
+                        : Proc_Vertex((int32_t)la, (int32_t)lb, (int32_t)lc);
+      out[n].position = (uint32_t)((int32_t)(j << 16) + off);
+      out[n].height = (uint16_t)lb;
+      n++;
+      next = j + dist;
+    }
+  }
+  return n;
+}
+
+// Rewrite the slot as a peak list and return its length in bytes
+static uint32_t Proc_PeaksFrame(CCD_Frame_t *frame) {
+  CCD_PeaksHeader_t hdr;
+  uint8_t fit = proc_peak_fit;
+  uint32_t n = Proc_FindPeaks(peaks_buf, CCD_PROC_PEAKS_MAX, frame->pixels,
+                              proc_peak_threshold, proc_peak_distance, fit,
+                              &hdr.truncated);
+  hdr.magic = CCD_PEAKS_MAGIC;
+  hdr.frame_num = frame->frame_num;
+  hdr.info = frame->info;
+  hdr.info.header_len = sizeof(hdr);
+  hdr.info.payload_len = (uint16_t)(n * sizeof(CCD_Peak_t));
+  hdr.info.flags |= CCD_FRAME_F_PEAKS;
+  hdr.count = (uint16_t)n;
+  hdr.fit = fit;
+  memcpy(frame, &hdr, sizeof(hdr));
+  memcpy((uint8_t *)frame + sizeof(hdr), peaks_buf, n * sizeof(CCD_Peak_t));
+  return sizeof(hdr) + n * sizeof(CCD_Peak_t);
+}
+
+// ========== BANDS ==========
+
+_Static_assert(sizeof(CCD_BandsHeader_t) +
+                       CCD_PROC_BANDS_MAX * sizeof(uint32_t) <=
+                   sizeof(CCD_Frame_t),
+               "a band frame fits its slot");
+
+static CCD_Band_t bands_next[CCD_PROC_BANDS_MAX]; // Staged by the command
+static uint8_t bands_next_count;
+CCD_DTCM_BSS static CCD_Band_t bands[CCD_PROC_BANDS_MAX];
+CCD_DTCM_BSS static uint8_t band_count;
+CCD_DTCM_BSS static uint32_t band_values[CCD_PROC_BANDS_MAX];
+static uint32_t band_frames;
+
+uint8_t CCD_Proc_SetBands(uint8_t first, const CCD_Band_t *b, uint8_t n,
+                          uint8_t apply) {
+  if (first + n > CCD_PROC_BANDS_MAX) {
+    return 0;
+  }
+  for (uint8_t i = 0; i < n; i++) {
+    if (b[i].len == 0 || b[i].start + b[i].len > CCD_BUFFER_SIZE) {
+      return 0;
+    }
+  }
+  memcpy(&bands_next[first], b, n * sizeof(*b));
+  bands_next_count = first + n;
+  if (apply) {
+    memcpy(bands, bands_next, bands_next_count * sizeof(bands[0]));
+    band_count = bands_next_count;
+  }
+  return 1;
+}
+
+void CCD_Proc_GetBands(CCD_BandsStatus_t *out) {
+  out->count = band_count;
+  out->staged = bands_next_count;
+  out->reserved = 0;
+  out->frames = band_frames;
+}
+
+// Light summed over len pixels, two per SMLAD: with the pixel's top bit
+// flipped each halfword is the signed px - 32768, so the light 65535 - px
+// is 32767 minus it. The signed sum stays below 2^27.
+CCD_ITCM static uint32_t Proc_BandLight(const uint16_t *px, uint32_t len) {
+  int32_t acc = 0;
+  uint32_t i = 0;
+  for (; i + 1U < len; i += 2) {
+    acc = (int32_t)__SMLAD(Proc_Load2(&px[i]) ^ 0x80008000U, 0x00010001U,
+                           acc);
+  }
+  if (i < len) {
+    acc += (int32_t)px[i] - 32768;
+  }
+  return (uint32_t)((int32_t)(len * 32767U) - acc);
+}
+
+// Rewrite the slot as a band frame and return its length in bytes
+static uint32_t Proc_BandsFrame(CCD_Frame_t *frame) {
+  uint32_t n = band_count;
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t v = (uint64_t)Proc_BandLight(&frame->pixels[bands[i].start],
+                                          bands[i].len) *
+                 bands[i].weight;
+    v = (v + CCD_PROC_BAND_UNITY / 2U) / CCD_PROC_BAND_UNITY;
+    band_values[i] = (v > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (uint32_t)v;
+  }
+  CCD_BandsHeader_t hdr;
+  hdr.magic = CCD_BANDS_MAGIC;
+  hdr.frame_num = frame->frame_num;
+  hdr.info = frame->info;
+  hdr.info.header_len = sizeof(hdr);
+  hdr.info.payload_len = (uint16_t)(n * sizeof(uint32_t));
+  hdr.count = (uint16_t)n;
+  memcpy(frame, &hdr, sizeof(hdr));
+  memcpy((uint8_t *)frame + sizeof(hdr), band_values, n * sizeof(uint32_t));
+  band_frames++;
+  return sizeof(hdr) + n * sizeof(uint32_t);
+}
+
+// ========== FOCUS ==========
+
+_Static_assert(sizeof(CCD_FocusHeader_t) +
+                       CCD_PROC_FOCUS_MAX * sizeof(CCD_FocusValue_t) <=
+                   sizeof(CCD_Frame_t),
+               "a focus frame fits its slot");
+
+static CCD_FocusLine_t focus_next[CCD_PROC_FOCUS_MAX]; // Staged
+static uint8_t focus_next_count;
+CCD_DTCM_BSS static CCD_FocusLine_t focus[CCD_PROC_FOCUS_MAX];
+CCD_DTCM_BSS static uint8_t focus_count;
+CCD_DTCM_BSS static CCD_FocusValue_t focus_values[CCD_PROC_FOCUS_MAX];
+static uint32_t focus_frames;
+static uint32_t focus_unresolved;
+static uint16_t focus_fwhm;
+static uint16_t focus_resolved;
+
+uint8_t CCD_Proc_SetFocus(uint8_t first, const CCD_FocusLine_t *l, uint8_t n,
+                          uint8_t apply) {
+  if (first + n > CCD_PROC_FOCUS_MAX) {
+    return 0;
+  }
+  for (uint8_t i = 0; i < n; i++) {
+    if (l[i].len < CCD_PROC_FOCUS_LEN_MIN ||
+        l[i].len > CCD_PROC_FOCUS_LEN_MAX ||
+        l[i].start + l[i].len > CCD_BUFFER_SIZE) {
+      return 0;
+    }
+  }
+  memcpy(&focus_next[first], l, n * sizeof(*l));
+  focus_next_count = first + n;
+  if (apply) {
+    memcpy(focus, focus_next, focus_next_count * sizeof(focus[0]));
+    focus_count = focus_next_count;
+  }
+  return 1;
+}
+
+void CCD_Proc_GetFocus(CCD_FocusStatus_t *out) {
+  out->count = focus_count;
+  out->staged = focus_next_count;
+  out->frames = focus_frames;
+  out->unresolved = focus_unresolved;
+  out->fwhm = focus_fwhm;
+  out->resolved = focus_resolved;
+}
+
+// Height and width of the line in px[0..len). Light lowers the pixel, so
+// a pixel is above half height while 2 * px < s, s the sum of the
+// window's smallest and largest pixel. Each crossing falls a fraction
+// (2 * px - s) / (2 * step) along the step between its two pixels; in
+// Q16 that is (2 * px - s) << 15 over the step, below 2^32. 1 with a width.
+CCD_ITCM static uint32_t Proc_FocusLine(const uint16_t *px, uint32_t len,
+                                        CCD_FocusValue_t *out) {
+  uint32_t peak = 0;
+  uint32_t top = px[0];
+  for (uint32_t i = 1; i < len; i++) {
+    if (px[i] < px[peak]) {
+      peak = i;
+    }
+    if (px[i] > top) {
+      top = px[i];
+    }
+  }
+  uint32_t s = top + px[peak];
+  out->centre = peak << 16;
+  out->height = (uint16_t)(top - px[peak]);
+  out->fwhm = 0;
+  if (top == px[peak]) {
+    return 0;
+  }
+  uint32_t a = peak;
+  while (a > 0 && 2U * px[a - 1U] < s) {
+    a--;
+  }
+  uint32_t b = peak;
+  while (b + 1U < len && 2U * px[b + 1U] < s) {
+    b++;
+  }
+  if (a == 0 || b + 1U == len) {
+    return 0; // Still above half at the window's edge
+  }
+  uint32_t left = ((a - 1U) << 16) + ((2U * px[a - 1U] - s) << 15) /
+                                         (px[a - 1U] - px[a]);
+  uint32_t right =
+      (b << 16) + ((s - 2U * px[b]) << 15) / (px[b + 1U] - px[b]);
+  uint32_t w = (right - left + 128U) >> 8;
+  out->centre = (left + right) >> 1;
+  out->fwhm = (uint16_t)((w == 0) ? 1U : w);
+  return 1;
+}
+
+// Rewrite the slot as a focus frame and return its length in bytes
+static uint32_t Proc_FocusFrame(CCD_Frame_t *frame) {
+  uint32_t n = focus_count;
+  uint32_t resolved = 0;
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    CCD_FocusValue_t *v = &focus_values[i];
+    if (Proc_FocusLine(&frame->pixels[focus[i].start], focus[i].len, v)) {
+      resolved++;
+      sum += v->fwhm;
+    }
+    v->centre += (uint32_t)focus[i].start << 16;
+  }
+  CCD_FocusHeader_t hdr;
+  hdr.magic = CCD_FOCUS_MAGIC;
+  hdr.frame_num = frame->frame_num;
+  hdr.info = frame->info;
+  hdr.info.header_len = sizeof(hdr);
+  hdr.info.payload_len = (uint16_t)(n * sizeof(CCD_FocusValue_t));
+  hdr.count = (uint16_t)n;
+  memcpy(frame, &hdr, sizeof(hdr));
+  memcpy((uint8_t *)frame + sizeof(hdr), focus_values,
+         n * sizeof(CCD_FocusValue_t));
+  focus_frames++;
+  focus_unresolved += n - resolved;
+  focus_resolved = (uint16_t)resolved;
+  focus_fwhm = (uint16_t)((resolved != 0) ? sum / resolved : 0U);
+  return sizeof(hdr) + n * sizeof(CCD_FocusValue_t);
+}
+
+// ========== SHAPING (ROI AND BINNING) ==========
+
+// Stage a new window set ("W" command, USB interrupt context). Windows are
+// in sensor pixels, must lie inside the line and may overlap as long as the
+// packed frame still fits its slot; n = 0 sends the whole line.
+uint8_t CCD_Proc_RoiValid(const CCD_RoiWindow_t *w, uint8_t n) {
+  if (n > CCD_PROC_ROI_MAX) {
+    return 0;
+  }
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < n; i++) {
+    if (w[i].len == 0 || w[i].start + w[i].len > CCD_BUFFER_SIZE) {
+      return 0;
+    }
+    total += w[i].len;
+  }
+  return total <= CCD_PROC_ROI_PIXELS; // Overlaps might not fit the slot
+}
+
+uint8_t CCD_Proc_SetRoi(const CCD_RoiWindow_t *w, uint8_t n) {
+  if (!CCD_Proc_RoiValid(w, n)) {
+    return 0;
+  }
+  memcpy(roi_next, w, n * sizeof(*w));
+  roi_next_count = n;
+  roi_update = 1;
+  return 1;
+}
+
+uint8_t CCD_Proc_GetRoi(CCD_RoiWindow_t *w) {
+  uint8_t n = roi_next_count;
+  memcpy(w, roi_next, n * sizeof(*w));
+  return n;
+}
+
+static void Proc_RoiUpdate(void) {
+  roi_update = 0;
+  roi_count = roi_next_count;
+  memcpy(roi, roi_next, roi_count * sizeof(roi[0]));
+  ref_valid = 0; // New pixel layout: next temporal frame is a keyframe
+}
+
+// ========== AUTO ROI ==========
+
+_Static_assert(CCD_PROC_ROI_MAX * (2U * CCD_PROC_AUTOROI_MARGIN_MAX +
+                                   2U * CCD_PROC_AUTOROI_ALIGN) <=
+                   CCD_PROC_ROI_PIXELS,
+               "the widest auto windows fit a shaped frame");
+
+// The search frames are summed in the scratch (Proc_Scratch_t.u.acc)
+static uint8_t auto_mode;
+static uint8_t auto_lines = CCD_PROC_ROI_MAX;
+static uint8_t auto_frames = 4;
+static uint16_t auto_margin = 32;
+static uint16_t auto_interval = 60;
+static uint8_t auto_state;
+static uint8_t auto_restart; // Search again at the next frame
+static uint8_t auto_n;       // Frames in the sum
+static uint8_t auto_found;
+static uint32_t auto_tick;   // HAL_GetTick() when the windows were set
+static uint32_t auto_searches;
+
+uint8_t CCD_Proc_SetAutoRoi(uint8_t mode, uint8_t lines, uint8_t frames,
+                            uint16_t margin, uint16_t interval) {
+  if (mode > CCD_PROC_AUTOROI_ON || lines == 0 ||
+      lines > CCD_PROC_ROI_MAX || frames == 0 ||
+      frames > CCD_PROC_AUTOROI_FRAMES_MAX ||
+      margin > CCD_PROC_AUTOROI_MARGIN_MAX) {
+    return 0;
+  }
+  if (mode != auto_mode || lines != auto_lines || frames != auto_frames ||
+      margin != auto_margin) {
+    auto_restart = 1;
+  }
+  if (mode == CCD_PROC_AUTOROI_OFF && auto_mode != CCD_PROC_AUTOROI_OFF) {
+    auto_state = CCD_AUTOROI_IDLE;
+    roi_update = 1; // The windows of "W" again
+  }
+  auto_mode = mode;
+  auto_lines = lines;
+  auto_frames = frames;
+  auto_margin = margin;
+  auto_interval = interval;
+  return 1;
+}
+
+void CCD_Proc_AutoRoiAgain(void) {
+  auto_restart = 1;
+}
+
+void CCD_Proc_GetAutoRoi(CCD_AutoRoiStatus_t *out) {
+  out->mode = auto_mode;
+  out->state = auto_state;
+  out->lines = auto_lines;
+  out->frames = auto_frames;
+  out->margin = auto_margin;
+  out->interval = auto_interval;
+  out->found = auto_found;
+  out->searches = auto_searches;
+  out->windows = (auto_state == CCD_AUTOROI_SET) ? roi_count : 0U;
+  memset(out->roi, 0, sizeof(out->roi));
+  memcpy(out->roi, roi, out->windows * sizeof(roi[0]));
+}
+
+// The lines strongest peaks of the search mean, each with margin pixels
+// either side, aligned and clipped to the line, merged where they meet,
+// in pixel order. Returns the windows, 0 if no peak was found.
+static uint8_t Proc_AutoRoiPlace(CCD_RoiWindow_t *w, const uint32_t *acc) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    shape_buf[i] = (uint16_t)((acc[i] + auto_n / 2U) / auto_n);
+  }
+  uint8_t truncated;
+  uint32_t n = Proc_FindPeaks(peaks_buf, CCD_PROC_PEAKS_MAX, shape_buf,
+                              proc_peak_threshold, proc_peak_distance,
+                              CCD_PROC_FIT_PARABOLA, &truncated);
+  auto_found = (uint8_t)n;
+  uint32_t lo[CCD_PROC_ROI_MAX];
+  uint32_t hi[CCD_PROC_ROI_MAX];
+  uint32_t count = 0;
+  const uint32_t end = CCD_BUFFER_SIZE & ~(CCD_PROC_AUTOROI_ALIGN - 1U);
+  for (; count < auto_lines && count < n; count++) {
+    uint32_t best = 0;
+    for (uint32_t i = 1; i < n; i++) {
+      if (peaks_buf[i].height > peaks_buf[best].height) {
+        best = i;
+      }
+    }
+    uint32_t c = (peaks_buf[best].position + 0x8000U) >> 16;
+    peaks_buf[best].height = 0; // Taken
+    uint32_t a = (c > auto_margin) ? c - auto_margin : 0U;
+    uint32_t b = c + auto_margin + CCD_PROC_AUTOROI_ALIGN;
+    a &= ~(CCD_PROC_AUTOROI_ALIGN - 1U);
+    b &= ~(CCD_PROC_AUTOROI_ALIGN - 1U);
+    b = (b > end) ? end : b;
+    a = (a >= b) ? b - CCD_PROC_AUTOROI_ALIGN : a; // A line past end
+    uint32_t k = count; // Insert in pixel order
+    for (; k > 0 && lo[k - 1U] > a; k--) {
+      lo[k] = lo[k - 1U];
+      hi[k] = hi[k - 1U];
+    }
+    lo[k] = a;
+    hi[k] = b;
+  }
+  uint8_t m = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (m > 0 && lo[i] <= w[m - 1U].start + w[m - 1U].len) {
+      uint32_t top = w[m - 1U].start + w[m - 1U].len;
+      w[m - 1U].len = (uint16_t)(((hi[i] > top) ? hi[i] : top) -
+                                 w[m - 1U].start);
+    } else {
+      w[m].start = (uint16_t)lo[i];
+      w[m].len = (uint16_t)(hi[i] - lo[i]);
+      m++;
+    }
+  }
+  return m;
+}
+
+// Before the shaping, instead of the host's windows: a search sends the
+// whole line and adds it to the mean; its last frame already goes out in
+// the windows found
+static void Proc_AutoRoi(const CCD_Frame_t *frame) {
+  if (auto_state == CCD_AUTOROI_SET && auto_interval != 0 &&
+      HAL_GetTick() - auto_tick >= auto_interval * 1000U) {
+    auto_restart = 1;
+  }
+  if (auto_restart || auto_state == CCD_AUTOROI_IDLE) {
+    auto_restart = 0;
+    auto_state = CCD_AUTOROI_SEARCH;
+    auto_n = 0;
+    roi_count = 0;
+    ref_valid = 0;
+  }
+  if (auto_state != CCD_AUTOROI_SEARCH || proc_scratch == NULL ||
+      Proc_WideQueued()) {
+    return; // Without the sum the search waits, the line goes out whole
+  }
+  const uint16_t *px = frame->pixels;
+  uint32_t *acc = proc_scratch->u.acc.search;
+  if (auto_n == 0) {
+    for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+      acc[i] = px[i];
+    }
+  } else {
+    for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+      acc[i] += px[i];
+    }
+  }
+  if (++auto_n < auto_frames) {
+    return;
+  }
+  CCD_RoiWindow_t w[CCD_PROC_ROI_MAX];
+  uint8_t m = Proc_AutoRoiPlace(w, acc);
+  auto_n = 0;
+  if (m == 0) {
+    return; // Nothing to frame: search on
+  }
+  memcpy(roi, w, m * sizeof(w[0]));
+  roi_count = m;
+  ref_valid = 0;
+  auto_state = CCD_AUTOROI_SET;
+  auto_tick = HAL_GetTick();
+  auto_searches++;
+}
+
+// Bytes of count pixels in the given packing
+static uint32_t Proc_PackedSize(uint32_t count, uint8_t bits) {
+  if (bits == CCD_PROC_PACK_12) {
+    return (count + 1U) / 2U * 3U;
+  }
+  if (bits == CCD_PROC_PACK_14) {
+    return (count + 3U) / 4U * 7U;
+  }
+  return count * sizeof(uint16_t);
+}
+
+// Run the selected codec over shape_buf and set hdr's codec and ref.
+// Returns the stream length, or 0 if the caller must send packed pixels
+// (codec off, or the stream would not be smaller than packed bytes).
+static uint32_t Proc_Encode(uint8_t *dst, uint32_t packed, uint32_t count,
+                            uint8_t bin, uint8_t bits, uint8_t codec,
+                            CCD_ShapedHeader_t *hdr) {
+  hdr->codec = CCD_PROC_CODEC_NONE;
+  hdr->ref = 0;
+  if (codec == CCD_PROC_CODEC_NONE) {
+    return 0;
+  }
+  if (codec == CCD_PROC_CODEC_TEMPORAL) {
+    // A request from the receiver or a changed shape forces a keyframe
+    if (proc_keyframe_request || !ref_valid || ref_count != count ||
+        ref_bin != bin || ref_bits != bits ||
+        ref_age >= CCD_PROC_KEYFRAME_INTERVAL - 1) {
+      proc_keyframe_request = 0;
+      codec = CCD_PROC_CODEC_RICE;
+    }
+  }
+
+  uint32_t size = 0;
+  if (count > 0) {
+    const uint16_t *ref =
+        (codec == CCD_PROC_CODEC_TEMPORAL) ? temporal_ref : NULL;
+    size = CCD_Codec_RiceEncode(dst, packed - 1U, shape_buf, ref, count,
+                                bits);
+    if (size == 0) {
+      ccd_proc_stats.rice_fallbacks++;
+    } else {
+      hdr->codec = codec;
+      hdr->ref = (ref != NULL) ? ref_num : 0;
+    }
+  }
+
+  // Whatever goes out (even a fallback) is the next frame's reference
+  uint32_t shift = 16U - bits;
+  for (uint32_t i = 0; i < count; i++) {
+    temporal_ref[i] = shape_buf[i] >> shift;
+  }
+  ref_age = (hdr->codec == CCD_PROC_CODEC_TEMPORAL) ? ref_age + 1 : 0;
+  ref_num = hdr->frame_num;
+  ref_count = (uint16_t)count;
+  ref_bin = bin;
+  ref_bits = bits;
+  ref_valid = 1;
+  return size;
+}
+
+// Rewrite the slot as a shaped frame and return its length in bytes:
+// header, window list, then each window's (binned) pixels back to back,
+// optionally bit-packed or Rice-coded. A window shorter than the bin factor
+// contributes no pixels. A Rice stream that would not be smaller than the
+// packed pixels is replaced by them, so the frame never grows.
+static uint32_t Proc_Shape(CCD_Frame_t *frame, uint8_t bin, uint8_t bits,
+                           uint8_t codec) {
+  CCD_Codec_BinKernel_t bin_run = CCD_Codec_BinKernel(bin);
+  uint32_t count = 0;
+  if (roi_count == 0) {
+    count = bin_run(shape_buf, frame->pixels, CCD_BUFFER_SIZE);
+  }
+  for (uint8_t i = 0; i < roi_count; i++) {
+    count += bin_run(&shape_buf[count], &frame->pixels[roi[i].start],
+                     roi[i].len);
+  }
+
+  CCD_ShapedHeader_t hdr;
+  hdr.magic = CCD_SHAPED_MAGIC;
+  hdr.frame_num = frame->frame_num;
+  hdr.info = frame->info;
+  hdr.info.header_len = sizeof(hdr);
+  hdr.info.flags |= ((bin > 1) ? CCD_FRAME_F_BINNED : 0U) |
+                    ((roi_count > 0) ? CCD_FRAME_F_ROI : 0U) |
+                    ((bits != CCD_PROC_PACK_NONE) ? CCD_FRAME_F_PACKED : 0U);
+  hdr.bin = bin;
+  hdr.windows = roi_count;
+  hdr.count = (uint16_t)count;
+  hdr.bits = bits;
+
+  uint8_t *base = (uint8_t *)frame;
+  uint8_t *dst = base + sizeof(hdr);
+  memcpy(dst, roi, roi_count * sizeof(roi[0]));
+  dst += roi_count * sizeof(roi[0]);
+
+  uint32_t packed = Proc_PackedSize(count, bits);
+  uint32_t size = Proc_Encode(dst, packed, count, bin, bits, codec, &hdr);
+  if (size == 0) {
+    if (bits == CCD_PROC_PACK_12) {
+      size = CCD_Codec_Pack12(dst, shape_buf, count);
+    } else if (bits == CCD_PROC_PACK_14) {
+      size = CCD_Codec_Pack14(dst, shape_buf, count);
+    } else {
+      memcpy(dst, shape_buf, count * sizeof(uint16_t));
+      size = packed;
+    }
+  }
+  hdr.size = (uint16_t)size;
+  if (hdr.codec != CCD_PROC_CODEC_NONE) {
+    hdr.info.flags |= CCD_FRAME_F_CODED;
+  }
+  hdr.info.payload_len = (uint16_t)(dst + size - base - sizeof(hdr));
+  memcpy(base, &hdr, sizeof(hdr));
+  return (uint32_t)(dst + size - base);
+}
+
+// The shaping without windows, packing or a codec, and into a buffer of the
+// caller's, so neither the slot nor the temporal reference changes
+uint32_t CCD_Proc_Preview(CCD_Frame_t *dst, const CCD_Frame_t *src,
+                          uint8_t bin) {
+  CCD_ShapedHeader_t hdr;
+  uint8_t *base = (uint8_t *)dst;
+  uint16_t *px = (uint16_t *)(base + sizeof(hdr));
+  uint32_t count =
+      CCD_Codec_BinKernel(bin)(px, src->pixels, CCD_BUFFER_SIZE);
+  hdr.magic = CCD_SHAPED_MAGIC;
+  hdr.frame_num = src->frame_num;
+  hdr.info = src->info;
+  hdr.info.header_len = sizeof(hdr);
+  hdr.info.flags |= (bin > 1) ? CCD_FRAME_F_BINNED : 0U;
+  hdr.info.payload_len = (uint16_t)(count * sizeof(uint16_t));
+  hdr.bin = bin;
+  hdr.windows = 0;
+  hdr.count = (uint16_t)count;
+  hdr.bits = CCD_PROC_PACK_NONE;
+  hdr.codec = CCD_PROC_CODEC_NONE;
+  hdr.size = hdr.info.payload_len;
+  hdr.ref = 0;
+  memcpy(base, &hdr, sizeof(hdr));
+  return sizeof(hdr) + hdr.info.payload_len;
+}
+
+// ========== PIPELINE ==========
+
+// Unity gains and an identity linearity table, then the linearity, flat
+// field and wavelength calibration saved in flash (applied if present)
+void CCD_Proc_Init(void) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    flat_gain[0][i] = CCD_FLAT_UNITY;
+  }
+  flat_active = 0;
+  proc_flat_enable = 0;
+  Proc_FlatService(CCD_FLAT_REQ_LOAD);
+  for (uint32_t i = 0; i < CCD_LIN_KNOTS; i++) {
+    lin_knot[0][i] = (uint16_t)((i << 8) < 0xFFFFU ? (i << 8) : 0xFFFFU);
+  }
+  lin_active = 0;
+  proc_lin_enable = 0;
+  CCD_Proc_LinService(CCD_LIN_CMD_LOAD);
+  memcpy(abs_log2, abs_log2_rom, sizeof(abs_log2));
+  CCD_Wavelength_t cal;
+  if (CCD_Store_Load(CCD_STORE_WAVELENGTH, &cal, sizeof(cal))) {
+    CCD_Proc_SetWavelength(&cal);
+  }
+  proc_defect_enable = CCD_Proc_LoadDefects() && defect_count != 0;
+}
+
+// Main loop housekeeping that must not run in the USB interrupt
+void CCD_Proc_Poll(void) {
+  uint8_t req = proc_flat_request;
+  if (req != 0) {
+    proc_flat_request = 0;
+    Proc_FlatService(req);
+  }
+  Proc_DarkFollow();
+  Proc_DriftFollow();
+}
+
+// Drop partial results and held frames, e.g. after a mode switch restarted
+// acquisition
+void CCD_Proc_Reset(void) {
+  coadd_count = 0;
+  dark_count = 0; // A dark capture restarts on the next frame
+  abs_count = 0;
+  drift_count = 0;
+  ref_valid = 0;
+  event_valid = 0;
+  spike_held = 0;
+  Proc_RollingFlush();
+}
+
+// The scratch goes to another mode, once no wide output is queued from
+// it: the despike history, the captures and an auto ROI search restart
+static uint8_t Proc_Yield(void) {
+  if (Proc_WideQueued()) {
+    return 0;
+  }
+  if (spike_held > 0) {
+    spike_held = 0;
+    spike_st.restarts++;
+  }
+  abs_count = 0;
+  drift_count = 0;
+  auto_n = 0;
+  proc_scratch = NULL;
+  return 1;
+}
+
+// Any stage enabled or still holding frames. Frames are then processed and
+// sent one at a time instead of in multi-frame batches.
+uint8_t CCD_Proc_Active(void) {
+#if CCD_REF_PD
+  if (CCD_Ref_Active()) {
+    return 1;
+  }
+#endif
+#if CCD_SHUTTER
+  if (CCD_Shutter_Active()) {
+    return 1;
+  }
+#endif
+#if CCD_MODEL
+  if (CCD_Model_Active()) {
+    return 1;
+  }
+#endif
+  return proc_lin_enable || proc_dark_state != CCD_DARK_NONE ||
+         proc_dark_request != 0 || proc_flat_enable || proc_coadd_n > 1 ||
+         proc_rolling_n > 1 || proc_event_threshold != 0 || roll_count > 0 ||
+         proc_bin > 1 || roi_count > 0 || roi_update ||
+         auto_mode != CCD_PROC_AUTOROI_OFF ||
+         proc_bits != CCD_PROC_PACK_NONE || proc_codec != CCD_PROC_CODEC_NONE ||
+         proc_abs_mode != CCD_PROC_ABS_OFF || proc_abs_request != 0 ||
+         abs_m != 0 || proc_smooth_window != 0 || wl.resample ||
+         proc_stats != CCD_PROC_STATS_OFF || proc_peaks != CCD_PROC_PEAKS_OFF ||
+         band_count != 0 || focus_count != 0 ||
+         proc_despike != CCD_PROC_DESPIKE_OFF ||
+         proc_baseline != CCD_PROC_BASE_OFF ||
+         proc_drift != CCD_PROC_DRIFT_OFF || proc_drift_request != 0 ||
+         drift_m != 0 || CCD_Match_Active() ||
+         (proc_defect_enable && defect_listed != 0);
+}
+
+// ========== PROFILE ==========
+
+CCD_DTCM_BSS static uint32_t prof_start; // DWT at the start of the pass
+CCD_DTCM_BSS static uint32_t prof_mark;  // DWT at the end of the last stage
+
+void CCD_Proc_ProfileReset(void) {
+  memset(&ccd_proc_profile, 0, sizeof(ccd_proc_profile));
+}
+
+// End of a stage: its cycles, and the pass so far
+static inline void Proc_Mark(uint32_t stage) {
+  uint32_t now = DWT->CYCCNT;
+  CCD_Proc_Profile_t *p = &ccd_proc_profile;
+  if (now - prof_mark > p->max_cycles[stage]) {
+    p->max_cycles[stage] = now - prof_mark;
+  }
+  if (now - prof_start > p->max_total) {
+    p->max_total = now - prof_start;
+  }
+  prof_mark = now;
+}
+
+CCD_Frame_t *CCD_Proc_Frame(CCD_Frame_t *frame, uint32_t *len) {
+  prof_start = DWT->CYCCNT;
+  prof_mark = prof_start;
+  ccd_proc_profile.frames++;
+  proc_scratch = CCD_Mem_Claim(CCD_MEM_PROC, Proc_Yield);
+
+  if (proc_lin_enable) {
+    Proc_Linearize(frame->pixels, lin_seg); // No flag bit left to mark it
+  }
+  Proc_Mark(CCD_PROC_STAGE_LINEARITY);
+  Proc_Black(frame->pixels); // No flag bit left either
+  if (proc_dark_request != 0 || dark_m != 0) {
+    Proc_DarkCapture(frame);
+  }
+  if (proc_dark_state & CCD_DARK_READY) {
+    Proc_DarkSubtract(frame->pixels, dark_comp);
+    frame->info.flags |= CCD_FRAME_F_DARK;
+  }
+  Proc_Mark(CCD_PROC_STAGE_DARK);
+  if (proc_flat_enable) {
+    Proc_FlatField(frame->pixels, flat_gain[flat_active]);
+    frame->info.flags |= CCD_FRAME_F_FLAT;
+  }
+  Proc_Mark(CCD_PROC_STAGE_FLAT);
+#if CCD_REF_PD
+  if (CCD_Ref_Active()) {
+    uint32_t g = CCD_Ref_Gain(frame->info.seq);
+    if (g != 0) {
+      Proc_Normalize(frame->pixels, g);
+    }
+  }
+#endif
+  Proc_Mark(CCD_PROC_STAGE_REF);
+  if (proc_defect_enable && defect_listed != 0) {
+    Proc_Defects(frame->pixels, defect_list, defect_listed);
+    defect_frames++;
+  }
+  Proc_Mark(CCD_PROC_STAGE_DEFECT);
+  uint8_t despike = proc_despike;
+  if (despike != CCD_PROC_DESPIKE_OFF && proc_scratch != NULL) {
+    Proc_DespikeFrame(frame, despike);
+  } else {
+    spike_held = 0; // A fresh history when re-enabled
+  }
+  Proc_Mark(CCD_PROC_STAGE_DESPIKE);
+
+  uint16_t n = proc_coadd_n;
+  if (n > 1) {
+    frame = Proc_Coadd(frame, n);
+  }
+  Proc_Mark(CCD_PROC_STAGE_COADD);
+  if (frame == NULL) {
+    return NULL;
+  }
+
+  n = proc_rolling_n;
+  if (n > 1) {
+    frame = Proc_Rolling(frame, n);
+  } else if (roll_count > 0) {
+    Proc_RollingFlush(); // Window just switched off
+  }
+  uint8_t wide = proc_wide;
+  if (frame != NULL && wide != CCD_PROC_WIDE_OFF &&
+      (frame->info.flags & (CCD_FRAME_F_COADD | CCD_FRAME_F_ROLLING))) {
+    abs_count = 0; // The output overlays the capture sums
+    drift_count = 0;
+    auto_n = 0;
+    Proc_WideFrame(frame, wide); // The 16-bit stages below are passed by
+    frame = NULL;
+  }
+  Proc_Mark(CCD_PROC_STAGE_ROLLING);
+  if (frame == NULL) {
+    return NULL;
+  }
+
+  uint16_t t = proc_event_threshold;
+  if (t != 0) {
+    frame = Proc_ChangeDetect(frame, t);
+  } else {
+    event_valid = 0; // Compare against a fresh frame when re-enabled
+  }
+  Proc_Mark(CCD_PROC_STAGE_CHANGE);
+  if (frame == NULL) {
+    return NULL;
+  }
+
+  uint8_t sums = (proc_scratch != NULL && !Proc_WideQueued());
+  if ((proc_abs_request != 0 || abs_m != 0) && sums) {
+    Proc_AbsCapture(frame);
+  }
+  uint8_t mode = proc_abs_mode;
+  if (mode != CCD_PROC_ABS_OFF && proc_abs_state == CCD_ABS_READY) {
+    if (abs_ref_mode != mode) {
+      Proc_AbsTable(mode);
+    }
+    Proc_Absorbance(frame->pixels, abs_ref, mode);
+    frame->info.flags |= CCD_FRAME_F_ABSORB;
+  }
+  Proc_Mark(CCD_PROC_STAGE_ABSORB);
+
+  uint8_t w = proc_smooth_window;
+  uint8_t order = proc_smooth_order;
+  if (CCD_Proc_SmoothValid(w, order)) {
+    if (w != smooth_window || order != smooth_order) {
+      Proc_SmoothSelect(w, order);
+    }
+    Proc_Smooth(frame->pixels, smooth_taps, w);
+    frame->info.flags |= CCD_FRAME_F_SMOOTH;
+  }
+  Proc_Mark(CCD_PROC_STAGE_SMOOTH);
+
+  if ((proc_drift_request != 0 || drift_m != 0) && sums) {
+    Proc_DriftCapture(frame);
+  }
+  uint8_t drift = proc_drift;
+  if (drift != CCD_PROC_DRIFT_OFF && proc_drift_state == CCD_DRIFT_READY) {
+    uint8_t clipped;
+    Proc_Drift(frame, &clipped);
+    if (drift == CCD_PROC_DRIFT_ONLY) {
+      *len = Proc_DriftFrame(frame, clipped);
+      Proc_Mark(CCD_PROC_STAGE_DRIFT);
+      return frame;
+    }
+  }
+  Proc_Mark(CCD_PROC_STAGE_DRIFT);
+
+  if (wl.resample) {
+    Proc_Resample(shape_buf, frame->pixels, wl_map);
+    memcpy(frame->pixels, shape_buf, sizeof(frame->pixels));
+    frame->info.flags |= CCD_FRAME_F_RESAMPLED;
+  }
+  Proc_Mark(CCD_PROC_STAGE_RESAMPLE);
+
+  uint8_t base = proc_baseline;
+  if (base != CCD_PROC_BASE_OFF) {
+    Proc_BaselineFrame(frame, base);
+  }
+  Proc_Mark(CCD_PROC_STAGE_BASELINE);
+
+  if (CCD_Match_Active()) {
+    uint32_t n = CCD_Match_Frame(frame);
+    if (n != 0) {
+      *len = n;
+      Proc_Mark(CCD_PROC_STAGE_MATCH);
+      return frame;
+    }
+  }
+  Proc_Mark(CCD_PROC_STAGE_MATCH);
+
+#if CCD_MODEL
+  if (CCD_Model_Active()) {
+    uint32_t n = CCD_Model_Frame(frame);
+    if (n != 0) {
+      *len = n;
+      Proc_Mark(CCD_PROC_STAGE_MODEL);
+      return frame;
+    }
+  }
+#endif
+  Proc_Mark(CCD_PROC_STAGE_MODEL);
+
+  if (proc_stats == CCD_PROC_STATS_ONLY) {
+    *len = Proc_StatsFrame(frame);
+    Proc_Mark(CCD_PROC_STAGE_STATS);
+    return frame;
+  }
+  Proc_Mark(CCD_PROC_STAGE_STATS);
+  if (proc_peaks == CCD_PROC_PEAKS_ONLY) {
+    *len = Proc_PeaksFrame(frame);
+    Proc_Mark(CCD_PROC_STAGE_PEAKS);
+    return frame;
+  }
+  Proc_Mark(CCD_PROC_STAGE_PEAKS);
+  if (band_count != 0) {
+    *len = Proc_BandsFrame(frame);
+    Proc_Mark(CCD_PROC_STAGE_BANDS);
+    return frame;
+  }
+  Proc_Mark(CCD_PROC_STAGE_BANDS);
+  if (focus_count != 0) {
+    *len = Proc_FocusFrame(frame);
+    Proc_Mark(CCD_PROC_STAGE_FOCUS);
+    return frame;
+  }
+  Proc_Mark(CCD_PROC_STAGE_FOCUS);
+
+  if (auto_mode != CCD_PROC_AUTOROI_OFF) {
+    Proc_AutoRoi(frame);
+  } else if (roi_update) {
+    Proc_RoiUpdate();
+  }
+  uint8_t bin = proc_bin;
+  uint8_t bits = proc_bits;
+  uint8_t codec = proc_codec;
+  if (bin > 1 || roi_count > 0 || bits != CCD_PROC_PACK_NONE ||
+      codec != CCD_PROC_CODEC_NONE) {
+    *len = Proc_Shape(frame, bin, bits, codec);
+  } else {
+    *len = sizeof(CCD_Frame_t);
+  }
+  Proc_Mark(CCD_PROC_STAGE_SHAPE);
+  return frame;
+}
+
+// ========== KERNEL BENCHMARK ==========
+
+#if CCD_CACHE_ENABLE
+__attribute__((section(".sram3"), aligned(32))) static uint16_t
+    bench_d2[BENCH_BYTES / 2U];
+#endif
+static volatile uint32_t bench_sink; // Kernel results, for the check only
+
+// Dark level with a broad line every 512 pixels and 4 bits of noise, so
+// the coder and the change detection see a spectrum rather than a constant
+static void Proc_BenchLine(uint16_t *px) {
+  uint32_t noise = 0x2545F491U;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    uint32_t x = i & 0x1FFU;
+    uint32_t d = (x < 256U) ? x : 512U - x;
+    noise = noise * 1664525U + 1013904223U;
+    px[i] = (uint16_t)(60000U - ((d * d) >> 3) + (noise >> 28));
+  }
+}
+
+// One run of the kernel as the pipeline calls it, on the line at px
+static void Proc_BenchRun(uint8_t kernel, uint16_t *px) {
+  CCD_FrameStats_t st;
+  switch (kernel) {
+  case CCD_PROC_KERNEL_LINEARITY:
+    Proc_Linearize(px, lin_seg);
+    break;
+  case CCD_PROC_KERNEL_DARK:
+    Proc_DarkSubtract(px, dark_comp);
+    break;
+  case CCD_PROC_KERNEL_FLAT:
+    Proc_FlatField(px, flat_gain[flat_active]);
+    break;
+  case CCD_PROC_KERNEL_COADD:
+    Proc_Accumulate(coadd_acc, px, 0);
+    break;
+  case CCD_PROC_KERNEL_CHANGE:
+    bench_sink = Proc_Sad(px, event_ref);
+    break;
+  case CCD_PROC_KERNEL_STATS:
+    Proc_Stats(&st, px, proc_stats_level);
+    bench_sink = st.sum;
+    break;
+  case CCD_PROC_KERNEL_BIN:
+    bench_sink =
+        CCD_Codec_BinKernel(4U)(shape_buf, px, CCD_BUFFER_SIZE);
+    break;
+  case CCD_PROC_KERNEL_PACK12:
+    bench_sink =
+        CCD_Codec_Pack12((uint8_t *)px, shape_buf, CCD_BUFFER_SIZE);
+    break;
+  case CCD_PROC_KERNEL_RICE:
+    bench_sink = CCD_Codec_RiceEncode((uint8_t *)px,
+                                      CCD_BUFFER_SIZE * sizeof(uint16_t),
+                                      shape_buf, NULL, CCD_BUFFER_SIZE,
+                                      CCD_PROC_PACK_NONE);
+    break;
+  case CCD_PROC_KERNEL_CRC:
+    bench_sink = CCD_Crc_Compute(px, CCD_BUFFER_SIZE * sizeof(uint16_t));
+    break;
+  case CCD_PROC_KERNEL_DESPIKE:
+    bench_sink = Proc_Despike(px, proc_scratch->spike[0],
+                              proc_scratch->spike[1],
+                              Proc_DespikeGain(proc_despike_sigma),
+                              proc_despike_floor);
+    break;
+  }
+}
+
+// What a run left behind: the line, the shaping buffer and the result
+static uint32_t Proc_BenchCheck(const uint16_t *px) {
+  uint32_t sink = bench_sink;
+  return CCD_Crc_Compute(px, CCD_BUFFER_SIZE * sizeof(uint16_t)) ^
+         CCD_Crc_Compute(shape_buf, sizeof(shape_buf)) ^
+         CCD_Crc_Compute(&sink, sizeof(sink));
+}
+
+// The line is rewritten before every run (untimed), so in-place kernels
+// never see their own output and the shaping buffer is a fresh source
+uint8_t CCD_Proc_Bench(uint8_t kernel, CCD_ProcBench_t *out) {
+  if (kernel >= CCD_PROC_KERNELS) {
+    return 0;
+  }
+  proc_scratch = CCD_Mem_Claim(CCD_MEM_PROC, Proc_Yield);
+  if (kernel == CCD_PROC_KERNEL_DESPIKE && proc_scratch == NULL) {
+    return 0; // The history is another mode's
+  }
+  uint16_t *bench_axi = NULL; // The scratch's, unless a wide output has it
+  if (proc_scratch != NULL && !Proc_WideQueued()) {
+    bench_axi = proc_scratch->u.bench;
+    abs_count = 0; // As before a wide output
+    drift_count = 0;
+    auto_n = 0;
+  }
+  uint16_t *const line[CCD_PROC_REGIONS] = {
+      [CCD_PROC_REGION_DTCM] = temporal_ref,
+      [CCD_PROC_REGION_AXI] = bench_axi,
+#if CCD_CACHE_ENABLE
+      [CCD_PROC_REGION_AXI_COLD] = bench_axi,
+      [CCD_PROC_REGION_D2] = bench_d2,
+#endif
+  };
+  memset(out, 0, sizeof(*out));
+  out->kernel = kernel;
+  out->regions = CCD_PROC_REGIONS;
+  out->runs = CCD_PROC_BENCH_RUNS;
+  for (uint32_t r = 0; r < CCD_PROC_REGIONS; r++) {
+    uint16_t *px = line[r];
+    if (px == NULL) {
+      continue;
+    }
+    uint32_t min = 0xFFFFFFFFU;
+    uint32_t sum = 0;
+    for (uint32_t n = 0; n < CCD_PROC_BENCH_RUNS; n++) {
+      Proc_BenchLine(px);
+      Proc_BenchLine(shape_buf);
+      bench_sink = 0;
+#if CCD_CACHE_ENABLE
+      if (r == CCD_PROC_REGION_AXI_COLD) {
+        SCB_CleanInvalidateDCache_by_Addr((uint32_t *)px, BENCH_BYTES);
+      }
+#endif
+      uint32_t start = DWT->CYCCNT;
+      Proc_BenchRun(kernel, px);
+      uint32_t cycles = DWT->CYCCNT - start;
+      if (cycles < min) {
+        min = cycles;
+      }
+      sum += cycles;
+      if (n == 0) {
+        out->region[r].check = Proc_BenchCheck(px);
+      }
+    }
+    out->region[r].min_cycles = min;
+    out->region[r].mean_cycles = sum / CCD_PROC_BENCH_RUNS;
+  }
+  ref_valid = 0; // The DTCM line was the temporal reference
+  if (kernel == CCD_PROC_KERNEL_COADD) {
+    coadd_count = 0; // As after a frame gap
+  } else if (kernel == CCD_PROC_KERNEL_DESPIKE) {
+    spike_held = 0;
+  }
+  return 1;
+}
@@ -0,0 +1,146 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_psram.c
+ * @brief          : External QSPI PSRAM on QUADSPI (burst frame store)
+ ******************************************************************************
+ */
+
+#include "ccd_psram.h"
+
+#if CCD_BURST_PSRAM
+
+// APS6404L commands
+#define PSRAM_RESET_ENABLE 0x66U
+#define PSRAM_RESET 0x99U
+#define PSRAM_ENTER_QUAD 0x35U // SPI -> QPI: everything on 4 lines after it
+#define PSRAM_QUAD_WRITE 0x38U
+#define PSRAM_QUAD_READ 0xEBU
+#define PSRAM_READ_WAIT 6U     // Wait cycles of PSRAM_QUAD_READ
+#define PSRAM_TIMEOUT_MS 10U
+#define PSRAM_CS_TIMEOUT 16U   // Idle QUADSPI cycles before CS goes high
+
+extern QSPI_HandleTypeDef hqspi;
+
+// Write in progress; the TX complete interrupt moves it on
+static const uint8_t *wr_src;
+static uint32_t wr_addr;
+static uint32_t wr_left;
+static uint32_t wr_n; // Bytes of the chunk on the bus
+static volatile uint8_t wr_busy;
+static volatile uint8_t wr_failed;
+static uint8_t mapped;
+
+static QSPI_CommandTypeDef Psram_Cmd(uint32_t instruction, uint32_t lines) {
+  QSPI_CommandTypeDef cmd = {
+      .Instruction = instruction,
+      .InstructionMode = lines,
+      .AddressSize = QSPI_ADDRESS_24_BITS,
+      .AddressMode = QSPI_ADDRESS_NONE,
+      .AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE,
+      .DataMode = QSPI_DATA_NONE,
+      .DdrMode = QSPI_DDR_MODE_DISABLE,
+      .DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY,
+      .SIOOMode = QSPI_SIOO_INST_EVERY_CMD,
+  };
+  return cmd;
+}
+
+uint8_t CCD_PSRAM_Init(void) {
+  static const uint8_t seq[] = {PSRAM_RESET_ENABLE, PSRAM_RESET,
+                                PSRAM_ENTER_QUAD};
+  for (uint32_t i = 0; i < sizeof(seq); i++) {
+    QSPI_CommandTypeDef cmd = Psram_Cmd(seq[i], QSPI_INSTRUCTION_1_LINE);
+    if (HAL_QSPI_Command(&hqspi, &cmd, PSRAM_TIMEOUT_MS) != HAL_OK) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// The next piece, up to the next CCD_PSRAM_CHUNK boundary, so no piece
+// crosses a 1 KB page of the chip either
+static uint8_t Psram_Chunk(void) {
+  uint32_t n = CCD_PSRAM_CHUNK - (wr_addr % CCD_PSRAM_CHUNK);
+  if (n > wr_left) {
+    n = wr_left;
+  }
+  QSPI_CommandTypeDef cmd =
+      Psram_Cmd(PSRAM_QUAD_WRITE, QSPI_INSTRUCTION_4_LINES);
+  cmd.Address = wr_addr;
+  cmd.AddressMode = QSPI_ADDRESS_4_LINES;
+  cmd.DataMode = QSPI_DATA_4_LINES;
+  cmd.NbData = n;
+  wr_n = n;
+  return HAL_QSPI_Command(&hqspi, &cmd, PSRAM_TIMEOUT_MS) == HAL_OK &&
+         HAL_QSPI_Transmit_DMA(&hqspi, (uint8_t *)wr_src) == HAL_OK;
+}
+
+uint8_t CCD_PSRAM_Write(uint32_t addr, const void *src, uint32_t len) {
+  if (wr_busy || mapped || len == 0 || addr + len > CCD_PSRAM_SIZE) {
+    return 0;
+  }
+  CCD_DCACHE_CLEAN(src, len); // The MDMA reads memory, not the cache
+  wr_src = src;
+  wr_addr = addr;
+  wr_left = len;
+  wr_failed = 0;
+  wr_busy = 1;
+  if (!Psram_Chunk()) {
+    wr_busy = 0;
+    wr_failed = 1;
+    return 0;
+  }
+  return 1;
+}
+
+void HAL_QSPI_TxCpltCallback(QSPI_HandleTypeDef *h) {
+  wr_src += wr_n;
+  wr_addr += wr_n;
+  wr_left -= wr_n;
+  if (wr_left == 0) {
+    wr_busy = 0;
+  } else if (!Psram_Chunk()) {
+    wr_failed = 1;
+    wr_busy = 0;
+  }
+}
+
+void HAL_QSPI_ErrorCallback(QSPI_HandleTypeDef *h) {
+  wr_failed = 1;
+  wr_busy = 0;
+}
+
+uint8_t CCD_PSRAM_Busy(void) { return wr_busy; }
+
+uint8_t CCD_PSRAM_Failed(void) { return wr_failed; }
+
+uint8_t CCD_PSRAM_Map(void) {
+  if (mapped) {
+    return 1;
+  }
+  if (wr_busy) {
+    return 0;
+  }
+  QSPI_CommandTypeDef cmd =
+      Psram_Cmd(PSRAM_QUAD_READ, QSPI_INSTRUCTION_4_LINES);
+  cmd.AddressMode = QSPI_ADDRESS_4_LINES;
+  cmd.DataMode = QSPI_DATA_4_LINES;
+  cmd.DummyCycles = PSRAM_READ_WAIT;
+  QSPI_MemoryMappedTypeDef mm = {
+      .TimeOutActivation = QSPI_TIMEOUT_COUNTER_ENABLE,
+      .TimeOutPeriod = PSRAM_CS_TIMEOUT,
+  };
+  mapped = HAL_QSPI_MemoryMapped(&hqspi, &cmd, &mm) == HAL_OK;
+  return mapped;
+}
+
+void CCD_PSRAM_Unmap(void) {
+  if (mapped) {
+    HAL_QSPI_Abort(&hqspi); // Leaves memory-mapped mode
+    mapped = 0;
+  }
+}
+
+uint8_t CCD_PSRAM_Mapped(void) { return mapped; }
+
+#endif /* CCD_BURST_PSRAM */
@@ -0,0 +1,305 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_ptc.c
+ * @brief          : Photon transfer curves: per-pixel mean and variance maps
+ ******************************************************************************
+ */
+
+#include "ccd_ptc.h"
+#include "ccd_acq.h"
+#include "ccd_ae.h"
+#include "ccd_crc.h"
+#include "ccd_mem.h"
+#include "ccd_phase.h" // Pixel classes
+#include "ccd_seq.h"
+#include "frame_ring.h"
+#include "usb_tx.h"
+#include "usbd_cdc_if.h"
+#include <stddef.h>
+#include <string.h>
+
+// The squares are summed where their pixel's mean and variance go out, 8
+// bytes each, so one buffer holds both
+typedef struct {
+  CCD_PtcHeader_t hdr;
+  union {
+    uint64_t sq[CCD_BUFFER_SIZE];
+    CCD_PtcPixel_t map[CCD_BUFFER_SIZE];
+  } u;
+} Ptc_Out_t;
+
+_Static_assert(offsetof(Ptc_Out_t, u) == sizeof(CCD_PtcHeader_t),
+               "the maps follow the header on the wire");
+_Static_assert(sizeof(CCD_PtcPixel_t) == sizeof(uint64_t),
+               "each pixel's map entry replaces its square sum");
+_Static_assert(sizeof(Ptc_Out_t) - sizeof(CCD_PtcHeader_t) <= 0xFFFFU,
+               "the maps must fit payload_len");
+_Static_assert(CCD_PTC_LEVELS <= 255U, "level indices are 8-bit");
+
+// The run's share of the scratch (ccd_mem.h), held from the start until
+// the run is over and its last maps are sent. Per pixel, beside the
+// squares: the value in the level's first frame, and the summed offsets
+// from it.
+typedef struct {
+  Ptc_Out_t out;
+  uint16_t first[CCD_BUFFER_SIZE];
+  int32_t sum[CCD_BUFFER_SIZE];
+} Ptc_Scratch_t;
+
+_Static_assert(sizeof(Ptc_Scratch_t) <= CCD_MEM_SCRATCH_SIZE,
+               "the run fits the scratch");
+
+// Commands and run state, main loop only
+static uint32_t ptc_t_us[CCD_PTC_LEVELS];
+static uint8_t ptc_levels;
+static uint16_t ptc_frames;
+static uint8_t ptc_state = CCD_PTC_IDLE;
+static uint8_t ptc_level;
+static uint16_t ptc_count;    // Frames in the sums
+static uint16_t ptc_from;     // First frame_num that may belong to the level
+static uint16_t ptc_next;     // frame_num expected next
+static uint32_t ptc_saved_us; // Integration time before the run
+static uint32_t ptc_start_ms;
+static uint32_t ptc_end_ms;
+static uint32_t ptc_maps;
+static uint32_t ptc_dropped;
+static uint32_t ptc_restarts;
+static float ptc_black;
+static float ptc_light;
+static float ptc_variance;
+
+static Ptc_Scratch_t *ptc_buf;    // NULL while the scratch is not held
+static volatile uint8_t ptc_busy; // Maps queued, cleared by TX completion
+
+static uint8_t Ptc_Running(void) {
+  return ptc_state != CCD_PTC_IDLE && ptc_state != CCD_PTC_DONE &&
+         ptc_state != CCD_PTC_ERROR;
+}
+
+// ========== COMMANDS ==========
+
+uint8_t CCD_Ptc_SetLevels(uint8_t first, const uint32_t *t_us, uint8_t n) {
+  if (Ptc_Running() || first + n > CCD_PTC_LEVELS) {
+    return 0;
+  }
+  memcpy(&ptc_t_us[first], t_us, n * sizeof(*t_us));
+  ptc_levels = first + n;
+  return 1;
+}
+
+// No levels set: one, at the integration time set
+uint8_t CCD_Ptc_Start(uint16_t frames) {
+  if (Ptc_Running() || frames < CCD_PTC_FRAMES_MIN ||
+      CCD_Acq_BracketCount() != 0 || CCD_Seq_Running()) {
+    return 0;
+  }
+  ptc_buf = CCD_Mem_Claim(CCD_MEM_PTC, NULL);
+  if (ptc_buf == NULL) {
+    return 0; // Held by another mode
+  }
+  if (ptc_levels == 0) {
+    ptc_t_us[0] = 0;
+    ptc_levels = 1;
+  }
+  CCD_AE_Enable(0); // The levels own the integration time
+  ptc_saved_us = CCD_Acq_IntegrationUs();
+  ptc_frames = frames;
+  ptc_level = 0;
+  ptc_count = 0;
+  ptc_start_ms = HAL_GetTick();
+  if (ccd_mode != CCD_MODE_FAST) {
+    ccd_mode = CCD_MODE_FAST;
+    mode_update_pending = 1;
+  }
+  ptc_state = CCD_PTC_STARTING;
+  return 1;
+}
+
+static void Ptc_Finish(uint8_t state) {
+  ptc_state = state;
+  ptc_end_ms = HAL_GetTick();
+  CCD_Acq_SetIntegration(ptc_saved_us);
+}
+
+void CCD_Ptc_Stop(void) {
+  if (Ptc_Running()) {
+    Ptc_Finish(CCD_PTC_DONE);
+  }
+}
+
+void CCD_Ptc_Status(CCD_PtcStatus_t *out) {
+  out->state = ptc_state;
+  out->level = ptc_level;
+  out->levels = ptc_levels;
+  out->reserved = 0;
+  out->frames = ptc_frames;
+  out->count = ptc_count;
+  out->t_us = CCD_Acq_IntegrationUs();
+  out->maps = ptc_maps;
+  out->dropped = ptc_dropped;
+  out->restarts = ptc_restarts;
+  out->elapsed_ms =
+      (Ptc_Running() ? HAL_GetTick() : ptc_end_ms) - ptc_start_ms;
+  out->black = ptc_black;
+  out->light = ptc_light;
+  out->variance = ptc_variance;
+}
+
+uint8_t CCD_Ptc_Active(void) {
+  return ptc_state >= CCD_PTC_SETTLE && ptc_state <= CCD_PTC_SENDING;
+}
+
+// ========== LEVELS ==========
+
+static void Ptc_EnterLevel(uint8_t level) {
+  uint32_t t = ptc_t_us[level];
+  ptc_level = level;
+  ptc_count = 0;
+  if (t != 0 && !CCD_Acq_SetIntegration(t)) {
+    Ptc_Finish(CCD_PTC_ERROR);
+    return;
+  }
+  ptc_from = CCD_Acq_FrameCount();
+  ptc_state = CCD_PTC_SETTLE;
+}
+
+static void Ptc_NextLevel(void) {
+  if (ptc_level + 1U >= ptc_levels) {
+    Ptc_Finish(CCD_PTC_DONE);
+  } else {
+    Ptc_EnterLevel(ptc_level + 1U);
+  }
+}
+
+// One SMLAL per pixel for the square; the offsets stay within +-65535, so
+// N frames of them fit int32 for any 16-bit N
+CCD_ITCM static void Ptc_Accumulate(Ptc_Scratch_t *b, const uint16_t *px) {
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    int32_t d = (int32_t)px[i] - b->first[i];
+    b->sum[i] += d;
+    b->out.u.sq[i] += (uint64_t)((int64_t)d * d);
+  }
+}
+
+static void Ptc_Start(Ptc_Scratch_t *b, const CCD_Frame_t *frame) {
+  memcpy(b->first, frame->pixels, sizeof(b->first));
+  memset(b->sum, 0, sizeof(b->sum));
+  memset(b->out.u.sq, 0, sizeof(b->out.u.sq));
+  b->out.hdr.first_seq = frame->info.seq;
+}
+
+// The sums become the maps in place (each pixel's square is read before
+// its entry is written), with the curve point over the pixel classes
+static void Ptc_Maps(Ptc_Scratch_t *b, uint32_t n) {
+  double inv_n = 1.0 / n;
+  double inv_n1 = 1.0 / (n - 1U);
+  double black = 0.0;
+  double mean = 0.0;
+  double var = 0.0;
+  for (uint32_t i = 0; i < CCD_BUFFER_SIZE; i++) {
+    double s = b->sum[i];
+    double v = ((double)b->out.u.sq[i] - s * s * inv_n) * inv_n1;
+    double m = b->first[i] + s * inv_n;
+    b->out.u.map[i].mean = (float)m;
+    b->out.u.map[i].variance = (float)v;
+    if (i >= CCD_PHASE_SHIELD_START &&
+        i < CCD_PHASE_SHIELD_START + CCD_PHASE_SHIELD_COUNT) {
+      black += m;
+    } else if (i >= CCD_PHASE_ACTIVE_START &&
+               i < CCD_PHASE_ACTIVE_START + CCD_PHASE_ACTIVE_COUNT) {
+      mean += m;
+      var += v;
+    }
+  }
+  black /= CCD_PHASE_SHIELD_COUNT;
+  ptc_black = (float)black;
+  ptc_light = (float)(black - mean / CCD_PHASE_ACTIVE_COUNT);
+  ptc_variance = (float)(var / CCD_PHASE_ACTIVE_COUNT);
+}
+
+static void Ptc_Sent(void *ctx, uint32_t len) { ptc_busy = 0; }
+
+// Queued, or lost with the port closed; either way the next level begins
+static void Ptc_Send(void) {
+  if (!CDC_IsOpen_FS()) {
+    ptc_dropped++;
+    Ptc_NextLevel();
+    return;
+  }
+  if (UsbTx_Space(USB_TX_FRAMES) == 0) {
+    ptc_state = CCD_PTC_SENDING;
+    return;
+  }
+  Ptc_Out_t *out = &ptc_buf->out;
+  CCD_Crc_Stamp(&out->hdr);
+  ptc_busy = 1;
+  if (UsbTx_Submit(USB_TX_FRAMES, (const uint8_t *)out, sizeof(*out),
+                   Ptc_Sent, NULL)) {
+    ptc_maps++;
+  } else {
+    ptc_busy = 0;
+    ptc_dropped++;
+  }
+  Ptc_NextLevel();
+}
+
+static void Ptc_Emit(const CCD_Frame_t *frame) {
+  CCD_PtcHeader_t *h = &ptc_buf->out.hdr;
+  Ptc_Maps(ptc_buf, ptc_count);
+  h->magic = CCD_PTC_MAGIC;
+  h->frame_num = frame->frame_num;
+  h->info = frame->info;
+  h->info.header_len = sizeof(*h);
+  h->info.payload_len = sizeof(ptc_buf->out.u);
+  h->level = ptc_level;
+  h->levels = ptc_levels;
+  h->frames = ptc_count;
+  h->t_us = CCD_Acq_IntegrationUs();
+  h->black = ptc_black;
+  h->light = ptc_light;
+  h->variance = ptc_variance;
+  h->restarts = ptc_restarts;
+  Ptc_Send();
+}
+
+// ========== ENGINE ==========
+
+void CCD_Ptc_Frame(CCD_Frame_t *frame) {
+  uint16_t num = frame->frame_num;
+  if (ptc_state == CCD_PTC_SETTLE && !ptc_busy &&
+      (int16_t)(num - ptc_from) >= 0 && CCD_Acq_ExposureSettled(num)) {
+    ptc_state = CCD_PTC_RUN;
+  }
+  if (ptc_state == CCD_PTC_RUN) {
+    if (ptc_count > 0 && num != ptc_next) {
+      ptc_restarts++; // Dropped or resynced: the sums need N real frames
+      ptc_count = 0;
+    }
+    ptc_next = (uint16_t)(num + 1U);
+    if (ptc_count == 0) {
+      Ptc_Start(ptc_buf, frame);
+    } else {
+      Ptc_Accumulate(ptc_buf, frame->pixels);
+    }
+    if (++ptc_count == ptc_frames) {
+      Ptc_Emit(frame);
+    }
+  }
+  FrameRing_Release(frame, 1);
+}
+
+void CCD_Ptc_Poll(void) {
+  if (ptc_state == CCD_PTC_STARTING && !mode_update_pending) {
+    Ptc_EnterLevel(0);
+  }
+  if (Ptc_Running() && ccd_mode != CCD_MODE_FAST && !mode_update_pending) {
+    Ptc_Finish(CCD_PTC_DONE); // Mode changed under the run
+  }
+  if (ptc_state == CCD_PTC_SENDING) {
+    Ptc_Send();
+  }
+  if (ptc_buf != NULL && !Ptc_Running() && !ptc_busy) {
+    ptc_buf = NULL;
+    CCD_Mem_Release(CCD_MEM_PTC);
+  }
+}
@@ -0,0 +1,225 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_rec.c
+ * @brief          : Recording to an SD card (SDMMC1, IDMA)
+ ******************************************************************************
+ */
+
+#include "ccd_rec.h"
+
+#if CCD_SD
+
+#include "ccd_crc.h"
+#include "ccd_line.h"
+#include "ccd_preview.h"
+#include "ccd_time.h"
+#include "frame_ring.h"
+#include "usb_tx.h"
+#include <string.h>
+
+#if !CCD_CACHE_ENABLE
+#error "CCD_SD: the SDMMC1 IDMA cannot reach the RAM_D2 ring of this build"
+#endif
+
+#define REC_BLOCK 512U
+#define REC_PAIR_BLOCKS (2U * sizeof(CCD_Frame_t) / REC_BLOCK)
+
+_Static_assert((2U * sizeof(CCD_Frame_t)) % REC_BLOCK == 0,
+               "a pair of frames fills whole blocks");
+_Static_assert((CCD_REC_BATCH % 2U) == 0 && CCD_REC_BATCH <= FRAME_RING_SLOTS,
+               "runs are whole pairs of ring slots");
+
+extern SD_HandleTypeDef hsd1;
+
+// Main loop only, apart from the two flags the SDMMC1 interrupt sets
+static CCD_RecStatus_t rec;
+static uint32_t rec_block;      // Where the next run goes
+static uint32_t rec_dropped0;   // frame_ring_stats.dropped at the start
+static CCD_Frame_t *rec_first;  // Run being written
+static uint32_t rec_n;          // Its frames, 0 for a header write
+static uint32_t rec_preview;    // Frames since the last preview
+static uint8_t rec_busy;        // A write is in flight
+static uint8_t rec_header;      // Start header still to write
+static uint8_t rec_final;       // Final header written
+static volatile uint8_t rec_done;
+static volatile uint8_t rec_failed;
+
+// IDMA source: AXI SRAM, one block
+__attribute__((aligned(32))) static uint8_t rec_header_block[REC_BLOCK];
+
+void HAL_SD_TxCpltCallback(SD_HandleTypeDef *hsd) { rec_done = 1; }
+
+void HAL_SD_ErrorCallback(SD_HandleTypeDef *hsd) {
+  rec_failed = 1;
+  rec_done = 1;
+}
+
+static uint8_t Rec_Write(const void *buf, uint32_t block, uint32_t blocks) {
+  CCD_DCACHE_CLEAN(buf, blocks * REC_BLOCK);
+  rec_done = 0;
+  rec_failed = 0;
+  if (HAL_SD_WriteBlocks_DMA(&hsd1, (uint8_t *)buf, block, blocks) != HAL_OK) {
+    return 0;
+  }
+  rec_busy = 1;
+  return 1;
+}
+
+static uint8_t Rec_WriteHeader(void) {
+  CCD_RecHeader_t h = {
+      .magic = CCD_REC_MAGIC,
+      .version = CCD_REC_VERSION,
+      .frame_size = sizeof(CCD_Frame_t),
+      .first_block = CCD_REC_BASE + 1U,
+      .frames = rec_final ? rec.frames : 0,
+      .first_seq = rec.first_seq,
+      .tick_hz = CCD_TIME_HZ,
+  };
+  memset(rec_header_block, 0, sizeof(rec_header_block));
+  memcpy(rec_header_block, &h, sizeof(h));
+  return Rec_Write(rec_header_block, CCD_REC_BASE, 1);
+}
+
+static void Rec_PreviewSent(void *ctx, uint32_t len) {
+  FrameRing_Release((const CCD_Frame_t *)ctx, 1);
+}
+
+// The run is on the card (or failed): give its slots back, the newest with
+// a reference of its own for USB when a raw preview is due. The binned
+// preview (ccd_preview.h) copies from the slot before it goes.
+static void Rec_EndRun(uint8_t written) {
+  CCD_Frame_t *last = &rec_first[rec_n - 1U];
+  uint8_t preview = 0;
+  if (written) {
+    rec.frames += rec_n;
+    rec_block += rec_n / 2U * REC_PAIR_BLOCKS;
+    rec_preview += rec_n;
+    CCD_Preview_Offer(last);
+#if CCD_ENCODER
+    for (uint32_t i = 0; CCD_Line_Active() && i < rec_n; i++) {
+      CCD_Line_Recorded(&rec_first[i]); // Line-scan previews, ccd_jpeg.h
+    }
+#endif
+    preview = !CCD_Preview_Enabled() && rec_preview >= CCD_REC_PREVIEW &&
+              UsbTx_Space(USB_TX_FRAMES) > 0;
+  }
+  preview = preview && FrameRing_Retain(last, 1);
+  FrameRing_Release(rec_first, rec_n);
+  if (preview) {
+    rec_preview = 0;
+    if (!UsbTx_Submit(USB_TX_FRAMES, (const uint8_t *)last,
+                      sizeof(CCD_Frame_t), Rec_PreviewSent, last)) {
+      FrameRing_Release(last, 1);
+    }
+  }
+  rec_n = 0;
+}
+
+static void Rec_Fail(void) {
+  rec.sd_error = HAL_SD_GetError(&hsd1);
+  rec.state = CCD_REC_ERROR;
+}
+
+uint8_t CCD_Rec_Start(void) {
+  HAL_SD_CardInfoTypeDef card;
+  if (rec.state == CCD_REC_RECORDING || rec.state == CCD_REC_STOPPING ||
+      HAL_SD_GetCardInfo(&hsd1, &card) != HAL_OK ||
+      card.LogBlockSize != REC_BLOCK ||
+      card.LogBlockNbr < CCD_REC_BASE + 1U + REC_PAIR_BLOCKS) {
+    return 0;
+  }
+  memset(&rec, 0, sizeof(rec));
+  rec.capacity =
+      (card.LogBlockNbr - CCD_REC_BASE - 1U) / REC_PAIR_BLOCKS * 2U;
+  rec_block = CCD_REC_BASE + 1U;
+  rec_dropped0 = frame_ring_stats.dropped;
+  rec_preview = CCD_REC_PREVIEW; // The first run is previewed
+  rec_header = 1;
+  rec_final = 0;
+  rec.state = CCD_REC_RECORDING;
+  return 1;
+}
+
+void CCD_Rec_Stop(void) {
+  if (rec.state == CCD_REC_RECORDING) {
+    rec.state = CCD_REC_STOPPING;
+  }
+}
+
+void CCD_Rec_Status(CCD_RecStatus_t *st) { *st = rec; }
+
+uint8_t CCD_Rec_Active(void) { return rec.state == CCD_REC_RECORDING; }
+
+// One write at a time: the next goes out once the card has programmed the
+// last one and is back in the transfer state
+void CCD_Rec_Poll(void) {
+  if (rec.state != CCD_REC_RECORDING && rec.state != CCD_REC_STOPPING) {
+    return;
+  }
+  rec.dropped = frame_ring_stats.dropped - rec_dropped0;
+  if (rec_busy) {
+    if (!rec_done) {
+      return;
+    }
+    rec_busy = 0;
+    if (rec_n > 0) {
+      Rec_EndRun(!rec_failed);
+    }
+    if (rec_failed) {
+      Rec_Fail();
+      return;
+    }
+  }
+  if (HAL_SD_GetCardState(&hsd1) != HAL_SD_CARD_TRANSFER) {
+    return;
+  }
+  if (rec_header) {
+    rec_header = 0;
+    if (!Rec_WriteHeader()) {
+      Rec_Fail();
+    }
+    return;
+  }
+  if (rec.state == CCD_REC_STOPPING || rec.frames >= rec.capacity) {
+    if (rec_final) {
+      rec.state = CCD_REC_IDLE;
+      return;
+    }
+    rec.state = CCD_REC_STOPPING;
+    rec_final = 1;
+    if (!Rec_WriteHeader()) {
+      Rec_Fail();
+    }
+    return;
+  }
+
+  CCD_Frame_t *first;
+  uint32_t room = rec.capacity - rec.frames;
+  uint32_t n =
+      FrameRing_PeekBatch(&first, room < CCD_REC_BATCH ? room : CCD_REC_BATCH);
+  if (n == 1 && FrameRing_Count() > 1) {
+    FrameRing_Advance(1); // Odd slot before the wrap, see ccd_rec.h
+    FrameRing_Release(first, 1);
+    rec.skipped++;
+    return;
+  }
+  n &= ~1U;
+  if (n == 0) {
+    return;
+  }
+  FrameRing_Advance(n);
+  if (rec.frames == 0) {
+    rec.first_seq = first->info.seq;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    CCD_Crc_Stamp(&first[i]);
+  }
+  rec_first = first;
+  rec_n = n;
+  if (!Rec_Write(first, rec_block, n / 2U * REC_PAIR_BLOCKS)) {
+    Rec_EndRun(0);
+    Rec_Fail();
+  }
+}
+
+#endif /* CCD_SD */
@@ -0,0 +1,238 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_ref.c
+ * @brief          : Reference photodiode on ADC3, per-frame source level
+ ******************************************************************************
+ */
+
+#include "ccd_ref.h"
+
+#if CCD_REF_PD
+
+#include "ccd_acq.h"
+#include "ccd_time.h"
+#include "ccd_timing.h"
+#include "stm32h7xx_ll_adc.h"
+#include "stm32h7xx_ll_dma.h"
+#include "stm32h7xx_ll_tim.h"
+
+#define REF_DMA DMA1
+#define REF_STREAM LL_DMA_STREAM_2
+#define REF_PERIOD_US (1000000U / CCD_REF_RATE_HZ)
+
+_Static_assert((CCD_REF_SLOTS & (CCD_REF_SLOTS - 1U)) == 0 &&
+                   (CCD_REF_HIST & (CCD_REF_HIST - 1U)) == 0,
+               "the result ring and the history index by mask");
+_Static_assert(CCD_REF_HIST >= CCD_REF_LEVELS,
+               "the status levels come from the history");
+
+// Written by DMA1 round and round; read after an invalidate
+__attribute__((aligned(32))) static uint32_t ref_buf[CCD_REF_SLOTS];
+
+static volatile uint8_t ref_mode = CCD_REF_OFF;
+static volatile uint32_t ref_target;
+static uint8_t ref_ready;   // CCD_Ref_Init() done
+static uint8_t ref_running; // Chain started by the last CCD_Ref_Apply()
+static uint8_t ref_shift;
+static uint32_t ref_result_us;
+static uint32_t ref_result_cycles;
+static uint64_t ref_start; // CCD_Time_Now() at the restart
+
+static uint32_t ref_seq[CCD_REF_HIST];
+static uint32_t ref_level[CCD_REF_HIST]; // 1/16 counts, 0 = none
+static uint16_t ref_results;             // In the newest level
+static volatile uint32_t ref_newest;
+static volatile uint32_t ref_frames;
+static volatile uint32_t ref_unmatched;
+
+void CCD_Ref_Init(void) {
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  GPIO_InitTypeDef gpio = {0};
+  gpio.Pin = CCD_REF_Pin;
+  gpio.Mode = GPIO_MODE_ANALOG;
+  gpio.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(CCD_REF_GPIO_Port, &gpio);
+
+  // TIM15 only counts: its update is the conversion trigger
+  __HAL_RCC_TIM15_CLK_ENABLE();
+  __HAL_RCC_TIM15_FORCE_RESET();
+  __HAL_RCC_TIM15_RELEASE_RESET();
+  LL_TIM_SetPrescaler(TIM15, 0);
+  LL_TIM_SetAutoReload(TIM15, CCD_TIM_CLK_HZ / CCD_REF_RATE_HZ - 1U);
+  LL_TIM_SetTriggerOutput(TIM15, LL_TIM_TRGO_UPDATE);
+
+  // One rank, one conversion per trigger, results to DMA without end.
+  // ADC3 is enabled, with the temperatures' first reading converting.
+  while (LL_ADC_INJ_IsConversionOngoing(ADC3)) {
+  }
+  LL_ADC_SetChannelPreselection(ADC3, CCD_REF_LL_CHANNEL);
+  LL_ADC_SetChannelSamplingTime(ADC3, CCD_REF_LL_CHANNEL,
+                                LL_ADC_SAMPLINGTIME_8CYCLES_5);
+  LL_ADC_REG_SetSequencerRanks(ADC3, LL_ADC_REG_RANK_1, CCD_REF_LL_CHANNEL);
+  LL_ADC_REG_SetSequencerLength(ADC3, LL_ADC_REG_SEQ_SCAN_DISABLE);
+  LL_ADC_REG_SetContinuousMode(ADC3, LL_ADC_REG_CONV_SINGLE);
+  LL_ADC_REG_SetTriggerSource(ADC3, LL_ADC_REG_TRIG_EXT_TIM15_TRGO);
+  LL_ADC_REG_SetTriggerEdge(ADC3, LL_ADC_REG_TRIG_EXT_RISING);
+  LL_ADC_REG_SetOverrun(ADC3, LL_ADC_REG_OVR_DATA_OVERWRITTEN);
+  LL_ADC_REG_SetDataTransferMode(ADC3, LL_ADC_REG_DMA_TRANSFER_UNLIMITED);
+  LL_ADC_SetOverSamplingDiscont(ADC3, LL_ADC_OVS_REG_DISCONT);
+
+  LL_DMA_ConfigTransfer(REF_DMA, REF_STREAM,
+                        LL_DMA_DIRECTION_PERIPH_TO_MEMORY |
+                            LL_DMA_MODE_CIRCULAR | LL_DMA_PERIPH_NOINCREMENT |
+                            LL_DMA_MEMORY_INCREMENT | LL_DMA_PDATAALIGN_WORD |
+                            LL_DMA_MDATAALIGN_WORD | LL_DMA_PRIORITY_LOW);
+  LL_DMA_SetPeriphRequest(REF_DMA, REF_STREAM, LL_DMAMUX1_REQ_ADC3);
+  LL_DMA_SetPeriphAddress(REF_DMA, REF_STREAM, (uint32_t)&ADC3->DR);
+  LL_DMA_SetMemoryAddress(REF_DMA, REF_STREAM, (uint32_t)ref_buf);
+  ref_ready = 1;
+}
+
+// The regular group's settings only change with both groups idle, so the
+// temperature conversion in progress, if any, finishes first
+void CCD_Ref_Apply(void) {
+  if (!ref_ready) {
+    return;
+  }
+  LL_TIM_DisableCounter(TIM15);
+  if (LL_ADC_REG_IsConversionOngoing(ADC3)) {
+    LL_ADC_REG_StopConversion(ADC3);
+    while (LL_ADC_REG_IsStopConversionOngoing(ADC3)) {
+    }
+  }
+  while (LL_ADC_INJ_IsConversionOngoing(ADC3)) {
+  }
+  LL_DMA_DisableStream(REF_DMA, REF_STREAM);
+  while (LL_DMA_IsEnabledStream(REF_DMA, REF_STREAM)) {
+  }
+  ref_running = 0;
+  if (ref_mode == CCD_REF_OFF) {
+    return;
+  }
+
+  uint32_t icg_us = CCD_Acq_IcgTicks() / CCD_TICKS_PER_US;
+  uint32_t t_us = CCD_Acq_IntegrationUs();
+  uint32_t span_us = 2U * ((t_us > icg_us) ? t_us : icg_us);
+  uint32_t shift = 0;
+  while (shift < CCD_REF_SHIFT_MAX &&
+         (CCD_REF_SLOTS / 2U) * (REF_PERIOD_US << shift) < span_us) {
+    shift++;
+  }
+  ref_shift = (uint8_t)shift;
+  ref_result_us = REF_PERIOD_US << shift;
+  ref_result_cycles = (CCD_TIME_HZ / CCD_REF_RATE_HZ) << shift;
+  if (shift > 0) {
+    LL_ADC_ConfigOverSamplingRatioShift(ADC3, 1UL << shift,
+                                        LL_ADC_OVS_SHIFT_NONE);
+    LL_ADC_SetOverSamplingScope(ADC3, LL_ADC_OVS_GRP_REGULAR_CONTINUED);
+  } else {
+    LL_ADC_SetOverSamplingScope(ADC3, LL_ADC_OVS_DISABLE);
+  }
+
+  LL_DMA_ClearFlag_TC2(REF_DMA);
+  LL_DMA_ClearFlag_HT2(REF_DMA);
+  LL_DMA_ClearFlag_TE2(REF_DMA);
+  LL_DMA_ClearFlag_FE2(REF_DMA);
+  LL_DMA_ClearFlag_DME2(REF_DMA);
+  LL_DMA_SetDataLength(REF_DMA, REF_STREAM, CCD_REF_SLOTS);
+  LL_DMA_EnableStream(REF_DMA, REF_STREAM);
+  LL_ADC_ClearFlag_OVR(ADC3);
+  LL_ADC_REG_StartConversion(ADC3); // Waits for TIM15
+  LL_TIM_SetCounter(TIM15, 0);
+  ref_start = CCD_Time_Now();
+  LL_TIM_EnableCounter(TIM15);
+  ref_running = 1;
+}
+
+// The newest result completed about now, at the DMA's write position less
+// one; the frame's integration ended (now - timestamp) / result before it
+CCD_ITCM void CCD_Ref_Frame(const CCD_Frame_t *frame) {
+  if (!ref_running) {
+    return;
+  }
+  uint64_t now = CCD_Time_Now();
+  uint32_t w = CCD_REF_SLOTS - LL_DMA_GetDataLength(REF_DMA, REF_STREAM);
+  uint64_t end = frame->info.timestamp;
+  uint64_t ring = (uint64_t)CCD_REF_SLOTS * ref_result_cycles; // < 2^32
+  uint32_t written = (now - ref_start < ring)
+                         ? (uint32_t)(now - ref_start) / ref_result_cycles
+                         : CCD_REF_SLOTS;
+  uint32_t level = 0;
+  uint32_t n = frame->info.exposure_us / ref_result_us;
+  if (n == 0) {
+    n = 1;
+  }
+  if (end <= now && now - end < ring) {
+    uint32_t back = (uint32_t)(now - end) / ref_result_cycles;
+    if (back + n > written) {
+      n = (back < written) ? written - back : 0; // The newest part
+    }
+    if (n > 0) {
+      CCD_DCACHE_INVALIDATE(ref_buf, sizeof(ref_buf));
+      uint64_t sum = 0;
+      uint32_t i = w - 1U - back;
+      for (uint32_t k = 0; k < n; k++, i--) {
+        sum += ref_buf[i & (CCD_REF_SLOTS - 1U)];
+      }
+      level = (uint32_t)((sum << 4) >> ref_shift) / n; // Under 2^30
+    }
+  } else {
+    n = 0;
+  }
+  uint32_t seq = frame->info.seq;
+  uint32_t slot = seq & (CCD_REF_HIST - 1U);
+  ref_level[slot] = level;
+  ref_seq[slot] = seq;
+  ref_results = (uint16_t)n;
+  ref_newest = seq;
+  ref_frames++;
+}
+
+uint8_t CCD_Ref_Set(uint8_t mode, uint32_t target) {
+  if (mode > CCD_REF_NORMALIZE) {
+    return 0;
+  }
+  ref_target = target;
+  ref_mode = mode;
+  return 1;
+}
+
+void CCD_Ref_Get(uint8_t *mode, uint32_t *target) {
+  *mode = ref_mode;
+  *target = ref_target;
+}
+
+uint8_t CCD_Ref_Active(void) { return ref_mode == CCD_REF_NORMALIZE; }
+
+uint32_t CCD_Ref_Gain(uint32_t seq) {
+  uint32_t slot = seq & (CCD_REF_HIST - 1U);
+  uint32_t level = (ref_seq[slot] == seq) ? ref_level[slot] : 0;
+  if (level == 0) {
+    ref_unmatched++;
+    return 0;
+  }
+  if (ref_target == 0) {
+    ref_target = level; // Locked to this frame
+  }
+  uint64_t g = (((uint64_t)ref_target << 15) + level / 2U) / level;
+  return (g > 0xFFFFU) ? 0xFFFFU : (uint32_t)g;
+}
+
+void CCD_Ref_Status(CCD_RefStatus_t *out) {
+  uint32_t seq = ref_newest;
+  out->mode = ref_mode;
+  out->shift = ref_shift;
+  out->results = ref_results;
+  out->target = ref_target;
+  out->seq = seq;
+  out->frames = ref_frames;
+  out->unmatched = ref_unmatched;
+  for (uint32_t i = 0; i < CCD_REF_LEVELS; i++) {
+    uint32_t slot = (seq - i) & (CCD_REF_HIST - 1U);
+    out->level[i] = (ref_frames > i && ref_seq[slot] == seq - i)
+                        ? ref_level[slot]
+                        : 0;
+  }
+}
+
+#endif /* CCD_REF_PD */
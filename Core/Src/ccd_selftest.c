@@ -0,0 +1,369 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_selftest.c
+ * @brief          : Timer chain self-test: fM, ADC trigger, SH and ICG timed
+ ******************************************************************************
+ */
+
+#include "ccd_selftest.h"
+#include "ccd_acq.h"
+#include "ccd_bench.h"
+#include "ccd_time.h"
+#include "ccd_timing.h"
+#include "stm32h7xx_ll_tim.h"
+
+#define ST_SPAN_MAX 0x8000U // Capture counts per interval, at most
+#define ST_READ_TICKS 16U   // ICG: the counts and the cycles read apart
+
+// The capture timer and trigger input per channel, CCD_SELFTEST_ICG aside
+static const struct {
+  TIM_TypeDef *tim;
+  uint32_t ts;    // LL_TIM_TS_ITR*: the TRGO it captures
+  uint32_t icpsc; // LL_TIM_ICPSC_*
+  uint8_t edges;  // Periods per capture, for it
+} st_inputs[CCD_SELFTEST_ICG] = {
+    {TIM15, LL_TIM_TS_ITR1, LL_TIM_ICPSC_DIV8, CCD_SELFTEST_PRESCALE},
+    {TIM12, LL_TIM_TS_ITR0, LL_TIM_ICPSC_DIV8, CCD_SELFTEST_PRESCALE},
+    {TIM12, LL_TIM_TS_ITR1, LL_TIM_ICPSC_DIV1, 1},
+};
+
+static uint8_t st_state = CCD_SELFTEST_NONE;
+static uint8_t st_guard = 1;
+static uint32_t st_since; // HAL_GetTick() when due
+static uint32_t st_done;  // and when the last run ended
+static CCD_AcqPeriods_t st_exp;
+static uint8_t st_failed;
+static uint8_t st_tested;
+static uint32_t st_expected[CCD_SELFTEST_CHANNELS];
+static uint32_t st_measured[CCD_SELFTEST_CHANNELS];
+static uint32_t st_runs, st_passes, st_failures, st_fallbacks, st_retries;
+
+// The channel being timed
+static uint8_t st_ch;
+static uint32_t st_began;   // HAL_GetTick()
+static uint32_t st_timeout; // ms
+static uint8_t st_tries;    // Overcaptures, this channel
+static uint8_t st_n;        // Captures taken
+static uint16_t st_prev;
+static uint16_t st_iv[CCD_SELFTEST_PERIODS]; // Capture counts apart
+static uint32_t st_psc;
+static uint16_t st_icg_n;   // TIM1: ICG periods
+static uint32_t st_icg_cnt; // TIM2
+static uint64_t st_icg_cyc;
+
+// TRGO for the capture timers: TIM3/TIM4/TIM5 drive nothing else with it
+void CCD_Selftest_Init(void) {
+  LL_TIM_SetTriggerOutput(TIM3, LL_TIM_TRGO_OC1REF);
+  LL_TIM_SetTriggerOutput(TIM4, LL_TIM_TRGO_OC4REF);
+  LL_TIM_SetTriggerOutput(TIM5, LL_TIM_TRGO_OC3REF);
+  __HAL_RCC_TIM12_CLK_ENABLE();
+  __HAL_RCC_TIM12_FORCE_RESET();
+  __HAL_RCC_TIM12_RELEASE_RESET();
+#if !CCD_REF_PD
+  __HAL_RCC_TIM15_CLK_ENABLE();
+  __HAL_RCC_TIM15_FORCE_RESET();
+  __HAL_RCC_TIM15_RELEASE_RESET();
+#endif
+}
+
+void CCD_Selftest_Start(void) {
+  st_state = CCD_SELFTEST_DUE;
+  st_since = HAL_GetTick();
+}
+
+// As the supervisor has it: the periods are the profile's only then
+static uint8_t Selftest_FreeRunning(void) {
+  return (ccd_mode == CCD_MODE_FAST || ccd_mode == CCD_MODE_LONG) &&
+         (sync_mode == CCD_SYNC_OFF || sync_mode == CCD_SYNC_MASTER) &&
+         !mode_update_pending && !CCD_Bench_Running();
+}
+
+// Per period, from the capture resolution and CCD_SELFTEST_TOL_PPM
+static uint32_t Selftest_Tolerance(uint32_t expected, uint32_t res) {
+  return res + (uint32_t)((uint64_t)expected * CCD_SELFTEST_TOL_PPM /
+                          1000000U);
+}
+
+static void Selftest_Result(uint32_t measured, uint32_t tol) {
+  uint32_t e = st_expected[st_ch];
+  uint32_t d = (measured > e) ? measured - e : e - measured;
+  st_measured[st_ch] = measured;
+  st_tested |= (uint8_t)(1U << st_ch);
+  if (measured == 0 || d > tol) {
+    st_failed |= (uint8_t)(1U << st_ch);
+  }
+}
+
+static void Capture_Stop(void) {
+  TIM_TypeDef *t = st_inputs[st_ch].tim;
+  LL_TIM_DisableCounter(t);
+  LL_TIM_CC_DisableChannel(t, LL_TIM_CHANNEL_CH1);
+}
+
+static void Capture_Begin(void) {
+  TIM_TypeDef *t = st_inputs[st_ch].tim;
+  uint64_t span = (uint64_t)st_inputs[st_ch].edges * st_expected[st_ch];
+  st_psc = (uint32_t)(span / ST_SPAN_MAX);
+  if (st_psc > 0xFFFFU) {
+    st_psc = 0xFFFFU;
+  }
+  LL_TIM_DisableCounter(t);
+  LL_TIM_CC_DisableChannel(t, LL_TIM_CHANNEL_CH1);
+  LL_TIM_SetTriggerInput(t, st_inputs[st_ch].ts);
+  LL_TIM_IC_SetActiveInput(t, LL_TIM_CHANNEL_CH1, LL_TIM_ACTIVEINPUT_TRC);
+  LL_TIM_IC_SetPrescaler(t, LL_TIM_CHANNEL_CH1, st_inputs[st_ch].icpsc);
+  LL_TIM_IC_SetPolarity(t, LL_TIM_CHANNEL_CH1, LL_TIM_IC_POLARITY_RISING);
+  LL_TIM_SetPrescaler(t, st_psc);
+  LL_TIM_SetAutoReload(t, 0xFFFFU);
+  LL_TIM_GenerateEvent_UPDATE(t); // Loads the prescaler
+  LL_TIM_ClearFlag_UPDATE(t);
+  LL_TIM_CC_EnableChannel(t, LL_TIM_CHANNEL_CH1);
+  LL_TIM_ClearFlag_CC1(t);
+  LL_TIM_ClearFlag_CC1OVR(t);
+  st_n = 0;
+  LL_TIM_EnableCounter(t);
+}
+
+// fM and the ADC trigger restart with every ICG, which may cut the period
+// a capture spans: the median is taken. SH is cut in most ICG periods, so
+// the longest.
+static void Capture_Evaluate(void) {
+  uint16_t s[CCD_SELFTEST_PERIODS];
+  for (uint32_t i = 0; i < CCD_SELFTEST_PERIODS; i++) {
+    uint32_t j = i;
+    for (; j > 0 && s[j - 1U] > st_iv[i]; j--) {
+      s[j] = s[j - 1U];
+    }
+    s[j] = st_iv[i];
+  }
+  uint32_t k = (st_ch == CCD_SELFTEST_SH) ? CCD_SELFTEST_PERIODS - 1U
+                                          : CCD_SELFTEST_PERIODS / 2U;
+  uint32_t edges = st_inputs[st_ch].edges;
+  uint32_t res = (2U * (st_psc + 1U) + edges - 1U) / edges;
+  uint32_t m = (s[k] * (st_psc + 1U) + edges / 2U) / edges;
+  Selftest_Result(m, Selftest_Tolerance(st_expected[st_ch], res));
+}
+
+// The profile's periods, SH never longer than the ICG that cuts it
+static void Selftest_Periods(CCD_AcqPeriods_t *p) {
+  CCD_Acq_Periods(p);
+  if (p->sh > p->icg) {
+    p->sh = p->icg;
+  }
+}
+
+// AE sets the SH period without a restart: one that moved while it was
+// timed is timed again at the new one, as a retry
+static uint8_t Capture_ShMoved(void) {
+  CCD_AcqPeriods_t p;
+  Selftest_Periods(&p);
+  if (p.sh == st_expected[CCD_SELFTEST_SH]) {
+    return 0;
+  }
+  st_retries++;
+  st_exp.sh = p.sh;
+  st_expected[CCD_SELFTEST_SH] = p.sh;
+  return 1;
+}
+
+// 1 = done. A capture that came while the last was unread is lost, and
+// with it the count of edges between: the channel starts again.
+static uint8_t Capture_Step(void) {
+  TIM_TypeDef *t = st_inputs[st_ch].tim;
+  uint64_t span = (uint64_t)st_inputs[st_ch].edges * st_expected[st_ch];
+  uint8_t spin = span * (CCD_SELFTEST_PERIODS + 1U) <=
+                 (uint64_t)CCD_SELFTEST_SPIN_US * CCD_TICKS_PER_US;
+  uint64_t until =
+      CCD_Time_Now() + (uint64_t)(CCD_TIME_HZ / 1000000U) *
+                           CCD_SELFTEST_SPIN_US;
+  do {
+    if (LL_TIM_IsActiveFlag_CC1OVR(t)) {
+      LL_TIM_ClearFlag_CC1OVR(t);
+      LL_TIM_ClearFlag_CC1(t);
+      st_retries++;
+      if (++st_tries > CCD_SELFTEST_RETRIES) {
+        Capture_Stop(); // Untested: the loop never kept up
+        return 1;
+      }
+      st_n = 0;
+    } else if (LL_TIM_IsActiveFlag_CC1(t)) {
+      uint16_t cap = (uint16_t)LL_TIM_IC_GetCaptureCH1(t); // Clears CC1IF
+      if (st_n > 0) {
+        st_iv[st_n - 1U] = (uint16_t)(cap - st_prev);
+      }
+      st_prev = cap;
+      if (++st_n > CCD_SELFTEST_PERIODS) {
+        Capture_Stop();
+        if (st_ch == CCD_SELFTEST_SH && Capture_ShMoved()) {
+          if (st_expected[st_ch] == 0 || ++st_tries > CCD_SELFTEST_RETRIES) {
+            return 1; // Untested
+          }
+          Capture_Begin();
+          return 0;
+        }
+        Capture_Evaluate();
+        return 1;
+      }
+    }
+  } while (spin && CCD_Time_Now() < until);
+  if (HAL_GetTick() - st_began > st_timeout) {
+    Capture_Stop();
+    Selftest_Result(0, 0); // No edges: stopped, or never started
+    return 1;
+  }
+  return 0;
+}
+
+// TIM1's ICG count and TIM2's, read together: re-read if TIM2 wrapped
+// between them
+static void Icg_Read(uint16_t *n, uint32_t *cnt, uint64_t *cyc) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t c;
+  do {
+    c = LL_TIM_GetCounter(TIM2);
+    *n = (uint16_t)LL_TIM_GetCounter(TIM1);
+  } while (LL_TIM_GetCounter(TIM2) < c);
+  *cyc = CCD_Time_Now();
+  __set_PRIMASK(primask);
+  *cnt = c;
+}
+
+static uint8_t Icg_Step(void) {
+  uint16_t n;
+  uint32_t cnt;
+  uint64_t cyc;
+  Icg_Read(&n, &cnt, &cyc);
+  uint16_t dn = (uint16_t)(n - st_icg_n);
+  if (dn < CCD_SELFTEST_ICG_PERIODS) {
+    if (HAL_GetTick() - st_began > st_timeout) {
+      Selftest_Result(0, 0);
+      return 1;
+    }
+    return 0;
+  }
+  int64_t ticks = (int64_t)((cyc - st_icg_cyc) / CCD_TIME_PER_TICK);
+  ticks -= (int64_t)cnt - (int64_t)st_icg_cnt;
+  uint32_t period = (ticks > 0) ? (uint32_t)((ticks + dn / 2) / dn) : 0;
+  Selftest_Result(period,
+                  Selftest_Tolerance(st_expected[st_ch], ST_READ_TICKS));
+  return 1;
+}
+
+// 1 = nothing to time on this channel
+static uint8_t Selftest_Begin(void) {
+  const uint32_t e[CCD_SELFTEST_CHANNELS] = {st_exp.fm, st_exp.adc,
+                                             st_exp.sh, st_exp.icg};
+  st_expected[st_ch] = e[st_ch];
+  st_measured[st_ch] = 0;
+  st_tries = 0;
+  st_began = HAL_GetTick();
+#if CCD_REF_PD
+  if (st_ch == CCD_SELFTEST_FM) {
+    return 1; // TIM15 converts for the reference photodiode
+  }
+#endif
+  if (e[st_ch] == 0) {
+    return 1; // SH not settled on one period
+  }
+  uint32_t periods = (st_ch == CCD_SELFTEST_ICG)
+                         ? CCD_SELFTEST_ICG_PERIODS
+                         : st_inputs[st_ch].edges * (CCD_SELFTEST_PERIODS + 1U);
+  st_timeout = CCD_SELFTEST_TIMEOUT_MS +
+               (uint32_t)((uint64_t)periods * e[st_ch] /
+                          (CCD_TIM_CLK_HZ / 1000U));
+  if (st_ch == CCD_SELFTEST_ICG) {
+    Icg_Read(&st_icg_n, &st_icg_cnt, &st_icg_cyc);
+  } else {
+    Capture_Begin();
+  }
+  return 0;
+}
+
+// Through the channels in turn, then the verdict. The guard needs the
+// restart it asks for, which starts the test again on "O0".
+static void Selftest_Finish(void) {
+  st_runs++;
+  st_done = HAL_GetTick();
+  if (st_failed == 0) {
+    st_passes++;
+    st_state = CCD_SELFTEST_PASS;
+    return;
+  }
+  st_failures++;
+  st_state = CCD_SELFTEST_FAIL;
+  if (st_guard && acq_noise_profile != 0) {
+    acq_noise_profile = 0;
+    mode_update_pending = 1;
+    st_fallbacks++;
+  }
+}
+
+void CCD_Selftest_Poll(void) {
+  if (st_state != CCD_SELFTEST_DUE && st_state != CCD_SELFTEST_RUN) {
+    return;
+  }
+  if (!Selftest_FreeRunning()) {
+    if (st_state == CCD_SELFTEST_RUN && st_ch != CCD_SELFTEST_ICG) {
+      Capture_Stop();
+    }
+    CCD_Selftest_Start(); // Again, once it settles
+    return;
+  }
+  if (st_state == CCD_SELFTEST_DUE) {
+    if (HAL_GetTick() - st_since < CCD_SELFTEST_SETTLE_MS) {
+      return;
+    }
+    Selftest_Periods(&st_exp);
+    st_failed = 0;
+    st_tested = 0;
+    st_ch = 0;
+    st_state = CCD_SELFTEST_RUN;
+    if (!Selftest_Begin()) {
+      return;
+    }
+  } else {
+    uint8_t done = (st_ch == CCD_SELFTEST_ICG) ? Icg_Step() : Capture_Step();
+    if (!done) {
+      return;
+    }
+  }
+  // Next channel with something to time
+  while (++st_ch < CCD_SELFTEST_CHANNELS) {
+    if (!Selftest_Begin()) {
+      return;
+    }
+  }
+  Selftest_Finish();
+}
+
+uint8_t CCD_Selftest_Set(uint8_t op) {
+  if (op == CCD_SELFTEST_GUARD_OFF || op == CCD_SELFTEST_GUARD_ON) {
+    st_guard = (op == CCD_SELFTEST_GUARD_ON);
+  } else if (op == CCD_SELFTEST_AGAIN) {
+    if (st_state == CCD_SELFTEST_RUN && st_ch != CCD_SELFTEST_ICG) {
+      Capture_Stop();
+    }
+    CCD_Selftest_Start();
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+void CCD_Selftest_Status(CCD_SelftestStatus_t *out) {
+  out->state = st_state;
+  out->failed = st_failed;
+  out->tested = st_tested;
+  out->guard = st_guard;
+  out->runs = st_runs;
+  out->passes = st_passes;
+  out->failures = st_failures;
+  out->fallbacks = st_fallbacks;
+  out->retries = st_retries;
+  for (uint32_t i = 0; i < CCD_SELFTEST_CHANNELS; i++) {
+    out->expected[i] = st_expected[i];
+    out->measured[i] = st_measured[i];
+  }
+  out->age_ms = (st_runs > 0) ? HAL_GetTick() - st_done : 0;
+}
@@ -0,0 +1,215 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_seq.c
+ * @brief          : Exposure / readout sequence engine (kinetic series)
+ ******************************************************************************
+ */
+
+#include "ccd_seq.h"
+#include "ccd_acq.h"
+#include "ccd_ae.h"
+#include "ccd_proc.h"
+#include "usb_tx.h"
+
+_Static_assert(CCD_SEQ_STEPS <= 255, "step indices are 8-bit");
+
+// Table, written by the commands only while idle
+static CCD_SeqStep_t seq_table[CCD_SEQ_STEPS];
+static volatile uint8_t seq_steps;
+static volatile uint16_t seq_repeats = 1;
+
+static volatile uint8_t seq_state = CCD_SEQ_IDLE;
+static volatile uint8_t seq_start_request;
+static volatile uint8_t seq_stop_request;
+static volatile uint8_t seq_triggered;
+
+// Run state, main loop only
+static uint8_t seq_step;
+static uint16_t seq_pass;
+static uint16_t seq_outputs; // Frames sent in this step
+static uint32_t seq_gap;     // ICG periods skipped after each output
+static uint32_t seq_skip;    // Of which still to skip
+static uint16_t seq_from;    // First frame_num that may belong to the step
+static uint16_t seq_frame;
+
+static volatile uint8_t seq_status_request;
+static volatile uint8_t seq_status_busy;
+static CCD_SeqStatus_t seq_status; // Read by the USB engine while queued
+
+static uint8_t Seq_Busy(void) {
+  uint8_t s = seq_state;
+  return s != CCD_SEQ_IDLE && s != CCD_SEQ_DONE && s != CCD_SEQ_ERROR;
+}
+
+// ========== COMMANDS ==========
+
+uint8_t CCD_Seq_SetStep(uint8_t index, const CCD_SeqStep_t *step) {
+  if (index >= CCD_SEQ_STEPS || step->outputs == 0 || step->coadd == 0 ||
+      step->coadd > CCD_PROC_COADD_MAX ||
+      step->delay_ms > CCD_SEQ_DELAY_MAX_MS || Seq_Busy()) {
+    return 0;
+  }
+  seq_table[index] = *step;
+  return 1;
+}
+
+uint8_t CCD_Seq_SetLength(uint8_t steps) {
+  if (steps > CCD_SEQ_STEPS || Seq_Busy()) {
+    return 0;
+  }
+  seq_steps = steps;
+  return 1;
+}
+
+void CCD_Seq_SetRepeats(uint16_t repeats) { seq_repeats = repeats; }
+
+uint8_t CCD_Seq_Start(void) {
+  if (seq_steps == 0 || Seq_Busy()) {
+    return 0;
+  }
+  seq_start_request = 1;
+  return 1;
+}
+
+void CCD_Seq_Stop(void) { seq_stop_request = 1; }
+
+void CCD_Seq_Trigger(void) { seq_triggered = 1; }
+
+void CCD_Seq_RequestStatus(void) { seq_status_request = 1; }
+
+CCD_ITCM void CCD_Seq_PinIRQ(void) {
+  if (seq_state == CCD_SEQ_TRIGGER) {
+    seq_triggered = 1;
+  }
+}
+
+// ========== ENGINE ==========
+
+static void Seq_Report(void) { seq_status_request = 1; }
+
+static void Seq_Finish(uint8_t state) {
+  seq_state = state;
+  proc_coadd_n = 1;
+  Seq_Report();
+}
+
+static void Seq_EnterStep(uint8_t index) {
+  const CCD_SeqStep_t *st = &seq_table[index];
+  seq_step = index;
+  seq_outputs = 0;
+  seq_skip = 0;
+  uint32_t icg_us = CCD_Acq_IcgTicks() / CCD_TICKS_PER_US;
+  seq_gap = (st->delay_ms * 1000U + icg_us - 1U) / icg_us;
+  if (!CCD_Acq_SetIntegration(st->t_us)) {
+    Seq_Finish(CCD_SEQ_ERROR);
+    return;
+  }
+  proc_coadd_n = st->coadd; // A new N restarts the sum
+  seq_from = CCD_Acq_FrameCount();
+  seq_frame = seq_from;
+  seq_triggered = 0;
+  seq_state = st->trigger ? CCD_SEQ_TRIGGER : CCD_SEQ_SETTLE;
+  Seq_Report();
+}
+
+static void Seq_NextStep(void) {
+  uint8_t next = seq_step + 1U;
+  if (next >= seq_steps) {
+    next = 0;
+    seq_pass++;
+    if (seq_repeats != 0 && seq_pass >= seq_repeats) {
+      Seq_Finish(CCD_SEQ_DONE);
+      return;
+    }
+  }
+  Seq_EnterStep(next);
+}
+
+static void Seq_StatusSent(void *ctx, uint32_t len) { seq_status_busy = 0; }
+
+void CCD_Seq_Poll(void) {
+  if (seq_stop_request) {
+    seq_stop_request = 0;
+    seq_start_request = 0;
+    if (Seq_Busy()) {
+      Seq_Finish(CCD_SEQ_DONE);
+    }
+  }
+  if (seq_start_request) {
+    seq_start_request = 0;
+    if (CCD_Acq_BracketCount() != 0) {
+      Seq_Finish(CCD_SEQ_ERROR);
+    } else {
+      CCD_AE_Enable(0); // The steps own the integration time
+      seq_pass = 0;
+      seq_step = 0;
+      if (ccd_mode != CCD_MODE_FAST) {
+        ccd_mode = CCD_MODE_FAST;
+        mode_update_pending = 1;
+      }
+      seq_state = CCD_SEQ_STARTING;
+    }
+  }
+
+  if (seq_state == CCD_SEQ_STARTING && !mode_update_pending) {
+    Seq_EnterStep(0);
+  }
+  if (seq_state == CCD_SEQ_TRIGGER && seq_triggered) {
+    // Skip a readout still in progress and the frame integrating across the
+    // trigger
+    seq_from = (uint16_t)(CCD_Acq_FrameCount() + 2U);
+    seq_frame = seq_from;
+    seq_state = CCD_SEQ_SETTLE;
+  }
+  if (Seq_Busy() && ccd_mode != CCD_MODE_FAST && !mode_update_pending) {
+    Seq_Finish(CCD_SEQ_DONE); // Mode changed under the sequence
+  }
+
+  if (seq_status_request && !seq_status_busy && UsbTx_Space(&usb_tx_fs) > 0) {
+    seq_status_request = 0;
+    seq_status.magic = CCD_SEQ_MAGIC;
+    seq_status.state = seq_state;
+    seq_status.step = seq_step;
+    seq_status.steps = seq_steps;
+    seq_status.reserved = 0;
+    seq_status.pass = seq_pass;
+    seq_status.repeats = seq_repeats;
+    seq_status.outputs = seq_outputs;
+    seq_status.frame_num = seq_frame;
+    seq_status_busy = 1;
+    UsbTx_Submit(&usb_tx_fs, (const uint8_t *)&seq_status,
+                 sizeof(seq_status), Seq_StatusSent, NULL);
+  }
+}
+
+uint8_t CCD_Seq_Running(void) {
+  return seq_state >= CCD_SEQ_TRIGGER && seq_state <= CCD_SEQ_RUN;
+}
+
+uint8_t CCD_Seq_Frame(const CCD_Frame_t *frame) {
+  if (seq_state == CCD_SEQ_SETTLE &&
+      (int16_t)(frame->frame_num - seq_from) >= 0 &&
+      CCD_Acq_ExposureSettled(frame->frame_num)) {
+    seq_state = CCD_SEQ_RUN;
+  }
+  if (seq_state != CCD_SEQ_RUN) {
+    return 0;
+  }
+  if (seq_skip > 0) {
+    seq_skip--;
+    return 0;
+  }
+  return 1;
+}
+
+void CCD_Seq_Output(const CCD_Frame_t *frame) {
+  if (seq_state != CCD_SEQ_RUN) {
+    return;
+  }
+  seq_frame = frame->frame_num;
+  if (++seq_outputs >= seq_table[seq_step].outputs) {
+    Seq_NextStep();
+  } else {
+    seq_skip = seq_gap;
+  }
+}
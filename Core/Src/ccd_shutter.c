@@ -0,0 +1,165 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_shutter.c
+ * @brief          : External shutter and a live dark from closed frames
+ ******************************************************************************
+ */
+
+#include "ccd_shutter.h"
+
+#if CCD_SHUTTER
+
+#include "ccd_proc.h"
+#include "ccd_temp.h"
+
+_Static_assert((CCD_SHUTTER_HIST & (CCD_SHUTTER_HIST - 1U)) == 0,
+               "the history indexes by mask");
+
+// Settings
+static uint16_t shut_every = 600;
+static uint8_t shut_settle = 2;
+static uint8_t shut_darks = 1;
+static uint8_t shut_shift = 2;
+
+// Schedule, at each handoff
+static volatile uint8_t shut_state = CCD_SHUTTER_IDLE;
+static volatile uint8_t shut_again;
+static uint32_t shut_count; // Frames into the state
+static uint8_t shut_kind[CCD_SHUTTER_HIST];
+static uint32_t shut_seq[CCD_SHUTTER_HIST];
+static volatile uint32_t shut_cycles;
+
+// Main loop
+static uint32_t shut_folded;
+static uint32_t shut_dropped;
+static uint32_t shut_last;
+static int16_t shut_temp = CCD_TEMP_NONE;
+
+static void Shutter_Drive(uint8_t closed) {
+  HAL_GPIO_WritePin(CCD_SHUTTER_GPIO_Port, CCD_SHUTTER_Pin,
+                    closed ? GPIO_PIN_SET : GPIO_PIN_RESET);
+}
+
+void CCD_Shutter_Init(void) {
+  GPIO_InitTypeDef gpio = {0};
+  __HAL_RCC_GPIOE_CLK_ENABLE();
+  Shutter_Drive(0);
+  gpio.Pin = CCD_SHUTTER_Pin;
+  gpio.Mode = GPIO_MODE_OUTPUT_PP;
+  gpio.Pull = GPIO_NOPULL;
+  gpio.Speed = GPIO_SPEED_FREQ_LOW;
+  HAL_GPIO_Init(CCD_SHUTTER_GPIO_Port, &gpio);
+}
+
+uint8_t CCD_Shutter_Set(uint8_t op, uint16_t every, uint8_t settle,
+                        uint8_t darks, uint8_t shift) {
+  if (op == CCD_SHUTTER_ON &&
+      (every < CCD_SHUTTER_EVERY_MIN || settle == 0 ||
+       settle > CCD_SHUTTER_SETTLE_MAX || darks == 0 ||
+       darks > CCD_SHUTTER_DARKS_MAX || shift > CCD_SHUTTER_SHIFT_MAX)) {
+    return 0;
+  }
+  if (op == CCD_SHUTTER_AGAIN) {
+    shut_again = (shut_state != CCD_SHUTTER_IDLE);
+    return shut_again;
+  }
+  if (op != CCD_SHUTTER_ON && op != CCD_SHUTTER_OFF) {
+    return 0;
+  }
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  Shutter_Drive(0);
+  shut_again = 0;
+  shut_count = 0;
+  shut_state = (op == CCD_SHUTTER_ON) ? CCD_SHUTTER_OPEN : CCD_SHUTTER_IDLE;
+  if (op == CCD_SHUTTER_ON) {
+    shut_every = every;
+    shut_settle = settle;
+    shut_darks = darks;
+    shut_shift = shift;
+  }
+  __set_PRIMASK(primask);
+  return 1;
+}
+
+uint8_t CCD_Shutter_Active(void) { return shut_state != CCD_SHUTTER_IDLE; }
+
+// One step per frame handed off. The frame that ends a state was taken in
+// it: the last light one before the closing, the last dark one before the
+// opening.
+static uint8_t Shutter_Step(void) {
+  switch (shut_state) {
+  case CCD_SHUTTER_OPEN:
+    if (shut_again || ++shut_count >= shut_every) {
+      shut_again = 0;
+      Shutter_Drive(1);
+      shut_cycles++;
+      shut_count = 0;
+      shut_state = CCD_SHUTTER_CLOSING;
+    }
+    return CCD_SHUTTER_LIGHT;
+  case CCD_SHUTTER_CLOSING:
+    if (++shut_count >= shut_settle) {
+      shut_count = 0;
+      shut_state = CCD_SHUTTER_DARK;
+    }
+    return CCD_SHUTTER_MOVING;
+  case CCD_SHUTTER_DARK:
+    if (++shut_count >= shut_darks) {
+      Shutter_Drive(0);
+      shut_count = 0;
+      shut_state = CCD_SHUTTER_OPENING;
+    }
+    return CCD_SHUTTER_CLOSED;
+  case CCD_SHUTTER_OPENING:
+    if (++shut_count >= shut_settle) {
+      shut_count = 0;
+      shut_state = CCD_SHUTTER_OPEN;
+    }
+    return CCD_SHUTTER_MOVING;
+  default:
+    return CCD_SHUTTER_LIGHT;
+  }
+}
+
+CCD_ITCM void CCD_Shutter_Frame(const CCD_Frame_t *frame) {
+  uint32_t slot = frame->info.seq & (CCD_SHUTTER_HIST - 1U);
+  shut_kind[slot] = Shutter_Step();
+  shut_seq[slot] = frame->info.seq;
+}
+
+uint8_t CCD_Shutter_Kind(uint32_t seq) {
+  uint32_t slot = seq & (CCD_SHUTTER_HIST - 1U);
+  return (shut_seq[slot] == seq) ? shut_kind[slot] : CCD_SHUTTER_LIGHT;
+}
+
+CCD_Frame_t *CCD_Shutter_Dark(CCD_Frame_t *frame, uint32_t *len) {
+  if (CCD_Proc_LiveDark(frame, shut_shift)) {
+    shut_folded++;
+    shut_last = frame->info.seq;
+    shut_temp = frame->info.die_temp;
+  }
+  frame->magic = CCD_SHUTTER_MAGIC;
+  *len = sizeof(CCD_Frame_t);
+  return frame;
+}
+
+void CCD_Shutter_Drop(void) { shut_dropped++; }
+
+void CCD_Shutter_Status(CCD_ShutterStatus_t *out) {
+  out->state = shut_state;
+  out->settle = shut_settle;
+  out->darks = shut_darks;
+  out->shift = shut_shift;
+  out->every = shut_every;
+  out->closed =
+      HAL_GPIO_ReadPin(CCD_SHUTTER_GPIO_Port, CCD_SHUTTER_Pin) == GPIO_PIN_SET;
+  out->estimate = CCD_Proc_LiveDarkValid();
+  out->temp = shut_temp;
+  out->cycles = shut_cycles;
+  out->dark_frames = shut_folded;
+  out->dropped = shut_dropped;
+  out->seq = shut_last;
+}
+
+#endif /* CCD_SHUTTER */
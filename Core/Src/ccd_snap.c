@@ -0,0 +1,123 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_snap.c
+ * @brief          : Event-driven single shots (mode 1)
+ ******************************************************************************
+ */
+
+#include "ccd_snap.h"
+#include "ccd_acq.h"
+#include "ccd_time.h"
+#include "usb_tx.h"
+
+CCD_DTCM_BSS static volatile uint8_t snap_pin;     // Pin trigger enabled
+CCD_DTCM_BSS static volatile uint8_t snap_waiting; // Frame not yet queued
+CCD_DTCM_BSS static volatile uint64_t snap_time; // CCD_Time_Now() at the snap
+CCD_DTCM_BSS static volatile uint16_t snap_count;
+CCD_DTCM_BSS static volatile uint16_t snap_missed;
+static volatile uint32_t expose_ms; // Last long exposure asked for
+static volatile uint16_t expose_count;
+static volatile uint16_t expose_aborted;
+
+static volatile uint8_t report_request;
+static volatile uint8_t report_busy;
+static CCD_SnapReport_t report; // Read by the USB engine while queued
+
+// ========== COMMANDS ==========
+
+// USB RX (priority 0) can preempt the pin interrupt, so the chain is
+// started and the time taken with both masked.
+CCD_ITCM void CCD_Snap_Fire(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint64_t now = CCD_Time_Now();
+  if (CCD_Acq_Snap()) {
+    snap_time = now;
+    snap_waiting = 1;
+    snap_count++;
+  } else {
+    snap_missed++;
+  }
+  __set_PRIMASK(primask);
+}
+
+CCD_ITCM void CCD_Snap_Expose(uint32_t t_ms) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint64_t now = CCD_Time_Now();
+  if (CCD_Acq_Expose(t_ms)) {
+    snap_time = now;
+    snap_waiting = 1;
+    snap_count++;
+    expose_ms = t_ms;
+    expose_count++;
+  } else {
+    snap_missed++;
+  }
+  __set_PRIMASK(primask);
+}
+
+uint8_t CCD_Snap_Abort(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint8_t aborted = CCD_Acq_ExposeAbort();
+  if (aborted) {
+    snap_waiting = 0;
+    expose_aborted++;
+  }
+  __set_PRIMASK(primask);
+  return aborted;
+}
+
+void CCD_Snap_ExposeStatus(CCD_ExposeStatus_t *out) {
+  uint32_t elapsed;
+  uint8_t state = CCD_Acq_SnapState(&elapsed);
+  out->state = CCD_EXPOSE_IDLE;
+  if (state == CCD_ACQ_SNAP_ARM || state == CCD_ACQ_SNAP_EXPOSE) {
+    out->state = CCD_EXPOSE_RUNNING;
+  } else if (state == CCD_ACQ_SNAP_FLUSH || state == CCD_ACQ_SNAP_READ) {
+    out->state = CCD_EXPOSE_READING;
+  }
+  out->reserved[0] = out->reserved[1] = out->reserved[2] = 0;
+  out->t_ms = expose_ms;
+  out->elapsed_ms = elapsed;
+  out->exposures = expose_count;
+  out->aborted = expose_aborted;
+}
+
+void CCD_Snap_SetPinTrigger(uint8_t enable) { snap_pin = enable; }
+
+CCD_ITCM void CCD_Snap_PinIRQ(void) {
+  if (snap_pin && ccd_mode == CCD_MODE_ONESHOT) {
+    CCD_Snap_Fire();
+  }
+}
+
+// ========== REPORT ==========
+
+void CCD_Snap_Sent(const CCD_Frame_t *frame) {
+  if (!snap_waiting || report_request || report_busy) {
+    return; // Only the frame of the last snap is timed
+  }
+  uint64_t cycles = CCD_Time_Now() - snap_time;
+  snap_waiting = 0;
+  report.magic = CCD_SNAP_MAGIC;
+  report.frame_num = frame->frame_num;
+  report.latency_us = (uint32_t)(cycles / (CCD_TIME_HZ / 1000000U));
+  report.t_us = frame->info.exposure_us;
+  report.snaps = snap_count;
+  report.missed = snap_missed;
+  report_request = 1;
+}
+
+static void Snap_ReportSent(void *ctx, uint32_t len) { report_busy = 0; }
+
+// Queued behind the frame it describes
+void CCD_Snap_Poll(void) {
+  if (report_request && UsbTx_Space(&usb_tx_fs) > 0) {
+    report_request = 0;
+    report_busy = 1;
+    UsbTx_Submit(&usb_tx_fs, (const uint8_t *)&report, sizeof(report),
+                 Snap_ReportSent, NULL);
+  }
+}
@@ -0,0 +1,226 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_store.c
+ * @brief          : Calibration tables persisted in internal flash
+ ******************************************************************************
+ */
+
+#include "ccd_store.h"
+#include <string.h>
+
+#define STORE_MAGIC 0x53444343U // "CCDS"
+#define STORE_WORD 32U          // Flash programming unit (256 bits)
+#define STORE_SECTOR_SIZE 0x20000U
+#define STORE_BLANK 0xFFFFFFFFU // Erased flash
+
+_Static_assert(CCD_STORE_COUNT <= CCD_STORE_SECTORS,
+               "every table needs its own flash sector");
+
+typedef struct {
+  uint32_t magic;
+  uint32_t id;
+  uint32_t len;
+  uint32_t checksum;
+  uint32_t reserved[4]; // Pads the header to one flash word
+} Store_Header_t;
+
+_Static_assert(sizeof(Store_Header_t) == STORE_WORD,
+               "header must be one flash word");
+
+// Within its bank
+static uint32_t Store_Sector(CCD_Store_Id_t id) {
+  return FLASH_SECTOR_7 - (uint32_t)id % 8U;
+}
+
+static uint32_t Store_Bank(CCD_Store_Id_t id) {
+  return ((uint32_t)id < 8U) ? FLASH_BANK_2 : FLASH_BANK_1;
+}
+
+static const uint8_t *Store_Addr(CCD_Store_Id_t id) {
+  uint32_t base = ((uint32_t)id < 8U) ? FLASH_BANK2_BASE : FLASH_BANK1_BASE;
+  return (const uint8_t *)(base + Store_Sector(id) * STORE_SECTOR_SIZE);
+}
+
+// Cheap integrity check against partial writes and stale layouts (not
+// cryptographic)
+static uint32_t Store_Checksum(const uint8_t *data, uint32_t len) {
+  uint32_t a = 1, b = 0;
+  for (uint32_t i = 0; i < len; i++) {
+    a = (a + data[i]) % 65521U;
+    b = (b + a) % 65521U;
+  }
+  return (b << 16) | a;
+}
+
+uint8_t CCD_Store_Load(CCD_Store_Id_t id, void *data, uint32_t len) {
+  const uint8_t *base = Store_Addr(id);
+  Store_Header_t hdr;
+  memcpy(&hdr, base, sizeof(hdr));
+  if (hdr.magic != STORE_MAGIC || hdr.id != (uint32_t)id || hdr.len != len ||
+      len > CCD_STORE_MAX_LEN) {
+    return 0;
+  }
+  if (Store_Checksum(base + STORE_WORD, len) != hdr.checksum) {
+    return 0;
+  }
+  memcpy(data, base + STORE_WORD, len);
+  return 1;
+}
+
+static uint8_t Store_EraseSector(CCD_Store_Id_t id) {
+  FLASH_EraseInitTypeDef erase = {0};
+  erase.TypeErase = FLASH_TYPEERASE_SECTORS;
+  erase.Banks = Store_Bank(id);
+  erase.Sector = Store_Sector(id);
+  erase.NbSectors = 1;
+  erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+  uint32_t bad_sector;
+  return HAL_FLASHEx_Erase(&erase, &bad_sector) == HAL_OK;
+}
+
+// Program len bytes at addr (flash-word aligned, erased), the last word
+// padded with 0xFF
+static uint8_t Store_ProgramData(uint32_t addr, const uint8_t *data,
+                                 uint32_t len) {
+  __attribute__((aligned(4))) uint8_t word[STORE_WORD];
+  for (uint32_t off = 0; off < len; off += STORE_WORD) {
+    uint32_t n = (len - off < STORE_WORD) ? (len - off) : STORE_WORD;
+    memset(word, 0xFF, sizeof(word));
+    memcpy(word, data + off, n);
+    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, addr + off,
+                          (uint32_t)word) != HAL_OK) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Erase the sector and program data first, header last, so a record
+// interrupted by a reset stays invalid
+static uint8_t Store_Program(CCD_Store_Id_t id, const Store_Header_t *hdr,
+                             const uint8_t *data) {
+  if (!Store_EraseSector(id)) {
+    return 0;
+  }
+  uint32_t addr = (uint32_t)Store_Addr(id);
+  if (!Store_ProgramData(addr + STORE_WORD, data, hdr->len)) {
+    return 0;
+  }
+  return HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, addr, (uint32_t)hdr) ==
+         HAL_OK;
+}
+
+static void Store_Header(Store_Header_t *hdr, CCD_Store_Id_t id,
+                         const void *data, uint32_t len) {
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic = STORE_MAGIC;
+  hdr->id = (uint32_t)id;
+  hdr->len = len;
+  hdr->checksum = Store_Checksum(data, len);
+}
+
+uint8_t CCD_Store_Save(CCD_Store_Id_t id, const void *data, uint32_t len) {
+  if (len > CCD_STORE_MAX_LEN) {
+    return 0;
+  }
+
+  Store_Header_t hdr;
+  Store_Header(&hdr, id, data, len);
+
+  HAL_FLASH_Unlock();
+  uint8_t ok = Store_Program(id, &hdr, data);
+  HAL_FLASH_Lock();
+
+  // Drop any lines cached from the old record before it is read back
+  CCD_DCACHE_INVALIDATE(Store_Addr(id), STORE_WORD + len);
+  return ok;
+}
+
+// ========== LOG SECTORS ==========
+
+// Flash words a log record takes, header included
+static uint32_t Store_RecordSize(uint32_t len) {
+  return STORE_WORD + (len + STORE_WORD - 1U) / STORE_WORD * STORE_WORD;
+}
+
+// Walk the records from the sector base to the first blank header. Returns
+// that offset, or STORE_SECTOR_SIZE if the sector holds something that is
+// not a log record (it is then erased by the next append). *last is the
+// offset of the newest valid record of len bytes, STORE_SECTOR_SIZE if none.
+static uint32_t Store_Scan(CCD_Store_Id_t id, uint32_t len, uint32_t *last) {
+  const uint8_t *base = Store_Addr(id);
+  uint32_t off = 0;
+  *last = STORE_SECTOR_SIZE;
+  while (off + STORE_WORD <= STORE_SECTOR_SIZE) {
+    Store_Header_t hdr;
+    memcpy(&hdr, base + off, sizeof(hdr));
+    if (hdr.magic == STORE_BLANK) {
+      return off;
+    }
+    if (hdr.magic != STORE_MAGIC || hdr.id != (uint32_t)id ||
+        hdr.len > CCD_STORE_MAX_LEN ||
+        off + Store_RecordSize(hdr.len) > STORE_SECTOR_SIZE) {
+      return STORE_SECTOR_SIZE;
+    }
+    if (hdr.len == len &&
+        Store_Checksum(base + off + STORE_WORD, len) == hdr.checksum) {
+      *last = off;
+    }
+    off += Store_RecordSize(hdr.len);
+  }
+  return off;
+}
+
+uint8_t CCD_Store_LoadLast(CCD_Store_Id_t id, void *data, uint32_t len) {
+  uint32_t last;
+  Store_Scan(id, len, &last);
+  if (last == STORE_SECTOR_SIZE) {
+    return 0;
+  }
+  memcpy(data, Store_Addr(id) + last + STORE_WORD, len);
+  return 1;
+}
+
+uint32_t CCD_Store_Free(CCD_Store_Id_t id) {
+  uint32_t last;
+  return STORE_SECTOR_SIZE - Store_Scan(id, 0, &last);
+}
+
+// Header first here: its length lets the scan step over a record cut short
+// by a reset, and its checksum keeps that record from loading
+uint8_t CCD_Store_Append(CCD_Store_Id_t id, const void *data, uint32_t len) {
+  uint32_t size = Store_RecordSize(len);
+  if (size > STORE_SECTOR_SIZE) {
+    return 0;
+  }
+  uint32_t last;
+  uint32_t off = Store_Scan(id, len, &last);
+
+  Store_Header_t hdr;
+  Store_Header(&hdr, id, data, len);
+
+  HAL_FLASH_Unlock();
+  uint8_t ok = 1;
+  if (off + size > STORE_SECTOR_SIZE) {
+    ok = Store_EraseSector(id);
+    CCD_DCACHE_INVALIDATE(Store_Addr(id), STORE_SECTOR_SIZE);
+    off = 0;
+  }
+  uint32_t addr = (uint32_t)Store_Addr(id) + off;
+  ok = ok &&
+       HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, addr, (uint32_t)&hdr) ==
+           HAL_OK &&
+       Store_ProgramData(addr + STORE_WORD, data, len);
+  HAL_FLASH_Lock();
+
+  CCD_DCACHE_INVALIDATE(addr, size);
+  return ok;
+}
+
+uint8_t CCD_Store_Erase(CCD_Store_Id_t id) {
+  HAL_FLASH_Unlock();
+  uint8_t ok = Store_EraseSector(id);
+  HAL_FLASH_Lock();
+  CCD_DCACHE_INVALIDATE(Store_Addr(id), STORE_SECTOR_SIZE);
+  return ok;
+}
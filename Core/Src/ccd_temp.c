@@ -0,0 +1,157 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_temp.c
+ * @brief          : Die and board temperature (ADC3)
+ ******************************************************************************
+ */
+
+#include "ccd_temp.h"
+#include "stm32h7xx_ll_adc.h"
+#include <math.h>
+
+#if CCD_TEMP_NTC && CCD_USB_ULPI
+#error "CCD_TEMP_NTC on PC0 needs the ULPI_STP pin"
+#endif
+
+#define TEMP_DIE 0
+#define TEMP_NTC 1
+
+volatile int16_t ccd_temp_die = CCD_TEMP_NONE;
+volatile int16_t ccd_temp_board = CCD_TEMP_NONE;
+
+static ADC_HandleTypeDef hadc3;
+static uint8_t temp_channel; // TEMP_* of the conversion in progress
+static uint32_t temp_due;
+
+// Rank 1 of the injected group, software-started. JSQR takes a write
+// whenever no injected conversion is running, also while the regular group
+// converts the reference photodiode (ccd_ref.h)
+static void Temp_Select(uint8_t channel) {
+  uint32_t ch =
+      (channel == TEMP_DIE) ? ADC_CHANNEL_TEMPSENSOR : CCD_TEMP_NTC_CHANNEL;
+  LL_ADC_INJ_ConfigQueueContext(ADC3, LL_ADC_INJ_TRIG_SOFTWARE,
+                                LL_ADC_INJ_TRIG_EXT_RISING,
+                                LL_ADC_INJ_SEQ_SCAN_DISABLE, ch, ch, ch, ch);
+  temp_channel = channel;
+}
+
+// Preselection, sampling time and ending only change with both groups
+// idle, so each sensor gets its own once, before ADC3 is enabled
+static void Temp_Channel(uint32_t ch) {
+  LL_ADC_SetChannelPreselection(ADC3, ch);
+  LL_ADC_SetChannelSamplingTime(ADC3, ch,
+                                LL_ADC_SAMPLINGTIME_810CYCLES_5); // >= 9 us
+  LL_ADC_SetChannelSingleDiff(ADC3, ch, LL_ADC_SINGLE_ENDED);
+}
+
+// Beta equation, with the thermistor at the bottom of the divider
+static int16_t Temp_Ntc(uint32_t raw) {
+  if (raw == 0 || raw >= 0xFFFFU) {
+    return CCD_TEMP_NONE; // Shorted or open
+  }
+  float r = CCD_TEMP_NTC_SERIES * (float)raw / (float)(0xFFFFU - raw);
+  float k = 1.0f / (1.0f / 298.15f +
+                    logf(r / CCD_TEMP_NTC_R25) / CCD_TEMP_NTC_BETA);
+  return (int16_t)lrintf((k - 273.15f) * 100.0f);
+}
+
+static void Temp_Store(uint32_t raw) {
+  if (temp_channel == TEMP_DIE) {
+    // __LL_ADC_CALC_TEMPERATURE() in hundredths: the factory two-point
+    // line, from the counts at the calibration's VREF+
+    int32_t cal1 = (int32_t)*TEMPSENSOR_CAL1_ADDR;
+    int32_t cal2 = (int32_t)*TEMPSENSOR_CAL2_ADDR;
+    int32_t span = (int32_t)(TEMPSENSOR_CAL2_TEMP - TEMPSENSOR_CAL1_TEMP);
+    int32_t x = (int32_t)(raw * CCD_TEMP_VREF_MV / TEMPSENSOR_CAL_VREFANALOG);
+    ccd_temp_die = (int16_t)((x - cal1) * span * 100 / (cal2 - cal1) +
+                             TEMPSENSOR_CAL1_TEMP * 100);
+  } else {
+    ccd_temp_board = Temp_Ntc(raw);
+  }
+}
+
+static void Temp_ReadNow(uint8_t channel) {
+  Temp_Select(channel);
+  LL_ADC_INJ_StartConversion(ADC3);
+  uint32_t start = HAL_GetTick();
+  while (!LL_ADC_IsActiveFlag_JEOC(ADC3)) {
+    if (HAL_GetTick() - start > 10U) {
+      return;
+    }
+  }
+  LL_ADC_ClearFlag_JEOC(ADC3);
+  Temp_Store(LL_ADC_INJ_ReadConversionData32(ADC3, LL_ADC_INJ_RANK_1));
+}
+
+void CCD_Temp_Init(void) {
+#if CCD_TEMP_NTC
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  GPIO_InitTypeDef gpio = {0};
+  gpio.Pin = GPIO_PIN_0;
+  gpio.Mode = GPIO_MODE_ANALOG;
+  gpio.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(GPIOC, &gpio);
+#endif
+  __HAL_RCC_ADC3_CLK_ENABLE();
+  hadc3.Instance = ADC3;
+  hadc3.Init.ClockPrescaler = ADC_CLOCK_ASYNC_DIV8;
+  hadc3.Init.Resolution = ADC_RESOLUTION_16B;
+  hadc3.Init.ScanConvMode = ADC_SCAN_DISABLE;
+  hadc3.Init.EOCSelection = ADC_EOC_SINGLE_CONV;
+  hadc3.Init.LowPowerAutoWait = DISABLE;
+  hadc3.Init.ContinuousConvMode = DISABLE;
+  hadc3.Init.NbrOfConversion = 1;
+  hadc3.Init.DiscontinuousConvMode = DISABLE;
+  hadc3.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+  hadc3.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
+  hadc3.Init.ConversionDataManagement = ADC_CONVERSIONDATA_DR;
+  hadc3.Init.Overrun = ADC_OVR_DATA_OVERWRITTEN;
+  hadc3.Init.LeftBitShift = ADC_LEFTBITSHIFT_NONE;
+  hadc3.Init.OversamplingMode = DISABLE;
+  if (HAL_ADC_Init(&hadc3) != HAL_OK) {
+    Error_Handler();
+  }
+  HAL_ADCEx_Calibration_Start(&hadc3, ADC_CALIB_OFFSET, ADC_SINGLE_ENDED);
+  ADC_Common_TypeDef *common = __LL_ADC_COMMON_INSTANCE(ADC3);
+  LL_ADC_SetCommonPathInternalCh(
+      common, LL_ADC_GetCommonPathInternalCh(common) |
+                  LL_ADC_PATH_INTERNAL_TEMPSENSOR); // ADC3 still disabled
+  Temp_Channel(ADC_CHANNEL_TEMPSENSOR);
+#if CCD_TEMP_NTC
+  Temp_Channel(CCD_TEMP_NTC_CHANNEL);
+#endif
+  LL_ADC_ClearFlag_ADRDY(ADC3);
+  LL_ADC_Enable(ADC3);
+  while (!LL_ADC_IsActiveFlag_ADRDY(ADC3)) {
+  }
+  HAL_Delay(1); // Sensor start-up, LL_ADC_DELAY_TEMPSENSOR_STAB_US
+#if CCD_TEMP_NTC
+  Temp_ReadNow(TEMP_NTC);
+#endif
+  Temp_ReadNow(TEMP_DIE);
+  LL_ADC_INJ_StartConversion(ADC3);
+  temp_due = HAL_GetTick() + CCD_TEMP_MS;
+}
+
+// One conversion per pass that is due: store the finished one, start the
+// next, on the other sensor if there are two
+void CCD_Temp_Poll(void) {
+  uint32_t now = HAL_GetTick();
+  if ((int32_t)(now - temp_due) < 0) {
+    return;
+  }
+  temp_due = now + CCD_TEMP_MS;
+  if (LL_ADC_IsActiveFlag_JEOC(ADC3)) {
+    LL_ADC_ClearFlag_JEOC(ADC3);
+    Temp_Store(LL_ADC_INJ_ReadConversionData32(ADC3, LL_ADC_INJ_RANK_1));
+  }
+#if CCD_TEMP_NTC
+  Temp_Select(temp_channel ^ 1U);
+#endif
+  LL_ADC_INJ_StartConversion(ADC3);
+}
+
+int16_t CCD_Temp_Sensor(void) {
+  int16_t board = ccd_temp_board;
+  return (board != CCD_TEMP_NONE) ? board : ccd_temp_die;
+}
@@ -0,0 +1,63 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_time.c
+ * @brief          : 64-bit timestamps (TIM7 extended by its wraps)
+ ******************************************************************************
+ */
+
+#include "ccd_time.h"
+#include "ccd_irq.h"
+#include "stm32h7xx_ll_tim.h"
+
+#define TIME_PSC 8U // TIM7 counts per CCD timer tick
+#define TIME_STEP (CCD_TIME_PER_TICK * TIME_PSC) // Timestamp ticks per count
+
+_Static_assert(CCD_TIME_HZ % CCD_TIM_CLK_HZ == 0,
+               "timestamps are a whole number of CCD timer ticks");
+
+CCD_DTCM_BSS static volatile uint32_t time_high; // Wraps counted
+
+void CCD_Time_Init(void) {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+  __HAL_RCC_TIM7_CLK_ENABLE();
+  __HAL_RCC_TIM7_FORCE_RESET();
+  __HAL_RCC_TIM7_RELEASE_RESET();
+  time_high = 0;
+  // UIFREMAP puts the pending wrap in CNT bit 31, read with the count
+  TIM7->CR1 = TIM_CR1_UIFREMAP | TIM_CR1_URS;
+  TIM7->PSC = TIME_PSC - 1U;
+  TIM7->ARR = 0xFFFFU;
+  TIM7->EGR = TIM_EGR_UG; // Loads PSC; URS keeps it from setting UIF
+  TIM7->DIER = TIM_DIER_UIE;
+  HAL_NVIC_SetPriority(TIM7_IRQn, CCD_IRQ_PRIO_DMA, 0);
+  HAL_NVIC_EnableIRQ(TIM7_IRQn);
+  TIM7->CR1 |= TIM_CR1_CEN;
+}
+
+// Callers preempt each other and the wrap interrupt, so the count and the
+// wraps are read in one step
+CCD_ITCM uint64_t CCD_Time_Now(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t cnt = TIM7->CNT;
+  uint32_t high = time_high;
+  __set_PRIMASK(primask);
+  if (cnt & TIM_CNT_UIFCPY) {
+    high++; // Wrapped, interrupt not taken yet
+  }
+  return (((uint64_t)high << 16) | (cnt & 0xFFFFU)) * TIME_STEP;
+}
+
+// Masked too, so that a TIM2 or TIM5 read cannot fall between the two. The
+// read back lets the flag clear before the handler returns.
+CCD_ITCM void CCD_Time_WrapIRQ(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  LL_TIM_ClearFlag_UPDATE(TIM7);
+  (void)TIM7->SR;
+  time_high++;
+  __set_PRIMASK(primask);
+}
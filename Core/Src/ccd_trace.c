@@ -0,0 +1,72 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_trace.c
+ * @brief          : ITM event trace over SWO (CCD_ITM_TRACE)
+ ******************************************************************************
+ */
+
+#include "ccd_trace.h"
+#include "ccd_time.h"
+
+#if CCD_ITM_TRACE
+
+// SWO output port and funnel (RM0433 "Serial wire output"); not in the
+// CMSIS device header
+#define TRACE_SWO_BASE 0x5C003000UL
+#define TRACE_SWTF_BASE 0x5C004000UL
+#define TRACE_REG(base, off) (*(volatile uint32_t *)((base) + (off)))
+#define TRACE_CODR 0x010U // Clock prescaler
+#define TRACE_SPPR 0x0F0U // Pin protocol
+#define TRACE_CTRL 0x000U // Funnel control (SWTF)
+#define TRACE_LAR 0xFB0U
+#define TRACE_UNLOCK 0xC5ACCE55UL
+#define TRACE_SPPR_NRZ 2U
+#define TRACE_CTRL_ENS0 1U // Funnel input 0: the Cortex-M7 ITM
+
+volatile uint32_t ccd_trace_dropped;
+
+void CCD_Trace_Init(void) {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DBGMCU->CR |= DBGMCU_CR_DBG_TRACECKEN | DBGMCU_CR_DBG_CKD1EN |
+                DBGMCU_CR_DBG_CKD3EN;
+#if CCD_ITM_SWO_HZ
+  TRACE_REG(TRACE_SWO_BASE, TRACE_LAR) = TRACE_UNLOCK;
+  TRACE_REG(TRACE_SWO_BASE, TRACE_CODR) =
+      HAL_RCC_GetSysClockFreq() / CCD_ITM_SWO_HZ - 1U;
+  TRACE_REG(TRACE_SWO_BASE, TRACE_SPPR) = TRACE_SPPR_NRZ;
+  TRACE_REG(TRACE_SWTF_BASE, TRACE_LAR) = TRACE_UNLOCK;
+  TRACE_REG(TRACE_SWTF_BASE, TRACE_CTRL) |= TRACE_CTRL_ENS0;
+#endif
+  ITM->LAR = TRACE_UNLOCK;
+  ITM->TCR = ITM_TCR_ITMENA_Msk | ITM_TCR_SYNCENA_Msk |
+             (1UL << ITM_TCR_TraceBusID_Pos);
+  ITM->TPR = 0; // Every port writable unprivileged
+  ITM->TER = (1UL << CCD_TRACE_PORTS) - 1U;
+}
+
+// A port reads 0 while the FIFO cannot take another write
+CCD_ITCM void CCD_Trace_Event(uint8_t port) {
+  if (ITM->PORT[port].u32 == 0) {
+    ccd_trace_dropped++;
+    return;
+  }
+  ITM->PORT[port].u32 = (uint32_t)CCD_Time_Now();
+}
+
+// An argument that no longer fits leaves the stamp alone in the trace
+CCD_ITCM void CCD_Trace_EventArg(uint8_t port, uint16_t arg) {
+  CCD_Trace_Event(port);
+  if (ITM->PORT[port].u32 == 0) {
+    ccd_trace_dropped++;
+    return;
+  }
+  ITM->PORT[port].u16 = arg;
+}
+
+// printf() through _write() (syscalls.c)
+int __io_putchar(int ch) {
+  ITM_SendChar((uint32_t)ch);
+  return ch;
+}
+
+#endif /* CCD_ITM_TRACE */
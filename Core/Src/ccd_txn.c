@@ -0,0 +1,199 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_txn.c
+ * @brief          : Configuration transactions, swapped at a frame boundary
+ ******************************************************************************
+ */
+
+#include "ccd_txn.h"
+#include "ccd_acq.h"
+#include <string.h>
+
+#define TXN_KEEP 0xFFU // CCD_TXN_FORMAT field left as it is
+
+// Main loop only: the commands and the transport both run there
+static uint8_t txn_state = CCD_TXN_IDLE;
+static uint8_t txn_staged; // CCD_TXN_F_*
+static uint8_t txn_wait_sh; // The swap waits for the new SH timing
+static uint16_t txn_from;
+static uint32_t txn_generation;
+static uint32_t txn_rejected;
+static uint32_t txn_aborted;
+static uint32_t txn_start[CCD_TXN_HIST];
+
+// The staged settings
+static uint32_t txn_period_us;
+static uint32_t txn_pulse_us;
+static uint32_t txn_t_us;
+static CCD_RoiWindow_t txn_roi[CCD_PROC_ROI_MAX];
+static uint8_t txn_roi_count;
+static uint8_t txn_bin;
+static uint16_t txn_coadd;
+static uint16_t txn_rolling;
+static uint8_t txn_bits;
+static uint8_t txn_codec;
+
+uint8_t CCD_Txn_Open(void) {
+  return txn_state == CCD_TXN_OPEN || txn_state == CCD_TXN_REFUSED;
+}
+
+uint8_t CCD_Txn_Armed(void) { return txn_state == CCD_TXN_ARMED; }
+
+uint8_t CCD_Txn_Begin(void) {
+  if (txn_state == CCD_TXN_ARMED) {
+    return 0;
+  }
+  txn_staged = 0;
+  txn_state = CCD_TXN_OPEN;
+  return 1;
+}
+
+uint8_t CCD_Txn_Abort(void) {
+  if (txn_state == CCD_TXN_ARMED) {
+    return 0;
+  }
+  if (CCD_Txn_Open()) {
+    txn_aborted++;
+  }
+  txn_staged = 0;
+  txn_state = CCD_TXN_IDLE;
+  return 1;
+}
+
+void CCD_Txn_Refuse(void) {
+  if (CCD_Txn_Open()) {
+    txn_state = CCD_TXN_REFUSED;
+  }
+}
+
+// The timing is the one setting that cannot wait for the frame: TIM5's
+// preloads take it at an ICG, and the frames integrated with it are the
+// ones to swap at. A refused commit applies nothing and closes, so a host
+// that pipelined the whole transaction never gets half of it.
+uint8_t CCD_Txn_Commit(void) {
+  if (!CCD_Txn_Open()) {
+    return 0;
+  }
+  uint8_t ok = (txn_state == CCD_TXN_OPEN);
+  if (ok && (txn_staged & CCD_TXN_F_EXPOSURE)) {
+    ok = CCD_Acq_SetExposure(txn_period_us, txn_pulse_us);
+  } else if (ok && (txn_staged & CCD_TXN_F_INTEGRATION)) {
+    ok = CCD_Acq_SetIntegration(txn_t_us);
+  }
+  if (!ok) {
+    txn_rejected++;
+    txn_staged = 0;
+    txn_state = CCD_TXN_IDLE;
+    return 0;
+  }
+  txn_wait_sh = (txn_staged & (CCD_TXN_F_EXPOSURE | CCD_TXN_F_INTEGRATION)) &&
+                CCD_Acq_BracketCount() == 0;
+  txn_from = (uint16_t)(CCD_Acq_FrameCount() + 1U); // Read out after this
+  txn_state = CCD_TXN_ARMED;
+  return 1;
+}
+
+// The exposure and the integration time both set the SH timing: the one
+// staged last is the one committed
+uint8_t CCD_Txn_SetExposure(uint32_t period_us, uint32_t pulse_us) {
+  if (!CCD_Acq_ExposureValid(period_us, pulse_us)) {
+    return 0;
+  }
+  txn_period_us = period_us;
+  txn_pulse_us = pulse_us;
+  txn_staged = (txn_staged & ~CCD_TXN_F_INTEGRATION) | CCD_TXN_F_EXPOSURE;
+  return 1;
+}
+
+void CCD_Txn_SetIntegration(uint32_t t_us) {
+  txn_t_us = t_us;
+  txn_staged = (txn_staged & ~CCD_TXN_F_EXPOSURE) | CCD_TXN_F_INTEGRATION;
+}
+
+uint8_t CCD_Txn_SetRoi(const CCD_RoiWindow_t *w, uint8_t n) {
+  if (!CCD_Proc_RoiValid(w, n)) {
+    return 0;
+  }
+  memcpy(txn_roi, w, n * sizeof(*w));
+  txn_roi_count = n;
+  txn_staged |= CCD_TXN_F_ROI;
+  return 1;
+}
+
+void CCD_Txn_SetBin(uint8_t bin) {
+  txn_bin = bin;
+  txn_staged |= CCD_TXN_F_BIN;
+}
+
+void CCD_Txn_SetCoadd(uint16_t n) {
+  txn_coadd = n;
+  txn_staged |= CCD_TXN_F_COADD;
+}
+
+void CCD_Txn_SetRolling(uint16_t n) {
+  txn_rolling = n;
+  txn_staged |= CCD_TXN_F_ROLLING;
+}
+
+uint8_t CCD_Txn_SetFormat(uint8_t bits, uint8_t codec) {
+  if ((bits != TXN_KEEP && bits != CCD_PROC_PACK_12 &&
+       bits != CCD_PROC_PACK_14 && bits != CCD_PROC_PACK_NONE) ||
+      (codec != TXN_KEEP && codec > CCD_PROC_CODEC_TEMPORAL)) {
+    return 0;
+  }
+  if (bits != TXN_KEEP) {
+    txn_bits = bits;
+    txn_staged |= CCD_TXN_F_PACK;
+  }
+  if (codec != TXN_KEEP) {
+    txn_codec = codec;
+    txn_staged |= CCD_TXN_F_CODEC;
+  }
+  return 1;
+}
+
+// The stages read the proc_* settings per frame and take a new ROI at the
+// next frame they process, this one
+void CCD_Txn_Frame(const CCD_Frame_t *frame) {
+  if (txn_state != CCD_TXN_ARMED ||
+      (int16_t)(frame->frame_num - txn_from) < 0 ||
+      (txn_wait_sh && !CCD_Acq_ExposureSettled(frame->frame_num))) {
+    return;
+  }
+  uint8_t f = txn_staged;
+  if (f & CCD_TXN_F_COADD) {
+    proc_coadd_n = txn_coadd;
+  }
+  if (f & CCD_TXN_F_ROLLING) {
+    proc_rolling_n = txn_rolling;
+  }
+  if (f & CCD_TXN_F_BIN) {
+    proc_bin = txn_bin;
+  }
+  if (f & CCD_TXN_F_PACK) {
+    proc_bits = txn_bits;
+  }
+  if (f & CCD_TXN_F_CODEC) {
+    proc_codec = txn_codec;
+  }
+  if (f & CCD_TXN_F_ROI) {
+    CCD_Proc_SetRoi(txn_roi, txn_roi_count);
+  }
+  txn_generation++;
+  txn_start[txn_generation % CCD_TXN_HIST] = frame->info.seq;
+  txn_staged = 0;
+  txn_state = CCD_TXN_IDLE;
+}
+
+void CCD_Txn_Status(CCD_TxnStatus_t *out) {
+  uint32_t g = txn_generation;
+  out->state = txn_state;
+  out->staged = txn_staged;
+  out->from = txn_from;
+  out->generation = g;
+  out->rejected = txn_rejected;
+  out->aborted = txn_aborted;
+  for (uint32_t i = 0; i < CCD_TXN_HIST; i++) {
+    out->start[i] = (g >= i + 1U) ? txn_start[(g - i) % CCD_TXN_HIST] : 0;
+  }
+}
@@ -0,0 +1,132 @@
+/**
+ ******************************************************************************
+ * @file           : ccd_watch.c
+ * @brief          : Capture chain supervisor and independent watchdog
+ ******************************************************************************
+ */
+
+#include "ccd_watch.h"
+#include "ccd_acq.h"
+#include "ccd_bench.h"
+
+// IWDG1 on the LSI (32 kHz) / 128: 4 ms per count, 12-bit reload
+#define WATCH_IWDG_PR 5U
+#define WATCH_IWDG_MS_PER_COUNT 4U
+#define WATCH_IWDG_RELOAD (CCD_WATCH_IWDG_MS / WATCH_IWDG_MS_PER_COUNT)
+_Static_assert(WATCH_IWDG_RELOAD <= IWDG_RLR_RL, "CCD_WATCH_IWDG_MS too long");
+
+CCD_Watch_Stats_t ccd_watch_stats;
+
+CCD_DTCM_BSS static volatile uint8_t watch_bad;  // Misaligned in a row
+CCD_DTCM_BSS static volatile uint8_t watch_good; // Aligned since the check
+static uint8_t watch_rearm;   // Due in the next CCD_Mode_Poll()
+static uint8_t watch_retries; // Re-arms without a good frame
+static uint8_t watch_stuck;   // Given up on a stall: the IWDG goes unfed
+static uint16_t watch_frames; // CCD_Acq_FrameCount() when last seen moving
+static uint32_t watch_seen;   // Its HAL_GetTick()
+
+void CCD_Watch_Init(void) {
+  watch_seen = HAL_GetTick();
+  watch_frames = CCD_Acq_FrameCount();
+#if CCD_WATCH_IWDG_MS
+  DBGMCU->APB4FZ1 |= DBGMCU_APB4FZ1_DBG_IWDG1;
+  IWDG1->KR = 0xCCCCU; // Start, which turns the LSI on
+  IWDG1->KR = 0x5555U; // Unlock PR and RLR
+  IWDG1->PR = WATCH_IWDG_PR;
+  IWDG1->RLR = WATCH_IWDG_RELOAD;
+  while (IWDG1->SR != 0U) {
+  }
+  IWDG1->KR = 0xAAAAU;
+#endif
+}
+
+// Only a chain that paces itself has a frame period to miss
+static uint8_t Watch_FreeRunning(void) {
+  return (ccd_mode == CCD_MODE_FAST || ccd_mode == CCD_MODE_LONG) &&
+         (sync_mode == CCD_SYNC_OFF || sync_mode == CCD_SYNC_MASTER) &&
+         !mode_update_pending && !CCD_Bench_Running();
+}
+
+static uint32_t Watch_StallMs(void) {
+  uint32_t ms = CCD_Acq_IcgTicks() / (CCD_TIM_CLK_HZ / 1000U);
+  return CCD_WATCH_STALL_FRAMES * ms + 2U;
+}
+
+void CCD_Watch_Poll(void) {
+  uint32_t now = HAL_GetTick();
+  uint16_t frames = CCD_Acq_FrameCount();
+  if (frames != watch_frames) {
+    watch_frames = frames;
+    watch_seen = now;
+    watch_stuck = 0;
+    if (watch_good) {
+      watch_good = 0;
+      watch_retries = 0;
+    }
+  }
+  if (!Watch_FreeRunning()) {
+    watch_seen = now;
+  } else if (!watch_rearm) {
+    uint8_t stall = (now - watch_seen) > Watch_StallMs();
+    if (stall || watch_bad >= CCD_WATCH_BAD_FRAMES ||
+        CCD_Acq_HwSyncSlipped()) {
+      if (watch_retries < CCD_WATCH_RETRIES) {
+        watch_retries++;
+        watch_rearm = 1;
+        ccd_watch_stats.rearms++;
+      } else if (stall) {
+        watch_stuck = 1;
+      }
+    }
+  }
+#if CCD_WATCH_IWDG_MS
+  if (!watch_stuck) {
+    IWDG1->KR = 0xAAAAU;
+  }
+#endif
+}
+
+uint8_t CCD_Watch_RearmDue(void) { return watch_rearm; }
+
+void CCD_Watch_Restarted(void) {
+  watch_rearm = 0;
+  watch_bad = 0;
+  watch_frames = CCD_Acq_FrameCount();
+  watch_seen = HAL_GetTick();
+}
+
+// The dummies come out of the sensor before and after the photosites at
+// the dark level, whatever the light
+CCD_ITCM void CCD_Watch_Frame(const CCD_Frame_t *frame) {
+  if (acq_source == CCD_ACQ_SRC_PATTERN) {
+    watch_good = 1;
+    return;
+  }
+  const uint16_t *px = frame->pixels;
+  uint32_t lo = 0xFFFFU;
+  uint32_t hi = 0;
+  uint32_t lead = 0;
+  uint32_t trail = 0;
+  for (uint32_t i = 0; i < CCD_WATCH_LEAD; i++) {
+    uint32_t v = px[i];
+    lo = (v < lo) ? v : lo;
+    hi = (v > hi) ? v : hi;
+    lead += v;
+  }
+  for (uint32_t i = CCD_BUFFER_SIZE - CCD_WATCH_TRAIL; i < CCD_BUFFER_SIZE;
+       i++) {
+    trail += px[i];
+  }
+  lead /= CCD_WATCH_LEAD;
+  trail /= CCD_WATCH_TRAIL;
+  uint32_t step = (lead > trail) ? lead - trail : trail - lead;
+  if (hi - lo > CCD_WATCH_DUMMY_SPREAD || step > CCD_WATCH_DUMMY_SPREAD) {
+    ccd_watch_stats.misaligned++;
+    if (watch_bad < 0xFFU) {
+      watch_bad++;
+    }
+  } else {
+    watch_bad = 0;
+    watch_good = 1;
+  }
+}
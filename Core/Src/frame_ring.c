@@ -0,0 +1,226 @@
+/**
+ ******************************************************************************
+ * @file           : frame_ring.c
+ * @brief          : Lock-free SPSC frame ring between ADC DMA and USB
+ ******************************************************************************
+ */
+
+#include "frame_ring.h"
+
+#if (FRAME_RING_SLOTS & (FRAME_RING_SLOTS - 1)) != 0
+#error "FRAME_RING_SLOTS must be a power of two"
+#endif
+
+#define RING_MASK (FRAME_RING_SLOTS - 1)
+
+#if CCD_CACHE_ENABLE
+// Frame slots in AXI SRAM (cached), written directly by the ADC DMA. Every
+// slot covers whole cache lines so maintenance never touches a neighbour.
+_Static_assert((sizeof(CCD_Frame_t) % 32) == 0,
+               "CCD_Frame_t must be a multiple of the 32-byte cache line");
+#define RING_SECTION
+#else
+// Frame slots in RAM_D2 (non-cached by the MPU), written directly by the DMA
+#define RING_SECTION section(".sram3"),
+#endif
+
+__attribute__((RING_SECTION
+               aligned(32))) static CCD_Frame_t frame_slots[FRAME_RING_SLOTS];
+
+// DMA target while the ring is full. Frames captured here are dropped.
+__attribute__((RING_SECTION aligned(32))) static CCD_Frame_t frame_scratch;
+
+// Free-running indices: claim and head are only written by the producer,
+// read and tail only by the consumer side, so no locking is needed. They
+// live in DTCM because every ISR on the frame path touches them.
+CCD_DTCM_BSS static volatile uint32_t ring_claim = 0; // Next slot for the DMA
+CCD_DTCM_BSS static volatile uint32_t ring_head = 0;  // Next claim to publish
+CCD_DTCM_BSS static volatile uint32_t ring_read = 0;  // Next frame to hand out
+CCD_DTCM_BSS static volatile uint32_t ring_tail = 0;  // Oldest not released
+
+// Per-slot holders, and the release marks of slots whose last holder is
+// done, so handed-out slots can come back out of order
+CCD_DTCM_BSS static volatile uint8_t slot_refs[FRAME_RING_SLOTS];
+CCD_DTCM_BSS static volatile uint8_t slot_released[FRAME_RING_SLOTS];
+
+CCD_DTCM_BSS FrameRing_Stats_t frame_ring_stats;
+
+// Occupancy at each publish (FrameRing_Occupancy), AXI SRAM
+static volatile uint32_t ring_hist[FRAME_RING_HIST];
+static volatile uint32_t ring_peak;
+
+void FrameRing_Init(void) {
+  ring_claim = 0;
+  ring_head = 0;
+  ring_read = 0;
+  ring_tail = 0;
+  for (uint32_t i = 0; i < FRAME_RING_SLOTS; i++) {
+    slot_refs[i] = 0;
+    slot_released[i] = 0;
+  }
+  frame_ring_stats.produced = 0;
+  frame_ring_stats.released = 0;
+  frame_ring_stats.dropped = 0;
+}
+
+// Next free slot for the DMA to fill, or the scratch frame if every slot is
+// claimed or still owned by the consumer. Up to two claims can be
+// outstanding (double-buffered DMA); they complete in claim order.
+CCD_ITCM CCD_Frame_t *FrameRing_Claim(void) {
+  if ((ring_claim - ring_tail) >= FRAME_RING_SLOTS) {
+    return &frame_scratch;
+  }
+  return &frame_slots[ring_claim++ & RING_MASK];
+}
+
+uint32_t FrameRing_Free(void) {
+  return FRAME_RING_SLOTS - (ring_claim - ring_tail);
+}
+
+// The DMA finished filling a claimed frame. Publishes it to the consumer, or
+// counts a drop (returns 0) if it was the scratch frame.
+CCD_ITCM uint8_t FrameRing_Complete(CCD_Frame_t *frame) {
+  frame_ring_stats.produced++;
+  if (frame == &frame_scratch) {
+    frame_ring_stats.dropped++;
+    return 0;
+  }
+  __DMB(); // Frame contents visible before the index moves
+  uint32_t occ = ++ring_head - ring_tail;
+  ring_hist[(occ - 1U) * FRAME_RING_HIST / FRAME_RING_SLOTS]++;
+  if (occ > ring_peak) {
+    ring_peak = occ;
+  }
+  return 1;
+}
+
+// Acquisition stopped mid-frame: return claimed but unfinished slots
+void FrameRing_CancelClaims(void) { ring_claim = ring_head; }
+
+// Next completed frame not yet handed out, or NULL if there is none
+CCD_Frame_t *FrameRing_Peek(void) {
+  if (ring_read == ring_head) {
+    return NULL;
+  }
+  __DMB();
+  return &frame_slots[ring_read & RING_MASK];
+}
+
+// Most recently completed frame not yet handed out, or NULL. It stays put
+// until the main loop advances past it.
+CCD_Frame_t *FrameRing_PeekNewest(void) {
+  uint32_t head = ring_head;
+  if (ring_read == head) {
+    return NULL;
+  }
+  __DMB();
+  return &frame_slots[(head - 1U) & RING_MASK];
+}
+
+// Up to max completed frames that are adjacent in memory (a batch never
+// wraps past the last slot), so they can go out as a single USB transfer
+uint32_t FrameRing_PeekBatch(CCD_Frame_t **first, uint32_t max) {
+  uint32_t avail = ring_head - ring_read;
+  uint32_t to_end = FRAME_RING_SLOTS - (ring_read & RING_MASK);
+  if (avail > to_end) {
+    avail = to_end;
+  }
+  if (avail > max) {
+    avail = max;
+  }
+  if (avail > 0) {
+    __DMB();
+    *first = &frame_slots[ring_read & RING_MASK];
+  }
+  return avail;
+}
+
+// The peeked frames are now owned by the transport, one holder each
+void FrameRing_Advance(uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    slot_refs[(ring_read + i) & RING_MASK] = 1;
+  }
+  ring_read += n;
+}
+
+uint8_t FrameRing_Retain(const CCD_Frame_t *first, uint32_t n) {
+  uint32_t slot = FrameRing_Slot(first);
+  if (slot == FRAME_RING_SLOTS) {
+    return 0;
+  }
+  uint8_t ok = 1;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq(); // Against a release from the TX completion
+  for (uint32_t i = 0; i < n; i++) {
+    ok = ok && slot_refs[(slot + i) & RING_MASK] < FRAME_RING_MAX_REFS;
+  }
+  for (uint32_t i = 0; ok && i < n; i++) {
+    slot_refs[(slot + i) & RING_MASK]++;
+  }
+  __set_PRIMASK(primask);
+  return ok;
+}
+
+// One holder is done with n slots from first; those it was the last holder
+// of go back to the producer. The transport gives slots back in send order,
+// but a processing stage may drop or hold a frame while later ones are in
+// flight, and sinks finish in any order, so slots are marked individually
+// and the tail only moves over a run of released slots. Called from the
+// main loop and from the TX completion interrupt.
+CCD_ITCM void FrameRing_Release(const CCD_Frame_t *first, uint32_t n) {
+  uint32_t slot = (uint32_t)(first - frame_slots);
+  uint32_t freed = 0;
+  __DMB(); // Finish reading the slots before giving them back
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t s = (slot + i) & RING_MASK;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint8_t refs = slot_refs[s];
+    refs -= (refs > 0U);
+    slot_refs[s] = refs;
+    __set_PRIMASK(primask);
+    if (refs != 0U) {
+      continue; // Another sink still reads it
+    }
+    // Drop the lines the CPU dirtied (header stamp, processing) so no
+    // write-back can land on top of the next DMA capture into this slot
+    CCD_DCACHE_INVALIDATE(&frame_slots[s], sizeof(CCD_Frame_t));
+    slot_released[s] = 1;
+    freed++;
+  }
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  frame_ring_stats.released += freed;
+  while (ring_tail != ring_read && slot_released[ring_tail & RING_MASK]) {
+    slot_released[ring_tail & RING_MASK] = 0;
+    ring_tail++;
+  }
+  __set_PRIMASK(primask);
+}
+
+// Completed frames not yet handed to the transport
+uint32_t FrameRing_Count(void) { return ring_head - ring_read; }
+
+uint32_t FrameRing_Occupancy(uint32_t *hist, uint8_t clear) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq(); // One publish's bin and peak together
+  for (uint32_t i = 0; i < FRAME_RING_HIST; i++) {
+    hist[i] = ring_hist[i];
+    if (clear) {
+      ring_hist[i] = 0;
+    }
+  }
+  uint32_t peak = ring_peak;
+  if (clear) {
+    ring_peak = 0;
+  }
+  __set_PRIMASK(primask);
+  return peak;
+}
+
+CCD_ITCM uint32_t FrameRing_Slot(const CCD_Frame_t *frame) {
+  uint32_t slot = ((uintptr_t)frame - (uintptr_t)frame_slots) /
+                  sizeof(CCD_Frame_t); // Wraps high below the ring
+  return (slot < FRAME_RING_SLOTS) ? slot : FRAME_RING_SLOTS;
+}
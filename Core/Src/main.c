@@ -12,26 +12,69 @@
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "ccd_acq.h"
+#include "ccd_adccal.h"
+#include "ccd_ae.h"
+#include "ccd_bench.h"
+#include "ccd_burst.h"
+#include "ccd_clock.h"
+#include "ccd_cmd.h"
+#include "ccd_config.h"
+#include "ccd_crc.h"
+#include "ccd_din.h"
+#include "ccd_dual.h"
+#include "ccd_ref.h"
+#include "ccd_eth.h"
+#include "ccd_fault.h"
+#include "ccd_flow.h"
+#include "ccd_hdr.h"
+#include "ccd_irq.h"
+#include "ccd_jpeg.h"
+#include "ccd_lat.h"
+#include "ccd_line.h"
+#include "ccd_loop.h"
+#include "ccd_mains.h"
+#include "ccd_match.h"
+#include "ccd_model.h"
+#include "ccd_mem.h"
+#include "ccd_pack.h"
+#include "ccd_phase.h"
+#include "ccd_preview.h"
+#include "ccd_probe.h"
+#include "ccd_proc.h"
+#include "ccd_psram.h"
+#include "ccd_ptc.h"
+#include "ccd_rec.h"
+#include "ccd_seq.h"
+#include "ccd_snap.h"
+#include "ccd_temp.h"
+#include "ccd_watch.h"
+#include "ccd_selftest.h"
+#include "ccd_shutter.h"
+#include "ccd_time.h"
+#include "ccd_timing.h"
+#include "ccd_trace.h"
+#include "ccd_txn.h"
+#include "frame_ring.h"
+#include "stm32h7xx_ll_tim.h"
+#include "usb_tx.h"
 #include "usbd_cdc_if.h"
+#if CCD_ETH
+#include "lwip.h"
+#endif
 #include <stdio.h>
 #include <string.h>
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
 /* USER CODE BEGIN PTD */
-#define CCD_BUFFER_SIZE 3694 // 32 Dummies + 3648 Pixels + 14 Dummies
-
-#pragma pack(push, 1)
-typedef struct {
-  uint16_t magic;     // 0xABCD
-  uint16_t frame_num; // Rolling frame counter
-  uint16_t pixels[CCD_BUFFER_SIZE];
-} CCD_Frame_t;
-#pragma pack(pop)
+
 /* USER CODE END PTD */
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+// Frames per batched transfer (8 x 7424 bytes fit one CDC transfer)
+#define CCD_TX_MAX_BATCH (USB_TX_MAX_TRANSFER / sizeof(CCD_Frame_t))
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -49,24 +92,15 @@ TIM_HandleTypeDef htim4;
 TIM_HandleTypeDef htim5;
 
 /* USER CODE BEGIN PV */
-// Double-Buffer DMA: Two buffers in SRAM3 (non-cached on H7)
-__attribute__((section(".sram3"),
-               aligned(32))) uint16_t Buffer_A[CCD_BUFFER_SIZE];
-__attribute__((section(".sram3"),
-               aligned(32))) uint16_t Buffer_B[CCD_BUFFER_SIZE];
-
-// USB Command Buffers
-#define CMD_BUF_SIZE 64
-
-// Application State
-volatile uint8_t frame_ready = 0; // Set by ICG interrupt when frame is complete
-volatile uint16_t *safe_buffer = Buffer_B; // Points to buffer safe to read
-uint16_t frame_counter = 0;
-CCD_Frame_t ccd_frame;
-
 // Mode Control
-volatile uint8_t ccd_mode = 0; // 0=Fast, 1=Stable(OneShot), 2=LongExposure
+volatile uint8_t ccd_mode = CCD_MODE_FAST; // CCD_MODE_* (main.h)
 volatile uint8_t mode_update_pending = 0;
+volatile uint8_t tx_mode = CCD_TX_FRAME;
+volatile uint8_t acq_mode = CCD_ACQ_RESTART;
+volatile uint8_t sync_mode = CCD_SYNC_OFF;
+
+// Longest main loop pass since the last CCD_CMD_STATS (main loop only)
+uint32_t loop_max_cycles;
 
 /* USER CODE END PV */
 
@@ -81,38 +115,336 @@ static void MX_TIM3_Init(void);
 static void MX_TIM4_Init(void);
 static void MX_TIM5_Init(void);
 /* USER CODE BEGIN PFP */
-
+void Send_CCD_Frames(void);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
 
-// ADC/DMA callback - not used in single buffer mode
-// ADC/DMA callback - Frame Complete
-void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc) {
-  if (hadc->Instance == ADC1) {
-    // Frame capture complete - copy to transmission buffer
-    ccd_frame.magic = 0xABCD;
-    ccd_frame.frame_num = frame_counter++;
-    memcpy(ccd_frame.pixels, (void *)Buffer_A, CCD_BUFFER_SIZE * 2);
-    frame_ready = 1;
+// The CCD timer periods are compile-time values for CCD_TIM_CLK_HZ. Check
+// that the clock tree really produced it (APB1 timers run at 2 x PCLK1
+// whenever the APB1 prescaler is not 1).
+static uint8_t CCD_Clock_Check(void) {
+  uint32_t tim_clk = HAL_RCC_GetPCLK1Freq();
+  if ((RCC->D2CFGR & RCC_D2CFGR_D2PPRE1) != RCC_APB1_DIV1) {
+    tim_clk *= 2;
+  }
+  return tim_clk == CCD_TIM_CLK_HZ;
+}
+
+// USB TX done callback. ctx is the first ring slot of the transfer; a batch
+// is whole adjacent frames, anything shorter is a single frame.
+static void CCD_Frame_Sent(void *ctx, uint32_t len) {
+  uint32_t n = (len + sizeof(CCD_Frame_t) - 1U) / sizeof(CCD_Frame_t);
+  CCD_Lat_Sent((const CCD_Frame_t *)ctx, n);
+  FrameRing_Release((const CCD_Frame_t *)ctx, n);
+}
+
+// Until the host opens the port, or after it closed it, completed frames
+// go straight back to the ring, so the first one it reads is fresh rather
+// than a ring of stale ones and the loss counters stay quiet
+static void CCD_Frame_Discard(void) {
+  CCD_Frame_t *first;
+  uint32_t n;
+  while ((n = FrameRing_PeekBatch(&first, FRAME_RING_SLOTS)) > 0) {
+    FrameRing_Advance(n);
+    FrameRing_Release(first, n);
+  }
+}
+
+// Room for the next frame, on *link (NULL for Ethernet). CCD_TX_DUAL gives
+// each frame to the port with the shorter queue (alternating on a tie)
+// while the host has the HS port open; the header seq lets the host merge
+// the two.
+static uint8_t CCD_Frame_Link(uint8_t mode, UsbTx_Link_t **out) {
+  static uint8_t last_hs;
+  UsbTx_Link_t *link = USB_TX_FRAMES;
+#if CCD_SD
+  if (CCD_Rec_Active()) {
+    *out = NULL;
+    return 0; // The ring is the recorder's
+  }
+#endif
+#if CCD_ETH
+  if (mode == CCD_TX_ETH) {
+    *out = NULL;
+    return CCD_Eth_Space() > 0;
   }
+#endif
+  if (!CDC_IsOpen_FS()) {
+    CCD_Frame_Discard();
+    return 0;
+  }
+  if (mode == CCD_TX_DUAL && CDC_IsOpen_HS()) {
+    uint32_t space = UsbTx_Space(link);
+    uint32_t space_hs = UsbTx_Space(&usb_tx_hs);
+    if (space_hs > space || (space_hs == space && !last_hs)) {
+      link = &usb_tx_hs;
+    }
+    last_hs = (link == &usb_tx_hs);
+  }
+  *out = link;
+  return UsbTx_Space(link) > CCD_Pack_Reserved(link);
 }
 
-// Send one frame of CCD data as binary (for oscilloscope)
-// Note: ccd_frame is already populated by TIM2 interrupt
-void Send_CCD_Frame_Binary(void) {
-  // Send in chunks (USB FS max packet = 64 bytes)
-  uint8_t *ptr = (uint8_t *)&ccd_frame;
-  uint16_t remaining = sizeof(CCD_Frame_t);
+// Hand every completed frame to the USB TX engine, or LwIP in CCD_TX_ETH
+// (with USB's binned preview, ccd_preview.h), or both in CCD_TX_FANOUT
+// (never blocks). Frames go straight from the DMA-written ring slot; no
+// copy into a USB or network buffer, and a slot both sinks read is
+// recycled after the later one (frame_ring.h). Only small outputs are
+// copied, several to a transfer (ccd_pack.h). Processing stages work on
+// the slot in place and may absorb a frame; bracketed frames are merged
+// instead, a photon transfer run sums them into maps (ccd_ptc.h), and a
+// running sequence drops the frames outside its steps. A finished burst
+// is queued first. Every frame gets its CRC last. Out of host credit the
+// flow policy takes the frames instead (CCD_Flow_Starve()). A USB link
+// test keeps the frames in the ring while it runs (ccd_loop.h).
+void Send_CCD_Frames(void) {
+  uint8_t mode = tx_mode;
+  uint32_t max_batch =
+      (mode == CCD_TX_BATCH && !CCD_Proc_Active() && !CCD_Phase_Busy() &&
+       !CCD_HDR_Active() && !CCD_Seq_Running() && !CCD_Ptc_Active() &&
+       !CCD_Txn_Armed())
+          ? CCD_TX_MAX_BATCH
+          : 1;
+  USB_TX_FRAMES->max_transfer =
+      (mode == CCD_TX_CHUNKED) ? USB_TX_CHUNK_SIZE : USB_TX_MAX_TRANSFER;
+  usb_tx_hs.max_transfer = USB_TX_MAX_TRANSFER_HS;
+  uint8_t held = CCD_Loop_Poll();
+  CCD_Burst_Send();
+
+  CCD_Frame_t *first;
+  uint32_t n;
+  UsbTx_Link_t *link;
+  while (!held && CCD_Frame_Link(mode, &link)) {
+    uint32_t credits = CCD_Flow_Credits();
+    if (credits == 0) {
+      if (CCD_HDR_Active() || CCD_Ptc_Active() || !CCD_Flow_Starve()) {
+        break; // Held in the ring until the host grants more
+      }
+      continue;
+    }
+    if ((first = CCD_Flow_Take()) != NULL) {
+      n = 1;
+    } else if ((n = FrameRing_PeekBatch(
+                    &first, credits < max_batch ? credits : max_batch)) > 0) {
+      FrameRing_Advance(n);
+    } else {
+      break;
+    }
+    uint32_t len = n * sizeof(CCD_Frame_t);
+    uint64_t icg = first->info.timestamp; // Before a stage rewrites it
+    if (n == 1) {
+      CCD_Txn_Frame(first); // A committed change, from this frame on
+    }
+#if CCD_ENCODER
+    if (CCD_Line_Active()) {
+      for (uint32_t i = 0; i < n; i++) {
+        CCD_Line_Frame(&first[i]); // Lines go out in tiles, from the stage
+      }
+      continue;
+    }
+#endif
+    uint8_t one = (n == 1); // Through the stages
+#if CCD_SHUTTER
+    uint8_t kind = one ? CCD_Shutter_Kind(first->info.seq) : CCD_SHUTTER_LIGHT;
+    if (kind == CCD_SHUTTER_MOVING) {
+      CCD_Shutter_Drop(); // Neither light nor dark
+      FrameRing_Release(first, 1);
+      continue;
+    }
+    if (kind == CCD_SHUTTER_CLOSED) {
+      first = CCD_Shutter_Dark(first, &len); // Into the estimate, out raw
+      one = 0;
+    }
+#endif
+    if (one && CCD_HDR_Active()) {
+      CCD_HDR_Frame(first); // Brackets go out merged, from the stage
+      continue;
+    }
+    if (one && CCD_Ptc_Active()) {
+      CCD_Ptc_Frame(first); // Summed; only the maps go out, from the stage
+      continue;
+    }
+    if (one && CCD_Seq_Running() && !CCD_Seq_Frame(first)) {
+      FrameRing_Release(first, 1);
+      continue;
+    }
+    if (one) {
+      CCD_Phase_Frame(first);
+    }
+    if (one && (first = CCD_Proc_Frame(first, &len)) == NULL) {
+      continue;
+    }
+    if (one) {
+      CCD_Seq_Output(first);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      CCD_Crc_Stamp(&first[i]); // Final from here on
+      CCD_Lat_Ready(&first[i], (i == 0) ? icg : first[i].info.timestamp);
+    }
+    CCD_Flow_Spend(n);
+#if CCD_ETH
+    if (link == NULL) {
+      CCD_Preview_Offer(first); // USB's copy, if due
+      CCD_Eth_Send(first, len); // Released by its pbuf, see ccd_eth.h
+    } else if (mode == CCD_TX_FANOUT) {
+      CCD_Eth_Mirror(first, len); // Its own reference, before USB has one
+    }
+#endif
+    if (ccd_mode == CCD_MODE_ONESHOT) {
+      CCD_Snap_Sent(first);
+    }
+    if (link != NULL && !CCD_Pack_Frame(link, first, len)) {
+      UsbTx_Submit(link, (const uint8_t *)first, len, CCD_Frame_Sent, first);
+    }
+  }
+#if CCD_DUAL_SENSOR
+  CCD_Dual_Send(); // Sensor B, behind the sensor A frames just queued
+#endif
+  CCD_Pack_Poll();
+  CCD_HDR_Poll();
+  CCD_Ptc_Poll();
+#if CCD_ENCODER
+  CCD_Line_Poll();
+#endif
+#if CCD_JPEG
+  CCD_Jpeg_Poll();
+#endif
+  UsbTx_Poll(USB_TX_FRAMES);
+  UsbTx_Poll(&usb_tx_hs);
+#if CCD_USB_VENDOR
+  UsbTx_Poll(&usb_tx_fs); // Acks and reports, on their own endpoint
+#endif
+}
+// Restart the capture chain for ccd_mode, acq_mode and sync_mode, once per
+// pass however many commands queued a change. A re-arm of the supervisor
+// (ccd_watch.h) restarts the same chain but keeps the processing and
+// flow-control state.
+static void CCD_Mode_Poll(void) {
+  if (!mode_update_pending && !CCD_Watch_RearmDue()) {
+    return;
+  }
+  uint8_t full = mode_update_pending;
+  mode_update_pending = 0;
+
+  // 1. Stop Everything
+  HAL_TIM_PWM_Stop(&htim2, TIM_CHANNEL_1);
+  HAL_TIM_PWM_Stop(&htim5, TIM_CHANNEL_3);
+  HAL_TIM_PWM_Stop(&htim4, TIM_CHANNEL_4);
+  CCD_Acq_Stop();
+  if (full) {
+    CCD_AdcCal_Service(); // A due recalibration, with the ADCs disabled
+    CCD_Proc_Reset();
+    CCD_Flow_Reset();
+  }
+  CCD_Acq_ApplySampling();
+
+  // Mode 3 owns the trigger input; one-shots are never slaved
+  uint8_t trig = CCD_ACQ_TRIG_FREE;
+  if (ccd_mode == CCD_MODE_EXT_TRIGGER) {
+    trig = CCD_ACQ_TRIG_EDGE;
+  } else if (sync_mode == CCD_SYNC_SLAVE && ccd_mode != CCD_MODE_ONESHOT) {
+    trig = CCD_ACQ_TRIG_SYNC;
+#if CCD_LINE_SYNC
+  } else if (sync_mode == CCD_SYNC_LINE && ccd_mode != CCD_MODE_ONESHOT) {
+    trig = CCD_ACQ_TRIG_LINE; // TIM8 at the mains phase, see ccd_mains.h
+#endif
+  }
+#if CCD_ENCODER
+  if (CCD_Line_Apply(trig == CCD_ACQ_TRIG_EDGE)) {
+    trig = CCD_ACQ_TRIG_ENCODER; // Lines from TIM8, see ccd_line.h
+  }
+#endif
+  CCD_Acq_ConfigTrigger(trig);
+  CCD_Acq_SetSyncOut(sync_mode == CCD_SYNC_MASTER && trig == CCD_ACQ_TRIG_FREE);
+
+  // 2. Reconfigure TIM5 (SH) based on mode: mode 2 is one SH per ICG
+  // (long exposure), modes 0, 1 and 3 the fast shutter ("L"), or in
+  // mode 0 the bracketing cycle ("Q")
+  CCD_Acq_ConfigShutter(ccd_mode);
+
+  // 3. Reset Counters
+  __HAL_TIM_SET_COUNTER(&htim2, 0);
+  __HAL_TIM_SET_COUNTER(&htim3, 0);
+  __HAL_TIM_SET_COUNTER(&htim4, 0);
+  __HAL_TIM_SET_COUNTER(&htim5, 0);
+
+  // 4. Restart. In mode 3 TIM2 only enables its output here and waits
+  // for the ETR edge; TIM4 waits on its gate. Mode 1 parks the aligned
+  // chain until a snap. A benchmark run fills the ring instead, with the
+  // timers clocking the sensor as usual.
+  uint8_t bench = CCD_Bench_Running();
+  if (bench) {
+    // Nothing armed: CCD_Bench_Poll() owns the ring
+  } else if (trig != CCD_ACQ_TRIG_FREE) {
+    CCD_Acq_StartTriggered();
+  } else if (ccd_mode != CCD_MODE_ONESHOT) {
+    CCD_Acq_StartContinuous();
+  }
 
-  while (remaining > 0) {
-    uint16_t chunk = (remaining > 512) ? 512 : remaining;
-    CDC_Transmit_FS(ptr, chunk);
-    ptr += chunk;
-    remaining -= chunk;
-    HAL_Delay(1); // Small delay to prevent buffer overflow
+  HAL_TIM_PWM_Start(&htim5, TIM_CHANNEL_3);
+  HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_4);
+  HAL_TIM_PWM_Start(&htim2, TIM_CHANNEL_1);
+  CCD_Acq_AlignTimers();
+  if (ccd_mode == CCD_MODE_ONESHOT && !bench) {
+    CCD_Acq_StartSnap();
   }
+  CCD_Watch_Restarted();
+  CCD_Selftest_Start(); // The new periods timed, once they settle
+}
+
+// Main loop stages, in order: commands first, so the changes they queue
+// share one mode switch; the supervisor ahead of it, for a re-arm in the
+// same pass; AE ahead of the transport, on the newest frame; the snap
+// report behind the frame it times. No stage blocks but the self-test,
+// for at most CCD_SELFTEST_SPIN_US after a switch, and a new one is
+// added by listing it here with its probe. Capture runs from the timer and
+// DMA interrupts, so a slow stage delays the stages behind it
+// (loop_max_cycles, CCD_PROBE_*), never a frame.
+static const struct {
+  void (*run)(void);
+  uint8_t probe; // CCD_PROBE_*
+} ccd_stages[] = {
+    {CCD_Cmd_Poll, CCD_PROBE_CMD},
+    {CCD_Watch_Poll, CCD_PROBE_WATCH},
+    {CCD_Mode_Poll, CCD_PROBE_MODE},
+    {CCD_Bench_Poll, CCD_PROBE_BENCH},
+    {CCD_Proc_Poll, CCD_PROBE_PROC},
+    {CCD_Phase_Poll, CCD_PROBE_PHASE},
+    {CCD_AE_Poll, CCD_PROBE_AE},
+    {CCD_Seq_Poll, CCD_PROBE_SEQ},
+#if CCD_SD
+    {CCD_Rec_Poll, CCD_PROBE_REC},
+#endif
+#if CCD_ETH
+    // ETH receive, ARP/IGMP timers, TX buffer release
+    {MX_LWIP_Process, CCD_PROBE_ETH},
+#endif
+    {Send_CCD_Frames, CCD_PROBE_SEND},
+    {CCD_Snap_Poll, CCD_PROBE_SNAP},
+    {CCD_Clock_Poll, CCD_PROBE_CLOCK},
+    {CCD_Fault_Poll, CCD_PROBE_FAULT},
+    {CCD_Config_Poll, CCD_PROBE_CONFIG},
+    {CCD_Temp_Poll, CCD_PROBE_TEMP},
+    {CCD_AdcCal_Poll, CCD_PROBE_ADCCAL},
+    {CCD_Selftest_Poll, CCD_PROBE_SELFTEST},
+};
+#define CCD_STAGE_COUNT (sizeof(ccd_stages) / sizeof(ccd_stages[0]))
+
+// Between passes the core sleeps until an interrupt: a frame, a command, a
+// TX completion, or the 1 ms HAL tick the timed stages run from. Exception
+// entry and return set the event register, so when one came in during the
+// pass the WFE returns at once and its work gets the next pass instead of
+// waiting for the tick. A mode switch or a benchmark (which paces frames
+// from the loop) keeps it spinning, and so does the ETH build, whose lwIP
+// receive path is polled.
+static void CCD_Loop_Idle(void) {
+#if !CCD_ETH
+  if (!mode_update_pending && !CCD_Bench_Running()) {
+    __WFE();
+  }
+#endif
 }
 /* USER CODE END 0 */
 
@@ -123,7 +455,7 @@ void Send_CCD_Frame_Binary(void) {
 int main(void) {
 
   /* USER CODE BEGIN 1 */
-
+  CCD_Mem_Init(); // Paint the stack before anything runs deep on it
   /* USER CODE END 1 */
 
   /* MPU Configuration--------------------------------------------------------*/
@@ -136,14 +468,38 @@ int main(void) {
   HAL_Init();
 
   /* USER CODE BEGIN Init */
-
+#if CCD_CACHE_ENABLE
+  // Caches on after MPU_Config. DMA targets get explicit maintenance
+  // (CCD_DCACHE_INVALIDATE); RAM_D2 buffers stay non-cacheable.
+  SCB_EnableICache();
+  SCB_EnableDCache();
+#endif
   /* USER CODE END Init */
 
   /* Configure the system clock */
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
+  if (!CCD_Clock_Check()) {
+    Error_Handler();
+  }
 
+  // Transport state must exist before USB can call back into it
+  CCD_Time_Init();
+  CCD_Probe_Init();
+#if CCD_ITM_TRACE
+  CCD_Trace_Init();
+#endif
+  CCD_Fault_Init();
+  CCD_Crc_Init();
+  FrameRing_Init();
+  UsbTx_Init();
+  CCD_Proc_Init();
+  CCD_Match_Init();
+#if CCD_MODEL
+  CCD_Model_Init();
+#endif
+  CCD_Burst_Init();
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
@@ -156,22 +512,41 @@ int main(void) {
   MX_TIM4_Init();
   MX_TIM5_Init();
   /* USER CODE BEGIN 2 */
+#if CCD_ETH
+  // Generated as an MX_ call with the LWIP middleware; kept here so the
+  // USB-only build links without it
+  MX_LWIP_Init();
+  CCD_Eth_Init();
+#endif
+#if CCD_BURST_PSRAM
+  // MX_QUADSPI_Init() is generated above with the QUADSPI peripheral
+  if (!CCD_PSRAM_Init()) {
+    Error_Handler();
+  }
+#endif
+
+  // ========== FRAME RING DMA ==========
+  // DMA fills the ring's write slot, USB drains completed slots in order.
+  // ICG period = CCD_BUFFER_SIZE pixel periods (exact sample count, checked
+  // in ccd_timing.h). TIM4 is hardware-slaved to TIM2
 
-  // ========== DOUBLE-BUFFER DMA ==========
-  // Two buffers swap automatically: while DMA writes to one, CPU reads the
-  // other ICG period = 886560 = 3694 x 240 (exact sample count) TIM4 is
-  // hardware-slaved to TIM2
+  // Levels from ccd_irq.h: the ICG re-arm and the SH preload above the
+  // frame-complete handoff, USB below both, and the frame work they leave
+  // to PendSV below everything
+  HAL_NVIC_SetPriority(TIM2_IRQn, CCD_IRQ_PRIO_TIMING, 0);
+  HAL_NVIC_EnableIRQ(TIM2_IRQn);
+
+  // TIM5 update only runs while an exposure change waits for its ICG
+  HAL_NVIC_SetPriority(TIM5_IRQn, CCD_IRQ_PRIO_TIMING, 0);
+  HAL_NVIC_EnableIRQ(TIM5_IRQn);
 
-  // HIGH Priority for DMA for stable data transfer
-  HAL_NVIC_SetPriority(DMA1_Stream0_IRQn, 4, 0);
+  HAL_NVIC_SetPriority(DMA1_Stream0_IRQn, CCD_IRQ_PRIO_DMA, 0);
   HAL_NVIC_EnableIRQ(DMA1_Stream0_IRQn);
 
-  // Lower priority for TIM2 ICG pulses
-  HAL_NVIC_SetPriority(TIM2_IRQn, 5, 0);
-  HAL_NVIC_EnableIRQ(TIM2_IRQn);
+  HAL_NVIC_SetPriority(PendSV_IRQn, CCD_IRQ_PRIO_DEFER, 0);
 
-  // Wait for USB to enumerate
-  HAL_Delay(3000);
+  // No wait for the USB enumeration: the sensor runs from here, and frames
+  // go out once the host opens the port (Send_CCD_Frames())
 
   // ========== CRITICAL H7 FIXES (from ST Community forum) ==========
   // 1. Timer PSC is preloaded - first cycle runs at PSC=0 without this fix
@@ -195,8 +570,43 @@ int main(void) {
   // 2. ADC BOOST mode required when ADC clock > 20MHz (we have ~30MHz)
   MODIFY_REG(ADC1->CR, ADC_CR_BOOST_Msk, (0x3UL << ADC_CR_BOOST_Pos));
 
-  // ADC calibration
-  HAL_ADCEx_Calibration_Start(&hadc1, ADC_CALIB_OFFSET, ADC_SINGLE_ENDED);
+  // ADC2 for multi-sampling ("I2"/"I4"), then the offset and linearity
+  // calibration of both, from flash if it still holds at the die
+  // temperature ADC3 reads (ccd_adccal.h, ccd_temp.h)
+  CCD_Acq_InitSlaveAdc();
+  CCD_Temp_Init();
+#if CCD_REF_PD
+  CCD_Ref_Init(); // ADC3's regular group, started by CCD_Acq_ApplySampling()
+#endif
+#if CCD_DIN
+  CCD_Din_Init(); // Before the capture: the ICG interrupt reads the port
+#endif
+  CCD_AdcCal_Init();
+
+  // Sample sources ("V<d>"): SPI4 and the TIM4 CNVST/read chain of the
+  // external ADC, the synthetic line
+  CCD_Acq_InitSources();
+  CCD_Acq_InitIcgCounter(); // Hardware ICG count behind ccd_acq_stats.missed
+  CCD_Selftest_Init();      // TIM3/4/5 TRGO into the capture timers
+#if CCD_ENCODER
+  CCD_Line_Init(); // TIM8 counts from here; mode 3 takes it with "ME<n>"
+#endif
+#if CCD_JPEG
+  CCD_Jpeg_Init(); // Codec tables and MDMA; previews with CCD_TELEM_JPEG
+#endif
+#if CCD_LINE_SYNC
+  CCD_Mains_Init(); // Crossings from here; "Y3" takes the frames to them
+#endif
+#if CCD_SHUTTER
+  CCD_Shutter_Init(); // Open; CCD_TELEM_SHUTTER starts the schedule
+#endif
+
+  // Stored ADC sample point ("FS"), else the MX_ADC1_Init/MX_TIM4_Init one
+  CCD_Phase_Init();
+  CCD_Acq_ApplySampling();
+
+  // Settings saved in flash, if any, over the defaults above
+  CCD_Config_Init();
 
   // ========== SYNCHRONIZED STARTUP ==========
   // Step 1: DMA is NO LONGER started here. It will start on the first ICG
@@ -209,112 +619,59 @@ int main(void) {
   __HAL_TIM_SET_COUNTER(&htim4, 0);
   __HAL_TIM_SET_COUNTER(&htim5, 0);
 
-  // Step 3: Enable TIM2 update interrupt for ICG
-  __HAL_TIM_ENABLE_IT(&htim2, TIM_IT_UPDATE);
+  // Step 3: The TIM2 update interrupt (ICG) is enabled by
+  // CCD_Acq_StartContinuous() only when the restart path needs it
 
   // Step 4: Start ONLY Master Clock (fM) running continuously
   HAL_TIM_PWM_Start(&htim3, TIM_CHANNEL_1);
 
   // Initial Start for Continuous Modes (0 and 2)
-  if (ccd_mode != 1) {
-    // Start other timers for continuous mode
-    HAL_TIM_PWM_Start(&htim5, TIM_CHANNEL_3); // SH
-    HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_4); // ADC Trigger
-    HAL_TIM_PWM_Start(&htim2, TIM_CHANNEL_1); // ICG
+  if (ccd_mode != CCD_MODE_ONESHOT) {
+    // Arm DMA before the timers so the first trigger lands in pixel 0
+    CCD_Acq_StartContinuous();
+  }
 
-    // Start DMA Loop
-    HAL_ADC_Start_DMA(&hadc1, (uint32_t *)Buffer_A, CCD_BUFFER_SIZE);
+  // Start other timers; mode 1 parks the chain again until a snap
+  HAL_TIM_PWM_Start(&htim5, TIM_CHANNEL_3); // SH
+  HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_4); // ADC Trigger
+  HAL_TIM_PWM_Start(&htim2, TIM_CHANNEL_1); // ICG
+  CCD_Acq_AlignTimers();
+  if (ccd_mode == CCD_MODE_ONESHOT) {
+    CCD_Acq_StartSnap();
   }
 
+  // Every interrupt level as ccd_irq.h has it, whatever the inits set
+  CCD_Irq_Check();
+
+  // Capture supervisor, and the watchdog from here on (ccd_watch.h)
+  CCD_Watch_Init();
+  CCD_Selftest_Start(); // The boot timing checked (ccd_selftest.h)
+
   /* USER CODE END 2 */
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
   while (1) {
 
-    // --- MODE SWITCHING LOGIC ---
-    if (mode_update_pending) {
-      mode_update_pending = 0;
-
-      // 1. Stop Everything
-      HAL_TIM_PWM_Stop(&htim2, TIM_CHANNEL_1);
-      HAL_TIM_PWM_Stop(&htim5, TIM_CHANNEL_3);
-      HAL_TIM_PWM_Stop(&htim4, TIM_CHANNEL_4);
-      HAL_ADC_Stop_DMA(&hadc1);
-
-      // 2. Reconfigure TIM5 (SH) based on mode
-      if (ccd_mode == 2) {
-        // Full Integration (Long Exposure)
-        __HAL_TIM_SET_AUTORELOAD(&htim5, 886560 - 1);
-        __HAL_TIM_SET_COMPARE(&htim5, TIM_CHANNEL_3, 1200 - 1);
-      } else {
-        // Fast Shutter (20us) - Modes 0 and 1
-        __HAL_TIM_SET_AUTORELOAD(&htim5, 2400 - 1);
-        __HAL_TIM_SET_COMPARE(&htim5, TIM_CHANNEL_3, 480 - 1);
-      }
-
-      // 3. Reset Counters
-      __HAL_TIM_SET_COUNTER(&htim2, 0);
-      __HAL_TIM_SET_COUNTER(&htim3, 0);
-      __HAL_TIM_SET_COUNTER(&htim4, 0);
-      __HAL_TIM_SET_COUNTER(&htim5, 0);
-
-      // 4. Restart if Continuous (Mode 0 or 2)
-      if (ccd_mode == 0 || ccd_mode == 2) {
-        __HAL_ADC_CLEAR_FLAG(&hadc1, ADC_FLAG_OVR);
-        HAL_ADC_Start_DMA(&hadc1, (uint32_t *)Buffer_A, CCD_BUFFER_SIZE);
-
-        HAL_TIM_PWM_Start(&htim5, TIM_CHANNEL_3);
-        HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_4);
-        HAL_TIM_PWM_Start(&htim2, TIM_CHANNEL_1);
-      }
+    // Frames arrive from the TIM2/DMA ISRs in every mode; in mode 1 a snap
+    // ("J", CCD_TRIG_IN) starts the parked chain from its interrupt. Slots
+    // stay owned by the transport until the TX completion releases them,
+    // so the DMA can never overwrite a frame mid-send.
+    frame_ready = 0;
+    uint32_t start = DWT->CYCCNT;
+    for (uint32_t i = 0; i < CCD_STAGE_COUNT; i++) {
+      uint32_t t = DWT->CYCCNT;
+      ccd_stages[i].run();
+      CCD_Probe_End(ccd_stages[i].probe, t);
     }
-
-    // --- EXECUTION LOGIC ---
-
-    if (ccd_mode == 1) {
-      // === MODE 1: ONE-SHOT STABLE ===
-
-      // 1. Prepare DMA
-      __HAL_ADC_CLEAR_FLAG(&hadc1, ADC_FLAG_OVR);
-      HAL_ADC_Start_DMA(&hadc1, (uint32_t *)Buffer_A, CCD_BUFFER_SIZE);
-
-      // 2. Reset Counters
-      __HAL_TIM_SET_COUNTER(&htim2, 0);
-      __HAL_TIM_SET_COUNTER(&htim4, 0);
-      __HAL_TIM_SET_COUNTER(&htim5, 0);
-
-      // 3. Start Timers
-      HAL_TIM_PWM_Start(&htim5, TIM_CHANNEL_3);
-      HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_4);
-      HAL_TIM_PWM_Start(&htim2, TIM_CHANNEL_1);
-
-      // 4. Wait for Frame
-      while (!frame_ready) {
-        if (mode_update_pending)
-          break; // Exit if mode changed
-      }
-
-      // 5. Stop Timers
-      HAL_TIM_PWM_Stop(&htim2, TIM_CHANNEL_1);
-      HAL_TIM_PWM_Stop(&htim5, TIM_CHANNEL_3);
-      HAL_TIM_PWM_Stop(&htim4, TIM_CHANNEL_4);
-
-      if (frame_ready) {
-        frame_ready = 0;
-        Send_CCD_Frame_Binary();
-      }
-
-    } else {
-      // === MODE 0 & 2: CONTINUOUS ===
-
-      // Just wait for interrupt to set flag
-      if (frame_ready) {
-        frame_ready = 0;
-        Send_CCD_Frame_Binary();
-      }
+    CCD_Probe_End(CCD_PROBE_LOOP, start);
+    uint32_t cycles = DWT->CYCCNT - start;
+    if (cycles > loop_max_cycles) {
+      loop_max_cycles = cycles;
     }
 
+    CCD_Loop_Idle();
+
     // Optional delay
     // HAL_Delay(1);
 
@@ -339,7 +696,10 @@ void SystemClock_Config(void) {
 
   /** Configure the main internal regulator output voltage
    */
-  __HAL_PWR_VOLTAGESCALING_CONFIG(PWR_REGULATOR_VOLTAGE_SCALE3);
+#if CCD_CLOCK_PROFILE == 480
+  __HAL_RCC_SYSCFG_CLK_ENABLE(); // VOS0 needs the SYSCFG overdrive bit
+#endif
+  __HAL_PWR_VOLTAGESCALING_CONFIG(CCD_CLK_VOS);
 
   while (!__HAL_PWR_GET_FLAG(PWR_FLAG_VOSRDY)) {
   }
@@ -352,9 +712,9 @@ void SystemClock_Config(void) {
   RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
   RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSE;
   RCC_OscInitStruct.PLL.PLLM = 5;
-  RCC_OscInitStruct.PLL.PLLN = 48;
+  RCC_OscInitStruct.PLL.PLLN = CCD_CLK_PLLN;
   RCC_OscInitStruct.PLL.PLLP = 2;
-  RCC_OscInitStruct.PLL.PLLQ = 5;
+  RCC_OscInitStruct.PLL.PLLQ = CCD_CLK_PLLQ; // 48 MHz USB
   RCC_OscInitStruct.PLL.PLLR = 2;
   RCC_OscInitStruct.PLL.PLLRGE = RCC_PLL1VCIRANGE_2;
   RCC_OscInitStruct.PLL.PLLVCOSEL = RCC_PLL1VCOWIDE;
@@ -370,13 +730,14 @@ void SystemClock_Config(void) {
                                 RCC_CLOCKTYPE_D3PCLK1 | RCC_CLOCKTYPE_D1PCLK1;
   RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_PLLCLK;
   RCC_ClkInitStruct.SYSCLKDivider = RCC_SYSCLK_DIV1;
-  RCC_ClkInitStruct.AHBCLKDivider = RCC_HCLK_DIV1;
-  RCC_ClkInitStruct.APB3CLKDivider = RCC_APB3_DIV1;
-  RCC_ClkInitStruct.APB1CLKDivider = RCC_APB1_DIV1;
-  RCC_ClkInitStruct.APB2CLKDivider = RCC_APB2_DIV1;
-  RCC_ClkInitStruct.APB4CLKDivider = RCC_APB4_DIV1;
-
-  if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_2) != HAL_OK) {
+  RCC_ClkInitStruct.AHBCLKDivider = CCD_CLK_HPRE;
+  RCC_ClkInitStruct.APB3CLKDivider = CCD_CLK_APB3_DIV;
+  RCC_ClkInitStruct.APB1CLKDivider = CCD_CLK_APB1_DIV;
+  RCC_ClkInitStruct.APB2CLKDivider = CCD_CLK_APB2_DIV;
+  RCC_ClkInitStruct.APB4CLKDivider = CCD_CLK_APB4_DIV;
+
+  if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, CCD_CLK_FLASH_LATENCY) !=
+      HAL_OK) {
     Error_Handler();
   }
 }
@@ -430,7 +791,7 @@ static void MX_ADC1_Init(void) {
 
   /** Configure Regular Channel
    */
-  sConfig.Channel = ADC_CHANNEL_15;
+  sConfig.Channel = CCD_ADC_CHANNEL;
   sConfig.Rank = ADC_REGULAR_RANK_1;
   sConfig.SamplingTime = ADC_SAMPLETIME_2CYCLES_5;
   sConfig.SingleDiff = ADC_SINGLE_ENDED;
@@ -464,9 +825,10 @@ static void MX_TIM2_Init(void) {
 
   /* USER CODE END TIM2_Init 1 */
   htim2.Instance = TIM2;
-  htim2.Init.Prescaler = 0;
+  htim2.Init.Prescaler = CCD_TIM2_PSC;
   htim2.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim2.Init.Period = 886560 - 1; // 3694 samples × 240 = exact DMA buffer match
+  htim2.Init.Period =
+      CCD_TIM2_ARR; // 3694 samples × pixel period = exact DMA buffer match
   htim2.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim2.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
   if (HAL_TIM_Base_Init(&htim2) != HAL_OK) {
@@ -484,15 +846,15 @@ static void MX_TIM2_Init(void) {
     Error_Handler();
   }
   sConfigOC.OCMode = TIM_OCMODE_PWM1;
-  sConfigOC.Pulse = 1200 - 1;
-  sConfigOC.OCPolarity =
-      TIM_OCPOLARITY_LOW; // Original working value (unchanged)
+  sConfigOC.Pulse = CCD_TIM2_CCR1; // ICG pulse
+  sConfigOC.OCPolarity = CCD_SENSOR_ICG_LOW ? TIM_OCPOLARITY_LOW
+                                            : TIM_OCPOLARITY_HIGH;
   sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
   if (HAL_TIM_PWM_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_1) != HAL_OK) {
     Error_Handler();
   }
   // CRITICAL FIX: TIM_TRGO_UPDATE triggers when counter overflows (counter = 0)
-  // This happens at the START of ICG pulse, which is correct for TCD1304
+  // This happens at the START of ICG pulse, which is correct for the sensor
   // TIM4 will reset at the start of each ICG period, ensuring ADC samples align
   // with readout window
   sMasterConfig.MasterOutputTrigger = TIM_TRGO_UPDATE;
@@ -501,6 +863,10 @@ static void MX_TIM2_Init(void) {
     Error_Handler();
   }
   /* USER CODE BEGIN TIM2_Init 2 */
+  // Strobe on CH3 (CH4 is its second edge): active high, off until "S"
+  LL_TIM_OC_SetPolarity(TIM2, LL_TIM_CHANNEL_CH3, LL_TIM_OCPOLARITY_HIGH);
+  CCD_Acq_SetStrobe(0, 0);
+  LL_TIM_CC_EnableChannel(TIM2, LL_TIM_CHANNEL_CH3);
 
   /* USER CODE END TIM2_Init 2 */
   HAL_TIM_MspPostInit(&htim2);
@@ -525,9 +891,9 @@ static void MX_TIM3_Init(void) {
 
   /* USER CODE END TIM3_Init 1 */
   htim3.Instance = TIM3;
-  htim3.Init.Prescaler = 0;
+  htim3.Init.Prescaler = CCD_TIM3_PSC;
   htim3.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim3.Init.Period = 60 - 1;
+  htim3.Init.Period = CCD_TIM3_ARR; // fM
   htim3.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim3.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
   if (HAL_TIM_Base_Init(&htim3) != HAL_OK) {
@@ -540,13 +906,22 @@ static void MX_TIM3_Init(void) {
   if (HAL_TIM_PWM_Init(&htim3) != HAL_OK) {
     Error_Handler();
   }
+#if CCD_FM_LOCK
+  // fM restarts with every TIM2 TRGO, like TIM4/TIM5 (CCD_FM_LOCK)
+  TIM_SlaveConfigTypeDef sSlaveConfig = {0};
+  sSlaveConfig.SlaveMode = TIM_SLAVEMODE_RESET;
+  sSlaveConfig.InputTrigger = TIM_TS_ITR1;
+  if (HAL_TIM_SlaveConfigSynchro(&htim3, &sSlaveConfig) != HAL_OK) {
+    Error_Handler();
+  }
+#endif
   sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
   sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
   if (HAL_TIMEx_MasterConfigSynchronization(&htim3, &sMasterConfig) != HAL_OK) {
     Error_Handler();
   }
   sConfigOC.OCMode = TIM_OCMODE_PWM1;
-  sConfigOC.Pulse = 30;
+  sConfigOC.Pulse = CCD_TIM3_CCR1;
   sConfigOC.OCPolarity =
       TIM_OCPOLARITY_HIGH; // REVERTED: Original working value
   sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
@@ -579,9 +954,9 @@ static void MX_TIM4_Init(void) {
 
   /* USER CODE END TIM4_Init 1 */
   htim4.Instance = TIM4;
-  htim4.Init.Prescaler = 0;
+  htim4.Init.Prescaler = CCD_TIM4_PSC;
   htim4.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim4.Init.Period = 240 - 1;
+  htim4.Init.Period = CCD_TIM4_ARR; // One pixel (CCD_SENSOR_FM_PER_PIXEL)
   htim4.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim4.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
   if (HAL_TIM_Base_Init(&htim4) != HAL_OK) {
@@ -594,7 +969,9 @@ static void MX_TIM4_Init(void) {
   if (HAL_TIM_PWM_Init(&htim4) != HAL_OK) {
     Error_Handler();
   }
-  sSlaveConfig.SlaveMode = TIM_SLAVEMODE_RESET;
+  // Stopped until the first TIM2 TRGO starts it, then reset by every one, so
+  // no ADC trigger fires before the ICG period it belongs to
+  sSlaveConfig.SlaveMode = TIM_SLAVEMODE_COMBINED_RESETTRIGGER;
   sSlaveConfig.InputTrigger = TIM_TS_ITR1;
   if (HAL_TIM_SlaveConfigSynchro(&htim4, &sSlaveConfig) != HAL_OK) {
     Error_Handler();
@@ -605,7 +982,7 @@ static void MX_TIM4_Init(void) {
     Error_Handler();
   }
   sConfigOC.OCMode = TIM_OCMODE_PWM1;
-  sConfigOC.Pulse = 60;
+  sConfigOC.Pulse = CCD_TIM4_CCR4;
   sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
   sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
   if (HAL_TIM_PWM_ConfigChannel(&htim4, &sConfigOC, TIM_CHANNEL_4) != HAL_OK) {
@@ -637,11 +1014,11 @@ static void MX_TIM5_Init(void) {
 
   /* USER CODE END TIM5_Init 1 */
   htim5.Instance = TIM5;
-  htim5.Init.Prescaler = 0;
+  htim5.Init.Prescaler = CCD_TIM5_PSC;
   htim5.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim5.Init.Period = 2400 - 1; // 20us integration time (50kHz)
+  htim5.Init.Period = CCD_TIM5_ARR; // Integration time (20us default)
   htim5.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
-  htim5.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  htim5.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
   if (HAL_TIM_Base_Init(&htim5) != HAL_OK) {
     Error_Handler();
   }
@@ -664,13 +1041,11 @@ static void MX_TIM5_Init(void) {
     Error_Handler();
   }
   sConfigOC.OCMode = TIM_OCMODE_PWM1;
-  sConfigOC.Pulse = 480 - 1; // 4us Pulse Width
+  sConfigOC.Pulse = CCD_TIM5_CCR3; // SH pulse width (4us default)
 
-  // TESTING: Changed to LOW for Active-Low at CCD (per TCD1304 datasheet
-  // requirement) STM32 outputs LOW during pulse → CCD sees LOW (Active-Low
-  // signal)
-  sConfigOC.OCPolarity =
-      TIM_OCPOLARITY_LOW; // Changed from HIGH to match datasheet
+  // Active low at the pin on the TCD1304 board (ccd_sensor.h)
+  sConfigOC.OCPolarity = CCD_SENSOR_SH_LOW ? TIM_OCPOLARITY_LOW
+                                           : TIM_OCPOLARITY_HIGH;
   sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
   if (HAL_TIM_PWM_ConfigChannel(&htim5, &sConfigOC, TIM_CHANNEL_3) != HAL_OK) {
     Error_Handler();
@@ -691,7 +1066,7 @@ static void MX_DMA_Init(void) {
 
   /* DMA interrupt init */
   /* DMA1_Stream0_IRQn interrupt configuration */
-  HAL_NVIC_SetPriority(DMA1_Stream0_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(DMA1_Stream0_IRQn, CCD_IRQ_PRIO_DMA, 0);
   HAL_NVIC_EnableIRQ(DMA1_Stream0_IRQn);
 }
 
@@ -712,6 +1087,42 @@ static void MX_GPIO_Init(void) {
   __HAL_RCC_GPIOD_CLK_ENABLE();
 
   /* USER CODE BEGIN MX_GPIO_Init_2 */
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  // Burst trigger input. The interrupt stays enabled; ccd_burst.c ignores
+  // edges unless "XE1" selected the pin.
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+  GPIO_InitStruct.Pin = CCD_TRIG_IN_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING;
+  GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+  HAL_GPIO_Init(CCD_TRIG_IN_GPIO_Port, &GPIO_InitStruct);
+  HAL_NVIC_SetPriority(CCD_TRIG_IN_EXTI_IRQn, CCD_IRQ_PRIO_TRIG, 0);
+  HAL_NVIC_EnableIRQ(CCD_TRIG_IN_EXTI_IRQn);
+
+  // Mode 3 frame start (TIM2_ETR). Only used while TIM2 is in trigger mode.
+  GPIO_InitStruct.Pin = CCD_EXT_TRIG_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+  GPIO_InitStruct.Alternate = GPIO_AF1_TIM2;
+  HAL_GPIO_Init(CCD_EXT_TRIG_GPIO_Port, &GPIO_InitStruct);
+
+  // Sync master output (TIM2_CH2), driven only after "Y1"
+  GPIO_InitStruct.Pin = CCD_SYNC_OUT_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  GPIO_InitStruct.Alternate = GPIO_AF1_TIM2;
+  HAL_GPIO_Init(CCD_SYNC_OUT_GPIO_Port, &GPIO_InitStruct);
+
+#ifdef CCD_STROBE_Pin
+  // Strobe output (TIM2_CH3), low until "S" sets a pulse
+  GPIO_InitStruct.Pin = CCD_STROBE_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  GPIO_InitStruct.Alternate = GPIO_AF1_TIM2;
+  HAL_GPIO_Init(CCD_STROBE_GPIO_Port, &GPIO_InitStruct);
+#endif
 
   /* USER CODE END MX_GPIO_Init_2 */
 }
@@ -732,8 +1143,12 @@ void MPU_Config(void) {
    */
   MPU_InitStruct.Enable = MPU_REGION_ENABLE;
   MPU_InitStruct.Number = MPU_REGION_NUMBER0;
-  MPU_InitStruct.BaseAddress = 0x30000000;     /* RAM_D2 (SRAM1+2+3) */
+  MPU_InitStruct.BaseAddress = 0x30000000; /* RAM_D2 (SRAM1+2+3) */
+#if CCD_CACHE_ENABLE
+  MPU_InitStruct.Size = MPU_REGION_SIZE_32KB; /* .sram3 DMA/USB buffers only */
+#else
   MPU_InitStruct.Size = MPU_REGION_SIZE_512KB; /* Covers all D2 RAM */
+#endif
   MPU_InitStruct.SubRegionDisable = 0x00;
   MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL0;
   MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
@@ -743,6 +1158,16 @@ void MPU_Config(void) {
   MPU_InitStruct.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
 
   HAL_MPU_ConfigRegion(&MPU_InitStruct);
+#if CCD_BURST_PSRAM
+  // QUADSPI window of the burst PSRAM: cached for the drain reads, written
+  // only through indirect commands (ccd_psram.c)
+  MPU_InitStruct.Number = MPU_REGION_NUMBER1;
+  MPU_InitStruct.BaseAddress = CCD_PSRAM_BASE;
+  MPU_InitStruct.Size = MPU_REGION_SIZE_8MB;
+  MPU_InitStruct.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
+  MPU_InitStruct.IsCacheable = MPU_ACCESS_CACHEABLE;
+  HAL_MPU_ConfigRegion(&MPU_InitStruct);
+#endif
   /* Enables the MPU */
   HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
 }
@@ -763,17 +1188,8 @@ void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim) {
     HAL_IncTick();
   }
   /* USER CODE BEGIN Callback 1 */
-  // TIM2 (ICG) interrupt: Frame Start
-  // This interrupt validates the start of a new frame.
-  if (htim->Instance == TIM2) { // ICG interrupt
-    // Mode 0/2: Continuous - Restart DMA here if using Normal Mode
-    if (ccd_mode != 1) {
-      // Clear OVR
-      __HAL_ADC_CLEAR_FLAG(&hadc1, ADC_FLAG_OVR);
-      // Restart DMA
-      HAL_ADC_Start_DMA(&hadc1, (uint32_t *)Buffer_A, CCD_BUFFER_SIZE);
-    }
-  }
+  // TIM2 (ICG) never gets here: TIM2_IRQHandler re-arms the DMA at
+  // register level (CCD_Acq_IcgIRQ) without going through the HAL
   /* USER CODE END Callback 1 */
 }
 
@@ -784,9 +1200,7 @@ void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim) {
 void Error_Handler(void) {
   /* USER CODE BEGIN Error_Handler_Debug */
   /* User can add his own implementation to report the HAL error return state */
-  __disable_irq();
-  while (1) {
-  }
+  CCD_Fault_Reset(CCD_FAULT_ERROR);
   /* USER CODE END Error_Handler_Debug */
 }
 #ifdef USE_FULL_ASSERT
@@ -22,6 +22,18 @@
 #include "stm32h7xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "ccd_acq.h"
+#include "ccd_burst.h"
+#include "ccd_din.h"
+#include "ccd_fault.h"
+#include "ccd_line.h"
+#include "ccd_mains.h"
+#include "ccd_probe.h"
+#include "ccd_seq.h"
+#include "ccd_snap.h"
+#include "ccd_time.h"
+#include "stm32h7xx_ll_exti.h"
+#include "stm32h7xx_ll_tim.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -59,6 +71,7 @@ extern PCD_HandleTypeDef hpcd_USB_OTG_FS;
 extern PCD_HandleTypeDef hpcd_USB_OTG_HS;
 extern DMA_HandleTypeDef hdma_adc1;
 extern TIM_HandleTypeDef htim2;
+extern TIM_HandleTypeDef htim5;
 extern TIM_HandleTypeDef htim6;
 
 /* USER CODE BEGIN EV */
@@ -89,7 +102,7 @@ void NMI_Handler(void)
 void HardFault_Handler(void)
 {
   /* USER CODE BEGIN HardFault_IRQn 0 */
-
+  CCD_Fault_Reset(CCD_FAULT_HARD);
   /* USER CODE END HardFault_IRQn 0 */
   while (1)
   {
@@ -175,7 +188,10 @@ void DebugMon_Handler(void)
 void PendSV_Handler(void)
 {
   /* USER CODE BEGIN PendSV_IRQn 0 */
-
+  // Only the capture interrupts pend it: their deferred frame work
+  uint32_t t = DWT->CYCCNT;
+  CCD_Acq_DeferredIRQ();
+  CCD_Probe_End(CCD_PROBE_DEFER, t);
   /* USER CODE END PendSV_IRQn 0 */
   /* USER CODE BEGIN PendSV_IRQn 1 */
 
@@ -209,11 +225,17 @@ void SysTick_Handler(void)
 void DMA1_Stream0_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Stream0_IRQn 0 */
+  uint32_t t = DWT->CYCCNT;
+  // Restart path: frame complete handled at register level
+  if (CCD_Acq_DmaIRQ()) {
+    CCD_Probe_End(CCD_PROBE_DMA, t);
+    return;
+  }
 
   /* USER CODE END DMA1_Stream0_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_adc1);
   /* USER CODE BEGIN DMA1_Stream0_IRQn 1 */
-
+  CCD_Probe_End(CCD_PROBE_DMA, t);
   /* USER CODE END DMA1_Stream0_IRQn 1 */
 }
 
@@ -223,6 +245,15 @@ void DMA1_Stream0_IRQHandler(void)
 void TIM2_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM2_IRQn 0 */
+  // ICG is the only TIM2 interrupt: re-arm the DMA directly and skip
+  // HAL_TIM_IRQHandler and the shared PeriodElapsed dispatch
+  uint32_t t = DWT->CYCCNT;
+  if (LL_TIM_IsActiveFlag_UPDATE(TIM2)) {
+    LL_TIM_ClearFlag_UPDATE(TIM2);
+    CCD_Acq_IcgIRQ();
+  }
+  CCD_Probe_End(CCD_PROBE_ICG, t);
+  return;
 
   /* USER CODE END TIM2_IRQn 0 */
   HAL_TIM_IRQHandler(&htim2);
@@ -231,6 +262,31 @@ void TIM2_IRQHandler(void)
   /* USER CODE END TIM2_IRQn 1 */
 }
 
+/**
+  * @brief This function handles TIM5 global interrupt.
+  */
+void TIM5_IRQHandler(void)
+{
+  /* USER CODE BEGIN TIM5_IRQn 0 */
+  // Only enabled for exposure changes (CCD_Acq_SetExposure) and long
+  // exposures (CCD_Acq_Expose), which also take CC3
+  uint32_t t = DWT->CYCCNT;
+  if (LL_TIM_IsEnabledIT_CC3(TIM5) && LL_TIM_IsActiveFlag_CC3(TIM5)) {
+    CCD_Acq_ShPulseIRQ();
+  }
+  if (LL_TIM_IsActiveFlag_UPDATE(TIM5)) {
+    CCD_Acq_ShIRQ();
+  }
+  CCD_Probe_End(CCD_PROBE_SH, t);
+  return;
+
+  /* USER CODE END TIM5_IRQn 0 */
+  HAL_TIM_IRQHandler(&htim5);
+  /* USER CODE BEGIN TIM5_IRQn 1 */
+
+  /* USER CODE END TIM5_IRQn 1 */
+}
+
 /**
   * @brief This function handles TIM6 global interrupt, DAC1_CH1 and DAC1_CH2 underrun error interrupts.
   */
@@ -251,11 +307,11 @@ void TIM6_DAC_IRQHandler(void)
 void OTG_HS_IRQHandler(void)
 {
   /* USER CODE BEGIN OTG_HS_IRQn 0 */
-
+  uint32_t t = DWT->CYCCNT;
   /* USER CODE END OTG_HS_IRQn 0 */
   HAL_PCD_IRQHandler(&hpcd_USB_OTG_HS);
   /* USER CODE BEGIN OTG_HS_IRQn 1 */
-
+  CCD_Probe_End(CCD_PROBE_USB_HS, t);
   /* USER CODE END OTG_HS_IRQn 1 */
 }
 
@@ -265,14 +321,71 @@ void OTG_HS_IRQHandler(void)
 void OTG_FS_IRQHandler(void)
 {
   /* USER CODE BEGIN OTG_FS_IRQn 0 */
-
+  uint32_t t = DWT->CYCCNT;
   /* USER CODE END OTG_FS_IRQn 0 */
   HAL_PCD_IRQHandler(&hpcd_USB_OTG_FS);
   /* USER CODE BEGIN OTG_FS_IRQn 1 */
-
+  CCD_Probe_End(CCD_PROBE_USB_FS, t);
   /* USER CODE END OTG_FS_IRQn 1 */
 }
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief This function handles EXTI line0 interrupt (burst / sequence / snap trigger input).
+  */
+void EXTI0_IRQHandler(void)
+{
+  uint32_t t = DWT->CYCCNT;
+  if (__HAL_GPIO_EXTI_GET_IT(CCD_TRIG_IN_Pin)) {
+    __HAL_GPIO_EXTI_CLEAR_IT(CCD_TRIG_IN_Pin);
+    CCD_Burst_PinIRQ();
+    CCD_Seq_PinIRQ();
+    CCD_Snap_PinIRQ();
+  }
+  CCD_Probe_End(CCD_PROBE_TRIG, t);
+}
+
+/**
+  * @brief This function handles TIM7 global interrupt (timestamp wraps).
+  */
+void TIM7_IRQHandler(void)
+{
+  CCD_Time_WrapIRQ();
+}
+
+#if CCD_DIN
+/**
+  * @brief This function handles EXTI lines 5-9 interrupt (digital input edges).
+  */
+void EXTI9_5_IRQHandler(void)
+{
+  if (LL_EXTI_IsActiveFlag_0_31(LL_EXTI_LINE_8)) {
+    CCD_Din_EdgeIRQ();
+  }
+}
+#endif
+
+#if CCD_ENCODER
+/**
+  * @brief This function handles TIM8 update interrupt (line-scan encoder).
+  */
+void TIM8_UP_TIM13_IRQHandler(void)
+{
+  if (LL_TIM_IsActiveFlag_UPDATE(TIM8)) {
+    CCD_Line_EncoderIRQ();
+  }
+}
+#endif
+
+#if CCD_LINE_SYNC
+/**
+  * @brief This function handles TIM8 capture compare interrupt (mains sync).
+  */
+void TIM8_CC_IRQHandler(void)
+{
+  CCD_Mains_IRQ();
+}
+#endif
+
 /* USER CODE END 1 */
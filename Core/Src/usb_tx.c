@@ -0,0 +1,158 @@
+/**
+ ******************************************************************************
+ * @file           : usb_tx.c
+ * @brief          : Non-blocking, completion-driven USB CDC transmit engine
+ ******************************************************************************
+ */
+
+#include "usb_tx.h"
+#include "ccd_trace.h"
+#include "usbd_cdc_if.h"
+#include <string.h>
+
+#if (USB_TX_QUEUE_LEN & (USB_TX_QUEUE_LEN - 1)) != 0
+#error "USB_TX_QUEUE_LEN must be a power of two"
+#endif
+
+#define TX_MASK (USB_TX_QUEUE_LEN - 1)
+
+// Link state is CPU-only and touched by every completion, so it lives in DTCM
+CCD_DTCM_BSS UsbTx_Link_t usb_tx_fs;
+CCD_DTCM_BSS UsbTx_Link_t usb_tx_hs;
+#if CCD_USB_VENDOR
+CCD_DTCM_BSS UsbTx_Link_t usb_tx_data;
+#endif
+
+static void UsbTx_LinkInit(UsbTx_Link_t *link,
+                           uint8_t (*transmit)(uint8_t *, uint16_t),
+                           IRQn_Type irq) {
+  memset(link, 0, sizeof(*link));
+  link->transmit = transmit;
+  link->irq = irq;
+  link->max_transfer = USB_TX_CHUNK_SIZE;
+}
+
+void UsbTx_Init(void) {
+  UsbTx_LinkInit(&usb_tx_fs, CDC_Transmit_FS, OTG_FS_IRQn);
+  UsbTx_LinkInit(&usb_tx_hs, CDC_Transmit_HS, OTG_HS_IRQn);
+#if CCD_USB_VENDOR
+  UsbTx_LinkInit(&usb_tx_data, Vendor_TransmitData_FS, OTG_FS_IRQn);
+  // One report per transfer: the host reads each as a whole, apart from
+  // the frames on the data endpoint
+  usb_tx_fs.max_transfer = USB_TX_MAX_TRANSFER;
+#endif
+}
+
+// Start the next transfer if the link is idle. Must run with the link's OTG
+// interrupt masked or from that interrupt.
+CCD_ITCM static void UsbTx_Kick(UsbTx_Link_t *link) {
+  if (link->busy || link->tail == link->head) {
+    return;
+  }
+
+  const UsbTx_Desc_t *d = &link->queue[link->tail & TX_MASK];
+  uint32_t chunk = d->len - link->offset;
+  if (chunk > link->max_transfer) {
+    chunk = link->max_transfer;
+  }
+
+  if (link->transmit((uint8_t *)d->buf + link->offset, (uint16_t)chunk) ==
+      USBD_OK) {
+    link->busy = 1;
+    link->inflight = chunk;
+    CCD_TRACE_ARG(CCD_TRACE_TX_START, chunk);
+  } else {
+    // Endpoint busy or not configured: retried on the next completion/poll
+    link->busy_retries++;
+  }
+}
+
+// Queue a buffer. Returns 0 if the queue is full.
+uint8_t UsbTx_Submit(UsbTx_Link_t *link, const uint8_t *buf, uint32_t len,
+                     UsbTx_DoneCallback done, void *ctx) {
+  if ((link->head - link->tail) >= USB_TX_QUEUE_LEN) {
+    link->full++;
+    return 0;
+  }
+  UsbTx_Desc_t *d = &link->queue[link->head & TX_MASK];
+  d->buf = buf;
+  d->len = len;
+  d->done = done;
+  d->ctx = ctx;
+  __DMB();
+  link->head++;
+  return 1;
+}
+
+uint32_t UsbTx_Space(const UsbTx_Link_t *link) {
+  return USB_TX_QUEUE_LEN - (link->head - link->tail);
+}
+
+// Start transmission from the main loop if nothing is in flight
+void UsbTx_Poll(UsbTx_Link_t *link) {
+  if (link->busy || link->tail == link->head) {
+    return;
+  }
+  HAL_NVIC_DisableIRQ(link->irq);
+  UsbTx_Kick(link);
+  HAL_NVIC_EnableIRQ(link->irq);
+}
+
+// IN transfer complete: retire finished buffers and chain the next transfer
+CCD_ITCM void UsbTx_OnComplete(UsbTx_Link_t *link) {
+  if (!link->busy) {
+    return;
+  }
+  CCD_TRACE_ARG(CCD_TRACE_TX_DONE, link->inflight);
+  link->busy = 0;
+  link->offset += link->inflight;
+  link->bytes_sent += link->inflight;
+  link->transfers++;
+  link->inflight = 0;
+
+  UsbTx_Desc_t d = link->queue[link->tail & TX_MASK];
+  if (link->offset >= d.len) {
+    link->offset = 0;
+    link->tail++;
+    if (d.done != NULL) {
+      d.done(d.ctx, d.len);
+    }
+  }
+  UsbTx_Kick(link);
+}
+
+#if CCD_USB_ISO
+// Isochronous packet the host did not collect: the rest of its buffer is
+// worthless to the host, so it is handed back unsent and the next buffer
+// starts in the next frame, in time
+CCD_ITCM void UsbTx_OnLost(UsbTx_Link_t *link) {
+  if (!link->busy) {
+    return;
+  }
+  link->busy = 0;
+  link->inflight = 0;
+  link->offset = 0;
+  link->lost++;
+  UsbTx_Desc_t d = link->queue[link->tail & TX_MASK];
+  link->tail++;
+  if (d.done != NULL) {
+    d.done(d.ctx, d.len);
+  }
+  UsbTx_Kick(link);
+}
+#endif
+
+// Link went away (reset/disconnect): hand every queued buffer back unsent
+void UsbTx_Abort(UsbTx_Link_t *link) {
+  link->busy = 0;
+  link->inflight = 0;
+  link->offset = 0;
+  while (link->tail != link->head) {
+    UsbTx_Desc_t d = link->queue[link->tail & TX_MASK];
+    link->tail++;
+    link->aborted++;
+    if (d.done != NULL) {
+      d.done(d.ctx, d.len);
+    }
+  }
+}
@@ -27,6 +27,7 @@
 #include "usbd_cdc_if.h"
 
 /* USER CODE BEGIN Includes */
+#include "usbd_vendor.h"
 
 /* USER CODE END Includes */
 
@@ -86,7 +87,18 @@ void MX_USB_DEVICE_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN USB_DEVICE_Init_PreTreatment */
-
+#if CCD_USB_VENDOR
+  // Vendor bulk class on the FS port instead of the CDC below
+  if (USBD_Init(&hUsbDeviceFS, &FS_Vendor_Desc, DEVICE_FS) != USBD_OK ||
+      USBD_RegisterClass(&hUsbDeviceFS, &USBD_VENDOR) != USBD_OK ||
+      USBD_VENDOR_RegisterInterface(&hUsbDeviceFS, &USBD_Vendor_fops_FS) !=
+          USBD_OK ||
+      USBD_Start(&hUsbDeviceFS) != USBD_OK) {
+    Error_Handler();
+  }
+  HAL_PWREx_EnableUSBVoltageDetector();
+  return;
+#endif
   /* USER CODE END USB_DEVICE_Init_PreTreatment */
 
   /* Init Device Library, add supported class and start the library. */
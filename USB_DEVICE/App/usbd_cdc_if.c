@@ -23,7 +23,20 @@
 #include "main.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include "ccd_acq.h"
+#include "ccd_ae.h"
+#include "ccd_bench.h"
+#include "ccd_burst.h"
+#include "ccd_cmd.h"
+#include "ccd_hdr.h"
+#include "ccd_line.h"
+#include "ccd_loop.h"
+#include "ccd_phase.h"
+#include "ccd_proc.h"
+#include "ccd_seq.h"
+#include "ccd_snap.h"
 #include "main.h"
+#include "usb_tx.h"
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -98,10 +111,10 @@ uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
 /* Create buffer for reception and transmission           */
 /* It's up to user to redefine and/or remove those define */
 /** Received data over USB are stored in this buffer      */
-uint8_t UserRxBufferHS[APP_RX_DATA_SIZE];
+CCD_USB_DMA uint8_t UserRxBufferHS[APP_RX_DATA_SIZE];
 
 /** Data to send over USB CDC are stored in this buffer   */
-uint8_t UserTxBufferHS[APP_TX_DATA_SIZE];
+CCD_USB_DMA uint8_t UserTxBufferHS[APP_TX_DATA_SIZE];
 
 /* USER CODE BEGIN PRIVATE_VARIABLES */
 // Binary-only mode: No command handling needed
@@ -147,6 +160,10 @@ static int8_t CDC_Receive_HS(uint8_t *pbuf, uint32_t *Len);
 static int8_t CDC_TransmitCplt_HS(uint8_t *pbuf, uint32_t *Len, uint8_t epnum);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
+// Set while the host holds DTR on the FS port, and on the HS port
+// (CCD_TX_DUAL)
+static volatile uint8_t cdc_fs_open;
+static volatile uint8_t cdc_hs_open;
 
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
 
@@ -182,6 +199,11 @@ static int8_t CDC_Init_FS(void) {
  */
 static int8_t CDC_DeInit_FS(void) {
   /* USER CODE BEGIN 4 */
+  cdc_fs_open = 0;
+  UsbTx_Abort(&usb_tx_fs);
+#if CCD_USB_VENDOR
+  UsbTx_Abort(&usb_tx_data);
+#endif
   return (USBD_OK);
   /* USER CODE END 4 */
 }
@@ -244,7 +266,14 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t *pbuf, uint16_t length) {
     break;
 
   case CDC_SET_CONTROL_LINE_STATE:
-
+    // DTR: the host has the port open, and frames start (CDC_IsOpen_FS())
+    if (((USBD_SetupReqTypedef *)pbuf)->wValue & 0x01U) {
+      cdc_fs_open = 1;
+    } else if (cdc_fs_open) {
+      cdc_fs_open = 0;
+      (void)USBD_LL_FlushEP(&hUsbDeviceFS, CDC_IN_EP);
+      UsbTx_Abort(&usb_tx_fs);
+    }
     break;
 
   case CDC_SEND_BREAK:
@@ -277,19 +306,357 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t *pbuf, uint16_t length) {
  */
 static int8_t CDC_Receive_FS(uint8_t *Buf, uint32_t *Len) {
   /* USER CODE BEGIN 6 */
-  // Simple Command Parser: "M0", "M1", "M2"
-  if (*Len > 0) {
+  // Simple Command Parser: "M0".."M3" (mode, M3 = external trigger),
+  // "ME<counts>" (M3 from the line-scan encoder, ME0 = off, see ccd_line.h),
+  // "T0".."T2" (transport), "A0", "A1" (acquisition), "N<n>" (co-add n
+  // frames, N1 = off),
+  // "R<k>" (rolling mean over k frames, R1 = off), "D<m>" (capture a dark
+  // from m frames, D0 = clear), "G..." (flat-field gains, see below),
+  // "B1", "B2", "B4", "B8" (binning), "W<start>:<len>,..." (ROI windows,
+  // "W" = whole line), "P12", "P14", "P16" (pixel packing), "C0", "C1",
+  // "C2" (lossless compression off/spatial/temporal), "CK" (keyframe),
+  // "E<t>" (send on change > t counts/pixel, E0 = every frame), "H<ms>"
+  // (heartbeat while unchanged), "X<n>[:<p>]", "XT", "XE0/1", "XL<level>",
+  // "XS", "X0" (burst and its triggers, see ccd_burst.h), "S<delay>:<width>"
+  // (strobe in us from ICG, S0 = off), "Y0".."Y3" (board sync off/master/
+  // slave/mains, ccd_acq.h), "F1", "F0", "FS", "FL" (ADC sample-phase sweep,
+  // see ccd_phase.h), "I1"/"I2"/"I4" (ADC samples per pixel, see ccd_acq.h),
+  // "O<n>" (readout speed profile: slower fM, ADC oversampling or longer
+  // sampling), "K0"/"K1" (correlated double sampling), "J", "JE0/1",
+  // "JX<ms>", "JA" (mode 1 snap, its pin trigger, long exposure and its
+  // abort, see ccd_snap.h), "V0".."V2" (sample source: ADC1, external
+  // SPI ADC, test pattern, see ccd_acq.h). Packets starting with
+  // CCD_CMD_SYNC carry binary command frames instead (ccd_cmd.h), executed
+  // by the main loop. A USB link test takes its packets first (ccd_loop.h),
+  // then a replay its frames (ccd_bench.h).
+  uint32_t taken = CCD_Loop_Receive(CCD_LOOP_FS, Buf, *Len);
+  taken += CCD_Bench_Receive(&Buf[taken], *Len - taken);
+  Buf += taken;
+  *Len -= taken;
+  if (*Len > 0 && !CCD_Cmd_Receive(Buf, *Len)) {
     if (Buf[0] == 'M' && *Len >= 2) {
       uint8_t mode = Buf[1] - '0'; // Convert char to int
-      if (mode <= 2) {
+      if (mode <= CCD_MODE_EXT_TRIGGER) {
         ccd_mode = mode;
         mode_update_pending = 1;
       }
+#if CCD_ENCODER
+      if (Buf[1] == 'E') {
+        uint32_t pitch = 0;
+        for (uint32_t i = 2; i < *Len && Buf[i] >= '0' && Buf[i] <= '9';
+             i++) {
+          if (pitch <= 0xFFFFU) { // Out of range either way
+            pitch = pitch * 10U + (Buf[i] - '0');
+          }
+        }
+        if (pitch <= 0xFFFFU) {
+          CCD_Line_SetPitch((uint16_t)pitch);
+          mode_update_pending = 1; // TIM8 and TIM2 are set up stopped
+        }
+      }
+#endif
+    } else if (Buf[0] == 'T' && *Len >= 2) {
+      uint8_t mode = Buf[1] - '0';
+      if (mode <= CCD_TX_LAST) {
+        tx_mode = mode;
+      }
+    } else if (Buf[0] == 'A' && *Len >= 2) {
+      uint8_t mode = Buf[1] - '0';
+      if (mode <= CCD_ACQ_HWSYNC) {
+        acq_mode = mode;
+        mode_update_pending = 1; // Restart capture in the new mode
+      }
+    } else if (Buf[0] == 'I' && *Len >= 2) {
+      uint8_t samples = Buf[1] - '0';
+      if (samples == 1 || samples == 2 || samples == CCD_ACQ_SAMPLES_MAX) {
+        acq_adc_samples = samples;
+        mode_update_pending = 1; // The dual mode is set with the ADCs stopped
+      }
+    } else if (Buf[0] == 'K' && *Len >= 2) {
+      if (Buf[1] == '0' || Buf[1] == '1') {
+        acq_cds = Buf[1] - '0';
+        mode_update_pending = 1;
+      }
+    } else if (Buf[0] == 'V' && *Len >= 2) {
+      if (CCD_Acq_SetSource(Buf[1] - '0')) {
+        mode_update_pending = 1; // The stream is re-pointed stopped
+      }
+    } else if (Buf[0] == 'O' && *Len >= 2) {
+      uint8_t profile = Buf[1] - '0';
+      if (profile < CCD_LN_COUNT) {
+        acq_noise_profile = profile;
+        mode_update_pending = 1; // Timers and ADC are reconfigured stopped
+      }
+    } else if (Buf[0] == 'F' && *Len >= 2) {
+      if (Buf[1] == CCD_PHASE_REQ_SWEEP || Buf[1] == CCD_PHASE_REQ_ABORT ||
+          Buf[1] == CCD_PHASE_REQ_SAVE || Buf[1] == CCD_PHASE_REQ_LOAD) {
+        ccd_phase_request = Buf[1];
+      }
+    } else if (Buf[0] == 'Y' && *Len >= 2) {
+      uint8_t mode = Buf[1] - '0';
+      if (mode <= CCD_SYNC_LAST) {
+        sync_mode = mode;
+        mode_update_pending = 1;
+      }
+    } else if (Buf[0] == 'B' && *Len >= 2) {
+      uint8_t bin = Buf[1] - '0';
+      if (bin == 1 || bin == 2 || bin == 4 || bin == 8) {
+        proc_bin = bin;
+      }
+    } else if (Buf[0] == 'P' && *Len >= 3) {
+      uint8_t bits = (Buf[1] - '0') * 10 + (Buf[2] - '0');
+      if (bits == CCD_PROC_PACK_12 || bits == CCD_PROC_PACK_14 ||
+          bits == CCD_PROC_PACK_NONE) {
+        proc_bits = bits;
+      }
+    } else if (Buf[0] == 'C' && *Len >= 2) {
+      uint8_t codec = Buf[1] - '0';
+      if (Buf[1] == 'K') {
+        proc_keyframe_request = 1;
+      } else if (codec <= CCD_PROC_CODEC_TEMPORAL) {
+        proc_codec = codec;
+      }
+    } else if (Buf[0] == 'Q' && *Len >= 2) {
+      uint32_t v[CCD_ACQ_BRACKET_MAX] = {0};
+      uint32_t nv = 0;
+      uint8_t digits = 0;
+      uint32_t first = (Buf[1] == 'S') ? 2 : 1;
+      for (uint32_t i = first; i < *Len && nv < CCD_ACQ_BRACKET_MAX; i++) {
+        if (Buf[i] >= '0' && Buf[i] <= '9') {
+          if (v[nv] <= 0xFFFFU) { // Out of range either way
+            v[nv] = v[nv] * 10 + (Buf[i] - '0');
+          }
+          digits = 1;
+        } else if (digits && Buf[i] == ':') {
+          nv++;
+          digits = 0;
+        } else {
+          break;
+        }
+      }
+      nv += digits;
+      if (first == 2) {
+        if (nv == 1 && v[0] <= 0xFFFFU) {
+          CCD_HDR_SetSaturation((uint16_t)v[0]);
+        }
+      } else if (nv == 1 && v[0] == 0) {
+        CCD_Acq_SetBracket(v, 0);
+        mode_update_pending = 1;
+      } else if (CCD_Acq_SetBracket(v, (uint8_t)nv)) {
+        mode_update_pending = 1; // The cycle starts at entry 0
+      }
+    } else if (Buf[0] == 'U' && *Len >= 2) {
+      uint32_t v[2] = {0, 0};
+      uint32_t nv = 0;
+      for (uint32_t i = 2; i < *Len && i <= 13; i++) {
+        if (Buf[i] >= '0' && Buf[i] <= '9') {
+          if (v[nv] <= 0xFFFFU) { // Out of range either way
+            v[nv] = v[nv] * 10 + (Buf[i] - '0');
+          }
+        } else if (Buf[i] == ':' && nv == 0) {
+          nv = 1;
+        } else {
+          break;
+        }
+      }
+      if (Buf[1] == '0' || Buf[1] == '1') {
+        CCD_AE_Enable(Buf[1] == '1');
+      } else if (Buf[1] == 'L' && nv == 1) {
+        CCD_AE_SetLimits(v[0], v[1]);
+      } else if (Buf[1] == 'T') {
+        CCD_AE_SetTarget(v[0]);
+      } else if (Buf[1] == 'P') {
+        CCD_AE_SetPercentile(v[0]);
+      } else if (Buf[1] == 'S') {
+        CCD_AE_RequestStatus();
+      }
+    } else if (Buf[0] == 'J') {
+      if (*Len >= 3 && Buf[1] == 'E') {
+        CCD_Snap_SetPinTrigger(Buf[2] == '1');
+      } else if (*Len >= 3 && Buf[1] == 'X') {
+        uint32_t ms = 0;
+        for (uint32_t i = 2; i < *Len && Buf[i] >= '0' && Buf[i] <= '9'; i++) {
+          if (ms <= CCD_ACQ_EXPOSE_MAX_MS) { // Out of range either way
+            ms = ms * 10U + (Buf[i] - '0');
+          }
+        }
+        CCD_Snap_Expose(ms); // Starts at the next SH pulse, in mode 1
+      } else if (*Len >= 2 && Buf[1] == 'A') {
+        CCD_Snap_Abort();
+      } else {
+        CCD_Snap_Fire(); // Starts the frame from here, in mode 1
+      }
+    } else if (Buf[0] == 'Z' && *Len >= 2) {
+      uint32_t v[6] = {0};
+      uint32_t nv = 0;
+      uint8_t digits = 0;
+      uint32_t first = (Buf[1] >= '0' && Buf[1] <= '9') ? 1 : 2;
+      for (uint32_t i = first; i < *Len && nv < 6; i++) {
+        if (Buf[i] >= '0' && Buf[i] <= '9') {
+          if (v[nv] <= 0xFFFFFFU) { // Out of range either way
+            v[nv] = v[nv] * 10 + (Buf[i] - '0');
+          }
+          digits = 1;
+        } else if (digits && Buf[i] == ':') {
+          nv++;
+          digits = 0;
+        } else {
+          break;
+        }
+      }
+      nv += digits;
+      if (Buf[1] == 'W' && nv == 6 && v[0] <= 0xFFU && v[2] <= 0xFFFFU &&
+          v[3] <= 0xFFFFU) {
+        CCD_SeqStep_t step = {.t_us = v[1],
+                              .outputs = (uint16_t)v[2],
+                              .coadd = (uint16_t)v[3],
+                              .delay_ms = v[4],
+                              .trigger = (v[5] != 0)};
+        CCD_Seq_SetStep((uint8_t)v[0], &step);
+      } else if (Buf[1] == 'N' && nv == 1 && v[0] <= 0xFFU) {
+        CCD_Seq_SetLength((uint8_t)v[0]);
+      } else if (Buf[1] == 'R' && nv == 1 && v[0] <= 0xFFFFU) {
+        CCD_Seq_SetRepeats((uint16_t)v[0]);
+      } else if (Buf[1] == 'G') {
+        CCD_Seq_Start();
+      } else if (Buf[1] == '0') {
+        CCD_Seq_Stop();
+      } else if (Buf[1] == 'T') {
+        CCD_Seq_Trigger();
+      } else if (Buf[1] == 'S') {
+        CCD_Seq_RequestStatus();
+      }
+    } else if (Buf[0] == 'X' && *Len >= 2) {
+      if (Buf[1] == 'T') {
+        CCD_Burst_Trigger();
+      } else if (Buf[1] == 'S') {
+        CCD_Burst_RequestStatus();
+      } else if (Buf[1] == 'E' && *Len >= 3) {
+        CCD_Burst_SetPinTrigger(Buf[2] == '1');
+      } else if (Buf[1] == 'L') {
+        uint32_t level = 0;
+        for (uint32_t i = 2; i < *Len && i <= 6 && Buf[i] >= '0' && Buf[i] <= '9';
+             i++) {
+          level = level * 10 + (Buf[i] - '0');
+        }
+        if (level <= 0xFFFFU) {
+          CCD_Burst_SetLevelTrigger((uint16_t)level);
+        }
+      } else {
+        uint32_t v[2] = {0, 0}; // Frames, pre-trigger frames
+        uint32_t nv = 0;
+        for (uint32_t i = 1; i < *Len && i <= 10; i++) {
+          if (Buf[i] >= '0' && Buf[i] <= '9') {
+            v[nv] = v[nv] * 10 + (Buf[i] - '0');
+          } else if (Buf[i] == ':' && nv == 0) {
+            nv = 1;
+          } else {
+            break;
+          }
+        }
+        if (v[0] == 0) {
+          CCD_Burst_Abort();
+        } else if (v[0] <= CCD_BURST_FRAMES && v[1] < v[0]) {
+          CCD_Burst_Arm((uint16_t)v[0], (uint16_t)v[1]);
+        }
+      }
+    } else if (Buf[0] == 'S') {
+      uint32_t v[2] = {0, 0}; // Delay, width (us)
+      uint32_t nv = 0;
+      for (uint32_t i = 1; i < *Len && i <= 11; i++) {
+        if (Buf[i] >= '0' && Buf[i] <= '9') {
+          if (v[nv] <= CCD_STROBE_MAX_US) { // Out of range either way
+            v[nv] = v[nv] * 10 + (Buf[i] - '0');
+          }
+        } else if (Buf[i] == ':' && nv == 0) {
+          nv = 1;
+        } else {
+          break;
+        }
+      }
+      CCD_Acq_SetStrobe(v[0], (nv == 1) ? v[1] : 0);
+    } else if (Buf[0] == 'L') {
+      uint32_t v[2] = {0, 0}; // SH period, pulse (us)
+      uint32_t nv = 0;
+      for (uint32_t i = 1; i < *Len && i <= 12; i++) {
+        if (Buf[i] >= '0' && Buf[i] <= '9') {
+          if (v[nv] <= CCD_SH_MAX_PERIOD_US) { // Out of range either way
+            v[nv] = v[nv] * 10 + (Buf[i] - '0');
+          }
+        } else if (Buf[i] == ':' && nv == 0) {
+          nv = 1;
+        } else {
+          break;
+        }
+      }
+      if (nv == 1) {
+        CCD_Acq_SetExposure(v[0], v[1]);
+      }
+    } else if (Buf[0] == 'W') {
+      CCD_RoiWindow_t w[CCD_PROC_ROI_MAX];
+      uint32_t v[2 * CCD_PROC_ROI_MAX] = {0};
+      uint32_t nv = 0;
+      uint8_t digits = 0;
+      for (uint32_t i = 1; i < *Len && nv < 2 * CCD_PROC_ROI_MAX; i++) {
+        if (Buf[i] >= '0' && Buf[i] <= '9') {
+          if (v[nv] <= CCD_BUFFER_SIZE) { // Out of range either way
+            v[nv] = v[nv] * 10 + (Buf[i] - '0');
+          }
+          digits = 1;
+        } else if (digits && (Buf[i] == ':' || Buf[i] == ',')) {
+          nv++;
+          digits = 0;
+        } else {
+          break; // Line end or junk
+        }
+      }
+      nv += digits;
+      if ((nv % 2) == 0) {
+        for (uint32_t i = 0; i < nv / 2; i++) {
+          w[i].start = (uint16_t)v[2 * i];
+          w[i].len = (uint16_t)v[2 * i + 1];
+        }
+        CCD_Proc_SetRoi(w, (uint8_t)(nv / 2));
+      }
+    } else if (Buf[0] == 'G' && *Len >= 2) {
+      // "GW" <offset u16> <Q15 gains u16...> (binary, little-endian),
+      // "GA" apply upload, "GS" save, "GL" load from flash, "G0"/"G1" off/on
+      if (Buf[1] == 'W' && *Len >= 4) {
+        CCD_Proc_FlatWrite(Buf[2] | (Buf[3] << 8), &Buf[4], (*Len - 4) / 2);
+      } else if (Buf[1] == '0' || Buf[1] == '1') {
+        proc_flat_enable = Buf[1] - '0';
+      } else if (Buf[1] == CCD_FLAT_REQ_APPLY || Buf[1] == CCD_FLAT_REQ_SAVE ||
+                 Buf[1] == CCD_FLAT_REQ_LOAD) {
+        proc_flat_request = Buf[1];
+      }
+    } else if ((Buf[0] == 'N' || Buf[0] == 'R' || Buf[0] == 'D' ||
+                Buf[0] == 'E' || Buf[0] == 'H') &&
+               *Len >= 2) {
+      uint32_t n = 0;
+      for (uint32_t i = 1; i < *Len && i <= 5 && Buf[i] >= '0' && Buf[i] <= '9';
+           i++) {
+        n = n * 10 + (Buf[i] - '0');
+      }
+      if (Buf[0] == 'N' && n >= 1 && n <= CCD_PROC_COADD_MAX) {
+        proc_coadd_n = (uint16_t)n;
+      } else if (Buf[0] == 'R' && n >= 1 && n <= CCD_PROC_ROLLING_MAX) {
+        proc_rolling_n = (uint16_t)n;
+      } else if (Buf[0] == 'D' && n <= CCD_PROC_DARK_MAX) {
+        proc_dark_request = (n == 0) ? CCD_DARK_CLEAR_REQ : (uint16_t)n;
+      } else if (Buf[0] == 'E' && n <= 0xFFFFU) {
+        proc_event_threshold = (uint16_t)n;
+      } else if (Buf[0] == 'H' && n >= 1 && n <= 0xFFFFU) {
+        proc_heartbeat_ms = (uint16_t)n;
+      }
     }
   }
 
-  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
-  USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  // With the binary RX ring full the host is NAKed until CCD_Cmd_Poll()
+  // makes room and calls CDC_ResumeRx_FS(), with a replayed frame held
+  // until CCD_Bench_Poll() has a slot for it
+  if (!CCD_Bench_Held() && CCD_Cmd_RxReady()) {
+    CDC_ResumeRx_FS();
+  }
   return (USBD_OK);
   /* USER CODE END 6 */
 }
@@ -308,8 +675,14 @@ static int8_t CDC_Receive_FS(uint8_t *Buf, uint32_t *Len) {
 uint8_t CDC_Transmit_FS(uint8_t *Buf, uint16_t Len) {
   uint8_t result = USBD_OK;
   /* USER CODE BEGIN 7 */
+#if CCD_USB_VENDOR
+  return USBD_VENDOR_Transmit(&hUsbDeviceFS, USBD_VENDOR_IN_EP, Buf, Len);
+#endif
   USBD_CDC_HandleTypeDef *hcdc =
       (USBD_CDC_HandleTypeDef *)hUsbDeviceFS.pClassData;
+  if (hcdc == NULL) {
+    return USBD_FAIL; // Not configured by the host yet
+  }
   if (hcdc->TxState != 0) {
     return USBD_BUSY;
   }
@@ -337,7 +710,14 @@ static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum) {
   /* USER CODE BEGIN 13 */
   UNUSED(Buf);
   UNUSED(Len);
+#if CCD_USB_VENDOR
+  if (epnum == (USBD_VENDOR_DATA_EP & 0x7FU)) {
+    UsbTx_OnComplete(&usb_tx_data);
+    return result;
+  }
+#endif
   UNUSED(epnum);
+  UsbTx_OnComplete(&usb_tx_fs);
   /* USER CODE END 13 */
   return result;
 }
@@ -362,6 +742,8 @@ static int8_t CDC_Init_HS(void) {
  */
 static int8_t CDC_DeInit_HS(void) {
   /* USER CODE BEGIN 9 */
+  cdc_hs_open = 0;
+  UsbTx_Abort(&usb_tx_hs);
   return (USBD_OK);
   /* USER CODE END 9 */
 }
@@ -424,7 +806,15 @@ static int8_t CDC_Control_HS(uint8_t cmd, uint8_t *pbuf, uint16_t length) {
     break;
 
   case CDC_SET_CONTROL_LINE_STATE:
-
+    // DTR: the host has the port open. Frames queued when it closes would
+    // wait for it forever, so they are handed back.
+    if (((USBD_SetupReqTypedef *)pbuf)->wValue & 0x01U) {
+      cdc_hs_open = 1;
+    } else if (cdc_hs_open) {
+      cdc_hs_open = 0;
+      (void)USBD_LL_FlushEP(&hUsbDeviceHS, CDC_IN_EP);
+      UsbTx_Abort(&usb_tx_hs);
+    }
     break;
 
   case CDC_SEND_BREAK:
@@ -457,6 +847,7 @@ static int8_t CDC_Control_HS(uint8_t cmd, uint8_t *pbuf, uint16_t length) {
  */
 static int8_t CDC_Receive_HS(uint8_t *Buf, uint32_t *Len) {
   /* USER CODE BEGIN 11 */
+  CCD_Loop_Receive(CCD_LOOP_HS, Buf, *Len); // Only link tests read HS
   USBD_CDC_SetRxBuffer(&hUsbDeviceHS, &Buf[0]);
   USBD_CDC_ReceivePacket(&hUsbDeviceHS);
   return (USBD_OK);
@@ -476,6 +867,9 @@ uint8_t CDC_Transmit_HS(uint8_t *Buf, uint16_t Len) {
   /* USER CODE BEGIN 12 */
   USBD_CDC_HandleTypeDef *hcdc =
       (USBD_CDC_HandleTypeDef *)hUsbDeviceHS.pClassData;
+  if (hcdc == NULL) {
+    return USBD_FAIL; // Not configured by the host yet
+  }
   if (hcdc->TxState != 0) {
     return USBD_BUSY;
   }
@@ -504,12 +898,80 @@ static int8_t CDC_TransmitCplt_HS(uint8_t *Buf, uint32_t *Len, uint8_t epnum) {
   UNUSED(Buf);
   UNUSED(Len);
   UNUSED(epnum);
+  UsbTx_OnComplete(&usb_tx_hs);
   /* USER CODE END 14 */
   return result;
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
+// Frames go out once the host has opened the FS port. The vendor class
+// has no DTR: there it is open once configured.
+uint8_t CDC_IsOpen_FS(void) {
+#if CCD_USB_VENDOR
+  return hUsbDeviceFS.dev_state == USBD_STATE_CONFIGURED;
+#else
+  return cdc_fs_open && hUsbDeviceFS.dev_state == USBD_STATE_CONFIGURED;
+#endif
+}
+
+// The HS port takes frames (CCD_TX_DUAL) once the host has opened it
+uint8_t CDC_IsOpen_HS(void) {
+  return cdc_hs_open && hUsbDeviceHS.dev_state == USBD_STATE_CONFIGURED;
+}
+
+// Arm the FS OUT endpoint for the next packet
+void CDC_ResumeRx_FS(void) {
+#if CCD_USB_VENDOR
+  USBD_VENDOR_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
+  USBD_VENDOR_ReceivePacket(&hUsbDeviceFS);
+#else
+  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
+  USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+#endif
+}
+
+#if CCD_USB_VENDOR
+// The vendor bulk class on the FS port (usbd_vendor.h) runs the same
+// receive, completion and disconnect paths; only the buffers differ
+static int8_t Vendor_Init_FS(void) {
+  USBD_VENDOR_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
+  return (USBD_OK);
+}
+
+// Frames go out on the data interface, everything else through
+// CDC_Transmit_FS on the control interface
+uint8_t Vendor_TransmitData_FS(uint8_t *Buf, uint16_t Len) {
+  return USBD_VENDOR_Transmit(&hUsbDeviceFS, USBD_VENDOR_DATA_EP, Buf, Len);
+}
+
+#if CCD_USB_ISO
+_Static_assert(USB_TX_CHUNK_SIZE == USBD_VENDOR_ISO_MPS,
+               "usb_tx_data sends one isochronous packet per transfer");
+
+static int8_t Vendor_TransmitLost_FS(uint8_t epnum) {
+  UNUSED(epnum); // Only the data endpoint is isochronous
+  UsbTx_OnLost(&usb_tx_data);
+  return (USBD_OK);
+}
+
+// The frames queued for the old endpoint go back unsent, as on a
+// disconnect. Both settings send USB_TX_CHUNK_SIZE transfers.
+static int8_t Vendor_DataAlt_FS(uint8_t alt) {
+  UNUSED(alt);
+  UsbTx_Abort(&usb_tx_data);
+  return (USBD_OK);
+}
+#endif
+
+USBD_VENDOR_ItfTypeDef USBD_Vendor_fops_FS = {
+    Vendor_Init_FS, CDC_DeInit_FS, CDC_Receive_FS, CDC_TransmitCplt_FS,
+#if CCD_USB_ISO
+    Vendor_TransmitLost_FS, Vendor_DataAlt_FS,
+#endif
+};
+#endif
+
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
 /**
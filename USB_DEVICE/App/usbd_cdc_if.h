@@ -31,6 +31,7 @@
 #include "usbd_cdc.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include "usbd_vendor.h"
 
 /* USER CODE END INCLUDE */
 
@@ -96,6 +97,9 @@ extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 extern USBD_CDC_ItfTypeDef USBD_Interface_fops_HS;
 
 /* USER CODE BEGIN EXPORTED_VARIABLES */
+#if CCD_USB_VENDOR
+extern USBD_VENDOR_ItfTypeDef USBD_Vendor_fops_FS;
+#endif
 
 /* USER CODE END EXPORTED_VARIABLES */
 
@@ -112,6 +116,12 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
 uint8_t CDC_Transmit_HS(uint8_t* Buf, uint16_t Len);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+void CDC_ResumeRx_FS(void);
+uint8_t CDC_IsOpen_FS(void);
+uint8_t CDC_IsOpen_HS(void);
+#if CCD_USB_VENDOR
+uint8_t Vendor_TransmitData_FS(uint8_t *Buf, uint16_t Len);
+#endif
 
 /* USER CODE END EXPORTED_FUNCTIONS */
 
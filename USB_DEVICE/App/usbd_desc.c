@@ -24,6 +24,7 @@
 #include "usbd_conf.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include "usbd_vendor.h"
 
 /* USER CODE END INCLUDE */
 
@@ -85,7 +86,139 @@
   */
 
 /* USER CODE BEGIN 0 */
+#if CCD_USB_VENDOR
+// Vendor bulk build (CCD_USB_VENDOR, usbd_vendor.h). A PID of its own, so
+// Windows does not reuse the driver it bound to the CDC device; both are
+// ST's evaluation IDs and need replacing in a product.
+#define USBD_PID_VENDOR 22352
+#define USBD_PRODUCT_STRING_VENDOR CCD_SENSOR_NAME " CCD" // ccd_sensor.h
+#define USB_SIZ_VENDOR_BOS_DESC 40U
+
+// UTF-16LE, as the MS OS 2.0 registry property wants it
+#define U16(c) (c), 0x00
+
+uint8_t *USBD_FS_LangIDStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *length);
+uint8_t *USBD_FS_ManufacturerStrDescriptor(USBD_SpeedTypeDef speed,
+                                           uint16_t *length);
+uint8_t *USBD_FS_SerialStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *length);
+uint8_t *USBD_FS_ConfigStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *length);
+uint8_t *USBD_FS_InterfaceStrDescriptor(USBD_SpeedTypeDef speed,
+                                        uint16_t *length);
+extern uint8_t USBD_StrDesc[USBD_MAX_STR_DESC_SIZ];
+
+// bcdUSB 2.01 so the host asks for the BOS; the class is per interface
+__ALIGN_BEGIN static uint8_t
+    USBD_FS_VendorDeviceDesc[USB_LEN_DEV_DESC] __ALIGN_END = {
+        0x12, USB_DESC_TYPE_DEVICE,
+        0x01, 0x02, // bcdUSB
+        0x00, 0x00, 0x00, // Class, subclass, protocol: see the interface
+        USB_MAX_EP0_SIZE,
+        LOBYTE(USBD_VID), HIBYTE(USBD_VID),
+        LOBYTE(USBD_PID_VENDOR), HIBYTE(USBD_PID_VENDOR),
+        0x00, 0x02, // bcdDevice
+        USBD_IDX_MFC_STR, USBD_IDX_PRODUCT_STR, USBD_IDX_SERIAL_STR,
+        USBD_MAX_NUM_CONFIGURATION,
+};
+
+// USB 2.0 extension (LPM, as in the CDC build) and the MS OS 2.0 platform
+// capability pointing at USBD_FS_MsOs20Desc
+__ALIGN_BEGIN static uint8_t USBD_FS_VendorBOSDesc[] __ALIGN_END = {
+    0x05, USB_DESC_TYPE_BOS,
+    LOBYTE(USB_SIZ_VENDOR_BOS_DESC), HIBYTE(USB_SIZ_VENDOR_BOS_DESC),
+    0x02, // bNumDeviceCaps
+
+    0x07, USB_DEVICE_CAPABITY_TYPE, 0x02, // USB 2.0 extension
+    0x02, 0x00, 0x00, 0x00,               // LPM
+
+    0x1C, USB_DEVICE_CAPABITY_TYPE, 0x05, // Platform
+    0x00,
+    // MS OS 2.0 platform UUID {D8DD60DF-4589-4CC7-9CD2-659D9E648A9F}
+    0xDF, 0x60, 0xDD, 0xD8, 0x89, 0x45, 0xC7, 0x4C,
+    0x9C, 0xD2, 0x65, 0x9D, 0x9E, 0x64, 0x8A, 0x9F,
+    0x00, 0x00, 0x03, 0x06, // dwWindowsVersion: 8.1
+    LOBYTE(USBD_MS_OS_20_DESC_SIZ), HIBYTE(USBD_MS_OS_20_DESC_SIZ),
+    USBD_VENDOR_MS_CODE,
+    0x00, // bAltEnumCode
+};
+
+// Function subset for interface itf: WinUSB compatible ID and the GUID
+// {6E3B1A3C-5F7D-4C1E-9B3A-2D4C1304CCDd} as DeviceInterfaceGUIDs, so each
+// interface is opened on its own. 160 bytes.
+#define MS_OS_20_FUNCTION(itf, d)                                            \
+  0x08, 0x00, 0x02, 0x00, /* Function subset header */                     \
+      (itf), 0x00, 0xA0, 0x00,                                             \
+                                                                           \
+      0x14, 0x00, 0x03, 0x00, /* Compatible ID */                          \
+      'W', 'I', 'N', 'U', 'S', 'B', 0x00, 0x00,                            \
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,                      \
+                                                                           \
+      0x84, 0x00, 0x04, 0x00, /* Registry property, 132 bytes */           \
+      0x07, 0x00,             /* REG_MULTI_SZ */                           \
+      0x2A, 0x00,             /* Name: 42 bytes */                         \
+      U16('D'), U16('e'), U16('v'), U16('i'), U16('c'), U16('e'), U16('I'), \
+      U16('n'), U16('t'), U16('e'), U16('r'), U16('f'), U16('a'), U16('c'), \
+      U16('e'), U16('G'), U16('U'), U16('I'), U16('D'), U16('s'), U16(0),   \
+      0x50, 0x00,             /* Data: 80 bytes */                         \
+      U16('{'), U16('6'), U16('E'), U16('3'), U16('B'), U16('1'), U16('A'), \
+      U16('3'), U16('C'), U16('-'), U16('5'), U16('F'), U16('7'), U16('D'), \
+      U16('-'), U16('4'), U16('C'), U16('1'), U16('E'), U16('-'), U16('9'), \
+      U16('B'), U16('3'), U16('A'), U16('-'), U16('2'), U16('D'), U16('4'), \
+      U16('C'), U16('1'), U16('3'), U16('0'), U16('4'), U16('C'), U16('C'), \
+      U16('D'), U16(d), U16('}'), U16(0), U16(0)
+
+// Descriptor set: header, the subset of configuration 0 and one function
+// per interface. GUIDs ...CCD0 for control, ...CCD1 for data.
+__ALIGN_BEGIN uint8_t USBD_FS_MsOs20Desc[] __ALIGN_END = {
+    0x0A, 0x00, 0x00, 0x00, // Set header
+    0x00, 0x00, 0x03, 0x06,
+    LOBYTE(USBD_MS_OS_20_DESC_SIZ), HIBYTE(USBD_MS_OS_20_DESC_SIZ),
+
+    0x08, 0x00, 0x01, 0x00, // Configuration subset header
+    0x00, 0x00,             // Configuration index 0
+    LOBYTE(USBD_MS_OS_20_DESC_SIZ - 10U),
+    HIBYTE(USBD_MS_OS_20_DESC_SIZ - 10U),
+
+    MS_OS_20_FUNCTION(0x00, '0'),
+    MS_OS_20_FUNCTION(0x01, '1'),
+};
+
+static uint8_t *USBD_FS_VendorDeviceDescriptor(USBD_SpeedTypeDef speed,
+                                               uint16_t *length) {
+  UNUSED(speed);
+  *length = sizeof(USBD_FS_VendorDeviceDesc);
+  return USBD_FS_VendorDeviceDesc;
+}
+
+static uint8_t *USBD_FS_VendorProductStrDescriptor(USBD_SpeedTypeDef speed,
+                                                   uint16_t *length) {
+  UNUSED(speed);
+  USBD_GetString((uint8_t *)USBD_PRODUCT_STRING_VENDOR, USBD_StrDesc, length);
+  return USBD_StrDesc;
+}
 
+static uint8_t *USBD_FS_VendorBOSDescriptor(USBD_SpeedTypeDef speed,
+                                            uint16_t *length) {
+  UNUSED(speed);
+  *length = sizeof(USBD_FS_VendorBOSDesc);
+  return USBD_FS_VendorBOSDesc;
+}
+
+USBD_DescriptorsTypeDef FS_Vendor_Desc = {
+    .GetDeviceDescriptor = USBD_FS_VendorDeviceDescriptor,
+    .GetLangIDStrDescriptor = USBD_FS_LangIDStrDescriptor,
+    .GetManufacturerStrDescriptor = USBD_FS_ManufacturerStrDescriptor,
+    .GetProductStrDescriptor = USBD_FS_VendorProductStrDescriptor,
+    .GetSerialStrDescriptor = USBD_FS_SerialStrDescriptor,
+    .GetConfigurationStrDescriptor = USBD_FS_ConfigStrDescriptor,
+    .GetInterfaceStrDescriptor = USBD_FS_InterfaceStrDescriptor,
+    .GetBOSDescriptor = USBD_FS_VendorBOSDescriptor,
+};
+
+_Static_assert(sizeof(USBD_FS_MsOs20Desc) == USBD_MS_OS_20_DESC_SIZ,
+               "wTotalLength of the MS OS 2.0 set");
+_Static_assert(sizeof(USBD_FS_VendorBOSDesc) == USB_SIZ_VENDOR_BOS_DESC,
+               "wTotalLength of the BOS");
+#endif /* CCD_USB_VENDOR */
 /* USER CODE END 0 */
 
 /** @defgroup USBD_DESC_Private_Macros USBD_DESC_Private_Macros
@@ -587,6 +720,10 @@ static void Get_SerialNum(void)
   uint32_t deviceserial1;
   uint32_t deviceserial2;
 
+  deviceserial0 = *(uint32_t *) DEVICE_ID1;
+  deviceserial1 = *(uint32_t *) DEVICE_ID2;
+  deviceserial2 = *(uint32_t *) DEVICE_ID3;
+
   deviceserial0 += deviceserial2;
 
   if (deviceserial0 != 0)
@@ -65,6 +65,7 @@
   */
 
 /* USER CODE BEGIN EXPORTED_DEFINES */
+#define USBD_MS_OS_20_DESC_SIZ 338U
 
 /* USER CODE END EXPORTED_DEFINES */
 
@@ -109,6 +110,11 @@ extern USBD_DescriptorsTypeDef HS_Desc;
 extern USBD_DescriptorsTypeDef FS_Desc;
 
 /* USER CODE BEGIN EXPORTED_VARIABLES */
+#if CCD_USB_VENDOR
+// FS port as a vendor bulk device (usbd_vendor.h)
+extern USBD_DescriptorsTypeDef FS_Vendor_Desc;
+extern uint8_t USBD_FS_MsOs20Desc[USBD_MS_OS_20_DESC_SIZ];
+#endif
 
 /* USER CODE END EXPORTED_VARIABLES */
 
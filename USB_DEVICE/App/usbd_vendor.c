@@ -0,0 +1,359 @@
+/**
+ ******************************************************************************
+ * @file           : usbd_vendor.c
+ * @brief          : Vendor-specific bulk class (WinUSB / libusb streaming)
+ ******************************************************************************
+ */
+
+#include "usbd_vendor.h"
+#include "usbd_ctlreq.h"
+#include "usbd_desc.h"
+
+#if CCD_USB_VENDOR
+
+static uint8_t Vendor_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
+static uint8_t Vendor_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
+static uint8_t Vendor_Setup(USBD_HandleTypeDef *pdev,
+                            USBD_SetupReqTypedef *req);
+static uint8_t Vendor_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum);
+static uint8_t Vendor_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum);
+static uint8_t *Vendor_GetConfigDesc(uint16_t *length);
+static uint8_t *Vendor_GetQualifierDesc(uint16_t *length);
+#if CCD_USB_ISO
+static uint8_t Vendor_IsoINIncomplete(USBD_HandleTypeDef *pdev,
+                                      uint8_t epnum);
+#endif
+
+USBD_ClassTypeDef USBD_VENDOR = {
+    Vendor_Init,
+    Vendor_DeInit,
+    Vendor_Setup,
+    NULL, // EP0_TxSent
+    NULL, // EP0_RxReady
+    Vendor_DataIn,
+    Vendor_DataOut,
+    NULL, // SOF
+#if CCD_USB_ISO
+    Vendor_IsoINIncomplete,
+#else
+    NULL,
+#endif
+    NULL,
+    Vendor_GetConfigDesc, // The FS port runs at full speed only
+    Vendor_GetConfigDesc,
+    Vendor_GetConfigDesc,
+    Vendor_GetQualifierDesc,
+};
+
+// Only the FS port uses the class, so its state is static rather than taken
+// from USBD_static_malloc(), which the CDC instance of the HS port owns
+static USBD_VENDOR_HandleTypeDef vendor_handle;
+
+__ALIGN_BEGIN static uint8_t
+    vendor_config_desc[USBD_VENDOR_CONFIG_DESC_SIZ] __ALIGN_END = {
+        0x09, USB_DESC_TYPE_CONFIGURATION,
+        LOBYTE(USBD_VENDOR_CONFIG_DESC_SIZ),
+        HIBYTE(USBD_VENDOR_CONFIG_DESC_SIZ),
+        0x02, // bNumInterfaces
+        0x01, // bConfigurationValue
+        0x00, // iConfiguration
+#if (USBD_SELF_POWERED == 1U)
+        0xC0,
+#else
+        0x80,
+#endif
+        USBD_MAX_POWER,
+
+        // Interface 0, control: commands and replies
+        0x09, USB_DESC_TYPE_INTERFACE,
+        0x00, // bInterfaceNumber
+        0x00, // bAlternateSetting
+        0x02, // bNumEndpoints
+        0xFF, // bInterfaceClass: vendor specific
+        0x00, // bInterfaceSubClass
+        0x00, // bInterfaceProtocol
+        USBD_IDX_INTERFACE_STR,
+
+        0x07, USB_DESC_TYPE_ENDPOINT, USBD_VENDOR_IN_EP, USBD_EP_TYPE_BULK,
+        LOBYTE(USBD_VENDOR_FS_MPS), HIBYTE(USBD_VENDOR_FS_MPS), 0x00,
+
+        0x07, USB_DESC_TYPE_ENDPOINT, USBD_VENDOR_OUT_EP, USBD_EP_TYPE_BULK,
+        LOBYTE(USBD_VENDOR_FS_MPS), HIBYTE(USBD_VENDOR_FS_MPS), 0x00,
+
+        // Interface 1, data: frames
+        0x09, USB_DESC_TYPE_INTERFACE,
+        0x01, // bInterfaceNumber
+        0x00, // bAlternateSetting
+        0x01, // bNumEndpoints
+        0xFF, 0x00, 0x00,
+        USBD_IDX_INTERFACE_STR,
+
+        0x07, USB_DESC_TYPE_ENDPOINT, USBD_VENDOR_DATA_EP, USBD_EP_TYPE_BULK,
+        LOBYTE(USBD_VENDOR_FS_MPS), HIBYTE(USBD_VENDOR_FS_MPS), 0x00,
+#if CCD_USB_ISO
+
+        // Interface 1, alternate setting 1: the same endpoint, isochronous
+        0x09, USB_DESC_TYPE_INTERFACE,
+        0x01, // bInterfaceNumber
+        0x01, // bAlternateSetting
+        0x01, // bNumEndpoints
+        0xFF, 0x00, 0x00,
+        USBD_IDX_INTERFACE_STR,
+
+        0x07, USB_DESC_TYPE_ENDPOINT, USBD_VENDOR_DATA_EP,
+        0x05, // bmAttributes: isochronous, asynchronous, data
+        LOBYTE(USBD_VENDOR_ISO_MPS), HIBYTE(USBD_VENDOR_ISO_MPS),
+        0x01, // bInterval: every frame
+#endif
+};
+
+static const uint8_t vendor_in_eps[USBD_VENDOR_IN_COUNT] = {
+    USBD_VENDOR_IN_EP, USBD_VENDOR_DATA_EP};
+
+__ALIGN_BEGIN static uint8_t
+    vendor_qualifier_desc[USB_LEN_DEV_QUALIFIER_DESC] __ALIGN_END = {
+        USB_LEN_DEV_QUALIFIER_DESC,
+        USB_DESC_TYPE_DEVICE_QUALIFIER,
+        0x00, 0x02, // bcdUSB
+        0x00, 0x00, 0x00,
+        0x40, // bMaxPacketSize0
+        0x01, // bNumConfigurations
+        0x00,
+};
+
+static USBD_VENDOR_ItfTypeDef *Vendor_Fops(USBD_HandleTypeDef *pdev) {
+  return (USBD_VENDOR_ItfTypeDef *)pdev->pUserData[pdev->classId];
+}
+
+#if CCD_USB_ISO
+#define VENDOR_DATA_INDEX ((USBD_VENDOR_DATA_EP & 0xFU) - 1U)
+
+static uint8_t Vendor_IsIso(const USBD_VENDOR_HandleTypeDef *h,
+                            uint8_t epnum) {
+  return h->data_alt && (epnum & 0xFU) == (USBD_VENDOR_DATA_EP & 0xFU);
+}
+
+// Both alternate settings of interface 1 use the frame endpoint. The
+// transfer in flight is flushed with the endpoint, and the interface hands
+// back the frames queued behind it, so the host's first read is a frame.
+static void Vendor_SetDataAlt(USBD_HandleTypeDef *pdev, uint8_t alt) {
+  USBD_VENDOR_HandleTypeDef *h = pdev->pClassDataCmsit[pdev->classId];
+  if (h == NULL) {
+    return;
+  }
+  (void)USBD_LL_FlushEP(pdev, USBD_VENDOR_DATA_EP);
+  (void)USBD_LL_CloseEP(pdev, USBD_VENDOR_DATA_EP);
+  (void)USBD_LL_OpenEP(pdev, USBD_VENDOR_DATA_EP,
+                       alt ? USBD_EP_TYPE_ISOC : USBD_EP_TYPE_BULK,
+                       alt ? USBD_VENDOR_ISO_MPS : USBD_VENDOR_FS_MPS);
+  h->data_alt = alt;
+  h->tx_busy[VENDOR_DATA_INDEX] = 0U;
+  Vendor_Fops(pdev)->DataAlt(alt);
+}
+#endif
+
+static uint8_t Vendor_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
+  UNUSED(cfgidx);
+  USBD_VENDOR_HandleTypeDef *h = &vendor_handle;
+  (void)USBD_memset(h, 0, sizeof(*h));
+  pdev->pClassDataCmsit[pdev->classId] = h;
+  pdev->pClassData = h;
+
+  for (uint32_t i = 0; i < USBD_VENDOR_IN_COUNT; i++) {
+    (void)USBD_LL_OpenEP(pdev, vendor_in_eps[i], USBD_EP_TYPE_BULK,
+                         USBD_VENDOR_FS_MPS);
+    pdev->ep_in[vendor_in_eps[i] & 0xFU].is_used = 1U;
+  }
+  (void)USBD_LL_OpenEP(pdev, USBD_VENDOR_OUT_EP, USBD_EP_TYPE_BULK,
+                       USBD_VENDOR_FS_MPS);
+  pdev->ep_out[USBD_VENDOR_OUT_EP & 0xFU].is_used = 1U;
+
+  Vendor_Fops(pdev)->Init(); // Sets the RX buffer
+  if (h->rx_buf == NULL) {
+    return (uint8_t)USBD_EMEM;
+  }
+  (void)USBD_LL_PrepareReceive(pdev, USBD_VENDOR_OUT_EP, h->rx_buf,
+                               USBD_VENDOR_FS_MPS);
+  return (uint8_t)USBD_OK;
+}
+
+static uint8_t Vendor_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
+  UNUSED(cfgidx);
+  for (uint32_t i = 0; i < USBD_VENDOR_IN_COUNT; i++) {
+    (void)USBD_LL_CloseEP(pdev, vendor_in_eps[i]);
+    pdev->ep_in[vendor_in_eps[i] & 0xFU].is_used = 0U;
+  }
+  (void)USBD_LL_CloseEP(pdev, USBD_VENDOR_OUT_EP);
+  pdev->ep_out[USBD_VENDOR_OUT_EP & 0xFU].is_used = 0U;
+  if (pdev->pClassDataCmsit[pdev->classId] != NULL) {
+    Vendor_Fops(pdev)->DeInit();
+    pdev->pClassDataCmsit[pdev->classId] = NULL;
+    pdev->pClassData = NULL;
+  }
+  return (uint8_t)USBD_OK;
+}
+
+// The MS OS 2.0 descriptor request is a device-to-host vendor request
+// (bRequest = the vendor code from the BOS, wIndex = 7). Standard interface
+// requests, for either interface, get the answers of a single alternate
+// setting, but for the data interface's second one with CCD_USB_ISO.
+static uint8_t Vendor_Setup(USBD_HandleTypeDef *pdev,
+                            USBD_SetupReqTypedef *req) {
+  static uint8_t alt_setting;
+  static uint16_t itf_status;
+
+  switch (req->bmRequest & USB_REQ_TYPE_MASK) {
+  case USB_REQ_TYPE_VENDOR:
+    if (req->bRequest == USBD_VENDOR_MS_CODE &&
+        req->wIndex == USBD_VENDOR_MS_OS_20_INDEX) {
+      (void)USBD_CtlSendData(pdev, USBD_FS_MsOs20Desc,
+                             MIN(USBD_MS_OS_20_DESC_SIZ, req->wLength));
+      return (uint8_t)USBD_OK;
+    }
+    break;
+  case USB_REQ_TYPE_STANDARD:
+    switch (req->bRequest) {
+    case USB_REQ_GET_STATUS:
+      (void)USBD_CtlSendData(pdev, (uint8_t *)&itf_status, 2U);
+      return (uint8_t)USBD_OK;
+    case USB_REQ_GET_INTERFACE:
+#if CCD_USB_ISO
+      alt_setting = (LOBYTE(req->wIndex) == 1U) ? vendor_handle.data_alt : 0U;
+#endif
+      (void)USBD_CtlSendData(pdev, &alt_setting, 1U);
+      return (uint8_t)USBD_OK;
+    case USB_REQ_SET_INTERFACE:
+#if CCD_USB_ISO
+      if (LOBYTE(req->wIndex) == 1U && req->wValue <= 1U) {
+        Vendor_SetDataAlt(pdev, (uint8_t)req->wValue);
+        return (uint8_t)USBD_OK;
+      }
+#endif
+      if (req->wValue == 0U) {
+        return (uint8_t)USBD_OK;
+      }
+      break;
+    case USB_REQ_CLEAR_FEATURE:
+      return (uint8_t)USBD_OK;
+    default:
+      break;
+    }
+    break;
+  default:
+    break;
+  }
+  USBD_CtlError(pdev, req);
+  return (uint8_t)USBD_FAIL;
+}
+
+// A transfer that ends on a full packet is closed with a ZLP, as in CDC,
+// so the host's read completes without waiting for more data. An
+// isochronous transfer is one packet and needs none.
+static uint8_t Vendor_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum) {
+  USBD_VENDOR_HandleTypeDef *h = pdev->pClassDataCmsit[pdev->classId];
+  if (h == NULL) {
+    return (uint8_t)USBD_FAIL;
+  }
+  USBD_EndpointTypeDef *ep = &pdev->ep_in[epnum & 0xFU];
+  uint8_t zlp = ep->total_length > 0U &&
+                (ep->total_length % USBD_VENDOR_FS_MPS) == 0U;
+#if CCD_USB_ISO
+  zlp = zlp && !Vendor_IsIso(h, epnum);
+#endif
+  if (zlp) {
+    ep->total_length = 0U;
+    (void)USBD_LL_Transmit(pdev, epnum, NULL, 0U);
+    return (uint8_t)USBD_OK;
+  }
+  uint32_t i = (epnum & 0xFU) - 1U;
+  h->tx_busy[i] = 0U;
+  Vendor_Fops(pdev)->TransmitCplt(h->tx_buf[i], &h->tx_len[i], epnum);
+  return (uint8_t)USBD_OK;
+}
+
+// The OUT endpoint stays NAKed until the interface re-arms it
+static uint8_t Vendor_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum) {
+  USBD_VENDOR_HandleTypeDef *h = pdev->pClassDataCmsit[pdev->classId];
+  if (h == NULL) {
+    return (uint8_t)USBD_FAIL;
+  }
+  h->rx_len = USBD_LL_GetRxDataSize(pdev, epnum);
+  Vendor_Fops(pdev)->Receive(h->rx_buf, &h->rx_len);
+  return (uint8_t)USBD_OK;
+}
+
+#if CCD_USB_ISO
+// The packet armed for this frame went unsent: the host had no transfer
+// queued, or asked too late. HAL_PCD_IRQHandler() has disabled the endpoint
+// and flushed its FIFO; the packet is dropped rather than armed again.
+static uint8_t Vendor_IsoINIncomplete(USBD_HandleTypeDef *pdev,
+                                      uint8_t epnum) {
+  USBD_VENDOR_HandleTypeDef *h = pdev->pClassDataCmsit[pdev->classId];
+  if (h == NULL || !Vendor_IsIso(h, epnum) ||
+      !h->tx_busy[VENDOR_DATA_INDEX]) {
+    return (uint8_t)USBD_OK;
+  }
+  h->tx_busy[VENDOR_DATA_INDEX] = 0U;
+  Vendor_Fops(pdev)->TransmitLost(epnum);
+  return (uint8_t)USBD_OK;
+}
+#endif
+
+static uint8_t *Vendor_GetConfigDesc(uint16_t *length) {
+  *length = (uint16_t)sizeof(vendor_config_desc);
+  return vendor_config_desc;
+}
+
+static uint8_t *Vendor_GetQualifierDesc(uint16_t *length) {
+  *length = (uint16_t)sizeof(vendor_qualifier_desc);
+  return vendor_qualifier_desc;
+}
+
+// ========== INTERFACE SIDE ==========
+
+uint8_t USBD_VENDOR_RegisterInterface(USBD_HandleTypeDef *pdev,
+                                      USBD_VENDOR_ItfTypeDef *fops) {
+  if (fops == NULL) {
+    return (uint8_t)USBD_FAIL;
+  }
+  pdev->pUserData[pdev->classId] = fops;
+  return (uint8_t)USBD_OK;
+}
+
+void USBD_VENDOR_SetRxBuffer(USBD_HandleTypeDef *pdev, uint8_t *buf) {
+  USBD_VENDOR_HandleTypeDef *h = pdev->pClassDataCmsit[pdev->classId];
+  if (h != NULL) {
+    h->rx_buf = buf;
+  }
+}
+
+uint8_t USBD_VENDOR_ReceivePacket(USBD_HandleTypeDef *pdev) {
+  USBD_VENDOR_HandleTypeDef *h = pdev->pClassDataCmsit[pdev->classId];
+  if (h == NULL) {
+    return (uint8_t)USBD_FAIL;
+  }
+  return (uint8_t)USBD_LL_PrepareReceive(pdev, USBD_VENDOR_OUT_EP, h->rx_buf,
+                                         USBD_VENDOR_FS_MPS);
+}
+
+// On USBD_VENDOR_IN_EP or USBD_VENDOR_DATA_EP. USBD_BUSY while a transfer
+// is in flight on that endpoint, USBD_FAIL before the host has configured
+// the device.
+uint8_t USBD_VENDOR_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_addr,
+                             uint8_t *buf, uint32_t len) {
+  USBD_VENDOR_HandleTypeDef *h = pdev->pClassDataCmsit[pdev->classId];
+  if (h == NULL) {
+    return (uint8_t)USBD_FAIL;
+  }
+  uint32_t i = (ep_addr & 0xFU) - 1U;
+  if (h->tx_busy[i]) {
+    return (uint8_t)USBD_BUSY;
+  }
+  h->tx_busy[i] = 1U;
+  h->tx_buf[i] = buf;
+  h->tx_len[i] = len;
+  pdev->ep_in[ep_addr & 0xFU].total_length = len;
+  return (uint8_t)USBD_LL_Transmit(pdev, ep_addr, buf, len);
+}
+
+#endif /* CCD_USB_VENDOR */
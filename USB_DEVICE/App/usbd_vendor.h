@@ -0,0 +1,101 @@
+/**
+ ******************************************************************************
+ * @file           : usbd_vendor.h
+ * @brief          : Vendor-specific bulk class (WinUSB / libusb streaming)
+ ******************************************************************************
+ * Built instead of CDC on the FS port with CCD_USB_VENDOR=1. A composite
+ * device of two vendor interfaces (class 0xFF):
+ *  - 0, control: bulk OUT for the ASCII and binary commands, bulk IN for
+ *    acks and status reports (usb_tx_fs)
+ *  - 1, data: a bulk IN endpoint of its own for frames (usb_tx_data)
+ * Each IN endpoint has its own TX FIFO and queue, so an ack never waits
+ * behind pixel data: its latency is one transfer on the control pipe, even
+ * with the data pipe saturated. Reports still carry the frame_num they
+ * refer to, so the host pairs them across the pipes. There is no
+ * notification endpoint and no line coding, and the host reads with libusb
+ * instead of through a tty.
+ *
+ * The BOS descriptor advertises an MS OS 2.0 descriptor set (usbd_desc.c)
+ * that is returned for the vendor request USBD_VENDOR_MS_CODE. It names
+ * WinUSB as the compatible ID of both functions, so Windows 8.1 and later
+ * bind WinUSB without an INF, and gives each interface the GUID libusb and
+ * WinUSB open it by. Linux and macOS need nothing.
+ *
+ * IN transfers run up to the OTG packet counter limit (1023 packets, the
+ * same USB_TX_MAX_TRANSFER as CDC) and end in a ZLP when they fill the last
+ * packet, so the host can queue large reads.
+ *
+ * With CCD_USB_ISO the data interface has a second alternate setting, in
+ * which the frame endpoint is isochronous with USBD_VENDOR_ISO_MPS byte
+ * packets: the bus reserves one every 1 ms frame, so a frame's delivery
+ * time is fixed by its size whatever else the host is doing, instead of
+ * varying with the bulk traffic. usb_tx_data sends one packet per transfer
+ * (USB_TX_CHUNK_SIZE, the same size) and each frame starts on a packet.
+ * A packet the host did not collect in its frame is neither resent nor
+ * followed by the rest of its frame (UsbTx_OnLost()): the host finds the
+ * frame short and the next one starts clean. Alternate setting 0 is the
+ * bulk endpoint as before, and a switch drops the frames queued.
+ ******************************************************************************
+ */
+
+#ifndef __USBD_VENDOR_H
+#define __USBD_VENDOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "usbd_ioreq.h"
+
+#define USBD_VENDOR_IN_EP 0x81U   // Interface 0: acks and reports
+#define USBD_VENDOR_OUT_EP 0x01U  // Interface 0: commands
+#define USBD_VENDOR_DATA_EP 0x82U // Interface 1: frames
+#define USBD_VENDOR_IN_COUNT 2U
+#define USBD_VENDOR_FS_MPS 64U
+#define USBD_VENDOR_ISO_MPS 512U // The data endpoint's TX FIFO (usbd_conf.c)
+#if CCD_USB_ISO
+#define USBD_VENDOR_CONFIG_DESC_SIZ 64U // Interface 1, alternate setting 1
+#else
+#define USBD_VENDOR_CONFIG_DESC_SIZ 48U
+#endif
+
+#define USBD_VENDOR_MS_CODE 0x01U         // bMS_VendorCode in the BOS
+#define USBD_VENDOR_MS_OS_20_INDEX 0x07U  // wIndex of the descriptor request
+
+// Same callbacks and signatures as USBD_CDC_ItfTypeDef, so usbd_cdc_if.c
+// serves both classes
+typedef struct {
+  int8_t (*Init)(void);
+  int8_t (*DeInit)(void);
+  int8_t (*Receive)(uint8_t *buf, uint32_t *len);
+  int8_t (*TransmitCplt)(uint8_t *buf, uint32_t *len, uint8_t epnum);
+#if CCD_USB_ISO
+  int8_t (*TransmitLost)(uint8_t epnum); // Iso packet dropped, not sent
+  int8_t (*DataAlt)(uint8_t alt);        // Data interface switched
+#endif
+} USBD_VENDOR_ItfTypeDef;
+
+// IN state per endpoint, indexed by endpoint number - 1
+typedef struct {
+  uint8_t *rx_buf;
+  uint32_t rx_len;
+  uint8_t *tx_buf[USBD_VENDOR_IN_COUNT];
+  uint32_t tx_len[USBD_VENDOR_IN_COUNT];
+  volatile uint8_t tx_busy[USBD_VENDOR_IN_COUNT];
+  uint8_t data_alt; // Interface 1: 0 = bulk, 1 = isochronous (CCD_USB_ISO)
+} USBD_VENDOR_HandleTypeDef;
+
+extern USBD_ClassTypeDef USBD_VENDOR;
+
+uint8_t USBD_VENDOR_RegisterInterface(USBD_HandleTypeDef *pdev,
+                                      USBD_VENDOR_ItfTypeDef *fops);
+void USBD_VENDOR_SetRxBuffer(USBD_HandleTypeDef *pdev, uint8_t *buf);
+uint8_t USBD_VENDOR_ReceivePacket(USBD_HandleTypeDef *pdev);
+uint8_t USBD_VENDOR_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_addr,
+                             uint8_t *buf, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __USBD_VENDOR_H */
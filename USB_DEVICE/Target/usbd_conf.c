@@ -26,6 +26,7 @@
 #include "usbd_cdc.h"
 
 /* USER CODE BEGIN Includes */
+#include "ccd_irq.h"
 
 /* USER CODE END Includes */
 
@@ -41,7 +42,7 @@
 PCD_HandleTypeDef hpcd_USB_OTG_FS;
 void Error_Handler(void);
 
-PCD_HandleTypeDef hpcd_USB_OTG_HS;
+CCD_USB_DMA PCD_HandleTypeDef hpcd_USB_OTG_HS;
 void Error_Handler(void);
 
 /* External functions --------------------------------------------------------*/
@@ -105,7 +106,7 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef* pcdHandle)
     __HAL_RCC_USB_OTG_FS_CLK_ENABLE();
 
     /* Peripheral interrupt init */
-    HAL_NVIC_SetPriority(OTG_FS_IRQn, 0, 0);
+    HAL_NVIC_SetPriority(OTG_FS_IRQn, CCD_IRQ_PRIO_USB, 0);
     HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
   /* USER CODE BEGIN USB_OTG_FS_MspInit 1 */
 
@@ -130,6 +131,35 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef* pcdHandle)
   */
     HAL_PWREx_EnableUSBVoltageDetector();
 
+#if CCD_USB_ULPI
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    __HAL_RCC_GPIOB_CLK_ENABLE();
+    __HAL_RCC_GPIOC_CLK_ENABLE();
+    __HAL_RCC_SYSCFG_CLK_ENABLE();
+    /**USB_OTG_HS GPIO Configuration (external ULPI PHY)
+    PA3 D0, PB0 D1, PB1 D2, PB10 D3, PB11 D4, PB12 D5, PB13 D6, PB5 D7,
+    PA5 CK, PC0 STP, PC2_C DIR, PC3_C NXT
+    */
+    // On LQFP100 PC2/PC3 only reach their _C pads through the analog switch
+    HAL_SYSCFG_AnalogSwitchConfig(SYSCFG_SWITCH_PC2 | SYSCFG_SWITCH_PC3,
+                                  SYSCFG_SWITCH_PC2_CLOSE |
+                                      SYSCFG_SWITCH_PC3_CLOSE);
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Pull = GPIO_NOPULL;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+    GPIO_InitStruct.Alternate = GPIO_AF10_OTG1_HS;
+    GPIO_InitStruct.Pin = GPIO_PIN_3|GPIO_PIN_5;
+    HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+    GPIO_InitStruct.Pin = GPIO_PIN_0|GPIO_PIN_1|GPIO_PIN_5|GPIO_PIN_10
+                          |GPIO_PIN_11|GPIO_PIN_12|GPIO_PIN_13;
+    HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+    GPIO_InitStruct.Pin = GPIO_PIN_0|GPIO_PIN_2|GPIO_PIN_3;
+    HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
+
+    /* Peripheral clock enable */
+    __HAL_RCC_USB_OTG_HS_CLK_ENABLE();
+    __HAL_RCC_USB_OTG_HS_ULPI_CLK_ENABLE();
+#else
     __HAL_RCC_GPIOB_CLK_ENABLE();
     /**USB_OTG_HS GPIO Configuration
     PB14     ------> USB_OTG_HS_DM
@@ -144,9 +174,10 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef* pcdHandle)
 
     /* Peripheral clock enable */
     __HAL_RCC_USB_OTG_HS_CLK_ENABLE();
+#endif
 
     /* Peripheral interrupt init */
-    HAL_NVIC_SetPriority(OTG_HS_IRQn, 0, 0);
+    HAL_NVIC_SetPriority(OTG_HS_IRQn, CCD_IRQ_PRIO_USB, 0);
     HAL_NVIC_EnableIRQ(OTG_HS_IRQn);
   /* USER CODE BEGIN USB_OTG_HS_MspInit 1 */
 
@@ -184,12 +215,20 @@ void HAL_PCD_MspDeInit(PCD_HandleTypeDef* pcdHandle)
   /* USER CODE END USB_OTG_HS_MspDeInit 0 */
     /* Peripheral clock disable */
     __HAL_RCC_USB_OTG_HS_CLK_DISABLE();
+#if CCD_USB_ULPI
+    __HAL_RCC_USB_OTG_HS_ULPI_CLK_DISABLE();
+    HAL_GPIO_DeInit(GPIOA, GPIO_PIN_3|GPIO_PIN_5);
+    HAL_GPIO_DeInit(GPIOB, GPIO_PIN_0|GPIO_PIN_1|GPIO_PIN_5|GPIO_PIN_10
+                           |GPIO_PIN_11|GPIO_PIN_12|GPIO_PIN_13);
+    HAL_GPIO_DeInit(GPIOC, GPIO_PIN_0|GPIO_PIN_2|GPIO_PIN_3);
+#else
 
     /**USB_OTG_HS GPIO Configuration
     PB14     ------> USB_OTG_HS_DM
     PB15     ------> USB_OTG_HS_DP
     */
     HAL_GPIO_DeInit(GPIOB, GPIO_PIN_14|GPIO_PIN_15);
+#endif
 
     /* Peripheral interrupt Deinit*/
     HAL_NVIC_DisableIRQ(OTG_HS_IRQn);
@@ -440,9 +479,19 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
   HAL_PCD_RegisterIsoInIncpltCallback(&hpcd_USB_OTG_FS, PCD_ISOINIncompleteCallback);
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
   /* USER CODE BEGIN TxRx_Configuration */
+#if CCD_USB_VENDOR
+  // 320 words in all. The data endpoint gets the FIFO CDC gave EP1, one
+  // USBD_VENDOR_ISO_MPS packet; the control endpoint only carries acks and
+  // reports.
+  HAL_PCDEx_SetRxFiFo(&hpcd_USB_OTG_FS, 0x80);
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_FS, 0, 0x20);
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_FS, 1, 0x20);
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_FS, 2, 0x80);
+#else
   HAL_PCDEx_SetRxFiFo(&hpcd_USB_OTG_FS, 0x80);
   HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_FS, 0, 0x40);
   HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_FS, 1, 0x80);
+#endif
   /* USER CODE END TxRx_Configuration */
   }
   if (pdev->id == DEVICE_HS) {
@@ -452,9 +501,18 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
 
   hpcd_USB_OTG_HS.Instance = USB_OTG_HS;
   hpcd_USB_OTG_HS.Init.dev_endpoints = 9;
+#if CCD_USB_ULPI
+  hpcd_USB_OTG_HS.Init.speed = PCD_SPEED_HIGH;
+  hpcd_USB_OTG_HS.Init.phy_itface = USB_OTG_ULPI_PHY;
+#else
   hpcd_USB_OTG_HS.Init.speed = PCD_SPEED_FULL;
-  hpcd_USB_OTG_HS.Init.dma_enable = DISABLE;
   hpcd_USB_OTG_HS.Init.phy_itface = USB_OTG_EMBEDDED_PHY;
+#endif
+#if CCD_USB_HS_DMA
+  hpcd_USB_OTG_HS.Init.dma_enable = ENABLE;
+#else
+  hpcd_USB_OTG_HS.Init.dma_enable = DISABLE;
+#endif
   hpcd_USB_OTG_HS.Init.Sof_enable = DISABLE;
   hpcd_USB_OTG_HS.Init.low_power_enable = DISABLE;
   hpcd_USB_OTG_HS.Init.lpm_enable = DISABLE;
@@ -482,9 +540,22 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
   HAL_PCD_RegisterIsoInIncpltCallback(&hpcd_USB_OTG_HS, PCD_ISOINIncompleteCallback);
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
   /* USER CODE BEGIN TxRx_HS_Configuration */
-  HAL_PCDEx_SetRxFiFo(&hpcd_USB_OTG_HS, 0x200);
-  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 0, 0x80);
-  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 1, 0x174);
+  // 1024 words, less 36 at the top for the DMA's per-endpoint registers
+  // (3 per endpoint, rounded up). The receive FIFO holds two packets and
+  // the setup slots, EP0 and the unused notification endpoint (EP2) get
+  // their minimum, and the data endpoint (EP1 IN) all the rest.
+#if CCD_USB_ULPI
+  HAL_PCDEx_SetRxFiFo(&hpcd_USB_OTG_HS, 0x120);
+#else
+  HAL_PCDEx_SetRxFiFo(&hpcd_USB_OTG_HS, 0x80);
+#endif
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 0, 0x40);
+#if CCD_USB_ULPI
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 1, 0x26C);
+#else
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 1, 0x30C);
+#endif
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 2, 0x10); // Offset follows EP1's
   /* USER CODE END TxRx_HS_Configuration */
   }
   return USBD_OK;
@@ -684,6 +755,13 @@ USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_addr, u
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
 
+#if CCD_USB_HS_DMA
+  // The OTG_HS DMA reads memory, not the cache: descriptors, replies and
+  // frames written by the CPU go out only once cleaned
+  if (pdev->id == DEVICE_HS && size > 0U) {
+    CCD_DCACHE_CLEAN(pbuf, size);
+  }
+#endif
   hal_status = HAL_PCD_EP_Transmit(pdev->pData, ep_addr, pbuf, size);
 
   usb_status =  USBD_Get_USB_Status(hal_status);
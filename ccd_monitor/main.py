@@ -2,26 +2,3037 @@
 CCD Monitor 2.0 - TCD1304 Spectrometer Interface
 """
 
-import dearpygui.dearpygui as dpg
+try:
+    import dearpygui.dearpygui as dpg
+except ImportError:  # Headless capture only
+    dpg = None
+import argparse
 import serial
 import serial.tools.list_ports
 import struct
 import numpy as np
 import threading
+import queue
+import multiprocessing
+import concurrent.futures
+from multiprocessing import shared_memory
 import time
 import os
+import sys
+import socket
+import platform
+import tempfile
+import select
+import http.server
+import signal
+import itertools
+import functools
+import inspect
 import json
+import numbers
+import asyncio
+from collections import OrderedDict, deque
+import zlib
+import gzip
+import hashlib
+import base64
+import bisect
+import urllib.request
 from datetime import datetime
-from scipy.signal import savgol_filter
+from scipy.signal import savgol_filter, savgol_coeffs, find_peaks as scipy_find_peaks
+from scipy.ndimage import correlate1d
+try:
+    import usb1         # python-libusb1, for the vendor bulk build
+except ImportError:
+    usb1 = None
+try:
+    import numba          # HostPipeline's compiled kernel
+except ImportError:
+    numba = None
+try:
+    import pyarrow as pa  # Arrow and Parquet export, ArrowSpool
+    import pyarrow.ipc
+    import pyarrow.parquet
+except ImportError:
+    pa = None
+try:
+    import cupy as cp     # reprocess(gpu=True), archive_pca(gpu=True)
+    import cupyx.scipy.ndimage
+except ImportError:
+    cp = None
+try:
+    import boto3          # upload_archive() to S3 and compatible stores
+except ImportError:
+    boto3 = None
+try:
+    import faiss          # SimilarityIndex, HNSW
+except ImportError:
+    faiss = None
+try:
+    import hnswlib        # SimilarityIndex without faiss
+except ImportError:
+    hnswlib = None
 
 # ==========================================
 # CONFIGURATION
 # ==========================================
 CCD_PIXELS = 3694
-FRAME_HEADER_SIZE = 4
+FRAME_INFO = struct.Struct('<BBHIQhhIHHI')  # CCD_FrameInfo_t (main.h)
+FRAME_INFO_FIELDS = ("version", "header_len", "flags", "seq", "timestamp",
+                     "die_temp", "board_temp", "exposure_us", "coadd",
+                     "payload_len", "crc")
+FRAME_VERSION = 4
+TEMP_NONE = -32768      # CCD_TEMP_NONE: no such sensor (0.01 degC otherwise)
+FRAME_HEADER_SIZE = 4 + FRAME_INFO.size
+FRAME_CRC_OFFSET = FRAME_HEADER_SIZE - 4  # CRC-32 of the frame with this as 0
 FRAME_SIZE = FRAME_HEADER_SIZE + CCD_PIXELS * 2
 MAGIC = 0xABCD
-BAUD_RATE = 115200
+SHAPED_MAGIC = 0xABCE   # Binned frame: extended header + shortened payload
+SHAPED_HEADER_SIZE = 14 + FRAME_INFO.size
+BURST_MAGIC = 0xABCF    # Burst frame: burst header + a normal frame
+BURST_HEADER_SIZE = 12
+BURST_STATUS = 0xABD0   # Reply to "XS"
+BURST_STATUS_SIZE = 22
+BURST_STATES = ("idle", "armed", "capturing", "draining")
+PHASE_MAGIC = 0xABD1    # Reply to "F1": ADC sample-phase sweep results
+PHASE_RESULT_SIZE = 12
+AE_STATUS = 0xABD2      # Reply to "US": auto-exposure state
+AE_STATUS_SIZE = 24
+HDR_MAGIC = 0xABD3      # Merged exposure bracket ("Q"), float pixels
+HDR_HEADER_SIZE = 24
+SEQ_STATUS = 0xABD4     # Sequence engine state ("Z")
+SEQ_STATUS_SIZE = 14
+SEQ_STATES = ("idle", "starting", "trigger", "settle", "run", "done", "error")
+SNAP_REPORT = 0xABD5    # Follows each mode 1 snap frame ("J")
+SNAP_REPORT_SIZE = 16
+STATS_MAGIC = 0xABD7    # Statistics instead of the frame, see set_frame_stats()
+FRAME_STATS = struct.Struct('<HHIHHII')  # CCD_FrameStats_t (ccd_proc.h)
+FRAME_STATS_FIELDS = ("min", "max", "sum", "mean", "saturated", "centroid",
+                      "signal")
+STATS_OFF, STATS_ONLY = range(2)  # CCD_PROC_STATS_*
+SOURCE_ADC, SOURCE_SPI, SOURCE_PATTERN, SOURCE_DUAL = range(4)  # CCD_ACQ_SRC_*, "V<d>"
+SAT_LEVEL = 2048        # CCD_PROC_SAT_LEVEL
+NO_CENTROID = 0xFFFFFFFF
+PEAKS_MAGIC = 0xABD8    # Peak list instead of the frame, see set_device_peaks()
+PEAKS_HEADER_SIZE = FRAME_HEADER_SIZE + 4  # CCD_PeaksHeader_t
+PEAK = struct.Struct('<IH')  # CCD_Peak_t
+PEAKS_OFF, PEAKS_ONLY = range(2)  # CCD_PROC_PEAKS_*
+FIT_PARABOLA, FIT_GAUSS = range(2)  # CCD_PROC_FIT_*
+DESPIKE_MODES = ("off", "median", "sigma")  # CCD_PROC_DESPIKE_*
+DESPIKE_SIGMA_MIN = 1.0  # CCD_PROC_DESPIKE_SIGMA_MIN, in sigmas
+DEFECT_BYTES = (CCD_PIXELS + 7) // 8  # CCD_PROC_DEFECT_BYTES: the map
+DEFECT_CHUNK = 32       # CCD_PROC_DEFECT_CHUNK: map bytes per reply
+DEFECT_OFF, DEFECT_ON, DEFECT_DETECT, DEFECT_WRITE, DEFECT_READ, \
+    DEFECT_SAVE, DEFECT_LOAD, DEFECT_CLEAR = range(8)  # CCD_DEFECT_*
+BANDS_MAGIC = 0xABDA    # Band values instead of the frame, see set_device_bands()
+BANDS_HEADER_SIZE = FRAME_HEADER_SIZE + 2  # CCD_BandsHeader_t
+BAND = struct.Struct('<HHH')  # CCD_Band_t
+BANDS_MAX = 16          # CCD_PROC_BANDS_MAX
+BANDS_APPLY = 0x80      # CCD_BANDS_APPLY
+BAND_UNITY = 4096       # CCD_PROC_BAND_UNITY
+FOCUS_MAGIC = 0xABE3    # Line heights and widths instead of the frame, see set_focus_lines()
+FOCUS_HEADER_SIZE = FRAME_HEADER_SIZE + 2  # CCD_FocusHeader_t
+FOCUS_LINE = struct.Struct('<HH')  # CCD_FocusLine_t
+FOCUS_VALUE = struct.Struct('<IHH')  # CCD_FocusValue_t
+FOCUS_MAX = 16          # CCD_PROC_FOCUS_MAX
+FOCUS_LEN = (3, 255)    # CCD_PROC_FOCUS_LEN_MIN/MAX, pixels
+FOCUS_REPLY = struct.Struct('<BBIIHH')  # CCD_FocusStatus_t
+FOCUS_KEPT = 4096       # Frames focus_track keeps
+ROI_MAX = 4             # CCD_PROC_ROI_MAX: windows per shaped frame
+AUTOROI_REPLY = struct.Struct('<4BHHBBI8H')  # CCD_AutoRoiStatus_t
+AUTOROI_OFF, AUTOROI_ON, AUTOROI_AGAIN = range(3)  # CCD_PROC_AUTOROI_*
+AUTOROI_STATES = ("idle", "search", "set")  # CCD_AUTOROI_*
+AUTOROI_FRAMES_MAX = 64  # CCD_PROC_AUTOROI_FRAMES_MAX
+AUTOROI_MARGIN_MAX = 256  # CCD_PROC_AUTOROI_MARGIN_MAX, pixels
+LINE_MAGIC = 0xABDB     # Encoder line-scan tile, see set_encoder_lines()
+LINE_HEADER_SIZE = FRAME_HEADER_SIZE + 12  # CCD_LineTileHeader_t
+LINE_TILE = struct.Struct('<BBHII')  # Its fields after the info
+LINE_ENTRY = struct.Struct('<IiQ')  # CCD_LineEntry_t
+LINE_POS_NONE = -0x80000000  # CCD_LINE_POS_NONE: no boundary matched
+LINE_SCAN_ROWS = 1024   # Lines line_scan keeps
+CMD_VALUE_MAX = 60      # CCD_CMD_VALUE_MAX: longest value one frame carries
+JPEG_MAGIC = 0xABDC     # JPEG line-scan preview strip, see set_line_preview()
+JPEG_HEADER_SIZE = FRAME_HEADER_SIZE + 28  # CCD_JpegHeader_t
+JPEG_STRIP = struct.Struct('<BBHIIiiII')  # Its fields after the info
+JPEG_STRIPS_KEPT = 256  # Strips line_preview keeps
+PTC_MAGIC = 0xABDD      # Photon transfer maps of one level, see start_ptc()
+PTC_HEADER_SIZE = FRAME_HEADER_SIZE + 28  # CCD_PtcHeader_t
+PTC_LEVEL = struct.Struct('<BBHII3fI')  # Its fields after the info
+PTC_SET, PTC_START, PTC_STOP = range(3)  # CCD_PTC_* actions
+PTC_STATES = ("idle", "starting", "settle", "run", "sending", "done", "error")
+PTC_LEVELS = 32         # CCD_PTC_LEVELS
+PTC_SET_CHUNK = (CMD_VALUE_MAX - 3) // 4  # Integration times per PTC_SET
+DRIFT_MAGIC = 0xABDE    # Drift record instead of the frame, see set_drift()
+DRIFT_RECORD = struct.Struct('<iHBx')  # CCD_DriftFrame_t after the info
+DRIFT_MODES = ("off", "track", "only")  # CCD_PROC_DRIFT_*
+DRIFT_MODE, DRIFT_REF, DRIFT_BAND = range(3)  # CCD_DRIFT_* actions
+DRIFT_STATES = ("none", "ready", "capturing")  # CCD_DRIFT_*
+DRIFT_LAG_MAX = 32      # CCD_PROC_DRIFT_LAG_MAX
+DRIFT_REF_MAX = 256     # CCD_PROC_DRIFT_REF_MAX
+DRIFT_KEPT = 4096       # Records drift_track keeps
+MATCH_MAGIC = 0xABDF    # Classification instead of the frame, see set_matching()
+MATCH_RECORD = struct.Struct('<BBhhH')  # CCD_MatchFrame_t after the info
+MATCH_MODES = ("off", "track", "only")  # CCD_MATCH_OFF..ONLY
+MATCH_MODE, MATCH_CAPTURE, MATCH_WRITE, MATCH_READ, MATCH_CLEAR, \
+    MATCH_SAVE, MATCH_LOAD = range(7)  # CCD_MATCH_* actions
+MATCH_REFS = 24         # CCD_MATCH_REFS
+MATCH_FIRST = 32        # CCD_PHASE_ACTIVE_START: first binned pixel
+MATCH_BIN = 16          # CCD_MATCH_BIN: pixels per bin
+MATCH_BINS = 228        # CCD_MATCH_BINS
+MATCH_CHUNK = 16        # CCD_MATCH_CHUNK: bins per reply
+MATCH_NONE = 0xFF       # CCD_MATCH_NONE
+MATCH_REF_MAX = 256     # CCD_MATCH_REF_MAX
+MATCH_KEPT = 4096       # Records match_track keeps
+WIDE_MAGIC = 0xABE0     # 32-bit co-add or rolling output, see set_wide_output()
+WIDE_HEADER_SIZE = FRAME_HEADER_SIZE + 4  # CCD_WideHeader_t
+WIDE_TAIL = struct.Struct('<BxH')  # Its fields after the info
+WIDE_FORMATS = ("off", "sum", "float")  # CCD_PROC_WIDE_*
+WIDE_SUM, WIDE_FLOAT = 1, 2
+DUAL_MAGIC = 0xABE1     # Sensor B beside the sensor A frame, see set_source()
+DUAL_KEPT = 8           # Sensor B frames waiting for their sensor A frame
+LOOP_MAGIC = 0xABE2     # Echoed or source message of a USB link test, see bench_usb()
+DARK_MAGIC = 0xABE4     # Closed-shutter frame, CCD_Frame_t; see set_live_dark()
+MODEL_MAGIC = 0xABE5    # Model values instead of the frame, see set_model()
+REPLAY_MAGIC = 0xABE6   # Frame written to the device for it to process, see replay()
+MODEL_RECORD = struct.Struct('<4fBBH')  # CCD_ModelFrame_t after the info
+MODEL_MODES = ("off", "track", "only")  # CCD_MODEL_OFF..ONLY
+MODEL_PREPS = ("none", "area", "snv")  # CCD_MODEL_PREP_*
+MODEL_MODE, MODEL_WRITE, MODEL_SCALE, MODEL_READ, MODEL_CLEAR, \
+    MODEL_SAVE, MODEL_LOAD = range(7)  # CCD_MODEL_* actions
+MODEL_OUTPUTS = 4       # CCD_MODEL_OUTPUTS
+MODEL_FIRST = 32        # CCD_PHASE_ACTIVE_START: first binned pixel
+MODEL_BIN = 4           # CCD_MODEL_BIN: pixels per bin
+MODEL_BINS = 912        # CCD_MODEL_BINS
+MODEL_CHUNK = 16        # CCD_MODEL_CHUNK: loadings per reply
+MODEL_NONE = 0xFF       # CCD_MODEL_NONE
+MODEL_KEPT = 4096       # Records model_track keeps
+LOOP_HEADER = struct.Struct('<HHI')  # CCD_LoopHeader_t: magic, length, seq
+CMD_SYNC = 0xC3         # Binary command frame (ccd_cmd.h)
+CMD_ACK = 0xABD6        # Acknowledgement of each binary command
+FAULT_MAGIC = 0xABD9    # Loss and fault counters, every second; see request_faults()
+FAULT_REPORT = struct.Struct('<BB15I')  # CCD_FaultReport_t after its magic
+FAULT_FIELDS = ("uptime_ms", "dropped", "resyncs", "overruns", "dma_errors",
+                "usb_busy", "usb_full", "usb_aborted", "cmd_errors",
+                "cmd_stalls", "throttled", "boots", "faults", "rearms",
+                "misaligned")
+FAULT_CAUSES = ("none", "error_handler", "hard_fault", "watchdog")  # CCD_FAULT_*
+CMD_ACK_SIZE = 6
+CMD_PING, CMD_MODE, CMD_EXPOSURE, CMD_INTEGRATION, CMD_ROI, CMD_BINNING, \
+    CMD_COADD, CMD_ROLLING, CMD_TRIGGER, CMD_TRANSPORT = range(10)
+CMD_CONFIG = 0x0A       # u8 CONFIG_*, u8 arg; see config()
+CONFIG_STATUS, CONFIG_SAVE, CONFIG_AUTO, CONFIG_DEFAULTS = range(4)  # CCD_CONFIG_*
+CONFIG_REPLY = struct.Struct('<5B3x2I')  # CCD_ConfigStatus_t
+CONFIG_FIELDS = ("auto_save", "restored", "warm_boot", "adc_cached",
+                 "pending", "saves", "free")
+CMD_DARK_TEMP = 0x0B    # u8 knots, DARKT_KNOTS (temp, gain); see set_dark_temperature()
+DARKT_KNOTS = 8         # CCD_PROC_DARKT_KNOTS
+DARKT_STATUS = 0xFF     # CCD_DARKT_STATUS: only the reply
+DARKT_KNOT = struct.Struct('<hH')  # CCD_DarkTempKnot_t
+DARKT_REPLY = struct.Struct('<BBhhHH2x')  # CCD_DarkTempStatus_t
+DARKT_UNITY = 4096      # CCD_PROC_DARKT_UNITY
+CMD_BLACK = 0x0C        # u8 0/1, BLACK_STATUS = read; see set_black_level()
+BLACK_STATUS = 0xFF     # CCD_BLACK_STATUS
+BLACK_REPLY = struct.Struct('<BxHH')  # CCD_BlackStatus_t
+CMD_STATS = 0x10
+CMD_TIME = 0x11         # Clock sync ping, see sync_time()
+CMD_TIME_REPLY = struct.Struct('<QQQB3xI')  # CCD_CmdTime_t
+TIME_SYNC_INTERVAL = 0.5  # Seconds between pings while connected
+TIME_SYNC_SAMPLES = 64    # Exchanges the clock fit looks back over
+CMD_FLOW = 0x12         # Flow control policy, see set_flow()
+CMD_CREDIT = 0x13       # Frames allowed since CMD_FLOW
+CMD_INFO = 0x14         # Firmware description, see request_info()
+CMD_INFO_REPLY = struct.Struct('<HHIIIBBBx')  # CCD_CmdInfo_t
+CMD_PROTOCOL = 2        # CCD_CMD_PROTOCOL this host understands
+BUILD_OPTIONS = ("cache", "vendor", "ulpi", "hs_dma", "eth", "sd", "psram",
+                 "ext_adc", "trace", "ntc", "encoder", "jpeg",
+                 "ref", "din", "iso", "mains", "shutter",
+                 "model")  # CCD_CMD_BUILD_*
+CMD_CAPS = struct.Struct('<IHHBBBxII')  # Appended to CCD_CmdInfo_t
+CMD_SENSOR = struct.Struct('<BBHHHH')  # Appended after CMD_CAPS
+SENSORS = ("TCD1304", "TCD1254", "ILX511", "S11639")  # CCD_SENSOR
+FORMATS = ("raw", "shaped", "packed", "rice", "temporal", "wide", "hdr",
+           "stats", "peaks", "bands", "drift", "match", "ptc", "line", "jpeg",
+           "burst", "dual", "dark", "model")  # CCD_CMD_FMT_*
+SINKS = ("usb_fs", "usb_hs", "hs_480", "eth", "sd", "psram")  # CCD_CMD_SINK_*
+CMD_RECORD = 0x15       # SD recording (CCD_SD=1), see record()
+REC_STOP, REC_START, REC_STATUS = range(3)  # CCD_REC_CMD_*
+REC_STATUS_REPLY = struct.Struct('<B3x6I')  # CCD_RecStatus_t
+REC_STATUS_FIELDS = ("state", "frames", "capacity", "skipped", "dropped",
+                     "first_seq", "sd_error")
+REC_STATES = ("idle", "recording", "stopping", "error")
+REC_HEADER = struct.Struct('<IHHIIII')  # CCD_RecHeader_t
+REC_MAGIC, REC_BASE, REC_BLOCK = 0x52444343, 2048, 512  # ccd_rec.h
+CMD_PROFILE = 0x16      # Processing cost per stage, see request_profile()
+CMD_FRAME_STATS = 0x17  # u8 STATS_*, u16 saturation level
+CMD_PEAKS = 0x18        # u8 PEAKS_*, u8 FIT_*, u16 threshold, u16 min distance
+CMD_SMOOTH = 0x19       # u8 window (0 = off), u8 order
+CMD_WAVELENGTH = 0x1A   # u8 WL_*, CCD_Wavelength_t; see set_wavelength()
+WL_SET, WL_STATUS, WL_SAVE = range(3)  # CCD_WL_CMD_*
+WAVELENGTH = struct.Struct('<7fBB')    # CCD_Wavelength_t
+WL_ORDER_MAX = 4
+CMD_ABSORBANCE = 0x1B   # u8 ABS_*, u16 reference frames (0 = keep)
+ABS_OFF, ABS_TRANSMITTANCE, ABS_ABSORBANCE = range(3)  # CCD_PROC_ABS_*
+ABS_STATES = ("none", "ready", "capturing")            # CCD_ABS_*
+CMD_LINEARITY = 0x1C    # u8 LIN_*, u16 offset, LIN_CHUNK u16 knots
+LIN_WRITE, LIN_APPLY, LIN_OFF, LIN_SAVE, LIN_LOAD = range(5)  # CCD_LIN_CMD_*
+LIN_KNOTS, LIN_CHUNK = 257, 24  # Knot i: output for raw value i * 256
+CMD_BENCH = 0x1D        # u8 BENCH_*, u32 frames/s, u32 count; see start_bench()
+BENCH_OFF, BENCH_RAMP, BENCH_COUNTER, BENCH_PRBS, \
+    BENCH_REPLAY = range(5)  # CCD_BENCH_*; REPLAY: frames from the host, see replay()
+CMD_PROBE = 0x1E        # u8 probe, u8 reset; see request_probes()
+PROBE_NAMES = ("icg_isr", "dma_isr", "sh_isr", "usb_fs_isr", "usb_hs_isr",
+               "trig_isr", "loop", "cmd", "mode", "bench", "proc", "phase",
+               "ae", "seq", "rec", "eth", "send", "snap",
+               "clock", "fault", "config", "adccal", "temp", "watch",
+               "defer_isr", "selftest")  # CCD_PROBE_*
+PROBE_REPLY = struct.Struct('<BBxx4I11I')  # CCD_CmdProbe_t
+PROBE_BIN0 = 64         # CCD_PROBE_BIN0: bin k from PROBE_BIN0 << (k - 1)
+CMD_TELEMETRY = 0x1F    # u8 TELEM_*, u8 reset; see request_latency()
+TELEM_LATENCY, TELEM_FAULTS, TELEM_KERNEL, TELEM_ADCCAL, TELEM_PREVIEW, \
+    TELEM_PREVIEW_BIN, TELEM_BANDS, TELEM_EXPOSE, TELEM_LINE, \
+    TELEM_JPEG, TELEM_DESPIKE, TELEM_PTC, \
+    TELEM_DEFECT, TELEM_DRIFT, TELEM_MATCH, TELEM_WIDE, \
+    TELEM_MEMORY, TELEM_SATURATION, TELEM_REFERENCE, \
+    TELEM_TXN, TELEM_INPUTS, TELEM_LOOP, TELEM_MAINS, \
+    TELEM_SELFTEST, TELEM_BASELINE, TELEM_FOCUS, \
+    TELEM_AUTOROI, TELEM_SHUTTER, TELEM_MODEL = range(29)  # CCD_TELEM_*
+TELEM_KEEP = 0xFF       # CCD_TELEM_FAULTS: leave the in-stream period
+LATENCY_NAMES = ("arm", "ready", "sent", "total")  # CCD_LAT_*
+LATENCY_REPLY = struct.Struct('<HH2I12II')  # CCD_LatReport_t
+KERNEL_NAMES = ("linearity", "dark", "flat", "coadd", "change", "stats",
+                "bin", "pack12", "rice", "crc", "despike")  # CCD_PROC_KERNEL_*
+REGION_NAMES = ("dtcm", "axi", "axi_cold", "d2")  # CCD_PROC_REGION_*
+KERNEL_REPLY = struct.Struct('<BBH12I')  # CCD_ProcBench_t
+ADCCAL_REPLY = struct.Struct('<hhBBxx4I')  # CCD_AdcCalStatus_t
+ADCCAL_SOURCES = ("measured", "stored")  # CCD_ADCCAL_*
+PREVIEW_REPLY = struct.Struct('<BBBx2I')  # CCD_PreviewStatus_t
+BANDS_REPLY = struct.Struct('<BBxxI')  # CCD_BandsStatus_t
+EXPOSE_REPLY = struct.Struct('<B3x2I2H')  # CCD_ExposeStatus_t
+EXPOSE_STATES = ("idle", "running", "reading")  # CCD_EXPOSE_*
+EXPOSE_MIN_MS, EXPOSE_MAX_MS = 10, 120000  # CCD_ACQ_EXPOSE_*_MS
+LINE_REPLY = struct.Struct('<HBBi3I')  # CCD_LineStatus_t
+JPEG_REPLY = struct.Struct('<BBH6I')  # CCD_JpegStatus_t
+DESPIKE_REPLY = struct.Struct('<BBHB3x6I')  # CCD_DespikeStatus_t
+PTC_REPLY = struct.Struct('<BBBx2H5I3f')  # CCD_PtcStatus_t
+DEFECT_REPLY = struct.Struct(f'<BB5HI{DEFECT_CHUNK}s')  # CCD_DefectStatus_t
+DRIFT_REPLY = struct.Struct('<4B2H5i2H3I')  # CCD_DriftStatus_t
+MATCH_REPLY = struct.Struct(f'<4B2hH2B5I2BH{MATCH_CHUNK}H')  # CCD_MatchStatus_t
+WIDE_REPLY = struct.Struct('<BBH')  # CCD_WideStatus_t
+RING_HIST = 8           # FRAME_RING_HIST occupancy bins
+MEMORY_REPLY = struct.Struct(f'<9I4B{RING_HIST}I')  # CCD_MemStatus_t
+MEMORY_FIELDS = ("stack_size", "stack_peak", "heap_used", "heap_free",
+                 "image", "itcm", "dtcm", "ram_d1", "ram_d2")
+MEM_CLEAR = 1           # CCD_MEM_CLEAR: restart the ring occupancy bins
+SAT_REPLY = struct.Struct('<BBH8I')  # CCD_SatStatus_t
+SAT_MODES = ("off", "flag", "ae")  # CCD_ACQ_SAT_*
+SAT_FIELDS = ("seq", "history", "frames", "saturated", "last", "early",
+              "seen_us", "readout_us")
+REF_REPLY = struct.Struct('<BBHIIII15I')  # CCD_RefStatus_t
+REF_MODES = ("off", "measure", "normalize")  # CCD_REF_*
+TXN_HIST = 10           # CCD_TXN_HIST generations kept
+TXN_REPLY = struct.Struct(f'<BBH3I{TXN_HIST}I')  # CCD_TxnStatus_t
+TXN_BEGIN, TXN_COMMIT, TXN_ABORT, TXN_FORMAT = range(4)  # CCD_TXN_*
+TXN_STATES = ("idle", "open", "armed", "refused")  # CCD_TxnStatus_t.state
+DIN_LEVELS, DIN_EDGES = 16, 6  # CCD_DIN_LEVELS, CCD_DIN_EDGES
+INPUTS_REPLY = struct.Struct(f'<4B2I{DIN_LEVELS}B{2 * DIN_EDGES}I')  # CCD_DinStatus_t
+INPUT_EDGES = ("off", "rising", "falling", "both")  # CCD_DIN_EDGE_*
+DIN_LATE, DIN_NONE = 0x80, 0xFF  # CCD_DIN_LATE, CCD_DIN_NONE
+LOOP_REPLY = struct.Struct('<3B8I')  # CCD_LoopStatus_t
+LOOP_TESTS = ("echo", "sink", "source")  # CCD_LOOP_*
+LOOP_STOP, LOOP_NONE = 3, 0xFF  # CCD_LOOP_STOP, CCD_LOOP_NONE
+LOOP_PORTS = ("fs", "hs")  # CCD_LOOP_FS, CCD_LOOP_HS
+LOOP_FIELDS = ("count", "done", "packets", "elapsed_us", "dropped",
+               "hold_max_us", "hold_sum_us", "tests")
+LOOP_PACKET = {'fs': 64, 'hs': 512}  # One OUT packet per echo
+LOOP_CHUNK = 4096       # CCD_LOOP_CHUNK: bytes per source message at most
+MAINS_REPLY = struct.Struct('<4BH7I')  # CCD_MainsStatus_t
+MAINS_SET = 0           # CCD_MAINS_SET
+MAINS_FIELDS = ("period_us", "freq_mhz", "crossings", "glitches",
+                "triggers", "dev_max_us", "late")
+SYNC_LINE = 3           # CCD_SYNC_LINE: "Y3"
+SHUTTER_REPLY = struct.Struct('<4BHBBh4I')  # CCD_ShutterStatus_t
+SHUTTER_OFF, SHUTTER_ON, SHUTTER_AGAIN = range(3)  # CCD_SHUTTER_*
+SHUTTER_STATES = ("idle", "open", "closing", "dark", "opening")
+SHUTTER_FIELDS = ("cycles", "dark_frames", "dropped", "seq")
+SHUTTER_SETTLE_MAX = 16  # CCD_SHUTTER_SETTLE_MAX, also for darks
+SHUTTER_SHIFT_MAX = 8   # CCD_SHUTTER_SHIFT_MAX
+MODEL_REPLY = struct.Struct(f'<4B5I4f2f2BH{MODEL_CHUNK}h')  # CCD_ModelStatus_t
+SELFTEST_REPLY = struct.Struct('<4B5I4I4II')  # CCD_SelftestStatus_t
+SELFTEST_STATES = ("none", "due", "run", "pass", "fail")  # CCD_SELFTEST_*
+SELFTEST_CHANNELS = ("fm", "adc", "sh", "icg")  # Mask bit 0 first
+SELFTEST_AGAIN = 2      # CCD_SELFTEST_AGAIN; 0/1 turn the guard off/on
+SELFTEST_FIELDS = ("runs", "passes", "failures", "fallbacks", "retries")
+BASELINE_REPLY = struct.Struct('<BBHI3HI')  # CCD_BaselineStatus_t
+BASELINE_MODES = ("off", "subtract", "estimate")  # CCD_PROC_BASE_*
+BASELINE_FIELDS = ("width", "frames", "low", "high", "mean", "clipped")
+BASELINE_WIDTH = (32, 2048)  # CCD_PROC_BASE_WIDTH_MIN/MAX, pixels
+TXN_FIELDS = ("exposure", "integration", "roi", "binning", "coadd",
+              "rolling", "packing", "codec")  # CCD_TXN_F_*, bit 0 first
+PROC_STAGES = ("linearity", "dark", "flat", "coadd", "rolling", "change",
+               "absorb", "smooth", "resample", "stats", "peaks",
+               "shape", "bands", "despike", "defect",
+               "drift", "match", "ref", "baseline",
+               "focus", "model")  # CCD_PROC_STAGE_*
+FLOW_POLICIES = ("off", "hold", "decimate", "coadd")  # CCD_FLOW_*
+TX_FRAME, TX_BATCH, TX_DUAL, TX_ETH, TX_FANOUT = 1, 2, 3, 4, 5  # CCD_TX_*
+DUAL_TIMEOUT = 0.05     # Read timeout per port while streaming on both
+DUAL_REORDER = 32       # Frames one port may run ahead of the other
+ETH_GROUP, ETH_PORT = "239.255.67.68", 50067  # CCD_ETH_GROUP, CCD_ETH_PORT
+ETH_RCVBUF = 4 << 20    # Socket buffer, about 500 frames
+CMD_STATUS = ("ok", "rejected", "unknown", "bad length", "bad check")
+CMD_STATS_FIELDS = ("produced", "released", "dropped", "resyncs", "dma_errors",
+                    "coadded", "commands", "cmd_errors", "uptime_ms",
+                    "throttled", "loop_max_us", "late", "irq_fixes", "packed",
+                    "packs", "icg_count", "missed", "dual_dropped")
+PHASE_SAMPLE_CYCLES = (2.5, 8.5, 16.5)  # ADC sampling time per "sample" index
+BAUD_RATE = 115200      # Ignored by the CDC device, any value works
+USB_VID = 0x0483        # Vendor bulk build (CCD_USB_VENDOR=1, usbd_desc.c)
+USB_PID_VENDOR = 22352
+USB_PID_CDC = 22336     # Virtual COM port builds
+USB_BULK_IN, USB_BULK_OUT = 0x81, 0x01  # Interface 0: acks, reports, commands
+USB_BULK_DATA = 0x82    # Interface 1: frames
+USB_BULK_PORT = "USB bulk (libusb)"  # Port list entry for it, or for
+                                     # one board: "<that>:<serial number>"
+ACQ_RING_SLOTS = 256    # Frames the shared ring keeps, see FrameRing
+# Host recording file (.ccdrec): this header, then one FRAME_RECORD per
+# frame, so the file maps straight into a structured numpy array
+CCDREC_HEADER = struct.Struct('<4sHHI')  # magic, version, pixels, record size
+CCDREC_MAGIC, CCDREC_VERSION = b'CCDR', 1
+CCDREC_QUEUE = 256      # Frames waiting for the writer before some drop
+EVENT_PRE = 100         # Frames an EventRecorder keeps from before a trigger
+EVENT_POST = 100        # Frames it records after the last one
+LINK_LOG = ".link.jsonl"  # Suffix of a recording's link log, see LinkHealth
+INDEX_SUFFIX = ".index"   # A recording's FrameIndex directory
+INDEX_PEAKS = 4           # Highest peaks a FrameIndex row keeps
+INDEX_THRESHOLD = 1000    # Counts above which they are looked for
+INDEX_BLOCK = 4096        # Rows written, and turned into columns, at a time
+OVERVIEW_SUFFIX = ".overview"  # A recording's OverviewPyramid directory
+OVERVIEW_LEVELS = (10, 100, 1000)  # Frames per row of each level
+OVERVIEW_BIN = 8          # Pixels per column
+SIMILAR_SUFFIX = ".similar"  # A recording's SimilarityIndex directory
+SIMILAR_BIN = 8           # Pixels per bin of an embedding
+SIMILAR_DIMS = 64         # PCA components kept (0: the bins as they are)
+SIMILAR_TRAIN = 20000     # Frames, spread over the recording, the PCA sees
+SIMILAR_LINKS = 32        # HNSW neighbours per node
+SIMILAR_EF_BUILD = 200    # HNSW candidates while adding
+SIMILAR_EF = 128          # HNSW candidates while searching, at least k
+ARROW_BATCH = 1024        # Frames per record batch of an Arrow export
+ARROW_SPOOL_DIR = os.path.join("/dev/shm" if os.path.isdir("/dev/shm")
+                               else tempfile.gettempdir(), "ccd_arrow")
+ARROW_SPOOL_FRAMES = 64   # Frames per ArrowSpool file, at most
+ARROW_SPOOL_S = 0.5       # Seconds per ArrowSpool file, at most
+ARROW_SPOOL_FILES = 32    # Files an ArrowSpool keeps
+TSDB_FORMATS = ("line", "arrow")  # TsdbSink: InfluxDB line protocol, Arrow IPC
+TSDB_BATCH = 5000         # Points per write, at most
+TSDB_FLUSH_S = 1.0        # Seconds a point waits for its batch, at most
+TSDB_BUFFER = 200000      # Points held while the database is away
+TSDB_RETRY_S = (0.5, 30.0)  # First and longest wait between retries
+TSDB_TIMEOUT = 10.0       # Seconds per write
+FRAME_RECORD = [('frame_num', '<u4'), ('seq', '<u4'), ('exposure_us', '<u4'),
+                ('time_s', '<f8'),        # Device clock
+                ('timestamp', '<f8'),     # Host clock, see device_to_host()
+                ('die_temp_c', '<f8'),    # NaN = not reported
+                ('board_temp_c', '<f8'),
+                ('pixels', '<u2', (CCD_PIXELS,))]
+FRAME_RECORD_META = struct.Struct('<IIIdddd')  # FRAME_RECORD up to pixels
+# Archive file (.ccdarc): header and JSON metadata, then chunks of
+# CCDARC_CHUNK_FRAMES frames (metadata as is, pixels byte-shuffled and
+# deflated), then the chunk index and a footer pointing at it
+CCDARC_HEADER = struct.Struct('<4sHHHxxI')  # magic, version, pixels,
+                                            # frames per chunk, JSON length
+CCDARC_MAGIC, CCDARC_VERSION = b'CCDA', 1
+CCDARC_CHUNK = struct.Struct('<4sIII')  # magic, frames, metadata, pixel bytes
+CCDARC_CHUNK_MAGIC = b'CHNK'
+CCDARC_INDEX = struct.Struct('<Q')      # Chunk offsets
+CCDARC_FOOTER = struct.Struct('<QI4s')  # Index offset, chunks, magic
+CCDARC_FOOTER_MAGIC = b'CIDX'
+CCDARC_CHUNK_FRAMES = 64
+CCDARC_LEVEL = 1        # zlib level: shuffled CCD lines gain little above it
+CCDARC_CACHE = 16       # Inflated chunks an Archive keeps (~0.5 MB each)
+CCDARC_PREFETCH = 2     # Chunks inflated ahead and behind the one in use
+UPLOAD_SUFFIX = ".upload.json"  # An archive's upload state, for resuming
+UPLOAD_PART = 32 << 20  # Bytes per multipart part, rounded up to a chunk
+UPLOAD_WORKERS = 8      # Parts in flight
+UPLOAD_RETRIES = 5      # Tries of a part before the upload stops
+UPLOAD_POLL = 1.0       # Seconds between looks at an archive being written
+ACQ_IDLE = 0.05         # Acquisition process poll while not connected, s
+RECONNECT_POLL = 0.02   # Device scans while a lost board is looked for, s
+ALIGN_TOLERANCE = 0.001 # DeviceManager: capture times matching, s
+FUSE_MODES = ("linear", "nearest")  # FrameFuser resampling
+FUSE_STALL = 0.5        # A board this far behind the others is not waited for, s
+FUSE_QUEUE = 1024       # Fused records kept for the reader
+FUSE_POLL = 0.0005      # Merge thread's wait for frames, s
+SIM_PORT = "Simulator"  # Port list entry for VirtualDevice; "<that>:<file>"
+                        # replays a recording
+SIM_RATE = 135.0        # Frames per second, about the mode 0 ICG rate
+SIM_CLOCK_HZ = 1000000  # Frame timestamp clock
+SIM_FRAMES = 32         # Synthetic frames made up front and cycled
+BENCH_FRAMES = 2000     # Frames per benchmark stage
+BENCH_TOLERANCE = 0.05  # Worse than the baseline by this much: a regression
+BENCH_PLOT_WIDTH = 1200 # Plot columns for the display stage
+BENCH_REPEATS = 5       # Passes per micro-benchmark; the best one counts
+BENCH_STAGES = ("link", "usb", "parse", "record", "display", "stages", "decode",
+                "gui")
+BENCH_ECHO_ROUNDS = 1000  # Echo round trips per port
+BENCH_USB_MB = 8        # MB into and out of the device per port
+LINK_EMA = 1 / 64       # LinkHealth smoothing of interval and jitter
+LINK_HISTORY = 120      # Seconds the health panel plots
+LINK_FIELDS = ("fps", "lost", "crc_errors", "resyncs", "skipped_bytes",
+               "device_dropped", "interval_ms", "jitter_ms",
+               "jitter_max_ms")  # LinkHealth.tick(), per second
+PLAN_HEADROOM = 0.8     # ReadoutPlanner: share of the link it fills
+PLAN_DROP_SECONDS = 3   # Seconds in a row with frames lost before a re-plan
+PLAN_TEST_MB = 2        # Its link test, MB out of the device
+PLAN_RATIO = {"rice": 1.6, "temporal": 2.4}  # Coded size ratios until measured
+PLAN_BINNING = (1, 2, 4, 8)
+PLAN_BITS = (16, 14, 12)
+PLAN_CODECS = ("none", "rice", "temporal")  # Codec ids 0, CODEC_RICE, CODEC_TEMPORAL
+FANOUT_PORT = 50068     # FramePublisher TCP port
+FANOUT_HOST = "127.0.0.1"  # FramePublisher interface: this host only
+METRICS_PORT = 9468     # MetricsServer HTTP port (/metrics)
+METRICS_POLL = 5.0      # Seconds between the device telemetry it asks for
+FANOUT_POLL = 0.005     # Publisher poll of the ring, s
+FANOUT_SEND_TIMEOUT = 5.0  # A subscriber this long in one send is dropped
+STREAM_BUFFER = ACQ_RING_SLOTS // 2  # Frames a FrameStream may fall behind
+STREAM_DROPS = ("oldest", "raise")  # What it does beyond that
+STREAM_POLL = 0.002     # FrameStream poll of the ring, s
+AVG_BLOCK, AVG_ROLLING, AVG_EXP = range(3)  # FrameAverager modes
+AVG_MODES = ("Block", "Rolling", "Exponential")
+AVG_ROLLING_MAX = 64    # Frames a rolling mean can span
+FRAME_POOL_SLOTS = 4    # Raw frames received before a FramePool buffer is reused
+RX_CHUNK = 65536        # Bytes a port read takes at most, see CCDReceiver._fill()
+WATERFALL_ROWS = 512    # Frames the waterfall shows, one texture row each
+WATERFALL_WIDTH = 1024  # Texture columns, each the maximum of its pixels
+WATERFALL_SIZE = (900, 512)  # On screen
+# Colour map control points, low to high (close to matplotlib's inferno)
+WATERFALL_COLOURS = ((0, 0, 4), (87, 16, 110), (188, 55, 84),
+                     (249, 142, 9), (252, 255, 164))
+PEAK_TRACK_MAX = 16     # Peaks PeakDetector.track() follows (the highest)
+PEAK_TRACK_RADIUS = 8   # Pixels a tracked peak may move from frame to frame
+PEAK_RESEARCH = 50      # Frames between full searches while tracking
+USB_BULK_URBS = 8       # Reads kept queued on the host
+USB_BULK_URB_SIZE = 65536
+USB_ISO_MPS = 512       # USBD_VENDOR_ISO_MPS, one packet per 1 ms frame
+USB_ISO_PACKETS = 4     # Per read: a read completes every 4 ms
+FLAT_UNITY = 32768      # Q15 gain 1.0 on the device
+FLAT_CHUNK = 29         # Gains per "GW" packet (fits one 64-byte USB packet)
+CODEC_RICE = 1          # Shaped header codec: delta + Rice coded pixels
+CODEC_TEMPORAL = 2      # Rice coded against the frame in the header's ref
+RICE_BLOCK = 16
+RICE_ESCAPE = 31
+
+# ==========================================
+# PIXEL PACKING (firmware "P12"/"P14", "C1")
+# ==========================================
+def _unpack_kernel(raw, count, bits, out):
+    """unpack_pixels() compiled: value j from bits j * bits little-endian
+    on, read as the three bytes that hold it; returns 0 on a short
+    stream"""
+    if (count * bits + 7) // 8 > raw.shape[0]:
+        return 0
+    mask = (1 << bits) - 1
+    shift = 16 - bits
+    last = raw.shape[0] - 1
+    for j in range(count):
+        pos = j * bits
+        b = pos >> 3
+        v = raw[b] | (raw[min(b + 1, last)] << 8) | \
+            (raw[min(b + 2, last)] << 16)
+        out[j] = ((v >> (pos & 7)) & mask) << shift
+    return 1
+
+if numba is not None:
+    _unpack_kernel = numba.njit(cache=True, nogil=True)(_unpack_kernel)
+
+def unpack_pixels(data, count, bits, out=None):
+    """Little-endian bit streams back to uint16 at the 16-bit ADC scale,
+    into out (uint16, at least count long) when given; compiled with
+    numba, else as the numpy below"""
+    raw = np.frombuffer(data, dtype=np.uint8)
+    if bits in (12, 14) and numba is not None:
+        px = np.empty(count, dtype=np.uint16) if out is None else out[:count]
+        if not _unpack_kernel(raw, count, bits, px):
+            raise ValueError("truncated packed pixels")
+        return px
+    if out is not None:
+        out[:count] = unpack_pixels(data, count, bits)
+        return out[:count]
+    if bits == 12:
+        g = raw.reshape(-1, 3).astype(np.uint16)
+        out = np.empty((len(g), 2), dtype=np.uint16)
+        out[:, 0] = g[:, 0] | ((g[:, 1] & 0x0F) << 8)
+        out[:, 1] = (g[:, 1] >> 4) | (g[:, 2] << 4)
+        return (out.reshape(-1)[:count] << 4).astype(np.uint16)
+    if bits == 14:
+        g = np.zeros((len(raw) // 7, 8), dtype=np.uint8)
+        g[:, :7] = raw.reshape(-1, 7)
+        v = g.view('<u8').reshape(-1, 1)
+        out = (v >> np.array([0, 14, 28, 42], dtype=np.uint64)) & 0x3FFF
+        return (out.reshape(-1)[:count].astype(np.uint16) << 2).astype(np.uint16)
+    return np.frombuffer(data, dtype='<u2')
+
+def bench_pixels(pattern, seq):
+    """Frame seq of a BENCH_* run as the device makes it (ccd_bench.c)"""
+    i = np.arange(CCD_PIXELS, dtype=np.uint32)
+    if pattern == BENCH_RAMP:
+        return ((i + np.uint32(seq & 0xFFFF)) & 0xFFFF).astype(np.uint16)
+    if pattern == BENCH_COUNTER:
+        return np.where(i & 1, seq >> 16, seq & 0xFFFF).astype(np.uint16)
+    x = i * np.uint32(0x85EBCA77) + np.uint32((seq * 0x9E3779B1) & 0xFFFFFFFF)
+    x ^= x >> np.uint32(15)
+    x *= np.uint32(0x2C1B3C6D)
+    x ^= x >> np.uint32(12)
+    x *= np.uint32(0x297A2D39)
+    x ^= x >> np.uint32(15)
+    return (x & 0xFFFF).astype(np.uint16)
+
+
+def read_recording(path):
+    """Frames of an SD card recording (ccd_rec.h), from the card's device
+    node or an image of it: yields (info, pixels). The header counts the
+    frames once the recording was stopped; otherwise (power lost) it reads
+    on until a frame fails its CRC or seq stops following."""
+    with open(path, 'rb') as f:
+        f.seek(REC_BASE * REC_BLOCK)
+        magic, version, size, block, frames, first_seq, _ = \
+            REC_HEADER.unpack(f.read(REC_HEADER.size))
+        if magic != REC_MAGIC or size != FRAME_SIZE:
+            raise ValueError(f"{path}: no recording")
+        f.seek(block * REC_BLOCK)
+        seq = first_seq
+        for n in itertools.count():
+            if frames and n == frames: return
+            data = bytearray(f.read(FRAME_SIZE))
+            if len(data) < FRAME_SIZE: return
+            info = dict(zip(FRAME_INFO_FIELDS,
+                            FRAME_INFO.unpack_from(data, 4)))
+            data[FRAME_CRC_OFFSET:FRAME_CRC_OFFSET + 4] = bytes(4)
+            if zlib.crc32(data) != info['crc'] or (n and info['seq'] <= seq):
+                return
+            seq = info['seq']
+            yield info, np.frombuffer(data[FRAME_HEADER_SIZE:], dtype='<u2')
+
+def open_recording(path):
+    """A .ccdrec file as a read-only structured array of FRAME_RECORD, mapped
+    rather than read. A recording still being written ends at its last
+    whole frame."""
+    with open(path, 'rb') as f:
+        magic, version, pixels, size = CCDREC_HEADER.unpack(
+            f.read(CCDREC_HEADER.size))
+        f.seek(0, os.SEEK_END)
+        n = (f.tell() - CCDREC_HEADER.size) // size
+    dtype = np.dtype(FRAME_RECORD)
+    if magic != CCDREC_MAGIC or pixels != CCD_PIXELS or size != dtype.itemsize:
+        raise ValueError(f"{path}: not a recording of this version")
+    if n == 0: return np.zeros(0, dtype=dtype)
+    return np.memmap(path, dtype=dtype, mode='r', offset=CCDREC_HEADER.size,
+                     shape=(n,))
+
+class FrameIndex:
+    """A per-frame summary of a recording, kept beside it so queries do not
+    read every pixel. For each frame: frame_num, seq, timestamp, the
+    signal (65535 - raw, as the GUI shows it) sum and maximum, the pixels
+    at or past saturation (raw below SAT_LEVEL), and the INDEX_PEAKS
+    highest peaks above INDEX_THRESHOLD (position and height; NaN and 0
+    where there are fewer).
+
+    add() takes FRAME_RECORD bytes, the recorder's writer thread does the
+    work, and rows go to disk INDEX_BLOCK at a time. close() turns them
+    into columns: one .npy per field in path + INDEX_SUFFIX, which
+    open_index() maps without reading. A query then reads only the
+    columns it tests, and load_hits() reads only the frames it found."""
+    DTYPE = np.dtype([('frame_num', '<u4'), ('seq', '<u4'),
+                      ('timestamp', '<f8'), ('sum', '<u8'), ('max', '<u2'),
+                      ('saturated', '<u2'),
+                      ('peak_px', '<f4', (INDEX_PEAKS,)),
+                      ('peak_height', '<u2', (INDEX_PEAKS,))])
+
+    def __init__(self, path):
+        self.dir = path + INDEX_SUFFIX
+        os.makedirs(self.dir, exist_ok=True)
+        self.rows_path = os.path.join(self.dir, "rows.tmp")
+        self.rows = open(self.rows_path, 'wb')
+        self.block = np.zeros(INDEX_BLOCK, dtype=self.DTYPE)
+        self.n = 0      # Rows in block
+        self.total = 0
+        self.detector = PeakDetector()
+        self.detector.use_smoothing = False
+        self.detector.threshold = INDEX_THRESHOLD
+
+    def add(self, record):
+        frame_num, seq, _, _, timestamp, _, _ = \
+            FRAME_RECORD_META.unpack_from(record)
+        raw = np.frombuffer(record, dtype='<u2', offset=FRAME_RECORD_META.size)
+        self.add_pixels(frame_num, seq, timestamp, raw)
+
+    def add_pixels(self, frame_num, seq, timestamp, raw):
+        row = self.block[self.n]
+        signal = 65535 - raw
+        row['frame_num'], row['seq'], row['timestamp'] = frame_num, seq, timestamp
+        row['sum'] = signal.sum(dtype=np.uint64)
+        row['max'] = signal.max()
+        row['saturated'] = np.count_nonzero(raw < SAT_LEVEL)
+        px, height = self.detector.find_peaks(signal)
+        keep = np.sort(np.argsort(height)[-INDEX_PEAKS:])
+        k = len(keep)
+        row['peak_px'][:k], row['peak_px'][k:] = px[keep], np.nan
+        row['peak_height'][:k], row['peak_height'][k:] = height[keep], 0
+        self.n += 1
+        if self.n == INDEX_BLOCK: self._flush()
+
+    def _flush(self):
+        self.rows.write(self.block[:self.n].tobytes())
+        self.total += self.n
+        self.n = 0
+
+    def close(self):
+        self._flush()
+        self.rows.close()
+        rows = np.memmap(self.rows_path, dtype=self.DTYPE, mode='r',
+                         shape=(self.total,)) if self.total else \
+            np.zeros(0, dtype=self.DTYPE)
+        for name in self.DTYPE.names:
+            col = np.lib.format.open_memmap(
+                os.path.join(self.dir, name + ".npy"), mode='w+',
+                dtype=self.DTYPE[name].base, shape=(self.total,) + self.DTYPE[name].shape)
+            for i in range(0, self.total, INDEX_BLOCK):
+                col[i:i + INDEX_BLOCK] = rows[name][i:i + INDEX_BLOCK]
+            col.flush()
+            del col
+        del rows
+        os.remove(self.rows_path)
+
+def open_index(path):
+    """The FrameIndex columns of a recording as read-only memory maps,
+    {field: array}, or None if it has no index (see build_index())"""
+    d = path + INDEX_SUFFIX
+    if not os.path.exists(os.path.join(d, "frame_num.npy")): return None
+    return {name: np.load(os.path.join(d, name + ".npy"), mmap_mode='r')
+            for name in FrameIndex.DTYPE.names}
+
+def find_frames(index, pixel=None, above=0, tolerance=3.0, field='max'):
+    """Positions in the recording of the frames of index (open_index())
+    with a peak within tolerance pixels of pixel higher than above, or,
+    without pixel, with field (max, sum, saturated) above it"""
+    if pixel is None: return np.flatnonzero(index[field] > above)
+    near = np.abs(index['peak_px'] - pixel) <= tolerance
+    return np.flatnonzero((near & (index['peak_height'] > above)).any(axis=1))
+
+def load_hits(path, hits):
+    """The pixels of the frames at hits, each read on its own"""
+    pixels, _ = open_frames(path)
+    out = np.stack([np.asarray(pixels[i]) for i in hits]) if len(hits) else \
+        np.zeros((0, CCD_PIXELS), dtype=np.uint16)
+    if hasattr(pixels, 'close'): pixels.close()
+    return out
+
+def build_index(path):
+    """Job: the FrameIndex of a recording made without one"""
+    pixels, records = open_frames(path)
+    n = len(pixels)
+    index = FrameIndex(path)
+    for i in range(n):
+        r = records[i] if records is not None else None
+        index.add_pixels(int(r['frame_num']) if r is not None else i,
+                         int(r['seq']) if r is not None else i,
+                         float(r['timestamp']) if r is not None else 0.0,
+                         np.asarray(pixels[i]))
+        if i % EXPORT_BATCH == 0: yield i / n
+    index.close()
+    if hasattr(pixels, 'close'): pixels.close()
+
+class OverviewPyramid:
+    """Envelopes of a recording over blocks of OVERVIEW_LEVELS frames, for
+    a timeline of the whole of it: level L has a row per L frames, and
+    each row a column per OVERVIEW_BIN pixels, as the mean (mean_L.npy)
+    and the maximum (max_L.npy) of the signal (65535 - raw) the frames
+    of the block have there. Each level is fed the rows of the one below
+    it, so a frame costs one binning however many levels there are.
+
+    Written like FrameIndex: add() in the recorder's writer thread, rows
+    appended to a file per level, and close() (which also writes the
+    blocks left part-full) turns them into .npy files that
+    open_overview() maps."""
+    def __init__(self, path):
+        self.dir = path + OVERVIEW_SUFFIX
+        os.makedirs(self.dir, exist_ok=True)
+        self.starts = np.arange(0, CCD_PIXELS, OVERVIEW_BIN)
+        self.widths = np.diff(np.append(self.starts, CCD_PIXELS))
+        bins = len(self.starts)
+        self.sum = np.zeros((len(OVERVIEW_LEVELS), bins))
+        self.max = np.zeros((len(OVERVIEW_LEVELS), bins), dtype=np.uint16)
+        self.count = [0] * len(OVERVIEW_LEVELS)  # Frames in each block
+        self.rows = [0] * len(OVERVIEW_LEVELS)
+        self.files = [(open(self._tmp('mean', L), 'wb'),
+                       open(self._tmp('max', L), 'wb'))
+                      for L in OVERVIEW_LEVELS]
+
+    def _tmp(self, kind, level):
+        return os.path.join(self.dir, f"{kind}_{level}.tmp")
+
+    def add(self, record):
+        self.add_pixels(np.frombuffer(record, dtype='<u2',
+                                      offset=FRAME_RECORD_META.size))
+
+    def add_pixels(self, raw):
+        signal = 65535 - raw
+        mean = np.add.reduceat(signal, self.starts, dtype=np.float64)
+        mean /= self.widths
+        self._feed(0, mean, np.maximum.reduceat(signal, self.starts), 1)
+
+    def _feed(self, i, mean, top, frames):
+        """A block of frames (the mean of their means, their max) into
+        level i"""
+        self.sum[i] += mean * frames
+        np.maximum(self.max[i], top, out=self.max[i])
+        self.count[i] += frames
+        if self.count[i] == OVERVIEW_LEVELS[i]: self._emit(i)
+
+    def _emit(self, i):
+        n = self.count[i]
+        mean = self.sum[i] / n
+        top = self.max[i].copy()
+        self.files[i][0].write(np.rint(mean).astype('<u2').tobytes())
+        self.files[i][1].write(top.astype('<u2').tobytes())
+        self.rows[i] += 1
+        self.sum[i] = 0
+        self.max[i] = 0
+        self.count[i] = 0
+        if i + 1 < len(OVERVIEW_LEVELS): self._feed(i + 1, mean, top, n)
+
+    def close(self):
+        for i in range(len(OVERVIEW_LEVELS)):
+            if self.count[i]: self._emit(i)
+        bins = len(self.starts)
+        for i, L in enumerate(OVERVIEW_LEVELS):
+            for f, kind in zip(self.files[i], ('mean', 'max')):
+                f.close()
+                tmp = self._tmp(kind, L)
+                shape = (self.rows[i], bins)
+                out = np.lib.format.open_memmap(
+                    os.path.join(self.dir, f"{kind}_{L}.npy"), mode='w+',
+                    dtype='<u2', shape=shape)
+                if self.rows[i]:
+                    rows = np.memmap(tmp, dtype='<u2', mode='r', shape=shape)
+                    for r in range(0, shape[0], INDEX_BLOCK):
+                        out[r:r + INDEX_BLOCK] = rows[r:r + INDEX_BLOCK]
+                    del rows
+                out.flush()
+                del out
+                os.remove(tmp)
+
+def open_overview(path):
+    """The OverviewPyramid of a recording as read-only memory maps,
+    {frames per row: (mean, max)}, or None if it has none"""
+    d = path + OVERVIEW_SUFFIX
+    if not os.path.exists(os.path.join(d, f"max_{OVERVIEW_LEVELS[-1]}.npy")):
+        return None
+    return {L: tuple(np.load(os.path.join(d, f"{kind}_{L}.npy"), mmap_mode='r')
+                     for kind in ('mean', 'max'))
+            for L in OVERVIEW_LEVELS}
+
+def build_overview(path):
+    """Job: the OverviewPyramid of a recording made without one"""
+    pixels, _ = open_frames(path)
+    n = len(pixels)
+    overview = OverviewPyramid(path)
+    for i in range(n):
+        overview.add_pixels(np.asarray(pixels[i]))
+        if i % EXPORT_BATCH == 0: yield i / n
+    overview.close()
+    if hasattr(pixels, 'close'): pixels.close()
+
+def _frame_blocks(pixels):
+    """(first, raw frames) over a recording opened with open_frames():
+    an archive a chunk at a time as threads inflate them, else
+    INDEX_BLOCK frames of the map at a time"""
+    if isinstance(pixels, Archive):
+        first = 0
+        for _, block in _inflated(pixels, len(pixels.offsets),
+                                  os.cpu_count() or 1):
+            yield first, block
+            first += len(block)
+    else:
+        for i in range(0, len(pixels), INDEX_BLOCK):
+            yield i, np.asarray(pixels[i:i + INDEX_BLOCK])
+
+def _frame_sample(pixels, frames):
+    """Raw blocks of about frames frames spread evenly over a recording
+    opened with open_frames(): whole chunks of an archive, so only those
+    are inflated, else every so many frames of the map"""
+    if isinstance(pixels, Archive):
+        chunks = len(pixels.offsets)
+        every = max(1, chunks * pixels.chunk_frames // frames)
+        for c in range(0, chunks, every):
+            yield pixels._chunk(c)[1]
+    else:
+        every = max(1, len(pixels) // frames)
+        for i in range(0, len(pixels), every * INDEX_BLOCK):
+            yield np.asarray(pixels[i:i + every * INDEX_BLOCK:every])
+
+def _unit(x):
+    """Rows of x scaled to length 1 (a flat row stays 0)"""
+    norm = np.linalg.norm(x, axis=1, keepdims=True)
+    return x / np.where(norm > 0, norm, 1.0)
+
+def similarity_embed(raw, mean=None, components=None):
+    """Embeddings (float32, a row per frame) of raw frames: the signal
+    (65535 - raw) binned SIMILAR_BIN pixels at a time, its mean taken off
+    and scaled to length 1, so the inner product of two is the
+    correlation of their shapes whatever their brightness; then, with a
+    PCA basis, projected on its components and scaled to length 1 again"""
+    starts = np.arange(0, CCD_PIXELS, SIMILAR_BIN)
+    x = 65535.0 - np.asarray(raw, dtype=np.float64).reshape(-1, CCD_PIXELS)
+    x = np.add.reduceat(x, starts, axis=1) / \
+        np.diff(np.append(starts, CCD_PIXELS))
+    x = _unit(x - x.mean(axis=1, keepdims=True))
+    if components is not None: x = _unit((x - mean) @ components.T)
+    return x.astype(np.float32)
+
+class SimilarityIndex:
+    """Frames of a recording like a given spectrum, by the inner product
+    of their embeddings (similarity_embed()): 1 for the same shape. The
+    index is the directory path + SIMILAR_SUFFIX that build_similarity()
+    writes: the PCA basis (basis.npz), every embedding (vectors.npy) and
+    an HNSW graph over them, index.faiss with faiss or index.hnsw with
+    hnswlib. The graph answers in about a millisecond however long the
+    recording; without either, query() scans the mapped vectors exactly,
+    INDEX_BLOCK * 16 at a time."""
+    def __init__(self, path):
+        self.dir = path + SIMILAR_SUFFIX
+        basis = np.load(os.path.join(self.dir, "basis.npz"))
+        components = basis['components']
+        self.mean, self.components = (basis['mean'], components) \
+            if components.size else (None, None)
+        self.vectors = np.load(os.path.join(self.dir, "vectors.npy"),
+                               mmap_mode='r')
+        self.graph, self.backend = None, "exact"
+        dims = self.vectors.shape[1]
+        if faiss is not None and os.path.exists(self._file("index.faiss")):
+            self.graph, self.backend = \
+                faiss.read_index(self._file("index.faiss")), "faiss"
+        elif hnswlib is not None and os.path.exists(self._file("index.hnsw")):
+            self.graph, self.backend = hnswlib.Index(space='ip', dim=dims), \
+                "hnswlib"
+            self.graph.load_index(self._file("index.hnsw"),
+                                  max_elements=len(self.vectors))
+
+    def _file(self, name): return os.path.join(self.dir, name)
+
+    def __len__(self): return len(self.vectors)
+
+    def embed(self, raw):
+        return similarity_embed(raw, self.mean, self.components)
+
+    def query(self, raw, k=10):
+        """(positions, similarities) of the k frames most like a raw frame,
+        most alike first, or a row of each per frame given; positions are
+        frames of the recording, for load_hits()"""
+        q = self.embed(raw)
+        k = min(k, len(self.vectors))
+        if self.backend == "faiss":
+            self.graph.hnsw.efSearch = max(SIMILAR_EF, k)
+            sim, pos = self.graph.search(q, k)
+        elif self.backend == "hnswlib":
+            self.graph.set_ef(max(SIMILAR_EF, k))
+            pos, dist = self.graph.knn_query(q, k)
+            sim = 1.0 - dist
+        else:
+            pos, sim = self._scan(q, k)
+        pos, sim = pos.astype(np.int64), sim.astype(np.float32)
+        return (pos[0], sim[0]) if np.ndim(raw) == 1 else (pos, sim)
+
+    def _scan(self, q, k):
+        """The exact top k of every query over the vectors"""
+        best_pos = np.zeros((len(q), 0), dtype=np.int64)
+        best_sim = np.zeros((len(q), 0), dtype=np.float32)
+        step = INDEX_BLOCK * 16
+        for i in range(0, len(self.vectors), step):
+            sim = q @ np.asarray(self.vectors[i:i + step]).T
+            top = np.argpartition(-sim, min(k, sim.shape[1]) - 1,
+                                  axis=1)[:, :k]
+            best_pos = np.hstack((best_pos, top + i))
+            best_sim = np.hstack((best_sim,
+                                  np.take_along_axis(sim, top, axis=1)))
+            keep = np.argsort(-best_sim, axis=1)[:, :k]
+            best_pos = np.take_along_axis(best_pos, keep, axis=1)
+            best_sim = np.take_along_axis(best_sim, keep, axis=1)
+        return best_pos, best_sim
+
+def open_similarity(path):
+    """The SimilarityIndex of a recording, or None if it has none (see
+    build_similarity())"""
+    if not os.path.exists(os.path.join(path + SIMILAR_SUFFIX, "vectors.npy")):
+        return None
+    return SimilarityIndex(path)
+
+def build_similarity(path, dims=SIMILAR_DIMS):
+    """Job: the SimilarityIndex of a recording. A first pass fits the PCA
+    basis (dims components; 0 for none) on about SIMILAR_TRAIN frames
+    spread over it, a second embeds every frame into vectors.npy, and the HNSW
+    graph is built from those when faiss or hnswlib is installed."""
+    pixels, _ = open_frames(path)
+    n = len(pixels)
+    d = path + SIMILAR_SUFFIX
+    os.makedirs(d, exist_ok=True)
+    mean = components = None
+    if dims and n:
+        x = np.concatenate([similarity_embed(block) for block in
+                            _frame_sample(pixels, SIMILAR_TRAIN)])
+        x = x.astype(np.float64)
+        mean = x.mean(axis=0)
+        _, _, vt = np.linalg.svd(x - mean, full_matrices=False)
+        components = vt[:dims]
+        yield 0.25
+    np.savez(os.path.join(d, "basis.npz"),
+             mean=np.zeros(0) if mean is None else mean,
+             components=np.zeros((0, 0)) if components is None else components)
+    width = len(range(0, CCD_PIXELS, SIMILAR_BIN)) if components is None \
+        else len(components)
+    vectors = np.lib.format.open_memmap(os.path.join(d, "vectors.npy"),
+                                        mode='w+', dtype=np.float32,
+                                        shape=(n, width))
+    for first, block in _frame_blocks(pixels):
+        vectors[first:first + len(block)] = \
+            similarity_embed(block, mean, components)
+        yield 0.25 + 0.5 * (first + len(block)) / max(n, 1)
+    vectors.flush()
+    if hasattr(pixels, 'close'): pixels.close()
+    if faiss is not None:
+        graph = faiss.IndexHNSWFlat(width, SIMILAR_LINKS,
+                                    faiss.METRIC_INNER_PRODUCT)
+        graph.hnsw.efConstruction = SIMILAR_EF_BUILD
+    elif hnswlib is not None:
+        graph = hnswlib.Index(space='ip', dim=width)
+        graph.init_index(max_elements=max(n, 1), M=SIMILAR_LINKS,
+                         ef_construction=SIMILAR_EF_BUILD)
+    else:
+        del vectors
+        return
+    step = INDEX_BLOCK * 16
+    for i in range(0, n, step):
+        block = np.ascontiguousarray(vectors[i:i + step])
+        if faiss is not None:
+            graph.add(block)
+        else:
+            graph.add_items(block, np.arange(i, i + len(block)))
+        yield 0.75 + 0.25 * (i + len(block)) / n
+    if faiss is not None:
+        faiss.write_index(graph, os.path.join(d, "index.faiss"))
+    else:
+        graph.save_index(os.path.join(d, "index.hnsw"))
+    del vectors
+
+class FrameRecorder:
+    """Frames appended to a .ccdrec file (or a .ccdarc) as they arrive. A writer thread
+    does the disk I/O; add() only copies the frame into one of CCDREC_QUEUE
+    records allocated with the recorder and queues it, and the writer
+    hands the record back once written. Memory stays at those records
+    however long the recording, and a disk that falls that far behind
+    costs frames (dropped) rather than the receiver's pace. close()
+    returns at once and the writer finishes the queue.
+    With index the writer also keeps the recording's FrameIndex and
+    OverviewPyramid."""
+    def __init__(self, path, metadata=None, index=True):
+        self.path = path
+        self.frames = 0
+        self.dropped = 0
+        self.index = FrameIndex(path) if index else None
+        self.overview = OverviewPyramid(path) if index else None
+        if path.endswith('.ccdarc'):
+            self.file = ArchiveWriter(path, metadata)
+        else:
+            self.file = open(path, 'wb')
+            self.file.write(CCDREC_HEADER.pack(
+                CCDREC_MAGIC, CCDREC_VERSION, CCD_PIXELS,
+                FRAME_RECORD_META.size + CCD_PIXELS * 2))
+        self.records = [bytearray(FRAME_RECORD_META.size + CCD_PIXELS * 2)
+                        for _ in range(CCDREC_QUEUE)]
+        self.record_pixels = [np.frombuffer(r, dtype='<u2',
+                                            offset=FRAME_RECORD_META.size)
+                              for r in self.records]
+        self.free = queue.SimpleQueue()  # Indexes of the records not queued
+        for i in range(CCDREC_QUEUE): self.free.put(i)
+        self.queue = queue.Queue(CCDREC_QUEUE)
+        self.thread = threading.Thread(target=self._write, daemon=True)
+        self.thread.start()
+
+    def add(self, frame_num, info, timestamp, pixels):
+        try:
+            i = self.free.get_nowait()
+        except queue.Empty:
+            self.dropped += 1
+            return
+        temps = [np.nan if info is None or info[k] is None else info[k]
+                 for k in ('die_temp_c', 'board_temp_c')]
+        FRAME_RECORD_META.pack_into(
+            self.records[i], 0, frame_num, info['seq'] if info else 0,
+            info['exposure_us'] if info else 0,
+            info['time_s'] if info else 0.0, timestamp, *temps)
+        self.record_pixels[i][:] = pixels  # The one copy, in place
+        try:
+            self.queue.put_nowait(i)
+            self.frames += 1
+        except queue.Full:  # Link log lines took the room
+            self.free.put(i)
+            self.dropped += 1
+
+    def add_wait(self, frame_num, info, timestamp, pixels):
+        """add() that waits for a free record instead of dropping the
+        frame, for a batch held elsewhere (EventRecorder's pre-trigger)"""
+        self.free.put(self.free.get())  # Blocks until the writer frees one
+        self.add(frame_num, info, timestamp, pixels)
+
+    def log(self, link):
+        """A LinkHealth second, for the link log next to the recording
+        (path + LINK_LOG, a JSON object per line); never costs a frame"""
+        try:
+            self.queue.put_nowait(json.dumps(link))
+        except queue.Full:
+            pass
+
+    def close(self):
+        self.queue.put(None)
+
+    def _write(self):
+        log = None
+        with self.file:
+            while (record := self.queue.get()) is not None:
+                if isinstance(record, str):
+                    if log is None: log = open(self.path + LINK_LOG, 'w')
+                    log.write(record + '\n')
+                else:
+                    i, record = record, self.records[record]
+                    self.file.write(record)
+                    if self.index:
+                        self.index.add(record)
+                        self.overview.add(record)
+                    self.free.put(i)
+        if log: log.close()
+        if self.index:
+            self.index.close()
+            self.overview.close()
+
+class PeakTrigger:
+    """EventRecorder criterion: the signal (65535 - raw) passes level at
+    some pixel of start:end"""
+    def __init__(self, level, start=0, end=None):
+        self.level, self.start, self.end = level, start, end
+
+    def __call__(self, pixels, info):
+        return 65535 - int(pixels[self.start:self.end].min()) > self.level
+
+class BandTrigger:
+    """EventRecorder criterion: the mean signal of band a (start, end)
+    over that of band b goes above above or below below"""
+    def __init__(self, a, b, above=None, below=None):
+        self.a, self.b, self.above, self.below = a, b, above, below
+
+    def _mean(self, pixels, band):
+        return 65535.0 - float(pixels[band[0]:band[1]].mean())
+
+    def __call__(self, pixels, info):
+        ref = self._mean(pixels, self.b)
+        if ref <= 0: return False
+        ratio = self._mean(pixels, self.a) / ref
+        return ((self.above is not None and ratio > self.above) or
+                (self.below is not None and ratio < self.below))
+
+class ChangeTrigger:
+    """EventRecorder criterion: the frame's mean signal moves more than
+    fraction away from its exponential mean over frames frames. The first
+    frame only seeds the mean, and a frame that triggers is not folded
+    in, so a lasting change keeps triggering until it settles."""
+    def __init__(self, fraction, frames=50):
+        self.fraction, self.frames = fraction, frames
+        self.mean = None
+
+    def __call__(self, pixels, info):
+        x = 65535.0 - float(pixels.mean())
+        if self.mean is None:
+            self.mean = x
+            return False
+        if abs(x - self.mean) > self.fraction * max(self.mean, 1.0):
+            return True
+        self.mean += (x - self.mean) / self.frames
+        return False
+
+class EventRecorder:
+    """Records only around events. The last pre frames are kept in a ring,
+    in RAM or, with ring_path, in a file mapped in its place (for a
+    pre-trigger larger than memory). When any of criteria (callables of
+    pixels and frame info: PeakTrigger, BandTrigger, ChangeTrigger or
+    one's own) holds, or trigger() is called (an external signal), a
+    FrameRecorder starts on the next file of path: the ring's frames go
+    in first, oldest first, then every frame until post frames pass
+    with no criterion holding. A trigger meanwhile extends the event;
+    max_frames, if set, ends it regardless. path is formatted with the
+    event number n ("run_{n:03d}.ccdrec"), or numbered before its
+    extension. The ring then refills before the next pre-trigger is
+    whole."""
+    def __init__(self, path, criteria=(), pre=EVENT_PRE, post=EVENT_POST,
+                 max_frames=None, metadata=None, ring_path=None):
+        self.path, self.criteria = path, list(criteria)
+        self.pre, self.post, self.max_frames = pre, post, max_frames
+        self.metadata = metadata
+        if ring_path:
+            self.ring = np.memmap(ring_path, dtype=np.uint16, mode='w+',
+                                  shape=(max(pre, 1), CCD_PIXELS))
+        else:
+            self.ring = np.zeros((max(pre, 1), CCD_PIXELS), dtype=np.uint16)
+        self.meta = [None] * len(self.ring)  # (frame_num, info, timestamp)
+        self.held = 0           # Frames in the ring
+        self.next = 0           # Slot for the next frame
+        self.recorder = None    # The event being recorded
+        self.left = 0           # Its frames still due without a trigger
+        self.length = 0         # Its frames after the trigger
+        self.pending = False    # trigger() since the last frame
+        self.events = 0
+        self.frames = 0         # Recorded, over every event
+        self.dropped = 0
+        self.paths = []
+
+    def trigger(self):
+        self.pending = True
+
+    def _file(self, n):
+        if '{' in self.path: return self.path.format(n=n)
+        base, ext = os.path.splitext(self.path)
+        return f"{base}_{n:04d}{ext}"
+
+    def _hit(self, pixels, info):
+        hit, self.pending = self.pending, False
+        for c in self.criteria:
+            hit = c(pixels, info) or hit  # Every criterion sees every frame
+        return hit
+
+    def add(self, frame_num, info, timestamp, pixels):
+        hit = self._hit(pixels, info)
+        if self.recorder is None and hit:
+            self.events += 1
+            path = self._file(self.events)
+            self.paths.append(path)
+            self.recorder = FrameRecorder(path, self.metadata)
+            n = len(self.ring)
+            for k in range(self.held):
+                i = (self.next - self.held + k) % n
+                self.recorder.add_wait(*self.meta[i], self.ring[i])
+            self.held = 0
+            self.length = 0
+        if self.recorder is None:
+            if self.pre:
+                self.ring[self.next] = pixels
+                self.meta[self.next] = (frame_num, info, timestamp)
+                self.next = (self.next + 1) % len(self.ring)
+                self.held = min(self.held + 1, len(self.ring))
+            return
+        self.recorder.add(frame_num, info, timestamp, pixels)
+        self.length += 1
+        self.left = self.post if hit else self.left - 1
+        if self.left <= 0 or (self.max_frames and self.length >= self.max_frames):
+            self.close()
+
+    def close(self):
+        """End the event being recorded, if any; the file gets its last
+        frames in the background"""
+        if self.recorder is None: return
+        self.frames += self.recorder.frames
+        self.dropped += self.recorder.dropped
+        self.recorder.close()
+        self.recorder = None
+
+    def status(self):
+        return {'state': 'recording' if self.recorder else 'armed',
+                'events': self.events, 'frames': self.frames +
+                (self.recorder.frames if self.recorder else 0),
+                'dropped': self.dropped, 'held': self.held,
+                'paths': list(self.paths)}
+
+def _shuffle(data):
+    """Low bytes of every pixel, then the high bytes: the high bytes of a
+    CCD line barely change, so they deflate to almost nothing"""
+    return np.frombuffer(data, dtype=np.uint8).reshape(-1, 2).T.tobytes()
+
+def _unshuffle(data, frames):
+    return np.ascontiguousarray(
+        np.frombuffer(data, dtype=np.uint8).reshape(2, -1).T
+    ).view('<u2').reshape(frames, CCD_PIXELS)
+
+class ArchiveWriter:
+    """A .ccdarc archive, written chunk by chunk. metadata (a dict that
+    JSON takes: calibration, device info, notes) goes in the header. The
+    file is complete after close(), which writes the chunk index; without
+    it (power lost) Archive finds the chunks by scanning."""
+    def __init__(self, path, metadata=None):
+        meta = json.dumps(metadata or {}).encode()
+        self.file = open(path, 'wb')
+        self.file.write(CCDARC_HEADER.pack(CCDARC_MAGIC, CCDARC_VERSION,
+                                           CCD_PIXELS, CCDARC_CHUNK_FRAMES,
+                                           len(meta)) + meta)
+        self.records = []
+        self.offsets = []
+
+    def write(self, record):
+        """One frame as a FRAME_RECORD, copied: the caller may reuse it"""
+        self.records.append(bytes(record))
+        if len(self.records) == CCDARC_CHUNK_FRAMES: self._flush()
+
+    def _flush(self):
+        if not self.records: return
+        n = FRAME_RECORD_META.size
+        meta = b''.join(r[:n] for r in self.records)
+        pixels = zlib.compress(_shuffle(b''.join(r[n:] for r in self.records)),
+                               CCDARC_LEVEL)
+        self.write_chunk(len(self.records), meta, pixels)
+        self.records = []
+
+    def write_chunk(self, frames, meta, pixels):
+        """A chunk made elsewhere: frames metadata records (FRAME_RECORD
+        without the pixels) and their pixels shuffled and deflated, for
+        writers that compress in parallel (reprocess())"""
+        self.offsets.append(self.file.tell())
+        self.file.write(CCDARC_CHUNK.pack(CCDARC_CHUNK_MAGIC, frames,
+                                          len(meta), len(pixels)))
+        self.file.write(meta)
+        self.file.write(pixels)
+
+    def close(self):
+        self._flush()
+        at = self.file.tell()
+        for off in self.offsets:
+            self.file.write(CCDARC_INDEX.pack(off))
+        self.file.write(CCDARC_FOOTER.pack(at, len(self.offsets),
+                                           CCDARC_FOOTER_MAGIC))
+        self.file.close()
+
+    def __enter__(self): return self
+
+    def __exit__(self, *exc): self.close()
+
+class Archive:
+    """A .ccdarc archive for reading. archive[i] is the pixels of frame i,
+    from one chunk read and inflated; records() is the per-frame metadata
+    of the whole file, FRAME_RECORD without the pixels; metadata is the
+    header dict. Opening reads the header and the index only. The last
+    CCDARC_CACHE chunks used are kept, and after each access a thread
+    inflates the CCDARC_PREFETCH chunks on either side, so stepping or
+    scrubbing through a recording rarely waits for zlib."""
+    def __init__(self, path):
+        self.file = open(path, 'rb')
+        magic, version, pixels, self.chunk_frames, meta_len = \
+            CCDARC_HEADER.unpack(self.file.read(CCDARC_HEADER.size))
+        if magic != CCDARC_MAGIC or version != CCDARC_VERSION or \
+                pixels != CCD_PIXELS:
+            raise ValueError(f"{path}: not an archive of this version")
+        self.metadata = json.loads(self.file.read(meta_len))
+        self.start = CCDARC_HEADER.size + meta_len  # First chunk
+        self.offsets = self._index() or self._scan()
+        self.frames = 0
+        if self.offsets:
+            last = self._chunk_header(len(self.offsets) - 1)[0]
+            self.frames = (len(self.offsets) - 1) * self.chunk_frames + last
+        self.lock = threading.Lock()  # The file position and the cache
+        self.cache = OrderedDict()    # Chunk -> (metadata, pixels)
+        self.wanted = None            # Chunk to prefetch around
+        self.wake = threading.Event()
+        self.closed = False
+        self.prefetcher = None
+
+    def _index(self):
+        self.file.seek(0, os.SEEK_END)
+        end = self.file.tell()
+        if end < CCDARC_FOOTER.size: return None
+        self.file.seek(end - CCDARC_FOOTER.size)
+        at, chunks, magic = CCDARC_FOOTER.unpack(self.file.read(CCDARC_FOOTER.size))
+        if magic != CCDARC_FOOTER_MAGIC: return None
+        self.file.seek(at)
+        data = self.file.read(chunks * CCDARC_INDEX.size)
+        return [o for (o,) in CCDARC_INDEX.iter_unpack(data)]
+
+    def _scan(self):
+        """Chunk offsets of an archive that was not closed, up to the
+        last whole chunk"""
+        offsets = []
+        self.file.seek(0, os.SEEK_END)
+        end = self.file.tell()
+        at = self.start
+        while at + CCDARC_CHUNK.size <= end:
+            self.file.seek(at)
+            magic, frames, meta, data = CCDARC_CHUNK.unpack(
+                self.file.read(CCDARC_CHUNK.size))
+            nxt = at + CCDARC_CHUNK.size + meta + data
+            if magic != CCDARC_CHUNK_MAGIC or nxt > end: break
+            offsets.append(at)
+            at = nxt
+        return offsets
+
+    def _chunk_header(self, c):
+        self.file.seek(self.offsets[c])
+        magic, frames, meta, data = CCDARC_CHUNK.unpack(
+            self.file.read(CCDARC_CHUNK.size))
+        return frames, meta, data
+
+    def _chunk(self, c):
+        """(metadata, pixels) of chunk c"""
+        with self.lock:
+            if c in self.cache:
+                self.cache.move_to_end(c)
+                return self.cache[c]
+            frames, meta, data = self._chunk_header(c)
+            meta = self.file.read(meta)
+            data = self.file.read(data)
+        records = np.frombuffer(meta, dtype=np.dtype(FRAME_RECORD[:-1]))
+        chunk = (records, _unshuffle(zlib.decompress(data), frames))
+        with self.lock:
+            self.cache[c] = chunk
+            while len(self.cache) > CCDARC_CACHE:
+                self.cache.popitem(last=False)
+        return chunk
+
+    def _prefetch(self):
+        while self.wake.wait() and not self.closed:
+            self.wake.clear()
+            c = self.wanted
+            for d in range(1, CCDARC_PREFETCH + 1):
+                for n in (c + d, c - d):
+                    if self.wanted != c or self.closed: break
+                    if 0 <= n < len(self.offsets) and n not in self.cache:
+                        self._chunk(n)
+
+    def __len__(self): return self.frames
+
+    def __getitem__(self, i):
+        if i < 0: i += self.frames
+        if not 0 <= i < self.frames: raise IndexError(i)
+        c = i // self.chunk_frames
+        pixels = self._chunk(c)[1][i % self.chunk_frames]
+        if self.wanted != c:
+            self.wanted = c
+            if self.prefetcher is None:
+                self.prefetcher = threading.Thread(target=self._prefetch,
+                                                   daemon=True)
+                self.prefetcher.start()
+            self.wake.set()
+        return pixels
+
+    def records(self):
+        out = []
+        with self.lock:
+            for c in range(len(self.offsets)):
+                frames, meta, data = self._chunk_header(c)
+                out.append(np.frombuffer(self.file.read(meta),
+                                         dtype=np.dtype(FRAME_RECORD[:-1])))
+        if not out: return np.zeros(0, dtype=np.dtype(FRAME_RECORD[:-1]))
+        return np.concatenate(out)
+
+    def close(self):
+        self.closed = True
+        self.wake.set()
+        if self.prefetcher: self.prefetcher.join()
+        self.file.close()
+
+def open_frames(path):
+    """(pixels, records) of a recording: frames to index, and the per-frame
+    metadata as a structured array (None for a .npz), without reading the
+    frames in"""
+    if path.endswith(".ccdarc"):
+        arc = Archive(path)
+        return arc, arc.records()
+    if path.endswith(".ccdrec"):
+        rec = open_recording(path)
+        return rec['pixels'], rec
+    return np.load(path)['pixels'], None
+
+EXPORT_BATCH = 64  # Frames between progress reports
+REPROCESS_WINDOW = 4  # Chunks in flight per reprocess() worker
+PCA_COMPONENTS = 8    # archive_pca() default
+REPROCESS_PEAKS = np.dtype([('frame_num', '<u4'), ('count', '<u4'),
+                            ('position_px', '<f4', (PEAK_TRACK_MAX,)),
+                            ('height', '<f4', (PEAK_TRACK_MAX,)),
+                            ('wavelength_nm', '<f4', (PEAK_TRACK_MAX,))])
+
+def export_csv(src, dst, calibration=None):
+    """Job: a recording as CSV, a row per frame (frame number, exposure,
+    then the pixels), under a row of pixel indices or, with a Calibration
+    that is enabled, wavelengths"""
+    pixels, records = open_frames(src)
+    n = len(pixels)
+    x = np.arange(CCD_PIXELS, dtype=np.float64)
+    if calibration is not None and calibration.enabled:
+        x = calibration.axis()
+    with open(dst, 'w') as f:
+        f.write("frame,exposure_us," + ",".join(f"{v:g}" for v in x) + "\n")
+        for i in range(n):
+            num = int(records['frame_num'][i]) if records is not None else i
+            exp = int(records['exposure_us'][i]) if records is not None else 0
+            f.write(f"{num},{exp}," + ",".join(map(str, pixels[i].tolist())) + "\n")
+            if i % EXPORT_BATCH == 0: yield i / n
+    if hasattr(pixels, 'close'): pixels.close()
+
+def export_npz(src, dst):
+    """Job: a .ccdrec or .ccdarc recording as the .npz the GUI used to save"""
+    pixels, r = open_frames(src)
+    n = len(pixels)
+    pix = np.zeros((n, CCD_PIXELS), dtype=np.uint16)
+    for i in range(n):
+        pix[i] = pixels[i]
+        if i % EXPORT_BATCH == 0: yield i / n
+    np.savez_compressed(dst, pixels=pix, frame_numbers=r['frame_num'].astype(np.uint16),
+                        sequence=r['seq'], device_time_s=r['time_s'],
+                        exposure_us=r['exposure_us'], capture_time=r['timestamp'],
+                        die_temp_c=r['die_temp_c'], board_temp_c=r['board_temp_c'])
+    if hasattr(pixels, 'close'): pixels.close()
+
+def arrow_schema(metadata=None):
+    """FRAME_RECORD as an Arrow schema: a column per field, the pixels a
+    fixed-size list of CCD_PIXELS uint16, and the recording's metadata
+    dict, as JSON, under the schema key b'ccd_monitor'"""
+    fields = [pa.field(name, pa.from_numpy_dtype(np.dtype(t)))
+              for name, t in FRAME_RECORD[:-1]]
+    fields.append(pa.field('pixels', pa.list_(pa.uint16(), CCD_PIXELS)))
+    meta = {b'ccd_monitor': json.dumps(metadata or {})}
+    return pa.schema(fields, metadata=meta)
+
+def arrow_batch(block, schema):
+    """FRAME_RECORD rows as an Arrow record batch; the pixel column takes
+    the rows' pixel block as its buffer, without a copy once it is
+    contiguous"""
+    columns = [pa.array(np.ascontiguousarray(block[name]))
+               for name, _ in FRAME_RECORD[:-1]]
+    flat = np.ascontiguousarray(block['pixels']).reshape(-1)
+    columns.append(pa.FixedSizeListArray.from_arrays(pa.array(flat),
+                                                     CCD_PIXELS))
+    return pa.RecordBatch.from_arrays(columns, schema=schema)
+
+def export_arrow(src, dst):
+    """Job: a recording as an Arrow IPC file (.arrow) or, for a dst ending
+    in .parquet, a Parquet file, a row per frame (arrow_schema()), in
+    batches of ARROW_BATCH frames"""
+    if pa is None: raise RuntimeError("Arrow export needs pyarrow")
+    pixels, records = open_frames(src)
+    n = len(pixels)
+    schema = arrow_schema(getattr(pixels, 'metadata', None))
+    if dst.endswith('.parquet'):
+        out = pa.parquet.ParquetWriter(dst, schema, compression='zstd')
+        write = out.write_batch
+    else:
+        out = pa.ipc.new_file(dst, schema)
+        write = out.write_batch
+    block = np.zeros(ARROW_BATCH, dtype=np.dtype(FRAME_RECORD))
+    try:
+        for i in range(0, n, ARROW_BATCH):
+            m = min(ARROW_BATCH, n - i)
+            if records is None:
+                block['frame_num'][:m] = np.arange(i, i + m)
+            else:
+                for name, _ in FRAME_RECORD[:-1]:
+                    block[name][:m] = records[name][i:i + m]
+            for k in range(m): block['pixels'][k] = pixels[i + k]
+            write(arrow_batch(block[:m], schema))
+            yield i / n
+    finally:
+        out.close()
+        if hasattr(pixels, 'close'): pixels.close()
+
+def compress_recording(src, dst, metadata=None):
+    """Job: a .ccdrec recording as a .ccdarc archive"""
+    rec = open_recording(src)
+    n = len(rec)
+    with ArchiveWriter(dst, metadata) as w:
+        for i in range(n):
+            w.write(rec[i].tobytes())
+            if i % EXPORT_BATCH == 0: yield i / n
+
+def _archive_chunks(f, at, end):
+    """(offset, length, frames) of the whole chunks of an open archive
+    file from at, up to end or the first not whole yet"""
+    out = []
+    while at + CCDARC_CHUNK.size <= end:
+        f.seek(at)
+        magic, frames, meta, data = CCDARC_CHUNK.unpack(
+            f.read(CCDARC_CHUNK.size))
+        n = CCDARC_CHUNK.size + meta + data
+        if magic != CCDARC_CHUNK_MAGIC or at + n > end: break
+        out.append((at, n, frames))
+        at += n
+    return out
+
+def _archive_closed(f, at, end):
+    """Whether an archive file's chunks end at at and its index and
+    footer, written by ArchiveWriter.close(), end at end"""
+    if end - at < CCDARC_FOOTER.size: return False
+    f.seek(end - CCDARC_FOOTER.size)
+    index, _, magic = CCDARC_FOOTER.unpack(f.read(CCDARC_FOOTER.size))
+    return magic == CCDARC_FOOTER_MAGIC and index == at
+
+def _upload_part(client, target, path, part, chunks):
+    """Send one part, its MD5 for the store to check; (ETag, MD5 hex,
+    {offset: CRC-32} of the chunks inside)"""
+    with open(path, 'rb') as f:
+        f.seek(part['start'])
+        body = f.read(part['end'] - part['start'])
+    md5 = hashlib.md5(body)
+    crcs = {str(off): zlib.crc32(body[off - part['start']:
+                                      off - part['start'] + n])
+            for off, n, *_ in chunks}
+    r = client.upload_part(Body=body, PartNumber=part['n'],
+                           ContentMD5=base64.b64encode(md5.digest()).decode(),
+                           **target)
+    return r['ETag'], md5.hexdigest(), crcs
+
+def _listed_parts(client, target):
+    """PartNumber -> ETag of the parts a multipart upload holds"""
+    parts, marker = {}, 0
+    while True:
+        r = client.list_parts(PartNumberMarker=marker, **target)
+        parts.update({p['PartNumber']: p['ETag'] for p in r.get('Parts', [])})
+        if not r.get('IsTruncated'): return parts
+        marker = r['NextPartNumberMarker']
+
+def _upload_save(path, state):
+    with open(path + '.tmp', 'w') as f: json.dump(state, f)
+    os.replace(path + '.tmp', path)
+
+def upload_archive(path, bucket, key=None, follow=False, client=None,
+                   part_size=UPLOAD_PART, workers=UPLOAD_WORKERS, stop=None):
+    """Job: a .ccdarc archive to an S3 bucket (or any store with its API;
+    client a boto3 S3 client, a default one without) as key (the file's
+    name without), as a multipart upload of parts of whole chunks, at
+    least part_size bytes each but the last, workers of them at a time.
+    Each part goes with its MD5, which the store checks, and the chunks
+    found get a CRC-32 each; once the upload is complete they go to
+    key + ".chunks.json" as (offset, bytes, frames, crc32), the chunk
+    index with checksums, for checking or reading parts of the object.
+
+    With follow the archive is still being written (FrameRecorder):
+    parts go as soon as enough chunks are whole, and the upload completes
+    once close() has written the index. Progress, the upload id and the
+    parts sent are kept in path + UPLOAD_SUFFIX after each part, so an
+    upload stopped (stop set, a crash, the link lost UPLOAD_RETRIES times
+    in a row) starts again where it was: the parts the store lists with
+    the same ETag are kept, the others sent again."""
+    if not path.endswith(".ccdarc"):
+        raise ValueError(f"{path}: only archives upload in chunks")
+    if client is None:
+        if boto3 is None: raise RuntimeError("uploads need boto3")
+        client = boto3.client('s3')
+    key = key or os.path.basename(path)
+    state_path = path + UPLOAD_SUFFIX
+    state = None
+    if os.path.exists(state_path):
+        with open(state_path) as f: state = json.load(f)
+        if (state['bucket'], state['key']) != (bucket, key): state = None
+    def target(s):
+        return {'Bucket': bucket, 'Key': key, 'UploadId': s['upload_id']}
+    if state:
+        try:
+            listed = _listed_parts(client, target(state))
+        except Exception:  # NoSuchUpload: aborted or expired, start over
+            state = None
+        else:
+            for p in state['parts']:
+                if listed.get(p['n']) != p['etag']: p['etag'] = None
+    with open(path, 'rb') as f:
+        while follow and os.fstat(f.fileno()).st_size < CCDARC_HEADER.size:
+            if stop and stop.is_set(): return
+            time.sleep(UPLOAD_POLL)  # The writer's first flush
+        _, _, _, _, meta_len = CCDARC_HEADER.unpack(f.read(CCDARC_HEADER.size))
+        if state is None:
+            r = client.create_multipart_upload(Bucket=bucket, Key=key)
+            state = {'bucket': bucket, 'key': key, 'upload_id': r['UploadId'],
+                     'scan': CCDARC_HEADER.size + meta_len, 'planned': 0,
+                     'chunks': [], 'parts': [], 'final': False}
+            _upload_save(state_path, state)
+        chunks, parts = state['chunks'], state['parts']
+        ends = [off + n for off, n, *_ in chunks]
+        todo = deque(p for p in parts if p['etag'] is None)
+        tries = {}
+        pending = {}
+
+        def plan(start, end):
+            part = {'n': len(parts) + 1, 'start': start, 'end': end,
+                    'etag': None, 'md5': None}
+            parts.append(part)
+            todo.append(part)
+            state['planned'] = end
+
+        with concurrent.futures.ThreadPoolExecutor(workers) as pool:
+            while True:
+                end = os.fstat(f.fileno()).st_size
+                if not state['final']:
+                    for off, n, frames in _archive_chunks(f, state['scan'], end):
+                        chunks.append([off, n, frames, None])
+                        ends.append(off + n)
+                        state['scan'] = off + n
+                    while True:
+                        i = bisect.bisect_left(ends, state['planned'] + part_size)
+                        if i == len(ends): break
+                        plan(state['planned'], ends[i])
+                    if not follow or _archive_closed(f, state['scan'], end):
+                        if state['planned'] < end: plan(state['planned'], end)
+                        state['final'] = True
+                while todo and len(pending) < workers * 2:
+                    part = todo.popleft()
+                    inside = [c for c in chunks
+                              if part['start'] <= c[0] < part['end']]
+                    pending[pool.submit(_upload_part, client, target(state),
+                                        path, part, inside)] = part
+                if not pending:
+                    if state['final']: break
+                    if stop and stop.is_set(): return
+                    time.sleep(UPLOAD_POLL)
+                    continue
+                done, _ = concurrent.futures.wait(
+                    pending, UPLOAD_POLL,
+                    concurrent.futures.FIRST_COMPLETED)
+                for fut in done:
+                    part = pending.pop(fut)
+                    try:
+                        part['etag'], part['md5'], crcs = fut.result()
+                    except Exception as e:
+                        tries[part['n']] = tries.get(part['n'], 0) + 1
+                        if tries[part['n']] >= UPLOAD_RETRIES:
+                            _upload_save(state_path, state)
+                            raise RuntimeError(
+                                f"{path}: part {part['n']}: {e}") from e
+                        todo.append(part)
+                        continue
+                    for c in chunks:
+                        c[3] = crcs.get(str(c[0]), c[3])
+                    _upload_save(state_path, state)
+                if stop and stop.is_set() and not state['final']:
+                    todo.clear()
+                sent = sum(p['end'] - p['start'] for p in parts if p['etag'])
+                yield sent / max(end, 1)
+    client.complete_multipart_upload(
+        MultipartUpload={'Parts': [{'PartNumber': p['n'], 'ETag': p['etag']}
+                                   for p in parts]}, **target(state))
+    client.put_object(Bucket=bucket, Key=key + ".chunks.json",
+                      Body=json.dumps({'chunks': chunks, 'parts': [
+                          (p['start'], p['end'], p['md5']) for p in parts]}).encode())
+    os.remove(state_path)
+    yield 1.0
+
+def mean_frame(path):
+    """The mean of every frame of a recording, float32: a dark or flat
+    reference for reprocess()"""
+    pixels, _ = open_frames(path)
+    acc = np.zeros(CCD_PIXELS)
+    for i in range(len(pixels)): acc += pixels[i]
+    if hasattr(pixels, 'close'): pixels.close()
+    return (acc / max(len(pixels), 1)).astype(np.float32)
+
+def photon_transfer(levels, max_light=None):
+    """Gain and read noise from the levels of a photon transfer run
+    (CCDReceiver.ptc['levels']): a line through variance against light,
+    the shot-noise part, up to max_light counts (default all). The gain is
+    the inverse slope in e-/count, the read noise the square root of the
+    variance the line has in the dark, in counts and electrons."""
+    pts = [(lv['light'], lv['variance']) for lv in levels
+           if max_light is None or lv['light'] <= max_light]
+    if len(pts) < 2:
+        raise ValueError("photon transfer needs two levels or more")
+    light, var = np.array(pts).T
+    slope, dark = np.polyfit(light, var, 1)
+    if slope <= 0:
+        raise ValueError("variance does not grow with light")
+    noise = float(np.sqrt(max(dark, 0.0)))
+    return {'gain_e_per_count': 1.0 / slope, 'read_noise_counts': noise,
+            'read_noise_e': noise / slope, 'points': len(pts)}
+
+_batch = None  # In a reprocess() worker: what _batch_init() was given
+
+def _batch_init(path, dark, gain, detector, coeffs):
+    global _batch
+    _batch = (Archive(path), dark, gain, detector, coeffs)
+
+def _batch_chunk(c):
+    """reprocess() worker: chunk c as signal above the dark, flat-fielded,
+    shuffled and deflated for ArchiveWriter.write_chunk(), and the peaks
+    of its frames"""
+    arc, dark, gain, detector, coeffs = _batch
+    records, pixels = arc._chunk(c)
+    signal = (65535.0 if dark is None else dark) - pixels.astype(np.float32)
+    if gain is not None: signal *= gain
+    out = np.clip(signal, 0, 65535).astype('<u2')
+    peaks = np.zeros(len(out), dtype=REPROCESS_PEAKS)
+    peaks['frame_num'] = records['frame_num']
+    for f in ('position_px', 'height', 'wavelength_nm'): peaks[f] = np.nan
+    if detector is not None:
+        for i, line in enumerate(out):
+            px, py = detector.find_peaks(line)
+            if len(px) > PEAK_TRACK_MAX:  # The highest, in position order
+                keep = np.sort(np.argsort(py)[-PEAK_TRACK_MAX:])
+                px, py = px[keep], py[keep]
+            peaks['count'][i] = len(px)
+            peaks['position_px'][i, :len(px)] = px
+            peaks['height'][i, :len(px)] = py
+            if coeffs: peaks['wavelength_nm'][i, :len(px)] = np.polyval(coeffs, px)
+    data = zlib.compress(_shuffle(out.tobytes()), CCDARC_LEVEL)
+    return len(out), records.tobytes(), data, peaks
+
+def _inflated(arc, chunks, workers):
+    """(records, pixels) of chunks 0 to chunks of arc in order, inflated
+    on workers threads (zlib lets go of the GIL), REPROCESS_WINDOW per
+    thread ahead"""
+    with concurrent.futures.ThreadPoolExecutor(workers) as io:
+        ahead = deque()
+        for c in range(chunks):
+            while len(ahead) < workers * REPROCESS_WINDOW and \
+                    c + len(ahead) < chunks:
+                ahead.append(io.submit(arc._chunk, c + len(ahead)))
+            yield ahead.popleft().result()
+
+def _deflate(out):
+    return zlib.compress(_shuffle(out), CCDARC_LEVEL)
+
+def _pinned(rows):
+    """rows frames of page-locked host memory, which the GPU copies from
+    and to while it computes"""
+    mem = cp.cuda.alloc_pinned_memory(rows * CCD_PIXELS * 2)
+    return np.frombuffer(mem, np.uint16, rows * CCD_PIXELS).reshape(rows, -1)
+
+class GpuBatch:
+    """_batch_chunk() as CuPy kernels, a whole chunk per call: the dark and
+    gain stay on the device, and the peaks are found in all the frames at
+    once. The smoothing is PeakDetector's Savitzky-Golay filter as one
+    correlation along the rows; a sample is a peak when it is over the
+    threshold, the highest within min_distance - 1 either side and
+    higher than the one before it (the first of a plateau). That keeps
+    what scipy's find_peaks() keeps but for a peak on the flank of a
+    higher sample that is not a peak itself. The PEAK_TRACK_MAX highest
+    of a frame stay, in position order."""
+    def __init__(self, dark, gain, detector):
+        self.dark = cp.asarray(65535.0 if dark is None else dark, dtype=cp.float32)
+        self.gain = None if gain is None else cp.asarray(gain)
+        self.detector = detector
+        self.coeffs = None
+        window = detector._window() if detector else 0
+        if window and CCD_PIXELS > window:
+            self.coeffs = cp.asarray(savgol_coeffs(window, detector.poly_order))
+
+    def run(self, raw, dev, out, stream):
+        """raw, a pinned chunk, copied to dev and corrected into out,
+        pinned as well, on stream; returns the peaks (device arrays), all
+        of it ready once the stream is"""
+        with stream:
+            dev.set(raw, stream=stream)
+            signal = self.dark - dev.astype(cp.float32)
+            if self.gain is not None: signal *= self.gain
+            line = cp.clip(signal, 0, 65535).astype(cp.uint16)
+            line.get(stream=stream, out=out, blocking=False)
+            return self.peaks(line) if self.detector else None
+
+    def peaks(self, line):
+        """(count, position_px, height) per frame of line, the latter two
+        PEAK_TRACK_MAX wide and NaN past count"""
+        nd = cupyx.scipy.ndimage
+        height = line.astype(cp.float32)
+        y = height if self.coeffs is None else \
+            nd.correlate1d(height, self.coeffs, axis=1, mode='nearest')
+        size = 2 * max(1, int(self.detector.min_distance)) - 1
+        peak = (y >= self.detector.threshold) & \
+            (y == nd.maximum_filter1d(y, size, axis=1, mode='nearest'))
+        peak[:, 1:] &= y[:, 1:] > y[:, :-1]
+        peak[:, 0] = peak[:, -1] = False
+        score = cp.where(peak, y, -cp.inf)
+        rows = cp.arange(len(y))[:, None]
+        top = cp.argpartition(-score, PEAK_TRACK_MAX, axis=1)[:, :PEAK_TRACK_MAX]
+        top = cp.sort(cp.where(peak[rows, top], top, CCD_PIXELS), axis=1)
+        found = top < CCD_PIXELS
+        idx = cp.minimum(top, CCD_PIXELS - 2)
+        pos = PeakDetector._refine(y, idx, rows)
+        return (found.sum(axis=1), cp.where(found, pos, cp.nan),
+                cp.where(found, height[rows, idx], cp.nan))
+
+def _gpu_chunks(src, chunks, dark, gain, detector, coeffs, workers):
+    """What _batch_chunk() returns, for each chunk in order, from the GPU.
+    Threads inflate and deflate, as many as workers; two pinned chunks
+    on two streams let one copy to the device and back while the other
+    computes."""
+    arc = Archive(src)
+    kernels = GpuBatch(dark, gain, detector)
+    rows = arc.chunk_frames
+    slots = [(_pinned(rows), cp.empty((rows, CCD_PIXELS), cp.uint16),
+              _pinned(rows), cp.cuda.Stream(non_blocking=True))
+             for _ in range(2)]
+    on_gpu, deflating = deque(), deque()
+
+    def harvest(records, n, slot, found):
+        raw, dev, out, stream = slot
+        stream.synchronize()
+        peaks = np.zeros(n, dtype=REPROCESS_PEAKS)
+        peaks['frame_num'] = records['frame_num']
+        for f in ('position_px', 'height', 'wavelength_nm'): peaks[f] = np.nan
+        if found is not None:
+            count, pos, height = (a.get() for a in found)
+            peaks['count'], peaks['position_px'], peaks['height'] = count, pos, height
+            if coeffs: peaks['wavelength_nm'] = np.polyval(coeffs, pos)
+        deflating.append((n, records.tobytes(),
+                          io.submit(_deflate, out[:n].tobytes()), peaks))
+
+    with concurrent.futures.ThreadPoolExecutor(workers) as io:
+        for c, (records, pixels) in enumerate(_inflated(arc, chunks, workers)):
+            if len(on_gpu) == len(slots): harvest(*on_gpu.popleft())
+            slot = slots[c % len(slots)]
+            n = len(pixels)
+            slot[0][:n] = pixels
+            on_gpu.append((records, n, slot, kernels.run(
+                slot[0][:n], slot[1][:n], slot[2][:n], slot[3])))
+            while deflating and (deflating[0][2].done() or
+                                 len(deflating) > workers * REPROCESS_WINDOW):
+                n, meta, data, peaks = deflating.popleft()
+                yield n, meta, data.result(), peaks
+        while on_gpu: harvest(*on_gpu.popleft())
+        while deflating:
+            n, meta, data, peaks = deflating.popleft()
+            yield n, meta, data.result(), peaks
+    arc.close()
+
+def _pool_chunks(src, chunks, dark, gain, detector, coeffs, workers):
+    """What _batch_chunk() returns, for each chunk in order, from a
+    process pool"""
+    pool = concurrent.futures.ProcessPoolExecutor(
+        workers, mp_context=multiprocessing.get_context('spawn'),
+        initializer=_batch_init,
+        initargs=(src, dark, gain, detector, coeffs))
+    with pool:
+        pending = deque()
+        nxt = 0
+        for _ in range(chunks):
+            while nxt < chunks and len(pending) < workers * REPROCESS_WINDOW:
+                pending.append(pool.submit(_batch_chunk, nxt))
+                nxt += 1
+            yield pending.popleft().result()
+
+def reprocess(src, dst=None, dark=None, flat=None, detector=None,
+              calibration=None, workers=None, gpu=False):
+    """Job: a .ccdarc archive again, its chunks spread over workers
+    processes (every core by default), into dst (src's name with
+    .reprocessed.ccdarc) and, with a PeakDetector, the peaks of every
+    frame into a .peaks.npy beside it (REPROCESS_PEAKS records; np.load
+    with mmap_mode='r').
+
+    The frames become signal above the dark: dark (a recording, averaged,
+    or a line) minus the raw counts, or 65535 minus them without one, as
+    the GUI shows them. flat (the same) divides out the pixel response,
+    normalised to its mean. calibration (a Calibration or polyval
+    coefficients) gives the peak wavelengths and goes in the metadata.
+    The references go to each worker once, at its start; chunks come back
+    in order, at most REPROCESS_WINDOW per worker in flight, so memory
+    does not grow with the archive.
+
+    With gpu (CuPy installed) the chunks are corrected and searched for
+    peaks on the GPU instead (GpuBatch), while workers threads inflate
+    and deflate them."""
+    if gpu and cp is None: raise RuntimeError("GPU reprocessing needs cupy")
+    stem = os.path.splitext(src)[0]
+    dst = dst or stem + ".reprocessed.ccdarc"
+    ref = lambda r: mean_frame(r) if isinstance(r, str) else \
+        (None if r is None else np.asarray(r, dtype=np.float32))
+    dark_line, gain = ref(dark), None
+    if flat is not None:
+        f = (65535.0 if dark_line is None else dark_line) - ref(flat)
+        f = np.where(f > 0, f, np.nan)
+        gain = np.nan_to_num(np.nanmean(f) / f).astype(np.float32)
+    coeffs = calibration.polynomial() if isinstance(calibration, Calibration) \
+        else (list(calibration) if calibration is not None else None)
+    arc = Archive(src)
+    chunks, frames, chunk_frames = len(arc.offsets), len(arc), arc.chunk_frames
+    metadata = dict(arc.metadata)
+    arc.close()
+    metadata['reprocessed'] = {
+        'source': os.path.basename(src), 'signal': 'dark - raw',
+        'dark': dark if isinstance(dark, str) else dark is not None,
+        'flat': flat if isinstance(flat, str) else flat is not None}
+    if coeffs: metadata['calibration'] = {'polynomial_nm': coeffs}
+    peaks = None
+    if detector is not None:
+        peaks = np.lib.format.open_memmap(stem + ".peaks.npy", mode='w+',
+                                          dtype=REPROCESS_PEAKS, shape=(frames,))
+    workers = workers or os.cpu_count() or 1
+    results = (_gpu_chunks if gpu else _pool_chunks)(
+        src, chunks, dark_line, gain, detector, coeffs, workers)
+    with ArchiveWriter(dst, metadata) as w:
+        for done, (n, meta, data, chunk_peaks) in enumerate(results):
+            w.write_chunk(n, meta, data)
+            if peaks is not None:
+                peaks[done * chunk_frames:done * chunk_frames + n] = chunk_peaks
+            yield (done + 1) / chunks
+    if peaks is not None: peaks.flush()
+
+def archive_pca(src, components=PCA_COMPONENTS, dark=None, gpu=False,
+                workers=None):
+    """Principal components of every frame of a .ccdarc archive, taken as
+    signal above the dark as reprocess() does: {'frames', 'mean',
+    'components' (one per row, most variance first), 'variance',
+    'ratio'}. One pass over the chunks adds each into the sum and the
+    Gram matrix (float64, CCD_PIXELS square), on the GPU with gpu, so
+    memory does not grow with the archive."""
+    if gpu and cp is None: raise RuntimeError("GPU decomposition needs cupy")
+    xp = cp if gpu else np
+    line = mean_frame(dark) if isinstance(dark, str) else dark
+    base = xp.asarray(65535.0 if line is None else line, dtype=xp.float64)
+    total = xp.zeros(CCD_PIXELS)
+    gram = xp.zeros((CCD_PIXELS, CCD_PIXELS))
+    n = 0
+    arc = Archive(src)
+    for _, pixels in _inflated(arc, len(arc.offsets),
+                               workers or os.cpu_count() or 1):
+        x = base - xp.asarray(pixels, dtype=xp.float64)
+        total += x.sum(axis=0)
+        gram += x.T @ x
+        n += len(x)
+    arc.close()
+    mean = total / max(n, 1)
+    var, vec = xp.linalg.eigh(gram / max(n, 1) - xp.outer(mean, mean))
+    top = xp.argsort(var)[::-1][:components]
+    host = (lambda a: a.get()) if gpu else np.asarray
+    return {'frames': n, 'mean': host(mean), 'components': host(vec[:, top].T),
+            'variance': host(var[top]),
+            'ratio': host(var[top] / max(float(var.sum()), 1e-300))}
+
+def model_bins(frames):
+    """The MODEL_BINS bin means (float64) of raw frames, one row per frame,
+    as the device bins the effective pixels for its models"""
+    x = np.asarray(frames, dtype=np.float64)
+    x = x[..., MODEL_FIRST:MODEL_FIRST + MODEL_BINS * MODEL_BIN]
+    return x.reshape(x.shape[:-1] + (MODEL_BINS, MODEL_BIN)).mean(axis=-1)
+
+def _model_prep(bins, prep):
+    """The preprocessing of the device's models over bin rows: none, the
+    mean divided out ("area") or the standard normal variate ("snv")"""
+    if prep == "area":
+        mean = bins.mean(axis=-1, keepdims=True)
+        return bins / np.where(mean > 0, mean, np.nan)
+    if prep == "snv":
+        sd = bins.std(axis=-1, keepdims=True)
+        return (bins - bins.mean(axis=-1, keepdims=True)) / \
+            np.where(sd > 0, sd, np.nan)
+    return bins
+
+class LinearModel:
+    """Linear models on raw frames, up to MODEL_OUTPUTS outputs: PLS
+    regressions or PCA scores, each output
+
+        value = coef . ((d(p(bins)) - x_mean) / x_scale) + intercept
+
+    over the frame's MODEL_BINS bin means, p the preprocessing (MODEL_PREPS)
+    and d a Savitzky-Golay derivative of order deriv (0: none), zero past
+    the ends. Everything after p is linear, so it is folded into weights
+    (outputs x MODEL_BINS) and offsets on p(bins) at construction: apply()
+    is one product per batch, and device_loadings() the same model as
+    the device evaluates it (CCDReceiver.load_model())."""
+    def __init__(self, coef, intercept=0.0, prep="none", x_mean=None,
+                 x_scale=None, deriv=0, window=11, poly=2, names=None):
+        if prep not in MODEL_PREPS:
+            raise ValueError(f"model preprocessing {prep!r}")
+        coef = np.atleast_2d(np.asarray(coef, dtype=np.float64))
+        if coef.shape[1] != MODEL_BINS or not 1 <= len(coef) <= MODEL_OUTPUTS:
+            raise ValueError(f"model of {coef.shape} coefficients")
+        w = coef / (1.0 if x_scale is None else np.asarray(x_scale, np.float64))
+        offsets = np.broadcast_to(np.asarray(intercept, np.float64),
+                                  len(coef)).copy()
+        if x_mean is not None:
+            offsets -= w @ np.asarray(x_mean, dtype=np.float64)
+        self.deriv = (deriv, window, poly) if deriv else None
+        if deriv:
+            h = savgol_coeffs(window, poly, deriv=deriv, use='dot')
+            w = np.array([np.convolve(r, h, 'same') for r in w])
+        self.prep, self.weights, self.offsets = prep, w, offsets
+        self.names = list(names) if names else \
+            [f"y{k}" for k in range(len(coef))]
+
+    def features(self, frames):
+        """d(p(bins)) of raw frames, the variables the model was fitted on"""
+        x = _model_prep(model_bins(frames), self.prep)
+        if self.deriv:
+            deriv, window, poly = self.deriv
+            x = correlate1d(x, savgol_coeffs(window, poly, deriv=deriv,
+                                             use='dot'), axis=-1,
+                            mode='constant')
+        return x
+
+    def apply(self, frames):
+        """The outputs of one raw frame, or one row of them per frame:
+        NaN where the preprocessing divides by nothing"""
+        p = _model_prep(model_bins(frames), self.prep)
+        return p @ self.weights.T + self.offsets
+
+    @classmethod
+    def pls(cls, frames, y, components=4, prep="none", scale=False,
+            deriv=0, window=11, poly=2, names=None):
+        """A PLS regression of the values y (one row, or one value, per
+        raw frame) on the frames, components latent variables (NIPALS on
+        the centred variables, with scale unit variance)"""
+        base = cls(np.zeros((1, MODEL_BINS)), prep=prep, deriv=deriv,
+                   window=window, poly=poly)
+        x = base.features(frames)
+        y = np.asarray(y, dtype=np.float64).reshape(len(x), -1)
+        x_mean, y_mean = x.mean(axis=0), y.mean(axis=0)
+        x_scale = x.std(axis=0) if scale else np.ones(MODEL_BINS)
+        x_scale = np.where(x_scale > 0, x_scale, 1.0)
+        e, f = (x - x_mean) / x_scale, y - y_mean
+        ws, ps, qs = [], [], []
+        for _ in range(components):
+            w = np.linalg.svd(e.T @ f, full_matrices=False)[0][:, 0]
+            t = e @ w
+            tt = max(float(t @ t), 1e-300)
+            p, q = e.T @ t / tt, f.T @ t / tt
+            e, f = e - np.outer(t, p), f - np.outer(t, q)
+            ws.append(w)
+            ps.append(p)
+            qs.append(q)
+        w, p, q = np.array(ws).T, np.array(ps).T, np.array(qs).T
+        coef = (w @ np.linalg.pinv(p.T @ w) @ q.T).T
+        return cls(coef, y_mean, prep, x_mean, x_scale, deriv, window, poly,
+                   names)
+
+    @classmethod
+    def pca(cls, frames, components=MODEL_OUTPUTS, prep="none", deriv=0,
+            window=11, poly=2):
+        """The scores on the first principal components of the frames,
+        most variance first"""
+        base = cls(np.zeros((1, MODEL_BINS)), prep=prep, deriv=deriv,
+                   window=window, poly=poly)
+        x = base.features(frames)
+        x_mean = x.mean(axis=0)
+        vt = np.linalg.svd(x - x_mean, full_matrices=False)[2]
+        return cls(vt[:components], 0.0, prep, x_mean, None, deriv, window,
+                   poly, [f"pc{k + 1}" for k in range(min(components,
+                                                           len(vt)))])
+
+    def device_loadings(self):
+        """(loadings, scale, offset) per output as the device takes them:
+        int16 loadings at full scale, value = scale * (loadings . p(bins))
+        + offset"""
+        out = []
+        for w, b in zip(self.weights, self.offsets):
+            peak = float(np.abs(w).max())
+            k = 32767.0 / peak if peak > 0 else 1.0
+            out.append((np.round(w * k).astype(np.int16), 1.0 / k, float(b)))
+        return out
+
+class JobQueue:
+    """Saves, exports and compression, run one at a time on a thread of
+    their own so neither the GUI nor the acquisition waits for the disk.
+    A job is a generator yielding its progress (0 to 1); status() is the
+    line for the status bar, last the outcome of the last job and done the
+    number of jobs finished."""
+    def __init__(self):
+        self.jobs = queue.Queue()
+        self.done = 0
+        self.current = None
+        self.progress = 0.0
+        self.last = None
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    def submit(self, name, job, *args):
+        self.jobs.put((name, job, args))
+
+    def _run(self):
+        while True:
+            name, job, args = self.jobs.get()
+            self.current, self.progress = name, 0.0
+            try:
+                for self.progress in job(*args):
+                    pass
+                self.last = f"{name}: done"
+            except Exception as e:
+                self.last = f"{name} failed: {e}"
+            print(self.last)
+            self.current = None
+            self.done += 1
+
+    def status(self):
+        if self.current is None: return self.last or ""
+        queued = self.jobs.qsize()
+        more = f" (+{queued} queued)" if queued else ""
+        return f"{self.current} {self.progress:.0%}{more}"
+
+class MetricsServer:
+    """The receiver's and the recorder's counters and the device's
+    telemetry as Prometheus metrics, served over HTTP at /metrics, in the
+    OpenMetrics format to a scraper that asks for it. A scrape reads what
+    the receiver already holds and sends the device nothing, so it never
+    waits on or adds to the link: the fault counters come in the stream
+    each second, and poll(), from the loop that reads the frames, asks
+    for the latency percentiles and the memory budget every METRICS_POLL
+    seconds, and sets the fault report period to a second. Device
+    latencies are converted from cycles to seconds."""
+    def __init__(self, rx, port=METRICS_PORT, host=''):
+        self.rx = rx
+        self.due = 0.0
+        server = self
+        class Handler(http.server.BaseHTTPRequestHandler):
+            def do_GET(self):
+                if self.path.split('?')[0] not in ("/metrics", "/"):
+                    self.send_error(404)
+                    return
+                om = "application/openmetrics-text" in \
+                    self.headers.get("Accept", "")
+                body = server.render(om).encode()
+                self.send_response(200)
+                self.send_header("Content-Type",
+                                 "application/openmetrics-text; version=1.0.0; "
+                                 "charset=utf-8" if om else
+                                 "text/plain; version=0.0.4; charset=utf-8")
+                self.send_header("Content-Length", str(len(body)))
+                self.end_headers()
+                self.wfile.write(body)
+            def log_message(self, *args): pass
+        self.httpd = http.server.ThreadingHTTPServer((host, port), Handler)
+        self.httpd.daemon_threads = True
+        self.thread = threading.Thread(target=self.httpd.serve_forever,
+                                       daemon=True)
+        self.thread.start()
+
+    def poll(self):
+        """Ask for the telemetry a snapshot does not get in the stream,
+        when it is due; call from the thread that sends the commands"""
+        now = time.monotonic()
+        if now < self.due or not self.rx.connected: return
+        self.due = now + METRICS_POLL
+        self.rx.request_faults(1.0)  # Again after a reboot
+        self.rx.request_latency(reset=False)
+        self.rx.request_memory()
+
+    def families(self):
+        """(name, type, help, [(labels, value)]) of every metric known"""
+        rx = self.rx
+        out = []
+        def add(name, kind, text, *samples):
+            samples = [(l, v) for l, v in samples if v is not None]
+            if samples: out.append((name, kind, text, samples))
+        add("ccd_connected", "gauge", "Board connected",
+            ({}, int(bool(rx.connected))))
+        add("ccd_frames_received_total", "counter", "Live frames received",
+            ({}, rx.frames_received))
+        add("ccd_receive_bytes_total", "counter", "Bytes read from the link",
+            ({}, rx.rx_bytes))
+        add("ccd_frames_lost_total", "counter", "Sequence gaps",
+            ({}, rx.frames_lost))
+        add("ccd_crc_errors_total", "counter", "Frames failing their CRC",
+            ({}, rx.crc_errors))
+        add("ccd_resyncs_total", "counter", "Magic searches that skipped bytes",
+            ({}, rx.resyncs))
+        add("ccd_skipped_bytes_total", "counter", "Bytes skipped resyncing",
+            ({}, rx.skipped_bytes))
+        add("ccd_reconnects_total", "counter", "Board reconnections",
+            ({}, rx.reconnects))
+        add("ccd_frame_rate", "gauge", "Frames in the last second",
+            ({}, rx.fps))
+        link = rx.health.second
+        add("ccd_link_jitter_seconds", "gauge", "Mean arrival jitter",
+            ({}, link['jitter_ms'] / 1e3))
+        add("ccd_link_jitter_max_seconds", "gauge",
+            "Worst arrival jitter in the last second",
+            ({}, link['jitter_max_ms'] / 1e3))
+        add("ccd_link_over_capacity", "gauge",
+            "Frames lost in the last second",
+            ({}, int(bool(link.get('over_capacity')))))
+        add("ccd_clock_drift_ppm", "gauge", "Device clock against the host's",
+            ({}, rx.clock_drift_ppm if rx.time_fit else None))
+        rec = rx.recorder
+        if rec:
+            add("ccd_recorder_frames_total", "counter", "Frames recorded",
+                ({}, rec.frames))
+            add("ccd_recorder_dropped_total", "counter",
+                "Frames the recorder's queue had no room for", ({}, rec.dropped))
+            add("ccd_recorder_queue", "gauge", "Frames waiting for the writer",
+                ({}, rec.queue.qsize()))
+            add("ccd_recorder_queue_capacity", "gauge",
+                "Frames the writer's queue holds", ({}, rec.queue.maxsize))
+        db = rx.tsdb
+        if db:
+            add("ccd_tsdb_written_total", "counter", "Points written",
+                ({}, db.written))
+            add("ccd_tsdb_dropped_total", "counter",
+                "Points dropped from a full buffer", ({}, db.dropped))
+            add("ccd_tsdb_failures_total", "counter", "Failed writes",
+                ({}, db.failures))
+            add("ccd_tsdb_queue", "gauge", "Points waiting to be written",
+                ({}, len(db.points)))
+        info = rx.frame_info
+        if info:
+            add("ccd_temperature_celsius", "gauge", "Temperatures in the frames",
+                *(({'sensor': k[:-7]}, info.get(k))
+                  for k in ('die_temp_c', 'board_temp_c')))
+        faults = rx.faults
+        if faults:
+            add("ccd_device_uptime_seconds", "gauge", "Device uptime",
+                ({}, faults['uptime_ms'] / 1e3))
+            for k in FAULT_FIELDS[1:]:
+                add(f"ccd_device_{k}_total", "counter", f"Device {k} count",
+                    ({}, faults[k]))
+        hz = rx.device_info['clock_hz'] if rx.device_info else 0
+        lat = rx.latency
+        if lat and hz:
+            add("ccd_device_latency_seconds", "gauge",
+                "Device frame latency percentiles (arm, ready, sent, total)",
+                *(({'stage': name, 'quantile': q}, lat[name][p] / hz)
+                  for name in LATENCY_NAMES
+                  for q, p in (("0.5", 'p50'), ("0.99", 'p99'), ("1", 'max'))))
+            add("ccd_device_rearm_alarms_total", "counter",
+                "Re-arms close to the sync limit", ({}, lat['alarms']))
+        mem = rx.memory_status
+        if mem:
+            add("ccd_device_ring_slots", "gauge", "Frame ring slots",
+                ({}, mem['ring_slots']))
+            add("ccd_device_ring_occupancy", "gauge", "Frame ring slots in use",
+                ({}, mem['ring_now']))
+            add("ccd_device_ring_peak", "gauge", "Most frame ring slots in use",
+                ({}, mem['ring_peak']))
+            add("ccd_device_stack_peak_bytes", "gauge", "Stack high-water mark",
+                ({}, mem['stack_peak']))
+        return out
+
+    def render(self, openmetrics=False):
+        """The exposition text of a scrape"""
+        lines = []
+        for name, kind, text, samples in self.families():
+            family = name[:-6] if openmetrics and kind == "counter" else name
+            lines += [f"# HELP {family} {text}", f"# TYPE {family} {kind}"]
+            for labels, value in samples:
+                tags = ",".join(f'{k}="{v}"' for k, v in labels.items())
+                value = "NaN" if value != value else repr(value)
+                lines.append(f"{name}{{{tags}}} {value}" if tags
+                             else f"{name} {value}")
+        if openmetrics: lines.append("# EOF")
+        return "\n".join(lines) + "\n"
+
+    def close(self):
+        self.httpd.shutdown()
+        self.httpd.server_close()
+
+def _print_plan(plan, reason):
+    if plan is None:
+        print("No capabilities from the firmware: readout left as set")
+        return
+    link = f"{plan['link_mbps']:.1f} MB/s" if plan['link_mbps'] else "unmeasured"
+    print(f"Readout ({reason}): binning {plan['binning']}, {plan['bits']} bits, "
+          f"codec {plan['codec']}, roi {plan['roi'] or 'all'}, "
+          f"co-add {plan['coadd']}: {plan['frame_bytes']:.0f} B x "
+          f"{plan['fps']:.0f}/s = {plan['mbps']:.2f} MB/s of {link}"
+          f"{'' if plan['meets'] else ' (short of the target)'}", flush=True)
+
+def capture(port, count, fname, timeout=5.0, setup=None, stats_s=0.0,
+            stop=None, iso=False, metrics=None, tsdb=None, upload=None,
+            plan=None):
+    """Record count frames from port to fname (.ccdrec, or .ccdarc) without
+    the GUI, through the same receiver. count 0 records until stop (a
+    threading.Event) is set. setup(rx) configures the device once connected.
+    Stops early once no frame came for timeout seconds (None waits for
+    ever, for a trigger); every stats_s seconds prints a line of counters to
+    stdout. Returns the number of frames saved. A board that resets or
+    re-enumerates is reconnected and set up again (see
+    CCDReceiver._reconnect()); the time it is away does not count
+    toward timeout, and the gap goes to the recording's link log. iso reads
+    a vendor build's frames on its isochronous endpoint (UsbBulkPort).
+    metrics serves the counters on that HTTP port (MetricsServer), and
+    tsdb (a TsdbSink) takes the band, statistics and model records.
+    upload, a (bucket, key) pair, sends an archive to object storage as
+    it is written (upload_archive()); capture() returns once it is up.
+    plan, ReadoutPlanner's arguments after rx ({'fps': 200} at least),
+    has the readout chosen for that rate after setup, and again when the
+    link drops frames; each choice is printed.
+
+    Memory is the recorder's queue (CCDREC_QUEUE frames) and, for an
+    archive, one chunk; the reads block on the port, so an idle link costs
+    no CPU."""
+    rx = CCDReceiver()
+    rx.usb_iso = iso
+    if not rx.connect(port): return 0
+    if setup: setup(rx)
+    planner = ReadoutPlanner(rx, **plan) if plan else None
+    if planner: _print_plan(planner.start(), "start")
+    if tsdb: rx.set_tsdb(tsdb)
+    recorder = rx.start_recording(fname)
+    server = MetricsServer(rx, metrics) if metrics else None
+    uploader = concurrent.futures.ThreadPoolExecutor(1).submit(
+        lambda: deque(upload_archive(fname, *upload, follow=True), maxlen=1)) \
+        if upload else None
+    last = due = time.monotonic()
+    try:
+        while (rx.connected or rx.lost) and \
+                (not count or recorder.frames < count) and \
+                not (stop and stop.is_set()):
+            now = time.monotonic()
+            if rx.read_frame():
+                last = now
+            elif rx.lost:
+                last = now
+                time.sleep(RECONNECT_POLL)
+            elif timeout is not None and now - last > timeout:
+                break
+            if server: server.poll()
+            if planner and (new := planner.tick()):
+                _print_plan(new, "frames lost")
+            if stats_s and now >= due:
+                due = now + stats_s
+                print(f"{datetime.now():%H:%M:%S} frames {recorder.frames} "
+                      f"fps {rx.fps:.1f} lost {rx.frames_lost} "
+                      f"crc {rx.crc_errors} dropped {recorder.dropped} "
+                      f"reconnects {rx.reconnects}",
+                      flush=True)
+    finally:
+        n = rx.stop_recording()
+        rx.disconnect()
+        if server: server.close()
+        if tsdb: tsdb.close()
+    recorder.thread.join()
+    if uploader:
+        try:
+            uploader.result()
+        except (RuntimeError, OSError) as e:
+            print(f"Upload stopped, --upload {fname} resumes it: {e}",
+                  file=sys.stderr)
+    return n
+
+def replay_frame(seq, pixels, record=None):
+    """A recorded frame as CCD_BENCH_REPLAY takes it: a CCD_Frame_t with
+    REPLAY_MAGIC and the given seq; frame_num, exposure and temperatures
+    from record (a FRAME_RECORD row, None for a .npz). The device sets the
+    timestamp and the CRC."""
+    def temp(c):
+        return TEMP_NONE if c != c else int(round(c * 100.0))
+    num, exp, die, board = (0, 0, float('nan'), float('nan')) if record is None \
+        else (int(record['frame_num']), int(record['exposure_us']),
+              float(record['die_temp_c']), float(record['board_temp_c']))
+    info = FRAME_INFO.pack(FRAME_VERSION, FRAME_HEADER_SIZE, 0, seq, 0,
+                           temp(die), temp(board), exp, 1, CCD_PIXELS * 2, 0)
+    return struct.pack('<HH', REPLAY_MAGIC, num & 0xFFFF) + info + \
+        np.asarray(pixels, dtype='<u2').tobytes()
+
+def replay(port, src, dst=None, setup=None, timeout=5.0):
+    """Run the frames of a recording (src: .ccdrec, .ccdarc or .npz)
+    through the device's processing in place of the sensor, and record
+    what comes out to dst if given, for a change to the stages to be
+    tried on the same spectra every time. setup(rx) configures the stages
+    once connected. Frames go with seq 0.. (an output's seq is the index
+    of its source frame) and are paced by the board's flow control: one
+    that finds the pipeline full is NAKed until a slot frees, so none is
+    lost (counted in stalls). No commands go while they are written.
+    Returns {'sent', 'received', 'elapsed_s', 'fps', 'lost', 'crc_errors',
+    'stalls'}; fps is of the frames out, first to last."""
+    pixels, records = open_frames(src)
+    n = len(pixels)
+    rx = CCDReceiver()
+    if not rx.connect(port): raise OSError(f"cannot open {port}")
+    sent, failed = [0], []
+    def write():
+        try:
+            for i in range(n):
+                if not rx.connected: return
+                rx.serial.write(replay_frame(
+                    i, pixels[i], records[i] if records is not None else None))
+                sent[0] += 1
+        except (serial.SerialException, OSError) as e:
+            failed.append(e)
+    recorder = None
+    try:
+        if setup: setup(rx)
+        rx.last_time_ping = float('inf')  # A ping would land inside a frame
+        seqs = rx.start_bench(BENCH_REPLAY, 0, n)
+        if not rx._pump(lambda: seqs and seqs[0] in rx.cmd_acks, timeout) \
+                or rx.cmd_acks[seqs[0]][1] != "ok":
+            raise OSError(f"replay refused on {port}")
+        recorder = rx.start_recording(dst) if dst else None
+        writer = threading.Thread(target=write, daemon=True)
+        writer.start()
+        got, first, last = 0, None, time.perf_counter()
+        while rx.connected and got < n and \
+                (writer.is_alive() or time.perf_counter() - last < timeout):
+            if rx.read_frame():
+                last = time.perf_counter()
+                first = last if first is None else first
+                got += 1
+            elif time.perf_counter() - last > timeout:
+                break  # The board stopped taking them
+        writer.join(timeout)
+        if failed: raise OSError(f"replay to {port}: {failed[0]}")
+        seqs = rx.stop_bench()
+        rx._pump(lambda: seqs and seqs[0] in rx.cmd_acks, timeout)
+        elapsed = last - first if got > 1 else 0.0
+        return {'sent': sent[0], 'received': got, 'elapsed_s': elapsed,
+                'fps': (got - 1) / elapsed if elapsed else 0.0,
+                'lost': rx.frames_lost, 'crc_errors': rx.crc_errors,
+                'stalls': rx.bench['stalls']}
+    finally:
+        if recorder: rx.stop_recording()
+        rx.disconnect()
+        if recorder: recorder.thread.join()
+        if hasattr(pixels, 'close'): pixels.close()
+
+def _rice_bits(data, pos, n, nbytes):
+    """n (at most 16) bits MSB first from bit pos"""
+    b = pos >> 3
+    v = data[b] << 16
+    if b + 1 < nbytes: v |= data[b + 1] << 8
+    if b + 2 < nbytes: v |= data[b + 2]
+    return (v >> (24 - (pos & 7) - n)) & ((1 << n) - 1)
+
+def _rice_kernel(data, count, bits, ref, temporal, out):
+    """rice_decode() compiled, into out: the bits used, or -1 if the
+    stream ends early. Runs of ones in a quotient are skipped a byte at
+    a time."""
+    nbytes = data.shape[0]
+    nbits = nbytes * 8
+    pos = 0
+    prev = 0
+    i = 0
+    while i < count:
+        n = min(RICE_BLOCK, count - i)
+        if pos + 5 > nbits:
+            return -1
+        k = _rice_bits(data, pos, 5, nbytes)
+        pos += 5
+        if k == RICE_ESCAPE:
+            if pos + n * bits > nbits:
+                return -1
+            for j in range(i, i + n):
+                prev = _rice_bits(data, pos, bits, nbytes)
+                out[j] = prev
+                pos += bits
+        else:
+            for j in range(i, i + n):
+                q = 0
+                while True:
+                    if pos >= nbits:
+                        return -1
+                    if (pos & 7) == 0 and data[pos >> 3] == 0xFF:
+                        q += 8
+                        pos += 8
+                        continue
+                    if (data[pos >> 3] >> (7 - (pos & 7))) & 1 == 0:
+                        break
+                    q += 1
+                    pos += 1
+                pos += 1
+                u = q << k
+                if k:
+                    if pos + k > nbits:
+                        return -1
+                    u |= _rice_bits(data, pos, k, nbytes)
+                    pos += k
+                d = (u >> 1) ^ -(u & 1)
+                prev = (ref[j] if temporal else prev) + d
+                out[j] = prev
+        i += n
+    return pos
+
+if numba is not None:
+    _rice_bits = numba.njit(cache=True, inline='always')(_rice_bits)
+    _rice_kernel = numba.njit(cache=True, nogil=True)(_rice_kernel)
+
+def rice_decode(data, count, bits, ref=None, out=None):
+    """Inverse of the firmware's CCD_Codec_RiceEncode(), into out (int32, at
+    least count long) when given: values at the stream's bit depth. The
+    compiled _rice_kernel() with numba, else rice_decode_reference()."""
+    if numba is None:
+        values = rice_decode_reference(data, count, bits, ref)
+        if out is None: return values
+        out[:count] = values
+        return out[:count]
+    out = np.empty(count, dtype=np.int32) if out is None else out[:count]
+    raw = np.frombuffer(data, dtype=np.uint8)
+    temporal = ref is not None
+    ref = np.asarray(ref, dtype=np.int32) if temporal else out
+    if _rice_kernel(raw, count, bits, ref, temporal, out) < 0:
+        raise ValueError("truncated Rice stream")
+    return out
+
+def rice_encode(values, bits, ref=None):
+    """CCD_Codec_RiceEncode() line for line, for checking the decoders against
+    (see bench_decode()): values at the stream's bit depth, deltas to
+    the previous value or to ref, each block escaped to plain bits-wide
+    values when Rice would not be shorter"""
+    out, acc, nacc = bytearray(), 0, 0
+    def put(v, n):
+        nonlocal acc, nacc
+        acc, nacc = (acc << n) | v, nacc + n
+        while nacc >= 8:
+            nacc -= 8
+            out.append((acc >> nacc) & 0xFF)
+        acc &= (1 << nacc) - 1
+    prev = 0
+    values = [int(v) for v in values]
+    for i in range(0, len(values), RICE_BLOCK):
+        block = values[i:i + RICE_BLOCK]
+        u = []
+        for j, v in enumerate(block):
+            d = v - (int(ref[i + j]) if ref is not None else prev)
+            prev = v
+            u.append(((d << 1) ^ (d >> 31)) & 0xFFFFFFFF)
+        mean = sum(u) // len(u)
+        k = mean.bit_length() - 1 if mean else 0
+        if len(u) * (k + 1) + sum(x >> k for x in u) >= len(u) * bits:
+            put(RICE_ESCAPE, 5)
+            for v in block: put(v, bits)
+            continue
+        put(k, 5)
+        for x in u:
+            q = x >> k
+            put(((1 << q) - 1) << 1, q + 1)
+            if k: put(x & ((1 << k) - 1), k)
+    if nacc: put(0, 8 - nacc)
+    return bytes(out)
+
+def rice_decode_reference(data, count, bits, ref=None):
+    """Inverse of the firmware's CCD_Codec_RiceEncode(): per block a 5-bit
+    k, then unary quotient + k-bit remainder of each zigzagged delta (MSB
+    first). Deltas are to the previous pixel, or to ref (temporal). Returns
+    values at the stream's bit depth."""
+    s = bin(int.from_bytes(b'\x01' + bytes(data), 'big'))[3:]
+    out = np.empty(count, dtype=np.int32)
+    pos = 0
+    prev = 0
+    for i in range(0, count, RICE_BLOCK):
+        n = min(RICE_BLOCK, count - i)
+        k = int(s[pos:pos + 5], 2)
+        pos += 5
+        if k == RICE_ESCAPE:
+            for j in range(i, i + n):
+                prev = int(s[pos:pos + bits], 2)
+                out[j] = prev
+                pos += bits
+            continue
+        for j in range(i, i + n):
+            zero = s.find('0', pos)
+            if zero < 0: raise ValueError("truncated Rice stream")
+            u = (zero - pos) << k
+            pos = zero + 1
+            if k:
+                u |= int(s[pos:pos + k], 2)
+                pos += k
+            d = (u >> 1) ^ -(u & 1)
+            prev = (int(ref[j]) if ref is not None else prev) + d
+            out[j] = prev
+    return out
+
+# ==========================================
+# VENDOR BULK TRANSPORT (libusb)
+# ==========================================
+class UsbBulkPort:
+    """The vendor bulk interfaces behind the part of the serial.Serial API
+    CCDReceiver uses. USB_BULK_URBS asynchronous reads stay queued on the
+    data endpoint, so the device never waits on the host between transfers;
+    a thread runs the libusb events and appends what arrives. The control
+    endpoint takes its own reads: the device sends each ack or report as
+    one transfer, and read_control() hands them over whole.
+
+    With iso (firmware built with CCD_USB_ISO) the data interface is
+    switched to its isochronous setting: the bus reserves one USB_ISO_MPS
+    packet every 1 ms for the frames, so their delivery time no longer
+    varies with the host's other traffic. A packet that arrives corrupted
+    is dropped, not resent, and counted in iso_errors. The device drops
+    the rest of that frame, so the receiver sees one frame lost."""
+
+    @staticmethod
+    def available():
+        if usb1 is None: return False
+        try:
+            with usb1.USBContext() as ctx:
+                return any(d.getVendorID() == USB_VID and d.getProductID() == USB_PID_VENDOR
+                           for d in ctx.getDeviceIterator(skip_on_error=True))
+        except usb1.USBError:
+            return False
+
+    @staticmethod
+    def serial_numbers():
+        """Of every vendor bulk board attached (the unique ID Get_SerialNum()
+        in usbd_desc.c reports)"""
+        if usb1 is None: return []
+        out = []
+        try:
+            with usb1.USBContext() as ctx:
+                for d in ctx.getDeviceIterator(skip_on_error=True):
+                    if d.getVendorID() == USB_VID and d.getProductID() == USB_PID_VENDOR:
+                        out.append(d.getSerialNumber())
+        except usb1.USBError:
+            pass
+        return out
+
+    def __init__(self, timeout=0.5, serial_number=None, iso=False):
+        """The first vendor bulk board, or the one with serial_number"""
+        if usb1 is None: raise OSError("python-libusb1 is not installed")
+        self.timeout = timeout
+        self.ctx = usb1.USBContext()
+        if serial_number is None:
+            self.handle = self.ctx.openByVendorIDAndProductID(
+                USB_VID, USB_PID_VENDOR, skip_on_error=True)
+        else:
+            self.handle = next(
+                (d.open() for d in self.ctx.getDeviceIterator(skip_on_error=True)
+                 if d.getVendorID() == USB_VID and d.getProductID() == USB_PID_VENDOR
+                 and d.getSerialNumber() == serial_number), None)
+        if self.handle is None:
+            self.ctx.close()
+            raise OSError("no vendor bulk device found")
+        self.handle.claimInterface(0)
+        self.handle.claimInterface(1)
+        self.iso = iso
+        self.iso_errors = 0     # Isochronous packets dropped on the way
+        if iso:
+            self.handle.setInterfaceAltSetting(1, 1)
+        self.buf = bytearray()
+        self.ctl = []  # Whole control messages, oldest first
+        self.cond = threading.Condition()
+        self.error = None
+        self.is_open = True
+        self.transfers = []
+        for ep, n in ((USB_BULK_DATA, USB_BULK_URBS), (USB_BULK_IN, 2)):
+            for _ in range(n):
+                if iso and ep == USB_BULK_DATA:
+                    t = self.handle.getTransfer(USB_ISO_PACKETS)
+                    t.setIsochronous(ep, USB_ISO_PACKETS * USB_ISO_MPS,
+                                     callback=self._on_iso, user_data=ep)
+                else:
+                    t = self.handle.getTransfer()
+                    t.setBulk(ep, USB_BULK_URB_SIZE, callback=self._on_read,
+                              user_data=ep)
+                t.submit()
+                self.transfers.append(t)
+        self.thread = threading.Thread(target=self._events, daemon=True)
+        self.thread.start()
+
+    def _on_read(self, t):
+        status = t.getStatus()
+        if status == usb1.TRANSFER_COMPLETED:
+            data = t.getBuffer()[:t.getActualLength()]
+            with self.cond:
+                if t.getUserData() == USB_BULK_IN:
+                    if data: self.ctl.append(bytes(data))
+                else:
+                    self.buf += data
+                self.cond.notify()
+            if self.is_open: t.submit()
+        elif status != usb1.TRANSFER_CANCELLED:
+            with self.cond:
+                self.error = f"bulk read failed ({status})"
+                self.cond.notify()
+
+    def _on_iso(self, t):
+        status = t.getStatus()
+        if status == usb1.TRANSFER_COMPLETED:
+            with self.cond:
+                for st, data in t.iterISO():
+                    if st == usb1.TRANSFER_COMPLETED:
+                        self.buf += data
+                    else:
+                        self.iso_errors += 1
+                self.cond.notify()
+            if self.is_open: t.submit()
+        elif status != usb1.TRANSFER_CANCELLED:
+            with self.cond:
+                self.error = f"isochronous read failed ({status})"
+                self.cond.notify()
+
+    def _events(self):
+        while self.is_open:
+            try:
+                self.ctx.handleEventsTimeout(0.1)
+            except usb1.USBError as e:
+                with self.cond:
+                    self.error = str(e)
+                    self.cond.notify()
+                return
+
+    @property
+    def in_waiting(self):
+        return len(self.buf)
+
+    def _wait(self, n):
+        self.cond.wait_for(lambda: len(self.buf) >= n or self.error or
+                           (self.ctl and not self.buf), self.timeout)
+        if self.error and not self.buf: raise OSError(self.error)
+
+    def read(self, n):
+        """Up to n data bytes. Returns early when a control message is
+        waiting, so an ack is not held up by an idle data endpoint."""
+        with self.cond:
+            self._wait(n)
+            data = bytes(self.buf[:n])
+            del self.buf[:n]
+        return data
+
+    def readinto(self, b):
+        """read() into the buffer b, without allocating: the byte count"""
+        with self.cond:
+            self._wait(len(b))
+            n = min(len(b), len(self.buf))
+            with memoryview(self.buf) as mv:
+                b[:n] = mv[:n]
+            del self.buf[:n]
+        return n
+
+    def read_control(self):
+        with self.cond:
+            msgs, self.ctl = self.ctl, []
+        return msgs
+
+    def write(self, data):
+        try:
+            return self.handle.bulkWrite(USB_BULK_OUT, data, timeout=1000)
+        except usb1.USBError as e:
+            raise OSError(str(e))
+
+    def close(self):
+        if not self.is_open: return
+        self.is_open = False
+        for t in self.transfers:
+            try:
+                t.cancel()
+            except usb1.USBError:
+                pass
+        self.thread.join()
+        try:
+            # Let the cancellations complete before the handle goes
+            while any(t.isSubmitted() for t in self.transfers):
+                self.ctx.handleEventsTimeout(0.1)
+            if self.iso:
+                self.handle.setInterfaceAltSetting(1, 0)  # Frees the bandwidth
+            self.handle.releaseInterface(1)
+            self.handle.releaseInterface(0)
+        except usb1.USBError:
+            pass
+        self.handle.close()
+        self.ctx.close()
+
+class UdpPort:
+    """The frame multicast of an Ethernet build (CCD_ETH=1) as a read-only
+    port. Each datagram is one whole frame, reassembled by the kernel from
+    its IP fragments; a lost fragment drops the datagram, and the gap shows
+    in seq. Any number of hosts can join the group at once."""
+
+    def __init__(self, group=ETH_GROUP, port=ETH_PORT, iface="0.0.0.0",
+                 timeout=DUAL_TIMEOUT):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, ETH_RCVBUF)
+        self.sock.bind(("", port))
+        mreq = socket.inet_aton(group) + socket.inet_aton(iface)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+        self.sock.settimeout(timeout)
+        self.rx = bytearray()
+
+    @property
+    def in_waiting(self):
+        return len(self.rx)
+
+    def read(self, n):
+        if not self.rx:
+            try:
+                self.rx += self.sock.recv(65536)
+            except socket.timeout:
+                return b''
+        chunk = bytes(self.rx[:n])
+        del self.rx[:n]
+        return chunk
+
+    def close(self):
+        self.sock.close()
+
+class MessagePort:
+    """One received message as a port that runs dry at its end."""
+
+    def __init__(self, data):
+        self.data = data
+
+    @property
+    def in_waiting(self):
+        return len(self.data)
+
+    def read(self, n):
+        chunk, self.data = self.data[:n], self.data[n:]
+        return chunk
+
+# ==========================================
+# VIRTUAL DEVICE
+# ==========================================
+class VirtualDevice:
+    """A board without the hardware, behind the part of the serial.Serial
+    API CCDReceiver uses. It sends frames in the wire format (header, CRC,
+    seq, device timestamps) at rate per second (0 = as fast as they are
+    read), and acks the binary commands: CMD_INFO and CMD_TIME as the
+    firmware does, every other one ok. ASCII commands are ignored. A
+    BENCH_REPLAY run sends back the frames written to it, restamped, in
+    place of its own (no processing).
+
+    The frames are replayed from a recording (.ccdrec, .ccdarc or .npz,
+    looped), or synthetic: a few emission lines that drift, over the dark
+    level with noise. drop is the fraction of frames left out (the seq
+    still advances, so the host counts them lost), corrupt the fraction
+    sent with one byte flipped (CRC errors)."""
+
+    def __init__(self, source=None, rate=SIM_RATE, drop=0.0, corrupt=0.0,
+                 timeout=0.5):
+        self.rate, self.drop, self.corrupt = rate, drop, corrupt
+        self.timeout = timeout
+        self.frames = open_frames(source)[0] if source else self._synthetic()
+        self.seq = 0
+        self.sent = 0
+        self.start = time.perf_counter()
+        self.buf = bytearray()
+        self.cmd = bytearray()
+        self.prev_tx = 0  # CMD_TIME: when the last reply went
+        self.prev_seq = 0
+        self.replay = None  # BENCH_REPLAY count while one runs (0 = no end)
+        self.replayed = 0
+        self.rng = np.random.default_rng(0)
+        self.pty = None
+        self.is_open = True
+
+    @staticmethod
+    def _synthetic():
+        rng = np.random.default_rng(1)
+        x = np.arange(CCD_PIXELS)
+        out = np.empty((SIM_FRAMES, CCD_PIXELS), dtype=np.uint16)
+        for i in range(SIM_FRAMES):
+            shift = 4 * np.sin(2 * np.pi * i / SIM_FRAMES)
+            line = sum(a * np.exp(-0.5 * ((x - c - shift) / w) ** 2)
+                       for c, w, a in ((900, 3, 30000), (1800, 5, 20000),
+                                       (2600, 2, 40000)))
+            out[i] = np.clip(60000 - line + rng.normal(0, 40, CCD_PIXELS),
+                             0, 65535)
+        return out
+
+    def _ticks(self):
+        return int((time.perf_counter() - self.start) * SIM_CLOCK_HZ)
+
+    def _frame(self):
+        if self.replay is not None: return b''
+        seq = self.seq
+        self.seq += 1
+        if self.rng.random() < self.drop: return b''
+        pixels = np.asarray(self.frames[seq % len(self.frames)],
+                            dtype='<u2').tobytes()
+        info = FRAME_INFO.pack(FRAME_VERSION, FRAME_HEADER_SIZE, 0, seq,
+                               self._ticks(), 2500, TEMP_NONE, 1000, 1,
+                               len(pixels), 0)
+        frame = bytearray(struct.pack('<HH', MAGIC, seq & 0xFFFF) + info +
+                          pixels)
+        struct.pack_into('<I', frame, FRAME_CRC_OFFSET, zlib.crc32(frame))
+        if self.rng.random() < self.corrupt:
+            frame[self.rng.integers(FRAME_HEADER_SIZE, len(frame))] ^= 0x10
+        return bytes(frame)
+
+    def _due(self):
+        """Frames the rate has made due since the start"""
+        return int((time.perf_counter() - self.start) * self.rate)
+
+    @property
+    def in_waiting(self):
+        if self.rate:
+            while self.sent < self._due():
+                self.buf += self._frame()
+                self.sent += 1
+        return len(self.buf)
+
+    def read(self, n):
+        """Up to n bytes of what has been sent; waits for the next frame
+        due, up to timeout"""
+        end = time.perf_counter() + self.timeout
+        while not self.in_waiting:
+            if not self.rate:
+                self.buf += self._frame()
+                continue
+            now = time.perf_counter()
+            if now >= end: break
+            due = self.start + (self.sent + 1) / self.rate
+            time.sleep(min(max(due - now, 0.0), end - now))
+        data = bytes(self.buf[:n])
+        del self.buf[:n]
+        return data
+
+    def _replayed(self, frame):
+        """A replayed frame back as a capture, as CCD_BENCH_REPLAY sends it"""
+        frame = bytearray(frame)
+        struct.pack_into('<H', frame, 0, MAGIC)
+        struct.pack_into('<Q', frame, 12, self._ticks())
+        struct.pack_into('<I', frame, FRAME_CRC_OFFSET, 0)
+        struct.pack_into('<I', frame, FRAME_CRC_OFFSET, zlib.crc32(frame))
+        self.buf += frame
+        self.replayed += 1
+        if self.replayed == self.replay: self.replay = None
+
+    def _ack(self, seq, ctype, status=0, payload=b''):
+        self.buf += struct.pack('<HBBBB', CMD_ACK, seq, ctype, status,
+                                len(payload)) + payload
+
+    def write(self, data):
+        """Binary command frames (CMD_SYNC, seq, type, length, value,
+        check) are acked in order; bytes outside one are skipped"""
+        self.cmd += data
+        while True:
+            if self.replay is not None and \
+                    self.cmd[:2] == struct.pack('<H', REPLAY_MAGIC):
+                if len(self.cmd) < FRAME_SIZE: break
+                self._replayed(self.cmd[:FRAME_SIZE])
+                del self.cmd[:FRAME_SIZE]
+                continue
+            i = self.cmd.find(CMD_SYNC)
+            if i < 0 or len(self.cmd) < i + 4:
+                if i < 0: self.cmd.clear()
+                break
+            seq, ctype, n = self.cmd[i + 1:i + 4]
+            if len(self.cmd) < i + 5 + n: break
+            body = bytes(self.cmd[i + 1:i + 4 + n])
+            check = self.cmd[i + 4 + n]
+            del self.cmd[:i + 5 + n]
+            if (sum(body) + check) & 0xFF != 0xFF:
+                self._ack(seq, ctype, CMD_STATUS.index("bad check"))
+            elif ctype == CMD_INFO:
+                self._ack(seq, ctype, 0, CMD_INFO_REPLY.pack(
+                    CMD_PROTOCOL, CCD_PIXELS, 1 << CMD_INFO | 1 << CMD_TIME,
+                    0, SIM_CLOCK_HZ, 32, TX_FRAME, 0) + CMD_CAPS.pack(
+                    1, 0, FRAME_SIZE, 1, 0, 1, 0, 0))
+            elif ctype == CMD_TIME:
+                now = self._ticks()
+                self._ack(seq, ctype, 0, CMD_TIME_REPLY.pack(
+                    now, now, self.prev_tx, self.prev_seq, SIM_CLOCK_HZ))
+                self.prev_tx, self.prev_seq = now, seq
+            elif ctype == CMD_BENCH and n == 9:
+                pattern, _, count = struct.unpack('<BII', body[3:])
+                if pattern == BENCH_REPLAY: self.replayed = 0
+                self.replay = count if pattern == BENCH_REPLAY else None
+                self._ack(seq, ctype, 0, struct.pack('<II', self.replayed, 0))
+            else:
+                self._ack(seq, ctype)
+        return len(data)
+
+    def close(self):
+        self.is_open = False
+        if self.pty is not None:
+            os.close(self.pty)
+            self.pty = None
+
+    def serve_pty(self):
+        """Serve the stream on a pseudo-terminal instead (POSIX), for a
+        receiver in another process to open like a real port. Returns its
+        path; the frames run on a thread until close()."""
+        import pty, tty
+        master, self.pty = pty.openpty()
+        tty.setraw(self.pty)
+        def pump():
+            while self.is_open:
+                ready = select.select([master], [], [], 0.01)[0]
+                if ready:
+                    try:
+                        self.write(os.read(master, 4096))
+                    except OSError:
+                        return
+                if self.in_waiting:
+                    data = bytes(self.buf)
+                    self.buf.clear()
+                    os.write(master, data)
+                elif not self.rate:
+                    self.buf += self._frame()
+            os.close(master)
+        threading.Thread(target=pump, daemon=True).start()
+        return os.ttyname(self.pty)
+
 
 # ==========================================
 # LOGIC CLASSES
@@ -35,6 +3046,7 @@ class SettingsManager:
             "enable_savgol": True,
             "savgol_window": 11,
             "frame_average": 1, # 1 = Off
+            "frame_average_mode": AVG_BLOCK,
             "peak_threshold": 15000,
             "peak_min_dist": 100,
             "last_project": "Default",
@@ -101,220 +3113,5059 @@ class Calibration:
         self.p2_nm = 1000.0
         self.slope = 0.0
         self.intercept = 0.0
+        self.coeffs = None  # Of a fit(), highest power first; None = linear
+        self.version = 0    # Counts the changes, see axis()
+        self._axis = None
         
+    def _changed(self):
+        self.version += 1
+        self._axis = None
+
     def update(self, p1_px, p1_nm, p2_px, p2_nm):
         self.p1_px, self.p1_nm = p1_px, p1_nm
         self.p2_px, self.p2_nm = p2_px, p2_nm
+        self.coeffs = None
         if (p2_px - p1_px) != 0:
             self.slope = (p2_nm - p1_nm) / (p2_px - p1_px)
             self.intercept = p1_nm - self.slope * p1_px
             self.enabled = True
         else:
             self.enabled = False
+        self._changed()
+
+    def fit(self, pixels, nms, order=2):
+        """Polynomial calibration: least squares through reference lines
+        at pixels with known wavelengths nms, at least order + 1 of them"""
+        if len(pixels) <= order: return False
+        self.coeffs = np.polyfit(pixels, nms, order)
+        self.enabled = True
+        self._changed()
+        return True
             
     def pixel_to_nm(self, px):
         if not self.enabled: return px
+        if self.coeffs is not None: return np.polyval(self.coeffs, px)
         return self.slope * px + self.intercept
 
-    def get_axis_label(self):
-        return "Wavelength (nm)" if self.enabled else "Pixel Index"
+    def polynomial(self):
+        """Coefficients in pixel, highest power first (np.polyval)"""
+        if self.coeffs is not None: return [float(c) for c in self.coeffs]
+        return [self.slope, self.intercept]
+
+    def axis(self):
+        """x of every pixel, nm or the pixel index, worked out once per
+        change of the calibration"""
+        if self._axis is None:
+            self._axis = self.pixel_to_nm(np.arange(CCD_PIXELS, dtype=np.float64))
+        return self._axis
+
+    def use_grid(self, start_nm, step_nm):
+        """Frames resampled by the device (device_wavelength) are linear in
+        nm by construction"""
+        self.slope, self.intercept = step_nm, start_nm
+        self.p1_px, self.p1_nm = 0, start_nm
+        self.p2_px, self.p2_nm = 3694, start_nm + step_nm * 3694
+        self.coeffs = None
+        self.enabled = True
+        self._changed()
+
+    def get_axis_label(self):
+        return "Wavelength (nm)" if self.enabled else "Pixel Index"
+
+class Decimator:
+    """A line cut down to a plot width pixels wide for drawing: each
+    column gets the lowest and the highest sample it covers, both at the
+    column's first x, so a one-pixel peak or dip still shows however
+    many samples share it. The points go into float64 arrays kept from
+    call to call, which DearPyGui reads through the buffer protocol, so
+    an update builds no Python object per point."""
+    def __init__(self):
+        self.px = self.py = np.zeros(0)
+
+    def __call__(self, x, y, width):
+        n = len(y)
+        width = max(int(width), 1)
+        count = n if n <= 2 * width else 2 * width
+        if len(self.px) != count:
+            self.px, self.py = np.empty(count), np.empty(count)
+        if count == n:
+            self.px[:], self.py[:] = x, y
+        else:
+            starts = np.arange(width) * n // width
+            self.px[0::2] = self.px[1::2] = x[starts]
+            self.py[0::2] = np.minimum.reduceat(y, starts)
+            self.py[1::2] = np.maximum.reduceat(y, starts)
+        return [self.px, self.py]
+
+class Waterfall:
+    """Frames as rows of a DearPyGui raw texture, which draws straight
+    from the numpy array, so a new frame rewrites one row in place and
+    nothing else. Rows form a ring; the view shows it oldest first as two
+    draws of the texture split at the next row to write (uv_split()).
+    Each of the WATERFALL_WIDTH columns of a row is the highest of the
+    pixels it covers, mapped to colour through a 256-entry LUT."""
+    def __init__(self):
+        self.texture = np.zeros((WATERFALL_ROWS, WATERFALL_WIDTH, 4),
+                                dtype=np.float32)
+        self.texture[..., 3] = 1.0
+        self.row = 0
+        self.seen = 0  # Frames taken from the ring, see AcqClient.frames()
+        points = np.array(WATERFALL_COLOURS, dtype=np.float32) / 255.0
+        at = np.linspace(0, 255, len(points))
+        self.lut = np.ones((256, 4), dtype=np.float32)
+        for c in range(3):
+            self.lut[:, c] = np.interp(np.arange(256), at, points[:, c])
+        self.width = 0  # Pixels per frame, for starts
+        self.starts = None
+
+    def add(self, pixels, y_max):
+        """pixels as the newest row, y_max and over at the top colour"""
+        if len(pixels) != self.width:
+            self.width = len(pixels)
+            self.starts = np.arange(WATERFALL_WIDTH) * self.width // WATERFALL_WIDTH
+        top = np.maximum.reduceat(pixels, self.starts).astype(np.uint32)
+        np.minimum(top * 255 // max(int(y_max), 1), 255, out=top)
+        self.texture[self.row] = self.lut[top]
+        self.row = (self.row + 1) % WATERFALL_ROWS
+
+    def uv_split(self):
+        """Fraction of the texture height where the oldest row starts"""
+        return self.row / WATERFALL_ROWS
+
+class LinkHealth:
+    """The link as the receiver sees it, summed up every second: frames
+    lost (sequence gaps), CRC failures, resyncs (searches for a magic that
+    had to skip bytes) and the bytes skipped, the frames the device's own
+    report says it dropped, and arrival jitter. Jitter is how far each
+    arrival interval strays from the capture interval in the device
+    timestamps (from the mean interval until the clock is known), so a
+    change of exposure is not jitter; its mean is smoothed over about
+    1 / LINK_EMA frames, its worst is per second. A second with frames
+    lost is a link over its capacity, or close to it."""
+    def __init__(self):
+        self.interval = 0.0  # Mean arrival interval, s
+        self.jitter = 0.0
+        self.jitter_max = 0.0
+        self.last = None     # (arrival, device time) of the last frame
+        self.totals = (0, 0, 0, 0)
+        self.seconds = 0
+        self.second = dict.fromkeys(LINK_FIELDS, 0)
+
+    def frame(self, arrival, device_s):
+        if self.last is not None:
+            gap = arrival - self.last[0]
+            expected = (device_s - self.last[1]) if device_s and self.last[1] \
+                else self.interval
+            d = abs(gap - expected)
+            self.interval += (gap - self.interval) * LINK_EMA
+            self.jitter += (d - self.jitter) * LINK_EMA
+            self.jitter_max = max(self.jitter_max, d)
+        self.last = (arrival, device_s)
+
+    def tick(self, rx):
+        """Close a second of rx (a CCDReceiver); returns it as a dict of
+        LINK_FIELDS plus over_capacity"""
+        totals = (rx.frames_lost, rx.crc_errors, rx.resyncs, rx.skipped_bytes)
+        lost, crc, resyncs, skipped = (a - b for a, b in zip(totals, self.totals))
+        self.totals = totals
+        device = rx.faults['new'].get('dropped', 0) if rx.faults else 0
+        self.second = {
+            'fps': rx.fps, 'lost': lost, 'crc_errors': crc, 'resyncs': resyncs,
+            'skipped_bytes': skipped, 'device_dropped': device,
+            'interval_ms': self.interval * 1e3, 'jitter_ms': self.jitter * 1e3,
+            'jitter_max_ms': self.jitter_max * 1e3,
+            'over_capacity': bool(lost or device)}
+        self.jitter_max = 0.0
+        self.seconds += 1
+        return self.second
+
+class ReadoutPlanner:
+    """The readout for a frame rate, chosen rather than set by hand:
+    start() measures what the link carries out of the device (its source
+    test, as bench_usb() runs it; link_mbps when given, nothing on the
+    simulator) and applies the cheapest configuration the capabilities
+    (device_info) allow whose frames fit PLAN_HEADROOM of it at fps.
+    Cheapest means the least given up, in this order: a lossless codec
+    (Rice, then temporal Rice), then the frame cut to the roi windows
+    (when given), then packing to 14 and 12 bits, then binning, so long
+    as pixels outputs remain across the sensor, and bits per pixel.
+    With capture_fps, the rate the device captures at, higher than fps,
+    the frames are co-added on the device down to about fps first, which
+    costs nothing asked for. When nothing fits, the smallest frames go.
+
+    tick(), every so often from the read loop, keeps it there: the coded
+    size of each frame is measured against the ratio assumed, and after
+    PLAN_DROP_SECONDS link seconds in a row with frames lost (LinkHealth)
+    the link is taken to be what got through and the readout planned
+    again. plan is the configuration in force, log each one with when and
+    why."""
+    def __init__(self, rx, fps, pixels=CCD_PIXELS, bits=16, roi=None,
+                 capture_fps=None, link_mbps=None):
+        self.rx = rx
+        self.fps = fps
+        self.pixels = pixels
+        self.bits = bits
+        self.roi = list(roi) if roi else None
+        self.capture_fps = capture_fps
+        self.link_mbps = link_mbps
+        self.ratio = dict(PLAN_RATIO)
+        self.plan = None
+        self.log = []
+        self.over = 0
+        self.seen = 0
+        self.mark = (0, 0)
+
+    def measure(self):
+        """MB/s out of the device on the port frames arrive on, or None"""
+        if self.rx.port.startswith(SIM_PORT): return None
+        try:
+            return _bench_usb_port(self.rx, self.rx, 'fs', 1, PLAN_TEST_MB,
+                                   5.0)['source']['mbps'] or None
+        except OSError:
+            return None
+
+    def frame_bytes(self, binning, bits, codec, roi):
+        if binning == 1 and bits == 16 and codec == "none" and not roi:
+            return FRAME_SIZE
+        n = sum(w for _, w in roi) if roi else CCD_PIXELS
+        data = ((n // binning) * bits + 7) // 8
+        return SHAPED_HEADER_SIZE + data / self.ratio.get(codec, 1.0)
+
+    def choose(self):
+        """The plan for the link as known; None without capabilities"""
+        caps = self.rx.device_info
+        if not caps or 'formats' not in caps: return None
+        formats = caps['formats']
+        codecs = [c for c in PLAN_CODECS if c == "none" or c in formats]
+        bits = [b for b in PLAN_BITS if b >= self.bits
+                and (b == 16 or "packed" in formats)]
+        shaped = "shaped" in formats
+        binning = [b for b in PLAN_BINNING if b == 1 or
+                   (shaped and CCD_PIXELS // b >= self.pixels)]
+        rois = [None] + ([self.roi] if self.roi and shaped else [])
+        coadd = 1
+        if self.capture_fps and self.fps:
+            coadd = max(int(self.capture_fps // self.fps), 1)
+        rate = (self.capture_fps / coadd) if self.capture_fps else self.fps
+        if caps.get('frame_us'):
+            rate = min(rate, 1e6 / caps['frame_us'] / coadd)
+        budget = (self.link_mbps * 1e6 * PLAN_HEADROOM if self.link_mbps
+                  else float('inf'))
+        plans = []
+        for b in binning:
+            for depth in bits:
+                for roi in rois:
+                    for codec in codecs:
+                        size = self.frame_bytes(b, depth, codec, roi)
+                        plans.append({
+                            'binning': b, 'bits': depth, 'codec': codec,
+                            'roi': roi, 'coadd': coadd, 'frame_bytes': size,
+                            'fps': rate, 'mbps': size * rate / 1e6,
+                            'link_mbps': self.link_mbps,
+                            'meets': size * rate <= budget and
+                            rate >= self.fps * 0.99})
+        for p in plans:
+            if p['meets']: return p
+        return min(plans, key=lambda p: p['frame_bytes'])
+
+    def apply(self, plan, reason):
+        rx = self.rx
+        rx.set_binning(plan['binning'])
+        rx.set_packing(plan['bits'])
+        rx.set_compression(PLAN_CODECS.index(plan['codec']))
+        rx.set_roi(plan['roi'] or [])
+        rx.configure(coadd=plan['coadd'])
+        self.plan = plan
+        self.log.append((time.time(), reason, plan))
+        self.mark = (rx.rx_bytes, rx.frames_received)
+        self.seen = rx.health.seconds
+        self.over = 0
+
+    def start(self):
+        """Measure, plan and apply; returns the plan (None when the
+        firmware predates the capabilities, and nothing is changed)"""
+        rx = self.rx
+        rx._pump(lambda: rx.device_info is not None, 1.0)
+        if self.link_mbps is None: self.link_mbps = self.measure()
+        plan = self.choose()
+        if plan: self.apply(plan, "start")
+        return plan
+
+    def tick(self):
+        """After each link second: the codec's ratio, and a new plan,
+        returned, once frames have been lost for a while"""
+        rx, plan = self.rx, self.plan
+        if plan is None or rx.health.seconds == self.seen: return None
+        self.seen = rx.health.seconds
+        got, frames = (rx.rx_bytes - self.mark[0],
+                       rx.frames_received - self.mark[1])
+        self.mark = (rx.rx_bytes, rx.frames_received)
+        if not rx.health.second['over_capacity']:
+            self.over = 0
+            coded = got / frames - SHAPED_HEADER_SIZE if frames else 0
+            if plan['codec'] != "none" and coded > 0:
+                plain = self.frame_bytes(plan['binning'], plan['bits'], "none",
+                                         plan['roi']) - SHAPED_HEADER_SIZE
+                self.ratio[plan['codec']] = max(plain / coded, 1.0)
+            return None
+        self.over += 1
+        if self.over < PLAN_DROP_SECONDS: return None
+        self.over = 0
+        self.link_mbps = min(self.link_mbps or float('inf'), got / 1e6)
+        new = self.choose()
+        keys = ('binning', 'bits', 'codec', 'roi', 'coadd')
+        if not new or all(new[k] == plan[k] for k in keys): return None
+        self.apply(new, "frames lost")
+        return new
+
+class FramePool:
+    """Receive buffers for raw frames, reused in turn, so a frame costs
+    no allocation: take() hands out the next buffer (a frame from its
+    frame_num on, as it follows the magic) and the pixels view of it,
+    made once. A frame is overwritten FRAME_POOL_SLOTS frames later, so a
+    consumer that keeps one longer copies it, as with FrameAverager's
+    output. The receiver's own consumers (peaks, averaging, recording,
+    the FrameRing publish) are done with it before the next one is read."""
+    def __init__(self, slots=FRAME_POOL_SLOTS):
+        self.bufs = [bytearray(FRAME_SIZE - 2) for _ in range(slots)]
+        self.pixels = [np.frombuffer(b, dtype=np.uint16,
+                                     offset=FRAME_HEADER_SIZE - 2)
+                       for b in self.bufs]
+        self.next = 0
+
+    def take(self):
+        i = self.next
+        self.next = (i + 1) % len(self.bufs)
+        return self.bufs[i], self.pixels[i]
+
+class FrameAverager:
+    """Host-side averaging of count frames, in int32 arrays that live as
+    long as the mode and count do, so a frame costs a few in-place numpy
+    operations and no allocation or float conversion:
+     - AVG_BLOCK: the mean of each count frames, one output per count.
+     - AVG_ROLLING: the mean of the last count frames (at most
+       AVG_ROLLING_MAX), every frame.
+     - AVG_EXP: exponential mean of time constant count frames, rounded
+       down to a power of two (at most 2^14); the sum carries that many
+       fractional bits.
+    add() returns the output line or None; the line is overwritten by the
+    next output, so a consumer that keeps it copies it."""
+    def __init__(self):
+        self.key = None
+
+    def _setup(self, mode, count, n):
+        self.key = (mode, count, n)
+        self.sum = np.zeros(n, dtype=np.int32)
+        self.tmp = np.empty(n, dtype=np.int32)
+        self.out = np.empty(n, dtype=np.uint16)
+        self.frames = 0
+        if mode == AVG_ROLLING:
+            self.count = min(count, AVG_ROLLING_MAX)
+            self.ring = np.zeros((self.count, n), dtype=np.uint16)
+        elif mode == AVG_EXP:
+            # 16-bit pixels << 14, plus one more, still fit the int32
+            self.shift = min(max(int(count).bit_length() - 1, 1), 14)
+        else:
+            self.count = count
+
+    def add(self, pixels, mode, count):
+        if self.key != (mode, count, len(pixels)):
+            self._setup(mode, count, len(pixels))
+        self.frames += 1
+        if mode == AVG_EXP:
+            if self.frames == 1:
+                # In the int32 sum: a uint16 shift would wrap first
+                self.sum[:] = pixels
+                self.sum <<= self.shift
+            np.right_shift(self.sum, self.shift, out=self.tmp)
+            self.sum += pixels
+            self.sum -= self.tmp
+            np.right_shift(self.sum, self.shift, out=self.tmp)
+        elif mode == AVG_ROLLING:
+            slot = self.ring[self.frames % self.count]
+            self.sum -= slot
+            self.sum += pixels
+            slot[:] = pixels
+            np.floor_divide(self.sum, min(self.frames, self.count), out=self.tmp)
+        else:
+            self.sum += pixels
+            if self.frames < self.count: return None
+            np.floor_divide(self.sum, self.count, out=self.tmp)
+            self.sum[:] = 0
+            self.frames = 0
+        self.out[:] = self.tmp
+        return self.out
+
+class PeakDetector:
+    def __init__(self):
+        self.threshold = 15000  # Higher default threshold
+        self.min_distance = 100 # Higher default distance
+        self.smooth_window = 11 # Savitzky-Golay window
+        self.poly_order = 3     # Savitzky-Golay order
+        self.use_smoothing = True
+        self.tracked = np.zeros(0)  # Positions track() follows
+        self.since_search = 0
+        
+    def _window(self):
+        """Savitzky-Golay window in use, 0 = no smoothing"""
+        if not self.use_smoothing: return 0
+        return max(self.smooth_window | 1, self.poly_order + 2 | 1, 3)
+
+    def smooth(self, data, axis=-1):
+        data = np.asarray(data, dtype=np.float64)
+        window = self._window()
+        if window and data.shape[axis] > window:
+            try:
+                return savgol_filter(data, window, self.poly_order, axis=axis)
+            except ValueError:
+                pass
+        return data
+
+    def find_peaks(self, data):
+        """Peaks of the smoothed line above threshold: sub-pixel positions
+        and the raw heights. Of two peaks closer than min_distance the
+        lower goes, in one pass of scipy's non-maximum suppression."""
+        if len(data) < 3: return np.zeros(0), np.zeros(0)
+        y = self.smooth(data)
+        idx, _ = scipy_find_peaks(y, height=self.threshold,
+                                  distance=max(1, int(self.min_distance)))
+        return self._refine(y, idx), np.asarray(data)[idx]
+
+    @staticmethod
+    def _refine(y, idx, axis_rows=None):
+        """idx moved to the vertex of the parabola through each peak sample
+        and its two neighbours (rows of y, one per peak, with axis_rows)"""
+        if axis_rows is None:
+            l, c, r = y[idx - 1], y[idx], y[idx + 1]
+        else:
+            l, c, r = (y[axis_rows, idx - 1], y[axis_rows, idx],
+                       y[axis_rows, idx + 1])
+        den = l - 2 * c + r
+        safe = np.where(den != 0, den, 1.0)
+        return idx + np.where(den != 0, 0.5 * (l - r) / safe, 0.0)
+
+    def track(self, data):
+        """Sub-pixel positions of up to PEAK_TRACK_MAX peaks, followed from
+        frame to frame: each is searched for only within PEAK_TRACK_RADIUS
+        of where it was, smoothing just that stretch. A full find_peaks()
+        runs at first, every PEAK_RESEARCH frames and as soon as a peak is
+        lost (under the threshold, out of its window, or merged)."""
+        self.since_search += 1
+        if len(self.tracked) and self.since_search < PEAK_RESEARCH:
+            pos = self._follow(data)
+            if pos is not None:
+                self.tracked = pos
+                return pos
+        pos, heights = self.find_peaks(data)
+        if len(pos) > PEAK_TRACK_MAX:
+            pos = np.sort(pos[np.argsort(heights)[-PEAK_TRACK_MAX:]])
+        self.tracked = pos
+        self.since_search = 0
+        return pos
+
+    def _follow(self, data):
+        r = PEAK_TRACK_RADIUS
+        h = self._window() // 2
+        reach = r + h + 1
+        centre = np.rint(self.tracked).astype(int)
+        cols = np.clip(centre[:, None] + np.arange(-reach, reach + 1),
+                       0, len(data) - 1)
+        seg = self.smooth(np.asarray(data)[cols], axis=1)
+        if h: seg = seg[:, h:-h]  # Offsets -(r + 1)..r + 1 are left
+        rows = np.arange(len(seg))
+        top = np.argmax(seg[:, 1:-1], axis=1) + 1
+        if np.any(top == 1) or np.any(top == len(seg[0]) - 2) or \
+                np.any(seg[rows, top] <= self.threshold):
+            return None
+        pos = centre - (r + 1) + self._refine(seg, top, rows)
+        if len(pos) > 1 and np.any(np.diff(pos) < self.min_distance):
+            return None
+        return pos
+
+
+def _pipeline_kernel(raw, offset, sign, gain, coeffs, threshold, distance,
+                     line, smooth, cand, keep):
+    """HostPipeline in one compiled pass per stage, into the buffers it
+    is given: line = (offset + sign * raw) * gain, smooth = line through
+    coeffs (edges held), then the local maxima of smooth above threshold
+    with those within distance of a higher one dropped, highest first, as
+    scipy's find_peaks does. Their indices go to the front of cand, in
+    position order; returns how many."""
+    n = raw.shape[0]
+    for i in range(n):
+        line[i] = (offset[i] + sign * raw[i]) * gain[i]
+    h = coeffs.shape[0] // 2
+    for i in range(n):
+        acc = 0.0
+        for k in range(-h, h + 1):
+            j = min(max(i + k, 0), n - 1)
+            acc += coeffs[k + h] * line[j]
+        smooth[i] = acc
+    m = 0
+    i = 1
+    while i < n - 1:
+        if smooth[i] > threshold and smooth[i] > smooth[i - 1]:
+            j = i + 1  # Past a plateau, whose middle counts
+            while j < n - 1 and smooth[j] == smooth[i]:
+                j += 1
+            if smooth[j] < smooth[i]:
+                cand[m] = (i + j - 1) // 2
+                m += 1
+            i = j
+        else:
+            i += 1
+    for c in range(m):
+        keep[c] = True
+    order = np.argsort(smooth[cand[:m]])
+    for o in range(m - 1, -1, -1):
+        c = order[o]
+        if not keep[c]:
+            continue
+        k = c - 1
+        while k >= 0 and cand[c] - cand[k] < distance:
+            keep[k] = False
+            k -= 1
+        k = c + 1
+        while k < m and cand[k] - cand[c] < distance:
+            keep[k] = False
+            k += 1
+    kept = 0
+    for c in range(m):
+        if keep[c]:
+            cand[kept] = cand[c]
+            kept += 1
+    return kept
+
+if numba is not None:
+    _pipeline_kernel = numba.njit(cache=True, nogil=True)(_pipeline_kernel)
+
+
+class HostPipeline:
+    """The host's per-frame processing fused into one pass over the frame:
+    the signal (65535 - raw, or raw, as invert says) less the dark,
+    times the flat-field gain, smoothed as PeakDetector smooths, and its
+    peaks (threshold and min_distance as there), with their sub-pixel
+    positions, heights and, with calibration coefficients, wavelengths.
+    Everything is set up once: the offset and gain lines, the smoothing
+    coefficients and every buffer, so a frame allocates next to nothing.
+
+    With numba installed every stage runs in _pipeline_kernel() compiled
+    (the first frame pays the compile, cached on disk from then on);
+    without, the same stages run as numpy and scipy calls writing into
+    the same buffers. Either way it is cheap enough for the receiver to
+    run on every frame it gets (CCDReceiver.set_pipeline()), not only
+    the ones the GUI draws. process() returns views of the buffers,
+    overwritten by the next call."""
+    def __init__(self, detector=None, dark=None, flat=None, invert=True,
+                 calibration=None):
+        d = detector or PeakDetector()
+        n = CCD_PIXELS
+        # As reprocess(): the dark, or 65535 without one, minus the raw
+        # counts; raw less the dark without invert
+        self.sign = -1.0 if invert else 1.0
+        if dark is None:
+            self.offset = np.full(n, 65535.0 if invert else 0.0)
+        else:
+            dark = np.asarray(dark, dtype=np.float64)
+            self.offset = dark.copy() if invert else -dark
+        self.gain = np.ones(n)
+        if flat is not None:
+            response = self.offset + self.sign * np.asarray(flat, np.float64)
+            self.gain = np.where(response > 0, response.mean() /
+                                 np.maximum(response, 1e-9), 1.0)
+        window = d._window()
+        self.coeffs = savgol_coeffs(window, d.poly_order, use='dot') \
+            if window else np.ones(1)
+        self.threshold = float(d.threshold)
+        self.distance = max(1, int(d.min_distance))
+        self.calibration = calibration  # polyval coefficients, or None
+        self.line, self.smooth = np.empty(n), np.empty(n)
+        self.cand = np.empty(n, dtype=np.int64)
+        self.keep = np.empty(n, dtype=np.bool_)
+        self.compiled = numba is not None
+
+    def process(self, raw):
+        """(line, positions, heights, wavelengths or None) of a raw frame"""
+        if self.compiled:
+            m = _pipeline_kernel(raw, self.offset, self.sign, self.gain,
+                                 self.coeffs, self.threshold, self.distance,
+                                 self.line, self.smooth, self.cand, self.keep)
+            idx = self.cand[:m]
+        else:
+            np.multiply(raw, self.sign, out=self.line)
+            self.line += self.offset
+            self.line *= self.gain
+            correlate1d(self.line, self.coeffs, output=self.smooth,
+                        mode='nearest')
+            idx, _ = scipy_find_peaks(self.smooth, height=self.threshold,
+                                      distance=self.distance)
+        pos = PeakDetector._refine(self.smooth, idx)
+        nm = None if self.calibration is None else \
+            np.polyval(self.calibration, pos)
+        return self.line, pos, self.line[idx], nm
+
+
+def _restored(method):
+    """A CCDReceiver setting that _reconnect() sends again: the arguments
+    of its latest call (configure()'s merged with the calls before),
+    kept in the order the settings were last made"""
+    sig = inspect.signature(method)
+    @functools.wraps(method)
+    def setting(self, *args, **kwargs):
+        if not self.restoring:
+            name = method.__name__
+            call = sig.bind(self, *args, **kwargs).arguments
+            call.pop('self')
+            if name == 'configure':
+                call = {**self.restore.get(name, {}),
+                        **{k: v for k, v in call.items() if v is not None}}
+            self.restore.pop(name, None)
+            self.restore[name] = dict(call)
+        return method(self, *args, **kwargs)
+    return setting
+
+
+class CCDReceiver:
+    def __init__(self):
+        # Newest frame; a raw one is a FramePool buffer, copy it to keep it
+        self.pixels = np.zeros(CCD_PIXELS, dtype=np.uint16)
+        self.frame_count = 0
+        self.fps = 0
+        self.running = True
+        self.connected = False
+        self.serial = None
+        self.lock = threading.Lock()
+        self.last_fps_time = time.time()
+        self.fps_frame_count = 0
+        self.frozen = False 
+        self.frame_ready = False
+        self.single_shot_pending = False
+        self.recording = False
+        self.recording_conditional = False
+        self.recorder = None    # FrameRecorder, see start_recording()
+        self.events = None      # EventRecorder, see start_event_recording()
+        self.peak_tracker = None  # PeakDetector, see set_peak_tracking()
+        self.pipeline = None      # HostPipeline, see set_pipeline()
+        self.tracked_peaks = np.zeros(0)  # Its positions in the last frame
+        self.pending_single_shot = False # New flag for "One Shot" logic
+        
+        # Frame Averaging
+        self.frame_avg_count = 1
+        self.frame_avg_mode = AVG_BLOCK
+        self.averager = FrameAverager()
+        self.bin_factor = 1
+        self.roi_windows = []
+        self.codec_ref = None   # (frame_num, values) for temporal frames
+        # Rice output, one buffer decoded into while the other is codec_ref
+        self.decode_bufs = [np.empty(CCD_PIXELS, dtype=np.int32) for _ in range(2)]
+        self.decode_flip = 0
+        self.frame_info = None  # CCD_FrameInfo_t of the last live frame
+        self.last_seq = None
+        self.frames_lost = 0    # Sequence gaps since connecting
+        self.crc_errors = 0     # Frames rejected by their CRC
+        self.resyncs = 0        # Magic searches that skipped bytes
+        self.skipped_bytes = 0
+        self.frames_received = 0  # Live frames since start
+        self.rx_bytes = 0       # Read from the ports since start
+        self.health = LinkHealth()
+        self.rx = bytearray()   # Received, not yet parsed
+        self.rx_chunk = memoryview(bytearray(RX_CHUNK))  # Port reads land here
+        self.pool = FramePool()  # Raw frames, see _read_raw()
+        self.ctl_port = None    # Control message being parsed, see _poll_control()
+        self.link2 = None       # HS port or UdpPort, see open_dual()/open_eth()
+        self.link2_close = False
+        self.rx2 = bytearray()  # Buffer of the port not being parsed
+        self.on_link2 = False
+        # Device clock -> host clock (perf_counter), see sync_time()
+        self.wall_offset = time.time() - time.perf_counter()
+        self.time_pings = {}    # seq -> host send time
+        self.time_samples = []
+        self.time_fit = None    # (a, b): host = a + b * device seconds
+        self.clock_drift_ppm = 0.0
+        self.sync_error_us = None
+        self.last_time_ping = 0.0
+        self.burst_frames = []
+        self.burst_status = None
+        self.phase_report = None
+        self.ae_status = None
+        self.hdr_frame = None
+        self.seq_status = None
+        self.snap_report = None
+        self.frame_stats = None
+        self.device_peaks = None
+        self.device_bands = None  # See set_device_bands()
+        self.device_focus = None  # See set_focus_lines()
+        self.focus_track = []   # (seq, [fwhm px or None per line]) per frame
+        self.focus_status = None  # See request_focus()
+        self.autoroi_status = None  # See set_auto_roi()
+        self.bands_status = None
+        self.despike_status = None  # See set_despike()
+        self.defect_status = None  # See detect_defects()
+        self.defect_map = bytearray(DEFECT_BYTES)  # As read by read_defects()
+        self.drift_status = None  # See set_drift()
+        self.device_drift = None  # Latest drift record
+        self.drift_track = []   # (seq, shift px, score) per record
+        self.match_status = None  # See set_matching()
+        self.device_match = None  # Latest classification record
+        self.match_track = []   # (seq, class or None, score) per record
+        self.match_references = {}  # index -> bin means, see read_match_reference()
+        self.model_status = None  # See set_model()
+        self.device_model = None  # Latest model record
+        self.model_track = []   # (seq, values) per record
+        self.model_loadings = {}  # output -> loadings, see read_model_loadings()
+        self.host_model = None  # LinearModel, see set_host_model()
+        self.tsdb = None        # TsdbSink, see set_tsdb()
+        self.model_values = None  # Its outputs for the last frame
+        self.wide_status = None  # See set_wide_output()
+        self.wide_frame = None  # Latest wide output
+        self.dual_frame = None  # Latest sensor pair (SOURCE_DUAL)
+        self.dual_a = None      # (seq, pixels) of the last sensor A frame
+        self.dual_b = {}        # seq -> sensor B pixels not yet paired
+        self.memory_status = None  # See request_memory()
+        self.saturation_status = None  # See set_saturation()
+        self.reference_status = None  # See set_reference()
+        self.txn_status = None  # See begin_config()
+        self.inputs_status = None  # See request_inputs()
+        self.loop_status = None  # See start_link_test()
+        self.mains_status = None  # See set_line_sync()
+        self.shutter_status = None  # See set_live_dark()
+        self.shutter_settle = 0  # Frames dropped per shutter move, not lost
+        self.live_dark = None   # Latest closed-shutter frame
+        self.selftest_status = None  # See request_selftest()
+        self.baseline_status = None  # See set_baseline()
+        self.loop_rx = []       # (seq, bytes, time) of each link test message
+        self.device_wavelength = None
+        self.absorbance_status = None
+        self.linearity_enabled = None
+        self.bench = None       # Results of the run start_bench() began
+        self.cmd_seq = 0
+        self.cmd_acks = {}  # seq -> (type, status, payload), last 256
+        self.device_stats = None
+        self.device_info = None
+        self.rec_status = None
+        self.proc_profile = None
+        self.probes = {}        # PROBE_NAMES entry -> cycle statistics
+        self.latency = None     # Frame latency and re-arm jitter, cycles
+        self.faults = None      # Loss and fault counters, see request_faults()
+        self.kernels = {}       # KERNEL_NAMES entry -> cycles per region
+        self.config_status = None  # Saved settings, see config()
+        self.adc_calibration = None  # See request_adc_calibration()
+        self.preview = None  # See set_preview()
+        self.exposure = None  # See expose()
+        self.line_scan = {'pixels': np.zeros((0, CCD_PIXELS), dtype=np.uint16),
+                          'seq': [], 'position': [], 'time_s': [], 'tiles': 0,
+                          'pitch': 0, 'missed': 0, 'dropped': 0}
+        self.line_status = None  # See request_line_status()
+        self.line_preview = {'strips': [], 'received': 0, 'lost': 0,
+                             'skipped': 0, 'failed': 0}
+        self.line_preview_status = None  # See set_line_preview()
+        self.ptc = {'levels': [], 'received': 0}  # See start_ptc()
+        self.ptc_status = None
+        self.dark_temperature = None  # See set_dark_temperature()
+        self.black_level = None  # See set_black_level()
+        self.keyframe_requested = False
+        self.flow_window = 0    # Frames granted ahead, 0 = flow control off
+        self.flow_received = 0  # Frames taken since set_flow()
+        self.flow_crc_base = 0  # crc_errors at set_flow()
+        self.flow_granted = 0   # Last credit limit sent
+        # Hot-plug: a board lost mid-run is looked for by its USB serial
+        # number and set up again, see _lost() and _reconnect()
+        self.auto_reconnect = True
+        self.port = None        # As given to connect()
+        self.usb_iso = False    # Vendor builds: frames on the isochronous
+                                # endpoint (CCD_USB_ISO), see UsbBulkPort
+        self.device_serial = None
+        self.restore = OrderedDict()  # Setting -> arguments, see _restored()
+        self.restoring = False
+        self.lost = None        # The gap while the board is away
+        self.reconnect_due = 0.0
+        self.reconnects = 0
+        self.gaps = []          # Gaps closed since start, oldest first
+
+    @staticmethod
+    def _port_serial(port):
+        """USB serial number of the board on port, None if it has none"""
+        if port.startswith(SIM_PORT): return None
+        if port.startswith(USB_BULK_PORT):
+            sn = port[len(USB_BULK_PORT) + 1:]
+            return sn or next(iter(UsbBulkPort.serial_numbers()), None)
+        return next((p.serial_number for p in serial.tools.list_ports.comports()
+                     if p.device == port), None)
+
+    def connect(self, port):
+        if self.serial: self.serial.close()
+        try:
+            if port.startswith(SIM_PORT):
+                self.serial = VirtualDevice(port[len(SIM_PORT) + 1:] or None)
+            elif port.startswith(USB_BULK_PORT):
+                self.serial = UsbBulkPort(
+                    timeout=0.5, serial_number=port[len(USB_BULK_PORT) + 1:] or None,
+                    iso=self.usb_iso)
+            else:
+                self.serial = serial.Serial(port, BAUD_RATE, timeout=0.5)
+            self.rx = bytearray()
+            self.time_samples = []
+            self.time_fit = None
+            self.connected = True
+            self.device_info = None
+            self.request_info()
+            self.port = port
+            self.device_serial = self._port_serial(port)
+            print(f"Connected to {port}")
+            return True
+        except Exception as e:
+            print(f"Connect failed: {e}")
+            self.connected = False
+            return False
+
+    def disconnect(self):
+        self.connected = False
+        self.lost = None
+        self._drop_link2()
+        if self.serial: self.serial.close()
+        self.serial = None
+
+    def _lost(self):
+        """The port failed under a running link (reset, re-enumeration,
+        cable): close it and look for the board again from the next
+        read_frame() on, rather than wait for the user"""
+        port, sn = self.port, self.device_serial
+        try:
+            self.disconnect()
+        except (serial.SerialException, OSError):
+            self.serial = None
+        if not self.auto_reconnect or port is None: return
+        self.lost = {'port': port, 'serial': sn, 'lost': time.time(),
+                     'last_seq': self.last_seq, 'frame': self.frame_count}
+        print(f"Lost {port}, reconnecting")
+
+    def _reconnect(self):
+        """One look for the lost board, every RECONNECT_POLL: by serial
+        number wherever it enumerated again, else on the same port. Once
+        open, every setting made (_restored()) goes out again, in order,
+        and the gap is kept in gaps and logged beside any recording."""
+        now = time.perf_counter()
+        if now < self.reconnect_due: return False
+        self.reconnect_due = now + RECONNECT_POLL
+        lost = self.lost
+        port = lost['port']
+        if lost['serial']:
+            port = next((d['port'] for d in discover_devices()
+                         if d['serial'] == lost['serial']), None)
+            if port is None: return False
+        elif not port.startswith((SIM_PORT, USB_BULK_PORT)) and \
+                not os.path.exists(port):
+            return False
+        if not self.connect(port): return False
+        self.lost = None
+        self.restoring = True
+        try:
+            for name, call in self.restore.items():
+                getattr(self, name)(**call)
+        finally:
+            self.restoring = False
+        self.last_seq = None  # The board's count starts again after a reset
+        gap = {**lost, 'port': port, 'restored': time.time()}
+        gap['seconds'] = gap['restored'] - gap['lost']
+        self.gaps.append(gap)
+        self.reconnects += 1
+        if self.recorder: self.recorder.log({'gap': gap})
+        print(f"Reconnected on {port} after {gap['seconds']:.3f} s")
+        return False
+
+    def open_dual(self, port):
+        """Stream over both USB ports (CMD_TRANSPORT TX_DUAL). port is the
+        HS port's tty; once it is open the device gives each frame to the
+        port with the shorter queue. read_frame() parses the two in turn and
+        frames arrive in either order; seq puts them back in sequence."""
+        if not self.connected or self.link2: return False
+        try:
+            self.link2 = serial.Serial(port, BAUD_RATE, timeout=DUAL_TIMEOUT)
+        except Exception as e:
+            print(f"Dual link failed: {e}")
+            return False
+        self.serial.timeout = DUAL_TIMEOUT
+        self.send_commands([(CMD_TRANSPORT, struct.pack('<B', TX_DUAL))])
+        return True
+
+    def open_eth(self, group=ETH_GROUP, iface="0.0.0.0"):
+        """Receive frames from the Ethernet multicast (CMD_TRANSPORT TX_ETH,
+        CCD_ETH=1 builds) next to the USB connection, which keeps the
+        commands, acks and reports. iface picks the local address to join
+        the group on. close_dual() ends it like the HS port."""
+        if not self.connected or self.link2: return False
+        try:
+            self.link2 = UdpPort(group, ETH_PORT, iface)
+        except OSError as e:
+            print(f"Ethernet link failed: {e}")
+            return False
+        self.serial.timeout = DUAL_TIMEOUT
+        self.send_commands([(CMD_TRANSPORT, struct.pack('<B', TX_ETH))])
+        return True
+
+    def mirror_eth(self, on=True):
+        """Keep streaming over USB and send every frame to the Ethernet
+        multicast as well (CMD_TRANSPORT TX_FANOUT, CCD_ETH=1 builds), for
+        other hosts on the group; both go out of the same device buffer.
+        Frames Ethernet has no room for are skipped there only. on=False
+        goes back to USB alone."""
+        if not self.connected or self.link2: return False
+        if on and self.device_info and self.device_info['tx_last'] < TX_FANOUT:
+            print("Ethernet mirror needs a CCD_ETH=1 build")
+            return False
+        mode = TX_FANOUT if on else TX_FRAME
+        self.send_commands([(CMD_TRANSPORT, struct.pack('<B', mode))])
+        return True
+
+    def close_dual(self):
+        """Back to one frame per transfer on the first port. The reader
+        lets go of the HS port (or the multicast) between messages."""
+        if self.link2:
+            self.send_commands([(CMD_TRANSPORT, struct.pack('<B', TX_FRAME))])
+            self.link2_close = True
+
+    def _drop_link2(self):
+        if self.on_link2: self._switch_link()
+        if self.link2: self.link2.close()
+        if self.serial: self.serial.timeout = 0.5
+        self.link2, self.link2_close, self.rx2 = None, False, bytearray()
+
+    def _switch_link(self):
+        """Parse from the other port. Each keeps its own buffer, so the
+        bytes of a frame still arriving wait for its port's next turn."""
+        self.rx, self.rx2 = self.rx2, self.rx
+        self.on_link2 = not self.on_link2
+
+    def read_frame(self):
+        if not self.connected or not self.serial:
+            return self._reconnect() if self.lost else False
+        if time.perf_counter() - self.last_time_ping >= TIME_SYNC_INTERVAL:
+            self.sync_time()
+        try:
+            if self.link2_close: self._drop_link2()
+            self._poll_control()
+            dry = 0
+            while self.running:
+                b = self._next_magic()
+                if b is None:
+                    if not self.link2: return False
+                    self._switch_link()
+                    dry += 1
+                    if dry == 2: return False  # Both timed out
+                    continue
+                dry = 0
+                parsed = self._read_message(b)
+                if self.link2: self._switch_link()  # Take turns
+                if parsed is not None:
+                    frame_num, raw_pixels = parsed
+                    if self.pipeline:
+                        _, pos, heights, _ = self.pipeline.process(raw_pixels)
+                        if len(pos) > PEAK_TRACK_MAX:
+                            pos = pos[np.sort(np.argsort(heights)[-PEAK_TRACK_MAX:])]
+                        self.tracked_peaks = pos
+                    elif self.peak_tracker:
+                        self.tracked_peaks = self.peak_tracker.track(raw_pixels)
+                    if self.host_model:
+                        self.model_values = self.host_model.apply(raw_pixels)
+                        if self.tsdb:
+                            self.tsdb.point("ccd_host_model", self.frame_info,
+                                            dict(zip(self.host_model.names,
+                                                     self.model_values)))
+                    
+                    # Frame Averaging Logic
+                    if self.frame_avg_count > 1:
+                        final_pixels = self.averager.add(raw_pixels, self.frame_avg_mode,
+                                                         self.frame_avg_count)
+                        if final_pixels is not None:
+                            # Output this average frame
+                            with self.lock:
+                                self.pixels = final_pixels
+                                self.frame_count = frame_num
+                                self.frame_ready = True
+                                self._handle_recording(frame_num, final_pixels)
+                                self._handle_singleshot()
+                    else:
+                        # No averaging
+                        with self.lock:
+                            self.pixels = raw_pixels
+                            self.frame_count = frame_num
+                            self.frame_ready = True
+                            self._handle_recording(frame_num, raw_pixels)
+                            self._handle_singleshot()
+                            
+                    self.fps_frame_count += 1
+                    self.frames_received += 1
+                    now = time.time()
+                    if now - self.last_fps_time >= 1.0:
+                        self.fps = self.fps_frame_count
+                        self.fps_frame_count = 0
+                        self.last_fps_time = now
+                        link = self.health.tick(self)
+                        if self.recorder: self.recorder.log(link)
+                    return True
+        except (serial.SerialException, OSError, PermissionError):
+            self._lost()
+            return False
+        except Exception as e:
+            print(f"Read error: {e}")
+            return False
+        return False
+        
+    def _read_message(self, b):
+        """Parse the message behind magic b: (frame_num, pixels) for a frame
+        to show, None otherwise."""
+        if b[0] == MAGIC & 0xFF:
+            return self._read_raw()
+        elif b[0] == SHAPED_MAGIC & 0xFF:
+            return self._read_shaped()
+        elif b[0] == BURST_MAGIC & 0xFF:
+            return self._read_burst()
+        elif b[0] == BURST_STATUS & 0xFF:
+            return self._read_burst_status()
+        elif b[0] == AE_STATUS & 0xFF:
+            return self._read_ae_status()
+        elif b[0] == HDR_MAGIC & 0xFF:
+            return self._read_hdr()
+        elif b[0] == SEQ_STATUS & 0xFF:
+            return self._read_seq_status()
+        elif b[0] == SNAP_REPORT & 0xFF:
+            return self._read_snap_report()
+        elif b[0] == CMD_ACK & 0xFF:
+            return self._read_cmd_ack()
+        elif b[0] == STATS_MAGIC & 0xFF:
+            return self._read_stats()
+        elif b[0] == PEAKS_MAGIC & 0xFF:
+            return self._read_peaks()
+        elif b[0] == BANDS_MAGIC & 0xFF:
+            return self._read_bands()
+        elif b[0] == FOCUS_MAGIC & 0xFF:
+            return self._read_focus()
+        elif b[0] == FAULT_MAGIC & 0xFF:
+            return self._read_faults()
+        elif b[0] == LINE_MAGIC & 0xFF:
+            return self._read_line_tile()
+        elif b[0] == JPEG_MAGIC & 0xFF:
+            return self._read_jpeg_strip()
+        elif b[0] == PTC_MAGIC & 0xFF:
+            return self._read_ptc()
+        elif b[0] == DRIFT_MAGIC & 0xFF:
+            return self._read_drift()
+        elif b[0] == MATCH_MAGIC & 0xFF:
+            return self._read_match()
+        elif b[0] == WIDE_MAGIC & 0xFF:
+            return self._read_wide()
+        elif b[0] == DUAL_MAGIC & 0xFF:
+            return self._read_dual()
+        elif b[0] == LOOP_MAGIC & 0xFF:
+            return self._read_loop()
+        elif b[0] == DARK_MAGIC & 0xFF:
+            return self._read_dark()
+        elif b[0] == MODEL_MAGIC & 0xFF:
+            return self._read_model()
+        else:
+            return self._read_phase_report()
+
+    MAGIC_LOW = bytes((MAGIC & 0xFF, SHAPED_MAGIC & 0xFF, BURST_MAGIC & 0xFF,
+                       BURST_STATUS & 0xFF, PHASE_MAGIC & 0xFF, AE_STATUS & 0xFF,
+                       HDR_MAGIC & 0xFF, SEQ_STATUS & 0xFF, SNAP_REPORT & 0xFF,
+                       CMD_ACK & 0xFF, STATS_MAGIC & 0xFF, PEAKS_MAGIC & 0xFF,
+                       FAULT_MAGIC & 0xFF, BANDS_MAGIC & 0xFF, LINE_MAGIC & 0xFF,
+                       JPEG_MAGIC & 0xFF, PTC_MAGIC & 0xFF,
+                       DRIFT_MAGIC & 0xFF, MATCH_MAGIC & 0xFF,
+                       WIDE_MAGIC & 0xFF, DUAL_MAGIC & 0xFF,
+                       LOOP_MAGIC & 0xFF, FOCUS_MAGIC & 0xFF,
+                       DARK_MAGIC & 0xFF, MODEL_MAGIC & 0xFF))
+
+    def _fill(self, n):
+        """Buffer at least n bytes, reading whatever has arrived in one go.
+        A port with readinto() reads into rx_chunk, up to RX_CHUNK bytes a
+        call, instead of returning a new bytes object per read."""
+        port = self.ctl_port or (self.link2 if self.on_link2 else self.serial)
+        readinto = getattr(port, 'readinto', None)
+        while len(self.rx) < n:
+            want = max(n - len(self.rx), port.in_waiting)
+            if readinto is None:
+                chunk = port.read(want)
+                if not chunk: return False
+                self.rx += chunk
+                self.rx_bytes += len(chunk)
+                continue
+            got = readinto(self.rx_chunk[:min(want, RX_CHUNK)])
+            if not got: return False
+            self.rx += self.rx_chunk[:got]
+            self.rx_bytes += got
+        return True
+
+    def _poll_control(self):
+        """Parse the acks and reports waiting on the control endpoint
+        (vendor bulk build). Each came as one transfer, so it is parsed on
+        its own and the frame stream in self.rx is left where it was."""
+        take = getattr(self.serial, 'read_control', None)
+        if take is None: return
+        rx = self.rx
+        try:
+            for msg in take():
+                self.ctl_port, self.rx = MessagePort(msg), bytearray()
+                while (b := self._next_magic()) is not None:
+                    self._read_message(b)
+        finally:
+            self.ctl_port, self.rx = None, rx
+
+    def _read(self, n):
+        """Take n bytes (fewer on timeout), like serial.read()."""
+        self._fill(n)
+        data = bytes(self.rx[:n])
+        del self.rx[:n]
+        return data
+
+    def _next_magic(self):
+        """Consume up to and including the next message magic and return it.
+        In sync it is at the front of the buffer; otherwise the buffer is
+        searched for it (bytes.find, not a byte per read)."""
+        skipped = 0
+        magic = None
+        while self._fill(2):
+            i = self.rx.find(MAGIC >> 8, 1)
+            if i < 0:
+                skipped += len(self.rx) - 1
+                del self.rx[:-1]
+                continue
+            if self.rx[i - 1] in self.MAGIC_LOW:
+                skipped += i - 1
+                magic = bytes(self.rx[i - 1:i + 1])
+                del self.rx[:i + 1]
+                break
+            skipped += i
+            del self.rx[:i]
+        if skipped:
+            self.resyncs += 1
+            self.skipped_bytes += skipped
+        return magic
+
+    def _frame_info(self, head, header_len, offset=0):
+        """Info of a candidate frame, head holding frame_num onwards from
+        offset, or None if it is not a frame header. frame_num must repeat
+        the low half of seq, so a magic inside pixel data almost never
+        passes."""
+        if len(head) < offset + 2 + FRAME_INFO.size: return None
+        frame_num = struct.unpack_from('<H', head, offset)[0]
+        info = self._parse_info(head, offset + 2)
+        if info is None or info['header_len'] != header_len or \
+                (info['seq'] & 0xFFFF) != frame_num:
+            return None
+        return info
+
+    def _crc_ok(self, info, buf, size, magic=b''):
+        """CRC of the message in buf[:size], in place: buf holds it from
+        its magic on, or from just behind magic. The CRC field counts as
+        zero. Nothing is copied, so a rejected candidate costs no more than
+        the CRC itself."""
+        at = FRAME_CRC_OFFSET - len(magic)
+        with memoryview(buf) as mv:
+            crc = zlib.crc32(mv[:at], zlib.crc32(magic))
+            crc = zlib.crc32(mv[at + 4:size], zlib.crc32(bytes(4), crc))
+        if crc == info['crc']: return True
+        self.crc_errors += 1
+        return False
+
+    def _parse_info(self, data, offset=0):
+        """Frame info with time_s (0.0 until device_info has the timestamp
+        clock) and the temperatures in degC (None without the sensor)"""
+        info = dict(zip(FRAME_INFO_FIELDS, FRAME_INFO.unpack_from(data, offset)))
+        if info['version'] != FRAME_VERSION: return None
+        hz = self.device_info['clock_hz'] if self.device_info else 0
+        info['time_s'] = info['timestamp'] / hz if hz else 0.0
+        for k in ('die_temp', 'board_temp'):
+            info[k + '_c'] = None if info[k] == TEMP_NONE else info[k] / 100
+        return info
+
+    def _track_info(self, info):
+        """Count frames missing between live frames. Co-added and rolling
+        outputs advance seq by their frame count or by one, so only a step
+        larger than coadd is a loss. Frames held back on purpose (change
+        detection "E", sequence gaps) count as well. In dual-link mode a
+        frame up to DUAL_REORDER behind was counted lost when the other port
+        overtook it, and is taken off again. A preview (set_preview()) skips
+        frames by design, so none count while it is on, and neither do the
+        frames the shutter moved in (set_live_dark())."""
+        late = False
+        previewing = self.preview and self.preview['rate']
+        if self.last_seq is not None and not previewing:
+            gap = (info['seq'] - self.last_seq) & 0xFFFFFFFF
+            step = max(info['coadd'], 1)
+            if (0 < gap < 0x80000000 and gap > step
+                    and gap != step + self.shutter_settle):
+                self.frames_lost += gap - step
+            elif self.link2 and 0 < (-gap & 0xFFFFFFFF) <= DUAL_REORDER:
+                late = True
+                self.frames_lost = max(self.frames_lost - step, 0)
+        if not late: self.last_seq = info['seq']
+        self.health.frame(time.perf_counter(), info['time_s'])
+        info['host_time'] = self.device_to_host(info['time_s'])
+        self.frame_info = info
+
+    # Frame parsers take their bytes only once the CRC matches. A rejected
+    # candidate leaves them buffered, so the search resumes right behind
+    # its magic and a good frame inside them is not lost.
+    def _read_raw(self):
+        if not self._fill(FRAME_HEADER_SIZE - 2): return None
+        info = self._frame_info(self.rx, FRAME_HEADER_SIZE)
+        if info is None or info['payload_len'] != CCD_PIXELS * 2: return None
+        if not self._fill(FRAME_SIZE - 2): return None
+        if not self._crc_ok(info, self.rx, FRAME_SIZE - 2, struct.pack('<H', MAGIC)): return None
+        data, pixels = self.pool.take()
+        with memoryview(self.rx) as mv:
+            data[:] = mv[:FRAME_SIZE - 2]  # The one copy of the frame
+        del self.rx[:FRAME_SIZE - 2]
+        self._flow_received()
+        self._track_info(info)
+        frame_num = struct.unpack_from('<H', data)[0]
+        if self.bench: self._bench_check(info, pixels)
+        self.dual_a = (info['seq'], pixels)
+        if self.dual_b: self._pair_dual(info)
+        return frame_num, pixels
+
+    def _read_dual(self):
+        """Sensor B frame ("V3"): sensor A's header under its own magic and
+        B's raw pixels. It is outside the flow credits and the loss count;
+        the sensor A frame of the same seq carries both."""
+        if not self._fill(FRAME_HEADER_SIZE - 2): return None
+        info = self._frame_info(self.rx, FRAME_HEADER_SIZE)
+        if info is None or info['payload_len'] != CCD_PIXELS * 2: return None
+        if not self._fill(FRAME_SIZE - 2): return None
+        if not self._crc_ok(info, self.rx, FRAME_SIZE - 2, struct.pack('<H', DUAL_MAGIC)):
+            return None
+        data = bytes(self.rx[:FRAME_SIZE - 2])
+        del self.rx[:FRAME_SIZE - 2]
+        self.dual_b[info['seq']] = np.frombuffer(data, dtype=np.uint16,
+                                                 offset=FRAME_HEADER_SIZE - 2)
+        while len(self.dual_b) > DUAL_KEPT:
+            del self.dual_b[next(iter(self.dual_b))]
+        self._pair_dual(info)
+        return None
+
+    def _read_dark(self):
+        """Closed-shutter frame (set_live_dark()): raw, black-levelled
+        pixels the device folded into its dark, into live_dark as (info,
+        pixels). It takes a flow credit and its seq, but is no spectrum."""
+        if not self._fill(FRAME_HEADER_SIZE - 2): return None
+        info = self._frame_info(self.rx, FRAME_HEADER_SIZE)
+        if info is None or info['payload_len'] != CCD_PIXELS * 2: return None
+        if not self._fill(FRAME_SIZE - 2): return None
+        if not self._crc_ok(info, self.rx, FRAME_SIZE - 2, struct.pack('<H', DARK_MAGIC)):
+            return None
+        data = bytes(self.rx[:FRAME_SIZE - 2])
+        del self.rx[:FRAME_SIZE - 2]
+        self._flow_received()
+        self._track_info(info)
+        self.live_dark = (info, np.frombuffer(data, dtype=np.uint16,
+                                              offset=FRAME_HEADER_SIZE - 2))
+        return None
+
+    def _read_loop(self):
+        """An echoed or source message of a USB link test: its seq, size
+        and arrival into loop_rx, the payload dropped"""
+        hdr = self._read(LOOP_HEADER.size - 2)
+        if len(hdr) != LOOP_HEADER.size - 2: return None
+        n, seq = struct.unpack('<HI', hdr)
+        if n < LOOP_HEADER.size: return None
+        if len(self._read(n - LOOP_HEADER.size)) == n - LOOP_HEADER.size:
+            self.loop_rx.append((seq, n, time.perf_counter()))
+        return None
+
+    def _pump(self, until, timeout):
+        """Parse what arrives, frames included, until until() holds (True)
+        or timeout s pass (False); for the link tests, which wait on acks
+        and their own messages rather than frames"""
+        end = time.perf_counter() + timeout
+        while not until():
+            if time.perf_counter() > end: return False
+            self._poll_control()
+            b = self._next_magic()
+            if b is not None: self._read_message(b)
+        return True
+
+    def _pair_dual(self, info):
+        """Match the last sensor A frame with a sensor B frame of its seq,
+        whichever came first, into dual_frame: 'pixels' is 2 x CCD_PIXELS,
+        sensor A first"""
+        if not self.dual_a: return
+        seq, a = self.dual_a
+        b = self.dual_b.pop(seq, None)
+        if b is None: return
+        self.dual_frame = {'seq': seq, 'info': info, 'pixels': np.vstack((a, b))}
+
+    def _read_stats(self):
+        """Statistics frame: the info and CCD_FrameStats_t of a frame that
+        was not sent, into frame_stats (centroid in pixels, None when
+        the frame was flat)"""
+        size = FRAME_HEADER_SIZE + FRAME_STATS.size
+        if not self._fill(FRAME_HEADER_SIZE - 2): return None
+        info = self._frame_info(self.rx, FRAME_HEADER_SIZE)
+        if info is None or info['payload_len'] != FRAME_STATS.size: return None
+        if not self._fill(size - 2): return None
+        if not self._crc_ok(info, self.rx, size - 2, struct.pack('<H', STATS_MAGIC)):
+            return None
+        st = dict(zip(FRAME_STATS_FIELDS,
+                      FRAME_STATS.unpack_from(self.rx, FRAME_HEADER_SIZE - 2)))
+        st['centroid'] = None if st['centroid'] == NO_CENTROID else st['centroid'] / 65536.0
+        st['frame_num'] = struct.unpack_from('<H', self.rx)[0]
+        del self.rx[:size - 2]
+        self._flow_received()
+        self._track_info(info)
+        st['info'] = info
+        self.frame_stats = st
+        if self.tsdb:
+            self.tsdb.point("ccd_stats", info,
+                            {k: st[k] for k in FRAME_STATS_FIELDS})
+        return None
+
+    def _read_drift(self):
+        """Drift record: the shift of a frame that was not sent against the
+        device's reference, into device_drift and drift_track (pixels,
+        features moved to higher pixels > 0)"""
+        size = FRAME_HEADER_SIZE + DRIFT_RECORD.size
+        if not self._fill(FRAME_HEADER_SIZE - 2): return None
+        info = self._frame_info(self.rx, FRAME_HEADER_SIZE)
+        if info is None or info['payload_len'] != DRIFT_RECORD.size: return None
+        if not self._fill(size - 2): return None
+        if not self._crc_ok(info, self.rx, size - 2, struct.pack('<H', DRIFT_MAGIC)):
+            return None
+        shift, score, clipped = DRIFT_RECORD.unpack_from(self.rx, FRAME_HEADER_SIZE - 2)
+        frame_num = struct.unpack_from('<H', self.rx)[0]
+        del self.rx[:size - 2]
+        self._flow_received()
+        self._track_info(info)
+        self.device_drift = {
+            'frame_num': frame_num, 'info': info, 'shift': shift / 65536.0,
+            'score': score / 32768.0, 'clipped': bool(clipped)
+        }
+        self.drift_track.append((info['seq'], shift / 65536.0, score / 32768.0))
+        del self.drift_track[:-DRIFT_KEPT]
+        return None
+
+    def _read_match(self):
+        """Classification record: the best reference of a frame that was
+        not sent, into device_match and match_track (None: no reference
+        scored the threshold)"""
+        size = FRAME_HEADER_SIZE + MATCH_RECORD.size
+        if not self._fill(FRAME_HEADER_SIZE - 2): return None
+        info = self._frame_info(self.rx, FRAME_HEADER_SIZE)
+        if info is None or info['payload_len'] != MATCH_RECORD.size: return None
+        if not self._fill(size - 2): return None
+        if not self._crc_ok(info, self.rx, size - 2, struct.pack('<H', MATCH_MAGIC)):
+            return None
+        best, second, score, second_score, latency = \
+            MATCH_RECORD.unpack_from(self.rx, FRAME_HEADER_SIZE - 2)
+        frame_num = struct.unpack_from('<H', self.rx)[0]
+        del self.rx[:size - 2]
+        self._flow_received()
+        self._track_info(info)
+        best = None if best == MATCH_NONE else best
+        self.device_match = {
+            'frame_num': frame_num, 'info': info, 'best': best,
+            'score': score / 32768.0,
+            'second': None if second == MATCH_NONE else second,
+            'second_score': second_score / 32768.0, 'latency_us': latency
+        }
+        self.match_track.append((info['seq'], best, score / 32768.0))
+        del self.match_track[:-MATCH_KEPT]
+        return None
+
+    def _read_model(self):
+        """Model record: the values of a frame that was not sent, into
+        device_model and model_track (None for an undefined output)"""
+        size = FRAME_HEADER_SIZE + MODEL_RECORD.size
+        if not self._fill(FRAME_HEADER_SIZE - 2): return None
+        info = self._frame_info(self.rx, FRAME_HEADER_SIZE)
+        if info is None or info['payload_len'] != MODEL_RECORD.size: return None
+        if not self._fill(size - 2): return None
+        if not self._crc_ok(info, self.rx, size - 2, struct.pack('<H', MODEL_MAGIC)):
+            return None
+        *values, defined, prep, latency = \
+            MODEL_RECORD.unpack_from(self.rx, FRAME_HEADER_SIZE - 2)
+        frame_num = struct.unpack_from('<H', self.rx)[0]
+        del self.rx[:size - 2]
+        self._flow_received()
+        self._track_info(info)
+        values = [v if defined >> k & 1 else None for k, v in enumerate(values)]
+        self.device_model = {
+            'frame_num': frame_num, 'info': info, 'values': values,
+            'prep': MODEL_PREPS[prep] if prep < len(MODEL_PREPS) else prep,
+            'latency_us': latency
+        }
+        self.model_track.append((info['seq'], values))
+        del self.model_track[:-MODEL_KEPT]
+        if self.tsdb:
+            self.tsdb.point("ccd_model", info,
+                            {f"y{k}": v for k, v in enumerate(values)})
+        return None
+
+    def _read_wide(self):
+        """Wide co-add or rolling output into wide_frame: 'values' as sent,
+        int32 sums or float32 means, and 'mean' per pixel (float), in wire
+        polarity. Shown and recorded as the rounded 16-bit mean the device
+        would have sent."""
+        n = WIDE_HEADER_SIZE - 2
+        if not self._fill(n): return None
+        info = self._frame_info(self.rx, WIDE_HEADER_SIZE)
+        if info is None or info['payload_len'] != CCD_PIXELS * 4: return None
+        size = n + info['payload_len']
+        if not self._fill(size): return None
+        if not self._crc_ok(info, self.rx, size, struct.pack('<H', WIDE_MAGIC)):
+            return None
+        fmt, terms = WIDE_TAIL.unpack_from(self.rx, n - WIDE_TAIL.size)
+        frame_num = struct.unpack_from('<H', self.rx)[0]
+        values = np.frombuffer(bytes(self.rx[n:size]),
+                               dtype='<i4' if fmt == WIDE_SUM else '<f4')
+        del self.rx[:size]
+        self._flow_received()
+        self._track_info(info)
+        mean = values / max(terms, 1) if fmt == WIDE_SUM else values
+        self.wide_frame = {
+            'frame_num': frame_num, 'info': info, 'terms': terms,
+            'format': WIDE_FORMATS[fmt] if fmt < len(WIDE_FORMATS) else fmt,
+            'values': values, 'mean': mean
+        }
+        pixels = np.clip(np.floor(mean + 0.5), 0, 65535).astype(np.uint16)
+        return frame_num, pixels
+
+    def _read_peaks(self):
+        """Peak list frame into device_peaks: sub-pixel positions and
+        heights in the display's polarity (light = high), as find_peaks()
+        would give for the frame"""
+        n = PEAKS_HEADER_SIZE - 2
+        if not self._fill(n): return None
+        info = self._frame_info(self.rx, PEAKS_HEADER_SIZE)
+        if info is None: return None
+        count, fit, truncated = struct.unpack_from('<HBB', self.rx, n - 4)
+        if info['payload_len'] != count * PEAK.size: return None
+        size = n + info['payload_len']
+        if not self._fill(size): return None
+        if not self._crc_ok(info, self.rx, size, struct.pack('<H', PEAKS_MAGIC)):
+            return None
+        data = bytes(self.rx[:size])
+        del self.rx[:size]
+        self._flow_received()
+        self._track_info(info)
+        peaks = [PEAK.unpack_from(data, n + i * PEAK.size) for i in range(count)]
+        self.device_peaks = {
+            'frame_num': struct.unpack_from('<H', data)[0], 'info': info,
+            'positions': [p / 65536.0 for p, _ in peaks],
+            'heights': [h for _, h in peaks],
+            'fit': fit, 'truncated': bool(truncated)
+        }
+        return None
+
+    def _read_bands(self):
+        """Band frame into device_bands: one value per band set with
+        set_device_bands(), the light summed over its pixels times its
+        weight"""
+        n = BANDS_HEADER_SIZE - 2
+        if not self._fill(n): return None
+        info = self._frame_info(self.rx, BANDS_HEADER_SIZE)
+        if info is None: return None
+        count = struct.unpack_from('<H', self.rx, n - 2)[0]
+        if count > BANDS_MAX or info['payload_len'] != count * 4: return None
+        size = n + info['payload_len']
+        if not self._fill(size): return None
+        if not self._crc_ok(info, self.rx, size, struct.pack('<H', BANDS_MAGIC)):
+            return None
+        data = bytes(self.rx[:size])
+        del self.rx[:size]
+        self._flow_received()
+        self._track_info(info)
+        self.device_bands = {
+            'frame_num': struct.unpack_from('<H', data)[0], 'info': info,
+            'values': list(struct.unpack_from(f'<{count}I', data, n))
+        }
+        if self.tsdb:
+            self.tsdb.point("ccd_bands", info,
+                            {f"b{i}": v for i, v in
+                             enumerate(self.device_bands['values'])})
+        return None
+
+    def _read_focus(self):
+        """Focus frame into device_focus and focus_track: per line set with
+        set_focus_lines(), its centre and FWHM in pixels (None without a
+        width) and its height, the light of the peak over the window's
+        least"""
+        n = FOCUS_HEADER_SIZE - 2
+        if not self._fill(n): return None
+        info = self._frame_info(self.rx, FOCUS_HEADER_SIZE)
+        if info is None: return None
+        count = struct.unpack_from('<H', self.rx, n - 2)[0]
+        if (count > FOCUS_MAX
+                or info['payload_len'] != count * FOCUS_VALUE.size):
+            return None
+        size = n + info['payload_len']
+        if not self._fill(size): return None
+        if not self._crc_ok(info, self.rx, size, struct.pack('<H', FOCUS_MAGIC)):
+            return None
+        data = bytes(self.rx[:size])
+        del self.rx[:size]
+        self._flow_received()
+        self._track_info(info)
+        lines = [(centre / 65536.0, height, fwhm / 256.0 if fwhm else None)
+                 for centre, height, fwhm in
+                 (FOCUS_VALUE.unpack_from(data, n + i * FOCUS_VALUE.size)
+                  for i in range(count))]
+        self.device_focus = {
+            'frame_num': struct.unpack_from('<H', data)[0], 'info': info,
+            'lines': lines
+        }
+        self.focus_track.append((info['seq'], [l[2] for l in lines]))
+        del self.focus_track[:-FOCUS_KEPT]
+        return None
+
+    def _read_line_tile(self):
+        """Encoder line-scan tile: its rows go on the bottom of line_scan,
+        which keeps the last LINE_SCAN_ROWS lines as a 2D image with each
+        line's seq, time and encoder position (None where no boundary
+        matched)"""
+        n = LINE_HEADER_SIZE - 2
+        if not self._fill(n): return None
+        info = self._frame_info(self.rx, LINE_HEADER_SIZE)
+        if info is None: return None
+        lines, capacity, pitch, missed, dropped = \
+            LINE_TILE.unpack_from(self.rx, n - LINE_TILE.size)
+        if not 0 < lines <= capacity or info['payload_len'] != \
+                capacity * LINE_ENTRY.size + lines * CCD_PIXELS * 2:
+            return None
+        size = n + info['payload_len']
+        if not self._fill(size): return None
+        if not self._crc_ok(info, self.rx, size, struct.pack('<H', LINE_MAGIC)):
+            return None
+        data = bytes(self.rx[:size])
+        del self.rx[:size]
+        entries = [LINE_ENTRY.unpack_from(data, n + i * LINE_ENTRY.size)
+                   for i in range(lines)]
+        rows = np.frombuffer(data, dtype='<u2', offset=n + capacity * LINE_ENTRY.size)
+        hz = self.device_info['clock_hz'] if self.device_info else 0
+        scan = self.line_scan
+        with self.lock:
+            scan['pixels'] = np.concatenate(
+                (scan['pixels'], rows.reshape(lines, CCD_PIXELS)))[-LINE_SCAN_ROWS:]
+            for seq, pos, t in entries:
+                scan['seq'].append(seq)
+                scan['position'].append(None if pos == LINE_POS_NONE else pos)
+                scan['time_s'].append(t / hz if hz else 0.0)
+            for k in ('seq', 'position', 'time_s'):
+                del scan[k][:-LINE_SCAN_ROWS]
+            scan.update(pitch=pitch, missed=missed, dropped=dropped,
+                        tiles=scan['tiles'] + 1)
+        return None
+
+    def _read_jpeg_strip(self):
+        """JPEG preview of CCD_JPEG_LINES lines of the line scan, a complete
+        grayscale image (light, 8 bits), appended to line_preview['strips']
+        undecoded with its first seq, time and encoder positions. A gap in
+        the strip numbers counts lost."""
+        n = JPEG_HEADER_SIZE - 2
+        if not self._fill(n): return None
+        info = self._frame_info(self.rx, JPEG_HEADER_SIZE)
+        if info is None: return None
+        lines, quality, width, number, first_seq, first_pos, last_pos, \
+            skipped, failed = JPEG_STRIP.unpack_from(self.rx, n - JPEG_STRIP.size)
+        if lines == 0 or info['payload_len'] < 4:
+            return None
+        size = n + info['payload_len']
+        if not self._fill(size): return None
+        if not self._crc_ok(info, self.rx, size, struct.pack('<H', JPEG_MAGIC)):
+            return None
+        data = bytes(self.rx[n:size])
+        del self.rx[:size]
+        prev = self.line_preview
+        with self.lock:
+            last = prev['strips'][-1]['strip'] if prev['strips'] else None
+            if last is not None and number > last + 1:
+                prev['lost'] += number - last - 1
+            prev['strips'].append({
+                'jpeg': data, 'strip': number, 'lines': lines, 'width': width,
+                'quality': quality, 'first_seq': first_seq,
+                'position': (None if first_pos == LINE_POS_NONE else first_pos,
+                             None if last_pos == LINE_POS_NONE else last_pos),
+                'time_s': info['time_s'],
+            })
+            del prev['strips'][:-JPEG_STRIPS_KEPT]
+            prev.update(received=prev['received'] + 1, skipped=skipped,
+                        failed=failed)
+        return None
+
+    def _read_ptc(self):
+        """Mean and variance maps of one photon transfer level (float per
+        pixel) with the level's curve point, appended to ptc['levels']; a
+        level 0 begins a new run."""
+        n = PTC_HEADER_SIZE - 2
+        if not self._fill(n): return None
+        info = self._frame_info(self.rx, PTC_HEADER_SIZE)
+        if info is None: return None
+        level, levels, frames, t_us, first_seq, black, light, variance, \
+            restarts = PTC_LEVEL.unpack_from(self.rx, n - PTC_LEVEL.size)
+        if info['payload_len'] != CCD_PIXELS * 8:
+            return None
+        size = n + info['payload_len']
+        if not self._fill(size): return None
+        if not self._crc_ok(info, self.rx, size, struct.pack('<H', PTC_MAGIC)):
+            return None
+        px = np.frombuffer(bytes(self.rx[n:size]), dtype='<f4').reshape(-1, 2)
+        del self.rx[:size]
+        with self.lock:
+            if level == 0:
+                self.ptc['levels'] = []
+            self.ptc['levels'].append({
+                'level': level, 'levels': levels, 'frames': frames,
+                't_us': t_us, 'first_seq': first_seq, 'black': black,
+                'light': light, 'variance': variance, 'restarts': restarts,
+                'mean': px[:, 0].copy(), 'pixel_variance': px[:, 1].copy(),
+                'time_s': info['time_s'],
+            })
+            self.ptc['received'] += 1
+        return None
+
+    def _read_burst(self):
+        """One frame of a drained burst. The whole burst is collected in
+        burst_frames; each frame is also shown as it arrives."""
+        n = BURST_HEADER_SIZE - 2
+        if not self._fill(n + FRAME_HEADER_SIZE): return None
+        if struct.unpack_from('<H', self.rx, n)[0] != MAGIC: return None
+        info = self._frame_info(self.rx, FRAME_HEADER_SIZE, n + 2)
+        if info is None: return None
+        if not self._fill(n + FRAME_SIZE): return None
+        with memoryview(self.rx) as mv:
+            ok = self._crc_ok(info, mv[n:], FRAME_SIZE)
+        if not ok: return None
+        hdr = bytes(self.rx[:n])
+        frame = bytes(self.rx[n:n + FRAME_SIZE])
+        del self.rx[:n + FRAME_SIZE]
+        index, count, trigger, t_us = struct.unpack('<HHHi', hdr)
+        frame_num = struct.unpack('<H', frame[2:4])[0]
+        pixels = np.frombuffer(frame, dtype=np.uint16, offset=FRAME_HEADER_SIZE)
+        if index == 0:
+            self.burst_frames = []
+        self.burst_frames.append({
+            'frame_num': frame_num,
+            'info': info,
+            't_us': t_us,
+            'pre_trigger': index < trigger,
+            'pixels': pixels
+        })
+        return frame_num, pixels
+
+    def _read_burst_status(self):
+        data = self._read(BURST_STATUS_SIZE - 2)
+        if len(data) == BURST_STATUS_SIZE - 2:
+            (state, sources, cause, failed, count, pre, stored, sent,
+             max_frames, level, overruns) = struct.unpack('<4B6HI', data)
+            self.burst_status = {
+                'state': BURST_STATES[state] if state < len(BURST_STATES) else state,
+                'count': count, 'pre': pre, 'stored': stored, 'sent': sent,
+                'max': max_frames, 'sources': sources, 'cause': cause,
+                'level': level, 'failed': bool(failed), 'overruns': overruns
+            }
+        return None
+
+    def _read_ae_status(self):
+        data = self._read(AE_STATUS_SIZE - 2)
+        if len(data) == AE_STATUS_SIZE - 2:
+            enabled, pct, min_us, max_us, t_us, target, signal, frame_num, \
+                sat_cuts = struct.unpack('<2B3I4H', data)
+            self.ae_status = {
+                'enabled': bool(enabled), 'percentile': pct,
+                'min_us': min_us, 'max_us': max_us, 't_us': t_us,
+                'target': target, 'signal': signal, 'frame_num': frame_num,
+                'sat_cuts': sat_cuts
+            }
+        return None
+
+    def _read_seq_status(self):
+        data = self._read(SEQ_STATUS_SIZE - 2)
+        if len(data) == SEQ_STATUS_SIZE - 2:
+            state, step, steps, _, pass_, repeats, outputs, frame_num = \
+                struct.unpack('<4B4H', data)
+            self.seq_status = {
+                'state': SEQ_STATES[state] if state < len(SEQ_STATES) else state,
+                'step': step, 'steps': steps, 'pass': pass_,
+                'repeats': repeats, 'outputs': outputs, 'frame_num': frame_num
+            }
+        return None
+
+    def _read_snap_report(self):
+        data = self._read(SNAP_REPORT_SIZE - 2)
+        if len(data) == SNAP_REPORT_SIZE - 2:
+            frame_num, latency_us, t_us, snaps, missed = struct.unpack('<H2I2H', data)
+            self.snap_report = {
+                'frame_num': frame_num, 'latency_us': latency_us,
+                't_us': t_us, 'snaps': snaps, 'missed': missed
+            }
+            if self.exposure and self.exposure['state'] == 'running':
+                self.exposure = dict(self.exposure, state='idle')
+        return None
+
+    def _fault_report(self, data):
+        """CCD_FaultReport_t (without its magic) into faults, with the growth
+        of each counter since the report before in faults['new']."""
+        last, _, *counts = FAULT_REPORT.unpack(data)
+        report = dict(zip(FAULT_FIELDS, counts))
+        report['last_fault'] = (FAULT_CAUSES[last] if last < len(FAULT_CAUSES)
+                                else last)
+        prev = self.faults
+        if prev and report['boots'] == prev['boots']:
+            report['new'] = {k: report[k] - prev[k] for k in FAULT_FIELDS[1:]
+                             if report[k] != prev[k]}
+        else:
+            report['new'] = {}
+        self.faults = report
+
+    def _read_faults(self):
+        data = self._read(FAULT_REPORT.size)
+        if len(data) == FAULT_REPORT.size:
+            self._fault_report(data)
+        return None
+
+    def _read_cmd_ack(self):
+        hdr = self._read(CMD_ACK_SIZE - 2)
+        if len(hdr) != CMD_ACK_SIZE - 2:
+            return None
+        seq, ctype, status, n = hdr
+        payload = self._read(n) if n else b""
+        t3 = time.perf_counter()
+        if len(payload) == n:
+            self.cmd_acks[seq] = (ctype, CMD_STATUS[status] if status < len(CMD_STATUS) else status,
+                                  payload)
+            if ctype == CMD_STATS and status == 0:
+                self.device_stats = dict(zip(CMD_STATS_FIELDS,
+                                             struct.unpack(f'<{n // 4}I', payload)))
+            elif ctype == CMD_RECORD and n == REC_STATUS_REPLY.size:
+                st = dict(zip(REC_STATUS_FIELDS, REC_STATUS_REPLY.unpack(payload)))
+                st['state'] = REC_STATES[st['state']] if st['state'] < len(REC_STATES) else st['state']
+                self.rec_status = st
+            elif ctype == CMD_INFO and status == 0 and n >= CMD_INFO_REPLY.size:
+                self._info_reply(payload)
+            elif ctype == CMD_PROFILE and status == 0 and n >= 12 and n % 4 == 0:
+                # Older builds time fewer stages
+                frame_cycles, frames, total, *stages = struct.unpack(f'<{n // 4}I', payload)
+                self.proc_profile = {
+                    'frame_cycles': frame_cycles, 'frames': frames,
+                    'max_total': total, 'stages': dict(zip(PROC_STAGES, stages)),
+                    'fits': total < frame_cycles
+                }
+            elif ctype == CMD_WAVELENGTH and n == WAVELENGTH.size:
+                *coef, start, step, resample, state = WAVELENGTH.unpack(payload)
+                self.device_wavelength = {
+                    'coef': coef, 'start_nm': start, 'step_nm': step,
+                    'resample': bool(resample), 'calibrated': state == 1
+                }
+            elif ctype == CMD_ABSORBANCE and status == 0 and n == 2:
+                mode, state = payload
+                self.absorbance_status = {
+                    'mode': mode,
+                    'state': ABS_STATES[state] if state < len(ABS_STATES) else state
+                }
+            elif ctype == CMD_BENCH and status == 0 and n >= 4 and self.bench:
+                self.bench['device_frames'] = struct.unpack_from('<I', payload)[0]
+                if n >= 8:  # Frames of a replay that waited for a slot
+                    self.bench['stalls'] = struct.unpack_from('<I', payload, 4)[0]
+            elif ctype == CMD_PROBE and status == 0 and n == PROBE_REPLY.size:
+                probe, bins, count, lo, hi, mean, *hist = PROBE_REPLY.unpack(payload)
+                if probe < len(PROBE_NAMES):
+                    self.probes[PROBE_NAMES[probe]] = {
+                        'count': count, 'min': lo, 'max': hi, 'mean': mean,
+                        'hist': hist[:bins]
+                    }
+            elif (ctype == CMD_TELEMETRY and status == 0 and n == FAULT_REPORT.size + 2
+                  and payload[:2] == struct.pack('<H', FAULT_MAGIC)):
+                self._fault_report(payload[2:])
+            elif ctype == CMD_TELEMETRY and status == 0 and n == KERNEL_REPLY.size:
+                kernel, regions, runs, *cycles = KERNEL_REPLY.unpack(payload)
+                if kernel < len(KERNEL_NAMES):
+                    self.kernels[KERNEL_NAMES[kernel]] = {
+                        name: {'min': cycles[3 * i], 'mean': cycles[3 * i + 1],
+                               'per_pixel': cycles[3 * i] / CCD_PIXELS,
+                               'check': cycles[3 * i + 2]}
+                        for i, name in enumerate(REGION_NAMES[:regions])
+                        if cycles[3 * i]
+                    }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == ADCCAL_REPLY.size:
+                temp, cal_temp, source, pending, runs, age, *offset = \
+                    ADCCAL_REPLY.unpack(payload)
+                self.adc_calibration = {
+                    'temp_c': temp, 'cal_temp_c': cal_temp,
+                    'source': (ADCCAL_SOURCES[source]
+                               if source < len(ADCCAL_SOURCES) else source),
+                    'pending': bool(pending), 'calibrations': runs,
+                    'age_s': age, 'offset': offset
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == BANDS_REPLY.size:
+                count, staged, frames = BANDS_REPLY.unpack(payload)
+                self.bands_status = {'count': count, 'staged': staged,
+                                     'frames': frames}
+            elif ctype == CMD_TELEMETRY and status == 0 and n == DESPIKE_REPLY.size:
+                mode, sigma, floor, held, frames, spiked, replaced, worst, \
+                    last, restarts = DESPIKE_REPLY.unpack(payload)
+                self.despike_status = {
+                    'mode': (DESPIKE_MODES[mode]
+                             if mode < len(DESPIKE_MODES) else mode),
+                    'sigma': sigma / 10, 'floor': floor, 'held': held,
+                    'frames': frames, 'spiked': spiked, 'replaced': replaced,
+                    'worst': worst, 'last': last, 'restarts': restarts
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == DEFECT_REPLY.size:
+                enabled, stored, defects, listed, hot, dead, offset, frames, \
+                    chunk = DEFECT_REPLY.unpack(payload)
+                end = min(offset + DEFECT_CHUNK, DEFECT_BYTES)
+                if offset < end:
+                    self.defect_map[offset:end] = chunk[:end - offset]
+                self.defect_status = {
+                    'enabled': bool(enabled), 'stored': bool(stored),
+                    'defects': defects, 'listed': listed, 'hot': hot,
+                    'dead': dead, 'frames': frames
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == DRIFT_REPLY.size:
+                mode, correct, lag, state, start, length, shift, lo, hi, mean, \
+                    applied, score, ref_frames, frames, clipped, rebuilds = \
+                    DRIFT_REPLY.unpack(payload)
+                self.drift_status = {
+                    'mode': DRIFT_MODES[mode] if mode < len(DRIFT_MODES) else mode,
+                    'correct': bool(correct), 'lag': lag,
+                    'state': (DRIFT_STATES[state]
+                              if state < len(DRIFT_STATES) else state),
+                    'start': start, 'length': length, 'shift': shift / 65536.0,
+                    'min': lo / 65536.0, 'max': hi / 65536.0,
+                    'mean': mean / 65536.0, 'applied': applied / 65536.0,
+                    'score': score / 32768.0, 'ref_frames': ref_frames,
+                    'frames': frames, 'clipped': clipped, 'rebuilds': rebuilds
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == WIDE_REPLY.size:
+                fmt, queued, dropped = WIDE_REPLY.unpack(payload)
+                self.wide_status = {
+                    'format': WIDE_FORMATS[fmt] if fmt < len(WIDE_FORMATS) else fmt,
+                    'queued': queued, 'dropped': dropped
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == SAT_REPLY.size:
+                mode, armed, level, *v = SAT_REPLY.unpack(payload)
+                st = dict(zip(SAT_FIELDS, v))
+                st.update({
+                    'mode': SAT_MODES[mode] if mode < len(SAT_MODES) else mode,
+                    'armed': bool(armed), 'level': level,
+                    'flagged': [st['seq'] - k for k in range(32)
+                                if st['history'] >> k & 1 and st['seq'] >= k]
+                })
+                self.saturation_status = st
+            elif ctype == CMD_TELEMETRY and status == 0 and n == REF_REPLY.size:
+                mode, shift, results, target, seq, frames, unmatched, \
+                    *levels = REF_REPLY.unpack(payload)
+                self.reference_status = {
+                    'mode': REF_MODES[mode] if mode < len(REF_MODES) else mode,
+                    'shift': shift, 'results': results,
+                    'target': target / 16, 'seq': seq, 'frames': frames,
+                    'unmatched': unmatched,
+                    'levels': {seq - k: v / 16 for k, v in enumerate(levels)
+                               if v and seq >= k}
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == TXN_REPLY.size:
+                state, staged, start_from, generation, rejected, aborted, \
+                    *starts = TXN_REPLY.unpack(payload)
+                self.txn_status = {
+                    'state': TXN_STATES[state] if state < len(TXN_STATES) else state,
+                    'staged': [f for k, f in enumerate(TXN_FIELDS) if staged >> k & 1],
+                    'from': start_from, 'generation': generation,
+                    'rejected': rejected, 'aborted': aborted,
+                    'starts': {generation - k: v for k, v in enumerate(starts)
+                               if generation > k}
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == LOOP_REPLY.size:
+                test, port, running, *v = LOOP_REPLY.unpack(payload)
+                self.loop_status = dict(zip(LOOP_FIELDS, v))
+                self.loop_status.update({
+                    'test': (LOOP_TESTS[test] if test < len(LOOP_TESTS)
+                             else None if test == LOOP_NONE else test),
+                    'port': LOOP_PORTS[port] if port < len(LOOP_PORTS) else port,
+                    'running': bool(running)
+                })
+            elif ctype == CMD_TELEMETRY and status == 0 and n == MAINS_REPLY.size:
+                active, locked, periods, used, phase, *v = \
+                    MAINS_REPLY.unpack(payload)
+                self.mains_status = dict(zip(MAINS_FIELDS, v))
+                self.mains_status.update({
+                    'active': bool(active), 'locked': bool(locked),
+                    'periods': periods, 'used': used, 'phase_deg': phase / 10,
+                    'freq_hz': v[1] / 1000
+                })
+            elif (ctype == CMD_TELEMETRY and status == 0
+                  and n == SHUTTER_REPLY.size):
+                state, settle, darks, shift, every, closed, estimate, \
+                    temp, *v = SHUTTER_REPLY.unpack(payload)
+                self.shutter_status = dict(zip(SHUTTER_FIELDS, v))
+                self.shutter_status.update({
+                    'state': (SHUTTER_STATES[state]
+                              if state < len(SHUTTER_STATES) else state),
+                    'every': every, 'settle': settle, 'darks': darks,
+                    'shift': shift, 'closed': bool(closed),
+                    'estimate': bool(estimate),
+                    'temp_c': None if temp == -32768 else temp / 100
+                })
+                self.shutter_settle = settle if state else 0
+            elif (ctype == CMD_TELEMETRY and status == 0
+                  and n == SELFTEST_REPLY.size):
+                v = SELFTEST_REPLY.unpack(payload)
+                state, failed, tested, guard = v[:4]
+                expected, measured = v[9:13], v[13:17]
+                self.selftest_status = dict(zip(SELFTEST_FIELDS, v[4:9]))
+                self.selftest_status.update({
+                    'state': (SELFTEST_STATES[state]
+                              if state < len(SELFTEST_STATES) else state),
+                    'guard': bool(guard), 'age_ms': v[17],
+                    'failed': [c for i, c in enumerate(SELFTEST_CHANNELS)
+                               if failed >> i & 1],
+                    'channels': {c: (expected[i], measured[i])
+                                 for i, c in enumerate(SELFTEST_CHANNELS)
+                                 if tested >> i & 1}
+                })
+            elif (ctype == CMD_TELEMETRY and status == 0
+                  and n == AUTOROI_REPLY.size):
+                mode, state, lines, frames, margin, interval, windows, \
+                    found, searches, *roi = AUTOROI_REPLY.unpack(payload)
+                self.autoroi_status = {
+                    'on': mode == AUTOROI_ON,
+                    'state': (AUTOROI_STATES[state]
+                              if state < len(AUTOROI_STATES) else state),
+                    'lines': lines, 'frames': frames, 'margin': margin,
+                    'interval_s': interval, 'found': found,
+                    'searches': searches,
+                    'windows': [tuple(roi[2 * i:2 * i + 2])
+                                for i in range(min(windows, ROI_MAX))]
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == FOCUS_REPLY.size:
+                count, staged, frames, unresolved, fwhm, resolved = \
+                    FOCUS_REPLY.unpack(payload)
+                self.focus_status = {
+                    'count': count, 'staged': staged, 'frames': frames,
+                    'unresolved': unresolved, 'resolved': resolved,
+                    'fwhm': fwhm / 256.0 if resolved else None
+                }
+            elif (ctype == CMD_TELEMETRY and status == 0
+                  and n == BASELINE_REPLY.size):
+                mode, _, *v = BASELINE_REPLY.unpack(payload)
+                self.baseline_status = dict(zip(BASELINE_FIELDS, v))
+                self.baseline_status['mode'] = (
+                    BASELINE_MODES[mode] if mode < len(BASELINE_MODES)
+                    else mode)
+            elif ctype == CMD_TELEMETRY and status == 0 and n == INPUTS_REPLY.size:
+                edge, inputs, rising, missed, seq, count, *rest = \
+                    INPUTS_REPLY.unpack(payload)
+                levels, edges = rest[:DIN_LEVELS], rest[DIN_LEVELS:]
+                self.inputs_status = {
+                    'edge': INPUT_EDGES[edge] if edge < len(INPUT_EDGES) else edge,
+                    'inputs': inputs, 'missed': missed, 'seq': seq,
+                    'count': count,
+                    'levels': {seq - k: v & ~DIN_LATE & 0xFF
+                               for k, v in enumerate(levels)
+                               if v != DIN_NONE and seq >= k},
+                    'late': [seq - k for k, v in enumerate(levels)
+                             if v != DIN_NONE and v & DIN_LATE and seq >= k],
+                    'edges': [(edges[2 * k], edges[2 * k + 1],
+                               bool(rising >> k & 1))
+                              for k in range(min(count, DIN_EDGES))]
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == MEMORY_REPLY.size:
+                v = MEMORY_REPLY.unpack(payload)
+                self.memory_status = dict(zip(MEMORY_FIELDS, v[:9]))
+                self.memory_status.update({
+                    'ring_slots': v[9], 'ring_now': v[10], 'ring_peak': v[11],
+                    'ring_hist': list(v[13:])
+                })
+            elif ctype == CMD_TELEMETRY and status == 0 and n == MATCH_REPLY.size:
+                mode, refs, best, second, score, second_score, threshold, \
+                    capture, stored, defined, frames, unmatched, latency, \
+                    max_latency, index, _, offset, *bins = \
+                    MATCH_REPLY.unpack(payload)
+                if index < MATCH_REFS and offset < MATCH_BINS:
+                    ref = self.match_references.setdefault(index, [0] * MATCH_BINS)
+                    end = min(offset + MATCH_CHUNK, MATCH_BINS)
+                    ref[offset:end] = bins[:end - offset]
+                self.match_status = {
+                    'mode': MATCH_MODES[mode] if mode < len(MATCH_MODES) else mode,
+                    'threshold': threshold / 32768.0, 'refs': refs,
+                    'defined': [k for k in range(MATCH_REFS) if defined >> k & 1],
+                    'best': None if best == MATCH_NONE else best,
+                    'score': score / 32768.0,
+                    'second': None if second == MATCH_NONE else second,
+                    'second_score': second_score / 32768.0,
+                    'capture': None if capture == MATCH_NONE else capture,
+                    'stored': bool(stored), 'frames': frames,
+                    'unmatched': unmatched, 'latency_us': latency,
+                    'max_latency_us': max_latency
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == MODEL_REPLY.size:
+                mode, prep, defined, stored, frames, seq, latency, \
+                    max_latency, invalid, *v = MODEL_REPLY.unpack(payload)
+                values, (scale, offset, index, _, first), loadings = \
+                    v[:MODEL_OUTPUTS], v[MODEL_OUTPUTS:MODEL_OUTPUTS + 5], \
+                    v[MODEL_OUTPUTS + 5:]
+                if index < MODEL_OUTPUTS and first < MODEL_BINS:
+                    w = self.model_loadings.setdefault(index, [0] * MODEL_BINS)
+                    end = min(first + MODEL_CHUNK, MODEL_BINS)
+                    w[first:end] = loadings[:end - first]
+                self.model_status = {
+                    'mode': MODEL_MODES[mode] if mode < len(MODEL_MODES) else mode,
+                    'prep': MODEL_PREPS[prep] if prep < len(MODEL_PREPS) else prep,
+                    'defined': [k for k in range(MODEL_OUTPUTS) if defined >> k & 1],
+                    'stored': bool(stored), 'frames': frames, 'seq': seq,
+                    'values': [x if defined >> k & 1 else None
+                               for k, x in enumerate(values)],
+                    'latency_us': latency, 'max_latency_us': max_latency,
+                    'invalid': invalid
+                }
+                if index < MODEL_OUTPUTS:
+                    self.model_status.update({'output': index, 'scale': scale,
+                                              'offset': offset})
+            elif ctype == CMD_TELEMETRY and status == 0 and n == PTC_REPLY.size:
+                state, level, levels, frames, count, t_us, maps, dropped, \
+                    restarts, elapsed, black, light, variance = \
+                    PTC_REPLY.unpack(payload)
+                self.ptc_status = {
+                    'state': (PTC_STATES[state]
+                              if state < len(PTC_STATES) else state),
+                    'level': level, 'levels': levels, 'frames': frames,
+                    'count': count, 't_us': t_us, 'maps': maps,
+                    'dropped': dropped, 'restarts': restarts,
+                    'elapsed_ms': elapsed, 'black': black, 'light': light,
+                    'variance': variance
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == EXPOSE_REPLY.size:
+                state, t_ms, elapsed, count, aborted = EXPOSE_REPLY.unpack(payload)
+                self.exposure = {
+                    'state': (EXPOSE_STATES[state]
+                              if state < len(EXPOSE_STATES) else state),
+                    't_ms': t_ms, 'elapsed_ms': elapsed,
+                    'exposures': count, 'aborted': aborted,
+                    'at': time.monotonic()
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == LINE_REPLY.size:
+                pitch, active, lines, position, tiles, missed, dropped = \
+                    LINE_REPLY.unpack(payload)
+                self.line_status = {
+                    'pitch': pitch, 'active': bool(active), 'lines': lines,
+                    'position': position, 'tiles': tiles, 'missed': missed,
+                    'dropped': dropped
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == JPEG_REPLY.size:
+                quality, lines, width, strips, bytes_in, bytes_out, lines_in, \
+                    skipped, failed = JPEG_REPLY.unpack(payload)
+                self.line_preview_status = {
+                    'quality': quality, 'lines': lines, 'width': width,
+                    'strips': strips, 'lines_in': lines_in, 'skipped': skipped,
+                    'failed': failed, 'bytes_in': bytes_in,
+                    'bytes_out': bytes_out,
+                    'ratio': bytes_out / (bytes_in * 2) if bytes_in else None
+                }
+            elif ctype == CMD_TELEMETRY and status == 0 and n == PREVIEW_REPLY.size:
+                rate, bin_, busy, sent, skipped = PREVIEW_REPLY.unpack(payload)
+                self.preview = {'rate': rate, 'bin': bin_, 'busy': busy,
+                                'sent': sent, 'skipped': skipped}
+            elif ctype == CMD_TELEMETRY and status == 0 and n == LATENCY_REPLY.size:
+                frames, arms, alarms, limit, *stat, worst = LATENCY_REPLY.unpack(payload)
+                self.latency = {
+                    'frames': frames, 'arms': arms, 'alarms': alarms,
+                    'arm_limit': limit, 'arm_worst': worst,
+                    **{name: dict(zip(('p50', 'p99', 'max'), stat[3 * i:3 * i + 3]))
+                       for i, name in enumerate(LATENCY_NAMES)}
+                }
+                if alarms:
+                    print(f"Sync margin: {alarms} late re-arms "
+                          f"(limit {limit} cycles)")
+            elif ctype == CMD_CONFIG and status == 0 and n == CONFIG_REPLY.size:
+                st = dict(zip(CONFIG_FIELDS, CONFIG_REPLY.unpack(payload)))
+                for k in ("auto_save", "restored", "warm_boot", "pending"):
+                    st[k] = bool(st[k])
+                self.config_status = st
+            elif ctype == CMD_BLACK and status == 0 and n == BLACK_REPLY.size:
+                enabled, black, level = BLACK_REPLY.unpack(payload)
+                self.black_level = {'enabled': bool(enabled), 'black': black,
+                                    'level': level}
+            elif ctype == CMD_DARK_TEMP and n == DARKT_REPLY.size:
+                count, active, dark_t, temp, ratio, ref = DARKT_REPLY.unpack(payload)
+                self.dark_temperature = {
+                    'knots': count, 'active': bool(active),
+                    'dark_temp_c': None if dark_t == TEMP_NONE else dark_t / 100,
+                    'temp_c': None if temp == TEMP_NONE else temp / 100,
+                    'ratio': ratio / DARKT_UNITY, 'zero_level': ref,
+                    'rejected': status != 0
+                }
+            elif ctype == CMD_LINEARITY and n == 1:
+                self.linearity_enabled = bool(payload[0])
+            elif ctype == CMD_TIME and status == 0 and n == CMD_TIME_REPLY.size:
+                self._time_sample(seq, t3, payload)
+        return None
+
+    def _info_reply(self, payload):
+        """CCD_CmdInfo_t into device_info; fields appended by newer firmware
+        are ignored"""
+        (protocol, pixels, commands, build, clock_hz, slots, tx_last,
+         value_max) = CMD_INFO_REPLY.unpack_from(payload)
+        self.device_info = {
+            'protocol': protocol, 'pixels': pixels,
+            'commands': [t for t in range(32) if commands >> t & 1],
+            'build': [o for i, o in enumerate(BUILD_OPTIONS) if build >> i & 1],
+            'clock_hz': clock_hz, 'ring_slots': slots, 'tx_last': tx_last,
+            'value_max': value_max,
+        }
+        if len(payload) >= CMD_INFO_REPLY.size + CMD_CAPS.size:
+            (formats, burst, frame_bytes, sinks, timing, profiles, fm_hz,
+             frame_us) = CMD_CAPS.unpack_from(payload, CMD_INFO_REPLY.size)
+            self.device_info.update({
+                'formats': [f for i, f in enumerate(FORMATS) if formats >> i & 1],
+                'burst_frames': burst, 'frame_bytes': frame_bytes,
+                'sinks': [k for i, k in enumerate(SINKS) if sinks >> i & 1],
+                'timing': timing, 'profiles': profiles, 'fm_hz': fm_hz,
+                'frame_us': frame_us,
+            })
+            if frame_bytes != FRAME_SIZE:
+                print(f"Device frames are {frame_bytes} bytes, "
+                      f"this host expects {FRAME_SIZE}")
+        offset = CMD_INFO_REPLY.size + CMD_CAPS.size
+        if len(payload) >= offset + CMD_SENSOR.size:
+            (sensor, flags, shield_start, shield_count, active_start,
+             active_count) = CMD_SENSOR.unpack_from(payload, offset)
+            self.device_info['sensor'] = {
+                'name': SENSORS[sensor] if sensor < len(SENSORS) else sensor,
+                'shutter': bool(flags & 1), 'rises': bool(flags & 2),
+                'shield': (shield_start, shield_count),
+                'active': (active_start, active_count),
+            }
+        if protocol != CMD_PROTOCOL:
+            print(f"Device speaks command protocol {protocol}, "
+                  f"this host {CMD_PROTOCOL}")
+
+    def _time_sample(self, seq, t3, payload):
+        """One NTP-style exchange: t0 sent and t3 received on the host, t1
+        received and t2 sent on the device. The reply also says when the
+        previous reply really left (it was only queued when stamped), and
+        that exchange is corrected."""
+        rx, tx, prev, prev_seq, hz = CMD_TIME_REPLY.unpack(payload)
+        t0 = self.time_pings.pop(seq, None)
+        if not hz: return
+        if prev:
+            for smp in reversed(self.time_samples[-4:]):
+                if smp['seq'] == prev_seq:
+                    smp['t2'] = max(smp['t2'], prev / hz)
+                    break
+        if t0 is None or not rx: return
+        if self.time_samples and rx / hz < self.time_samples[-1]['t1']:
+            self.time_samples = []  # Device restarted
+        self.time_samples.append({'seq': seq, 't0': t0, 't1': rx / hz,
+                                  't2': tx / hz, 't3': t3})
+        del self.time_samples[:-TIME_SYNC_SAMPLES]
+        self._fit_clock()
+
+    def _fit_clock(self):
+        """Line through the exchanges with the shortest round trip (the
+        least queueing on either side): offset from their midpoints, drift
+        from the slope once they span a few seconds."""
+        smp = sorted(self.time_samples,
+                     key=lambda s: (s['t3'] - s['t0']) - (s['t2'] - s['t1']))
+        smp = smp[:max(4, len(smp) // 4)]
+        dev = np.array([(s['t1'] + s['t2']) / 2 for s in smp])
+        host = np.array([(s['t0'] + s['t3']) / 2 for s in smp])
+        if len(smp) >= 4 and dev.max() - dev.min() > 5.0:
+            b, a = np.polyfit(dev - dev[0], host, 1)
+            a -= b * dev[0]
+        else:
+            b, a = 1.0, float(np.mean(host - dev))
+        self.time_fit = (a, b)
+        self.clock_drift_ppm = (b - 1.0) * 1e6
+        best = smp[0]
+        self.sync_error_us = ((best['t3'] - best['t0']) - (best['t2'] - best['t1'])) / 2 * 1e6
+
+    def device_to_host(self, t_device):
+        """Device time (seconds, CCD_FrameInfo_t timestamp / clock_hz) as
+        host wall-clock time, or None before the first exchange"""
+        if self.time_fit is None: return None
+        a, b = self.time_fit
+        return a + b * t_device + self.wall_offset
+
+    def _read_hdr(self):
+        """Merged bracket: signal above dark in counts at the longest
+        exposure, float32 (may exceed 65535). Kept in hdr_frame."""
+        hdr = self._read(HDR_HEADER_SIZE - 2)
+        if len(hdr) != HDR_HEADER_SIZE - 2:
+            return None
+        frame_num, count, _, dropped, *t_us = struct.unpack('<HBBH4I', hdr)
+        data = self._read(CCD_PIXELS * 4)
+        if len(data) == CCD_PIXELS * 4:
+            with self.lock:
+                self.hdr_frame = {
+                    'frame_num': frame_num, 'dropped': dropped,
+                    't_us': t_us[:count],
+                    'signal': np.frombuffer(data, dtype='<f4').copy()
+                }
+        return None
+
+    def _read_phase_report(self):
+        hdr = self._read(2)
+        if len(hdr) != 2:
+            return None
+        count, best = hdr[0], hdr[1]
+        data = self._read(count * PHASE_RESULT_SIZE)
+        if len(data) == count * PHASE_RESULT_SIZE:
+            results = []
+            for i in range(count):
+                phase, sample, _, signal, noise = struct.unpack_from(
+                    '<HBBII', data, i * PHASE_RESULT_SIZE)
+                results.append({
+                    'phase': phase,
+                    'sample_cycles': PHASE_SAMPLE_CYCLES[sample]
+                    if sample < len(PHASE_SAMPLE_CYCLES) else sample,
+                    'signal': signal / 256.0,
+                    'noise': noise / 256.0
+                })
+            self.phase_report = {'best': best, 'results': results}
+        return None
+
+    def _read_shaped(self):
+        """ROI/binned frame, expanded back to CCD_PIXELS for display and
+        recording. Pixels outside every window read as 65535 (no light)."""
+        n = SHAPED_HEADER_SIZE - 2
+        if not self._fill(n): return None
+        info = self._frame_info(self.rx, SHAPED_HEADER_SIZE)
+        if info is None: return None
+        frame_num = struct.unpack_from('<H', self.rx)[0]
+        bin_factor, n_windows, count, bits, codec, nbytes, ref = \
+            struct.unpack_from('<BBHBBHH', self.rx, 2 + FRAME_INFO.size)
+        if info['payload_len'] != n_windows * 4 + nbytes or bin_factor == 0:
+            return None
+        size = n + info['payload_len']
+        if not self._fill(size): return None
+        if not self._crc_ok(info, self.rx, size, struct.pack('<H', SHAPED_MAGIC)):
+            return None
+        body = bytes(self.rx[:size])
+        del self.rx[:size]
+        self._flow_received()
+        win = body[n:n + n_windows * 4]
+        data = body[n + n_windows * 4:]
+        shift = 16 - bits
+        if codec == CODEC_TEMPORAL:
+            # Needs the exact frame it was coded against; otherwise wait for
+            # a keyframe (and ask for one right away)
+            if self.codec_ref is None or self.codec_ref[0] != ref or \
+                    len(self.codec_ref[1]) != count:
+                self.codec_ref = None
+                if not self.keyframe_requested:
+                    self.keyframe_requested = True
+                    self.serial.write(b"CK")
+                return None
+        buf = self.decode_bufs[self.decode_flip]
+        if codec == CODEC_TEMPORAL:
+            depth = rice_decode(data, count, bits, self.codec_ref[1], buf)
+        elif codec == CODEC_RICE:
+            depth = rice_decode(data, count, bits, out=buf)
+        else:
+            depth = buf[:count]
+            np.right_shift(unpack_pixels(data, count, bits), shift, out=depth)
+        self.codec_ref = (frame_num, depth)
+        self.decode_flip ^= 1
+        if codec != CODEC_TEMPORAL:
+            self.keyframe_requested = False
+        values = (depth << shift).astype(np.uint16)
+        if n_windows == 0:
+            windows = [(0, CCD_PIXELS)]
+        else:
+            windows = [struct.unpack_from('<HH', win, 4 * i) for i in range(n_windows)]
+        pixels = np.full(CCD_PIXELS, 65535, dtype=np.uint16)
+        pos = 0
+        for start, length in windows:
+            n = length // bin_factor
+            chunk = np.repeat(values[pos:pos + n], bin_factor)
+            pixels[start:start + len(chunk)] = chunk[:CCD_PIXELS - start]
+            pos += n
+        self.bin_factor = bin_factor
+        self.roi_windows = windows if n_windows else []
+        self._track_info(info)
+        return frame_num, pixels
+
+    def _handle_recording(self, frame_num, pixels):
+        if self.recorder and (self.recording or
+                              (self.recording_conditional and not self.frozen)):
+            info = self.frame_info
+            host_time = info.get('host_time') if info else None
+            # Capture (ICG) time on the host clock once synced, else when
+            # the frame was parsed
+            self.recorder.add(frame_num, info,
+                              host_time if host_time is not None else time.time(),
+                              pixels)
+        if self.events:
+            info = self.frame_info
+            host_time = info.get('host_time') if info else None
+            self.events.add(frame_num, info,
+                            host_time if host_time is not None else time.time(),
+                            pixels)
+            
+    def start_recording(self, path, metadata=None):
+        """Stream frames to path: .ccdrec (open_recording()) or .ccdarc
+        (Archive, with metadata in its header)"""
+        with self.lock:
+            if self.recorder: self.recorder.close()
+            self.recorder = FrameRecorder(path, metadata)
+            self.recording = True
+        return self.recorder
+
+    def start_event_recording(self, path, criteria=(), pre=EVENT_PRE,
+                              post=EVENT_POST, max_frames=None, metadata=None,
+                              ring_path=None):
+        """Record only around events (EventRecorder): each time one of
+        criteria holds, or trigger_event() is called, the pre frames before
+        it and the frames up to post after the last trigger go to the next
+        file of path. Runs beside start_recording(), which is unaffected."""
+        with self.lock:
+            if self.events: self.events.close()
+            self.events = EventRecorder(path, criteria, pre, post, max_frames,
+                                        metadata, ring_path)
+        return self.events
+
+    def trigger_event(self):
+        """An external event: the next frame starts (or extends) one"""
+        with self.lock:
+            if self.events: self.events.trigger()
+
+    def stop_event_recording(self):
+        """End event recording, closing an event in progress: its
+        status() (events, frames, files)"""
+        with self.lock:
+            events, self.events = self.events, None
+        if events is None: return None
+        events.close()
+        return events.status()
+
+    def stop_recording(self):
+        """Frames recorded since start_recording(); the file gets the last
+        of them in the background"""
+        with self.lock:
+            recorder, self.recorder = self.recorder, None
+            self.recording = False
+        if recorder is None: return 0
+        recorder.close()
+        if recorder.dropped:
+            print(f"Recording dropped {recorder.dropped} frames")
+        return recorder.frames
+
+    def set_peak_tracking(self, threshold, min_distance=100, smooth_window=11,
+                          use_smoothing=True):
+        """Follow the peaks of every frame received (see PeakDetector.track)
+        into tracked_peaks, as pixel positions; threshold None stops"""
+        if threshold is None:
+            self.peak_tracker, self.tracked_peaks = None, np.zeros(0)
+            return
+        t = PeakDetector()
+        t.threshold, t.min_distance = threshold, min_distance
+        t.smooth_window, t.use_smoothing = smooth_window, use_smoothing
+        self.peak_tracker = t
+
+    def set_pipeline(self, pipeline):
+        """Run a HostPipeline on every frame received, its peaks (the
+        PEAK_TRACK_MAX highest) into tracked_peaks in place of the
+        tracker's; None stops"""
+        self.pipeline = pipeline
+        if pipeline is None: self.tracked_peaks = np.zeros(0)
+
+    def _handle_singleshot(self):
+        if self.pending_single_shot:
+            self.pending_single_shot = False
+            self.frozen = True
+        
+    @_restored
+    def set_mode(self, mode_idx):
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"M{mode_idx}".encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_binning(self, factor):
+        """Device-side binning: 1 (off), 2, 4 or 8"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"B{factor}".encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_packing(self, bits):
+        """Device-side pixel packing: 16 (off), 12 or 14 bits"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"P{bits}".encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_compression(self, codec):
+        """Device-side lossless compression: 0 (off), CODEC_RICE or
+        CODEC_TEMPORAL"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"C{codec}".encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_change_detection(self, threshold, heartbeat_ms=1000):
+        """Device sends a frame only when it differs from the last one sent by
+        more than threshold counts per pixel (0 = every frame), or at least
+        every heartbeat_ms"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"H{heartbeat_ms}".encode('ascii'))
+                self.serial.write(f"E{threshold}".encode('ascii'))
+            except:
+                self._lost()
+
+    def start_burst(self, count, pre=0):
+        """Capture count frames at full rate on the device and drain them
+        afterwards. With pre > 0 the device keeps that many frames of history
+        and waits for trigger_burst()."""
+        if self.connected and self.serial:
+            cmd = f"X{count}:{pre}" if pre else f"X{count}"
+            try:
+                self.serial.write(cmd.encode('ascii'))
+            except:
+                self._lost()
+
+    def trigger_burst(self):
+        if self.connected and self.serial:
+            try:
+                self.serial.write(b"XT")
+            except:
+                self._lost()
+
+    @_restored
+    def set_burst_triggers(self, pin=False, level=0):
+        """Extra burst triggers besides trigger_burst(): a rising edge on the
+        trigger input, and/or any pixel below level counts (0 = off)"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(b"XE1" if pin else b"XE0")
+                self.serial.write(f"XL{level}".encode('ascii'))
+            except:
+                self._lost()
+
+    def abort_burst(self):
+        if self.connected and self.serial:
+            try:
+                self.serial.write(b"X0")
+            except:
+                self._lost()
+
+    def request_burst_status(self):
+        """Reply arrives in burst_status"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(b"XS")
+            except:
+                self._lost()
+
+    def phase_command(self, req):
+        """ADC sample phase: '1' sweep (reply in phase_report), '0' abort,
+        'S' save to flash, 'L' reload from flash"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"F{req}".encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_samples_per_pixel(self, n):
+        """ADC samples averaged per pixel on the device: 1, 2 or 4"""
+        if self.connected and self.serial and n in (1, 2, 4):
+            try:
+                self.serial.write(f"I{n}".encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_cds(self, enable):
+        """Correlated double sampling: pixel = 0xFFFF - (reset - signal)"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(b"K1" if enable else b"K0")
+            except:
+                self._lost()
+
+    @_restored
+    def set_noise_profile(self, profile):
+        """Readout speed profile (CCD_LN_TABLE): 0 = normal; the others slow
+        fM for lower noise and a lower frame rate: 1/2 with ADC
+        oversampling, 3/4 with longer ADC sampling; the fast timing build
+        adds 0.8 MHz, 5 with long sampling and 6 oversampled"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"O{int(profile)}".encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_source(self, source):
+        """Sample source: SOURCE_ADC, SOURCE_SPI (external ADC builds),
+        SOURCE_PATTERN (synthetic line, no sensor needed) or SOURCE_DUAL
+        (two heads, CCD_DUAL_SENSOR builds; pairs into dual_frame)"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"V{int(source)}".encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_sync(self, role):
+        """Board sync: 0 = off, 1 = master (drives PA1), 2 = slave (PA15 in),
+        3 = mains line sync (CCD_LINE_SYNC builds, see set_line_sync)"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"Y{role}".encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_strobe(self, delay_us, width_us):
+        """Strobe output pulse, us from the start of each ICG period (0 = off)"""
+        if self.connected and self.serial:
+            try:
+                if width_us:
+                    self.serial.write(f"S{int(delay_us)}:{int(width_us)}".encode('ascii'))
+                else:
+                    self.serial.write(b"S0")
+            except:
+                self._lost()
+
+    @_restored
+    def set_exposure(self, period_us, pulse_us):
+        """Fast-shutter SH period and pulse in us, applied at the next ICG
+        without restarting acquisition (modes 0, 1 and 3)"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"L{int(period_us)}:{int(pulse_us)}".encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_auto_exposure(self, enable, target=None, min_us=None, max_us=None,
+                          percentile=None):
+        """Device auto-exposure ("U"); settings are sent before the enable.
+        target is the signal in counts below the dark level."""
+        if self.connected and self.serial:
+            try:
+                if target is not None:
+                    self.serial.write(f"UT{int(target)}".encode('ascii'))
+                if min_us is not None and max_us is not None:
+                    self.serial.write(f"UL{int(min_us)}:{int(max_us)}".encode('ascii'))
+                if percentile is not None:
+                    self.serial.write(f"UP{int(percentile)}".encode('ascii'))
+                self.serial.write(b"U1" if enable else b"U0")
+            except:
+                self._lost()
+
+    @_restored
+    def set_bracket(self, times_us):
+        """Exposure bracketing in mode 0: 2-4 integration times in us, one
+        per frame, merged on the device into hdr_frame. [] = off."""
+        if self.connected and self.serial:
+            try:
+                if times_us:
+                    self.serial.write(("Q" + ":".join(str(int(t)) for t in times_us)).encode('ascii'))
+                else:
+                    self.serial.write(b"Q0")
+            except:
+                self._lost()
+
+    @_restored
+    def set_hdr_saturation(self, level):
+        """Raw level at or below which a bracket sample counts as saturated"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"QS{int(level)}".encode('ascii'))
+            except:
+                self._lost()
+
+    def set_sequence(self, steps, repeats=1):
+        """Upload a sequence table: dicts with t_us, outputs and optional
+        coadd (1), delay_ms (0) and trigger (False). repeats 0 = endless."""
+        if self.connected and self.serial:
+            try:
+                for i, st in enumerate(steps):
+                    self.serial.write((f"ZW{i}:{int(st['t_us'])}:{int(st['outputs'])}:"
+                                       f"{int(st.get('coadd', 1))}:{int(st.get('delay_ms', 0))}:"
+                                       f"{int(bool(st.get('trigger', False)))}").encode('ascii'))
+                self.serial.write(f"ZN{len(steps)}".encode('ascii'))
+                self.serial.write(f"ZR{int(repeats)}".encode('ascii'))
+            except:
+                self._lost()
+
+    def sequence_command(self, cmd):
+        """Sequence control: "ZG" start (switches to mode 0), "Z0" stop,
+        "ZT" trigger, "ZS" status into seq_status"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(cmd.encode('ascii'))
+            except:
+                self._lost()
+
+    def _command_frame(self, ctype, value=b""):
+        seq = self.cmd_seq
+        self.cmd_seq = (seq + 1) & 0xFF
+        body = bytes((seq, ctype, len(value))) + value
+        return bytes((CMD_SYNC,)) + body + bytes(((0xFF - sum(body)) & 0xFF,)), seq
+
+    def send_commands(self, commands):
+        """Binary commands in one write: (CMD_*, value bytes) pairs, applied
+        in order by the device with one restart at most. Returns their
+        sequence numbers; the outcomes land in cmd_acks."""
+        seqs = []
+        if self.connected and self.serial:
+            data = b""
+            for ctype, value in commands:
+                frame, seq = self._command_frame(ctype, value)
+                data += frame
+                seqs.append(seq)
+            try:
+                self.serial.write(data)
+            except:
+                self._lost()
+        return seqs
+
+    @_restored
+    def configure(self, mode=None, exposure=None, integration_us=None, roi=None,
+                  binning=None, coadd=None, rolling=None, atomic=False):
+        """Pipelined configuration over the binary protocol; exposure is
+        (period_us, pulse_us), roi a list of (start, length). atomic sends
+        the settings after mode as one transaction (begin_config())"""
+        cmds = []
+        if mode is not None:
+            cmds.append((CMD_MODE, struct.pack('<B', mode)))
+        if atomic:
+            cmds.append((CMD_TELEMETRY, bytes((TELEM_TXN, TXN_BEGIN))))
+        if exposure is not None:
+            cmds.append((CMD_EXPOSURE, struct.pack('<2I', *exposure)))
+        if integration_us is not None:
+            cmds.append((CMD_INTEGRATION, struct.pack('<I', integration_us)))
+        if roi is not None:
+            cmds.append((CMD_ROI, b"".join(struct.pack('<2H', s, n) for s, n in roi)))
+        if binning is not None:
+            cmds.append((CMD_BINNING, struct.pack('<B', binning)))
+        if coadd is not None:
+            cmds.append((CMD_COADD, struct.pack('<H', coadd)))
+        if rolling is not None:
+            cmds.append((CMD_ROLLING, struct.pack('<H', rolling)))
+        if atomic:
+            cmds.append((CMD_TELEMETRY, bytes((TELEM_TXN, TXN_COMMIT))))
+        return self.send_commands(cmds)
+
+    def sync_time(self):
+        """Send a clock sync ping (CMD_TIME). read_frame() does so every
+        TIME_SYNC_INTERVAL; the fit lands in time_fit, clock_drift_ppm and
+        sync_error_us (half the best round trip: the bound on the offset)."""
+        self.last_time_ping = time.perf_counter()
+        if self.connected and self.serial:
+            frame, seq = self._command_frame(CMD_TIME)
+            try:
+                self.time_pings[seq] = time.perf_counter()
+                self.serial.write(frame)
+            except:
+                self._lost()
+
+    @_restored
+    def set_flow(self, policy, window=8):
+        """Credit-based flow control: the device sends at most window
+        frames ahead of those parsed here, and out of credit applies policy
+        (FLOW_POLICIES: hold them in its ring, decimate, or co-add) instead
+        of losing frames in the host's buffers. "off" sends freely."""
+        policy = FLOW_POLICIES.index(policy) if isinstance(policy, str) else policy
+        self.flow_window = window if policy else 0
+        self.flow_received = 0
+        self.flow_crc_base = self.crc_errors
+        self.flow_granted = self.flow_window
+        cmds = [(CMD_FLOW, struct.pack('<B', policy))]
+        if policy:
+            cmds.append((CMD_CREDIT, struct.pack('<I', self.flow_granted)))
+        return self.send_commands(cmds)
+
+    def _flow_received(self):
+        """One frame taken: top the grant up to window frames ahead once
+        half of it is used. Frames rejected by their CRC were sent too, so
+        they count, or every bad frame would shrink the window for good."""
+        if not self.flow_window: return
+        self.flow_received += 1
+        taken = self.flow_received + self.crc_errors - self.flow_crc_base
+        limit = (taken + self.flow_window) & 0xFFFFFFFF
+        if ((limit - self.flow_granted) & 0xFFFFFFFF) >= max(self.flow_window // 2, 1):
+            self.flow_granted = limit
+            self.send_commands([(CMD_CREDIT, struct.pack('<I', limit))])
+
+    def request_info(self):
+        """Firmware description into device_info (binary CMD_INFO). Stays
+        None with firmware older than the command."""
+        return self.send_commands([(CMD_INFO, b"")])
+
+    def choose_fastest(self, hs_port=None, eth=False):
+        """Settings for the highest frame rate the device says it can do
+        (device_info, request_info() first): temporal Rice coding if the
+        build has it, else Rice, and the frames over the HS port (hs_port,
+        its tty) or the Ethernet multicast when asked for and present.
+        Without either, adjacent frames are batched into one transfer when
+        nothing is coded. Returns what was chosen, or None when the firmware
+        predates the capabilities."""
+        caps = self.device_info
+        if not caps or 'formats' not in caps: return None
+        chosen = {}
+        for codec, name in ((CODEC_TEMPORAL, "temporal"), (CODEC_RICE, "rice")):
+            if name in caps['formats']:
+                self.set_compression(codec)
+                chosen['codec'] = name
+                break
+        if hs_port and "usb_hs" in caps['sinks'] and self.open_dual(hs_port):
+            chosen['link'] = "dual"
+        elif eth and "eth" in caps['sinks'] and self.open_eth():
+            chosen['link'] = "eth"
+        elif 'codec' not in chosen and not self.link2:
+            self.send_commands([(CMD_TRANSPORT, struct.pack('<B', TX_BATCH))])
+            chosen['link'] = "batch"
+        return chosen
+
+    def record(self, action=REC_STATUS):
+        """SD card recording (CCD_SD=1 builds): REC_START, REC_STOP or
+        REC_STATUS. Every action answers with the state into rec_status.
+        While recording, USB only gets a preview frame now and then."""
+        return self.send_commands([(CMD_RECORD, struct.pack('<B', action))])
+
+    @_restored
+    def set_frame_stats(self, mode=STATS_ONLY, level=SAT_LEVEL):
+        """STATS_ONLY: the device sends per-frame statistics (frame_stats)
+        instead of the frames, a few bytes per frame at the full rate.
+        Pixels below level count as saturated."""
+        return self.send_commands([(CMD_FRAME_STATS, struct.pack('<BH', mode, level))])
+
+    @_restored
+    def set_device_peaks(self, mode=PEAKS_ONLY, threshold=15000,
+                         min_distance=100, fit=FIT_PARABOLA):
+        """PEAKS_ONLY: the device sends each frame's peak list (device_peaks)
+        instead of the frame. threshold and min_distance as in PeakDetector;
+        smoothing is set_device_smoothing()."""
+        return self.send_commands([(CMD_PEAKS, struct.pack(
+            '<BBHH', mode, fit, threshold, max(min_distance, 1)))])
+
+    @_restored
+    def set_device_bands(self, bands=()):
+        """Turn the device into a photometer: each frame becomes one value
+        per band (device_bands), the light (65535 - pixel) summed over the
+        band times its weight, with the frame's timestamp. bands holds up to
+        16 (start, length) or (start, length, weight) tuples in sensor
+        pixels, weight 1.0 by default and below 16; () sends frames again.
+        Device statistics or peaks, when on, are sent instead."""
+        packed = [BAND.pack(b[0], b[1], min(round((b[2] if len(b) > 2 else 1.0)
+                                                  * BAND_UNITY), 0xFFFF))
+                  for b in bands[:BANDS_MAX]]
+        per = (CMD_VALUE_MAX - 2) // BAND.size
+        chunks = [packed[i:i + per] for i in range(0, len(packed), per)] or [[]]
+        return self.send_commands([
+            (CMD_TELEMETRY, bytes((TELEM_BANDS, i * per |
+                                   (BANDS_APPLY if i == len(chunks) - 1 else 0)))
+             + b''.join(c))
+            for i, c in enumerate(chunks)])
+
+    @_restored
+    def set_focus_lines(self, lines=()):
+        """Focus and alignment at the frame rate: each frame becomes the
+        height, centre and full width at half maximum of every line in
+        lines, up to 16 (start, length) pixel windows of 3 to 255 pixels
+        with one line each, into device_focus and focus_track. A line that
+        stays above half height to an edge of its window has no width.
+        () sends frames again; device statistics, peaks or bands, when on,
+        are sent instead."""
+        if len(lines) > FOCUS_MAX:
+            raise ValueError(f"{len(lines)} focus lines, {FOCUS_MAX} at most")
+        for start, length in lines:
+            if (not FOCUS_LEN[0] <= length <= FOCUS_LEN[1]
+                    or start < 0 or start + length > CCD_PIXELS):
+                raise ValueError(f"focus window {(start, length)!r}")
+        packed = [FOCUS_LINE.pack(start, length) for start, length in lines]
+        per = (CMD_VALUE_MAX - 2) // FOCUS_LINE.size
+        chunks = [packed[i:i + per] for i in range(0, len(packed), per)] or [[]]
+        return self.send_commands([
+            (CMD_TELEMETRY, bytes((TELEM_FOCUS, i * per |
+                                   (BANDS_APPLY if i == len(chunks) - 1 else 0)))
+             + b''.join(c))
+            for i, c in enumerate(chunks)])
+
+    def request_focus(self):
+        """The focus lines into focus_status: lines applied, frames sent,
+        line values without a width, and the last frame's mean 'fwhm'
+        in pixels over its 'resolved' lines"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_FOCUS, TELEM_KEEP)))])
+
+    @_restored
+    def set_despike(self, mode="sigma", sigma=5.0, floor=200):
+        """Cosmic-ray and spike rejection on the device, ahead of its co-add
+        and rolling mean: "median" sends every pixel as the median of its
+        frame and the two before, "sigma" replaces by that median only the
+        pixels more than sigma noise sigmas (1.4826 times the median absolute
+        deviation of the three) and floor counts away from it; "off" sends
+        frames as they are. despike_status counts the replaced pixels."""
+        if mode not in DESPIKE_MODES:
+            raise ValueError(f"spike rejection mode {mode!r}")
+        if not DESPIKE_SIGMA_MIN <= sigma <= 25.5:
+            raise ValueError(f"spike rejection sigma {sigma} out of range")
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBBH', TELEM_DESPIKE, DESPIKE_MODES.index(mode),
+            round(sigma * 10), min(max(int(floor), 0), 0xFFFF)))])
+
+    def request_despike(self):
+        """The spike rejection settings and counters into despike_status"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_DESPIKE, TELEM_KEEP)))])
+
+    def detect_defects(self, hot=500, dead=0.2):
+        """Map and replace defect pixels on the device: hot ones further than
+        hot counts from the median of their four neighbours in the master
+        dark ("D<m>" first), dead or weak ones whose flat-field gain is more
+        than dead (a fraction of unity) from theirs (flat field applied).
+        None skips a check. Each defect is then sent interpolated between
+        its nearest good neighbours; save_defects() keeps the map."""
+        h = 0 if hot is None else min(max(int(hot), 1), 0xFFFF)
+        d = 0 if dead is None else min(max(round(dead * 32768), 1), 0xFFFF)
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBHH', TELEM_DEFECT, DEFECT_DETECT, h, d))])
+
+    def set_defects(self, pixels):
+        """Replace the device's defect map with these pixel indices and
+        turn the replacement on"""
+        bitmap = bytearray(DEFECT_BYTES)
+        for i in pixels:
+            if not 0 <= i < CCD_PIXELS:
+                raise ValueError(f"defect pixel {i} out of range")
+            bitmap[i >> 3] |= 1 << (i & 7)
+        step = CMD_VALUE_MAX - 4
+        cmds = [(CMD_TELEMETRY, struct.pack('<BBH', TELEM_DEFECT, DEFECT_WRITE,
+                                            i) + bytes(bitmap[i:i + step]))
+                for i in range(0, DEFECT_BYTES, step)]
+        cmds.append((CMD_TELEMETRY, bytes((TELEM_DEFECT, DEFECT_ON))))
+        return self.send_commands(cmds)
+
+    def read_defects(self):
+        """The device's defect map into defect_map (a bitmap, pixel i in
+        bit i & 7 of byte i // 8) and its totals into defect_status; see
+        defect_pixels()"""
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBH', TELEM_DEFECT, DEFECT_READ, i))
+                for i in range(0, DEFECT_BYTES, DEFECT_CHUNK)])
+
+    def defect_pixels(self):
+        """The pixel indices in defect_map"""
+        return [i for i in range(CCD_PIXELS)
+                if self.defect_map[i >> 3] >> (i & 7) & 1]
+
+    def set_defects_enabled(self, enable):
+        """Replace the mapped pixels or send them as they are; the map stays"""
+        return self.send_commands([(CMD_TELEMETRY, bytes((
+            TELEM_DEFECT, DEFECT_ON if enable else DEFECT_OFF)))])
+
+    def save_defects(self):
+        """Keep the defect map in the device's flash (blocks it ~2 s); it is
+        applied from there at boot"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_DEFECT, DEFECT_SAVE)))])
+
+    def clear_defects(self):
+        """Empty the device's defect map (flash keeps the saved one)"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_DEFECT, DEFECT_CLEAR)))])
+
+    def start_ptc(self, exposures_us=(0,), frames=64):
+        """Photon transfer run on the device: frames consecutive frames per
+        integration time in exposures_us (0 = as set; a sweep from dark to
+        near saturation makes the curve), summed per pixel in mode 0 with
+        auto-exposure off. Only the mean and variance maps of each level
+        come back, into ptc['levels']; photon_transfer() fits them. The
+        integration time is restored at the end."""
+        times = [int(t) for t in exposures_us]
+        if not 1 <= len(times) <= PTC_LEVELS:
+            raise ValueError(f"{len(times)} photon transfer levels")
+        if not 2 <= frames <= 0xFFFF:
+            raise ValueError(f"{frames} frames per level")
+        cmds = [(CMD_TELEMETRY, struct.pack(
+            f'<BBB{len(chunk)}I', TELEM_PTC, PTC_SET, i, *chunk))
+                for i in range(0, len(times), PTC_SET_CHUNK)
+                for chunk in [times[i:i + PTC_SET_CHUNK]]]
+        cmds.append((CMD_TELEMETRY, struct.pack('<BBH', TELEM_PTC, PTC_START,
+                                                frames)))
+        return self.send_commands(cmds)
+
+    def stop_ptc(self):
+        """End a photon transfer run; levels already sent stay in ptc"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_PTC, PTC_STOP)))])
+
+    def request_ptc(self):
+        """The photon transfer run's progress into ptc_status"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_PTC, TELEM_KEEP)))])
+
+    @_restored
+    def set_drift(self, mode="track", correct=False):
+        """Spectral drift tracking on the device against the reference of
+        capture_drift_reference(): "track" measures every frame's shift of
+        the band into drift_status, "only" sends a drift record
+        (device_drift, drift_track) instead of each frame. With correct the
+        resampling grid of set_wavelength(resample=True) follows the
+        smoothed shift, so resampled frames stay on their wavelengths."""
+        if mode not in DRIFT_MODES:
+            raise ValueError(f"drift mode {mode!r}")
+        return self.send_commands([(CMD_TELEMETRY, bytes((
+            TELEM_DRIFT, DRIFT_MODE, DRIFT_MODES.index(mode), int(bool(correct)))))])
+
+    def capture_drift_reference(self, frames=16):
+        """Average the next frames into the drift reference; the shifts and
+        their extremes start again from it. Not kept over a reboot."""
+        if not 1 <= frames <= DRIFT_REF_MAX:
+            raise ValueError(f"drift reference of {frames} frames")
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBH', TELEM_DRIFT, DRIFT_REF, frames))])
+
+    def set_drift_band(self, start, length, lag=16):
+        """Correlate pixels start..start + length (even) at shifts of up to
+        +-lag pixels; the window with its lags must stay within the line.
+        Drops the reference."""
+        if length % 2 or not 1 <= lag <= DRIFT_LAG_MAX or start < lag or \
+                start + length + lag > CCD_PIXELS:
+            raise ValueError(f"drift band {start}+{length} +-{lag} out of range")
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBHHB', TELEM_DRIFT, DRIFT_BAND, start, length, lag))])
+
+    def request_drift(self):
+        """The drift band, reference and shifts into drift_status"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_DRIFT, TELEM_KEEP)))])
+
+    @_restored
+    def set_matching(self, mode="only", threshold=0.9):
+        """Classify every frame on the device against its reference library:
+        the normalised dot product of the binned spectrum, mean removed,
+        with each reference. "only" sends a classification record
+        (device_match, match_track) instead of each frame: the best
+        reference if it scores threshold or more, else None, with the
+        runner-up and the latency from readout; "track" sends the frames on
+        and keeps the last decision for request_matching(). Kept over a
+        reboot, as the library saved with save_match_library()."""
+        if mode not in MATCH_MODES:
+            raise ValueError(f"matching mode {mode!r}")
+        if not 0.0 <= threshold <= 1.0:
+            raise ValueError(f"matching threshold {threshold} out of range")
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBBH', TELEM_MATCH, MATCH_MODE, MATCH_MODES.index(mode),
+            round(threshold * 32768)))])
+
+    def capture_match_reference(self, index, frames=16):
+        """Average the next frames, as the device processes them, into
+        reference index of the library"""
+        if not 0 <= index < MATCH_REFS or not 1 <= frames <= MATCH_REF_MAX:
+            raise ValueError(f"match reference {index} of {frames} frames")
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBBH', TELEM_MATCH, MATCH_CAPTURE, index, frames))])
+
+    def set_match_reference(self, index, spectrum):
+        """Upload a raw line (CCD_PIXELS counts, as frames arrive) or its
+        MATCH_BINS bin means as reference index"""
+        if not 0 <= index < MATCH_REFS:
+            raise ValueError(f"match reference {index} out of range")
+        values = [int(v) for v in spectrum]
+        if len(values) == CCD_PIXELS:
+            values = [(sum(values[i:i + MATCH_BIN]) + MATCH_BIN // 2) // MATCH_BIN
+                      for i in range(MATCH_FIRST, MATCH_FIRST + MATCH_BINS * MATCH_BIN,
+                                     MATCH_BIN)]
+        if len(values) != MATCH_BINS:
+            raise ValueError(f"match reference of {len(values)} values")
+        step = (CMD_VALUE_MAX - 5) // 2
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            f'<BBBH{len(values[i:i + step])}H', TELEM_MATCH, MATCH_WRITE, index, i,
+            *(min(max(v, 0), 0xFFFF) for v in values[i:i + step])))
+                for i in range(0, MATCH_BINS, step)])
+
+    def read_match_reference(self, index):
+        """Reference index's bin means into match_references[index]"""
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBBH', TELEM_MATCH, MATCH_READ, index, i))
+                for i in range(0, MATCH_BINS, MATCH_CHUNK)])
+
+    def clear_match_references(self, index=None):
+        """Drop reference index, or every reference"""
+        if index is None:
+            self.match_references.clear()
+        else:
+            self.match_references.pop(index, None)
+        return self.send_commands([(CMD_TELEMETRY, bytes((
+            TELEM_MATCH, MATCH_CLEAR, MATCH_NONE if index is None else index)))])
+
+    def save_match_library(self):
+        """Keep the reference library in the device's flash (blocks it ~2 s);
+        it is loaded from there at boot"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_MATCH, MATCH_SAVE)))])
+
+    def load_match_library(self):
+        """Go back to the library saved in flash"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_MATCH, MATCH_LOAD)))])
+
+    def request_matching(self):
+        """The last decision and the totals into match_status"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_MATCH, TELEM_KEEP)))])
+
+    @_restored
+    def set_model(self, mode="only", prep="none"):
+        """Apply the device's linear models (load_model()) to every frame:
+        "only" sends a model record (device_model, model_track) of the
+        values instead of each frame, with the latency from readout;
+        "track" sends the frames on and keeps the last values for
+        request_model(). prep is the preprocessing the model was built
+        with. Kept over a reboot, as the model saved with save_model()."""
+        if mode not in MODEL_MODES:
+            raise ValueError(f"model mode {mode!r}")
+        if prep not in MODEL_PREPS:
+            raise ValueError(f"model preprocessing {prep!r}")
+        return self.send_commands([(CMD_TELEMETRY, bytes((
+            TELEM_MODEL, MODEL_MODE, MODEL_MODES.index(mode),
+            MODEL_PREPS.index(prep))))])
+
+    def load_model(self, model, mode="only"):
+        """Upload a LinearModel as the device's models, output k of the
+        device being the model's output k, and apply it (set_model())"""
+        step = (CMD_VALUE_MAX - 5) // 2
+        cmds = [(CMD_TELEMETRY, bytes((TELEM_MODEL, MODEL_CLEAR, MODEL_NONE)))]
+        for k, (w, scale, offset) in enumerate(model.device_loadings()):
+            cmds += [(CMD_TELEMETRY, struct.pack(
+                f'<BBBH{len(w[i:i + step])}h', TELEM_MODEL, MODEL_WRITE, k, i,
+                *(int(v) for v in w[i:i + step])))
+                for i in range(0, MODEL_BINS, step)]
+            cmds.append((CMD_TELEMETRY, struct.pack(
+                '<BBBff', TELEM_MODEL, MODEL_SCALE, k, scale, offset)))
+        self.model_loadings.clear()
+        return self.send_commands(cmds) + self.set_model(mode, model.prep)
+
+    def read_model_loadings(self, output):
+        """Output's int16 loadings into model_loadings[output], its scale
+        and offset into model_status"""
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBBH', TELEM_MODEL, MODEL_READ, output, i))
+                for i in range(0, MODEL_BINS, MODEL_CHUNK)])
+
+    def clear_model(self, output=None):
+        """Drop output, or every output"""
+        if output is None:
+            self.model_loadings.clear()
+        else:
+            self.model_loadings.pop(output, None)
+        return self.send_commands([(CMD_TELEMETRY, bytes((
+            TELEM_MODEL, MODEL_CLEAR, MODEL_NONE if output is None else output)))])
+
+    def save_model(self):
+        """Keep the models in the device's flash (blocks it ~2 s); they
+        are loaded from there at boot"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_MODEL, MODEL_SAVE)))])
+
+    def load_saved_model(self):
+        """Go back to the models saved in flash"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_MODEL, MODEL_LOAD)))])
+
+    def request_model(self):
+        """The last values and the totals into model_status"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_MODEL, TELEM_KEEP)))])
+
+    def set_tsdb(self, sink):
+        """Queue the band (set_device_bands()), statistics and model
+        records, and the host model's outputs, to a TsdbSink, tagged with
+        the board's serial number unless it has a device; None stops"""
+        if sink is not None and sink.device is None:
+            sink.device = self.device_serial or self.port
+        self.tsdb = sink
+
+    def set_host_model(self, model):
+        """Apply a LinearModel on the host to every frame received, its
+        outputs into model_values; None stops"""
+        self.host_model = model
+        self.model_values = None
+
+    @_restored
+    def set_wide_output(self, fmt="float"):
+        """Co-add and rolling outputs (configure(coadd=, rolling=)) as 32-bit
+        values into wide_frame instead of rounded 16-bit means: "sum" the
+        exact int32 sums, "float" the float32 means, "off" the 16-bit
+        frames again. The device stages after the average (change
+        detection, absorbance, smoothing, drift, resampling, matching,
+        statistics, peaks, bands and shaping) are skipped for them, and
+        they only go out over USB. Counters in wide_status."""
+        if fmt not in WIDE_FORMATS:
+            raise ValueError(f"wide format {fmt!r}")
+        return self.send_commands([(CMD_TELEMETRY, bytes((
+            TELEM_WIDE, WIDE_FORMATS.index(fmt))))])
+
+    def request_wide_output(self):
+        """The wide format and its dropped outputs into wide_status"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_WIDE, TELEM_KEEP)))])
+
+    def set_saturation(self, mode="flag", level=None):
+        """ADC watchdog saturation flag: "flag" marks every frame with a
+        conversion at or below level (raw counts, as in the frame; None
+        keeps the device's), "ae" also has auto-exposure cut the time
+        mid-readout, "off" stops it. A change restarts the capture.
+        saturation_status['flagged'] lists the seq of flagged frames among
+        the last 32."""
+        if mode not in SAT_MODES:
+            raise ValueError(f"saturation mode {mode!r}")
+        value = bytes((TELEM_SATURATION, SAT_MODES.index(mode)))
+        if level is not None:
+            value += struct.pack('<H', level)
+        return self.send_commands([(CMD_TELEMETRY, value)])
+
+    def request_saturation(self):
+        """The saturation flag's state and counters into saturation_status"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_SATURATION, TELEM_KEEP)))])
+
+    def set_reference(self, mode="measure", target=None):
+        """Reference photodiode (firmware built with CCD_REF_PD): "measure"
+        reads the lamp's level over every frame's integration, "normalize"
+        also scales each frame's signal by target / level, and "off" stops
+        it. target is in ADC counts; 0 locks it to the next frame's level,
+        None keeps the device's. Switching on or off restarts the capture.
+        reference_status['levels'] maps the seq of the last frames to their
+        level in counts."""
+        if mode not in REF_MODES:
+            raise ValueError(f"reference mode {mode!r}")
+        value = bytes((TELEM_REFERENCE, REF_MODES.index(mode)))
+        if target is not None:
+            value += struct.pack('<I', round(target * 16))
+        return self.send_commands([(CMD_TELEMETRY, value)])
+
+    def request_reference(self):
+        """The reference photodiode's levels into reference_status"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_REFERENCE, TELEM_KEEP)))])
+
+    def set_input_edges(self, edge="rising"):
+        """Digital inputs (firmware built with CCD_DIN): timestamp the
+        "rising", "falling" or "both" edges of the first input (PE8) on the
+        frame clock, or stop ("off"). The setting is not kept."""
+        if edge not in INPUT_EDGES:
+            raise ValueError(f"input edge {edge!r}")
+        return self.send_commands([(CMD_TELEMETRY, bytes(
+            (TELEM_INPUTS, INPUT_EDGES.index(edge))))])
+
+    def request_inputs(self):
+        """The inputs latched with the last frames into inputs_status:
+        'levels' maps seq to the input bits at its ICG (bit 0 = PE8), 'late'
+        lists the frames read at completion instead, and 'edges' holds the
+        last edges as (seq, clock_hz ticks after its ICG, rising), newest first"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_INPUTS, TELEM_KEEP)))])
+
+    def set_line_sync(self, phase_deg=0.0, periods=1):
+        """Mains line sync (firmware built with CCD_LINE_SYNC): with
+        set_sync(SYNC_LINE) every frame starts phase_deg after the rising
+        zero crossing on PC6 and lasts the fewest whole mains periods, at
+        least periods, that hold the exposure; in mode 2 the integration
+        is that frame. The setting is not kept."""
+        phase = int(round(phase_deg * 10)) % 3600
+        if not 1 <= periods <= 255:
+            raise ValueError(f"mains periods {periods!r}")
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBHB', TELEM_MAINS, MAINS_SET, phase, periods))])
+
+    def request_line_sync(self):
+        """The mains lock into mains_status: 'locked', the line's 'freq_hz',
+        'used' periods per frame, and the crossings, glitches, triggers and
+        late arms counted since boot"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_MAINS, TELEM_KEEP)))])
+
+    @_restored
+    def set_live_dark(self, every=600, settle=2, darks=1, shift=2, on=True):
+        """Live dark (firmware built with CCD_SHUTTER): after every every
+        light frames the shutter on PE15 closes. The settle frames while it
+        moves, each way, are dropped; the darks frames behind it arrive as
+        live_dark and move the master dark 1 / 2**shift of the way to them,
+        so it follows the dark current without stopping for a "D<m>"
+        capture. off opens the shutter and keeps the last estimate. The
+        device does not keep the setting."""
+        if not on:
+            self.shutter_settle = 0
+            return self.send_commands([(CMD_TELEMETRY,
+                                        bytes((TELEM_SHUTTER, SHUTTER_OFF)))])
+        if not 2 <= every <= 0xFFFF:
+            raise ValueError(f"live dark every {every!r}")
+        if not (1 <= settle <= SHUTTER_SETTLE_MAX
+                and 1 <= darks <= SHUTTER_SETTLE_MAX):
+            raise ValueError(f"live dark settle {settle!r} darks {darks!r}")
+        if not 0 <= shift <= SHUTTER_SHIFT_MAX:
+            raise ValueError(f"live dark shift {shift!r}")
+        self.shutter_settle = settle
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBHBBB', TELEM_SHUTTER, SHUTTER_ON, every, settle, darks,
+            shift))])
+
+    def request_live_dark(self, again=False):
+        """The shutter schedule into shutter_status: 'state' ("open",
+        "closing", "dark", "opening", or "idle" when off), whether the
+        master dark is the 'estimate', the sensor 'temp_c' at the newest
+        dark frame, and the 'cycles', 'dark_frames' folded and frames
+        'dropped' since boot. again closes the shutter at the next frame."""
+        op = SHUTTER_AGAIN if again else TELEM_KEEP
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_SHUTTER, op)))])
+
+    def request_selftest(self, again=False):
+        """The timer chain's last check against its profile (ccd_selftest.h)
+        into selftest_status: 'state' ("pass", "fail", or "due" while the
+        chain is not free-running), the 'failed' channels, and 'channels'
+        mapping each one timed to its (expected, measured) period in timer
+        ticks. again runs the check once more"""
+        op = SELFTEST_AGAIN if again else TELEM_KEEP
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_SELFTEST, op)))])
+
+    def set_selftest_guard(self, on=True):
+        """With the guard on (the default) a readout profile other than
+        O0 that fails the check is replaced by O0"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_SELFTEST, int(bool(on)))))])
+
+    @_restored
+    def set_baseline(self, mode="subtract", width=256):
+        """On-device baseline removal after resampling: "subtract" sends
+        only the light above the lower envelope of the spectrum, taken over
+        width pixels (well above the widest peak), "estimate" sends the
+        envelope itself, "off" the spectrum. The setting is kept."""
+        if mode not in BASELINE_MODES:
+            raise ValueError(f"baseline mode {mode!r}")
+        if not BASELINE_WIDTH[0] <= width <= BASELINE_WIDTH[1]:
+            raise ValueError(f"baseline width {width!r}")
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBH', TELEM_BASELINE, BASELINE_MODES.index(mode), width))])
+
+    def request_baseline(self):
+        """The baseline stage into baseline_status: 'mode', 'width', the
+        last frame's envelope 'low', 'high' and 'mean' (as light, in
+        counts) and the pixels 'clipped' below it"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_BASELINE, TELEM_KEEP)))])
+
+    def start_link_test(self, test, port="fs", count=1):
+        """USB link test (ccd_loop.h) on the "fs" port, the one commands go
+        to, or the "hs" CDC port: "echo" sends back the next count packets
+        that start with a LOOP_HEADER, "sink" throws away the next count
+        bytes, "source" sends count bytes of LOOP messages as fast as the
+        link takes them. Frames are held while it runs. Messages that come
+        back land in loop_rx, which this clears, the device's figures in
+        loop_status; bench_usb() runs the three."""
+        if test not in LOOP_TESTS or port not in LOOP_PORTS:
+            raise ValueError(f"link test {test!r} on {port!r}")
+        self.loop_rx = []
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<3BI', TELEM_LOOP, LOOP_TESTS.index(test), LOOP_PORTS.index(port),
+            count))])
+
+    def stop_link_test(self):
+        return self.send_commands([(CMD_TELEMETRY, bytes((TELEM_LOOP, LOOP_STOP)))])
+
+    def request_link_test(self):
+        """The last link test's figures into loop_status"""
+        return self.send_commands([(CMD_TELEMETRY, bytes((TELEM_LOOP, TELEM_KEEP)))])
+
+    def begin_config(self):
+        """Open a configuration transaction: until commit_config(), the
+        exposure, integration, ROI, binning, co-add and rolling commands
+        (configure()) and stage_format() are checked and held by the
+        device, then all swapped in at the same frame, the first integrated
+        with the new exposure. Frames before it have none of the changes,
+        so none has to be dropped. Any of them refused makes the commit
+        refused too, with nothing applied. The ASCII commands still apply
+        at once. State in txn_status."""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_TXN, TXN_BEGIN)))])
+
+    def stage_format(self, bits=None, codec=None):
+        """Packing (12, 14 or 16 bits) and codec (0 none, 1 rice, 2
+        temporal) for the open transaction; None keeps either"""
+        return self.send_commands([(CMD_TELEMETRY, bytes((
+            TELEM_TXN, TXN_FORMAT, TELEM_KEEP if bits is None else bits,
+            TELEM_KEEP if codec is None else codec)))])
+
+    def commit_config(self):
+        """Arm the open transaction's swap; txn_status['starts'] then maps
+        each generation to the seq of its first frame"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_TXN, TXN_COMMIT)))])
+
+    def abort_config(self):
+        """Drop the open transaction (refused once it is committed)"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_TXN, TXN_ABORT)))])
+
+    def request_config_txn(self):
+        """The transaction state and generation starts into txn_status"""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_TXN, TELEM_KEEP)))])
+
+    def config_generation(self, seq):
+        """The configuration generation frame seq was taken with, from the
+        last txn_status; None if it is older than the generations kept"""
+        st = self.txn_status
+        if st is None:
+            return None
+        for g in sorted(st['starts'], reverse=True):
+            if st['starts'][g] <= seq:
+                return g
+        return 0 if len(st['starts']) < TXN_HIST else None
+
+    def request_memory(self, clear=False):
+        """The device's memory budget into memory_status: stack high-water
+        mark and size, heap use, static bytes per RAM and the image size,
+        and the frame ring's occupancy as frames were published (ring_hist,
+        RING_HIST bins of ring_slots / RING_HIST slots) with its peak.
+        clear restarts the occupancy after reading it."""
+        return self.send_commands([(CMD_TELEMETRY, bytes((
+            TELEM_MEMORY, MEM_CLEAR if clear else TELEM_KEEP)))])
+
+    @_restored
+    def set_device_smoothing(self, window=11, order=3):
+        """Savitzky-Golay smoothing on the device, ahead of its peaks and
+        compression (window 5..25 odd, order 2..5; window 0 = off). Frames
+        come already smoothed, so PeakDetector's own pass can be turned off."""
+        if window:
+            window = min(max(window | 1, 7 if order >= 4 else 5), 25)
+        return self.send_commands([(CMD_SMOOTH, struct.pack('<BB', window, order))])
+
+    @_restored
+    def set_wavelength(self, coef, resample=True, start_nm=0.0, step_nm=0.0):
+        """Store a pixel -> nm polynomial on the device, coef[k] for pixel**k
+        up to 4th order. With resample the device sends every frame on the
+        uniform grid start_nm + i * step_nm (step_nm 0 = spanning the
+        calibrated line); device_wavelength has the grid it uses, see
+        Calibration.use_grid(). Rejected if not monotonic over the line."""
+        coef = (list(coef) + [0.0] * (WL_ORDER_MAX + 1))[:WL_ORDER_MAX + 1]
+        return self.send_commands([(CMD_WAVELENGTH, struct.pack('<B', WL_SET) +
+                                    WAVELENGTH.pack(*coef, start_nm, step_nm,
+                                                    int(resample), 0))])
+
+    @_restored
+    def set_black_level(self, enable=None):
+        """Per-frame black level from the leading dummy outputs: with it on
+        the device shifts every frame so that its black sits at
+        black_level['level'], ahead of the dark (take the dark again after
+        a change). None only reads black_level; its 'black' is the last
+        frame's own estimate either way, the offset drift to watch."""
+        arg = BLACK_STATUS if enable is None else int(bool(enable))
+        return self.send_commands([(CMD_BLACK, bytes((arg,)))])
+
+    @_restored
+    def set_dark_temperature(self, table=None):
+        """Scale the master dark ("D") to the sensor temperature in the
+        frames, from table: up to DARKT_KNOTS (degC, relative dark current)
+        pairs, rising in temperature, e.g. measured as the mean dark level
+        above the dummy outputs at a few temperatures. An empty table turns
+        it off, None only reads the state into dark_temperature. The device
+        keeps the table with its settings (config())."""
+        if table is None:
+            count, table = DARKT_STATUS, []
+        else:
+            table = sorted(table)[:DARKT_KNOTS]
+            count = len(table)
+        knots = b"".join(DARKT_KNOT.pack(round(t * 100), min(max(round(g), 1), 0xFFFF))
+                         for t, g in table)
+        knots += bytes(DARKT_KNOT.size * (DARKT_KNOTS - len(table)))
+        return self.send_commands([(CMD_DARK_TEMP, bytes((count,)) + knots)])
+
+    def request_wavelength(self, action=WL_STATUS):
+        """The device's calibration into device_wavelength; WL_SAVE also
+        keeps it in flash for the next boot"""
+        return self.send_commands([(CMD_WAVELENGTH, struct.pack('<B', action) +
+                                    bytes(WAVELENGTH.size))])
+
+    @_restored
+    def set_absorbance(self, mode=ABS_ABSORBANCE, reference_frames=0):
+        """Frames as transmittance or absorbance against a reference I0 on
+        the device; reference_frames > 0 first averages that many frames
+        (up to 256) into a new I0, so point the beam at the blank and take
+        the dark before. Decode with ratio_values(); absorbance_status
+        says the mode and whether a reference is ready."""
+        return self.send_commands([(CMD_ABSORBANCE, struct.pack(
+            '<BH', mode, reference_frames))])
+
+    @staticmethod
+    def ratio_values(pixels, mode):
+        """Pixels of a frame with the device's ABS_* mode applied: T (1.0 =
+        the reference) or A in AU"""
+        if mode == ABS_TRANSMITTANCE:
+            return [p / 32768.0 for p in pixels]
+        return [(p - 32768) / 4096.0 for p in pixels]
+
+    def request_profile(self):
+        """Worst-case cycles of each processing stage since the last request,
+        into proc_profile, with the frame period they must fit in. Set a
+        configuration, let it run, then check proc_profile['fits']."""
+        return self.send_commands([(CMD_PROFILE, b"")])
+
+    def request_probes(self, reset=True, names=PROBE_NAMES):
+        """Cycle counts of the interrupt handlers and main loop stages into
+        probes (min/max/mean and a log2 histogram, see PROBE_BIN0), since
+        the last reset. Divide by device_info['clock_hz'] for seconds; at
+        slow exposures the 240 and 480 MHz builds halve their core clock,
+        and cycles taken then are twice as long."""
+        return self.send_commands([(CMD_PROBE, bytes((PROBE_NAMES.index(n), int(reset))))
+                                   for n in names])
+
+    def request_latency(self, reset=True):
+        """Latency percentiles of the recent frames into latency: 'ready' DMA
+        complete to processed, 'sent' processed to USB complete, 'total' ICG
+        edge to USB complete, and 'arm' the ICG edge to the DMA re-arm,
+        whose p99 - p50 is the sync jitter. 'alarms' counts re-arms close to
+        arm_limit, the first sample, since the last reset: frames are about
+        to be lost to resyncs; 'arm_worst' is the longest re-arm since then,
+        however long ago. All in cycles of device_info['clock_hz']."""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_LATENCY, int(reset))))])
+
+    def request_faults(self, period_s=None):
+        """Loss and fault counters into faults; they only grow, and
+        faults['new'] has what changed since the report before. The device
+        also sends them every period_s seconds (0 = only on request, None =
+        leave as is, 0.1 s steps)."""
+        arg = TELEM_KEEP if period_s is None else min(round(period_s * 10), 254)
+        return self.send_commands([(CMD_TELEMETRY, bytes((TELEM_FAULTS, arg)))])
+
+    def request_kernels(self, names=KERNEL_NAMES):
+        """Time the processing kernels on the device into kernels: the
+        fastest and mean of 16 runs over a whole line, per memory region the
+        build has, and the fastest in cycles per pixel. 'check' fingerprints
+        the output, the same in every region and from one build to the next
+        unless the kernel's result changed. Each one holds the device's main
+        loop for up to about 10 ms."""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_KERNEL, KERNEL_NAMES.index(n))))
+                                   for n in names])
+
+    def request_adc_calibration(self, recalibrate=False):
+        """The ADC calibration in use into adc_calibration: 'stored' when
+        the boot reapplied the factors in flash, the die temperature now and
+        at the calibration. recalibrate makes a new one due; the device runs
+        it in a capture restart, so a few frames are lost."""
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_ADCCAL, int(recalibrate))))])
+
+    def set_preview(self, rate=30, bin_factor=4):
+        """While the device records to SD or streams to Ethernet (TX_ETH),
+        send USB a preview of the frames: binned by bin_factor (1, 2, 4, 8)
+        and at most rate frames per second, 0 = off (the recorder's raw frame
+        every 32 again). A slow USB reader only loses previews, never
+        recorded frames. Current state in preview (sent, skipped); the frames
+        in between are not counted lost while it is on."""
+        return self.send_commands([
+            (CMD_TELEMETRY, bytes((TELEM_PREVIEW_BIN, bin_factor))),
+            (CMD_TELEMETRY, bytes((TELEM_PREVIEW, rate)))])
+
+    @staticmethod
+    def kernel_regressions(baseline, kernels, tolerance=0.05):
+        """(kernel, region, baseline, now) of every fastest run more than
+        tolerance slower than in baseline, an earlier kernels dict (e.g.
+        kept as JSON with the firmware it was taken on)"""
+        return [(k, r, old['min'], kernels[k][r]['min'])
+                for k, regions in baseline.items() if k in kernels
+                for r, old in regions.items() if r in kernels[k]
+                and kernels[k][r]['min'] > old['min'] * (1 + tolerance)]
+
+    @staticmethod
+    def kernel_mismatches(baseline, kernels):
+        """(kernel, region, baseline, now) of every output check that differs
+        from baseline, an earlier kernels dict taken on the same tables
+        (coadd and despike only right after a reset), or from the kernel's
+        first region: a faster kernel must still match bit for bit"""
+        out = []
+        for k, regions in kernels.items():
+            first = next(iter(regions.values()), {}).get('check')
+            for r, now in regions.items():
+                old = baseline.get(k, {}).get(r, {}).get('check', first)
+                if now.get('check') != old:
+                    out.append((k, r, old, now.get('check')))
+        return out
+
+    def config(self, action=CONFIG_STATUS, auto=True):
+        """The settings the device restores at boot, into config_status.
+        It saves them by itself a couple of seconds after a change;
+        CONFIG_SAVE saves at once, CONFIG_AUTO turns that on or off (auto),
+        CONFIG_DEFAULTS erases them so the next boot starts from the
+        built-in defaults. A save can hold the device's main loop for the
+        flash erase (about 2 s, once every thousand or so saves)."""
+        return self.send_commands([(CMD_CONFIG, bytes((action, int(auto))))])
+
+    def request_stats(self):
+        """Device counters into device_stats (binary CMD_STATS)"""
+        return self.send_commands([(CMD_STATS, b"")])
+
+    def request_ae_status(self):
+        """Ask for a CCD_AEStatus_t, decoded into ae_status"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(b"US")
+            except:
+                self._lost()
+
+    @_restored
+    def set_roi(self, windows):
+        """Device-side ROI: list of (start, length) in sensor pixels, [] = all"""
+        if self.connected and self.serial:
+            cmd = "W" + ",".join(f"{s}:{n}" for s, n in windows)
+            try:
+                self.serial.write(cmd.encode('ascii'))
+            except:
+                self._lost()
+
+    @_restored
+    def set_auto_roi(self, on=True, lines=4, frames=4, margin=32,
+                     interval_s=60):
+        """Device-placed ROI: the device averages frames whole frames, finds
+        the peaks in them (set_device_peaks() threshold and distance), and
+        sends from then on only windows of margin pixels either side of the
+        lines strongest, up to 4, merged where they overlap. Every
+        interval_s seconds (0: only on request_auto_roi(again=True)) it
+        looks again. off returns to the windows of set_roi(). The setting
+        is kept."""
+        if not 1 <= lines <= ROI_MAX:
+            raise ValueError(f"auto ROI lines {lines!r}")
+        if not 1 <= frames <= AUTOROI_FRAMES_MAX:
+            raise ValueError(f"auto ROI frames {frames!r}")
+        if not 0 <= margin <= AUTOROI_MARGIN_MAX:
+            raise ValueError(f"auto ROI margin {margin!r}")
+        if not 0 <= interval_s <= 0xFFFF:
+            raise ValueError(f"auto ROI interval {interval_s!r}")
+        return self.send_commands([(CMD_TELEMETRY, struct.pack(
+            '<BBBBHH', TELEM_AUTOROI, AUTOROI_ON if on else AUTOROI_OFF,
+            lines, frames, margin, interval_s))])
+
+    def request_auto_roi(self, again=False):
+        """The auto ROI into autoroi_status: 'state' ("search" while
+        averaging, "set"), the 'windows' placed as (start, length), the
+        lines 'found' by the last search and the 'searches' since boot.
+        again searches at once."""
+        op = AUTOROI_AGAIN if again else TELEM_KEEP
+        return self.send_commands([(CMD_TELEMETRY,
+                                    bytes((TELEM_AUTOROI, op)))])
+
+    @_restored
+    def upload_flat_field(self, gains, save=False):
+        """Send per-pixel gains (1.0 = unchanged) and apply them on the device"""
+        if not (self.connected and self.serial): return False
+        q15 = np.clip(np.round(np.asarray(gains, dtype=np.float64) * FLAT_UNITY),
+                      0, 65535).astype('<u2')
+        try:
+            for off in range(0, len(q15), FLAT_CHUNK):
+                chunk = q15[off:off + FLAT_CHUNK]
+                self.serial.write(b'GW' + struct.pack('<H', off) + chunk.tobytes())
+            self.serial.write(b'GA')
+            if save:
+                self.serial.write(b'GS')
+            return True
+        except:
+            self._lost()
+            return False
+
+    @_restored
+    def upload_linearity(self, knots, save=False):
+        """ADC linearity correction: LIN_KNOTS corrected values for the raw
+        values 0, 256, ..., 65536 (piecewise linear in between), applied on
+        the device before the dark; save keeps them in flash"""
+        knots = [min(max(int(round(k)), 0), 65535) for k in knots]
+        if len(knots) != LIN_KNOTS:
+            return False
+        cmds = []
+        for off in range(0, LIN_KNOTS, LIN_CHUNK):
+            chunk = knots[off:off + LIN_CHUNK]
+            chunk += [0] * (LIN_CHUNK - len(chunk))
+            cmds.append((CMD_LINEARITY, struct.pack(
+                f'<BH{LIN_CHUNK}H', LIN_WRITE, off, *chunk)))
+        cmds.append((CMD_LINEARITY, struct.pack('<BH', LIN_APPLY, 0) +
+                     bytes(2 * LIN_CHUNK)))
+        if save:
+            cmds.append((CMD_LINEARITY, struct.pack('<BH', LIN_SAVE, 0) +
+                         bytes(2 * LIN_CHUNK)))
+        return bool(self.send_commands(cmds))
+
+    def start_bench(self, pattern=BENCH_PRBS, rate=0, count=0):
+        """Have the device stop capture and send generated frames instead,
+        rate per second (0 = as fast as the link drains them, without loss)
+        until count (0 = until stop_bench()). Each raw frame is checked bit
+        for bit against bench_pixels(); keep device processing off. The
+        results collect in bench. BENCH_REPLAY takes the frames from the
+        host instead, with the processing on: see replay()."""
+        self.bench = {
+            'pattern': pattern, 'frames': 0, 'bad_frames': 0,
+            'bit_errors': 0, 'bytes': 0, 'first_seq': None, 'last_seq': None,
+            'start': time.perf_counter(), 'elapsed': 0.0, 'mbps': 0.0,
+            'latency_max_ms': 0.0, 'device_frames': None, 'stalls': None,
+        }
+        self.last_seq = None  # The run counts seq from 0
+        return self.send_commands([(CMD_BENCH, struct.pack(
+            '<BII', pattern, rate, count))])
+
+    def stop_bench(self):
+        """End the run (capture resumes); bench['device_frames'] then says
+        how many frames the device made, so lost ones show against frames,
+        and bench['stalls'] how many of a replay's waited for a slot. Also
+        reads the counts once a run with a count has finished."""
+        return self.send_commands([(CMD_BENCH, struct.pack('<BII', BENCH_OFF, 0, 0))])
+
+    def _bench_check(self, info, pixels):
+        b = self.bench
+        now = time.perf_counter()
+        if info['exposure_us'] != 0 or b['pattern'] == BENCH_REPLAY:
+            return  # A capture, sent before the run or after it, or a replay
+        b['first_seq'] = info['seq'] if b['first_seq'] is None else b['first_seq']
+        b['last_seq'] = info['seq']
+        b['frames'] += 1
+        b['bytes'] += FRAME_SIZE
+        diff = pixels ^ bench_pixels(b['pattern'], info['seq'])
+        bits = int(np.unpackbits(diff.view(np.uint8)).sum())
+        if bits:
+            b['bad_frames'] += 1
+            b['bit_errors'] += bits
+        b['elapsed'] = now - b['start']
+        if b['elapsed'] > 0: b['mbps'] = b['bytes'] / b['elapsed'] / 1e6
+        if self.time_fit is not None:
+            latency = (now + self.wall_offset - info['host_time']) * 1000.0
+            b['latency_max_ms'] = max(b['latency_max_ms'], latency)
+
+    def trigger_single_shot(self):
+        """Unfreeze, wait for next frame, then freeze. In mode 1 this also
+        snaps the frame on the device."""
+        self.frozen = False
+        self.pending_single_shot = True
+        self.snap()
+
+    def snap(self):
+        """Mode 1 single shot ("J"); the latency lands in snap_report"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(b"J")
+            except:
+                self._lost()
+
+    def expose(self, seconds):
+        """One long exposure in mode 1 ("JX"), 10 ms to 2 min: the device
+        reads nothing out until it is over, then sends one frame with
+        exposure_us set and the snap_report. Follow it with
+        request_exposure() and exposure_progress()."""
+        ms = round(seconds * 1000)
+        if not EXPOSE_MIN_MS <= ms <= EXPOSE_MAX_MS:
+            raise ValueError(f"exposure {seconds} s out of range")
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"JX{ms}".encode('ascii'))
+            except:
+                self._lost()
+                return False
+            self.exposure = {'state': 'running', 't_ms': ms, 'elapsed_ms': 0,
+                             'at': time.monotonic()}
+            return True
+        return False
+
+    def abort_exposure(self):
+        """End the running long exposure without a frame"""
+        return self.send_commands([(CMD_TELEMETRY, bytes((TELEM_EXPOSE, 1)))])
+
+    def request_exposure(self):
+        """The device's long exposure state into exposure: 'state'
+        (EXPOSE_STATES), 't_ms', 'elapsed_ms' and the started and aborted
+        counts"""
+        return self.send_commands([(CMD_TELEMETRY, bytes((TELEM_EXPOSE, 0)))])
+
+    def exposure_progress(self):
+        """(fraction done, seconds left) of the running long exposure, from
+        the last exposure state and the host clock since; None when none
+        runs"""
+        e = self.exposure
+        if not e or e['state'] != 'running' or not e['t_ms']:
+            return None
+        done = min(e['elapsed_ms'] + (time.monotonic() - e['at']) * 1000,
+                   e['t_ms'])
+        return done / e['t_ms'], (e['t_ms'] - done) / 1000
+
+    @_restored
+    def set_encoder_lines(self, counts):
+        """Line scan (CCD_ENCODER builds): in mode 3 a frame starts at every
+        counts steps of the quadrature encoder on PC6/PC7, either way, and
+        the lines arrive in tiles into line_scan with their positions.
+        Positions restart at 0 with each new pitch. 0 goes back to the
+        PA15 trigger edge."""
+        if not 0 <= counts <= 0xFFFF:
+            raise ValueError(f"encoder pitch {counts} out of range")
+        if self.connected and self.serial:
+            try:
+                self.serial.write(f"ME{int(counts)}".encode('ascii'))
+            except:
+                self._lost()
+
+    def request_line_status(self):
+        """The encoder state into line_status: 'pitch', 'active', the lines
+        per tile, the position now, and tiles sent, lines missed (the
+        encoder faster than the line rate) and lines dropped"""
+        return self.send_commands([(CMD_TELEMETRY, bytes((TELEM_LINE, 0)))])
+
+    def set_line_preview(self, quality=50):
+        """Line scan (CCD_JPEG builds): JPEG strips of the lines at this
+        quality (1-100, 0 = off, None = read only) into line_preview in
+        place of the raw tiles, or next to the raw lines while recording to
+        SD. Encoder state and totals in line_preview_status; 'ratio' is the
+        JPEG bytes over the raw 16-bit lines."""
+        arg = TELEM_KEEP if quality is None else int(quality)
+        if not (arg == TELEM_KEEP or 0 <= arg <= 100):
+            raise ValueError(f"JPEG quality {quality} out of range")
+        return self.send_commands([(CMD_TELEMETRY, bytes((TELEM_JPEG, arg)))])
+
+    @_restored
+    def set_snap_pin_trigger(self, enable):
+        """Snap on rising edges of the trigger input as well (mode 1)"""
+        if self.connected and self.serial:
+            try:
+                self.serial.write(b"JE1" if enable else b"JE0")
+            except:
+                self._lost()
+
+# ==========================================
+# ACQUISITION PROCESS
+# ==========================================
+
+class FrameRing:
+    """Frames in shared memory, written by the acquisition process and
+    read in place by any other. Frame n (counted from 0) goes to slot
+    n % ACQ_RING_SLOTS; the writer clears the slot's gen before filling
+    it and sets it to n + 1 after, so a reader holding a view of frame n
+    checks valid(n) once it has used it."""
+    HEADER = np.dtype([('published', '<u8'), ('connected', '<u4'),
+                       ('frozen', '<u4'), ('fps', '<u4'),
+                       ('frame_count', '<u4'), ('frames_lost', '<u4'),
+                       ('crc_errors', '<u4'),
+                       ('link_seconds', '<u4'),  # LinkHealth.seconds
+                       ('reconnecting', '<u4'),  # CCDReceiver.lost is set
+                       ('reconnects', '<u4'),
+                       ('link', '<f8', (len(LINK_FIELDS),))])
+    SLOT = np.dtype([('gen', '<u8')] + FRAME_RECORD +
+                    [('peak_count', '<u4'),  # CCDReceiver.tracked_peaks
+                     ('peaks', '<f8', (PEAK_TRACK_MAX,))])
+
+    def __init__(self, name=None, slots=ACQ_RING_SLOTS):
+        size = self.HEADER.itemsize + slots * self.SLOT.itemsize
+        if name is None:
+            self.shm = shared_memory.SharedMemory(create=True, size=size)
+            self.shm.buf[:size] = bytes(size)
+        else:
+            self.shm = shared_memory.SharedMemory(name=name)
+        self.name = self.shm.name
+        self.head = np.ndarray((), self.HEADER, self.shm.buf)
+        self.slots = np.ndarray((slots,), self.SLOT, self.shm.buf,
+                                offset=self.HEADER.itemsize)
+
+    def published(self):
+        return int(self.head['published'])
+
+    def frame(self, n):
+        """Frame n in place (a view of its slot): frame_num, seq, pixels, ..."""
+        return self.slots[n % len(self.slots)]
+
+    def pixels(self, n):
+        return self.slots['pixels'][n % len(self.slots)]
+
+    def valid(self, n):
+        return int(self.slots['gen'][n % len(self.slots)]) == n + 1
+
+    def publish(self, frame_num, pixels, info, timestamp, peaks=()):
+        n = self.published()
+        i = n % len(self.slots)
+        s = self.slots
+        s['gen'][i] = 0
+        s['frame_num'][i] = frame_num
+        s['pixels'][i] = pixels
+        s['timestamp'][i] = timestamp
+        s['seq'][i] = info['seq'] if info else 0
+        s['exposure_us'][i] = info['exposure_us'] if info else 0
+        s['time_s'][i] = info['time_s'] if info else 0.0
+        for k in ('die_temp_c', 'board_temp_c'):
+            t = info[k] if info else None
+            s[k][i] = np.nan if t is None else t
+        s['peak_count'][i] = len(peaks)
+        s['peaks'][i][:len(peaks)] = peaks
+        s['gen'][i] = n + 1
+        self.head['published'] = n + 1
+
+    def close(self, unlink=False):
+        del self.head, self.slots
+        self.shm.close()
+        if unlink: self.shm.unlink()
+
+
+class FramePublisher:
+    """Frames from a FrameRing to any number of TCP subscribers, local or
+    remote. Each gets a CCDREC_HEADER, then one FRAME_RECORD per frame:
+    the .ccdrec layout, so subscribe() (or numpy.frombuffer) reads them.
+
+    A subscriber holds one frame at most, the newest: one that reads
+    slower than the device sends gets fewer frames, never an older one,
+    and never holds up the ring, the other subscribers or the device link.
+    It can also send "D<n>\\n" to take only every n-th frame.
+
+    The frames are served on loopback unless host names another interface;
+    host='' serves every interface, with no authentication, so only pass
+    it on a network where every machine may read the spectra."""
+    def __init__(self, ring, port=FANOUT_PORT, host=FANOUT_HOST):
+        self.ring = ring
+        self.subscribers = []
+        self.lock = threading.Lock()
+        self.running = True
+        self.record = FRAME_RECORD_META.size + CCD_PIXELS * 2
+        self.server = socket.create_server((host, port))
+        self.server.settimeout(0.5)
+        self.threads = [threading.Thread(target=t, daemon=True)
+                        for t in (self._accept, self._publish)]
+        for t in self.threads: t.start()
+
+    def _accept(self):
+        while self.running:
+            try:
+                sock, addr = self.server.accept()
+            except socket.timeout:
+                continue
+            except OSError:
+                return
+            sub = _Subscriber(sock, addr, self.record)
+            with self.lock:
+                self.subscribers.append(sub)
+            threading.Thread(target=self._serve, args=(sub,),
+                             daemon=True).start()
+
+    def _serve(self, sub):
+        try:
+            sub.run()
+        finally:
+            with self.lock:
+                self.subscribers.remove(sub)
+            sub.sock.close()
+
+    def _publish(self):
+        """Each frame is copied out of its slot once, whatever the number of
+        subscribers; a slot rewritten during the copy is skipped"""
+        seen = self.ring.published()
+        slot = self.ring.SLOT.itemsize
+        base = self.ring.HEADER.itemsize + 8  # Past the slot's gen
+        while self.running:
+            n = self.ring.published()
+            if n == seen:
+                time.sleep(FANOUT_POLL)
+                continue
+            with self.lock:
+                subs = list(self.subscribers)
+            for i in range(max(seen, n - len(self.ring.slots) + 1), n):
+                if not subs: break
+                off = base + (i % len(self.ring.slots)) * slot
+                rec = bytes(self.ring.shm.buf[off:off + self.record])
+                if not self.ring.valid(i): continue
+                for sub in subs: sub.offer(rec)
+            seen = n
+
+    def clients(self):
+        """Per subscriber: address, frames sent, frames conflated away"""
+        with self.lock:
+            return [{'addr': s.addr, 'sent': s.sent, 'skipped': s.skipped,
+                     'every': s.every} for s in self.subscribers]
+
+    def close(self):
+        self.running = False
+        self.server.close()
+        with self.lock:
+            for sub in self.subscribers: sub.stop()
+        for t in self.threads: t.join(1.0)
+
 
-class PeakDetector:
-    def __init__(self):
-        self.threshold = 15000  # Higher default threshold
-        self.min_distance = 100 # Higher default distance
-        self.smooth_window = 11 # Savitzky-Golay window
-        self.poly_order = 3     # Savitzky-Golay order
-        self.use_smoothing = True
-        
-    def find_peaks(self, data):
-        if len(data) == 0: return [], []
-        
-        # 1. Smoothing (Savitzky-Golay)
-        if self.use_smoothing and len(data) > self.smooth_window:
-            # Ensure window is odd and less than data length
-            window = self.smooth_window | 1 
-            if window < 3: window = 3
+class _Subscriber:
+    """One FramePublisher client: the newest frame not sent yet, and the
+    thread sending it"""
+    def __init__(self, sock, addr, record):
+        self.sock, self.addr = sock, addr
+        self.record = record
+        self.every = 1
+        self.count = 0
+        self.sent = 0
+        self.skipped = 0
+        self.pending = None
+        self.cond = threading.Condition()
+        self.running = True
+
+    def offer(self, rec):
+        self.count += 1
+        if self.count % self.every: return
+        with self.cond:
+            if self.pending is not None: self.skipped += 1
+            self.pending = rec
+            self.cond.notify()
+
+    def stop(self):
+        with self.cond:
+            self.running = False
+            self.cond.notify()
+
+    def _commands(self):
+        """D<n> lines: decimation. False once the client has gone."""
+        while select.select([self.sock], [], [], 0)[0]:
+            data = self.sock.recv(256)
+            if not data: return False
+            for line in data.split(b'\n'):
+                if line[:1] == b'D' and line[1:].strip().isdigit():
+                    self.every = max(1, int(line[1:]))
+        return True
+
+    def run(self):
+        self.sock.settimeout(FANOUT_SEND_TIMEOUT)
+        try:
+            self.sock.sendall(CCDREC_HEADER.pack(CCDREC_MAGIC, CCDREC_VERSION,
+                                                 CCD_PIXELS, self.record))
+            while self.running and self._commands():
+                with self.cond:
+                    if self.pending is None: self.cond.wait(0.1)
+                    rec, self.pending = self.pending, None
+                if rec is not None:
+                    self.sock.sendall(rec)
+                    self.sent += 1
+        except OSError:
+            pass  # Gone, or too slow to take one frame
+
+
+class ArrowSpool:
+    """Frames from a FrameRing as a rolling set of Arrow IPC files in
+    shared memory (/dev/shm where there is one), for tools in any
+    language that read Arrow: each file is one record batch
+    (arrow_schema()) of up to ARROW_SPOOL_FRAMES frames or
+    ARROW_SPOOL_S seconds, named by its first frame's position in the
+    ring (12 digits) and renamed into place once whole, so a reader
+    never sees half a file. Reading one with pyarrow.memory_map() maps
+    the batch rather than copying it; see read_spool(). The oldest
+    files past ARROW_SPOOL_FILES are removed."""
+    def __init__(self, ring, directory=ARROW_SPOOL_DIR):
+        if pa is None: raise RuntimeError("ArrowSpool needs pyarrow")
+        self.ring = ring
+        self.dir = directory
+        os.makedirs(directory, exist_ok=True)
+        for f in os.listdir(directory):
+            if f.endswith('.arrow'): os.remove(os.path.join(directory, f))
+        self.schema = arrow_schema()
+        self.block = np.zeros(ARROW_SPOOL_FRAMES, dtype=np.dtype(FRAME_RECORD))
+        self.files = deque()
+        self.running = True
+        self.thread = threading.Thread(target=self._spool, daemon=True)
+        self.thread.start()
+
+    def _spool(self):
+        seen = self.ring.published()
+        first, m, started = seen, 0, time.monotonic()
+        while self.running:
+            n = self.ring.published()
+            for i in range(max(seen, n - len(self.ring.slots) + 1), n):
+                slot = self.ring.frame(i)
+                row = self.block[m]
+                for name, *_ in FRAME_RECORD: row[name] = slot[name]
+                if not self.ring.valid(i): continue
+                if m == 0: first, started = i, time.monotonic()
+                m += 1
+                if m == ARROW_SPOOL_FRAMES:
+                    self._write(first, m)
+                    m = 0
+            seen = n
+            if m and time.monotonic() - started >= ARROW_SPOOL_S:
+                self._write(first, m)
+                m = 0
+            time.sleep(FANOUT_POLL)
+
+    def _write(self, first, m):
+        path = os.path.join(self.dir, f"{first:012d}.arrow")
+        with pa.OSFile(path + '.tmp', 'wb') as f:
+            with pa.ipc.new_file(f, self.schema) as w:
+                w.write_batch(arrow_batch(self.block[:m], self.schema))
+        os.replace(path + '.tmp', path)
+        self.files.append(path)
+        while len(self.files) > ARROW_SPOOL_FILES:
             try:
-                processed_data = savgol_filter(data, window, self.poly_order)
-            except:
-                processed_data = data
-        else:
-            processed_data = data
-            
-        # 2. Thresholding
-        candidates = np.where(processed_data > self.threshold)[0]
-        if len(candidates) == 0: return [], []
-        
-        # 3. Local Maxima with optimized neighbor check
-        #   (d[i] > d[i-1] AND d[i] > d[i+1])
-        #   We use a vectorized approach manually to be safe
-        
-        peaks_x = []
-        peaks_y = []
-        
-        last_peak_idx = -self.min_distance
-        
-        # Simple Greedy Search on the *processed* data
-        # We look for local maxima
-        
-        # Pre-compute is_peak boolean array
-        padded = np.pad(processed_data, (1, 1), mode='constant', constant_values=0)
-        is_max = (padded[1:-1] > padded[:-2]) & (padded[1:-1] > padded[2:])
-        
-        # Candidate indices are where is_max is true AND value > threshold
-        candidate_indices = np.where(is_max & (processed_data > self.threshold))[0]
+                os.remove(self.files.popleft())
+            except OSError:
+                pass
 
-        # 4. Filter by Min Distance (Greedy Left-to-Right)
-        final_peaks_x = []
-        final_peaks_y = [] # We return the SMOOTHED y or RAW y? Usually RAW y at that index looks best on graph.
-                           # But for detection the smoothed one was used. Let's return RAW Y.
-        
-        for idx in candidate_indices:
-            if idx - last_peak_idx >= self.min_distance:
-                final_peaks_x.append(idx)
-                final_peaks_y.append(data[idx]) # Use raw data Y value
-                last_peak_idx = idx
-                
-        return np.array(final_peaks_x), np.array(final_peaks_y)
+    def close(self):
+        self.running = False
+        self.thread.join(1.0)
 
+def read_spool(directory=ARROW_SPOOL_DIR, since=-1):
+    """(last, tables): the ArrowSpool files after position since, each a
+    pyarrow Table mapped from shared memory, and the position of the last
+    one to pass as since next time. A file removed before it is read is
+    skipped."""
+    tables = []
+    for f in sorted(os.listdir(directory)):
+        if not f.endswith('.arrow') or int(f[:-6]) <= since: continue
+        try:
+            source = pa.memory_map(os.path.join(directory, f))
+        except OSError:
+            continue
+        tables.append(pa.ipc.open_file(source).read_all())
+        since = int(f[:-6])
+    return since, tables
 
-class CCDReceiver:
-    def __init__(self):
-        self.pixels = np.zeros(CCD_PIXELS, dtype=np.uint16)
-        self.frame_count = 0
-        self.fps = 0
+class TsdbSink:
+    """Band, statistics and model outputs into a time-series database,
+    batched: point() only queues (measurement, time, seq, fields), and a
+    writer thread sends up to TSDB_BATCH points per HTTP POST to url,
+    every TSDB_FLUSH_S seconds or sooner once a batch is full. "line" is
+    InfluxDB line protocol, gzipped (url e.g.
+    http://host:8086/api/v2/write?org=o&bucket=b&precision=ns, a token in
+    headers); "arrow" an Arrow IPC stream, zstd-compressed, one row per
+    field (time, measurement, device, seq, field, value).
+
+    A failed write is retried, waiting from TSDB_RETRY_S[0] doubling up
+    to TSDB_RETRY_S[1], while new points queue behind it; at most
+    TSDB_BUFFER wait, the oldest going first (dropped) on a long outage.
+    A batch the database refuses (4xx other than 429) is dropped too.
+    written, failures and last_error say how it goes. Times are the
+    frame's on the host clock (info['host_time']), ns."""
+    def __init__(self, url, fmt="line", device=None, headers=None):
+        if fmt not in TSDB_FORMATS: raise ValueError(f"TSDB format {fmt!r}")
+        if fmt == "arrow" and pa is None:
+            raise RuntimeError("Arrow TSDB batches need pyarrow")
+        self.url, self.fmt, self.device = url, fmt, device
+        self.headers = dict(headers or {})
+        self.points = deque(maxlen=TSDB_BUFFER)
+        self.dropped = self.written = self.failures = 0
+        self.last_error = None
+        self.wake = threading.Event()
         self.running = True
-        self.connected = False
-        self.serial = None
-        self.lock = threading.Lock()
-        self.last_fps_time = time.time()
-        self.fps_frame_count = 0
-        self.frozen = False 
-        self.frame_ready = False
-        self.single_shot_pending = False
+        self.thread = threading.Thread(target=self._write, daemon=True)
+        self.thread.start()
+
+    def point(self, measurement, info, fields):
+        """Queue the fields (name -> number, None skipped) of a record"""
+        t = info.get('host_time') if info else None
+        if len(self.points) == TSDB_BUFFER: self.dropped += 1
+        self.points.append((measurement, int((t or time.time()) * 1e9),
+                            info['seq'] if info else 0, fields))
+        if len(self.points) >= TSDB_BATCH: self.wake.set()
+
+    def _batch(self):
+        n = min(len(self.points), TSDB_BATCH)
+        return [self.points.popleft() for _ in range(n)]
+
+    @staticmethod
+    def _tag(v):
+        return str(v).replace(',', r'\,').replace('=', r'\=').replace(' ', r'\ ')
+
+    def _line(self, batch):
+        device = self._tag(self.device or "ccd")
+        lines = []
+        for measurement, t, seq, fields in batch:
+            f = [f"seq={seq}i"]
+            for k, v in fields.items():
+                if v is None or v != v: continue
+                f.append(f"{k}={v}i" if isinstance(v, numbers.Integral)
+                         else f"{k}={float(v)!r}")
+            lines.append(f"{measurement},device={device} {','.join(f)} {t}")
+        return gzip.compress(("\n".join(lines) + "\n").encode(), 1), \
+            {"Content-Type": "text/plain; charset=utf-8",
+             "Content-Encoding": "gzip"}
+
+    def _arrow(self, batch):
+        rows = [(m, t, seq, k, float(v)) for m, t, seq, fields in batch
+                for k, v in fields.items() if v is not None]
+        measurement, t, seq, field, value = zip(*rows) if rows else ([],) * 5
+        table = pa.table({
+            'time': pa.array(t, pa.timestamp('ns')),
+            'measurement': pa.array(measurement).dictionary_encode(),
+            'device': pa.array([self.device or "ccd"] * len(rows)).dictionary_encode(),
+            'seq': pa.array(seq, pa.uint32()),
+            'field': pa.array(field).dictionary_encode(),
+            'value': pa.array(value, pa.float64())})
+        sink = pa.BufferOutputStream()
+        options = pa.ipc.IpcWriteOptions(compression='zstd')
+        with pa.ipc.new_stream(sink, table.schema, options=options) as w:
+            w.write_table(table)
+        return sink.getvalue().to_pybytes(), \
+            {"Content-Type": "application/vnd.apache.arrow.stream"}
+
+    def _post(self, body, headers):
+        req = urllib.request.Request(self.url, data=body, method="POST",
+                                     headers={**headers, **self.headers})
+        with urllib.request.urlopen(req, timeout=TSDB_TIMEOUT) as r:
+            r.read()
+
+    def _write(self):
+        while self.running or self.points:
+            if self.running and len(self.points) < TSDB_BATCH:
+                self.wake.wait(TSDB_FLUSH_S)
+            self.wake.clear()
+            batch = self._batch()
+            if not batch: continue
+            body, headers = (self._arrow if self.fmt == "arrow"
+                             else self._line)(batch)
+            wait = TSDB_RETRY_S[0]
+            while True:
+                try:
+                    self._post(body, headers)
+                    self.written += len(batch)
+                    break
+                except (OSError, ValueError) as e:
+                    self.failures += 1
+                    self.last_error = str(e)
+                    code = getattr(e, 'code', None)
+                    if code and 400 <= code < 500 and code != 429:
+                        self.dropped += len(batch)  # Refused, not away
+                        break
+                    if not self.running: return  # Closing: give up
+                    time.sleep(wait)
+                    wait = min(wait * 2, TSDB_RETRY_S[1])
+
+    def close(self, timeout=TSDB_TIMEOUT):
+        """Send what is queued, giving up after one failed write"""
+        self.running = False
+        self.wake.set()
+        self.thread.join(timeout)
+
+def subscribe(host, port=FANOUT_PORT, every=1):
+    """Frames from a FramePublisher, one FRAME_RECORD (numpy.void) at a
+    time, until the publisher closes"""
+    dtype = np.dtype(FRAME_RECORD)
+    with socket.create_connection((host, port)) as sock:
+        if every > 1: sock.sendall(f"D{every}\n".encode('ascii'))
+        f = sock.makefile('rb')
+        magic, version, pixels, size = CCDREC_HEADER.unpack(
+            f.read(CCDREC_HEADER.size))
+        if magic != CCDREC_MAGIC or size != dtype.itemsize:
+            raise ValueError("not a frame publisher of this version")
+        while True:
+            rec = f.read(size)
+            if len(rec) < size: return
+            yield np.frombuffer(rec, dtype=dtype)[0]
+
+
+def _acquire(ring_name, conn):
+    """Acquisition process: a CCDReceiver reading frames into the ring.
+    Between reads it runs the calls AcqClient sends over conn, (name,
+    args, reply) for a method or (name, (value,), reply) for a setting,
+    and None to stop."""
+    ring = FrameRing(ring_name)
+    rx = CCDReceiver()
+    head = ring.head
+    try:
+        while True:
+            while conn.poll():
+                msg = conn.recv()
+                if msg is None: return
+                name, args, reply = msg
+                attr = getattr(rx, name)
+                if callable(attr):
+                    result = attr(*args)
+                else:
+                    setattr(rx, name, args[0])
+                    result = None
+                if reply: conn.send(result)
+            if rx.connected:
+                rx.read_frame()
+            else:
+                if rx.lost: rx.read_frame()
+                time.sleep(RECONNECT_POLL if rx.lost else ACQ_IDLE)
+            if rx.frame_ready:
+                with rx.lock:
+                    rx.frame_ready = False
+                    info = rx.frame_info
+                    host_time = info.get('host_time') if info else None
+                    ring.publish(rx.frame_count, rx.pixels, info,
+                                 host_time if host_time is not None
+                                 else time.time(), rx.tracked_peaks)
+            head['connected'] = rx.connected
+            head['reconnecting'] = rx.lost is not None
+            head['reconnects'] = rx.reconnects
+            head['frozen'] = rx.frozen
+            head['fps'] = rx.fps
+            head['frame_count'] = rx.frame_count
+            head['frames_lost'] = rx.frames_lost
+            head['crc_errors'] = rx.crc_errors
+            if head['link_seconds'] != rx.health.seconds:
+                head['link'] = [rx.health.second[k] for k in LINK_FIELDS]
+                head['link_seconds'] = rx.health.seconds
+    finally:
+        rx.disconnect()
+        del head
+        ring.close()
+
+
+class FrameStream:
+    """The ring's frames for a script, from now on as they are published:
+    iterate it with for, or with async for in asyncio. Each item is the
+    frame's slot in place, the FRAME_RECORD fields, gen and the tracked
+    peaks, copied nowhere. It holds until the writer comes round to the
+    slot again, ACQ_RING_SLOTS frames after it; torn counts the frames
+    the writer reached before the next item was asked for.
+
+    With batch=N each item is N consecutive frames instead: an (N,) array
+    of slot records, its 'pixels' N x CCD_PIXELS, copied in one go into a
+    buffer kept from batch to batch, so keep a copy of what has to outlive
+    the next one. A row rewritten during the copy gets gen 0 and counts as
+    torn.
+
+    A reader more than buffer frames behind skips to the newest buffer
+    frames ('oldest', counted in dropped) or raises OverflowError
+    ('raise'). Iteration ends at close() or after timeout s without a
+    frame."""
+    def __init__(self, ring, buffer=STREAM_BUFFER, drop='oldest', batch=0,
+                 timeout=None, poll=STREAM_POLL):
+        if drop not in STREAM_DROPS:
+            raise ValueError(f"stream drop policy {drop!r}")
+        if not max(batch, 1) <= buffer < len(ring.slots):
+            raise ValueError(f"stream buffer {buffer} for batches of {batch}")
+        self.ring = ring
+        self.buffer, self.drop, self.batch = buffer, drop, batch
+        self.timeout, self.poll = timeout, poll
+        self.next = ring.published()
+        self.held = None   # Frame of the last item, checked at the next
+        self.dropped = 0
+        self.torn = 0
+        self.rows = np.empty(batch, ring.SLOT) if batch else None
+        self.closed = False
+
+    def _ready(self):
+        """Whether an item can be taken; applies the drop policy"""
+        n = self.ring.published()
+        behind = n - self.next
+        if behind > self.buffer:
+            if self.drop == 'raise':
+                raise OverflowError(f"stream {behind} frames behind")
+            self.dropped += behind - self.buffer
+            self.next = n - self.buffer
+        return behind >= max(self.batch, 1)
+
+    def _take(self):
+        i = self.next
+        if not self.batch:
+            self.next, self.held = i + 1, i
+            return self.ring.frame(i)
+        frames = np.arange(i, i + self.batch)
+        idx = frames % len(self.ring.slots)
+        np.take(self.ring.slots, idx, out=self.rows)
+        torn = self.ring.slots['gen'][idx] != frames + 1
+        self.rows['gen'][torn] = 0
+        self.torn += int(np.count_nonzero(torn))
+        self.next += self.batch
+        return self.rows
+
+    def _release(self):
+        if self.held is not None and not self.ring.valid(self.held):
+            self.torn += 1
+        self.held = None
+
+    def _expired(self, start):
+        return self.closed or (self.timeout is not None and
+                               time.monotonic() - start > self.timeout)
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        self._release()
+        start = time.monotonic()
+        while not self._ready():
+            if self._expired(start): raise StopIteration
+            time.sleep(self.poll)
+        return self._take()
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        self._release()
+        start = time.monotonic()
+        while not self._ready():
+            if self._expired(start): raise StopAsyncIteration
+            await asyncio.sleep(self.poll)
+        return self._take()
+
+    def close(self):
+        self.closed = True
+
+
+class AcqClient:
+    """The receiver as the GUI sees it, running in a process of its own so
+    rendering never holds up parsing. Frames come through a FrameRing;
+    the counters come from its header, and calls to CCDReceiver go over
+    a pipe. Recording happens in the acquisition process too, straight
+    to the file."""
+    def __init__(self):
+        self.ring = FrameRing()
+        self.conn, child = multiprocessing.Pipe()
+        self.proc = multiprocessing.Process(
+            target=_acquire, args=(self.ring.name, child), daemon=True)
+        self.proc.start()
+        self.shown = 0  # Frames published when the last was taken
+        self.track_seen = 0  # The same for tracked_peaks()
+        self._frame_avg_count = 1
+        self._frame_avg_mode = AVG_BLOCK
         self.recording = False
-        self.recording_conditional = False
-        self.recorded_frames = []
-        self.pending_single_shot = False # New flag for "One Shot" logic
-        
-        # Frame Averaging
-        self.frame_avg_count = 1
-        self.accum_buffer = None
-        self.accum_count = 0
-        
+        self.running = True
+        self.publisher = None
+        self.spool = None
+
+    def _call(self, name, *args, reply=False):
+        self.conn.send((name, args, reply))
+        return self.conn.recv() if reply else None
+
+    def __getattr__(self, name):
+        """CCDReceiver methods without a result, run in the other process"""
+        if name.startswith('_') or not callable(getattr(CCDReceiver, name,
+                                                        None)):
+            raise AttributeError(name)
+        return lambda *args: self._call(name, *args)
+
     def connect(self, port):
-        if self.serial: self.serial.close()
-        try:
-            self.serial = serial.Serial(port, BAUD_RATE, timeout=0.5)
-            self.connected = True
-            print(f"Connected to {port}")
-            return True
-        except Exception as e:
-            print(f"Connect failed: {e}")
-            self.connected = False
-            return False
+        return self._call('connect', port, reply=True)
 
-    def disconnect(self):
-        self.connected = False
-        if self.serial: self.serial.close()
-        self.serial = None
-        
-    def read_frame(self):
-        if not self.connected or not self.serial: return False
-        try:
-            while self.running:
-                b = self.serial.read(1)
-                if not b: return False
-                if b[0] == 0xCD:
-                    b2 = self.serial.read(1)
-                    if b2 and b2[0] == 0xAB:
-                        data = self.serial.read(FRAME_SIZE - 2)
-                        if len(data) == FRAME_SIZE - 2:
-                            frame_num = struct.unpack('<H', data[0:2])[0]
-                            # Raw pixels
-                            raw_pixels = np.frombuffer(data[2:], dtype=np.uint16).copy()
-                            
-                            # Frame Averaging Logic
-                            if self.frame_avg_count > 1:
-                                if self.accum_buffer is None:
-                                    self.accum_buffer = raw_pixels.astype(np.float32)
-                                    self.accum_count = 1
-                                else:
-                                    self.accum_buffer += raw_pixels
-                                    self.accum_count += 1
-                                    
-                                if self.accum_count >= self.frame_avg_count:
-                                    final_pixels = (self.accum_buffer / self.accum_count).astype(np.uint16)
-                                    self.accum_buffer = None
-                                    self.accum_count = 0
-                                    # Output this average frame
-                                    with self.lock:
-                                        self.pixels = final_pixels
-                                        self.frame_count = frame_num
-                                        self.frame_ready = True
-                                        self._handle_recording(frame_num, final_pixels)
-                                        self._handle_singleshot()
-                            else:
-                                # No averaging
-                                with self.lock:
-                                    self.pixels = raw_pixels
-                                    self.frame_count = frame_num
-                                    self.frame_ready = True
-                                    self._handle_recording(frame_num, raw_pixels)
-                                    self._handle_singleshot()
-                                    
-                            self.fps_frame_count += 1
-                            now = time.time()
-                            if now - self.last_fps_time >= 1.0:
-                                self.fps = self.fps_frame_count
-                                self.fps_frame_count = 0
-                                self.last_fps_time = now
-                            return True
-        except (serial.SerialException, OSError, PermissionError):
-            self.disconnect()
-            return False
-        except Exception as e:
-            print(f"Read error: {e}")
-            return False
-        return False
-        
-    def _handle_recording(self, frame_num, pixels):
-        if self.recording or (self.recording_conditional and not self.frozen):
-            self.recorded_frames.append({
-                'frame_num': frame_num,
-                'timestamp': time.time(),
-                'pixels': pixels.copy()
-            })
-            
-    def _handle_singleshot(self):
-        if self.pending_single_shot:
-            self.pending_single_shot = False
-            self.frozen = True
-        
-    def set_mode(self, mode_idx):
-        if self.connected and self.serial:
-            try:
-                self.serial.write(f"M{mode_idx}".encode('ascii'))
-            except:
-                self.disconnect()
+    @property
+    def connected(self): return bool(self.ring.head['connected'])
+
+    @property
+    def reconnecting(self): return bool(self.ring.head['reconnecting'])
+
+    @property
+    def reconnects(self): return int(self.ring.head['reconnects'])
+
+    @property
+    def frozen(self): return bool(self.ring.head['frozen'])
+
+    @frozen.setter
+    def frozen(self, value):
+        self._call('frozen', value)
+
+    @property
+    def fps(self): return int(self.ring.head['fps'])
+
+    @property
+    def frame_count(self): return int(self.ring.head['frame_count'])
+
+    @property
+    def frames_lost(self): return int(self.ring.head['frames_lost'])
+
+    def link_health(self):
+        """(seconds, the last LinkHealth second as a dict of LINK_FIELDS)"""
+        head = self.ring.head
+        return int(head['link_seconds']), dict(zip(LINK_FIELDS,
+                                                   head['link'].tolist()))
+
+    @property
+    def frame_avg_count(self): return self._frame_avg_count
+
+    @frame_avg_count.setter
+    def frame_avg_count(self, n):
+        self._frame_avg_count = n
+        self._call('frame_avg_count', n)
+
+    @property
+    def frame_avg_mode(self): return self._frame_avg_mode
+
+    @frame_avg_mode.setter
+    def frame_avg_mode(self, mode):
+        self._frame_avg_mode = mode
+        self._call('frame_avg_mode', mode)
+
+    def exposure_progress(self):
+        """CCDReceiver.exposure_progress(), from the other process"""
+        return self._call('exposure_progress', reply=True)
+
+    def take_frame(self):
+        """A copy of the newest frame not taken yet, or None"""
+        n = self.ring.published()
+        if n == self.shown: return None
+        self.shown = n
+        pixels = self.ring.pixels(n - 1).copy()
+        return pixels if self.ring.valid(n - 1) else None
+
+    def frames(self, since):
+        """(next, pixels): views of the frames published from since on
+        that are still in the ring, and where the next call starts"""
+        n = self.ring.published()
+        first = max(since, n - len(self.ring.slots) + 1)
+        return n, [self.ring.pixels(i) for i in range(first, n)]
+
+    def tracked_peaks(self):
+        """(frame_num, positions) of every frame published since the last
+        call and still in the ring, for charts that follow lines over
+        time; see CCDReceiver.set_peak_tracking()"""
+        out = []
+        n = self.ring.published()
+        for i in range(max(self.track_seen, n - len(self.ring.slots)), n):
+            slot = self.ring.frame(i)
+            peaks = slot['peaks'][:slot['peak_count']].copy()
+            if self.ring.valid(i): out.append((int(slot['frame_num']), peaks))
+        self.track_seen = n
+        return out
+
+    def shown_peaks(self):
+        """The tracked_peaks of the frame take_frame() last returned"""
+        slot = self.ring.frame(self.shown - 1)
+        return slot['peaks'][:slot['peak_count']].copy()
+
+    def start_recording(self, path, metadata=None):
+        self.recording = True
+        self._call('start_recording', path, metadata)
+
+    def stop_recording(self):
+        self.recording = False
+        return self._call('stop_recording', reply=True)
+
+    def start_event_recording(self, path, criteria=(), pre=EVENT_PRE,
+                              post=EVENT_POST, max_frames=None, metadata=None,
+                              ring_path=None):
+        """criteria must pickle: PeakTrigger and the like, not lambdas"""
+        self._call('start_event_recording', path, criteria, pre, post,
+                   max_frames, metadata, ring_path)
+
+    def stop_event_recording(self):
+        return self._call('stop_event_recording', reply=True)
+
+    def publish(self, port=FANOUT_PORT, host=FANOUT_HOST):
+        """Serve the ring's frames to subscribers (FramePublisher): on this
+        host only, unless host is an interface address or '' for all"""
+        if self.publisher is None:
+            self.publisher = FramePublisher(self.ring, port, host)
+        return self.publisher
+
+    def stream(self, buffer=STREAM_BUFFER, drop='oldest', batch=0,
+               timeout=None):
+        """A FrameStream of the ring's frames from now on"""
+        return FrameStream(self.ring, buffer, drop, batch, timeout)
+
+    def spool_arrow(self, directory=ARROW_SPOOL_DIR):
+        """Write the ring's frames to rolling Arrow files (ArrowSpool)"""
+        if self.spool is None:
+            self.spool = ArrowSpool(self.ring, directory)
+        return self.spool
+
+    def close(self):
+        self.running = False
+        if self.publisher: self.publisher.close()
+        if self.spool: self.spool.close()
+        self.conn.send(None)
+        self.proc.join(2.0)
+        self.ring.close(unlink=True)
+
+
+def discover_devices():
+    """Every board attached: {serial, port, transport}, by the USB serial
+    number each reports (the chip's unique ID), so a board keeps its name
+    whichever port it lands on"""
+    out = [{'serial': p.serial_number, 'port': p.device, 'transport': 'cdc'}
+           for p in serial.tools.list_ports.comports()
+           if p.vid == USB_VID and p.pid == USB_PID_CDC]
+    out += [{'serial': sn, 'port': f"{USB_BULK_PORT}:{sn}", 'transport': 'bulk'}
+            for sn in UsbBulkPort.serial_numbers()]
+    return sorted(out, key=lambda d: d['serial'] or '')
+
+
+class FrameFuser:
+    """Frames of several boards resampled onto one timeline, for fusion
+    downstream. Each board's frames carry their capture time on the host
+    clock, from its own clock sync (device_to_host()). The timeline is a
+    tick every period seconds from the first time every board has a
+    frame, or, with period None, the capture times of the first board.
+    At each tick every board's frame is resampled: "linear" interpolates
+    each pixel between its frames either side, "nearest" takes the closer.
+    Across a seq gap (frames lost) the nearest is taken, counted in gaps.
+
+    A tick is fused as soon as every board has a frame at or after it, so
+    a record trails the slowest board by one frame at most. A board more
+    than FUSE_STALL behind the rest (gone, or stopped) is not waited for:
+    its ticks are skipped and counted. Ticks before a board's first frame
+    are skipped too.
+
+    Records are dicts: 'time', 'pixels' float32 (boards, CCD_PIXELS) in
+    serials order, and per board 'offset_s' from the tick to the frame
+    nearest it and that frame's 'seq'. The rings are read in place, as any
+    reader does, with no lock, and each frame is copied once; acquisition
+    stays a process per board, so ingest grows with the boards and the
+    merge costs a few numpy operations per board and tick. step() fuses
+    what has come in. start() runs it in a thread appending to records,
+    a deque the reader empties from the other end, also without a lock."""
+    def __init__(self, rings, period=None, mode="linear"):
+        if mode not in FUSE_MODES:
+            raise ValueError(f"fusion mode {mode!r}")
+        self.rings = rings
+        self.serials = list(rings)
+        self.period = period
+        self.mode = mode
+        self.seen = {sn: r.published() for sn, r in rings.items()}
+        self.frames = {sn: deque() for sn in rings}
+        self.last = None
+        self.records = deque(maxlen=FUSE_QUEUE)
+        self.fused = self.skipped = self.gaps = 0
+        self.thread = None
+
+    def _collect(self):
+        for sn, ring in self.rings.items():
+            n = ring.published()
+            q = self.frames[sn]
+            for i in range(max(self.seen[sn], n - len(ring.slots) + 1), n):
+                rec = ring.frame(i).copy()
+                if ring.valid(i): q.append(rec)
+            self.seen[sn] = n
+
+    def _tick(self):
+        """The next tick, or None until the frame that sets it is in"""
+        if self.period is None:
+            for rec in self.frames[self.serials[0]]:
+                if self.last is None or rec['timestamp'] > self.last:
+                    return float(rec['timestamp'])
+            return None
+        if self.last is not None: return self.last + self.period
+        if not all(self.frames.values()): return None
+        return max(float(q[0]['timestamp']) for q in self.frames.values())
+
+    def _fuse(self, t):
+        """The record at t; None to wait for frames, False for a skip"""
+        newest = max((float(q[-1]['timestamp'])
+                      for q in self.frames.values() if q), default=t)
+        pairs = []
+        for sn in self.serials:
+            q = self.frames[sn]
+            while len(q) > 1 and q[1]['timestamp'] <= t: q.popleft()
+            if not q or q[-1]['timestamp'] < t:
+                return False if newest - t > FUSE_STALL else None
+            if q[0]['timestamp'] > t: return False
+            pairs.append((q[0], q[1] if len(q) > 1 else q[0]))
+        pixels = np.empty((len(pairs), CCD_PIXELS), dtype=np.float32)
+        offset, seq = [], []
+        for row, (a, b) in zip(pixels, pairs):
+            ta, tb = float(a['timestamp']), float(b['timestamp'])
+            w = (t - ta) / (tb - ta) if tb > ta else 0.0
+            near = b if w > 0.5 else a
+            gap = ((int(b['seq']) - int(a['seq'])) & 0xFFFFFFFF) > 1
+            if self.mode == "nearest" or gap:
+                row[:] = near['pixels']
+                self.gaps += gap
+            else:
+                row[:] = a['pixels']
+                row += (b['pixels'] - row) * np.float32(w)
+            offset.append(float(near['timestamp']) - t)
+            seq.append(int(near['seq']))
+        return {'time': t, 'pixels': pixels, 'offset_s': offset, 'seq': seq}
+
+    def step(self):
+        """The records fused from the frames in since the last call"""
+        self._collect()
+        out = []
+        while (t := self._tick()) is not None:
+            rec = self._fuse(t)
+            if rec is None: break
+            self.last = t
+            if rec is False:
+                self.skipped += 1
+                continue
+            self.fused += 1
+            out.append(rec)
+        return out
+
+    def start(self):
+        self.running = True
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+        return self
+
+    def _run(self):
+        while self.running:
+            got = self.step()
+            self.records.extend(got)
+            if not got: time.sleep(FUSE_POLL)
+
+    def stop(self):
+        self.running = False
+        if self.thread: self.thread.join()
+
+class DeviceManager:
+    """Several boards as one instrument. Each runs in an AcqClient of its
+    own, a process (and so a core) and a ring per board, with nothing
+    shared between them, so throughput grows with the number of boards.
+
+    Frames are matched across boards by capture time: each board's ICG
+    time on the host clock, from its own clock sync (device_to_host()), so
+    boards triggered together line up whatever their USB latency.
+    aligned() returns the sets in which every board has a frame within
+    tolerance; the frames no other board matches are counted in
+    unmatched."""
+    def __init__(self, devices=None):
+        self.devices = discover_devices() if devices is None else devices
+        self.clients = {}
+        self.seen = {}
+        self.pending = {}
+        self.unmatched = 0
+
+    def open(self):
+        """Connect to every board; returns the serial numbers connected"""
+        for d in self.devices:
+            client = AcqClient()
+            if client.connect(d['port']):
+                self.clients[d['serial']] = client
+                self.seen[d['serial']] = client.ring.published()
+                self.pending[d['serial']] = []
+            else:
+                client.close()
+        return list(self.clients)
+
+    def __getattr__(self, name):
+        """A CCDReceiver method run on every board: {serial: result}"""
+        if name.startswith('_') or not callable(getattr(CCDReceiver, name,
+                                                        None)):
+            raise AttributeError(name)
+        return lambda *args: {sn: getattr(c, name)(*args)
+                              for sn, c in self.clients.items()}
+
+    def status(self):
+        """Per board: connected, fps, frames, frames lost, CRC errors"""
+        return {sn: {k: int(c.ring.head[k]) for k in
+                     ('connected', 'fps', 'frame_count', 'frames_lost',
+                      'crc_errors')}
+                for sn, c in self.clients.items()}
+
+    def _collect(self):
+        """Copies of the frames published since the last call, per board;
+        a ring lapped in between loses its oldest, as any reader does"""
+        for sn, c in self.clients.items():
+            ring = c.ring
+            n = ring.published()
+            for i in range(max(self.seen[sn], n - len(ring.slots) + 1), n):
+                rec = ring.frame(i).copy()
+                if ring.valid(i): self.pending[sn].append(rec)
+            self.seen[sn] = n
+
+    def aligned(self, tolerance=ALIGN_TOLERANCE):
+        """[{serial: frame record}, ...] of the frames captured together
+        since the last call, oldest first. A frame waits for the others
+        until a later frame of every board has come in."""
+        self._collect()
+        out = []
+        queues = list(self.pending.values())
+        while queues and all(queues):
+            heads = [q[0]['timestamp'] for q in queues]
+            t = max(heads)
+            if min(heads) >= t - tolerance:
+                out.append({sn: q.pop(0) for sn, q in self.pending.items()})
+                continue
+            for q in queues:
+                while q and q[0]['timestamp'] < t - tolerance:
+                    q.pop(0)
+                    self.unmatched += 1
+        return out
+
+    def fuse(self, period=None, mode="linear"):
+        """A FrameFuser over every board's ring, from the frames still to
+        come: one timeline, a tick every period s or at the first board's
+        frames, each board's frame resampled to it"""
+        return FrameFuser({sn: c.ring for sn, c in self.clients.items()},
+                          period, mode)
+
+    def close(self):
+        for c in self.clients.values():
+            c.disconnect()
+            c.close()
+        self.clients.clear()
+
+
+# ==========================================
+# BENCHMARK
+# ==========================================
+def _durations(times):
+    """Mean, 99th percentile and worst of durations in s, as ms"""
+    t = np.sort(np.asarray(times, dtype=np.float64)) * 1000.0
+    if not len(t): return {}
+    return {'mean_ms': float(t.mean()), 'p99_ms': float(t[len(t) * 99 // 100]),
+            'max_ms': float(t[-1])}
+
+def bench_link(port=SIM_PORT, frames=BENCH_FRAMES, timeout=10.0):
+    """Link and receiver together, from the first frame: frames/s, MB/s,
+    frames lost, CRC errors, and capture-to-parse latency once the clocks
+    are synced. A board sends its test pattern (start_bench(): no device
+    processing, every bit checked); the simulator runs uncapped."""
+    rx = CCDReceiver()
+    if not rx.connect(port): raise OSError(f"cannot open {port}")
+    board = not isinstance(rx.serial, VirtualDevice)
+    if board:
+        rx.start_bench(BENCH_PRBS, 0, frames)
+    else:
+        rx.serial.rate = 0
+    latency = []
+    n = 0
+    start = last = None
+    try:
+        while n < frames and rx.connected:
+            if not rx.read_frame():
+                if last is not None and time.perf_counter() - last > timeout: break
+                continue
+            last = time.perf_counter()
+            if start is None:
+                start = last
+                continue  # The clock starts with the first frame
+            n += 1
+            host = rx.frame_info.get('host_time') if rx.frame_info else None
+            if host is not None:
+                latency.append(last + rx.wall_offset - host)
+        elapsed = (last - start) if n else 0.0
+        out = {'frames': n, 'elapsed_s': elapsed,
+               'fps': n / elapsed if elapsed else 0.0,
+               'mbps': n * FRAME_SIZE / elapsed / 1e6 if elapsed else 0.0,
+               'lost': rx.frames_lost, 'crc_errors': rx.crc_errors,
+               'latency': _durations(latency)}
+        if board:
+            rx.stop_bench()
+            out['bit_errors'] = rx.bench['bit_errors']
+            out['bad_frames'] = rx.bench['bad_frames']
+    finally:
+        rx.disconnect()
+    return out
+
+def _bench_usb_port(rx, link, port, rounds, megabytes, timeout):
+    """bench_usb() on one port, its messages arriving at link, which is rx
+    for FS; commands go through rx"""
+    def ask(seqs):
+        ok = rx._pump(lambda: seqs[0] in rx.cmd_acks, timeout)
+        if not ok or rx.cmd_acks[seqs[0]][1] != "ok":
+            raise OSError(f"link test refused on {port}")
+        return dict(rx.loop_status)
+    def finish():
+        end = time.perf_counter() + timeout
+        while (st := ask(rx.request_link_test()))['running']:
+            if time.perf_counter() > end:
+                rx.stop_link_test()
+                break
+            time.sleep(0.01)
+        return st
+    out = {}
+    size = LOOP_PACKET[port]
+    pad = bytes(size - LOOP_HEADER.size)
+    ask(rx.start_link_test("echo", port, rounds + 1))
+    rtt, lost = [], 0
+    for i in range(rounds + 1):  # The first waits out the frames queued before
+        t0 = time.perf_counter()
+        link.serial.write(LOOP_HEADER.pack(LOOP_MAGIC, size, i) + pad)
+        if link._pump(lambda: link.loop_rx and link.loop_rx[-1][0] == i, timeout):
+            if i: rtt.append(link.loop_rx[-1][2] - t0)
+        else:
+            lost += 1
+    st = finish()
+    out['echo'] = dict(_durations(rtt), lost=lost, bytes=size,
+                       p50_ms=sorted(rtt)[len(rtt) // 2] * 1000.0 if rtt else 0.0,
+                       dropped=st['dropped'],
+                       hold_max_ms=st['hold_max_us'] / 1000.0,
+                       hold_mean_ms=st['hold_sum_us'] / 1000.0 / max(st['done'], 1))
+
+    count = int(megabytes * 1e6)
+    block = bytes(USB_BULK_URB_SIZE)
+    ask(rx.start_link_test("sink", port, count))
+    t0 = time.perf_counter()
+    for k in range(0, count, len(block)):
+        link.serial.write(block[:count - k])
+    st = finish()
+    dt = time.perf_counter() - t0
+    out['sink'] = {'mbps': st['done'] / dt / 1e6,
+                   'device_mbps': st['done'] / st['elapsed_us'] if st['elapsed_us'] else 0.0,
+                   'bytes': st['done'], 'packets': st['packets']}
+
+    ask(rx.start_link_test("source", port, count))
+    last = (count - 1) // LOOP_CHUNK
+    link._pump(lambda: link.loop_rx and link.loop_rx[-1][0] >= last, timeout)
+    got = link.loop_rx
+    if not got: raise OSError(f"no source data on {port}")
+    span = got[-1][2] - got[0][2] if len(got) > 1 else 0.0
+    n = sum(m[1] for m in got)
+    st = finish()
+    out['source'] = {'mbps': (n - got[0][1]) / span / 1e6 if span else 0.0,
+                     'device_mbps': st['done'] / st['elapsed_us'] if st['elapsed_us'] else 0.0,
+                     'bytes': n, 'lost': st['packets'] - len(got)}
+    return out
+
+def bench_usb(port=SIM_PORT, hs_port=None, rounds=BENCH_ECHO_ROUNDS,
+              megabytes=BENCH_USB_MB, timeout=5.0):
+    """The USB link on its own, with the device's link tests
+    (start_link_test()), per port: 'echo', the round trip of one packet
+    (percentiles as the host sees it, and how long the device's main loop
+    held each one), then MB/s into the device ('sink') and out of it
+    ('source'), timed by the host and by the device. 'fs' is the port
+    given, CDC or the vendor class ('transport'); 'hs' the HS CDC port at
+    hs_port, if given. The device holds its frames meanwhile. Nothing to
+    test on the simulator. A board's frames go to the ring and its drops
+    from the test show in the 'link' figures of a later run, not here."""
+    if port.startswith(SIM_PORT): return {}
+    rx = CCDReceiver()
+    if not rx.connect(port): raise OSError(f"cannot open {port}")
+    hs = None
+    try:
+        transport = 'vendor' if isinstance(rx.serial, UsbBulkPort) else 'cdc'
+        out = {'fs': dict(_bench_usb_port(rx, rx, 'fs', rounds, megabytes, timeout),
+                          transport=transport)}
+        if hs_port:
+            hs = CCDReceiver()
+            hs.serial = serial.Serial(hs_port, BAUD_RATE, timeout=DUAL_TIMEOUT)
+            hs.rx, hs.connected = bytearray(), True
+            out['hs'] = dict(_bench_usb_port(rx, hs, 'hs', rounds, megabytes, timeout),
+                             transport='cdc')
+    finally:
+        if hs: hs.disconnect()
+        rx.disconnect()
+    return out
+
+def _bench_lines(source=None):
+    """The fixed frames the host stages run on: the synthetic ones, or the
+    first SIM_FRAMES of a recording"""
+    if source is None: return VirtualDevice._synthetic()
+    pixels = open_frames(source)[0]
+    return [np.asarray(pixels[i]) for i in range(min(len(pixels), SIM_FRAMES))]
+
+def bench_parse(frames=BENCH_FRAMES, source=None):
+    """The receiver alone: frames parsed and CRC-checked from a stream
+    already in memory, per frame and per second"""
+    sim = VirtualDevice(source, rate=0)
+    stream = b"".join(sim._frame() for _ in range(frames))
+    rx = CCDReceiver()
+    rx.serial, rx.connected = MessagePort(stream), True
+    rx.last_time_ping = float('inf')  # No clock pings into the stream
+    n = 0
+    t0 = time.perf_counter()
+    while rx.read_frame(): n += 1
+    dt = time.perf_counter() - t0
+    return {'frames': n, 'us_per_frame': dt / max(n, 1) * 1e6,
+            'fps': n / dt, 'mbps': len(stream) / dt / 1e6}
+
+def bench_record(frames=BENCH_FRAMES, directory=None):
+    """FrameRecorder to .ccdrec and to .ccdarc, as fast as add() takes
+    frames, in a temporary directory (in directory, to test that disk):
+    frames written per second from the first add() to the file closed,
+    and the frames the queue dropped because the writer fell behind"""
+    lines = VirtualDevice._synthetic()
+    info = {'seq': 0, 'exposure_us': 1000, 'time_s': 0.0,
+            'die_temp_c': 25.0, 'board_temp_c': None}
+    out = {}
+    with tempfile.TemporaryDirectory(dir=directory) as d:
+        for ext in ('ccdrec', 'ccdarc'):
+            path = os.path.join(d, 'bench.' + ext)
+            t0 = time.perf_counter()
+            rec = FrameRecorder(path)
+            for i in range(frames):
+                info['seq'] = i
+                rec.add(i, info, time.time(), lines[i % len(lines)])
+            rec.close()
+            rec.thread.join()
+            dt = time.perf_counter() - t0
+            written = rec.frames - rec.dropped
+            out[ext] = {'fps': written / dt, 'mbps': written * FRAME_SIZE / dt / 1e6,
+                        'dropped': rec.dropped, 'file_bytes': os.path.getsize(path)}
+    return out
+
+def bench_display(frames=BENCH_FRAMES, width=BENCH_PLOT_WIDTH, source=None):
+    """The GUI's work per frame short of rendering: inversion, the line
+    decimated to the plot width, a waterfall row, peak finding"""
+    lines = _bench_lines(source)
+    x = np.arange(CCD_PIXELS, dtype=np.float64)
+    trace, waterfall, peaks = Decimator(), Waterfall(), PeakDetector()
+    times = []
+    for i in range(frames):
+        t0 = time.perf_counter()
+        pixels = 65535 - lines[i % len(lines)]
+        trace(x, pixels, width)
+        waterfall.add(pixels, 65535)
+        peaks.find_peaks(pixels)
+        times.append(time.perf_counter() - t0)
+    return _durations(times)
+
+def bench_stages(frames=BENCH_FRAMES, source=None, width=BENCH_PLOT_WIDTH):
+    """Per-frame cost of each host stage on its own, in us: the receiver
+    (parse), the three averaging modes, peak finding and tracking, the
+    decimated trace and a waterfall row. Each runs over frames of the
+    fixed set BENCH_REPEATS times and the best pass counts, so a busy
+    moment of the machine is not taken for a regression."""
+    lines = _bench_lines(source)
+    x = np.arange(CCD_PIXELS, dtype=np.float64)
+    averager, peaks, tracker = FrameAverager(), PeakDetector(), PeakDetector()
+    trace, waterfall = Decimator(), Waterfall()
+    pipeline = HostPipeline(peaks)
+    stages = {
+        'average_block': lambda p: averager.add(p, AVG_BLOCK, 8),
+        'average_rolling': lambda p: averager.add(p, AVG_ROLLING, 8),
+        'average_exp': lambda p: averager.add(p, AVG_EXP, 8),
+        'peaks': peaks.find_peaks,
+        'peak_track': tracker.track,
+        'decimate': lambda p: trace(x, p, width),
+        'waterfall': lambda p: waterfall.add(p, 65535),
+        'pipeline': pipeline.process,  # Takes the raw frames
+    }
+    out = {'parse': {'us_per_frame': min(bench_parse(frames, source)['us_per_frame']
+                                         for _ in range(BENCH_REPEATS))}}
+    inverted = [65535 - p for p in lines]
+    for name, stage in stages.items():
+        best = float('inf')
+        for _ in range(BENCH_REPEATS):
+            t0 = time.perf_counter()
+            src = lines if name == 'pipeline' else inverted
+            for i in range(frames): stage(src[i % len(src)])
+            best = min(best, time.perf_counter() - t0)
+        out[name] = {'us_per_frame': best / frames * 1e6}
+    return out
+
+def bench_decode(frames=BENCH_FRAMES, source=None):
+    """The shaped-frame decoders on the fixed frames at 12 bits, packed
+    (pack12, and pack14 at 14 bits), Rice coded (rice) and Rice coded
+    against the frame before (temporal), made by the reference encoders
+    (the firmware's, ported: rice_encode()): decoded MB/s of 16-bit
+    pixels, and the pixels of every pass that differ from the frames
+    coded, which must stay 0"""
+    def pack(values, bits):  # Little-endian bit stream, as Proc_Pack*()
+        v = sum(int(x) << (j * bits) for j, x in enumerate(values))
+        return v.to_bytes((len(values) * bits + 7) // 8, 'little')
+    lines = _bench_lines(source)
+    n = CCD_PIXELS
+    out = {}
+    for name, bits in (('pack12', 12), ('pack14', 14), ('rice', 12),
+                       ('temporal', 12)):
+        depth = [(p >> (16 - bits)).astype(np.int32) for p in lines]
+        if name.startswith('pack'):
+            streams = [pack(d, bits) for d in depth]
+            want = [(d << (16 - bits)).astype(np.uint16) for d in depth]
+            buf = np.empty(n, dtype=np.uint16)
+            run = lambda i: unpack_pixels(streams[i], n, bits, buf)
+        else:
+            refs = [depth[i - 1] if name == 'temporal' else None
+                    for i in range(len(depth))]
+            streams = [rice_encode(d, bits, r) for d, r in zip(depth, refs)]
+            want = depth
+            buf = np.empty(n, dtype=np.int32)
+            run = lambda i: rice_decode(streams[i], n, bits, refs[i], buf)
+        best, wrong = float('inf'), 0
+        for _ in range(BENCH_REPEATS):
+            t0 = time.perf_counter()
+            for i in range(frames): run(i % len(streams))
+            best = min(best, time.perf_counter() - t0)
+            for i in range(len(streams)):
+                wrong += int(np.count_nonzero(run(i) != want[i]))
+        out[name] = {'mbps': frames * n * 2 / best / 1e6,
+                     'coded_bytes': sum(map(len, streams)) / len(streams),
+                     'mismatches': wrong, 'compiled': numba is not None}
+    return out
+
+def bench_gui(seconds):
+    """GUI frame time (update and render) for seconds, on the simulator
+    at its default rate"""
+    app = CCDApp(bench=seconds)
+    out = _durations(app.frame_times)
+    out['fps'] = len(app.frame_times) / seconds
+    return out
+
+def benchmark(port=SIM_PORT, frames=BENCH_FRAMES, gui_s=0.0, source=None,
+              only=BENCH_STAGES, hs_port=None):
+    """The stages in only (BENCH_STAGES; gui with gui_s seconds), as one
+    JSON-ready dict to keep next to the firmware and host versions it was
+    taken on; see bench_regressions(). source: a recording to run the
+    host stages on instead of the synthetic frames; hs_port: the HS port
+    for the usb stage to test as well."""
+    results = {'time': datetime.now().isoformat(timespec='seconds'),
+               'host': platform.node(), 'python': platform.python_version(),
+               'port': port, 'frames': frames, 'source': source}
+    runs = {'link': lambda: bench_link(port, frames),
+            'usb': lambda: bench_usb(port, hs_port),
+            'parse': lambda: bench_parse(frames, source),
+            'record': lambda: bench_record(frames),
+            'display': lambda: bench_display(frames, source=source),
+            'stages': lambda: bench_stages(frames, source),
+            'decode': lambda: bench_decode(frames, source),
+            'gui': lambda: bench_gui(gui_s)}
+    for name in only:
+        if name != 'gui' or gui_s: results[name] = runs[name]()
+    return results
+
+def bench_regressions(baseline, results, tolerance=BENCH_TOLERANCE):
+    """(figure, baseline, now) of each figure worse than in baseline, an
+    earlier benchmark(): a rate (fps, mbps) more than tolerance lower, a
+    time (_ms, us_) more than tolerance higher, a loss count higher"""
+    def flat(d, prefix=''):
+        for k, v in d.items():
+            if isinstance(v, dict): yield from flat(v, prefix + k + '.')
+            elif isinstance(v, (int, float)): yield prefix + k, v
+    now = dict(flat(results))
+    out = []
+    for key, old in flat(baseline):
+        if key not in now: continue
+        name = key.rsplit('.', 1)[-1]
+        new = now[key]
+        if name in ('fps', 'mbps'):
+            worse = new < old * (1 - tolerance)
+        elif name.endswith('_ms') or name.startswith('us_'):
+            worse = new > old * (1 + tolerance)
+        elif name in ('lost', 'crc_errors', 'dropped', 'bit_errors', 'bad_frames',
+                      'mismatches'):
+            worse = new > old
+        else:
+            continue
+        if worse: out.append((key, old, new))
+    return out
 
-    def trigger_single_shot(self):
-        """Unfreeze, wait for next frame, then freeze"""
-        self.frozen = False
-        self.pending_single_shot = True
 
 # ==========================================
 # MAIN APP
 # ==========================================
 
 class CCDApp:
-    def __init__(self):
+    def __init__(self, publish=None, bench=0.0, arrow=None,
+                 publish_host=FANOUT_HOST):
+        """publish: serve frames on this port (FramePublisher), on the
+        publish_host interface; bench: run
+        that many seconds on the simulator, timing each GUI frame into
+        frame_times, then close; arrow: spool frames as Arrow files to
+        this directory (ArrowSpool)"""
         self.settings = SettingsManager()
-        self.receiver = CCDReceiver()
+        self.receiver = AcqClient()
+        if publish: self.receiver.publish(publish, publish_host)
+        if arrow: self.receiver.spool_arrow(arrow)
         self.project_mgr = ProjectManager()
         self.calibration = Calibration()
         self.peak_detector = PeakDetector()
+        self.jobs = JobQueue()
+        self.jobs_seen = 0  # jobs.done at the last history refresh
+        self.live_trace = Decimator()
+        self.waterfall = Waterfall()
+        self.timeline = Waterfall()  # The History recording, see render_timeline()
+        self.timeline_span = 0       # Frames it shows
+        self.timeline_mean = False   # Mean envelope rather than maximum
+        self.timeline_key = None
+        self.axis_key = None  # See display_axis()
+        self.x_fitted = None    # axis_key the x axis was last fitted to
+        self.x_released = False
+        self.live_pixels = None  # Newest frame shown, redrawn when the view moves
+        self.live_view = self.peaks_view = self.history_view = None
+        self.history_trace = Decimator()
+        self.bench = bench
+        self.frame_times = []
+        self.link_seen = 0  # AcqClient.link_health() seconds last plotted
+        self.expose_active = False  # A long exposure started, see update_exposure()
+        self.expose_shown = 0   # time.monotonic() of the last progress update
+        self.expose_polled = 0  # The same for request_exposure()
+        self.link_history = {k: deque(maxlen=LINK_HISTORY)
+                             for k in ('lost', 'crc_errors', 'jitter_max_ms')}
+        self.link_over = False  # Frames lost in the last second
         
         # Load Settings
         self.invert_signal = self.settings.get("invert_signal")
@@ -323,6 +8174,7 @@ class CCDApp:
         self.peak_detector.threshold = self.settings.get("peak_threshold")
         self.peak_detector.min_distance = self.settings.get("peak_min_dist")
         self.receiver.frame_avg_count = self.settings.get("frame_average")
+        self.receiver.frame_avg_mode = self.settings.get("frame_average_mode")
         self.remove_dummies = self.settings.get("remove_dummies")
         self.y_max = self.settings.get("y_max")
         
@@ -334,34 +8186,40 @@ class CCDApp:
         self.history_idx = 0
         
         self.show_peaks = True
+        self.pipeline_peaks = False  # From the receiver's HostPipeline
         self.show_history = False
         
-        self.t = threading.Thread(target=self.bg_loop, daemon=True)
-        self.t.start()
-        
         self.setup_ui()
-        
-    def bg_loop(self):
-        while self.receiver.running:
-            if self.receiver.connected:
-                self.receiver.read_frame()
-            else:
-                time.sleep(0.5)
 
     def save_settings(self):
         self.settings.set("invert_signal", self.invert_signal)
         self.settings.set("enable_savgol", self.peak_detector.use_smoothing)
         self.settings.set("savgol_window", self.peak_detector.smooth_window)
         self.settings.set("frame_average", self.receiver.frame_avg_count)
+        self.settings.set("frame_average_mode", self.receiver.frame_avg_mode)
         self.settings.set("peak_threshold", self.peak_detector.threshold)
         self.settings.set("peak_min_dist", self.peak_detector.min_distance)
         self.settings.set("last_project", self.project_mgr.current_project)
         self.settings.set("remove_dummies", self.remove_dummies)
         self.settings.set("y_max", self.y_max)
         self.settings.save()
+        if self.pipeline_peaks: self.receiver.set_pipeline(self.host_pipeline())
+
+    def host_pipeline(self):
+        """A HostPipeline with the GUI's peak, inversion and calibration
+        settings"""
+        return HostPipeline(self.peak_detector, invert=self.invert_signal,
+                            calibration=self.calibration.polynomial()
+                            if self.calibration.enabled else None)
+
+    def cb_pipeline_peaks(self, on):
+        self.pipeline_peaks = on
+        self.receiver.set_pipeline(self.host_pipeline() if on else None)
 
     def refresh_ports(self):
         ports = [p.device for p in serial.tools.list_ports.comports()]
+        if UsbBulkPort.available(): ports.insert(0, USB_BULK_PORT)
+        ports.append(SIM_PORT)
         dpg.configure_item("cb_ports", items=ports)
         if ports: dpg.set_value("cb_ports", ports[0])
 
@@ -377,9 +8235,39 @@ class CCDApp:
         dpg.set_value("status_txt", "Disconnected")
 
     def cb_mode(self, s, a):
-        idx = ["Fast", "Stable", "Long"].index(a.split()[0])
+        idx = ["Fast", "Stable", "Long", "Triggered"].index(a.split()[0])
         self.receiver.set_mode(idx)
 
+    def cb_expose(self):
+        """Long exposure in mode 1 ("Stable (One-Shot)")"""
+        seconds = dpg.get_value("expose_s")
+        if not EXPOSE_MIN_MS <= round(seconds * 1000) <= EXPOSE_MAX_MS:
+            dpg.set_value("status_txt", "Exposure: 0.01 .. 120 s")
+            return
+        self.expose_active = True
+        self.expose_polled = time.monotonic()
+        self.receiver.expose(seconds)
+
+    def update_exposure(self):
+        """The long exposure bar, four times a second while one runs; the
+        device state is read once a second, to catch its end or an abort"""
+        now = time.monotonic()
+        if not self.expose_active or now - self.expose_shown < 0.25:
+            return
+        self.expose_shown = now
+        progress = self.receiver.exposure_progress()
+        if progress is None:
+            self.expose_active = False
+            dpg.set_value("expose_bar", 0.0)
+            dpg.configure_item("expose_bar", overlay="")
+            return
+        done, left = progress
+        dpg.set_value("expose_bar", done)
+        dpg.configure_item("expose_bar", overlay=f"{left:.1f} s left")
+        if now - self.expose_polled >= 1.0:
+            self.expose_polled = now
+            self.receiver.request_exposure()
+
     def cb_create_project(self):
         name = dpg.get_value("new_proj_name")
         if self.project_mgr.create_project(name):
@@ -392,48 +8280,74 @@ class CCDApp:
             self.save_recording()
             dpg.configure_item("btn_rec", label="Record")
         else:
-            self.receiver.start_recording()
+            ts = datetime.now().strftime("%Y%m%d_%H%M%S")
+            self.rec_path = os.path.join(self.project_mgr.get_recording_dir(),
+                                         f"rec_{ts}.ccdarc")
+            cal = self.calibration
+            self.receiver.start_recording(self.rec_path, {
+                'project': self.project_mgr.current_project,
+                'calibration': {'polynomial_nm': cal.polynomial()}
+                               if cal.enabled else None})
             dpg.configure_item("btn_rec", label="Stop & Save")
 
     def save_recording(self):
-        with self.receiver.lock:
-            frames = self.receiver.recorded_frames
-            self.receiver.recorded_frames = []
-            self.receiver.recording = False
-            
-        if not frames: return
-        
-        ts = datetime.now().strftime("%Y%m%d_%H%M%S")
-        fname = os.path.join(self.project_mgr.get_recording_dir(), f"rec_{ts}.npz")
-        
-        n = len(frames)
-        pix = np.zeros((n, CCD_PIXELS), dtype=np.uint16)
-        nums = np.zeros(n, dtype=np.uint16)
-        for i, f in enumerate(frames):
-            pix[i] = f['pixels']
-            nums[i] = f['frame_num']
-            
-        np.savez_compressed(fname, pixels=pix, frame_numbers=nums)
-        print(f"Saved {fname}")
+        n = self.receiver.stop_recording()
+        print(f"Saved {self.rec_path} ({n} frames)")
         self.refresh_history_list()
 
     def refresh_history_list(self):
         d = self.project_mgr.get_recording_dir()
         if os.path.exists(d):
-            files = [f for f in os.listdir(d) if f.endswith(".npz")]
+            files = [f for f in os.listdir(d)
+                     if f.endswith((".ccdarc", ".ccdrec", ".npz"))]
             files.sort(reverse=True)
             self.history_files = files
             dpg.configure_item("lb_history", items=files)
             
+    def cb_export(self, kind):
+        """Queue the selected recording for export or compression"""
+        a = dpg.get_value("lb_history")
+        if not a: return
+        src = os.path.join(self.project_mgr.get_recording_dir(), a)
+        dst = os.path.splitext(src)[0] + "." + kind
+        if kind == "csv":
+            self.jobs.submit(f"CSV {a}", export_csv, src, dst, self.calibration)
+        elif kind == "npz" and not a.endswith(".npz"):
+            self.jobs.submit(f"NPZ {a}", export_npz, src, dst)
+        elif kind == "ccdarc" and a.endswith(".ccdrec"):
+            self.jobs.submit(f"Compress {a}", compress_recording, src, dst,
+                             {'project': self.project_mgr.current_project})
+        elif kind == "reprocess" and a.endswith(".ccdarc"):
+            self.jobs.submit(f"Reprocess {a}", reprocess, src, None, None,
+                             None, self.peak_detector,
+                             self.calibration.polynomial()
+                             if self.calibration.enabled else None)
+        elif kind == "index" and not a.endswith(".npz"):
+            self.jobs.submit(f"Index {a}", build_index, src)
+            self.jobs.submit(f"Overview {a}", build_overview, src)
+            self.jobs.submit(f"Similarity {a}", build_similarity, src)
+        elif kind in ("arrow", "parquet") and pa is not None:
+            self.jobs.submit(f"{kind.title()} {a}", export_arrow, src, dst)
+
     def cb_load_history(self, s, a):
         if not a: return
         path = os.path.join(self.project_mgr.get_recording_dir(), a)
+        if self.history_data and hasattr(self.history_data['pixels'], 'close'):
+            self.history_data['pixels'].close()
+            self.history_data = None
         try:
-            data = np.load(path)
+            if a.endswith(".ccdarc"):
+                pixels = Archive(path)  # Frames inflated as they are shown
+            elif a.endswith(".ccdrec"):
+                pixels = open_recording(path)['pixels']
+            else:
+                pixels = np.load(path)['pixels']
             self.history_data = {
-                'pixels': data['pixels'],
-                'frames': len(data['pixels'])
+                'pixels': pixels,
+                'frames': len(pixels),
+                'overview': open_overview(path)
             }
+            self.timeline_span = len(pixels)
             self.history_idx = 0
             dpg.configure_item("slider_hist", max_value=self.history_data['frames']-1)
             self.show_history = True
@@ -442,91 +8356,247 @@ class CCDApp:
             print(f"Load failed: {e}")
 
     def update(self):
+        if self.jobs.done != self.jobs_seen:  # An export may have added files
+            self.jobs_seen = self.jobs.done
+            self.refresh_history_list()
+
         # 0. Apply Axis Limits
         dpg.set_axis_limits("y_axis", 0, self.y_max)
         
-        # Calculate X Limits
-        x_min, x_max = 0, CCD_PIXELS
-        if self.calibration.enabled:
-            x_min = self.calibration.pixel_to_nm(0)
-            x_max = self.calibration.pixel_to_nm(CCD_PIXELS)
-            
-        if self.remove_dummies:
-            if self.calibration.enabled:
-                x_min = self.calibration.pixel_to_nm(32)
-                x_max = self.calibration.pixel_to_nm(3680)
-            else:
-                x_min, x_max = 32, 3680
-                
-        if x_min > x_max: x_min, x_max = x_max, x_min
-        dpg.set_axis_limits("x_axis", x_min, x_max)
+        # Calculate X Limits: fitted once per change of the axis, then the
+        # user's to zoom and pan
+        display_x, start, end, x_min, x_max = self.display_axis()
+        if self.x_fitted != self.axis_key:
+            dpg.set_axis_limits("x_axis", x_min, x_max)
+            self.x_fitted = self.axis_key
+            self.x_released = False
+        elif not self.x_released:
+            dpg.set_axis_limits_auto("x_axis")
+            self.x_released = True
+        lo, hi = self.visible_pixels(display_x, start, end)
+        view = (self.axis_key, lo, hi, self.plot_width(), self.invert_signal)
         
-        if self.receiver.frame_ready and not self.receiver.frozen:
-            with self.receiver.lock:
-                self.receiver.frame_ready = False
-                pixels = self.receiver.pixels.copy()
-            
-            # 1. Inversion
-            if self.invert_signal:
-                pixels = 65535 - pixels
-                
-            # 2. X Axis & Dummy Removal
-            if self.calibration.enabled:
-                full_x_data = np.array([self.calibration.pixel_to_nm(i) for i in range(CCD_PIXELS)])
-            else:
-                full_x_data = np.arange(CCD_PIXELS)
-                
-            if self.remove_dummies:
-                # Slice logic: Keep 32 to 3680
-                start, end = 32, 3680
-                if end > len(pixels): end = len(pixels)
-                display_pixels = pixels[start:end]
-                display_x = full_x_data[start:end]
-                # Adjust indices for peak detection relative to slice if needed, 
-                # but peak detector works on passed array.
-            else:
-                display_pixels = pixels
-                display_x = full_x_data
-                
-            dpg.set_value("series_live", [display_x.tolist(), display_pixels.tolist()])
+        pixels = self.receiver.take_frame()
+        new_frame = pixels is not None and not self.receiver.frozen
+        if new_frame:
+            self.live_pixels = pixels
+        if self.live_pixels is not None and (new_frame or view != self.live_view):
+            # 1. Inversion, 2. Dummy Removal: of the visible pixels only (the
+            # x axis is sliced to match)
+            self.live_view = view
+            dpg.set_value("series_live", self.live_trace(
+                display_x[lo - start:hi - start],
+                self.display_slice(self.live_pixels, lo, hi),
+                self.plot_width()))
             
-            # 3. Peaks (Detect on DISPLAY pixels to match visual)
-            if self.show_peaks:
-                px, py = self.peak_detector.find_peaks(display_pixels)
-                if len(px) > 0:
-                    # px are indices into display_pixels. 
-                    # We need to map them to X coordinates
-                    px_indices = px.astype(int)
-                    px_x_coords = display_x[px_indices]
-                    dpg.set_value("series_peaks", [px_x_coords.tolist(), py.tolist()])
-                else:
-                    dpg.set_value("series_peaks", [[], []])
+        # 3. Peaks (Detect on DISPLAY pixels to match visual)
+        peak_view = (view, self.show_peaks, self.pipeline_peaks,
+                     self.peak_detector.threshold, self.peak_detector.min_distance,
+                     self.peak_detector._window(), self.peak_detector.poly_order)
+        if self.live_pixels is not None and (new_frame or peak_view != self.peaks_view):
+            self.peaks_view = peak_view
+            self.update_peaks(lo, hi, start, end)
                      
-            dpg.set_value("status_bar", f"FPS: {self.receiver.fps} | Frame: {self.receiver.frame_count} | Mode: {self.project_mgr.current_project}")
+        if new_frame:
+            over = " | LINK OVER CAPACITY" if self.link_over else ""
+            dpg.set_value("status_bar", f"FPS: {self.receiver.fps} | Frame: {self.receiver.frame_count} | Lost: {self.receiver.frames_lost} | Mode: {self.project_mgr.current_project} | {self.jobs.status()}{over}")
+
+        if self.receiver.reconnecting:
+            dpg.set_value("status_bar", "Board lost: RECONNECTING | "
+                          f"Reconnects: {self.receiver.reconnects} | {self.jobs.status()}")
+
+        self.update_link_health()
+        self.update_exposure()
+
+        if dpg.is_item_shown("waterfall_win"):
+            self.update_waterfall()
+
+        if dpg.is_item_shown("timeline_win"):
+            self.render_timeline()
 
         if self.show_history and self.history_data:
             idx = dpg.get_value("slider_hist")
-            h_pixels = self.history_data['pixels'][idx]
-            if self.invert_signal: 
-                 h_pixels = 65535 - h_pixels
-                 
-            if self.calibration.enabled:
-                h_full_x = np.array([self.calibration.pixel_to_nm(i) for i in range(CCD_PIXELS)])
-            else:
-                h_full_x = np.arange(CCD_PIXELS)
-                
-            if self.remove_dummies:
-                start, end = 32, 3680
-                display_h_pixels = h_pixels[start:end]
-                display_h_x = h_full_x[start:end]
-            else:
-                display_h_pixels = h_pixels
-                display_h_x = h_full_x
-                
-            dpg.set_value("series_history_line", [display_h_x.tolist(), display_h_pixels.tolist()])
+            key = (id(self.history_data), idx, view)
+            if key != self.history_view:
+                self.history_view = key
+                h_pixels = self.history_data['pixels'][idx]
+                dpg.set_value("series_history_line", self.history_trace(
+                    display_x[lo - start:hi - start],
+                    self.display_slice(h_pixels, lo, hi), self.plot_width()))
+
+    def display_slice(self, pixels, lo, hi):
+        """Pixels lo to hi of a frame as shown, inverted if set: only what
+        is drawn is worked on"""
+        seg = np.asarray(pixels[lo:hi])
+        return 65535 - seg if self.invert_signal else seg
+
+    def visible_pixels(self, display_x, start, end):
+        """(lo, hi): the pixels of start to end the x axis shows as zoomed,
+        and one either side so the line runs on to the edge"""
+        x0, x1 = dpg.get_axis_limits("x_axis")
+        if not x1 > x0: return start, end
+        x = display_x if display_x[-1] >= display_x[0] else -display_x[::-1]
+        a, b = (x0, x1) if x is display_x else (-x1, -x0)
+        lo = max(int(np.searchsorted(x, a)) - 1, 0)
+        hi = min(int(np.searchsorted(x, b, side='right')) + 1, len(x))
+        if x is not display_x: lo, hi = len(x) - hi, len(x) - lo
+        if hi - lo < 2: return start, end
+        return start + lo, start + hi
+
+    def update_peaks(self, lo, hi, start, end):
+        """The peak markers of the visible pixels. Found on them widened by
+        the smoothing window, which sees that far, so a peak by the edge is
+        where the whole frame would put it; those in the margins go."""
+        if not self.show_peaks:
+            dpg.set_value("series_peaks", [[], []])
+            return
+        if self.pipeline_peaks:
+            px = self.receiver.shown_peaks()
+            px = px[(px >= lo) & (px < hi - 1)]
+            y = np.asarray(self.live_pixels)[np.rint(px).astype(int)]
+            if self.invert_signal: y = 65535 - y
+        else:
+            margin = self.peak_detector._window() // 2 + 1
+            a, b = max(lo - margin, start), min(hi + margin, end)
+            px, y = self.peak_detector.find_peaks(self.display_slice(self.live_pixels, a, b))
+            px = px + a
+            keep = (px >= lo) & (px < hi)
+            px, y = px[keep], y[keep]
+        # px are sub-pixel positions in the frame; map them to X coordinates
+        x = np.interp(px, np.arange(CCD_PIXELS), self.calibration.axis())
+        dpg.set_value("series_peaks", [x.tolist(), np.asarray(y).tolist()])
+
+    def update_link_health(self):
+        """Once per LinkHealth second: the history, and the panel if shown"""
+        seconds, link = self.receiver.link_health()
+        if seconds == self.link_seen: return
+        self.link_seen = seconds
+        self.link_over = bool(link['lost'] or link['device_dropped'])
+        for k, h in self.link_history.items(): h.append(link[k])
+        if not dpg.is_item_shown("health_win"): return
+        dpg.set_value("health_txt",
+                      f"Frames/s {link['fps']:.0f}   lost {link['lost']:.0f}/s"
+                      f" (device {link['device_dropped']:.0f})   CRC"
+                      f" {link['crc_errors']:.0f}/s   resyncs"
+                      f" {link['resyncs']:.0f}/s ({link['skipped_bytes']:.0f} B)\n"
+                      f"Interval {link['interval_ms']:.2f} ms   jitter"
+                      f" {link['jitter_ms']:.3f} ms (worst {link['jitter_max_ms']:.2f})\n"
+                      f"Total lost {self.receiver.frames_lost}, CRC errors"
+                      f" {int(self.receiver.ring.head['crc_errors'])}"
+                      + ("   OVER CAPACITY" if self.link_over else ""))
+        x = list(range(-len(self.link_history['lost']) + 1, 1))
+        for k, h in self.link_history.items():
+            dpg.set_value("health_" + k, [x, list(h)])
+        dpg.fit_axis_data("health_x")
+        dpg.fit_axis_data("health_y")
+
+    def update_waterfall(self):
+        """Every frame since the last pass, not just the newest, becomes a
+        row; the two draws of the texture move to the new split"""
+        wf = self.waterfall
+        wf.seen, frames = self.receiver.frames(wf.seen)
+        for pixels in frames[-WATERFALL_ROWS:]:
+            wf.add(65535 - pixels if self.invert_signal else pixels, self.y_max)
+        w, h = WATERFALL_SIZE
+        split = wf.uv_split()
+        edge = h * (1.0 - split)
+        dpg.configure_item("waterfall_old", pmin=(0, 0), pmax=(w, edge),
+                           uv_min=(0, split), uv_max=(1, 1))
+        dpg.configure_item("waterfall_new", pmin=(0, edge), pmax=(w, h),
+                           uv_min=(0, 0), uv_max=(1, split))
+
+    def render_timeline(self):
+        """The History recording as WATERFALL_ROWS rows around the slider
+        frame, from the coarsest OverviewPyramid level that still has a
+        row for each, or from the frames themselves once the span is too
+        short for any (or the recording has no pyramid). Drawn again only
+        when the frame, span or envelope changed."""
+        data = self.history_data
+        if not data or not data['frames']: return
+        n = data['frames']
+        span = max(1, min(self.timeline_span, n))
+        centre = dpg.get_value("slider_hist")
+        key = (id(data), centre, span, self.timeline_mean, self.y_max)
+        if key == self.timeline_key: return
+        self.timeline_key = key
+        lo = max(0, min(centre - span // 2, n - span))
+        frames = lo + np.arange(WATERFALL_ROWS) * span // WATERFALL_ROWS
+        levels = [L for L in OVERVIEW_LEVELS if L * WATERFALL_ROWS <= span]
+        wf = self.timeline
+        wf.row = 0
+        if data['overview'] and levels:
+            L = levels[-1]
+            block = data['overview'][L][0 if self.timeline_mean else 1]
+            rows = np.asarray(block[np.minimum(frames // L, len(block) - 1)])
+            for row in rows: wf.add(row, self.y_max)
+            source = f"{L}-frame blocks"
+        else:
+            for i in frames:
+                wf.add(65535 - np.asarray(data['pixels'][int(i)]), self.y_max)
+            source = "frames"
+        dpg.set_value("timeline_txt", f"Frames {lo}-{lo + span - 1} of {n}"
+                      f" from {source}, newest at the bottom")
+
+    def cb_timeline_zoom(self, factor):
+        if self.history_data:
+            self.timeline_span = int(min(max(self.timeline_span * factor,
+                                             WATERFALL_ROWS),
+                                         self.history_data['frames']))
+
+    def display_axis(self):
+        """(x, start, end, x_min, x_max): the shown part of the calibrated
+        axis, which the live, history and peak views share, pixels start
+        to end and the axis limits. Sliced again only when the
+        calibration or the dummy setting changed."""
+        key = (self.calibration.version, self.remove_dummies)
+        if self.axis_key != key:
+            start, end = (32, 3680) if self.remove_dummies else (0, CCD_PIXELS)
+            x = self.calibration.axis()[start:end]
+            self.axis_cache = (x, start, end, float(x.min()), float(x.max()))
+            self.axis_key = key
+        return self.axis_cache
+
+    def plot_width(self):
+        """Plot width in screen pixels, the resolution traces are drawn at"""
+        width = dpg.get_item_rect_size("main_plot")[0]
+        return width if width > 0 else 1920
 
     def setup_ui(self):
         dpg.create_context()
+        with dpg.texture_registry():
+            dpg.add_raw_texture(WATERFALL_WIDTH, WATERFALL_ROWS, self.waterfall.texture,
+                                format=dpg.mvFormat_Float_rgba, tag="waterfall_tex")
+        w, h = WATERFALL_SIZE
+        with dpg.window(label="Waterfall", tag="waterfall_win", show=False,
+                        width=w + 20, height=h + 40):
+            with dpg.drawlist(width=w, height=h):
+                dpg.draw_image("waterfall_tex", (0, 0), (w, h), tag="waterfall_old")
+                dpg.draw_image("waterfall_tex", (0, h), (w, h), tag="waterfall_new")
+        
+        with dpg.texture_registry():
+            dpg.add_raw_texture(WATERFALL_WIDTH, WATERFALL_ROWS, self.timeline.texture,
+                                format=dpg.mvFormat_Float_rgba, tag="timeline_tex")
+        with dpg.window(label="Timeline", tag="timeline_win", show=False,
+                        width=w + 20, height=h + 90):
+            with dpg.group(horizontal=True):
+                dpg.add_button(label="Zoom In", callback=lambda: self.cb_timeline_zoom(0.25))
+                dpg.add_button(label="Zoom Out", callback=lambda: self.cb_timeline_zoom(4))
+                dpg.add_checkbox(label="Mean", default_value=False,
+                                 callback=lambda s, a: setattr(self, 'timeline_mean', a))
+            dpg.add_text("Load a recording in the History tab", tag="timeline_txt")
+            with dpg.drawlist(width=w, height=h):
+                dpg.draw_image("timeline_tex", (0, 0), (w, h))
+
+        with dpg.window(label="Link Health", tag="health_win", show=False,
+                        width=560, height=360):
+            dpg.add_text("Waiting for a second of frames", tag="health_txt")
+            with dpg.plot(height=-1, width=-1):
+                dpg.add_plot_legend()
+                dpg.add_plot_axis(dpg.mvXAxis, label="Seconds", tag="health_x")
+                dpg.add_plot_axis(dpg.mvYAxis, label="Per second / ms", tag="health_y")
+                dpg.add_line_series([], [], label="Lost", parent="health_y", tag="health_lost")
+                dpg.add_line_series([], [], label="CRC errors", parent="health_y", tag="health_crc_errors")
+                dpg.add_line_series([], [], label="Worst jitter (ms)", parent="health_y", tag="health_jitter_max_ms")
         
         with dpg.window(tag="main_win"):
             
@@ -553,13 +8623,19 @@ class CCDApp:
                             
                             dpg.add_separator()
                             dpg.add_text("Acquisition")
-                            dpg.add_combo(["Fast (Flicker)", "Stable (One-Shot)", "Long (7.3ms)"], 
+                            dpg.add_combo(["Fast (Flicker)", "Stable (One-Shot)", "Long (full frame)", "Triggered (PA15)"], 
                                          default_value="Fast (Flicker)", callback=self.cb_mode, width=-1)
                             
                             with dpg.group(horizontal=True):
                                 dpg.add_button(label="Run", callback=lambda: setattr(self.receiver, 'frozen', False))
                                 dpg.add_button(label="Freeze", callback=lambda: setattr(self.receiver, 'frozen', True))
                                 dpg.add_button(label="Single Shot", callback=self.receiver.trigger_single_shot)
+                            with dpg.group(horizontal=True):
+                                dpg.add_input_float(tag="expose_s", default_value=1.0, width=70,
+                                                    step=0, format="%.2f s")
+                                dpg.add_button(label="Expose", callback=self.cb_expose)
+                                dpg.add_button(label="Abort", callback=self.receiver.abort_exposure)
+                            dpg.add_progress_bar(tag="expose_bar", default_value=0.0, width=-1)
 
                             dpg.add_separator()
                             dpg.add_text("Signal Processing")
@@ -569,6 +8645,8 @@ class CCDApp:
                             dpg.add_text("Temporal Smoothing (Avg Frames)")
                             dpg.add_slider_int(label="Avg", default_value=self.receiver.frame_avg_count, min_value=1, max_value=20, 
                                               callback=lambda s,a: [setattr(self.receiver, 'frame_avg_count', a), self.save_settings()])
+                            dpg.add_combo(AVG_MODES, default_value=AVG_MODES[self.receiver.frame_avg_mode], width=-1,
+                                          callback=lambda s,a: [setattr(self.receiver, 'frame_avg_mode', AVG_MODES.index(a)), self.save_settings()])
                             
                             dpg.add_separator()
                             dpg.add_text("View Control")
@@ -576,6 +8654,10 @@ class CCDApp:
                                             callback=lambda s,a: [setattr(self, 'remove_dummies', a), self.save_settings()])
                             dpg.add_slider_int(label="Y Max", default_value=self.y_max, min_value=1000, max_value=65535,
                                               callback=lambda s,a: [setattr(self, 'y_max', a), self.save_settings()])
+                            dpg.add_button(label="Waterfall", width=-1,
+                                           callback=lambda: dpg.configure_item("waterfall_win", show=True))
+                            dpg.add_button(label="Link Health", width=-1,
+                                           callback=lambda: dpg.configure_item("health_win", show=True))
                             
                             dpg.add_separator()
                             dpg.add_text("Recording")
@@ -606,6 +8688,8 @@ class CCDApp:
                             dpg.add_separator()
                             dpg.add_text("Peak Detection")
                             dpg.add_checkbox(label="Show Peaks", default_value=True, callback=lambda s,a: setattr(self, 'show_peaks', a))
+                            dpg.add_checkbox(label="Every Frame (receiver)", default_value=False,
+                                             callback=lambda s,a: self.cb_pipeline_peaks(a))
                             dpg.add_slider_float(label="Thresh", tag="peak_thresh", default_value=self.peak_detector.threshold, max_value=65535, 
                                                 callback=lambda s,a: [setattr(self.peak_detector, 'threshold', a), self.save_settings()])
                             dpg.add_slider_int(label="Min Dist", tag="peak_dist", default_value=self.peak_detector.min_distance, max_value=500,
@@ -620,6 +8704,15 @@ class CCDApp:
                         with dpg.tab(label="History"):
                             dpg.add_text("Recordings")
                             dpg.add_listbox([], tag="lb_history", width=-1, num_items=15, callback=self.cb_load_history)
+                            with dpg.group(horizontal=True):
+                                dpg.add_button(label="CSV", callback=lambda: self.cb_export("csv"))
+                                dpg.add_button(label="NPZ", callback=lambda: self.cb_export("npz"))
+                                dpg.add_button(label="Compress", callback=lambda: self.cb_export("ccdarc"))
+                                dpg.add_button(label="Reprocess", callback=lambda: self.cb_export("reprocess"))
+                                dpg.add_button(label="Index", callback=lambda: self.cb_export("index"))
+                                dpg.add_button(label="Arrow", callback=lambda: self.cb_export("arrow"))
+                                dpg.add_button(label="Parquet", callback=lambda: self.cb_export("parquet"))
+                                dpg.add_button(label="Timeline", callback=lambda: dpg.configure_item("timeline_win", show=True))
                             dpg.add_separator()
                             dpg.add_checkbox(label="Overlay History", default_value=False, callback=lambda s,a: setattr(self, 'show_history', a))
                             dpg.add_slider_int(label="Frame", tag="slider_hist", default_value=0, max_value=1)
@@ -655,16 +8748,223 @@ class CCDApp:
         dpg.set_primary_window("main_win", True)
         self.refresh_ports()
         self.refresh_history_list()
+        if self.bench: self.receiver.connect(SIM_PORT)
+        end = time.perf_counter() + self.bench
         
         while dpg.is_dearpygui_running():
+            t0 = time.perf_counter()
             self.update()
             dpg.render_dearpygui_frame()
+            if self.bench:
+                self.frame_times.append(time.perf_counter() - t0)
+                if t0 > end: break
             
         dpg.destroy_context()
         self.save_settings() # Save on exit
         self.receiver.disconnect()
-        self.receiver.running = False
+        self.receiver.close()
 
 
 if __name__ == "__main__":
-    app = CCDApp()
+    parser = argparse.ArgumentParser(description=__doc__.strip())
+    parser.add_argument("--capture", type=int, metavar="N", help="record N frames (0: until SIGINT/SIGTERM) to --out without the GUI")
+    parser.add_argument("--replay", metavar="RECORDING", help="send a recording's frames through the board's processing, what comes out to --out")
+    parser.add_argument("--port", help="serial port, or the vendor bulk device (default); --benchmark defaults to the simulator")
+    parser.add_argument("--out", default="capture.ccdrec", help=".ccdrec, or .ccdarc for a compressed archive")
+    parser.add_argument("--mode", type=int, choices=range(4), help="0 fast, 1 stable, 2 long, 3 triggered (PA15)")
+    parser.add_argument("--trigger", action="store_true", help="same as --mode 3, and wait for triggers however long")
+    parser.add_argument("--exposure-us", type=int, metavar="US", help="fast-shutter exposure (SH pulse period)")
+    parser.add_argument("--pulse-us", type=int, default=2, metavar="US", help="SH pulse width (default 2)")
+    parser.add_argument("--fps", type=float, help="--capture: choose binning, packing, codec, ROI and co-add for this frame rate over the link as measured, and re-plan when it drops frames")
+    parser.add_argument("--min-pixels", type=int, default=CCD_PIXELS, metavar="N", help="--fps: outputs across the sensor to keep (default all)")
+    parser.add_argument("--min-bits", type=int, choices=PLAN_BITS, default=16, help="--fps: bits per pixel to keep (default 16)")
+    parser.add_argument("--roi", metavar="START:LEN,...", help="--fps: the windows needed, which the frames may be cut to")
+    parser.add_argument("--link-mbps", type=float, metavar="MB/S", help="--fps: the link's rate instead of testing it")
+    parser.add_argument("--average", type=int, default=1, metavar="N", help="average N frames before recording")
+    parser.add_argument("--average-mode", choices=[m.lower() for m in AVG_MODES], default="block")
+    parser.add_argument("--timeout", type=float, default=5.0, help="stop after this many seconds without a frame")
+    parser.add_argument("--publish", type=int, nargs='?', const=FANOUT_PORT, metavar="TCP_PORT", help=f"serve live frames to subscribers on this host (default port {FANOUT_PORT})")
+    parser.add_argument("--publish-host", default=FANOUT_HOST, metavar="ADDR", help="--publish: interface to serve on, \"\" or 0.0.0.0 for every one (default this host only)")
+    parser.add_argument("--list-devices", action="store_true", help="print the boards attached and exit")
+    parser.add_argument("--simulate", nargs='?', const="", metavar="SOURCE", help="serve a virtual board on a pty: synthetic, or replaying a .ccdrec/.ccdarc/.npz")
+    parser.add_argument("--sim-rate", type=float, default=SIM_RATE, metavar="HZ", help="simulated frames per second (0: as fast as read)")
+    parser.add_argument("--sim-drop", type=float, default=0.0, metavar="P", help="fraction of simulated frames lost")
+    parser.add_argument("--sim-corrupt", type=float, default=0.0, metavar="P", help="fraction of simulated frames corrupted")
+    parser.add_argument("--benchmark", nargs='?', const="-", metavar="OUT.json", help="measure link, parsing, recording and display, as JSON")
+    parser.add_argument("--bench-frames", type=int, default=BENCH_FRAMES, metavar="N")
+    parser.add_argument("--bench-gui", type=float, default=0.0, metavar="S", help="include S seconds of GUI frame timing")
+    parser.add_argument("--bench-only", metavar="STAGES", default=",".join(BENCH_STAGES), help=f"comma-separated, of {','.join(BENCH_STAGES)}")
+    parser.add_argument("--bench-hs", metavar="PORT", help="usb stage: also test the HS CDC port")
+    parser.add_argument("--bench-source", metavar="FILE", help="run the host stages on a recording instead of synthetic frames")
+    parser.add_argument("--baseline", metavar="JSON", help="compare the benchmark with an earlier one; exit 1 on a regression")
+    parser.add_argument("--tolerance", type=float, default=BENCH_TOLERANCE, help="fraction worse than the baseline that counts as a regression")
+    parser.add_argument("--reprocess", nargs='+', metavar="ARCHIVE", help="correct .ccdarc archives and extract their peaks on every core")
+    parser.add_argument("--dark", metavar="FILE", help="--reprocess: dark reference recording")
+    parser.add_argument("--flat", metavar="FILE", help="--reprocess: flat reference recording")
+    parser.add_argument("--no-peaks", action="store_true", help="--reprocess: skip peak extraction")
+    parser.add_argument("--workers", type=int, help="--reprocess: processes (default: every core)")
+    parser.add_argument("--gpu", action="store_true", help="--reprocess: correct and find peaks on the GPU (cupy)")
+    parser.add_argument("--export-arrow", nargs='+', metavar="RECORDING", help="write recordings as Arrow IPC files (.arrow)")
+    parser.add_argument("--parquet", action="store_true", help="--export-arrow: write Parquet (.parquet) instead")
+    parser.add_argument("--arrow-spool", nargs='?', const=ARROW_SPOOL_DIR, metavar="DIR", help=f"spool live frames as Arrow files (default {ARROW_SPOOL_DIR})")
+    parser.add_argument("--index", nargs='+', metavar="RECORDING", help="build the frame index and overview of recordings made without them")
+    parser.add_argument("--find", metavar="RECORDING", help="frames of an indexed recording matching --at-px/--above/--field")
+    parser.add_argument("--at-px", type=float, help="--find: a peak within --px-tolerance of this pixel")
+    parser.add_argument("--px-tolerance", type=float, default=3.0, help="--find: pixels (default 3)")
+    parser.add_argument("--above", type=float, default=0, help="--find: peak height, or --field value, to exceed")
+    parser.add_argument("--field", default="max", choices=["max", "sum", "saturated"], help="--find without --at-px: the column tested")
+    parser.add_argument("--similar-index", nargs='+', metavar="RECORDING", help="build the similarity index (faiss or hnswlib HNSW when installed) of recordings")
+    parser.add_argument("--dims", type=int, default=SIMILAR_DIMS, help=f"--similar-index: PCA components (0: none, default {SIMILAR_DIMS})")
+    parser.add_argument("--similar", metavar="RECORDING", help="frames of a recording most like its frame --like")
+    parser.add_argument("--like", type=int, default=0, metavar="I", help="--similar: position of the frame to match")
+    parser.add_argument("--top", type=int, default=10, metavar="K", help="--similar: frames listed (default 10)")
+    parser.add_argument("--iso", action="store_true", help="vendor bulk device: frames on the isochronous endpoint (CCD_USB_ISO builds)")
+    parser.add_argument("--metrics", type=int, nargs='?', const=METRICS_PORT, metavar="HTTP_PORT", help=f"--capture: serve Prometheus metrics at /metrics (default port {METRICS_PORT})")
+    parser.add_argument("--tsdb", metavar="URL", help="--capture: POST band, statistics and model records to a time-series database")
+    parser.add_argument("--tsdb-format", choices=TSDB_FORMATS, default="line", help="--tsdb: InfluxDB line protocol (gzip) or Arrow IPC (zstd)")
+    parser.add_argument("--tsdb-token", metavar="TOKEN", help="--tsdb: sent as 'Authorization: Token TOKEN'")
+    parser.add_argument("--upload", nargs='+', metavar="ARCHIVE", help="send .ccdarc archives to --bucket as parallel multipart uploads, resuming any stopped")
+    parser.add_argument("--bucket", help="S3 bucket for --upload, or to upload a --capture .ccdarc while it is recorded")
+    parser.add_argument("--prefix", default="", help="--bucket: prefix of the object keys")
+    parser.add_argument("--stats", type=float, default=0.0, metavar="S", help="print counters every S seconds")
+    args = parser.parse_args()
+    if args.list_devices:
+        for d in discover_devices():
+            print(f"{d['serial']}  {d['transport']:4}  {d['port']}")
+        raise SystemExit(0)
+    if args.benchmark:
+        only = [n for n in args.bench_only.split(",") if n]
+        bad = set(only) - set(BENCH_STAGES)
+        if bad: parser.error(f"unknown stage {', '.join(sorted(bad))}")
+        results = benchmark(args.port or SIM_PORT, args.bench_frames,
+                            args.bench_gui, args.bench_source, only, args.bench_hs)
+        text = json.dumps(results, indent=2)
+        if args.benchmark == "-":
+            print(text)
+        else:
+            with open(args.benchmark, 'w') as f: f.write(text)
+        worse = []
+        if args.baseline:
+            with open(args.baseline) as f:
+                worse = bench_regressions(json.load(f), results, args.tolerance)
+            for key, old, new in worse:
+                print(f"Regression {key}: {old:.6g} -> {new:.6g}", file=sys.stderr)
+        raise SystemExit(bool(worse))
+    if args.reprocess:
+        settings = SettingsManager()
+        detector = None if args.no_peaks else PeakDetector()
+        if detector:
+            detector.threshold = settings.get("peak_threshold")
+            detector.min_distance = settings.get("peak_min_dist")
+            detector.use_smoothing = settings.get("enable_savgol")
+            detector.smooth_window = settings.get("savgol_window")
+        for src in args.reprocess:
+            t0 = time.perf_counter()
+            for _ in reprocess(src, None, args.dark, args.flat, detector,
+                               None, args.workers, args.gpu): pass
+            print(f"{src}: {time.perf_counter() - t0:.1f} s")
+        raise SystemExit(0)
+    if args.export_arrow:
+        if pa is None: raise SystemExit("--export-arrow needs pyarrow")
+        for src in args.export_arrow:
+            dst = os.path.splitext(src)[0] + (".parquet" if args.parquet else ".arrow")
+            for _ in export_arrow(src, dst): pass
+            print(dst)
+        raise SystemExit(0)
+    if args.index:
+        for path in args.index:
+            for _ in build_index(path): pass
+            for _ in build_overview(path): pass
+            print(f"{path}{INDEX_SUFFIX} {path}{OVERVIEW_SUFFIX}")
+        raise SystemExit(0)
+    if args.upload:
+        if not args.bucket: raise SystemExit("--upload needs --bucket")
+        for path in args.upload:
+            t0 = time.perf_counter()
+            for _ in upload_archive(path, args.bucket,
+                                    args.prefix + os.path.basename(path)): pass
+            size = os.path.getsize(path)
+            print(f"{path}: {size / 1e6:.0f} MB in "
+                  f"{time.perf_counter() - t0:.1f} s")
+        raise SystemExit(0)
+    if args.similar_index:
+        for path in args.similar_index:
+            t0 = time.perf_counter()
+            for _ in build_similarity(path, args.dims): pass
+            print(f"{path}{SIMILAR_SUFFIX}: {time.perf_counter() - t0:.1f} s")
+        raise SystemExit(0)
+    if args.similar:
+        index = open_similarity(args.similar)
+        if index is None:
+            raise SystemExit(f"{args.similar}: no similarity index, build it "
+                             "with --similar-index")
+        pixels, records = open_frames(args.similar)
+        t0 = time.perf_counter()
+        hits, sims = index.query(np.asarray(pixels[args.like]), args.top)
+        ms = (time.perf_counter() - t0) * 1000.0
+        for i, s in zip(hits, sims):
+            num = int(records['frame_num'][i]) if records is not None else i
+            print(i, num, f"{s:.4f}")
+        print(f"{index.backend}, {len(index)} frames, {ms:.2f} ms",
+              file=sys.stderr)
+        raise SystemExit(0)
+    if args.find:
+        index = open_index(args.find)
+        if index is None:
+            raise SystemExit(f"{args.find}: no index, build it with --index")
+        hits = find_frames(index, args.at_px, args.above, args.px_tolerance,
+                           args.field)
+        for i in hits:
+            print(i, int(index['frame_num'][i]), f"{index['timestamp'][i]:.6f}")
+        raise SystemExit(0)
+    if args.simulate is not None:
+        sim = VirtualDevice(args.simulate or None, args.sim_rate,
+                            args.sim_drop, args.sim_corrupt)
+        print(f"Virtual board on {sim.serve_pty()}", flush=True)
+        try:
+            while True: time.sleep(1.0)
+        except KeyboardInterrupt:
+            sim.close()
+        raise SystemExit(0)
+    if args.replay:
+        out = replay(args.port or USB_BULK_PORT, args.replay, args.out,
+                     timeout=args.timeout)
+        print(f"Replayed {out['sent']} frames, {out['received']} out to "
+              f"{args.out} at {out['fps']:.1f} fps; stalls {out['stalls']} "
+              f"lost {out['lost']} crc {out['crc_errors']}")
+        raise SystemExit(not out['received'])
+    if args.capture is not None:
+        if args.bucket and not args.out.endswith(".ccdarc"):
+            raise SystemExit("--bucket uploads a .ccdarc --out")
+        mode = 3 if args.trigger else args.mode
+        def setup(rx):
+            if mode is not None: rx.set_mode(mode)
+            if args.exposure_us: rx.set_exposure(args.exposure_us, args.pulse_us)
+            rx.frame_avg_mode = [m.lower() for m in AVG_MODES].index(args.average_mode)
+            rx.frame_avg_count = max(1, args.average)
+        # A service manager stops with SIGTERM: end the file cleanly (the
+        # archive index is written on close)
+        tsdb = TsdbSink(args.tsdb, args.tsdb_format, headers={
+            "Authorization": f"Token {args.tsdb_token}"}
+            if args.tsdb_token else None) if args.tsdb else None
+        plan = {'fps': args.fps, 'pixels': args.min_pixels,
+                'bits': args.min_bits, 'link_mbps': args.link_mbps,
+                'roi': [tuple(map(int, w.split(":")))
+                        for w in args.roi.split(",")] if args.roi else None
+                } if args.fps else None
+        stop = threading.Event()
+        for sig in (signal.SIGINT, signal.SIGTERM):
+            signal.signal(sig, lambda *_: stop.set())
+        n = capture(args.port or USB_BULK_PORT, args.capture, args.out,
+                    None if args.trigger else args.timeout,
+                    setup, args.stats, stop, args.iso, args.metrics, tsdb,
+                    (args.bucket, args.prefix + os.path.basename(args.out))
+                    if args.bucket else None, plan)
+        print(f"Saved {n} frames to {args.out}")
+        raise SystemExit(n < args.capture)
+    if dpg is None:
+        raise SystemExit("The GUI needs dearpygui; --capture runs without it")
+    if args.arrow_spool and pa is None:
+        raise SystemExit("--arrow-spool needs pyarrow")
+    app = CCDApp(args.publish, arrow=args.arrow_spool,
+                 publish_host=args.publish_host)
@@ -0,0 +1,22 @@
+/**
+ ******************************************************************************
+ * @file           : cmsis_compiler.h
+ * @brief          : Host stand-in for the CMSIS compiler header
+ ******************************************************************************
+ * Only what ccd_codec.c uses, with the Cortex-M7 results: __CLZ(0) is 32,
+ * where __builtin_clz(0) is undefined.
+ ******************************************************************************
+ */
+
+#ifndef __CMSIS_COMPILER_H
+#define __CMSIS_COMPILER_H
+
+#include <stdint.h>
+
+#define __STATIC_FORCEINLINE __attribute__((always_inline)) static inline
+
+__STATIC_FORCEINLINE uint8_t __CLZ(uint32_t value) {
+  return (value == 0U) ? 32U : (uint8_t)__builtin_clz(value);
+}
+
+#endif /* __CMSIS_COMPILER_H */
@@ -0,0 +1,306 @@
+/**
+ ******************************************************************************
+ * @file           : test_codec.c
+ * @brief          : Round-trip and fuzz test of the ccd_codec.c kernels
+ ******************************************************************************
+ * Random lines of the shapes a spectrum takes (flat, noise, ramps, lines,
+ * spikes, saturation, full-range noise) at random lengths go through each
+ * kernel, and the output is checked against a reference written from the
+ * wire format rather than from the kernel: the binned means, the packed
+ * pixels unpacked again, and the Rice stream decoded back to the pixels
+ * at its depth, spatial and temporal. The Rice limit is checked at the
+ * exact stream size and one byte under it.
+ *
+ * Usage: test_codec [iterations [seed]]
+ ******************************************************************************
+ */
+
+#include "ccd_codec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_MAX 4096U // Above CCD_BUFFER_SIZE of every sensor
+#define ITERATIONS 2000U
+
+static uint32_t rng_state;
+static uint32_t failures;
+
+static uint32_t Rand(void) {
+  uint32_t x = rng_state; // xorshift32
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return rng_state = x;
+}
+
+static uint32_t RandBelow(uint32_t n) { return Rand() % n; }
+
+#define CHECK(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      if (failures++ < 20U) {                                                  \
+        printf(__VA_ARGS__);                                                   \
+        printf("\n");                                                          \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+// ========== LINES ==========
+
+static uint16_t Clip(int32_t v) {
+  return (uint16_t)((v < 0) ? 0 : (v > 0xFFFF) ? 0xFFFF : v);
+}
+
+static void Line_Make(uint16_t *px, uint32_t count) {
+  uint32_t shape = RandBelow(7);
+  int32_t level = (int32_t)RandBelow(0x10000);
+  int32_t noise = (int32_t)(1U << RandBelow(12));
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t v = level;
+    switch (shape) {
+    case 0: // Flat
+      break;
+    case 1: // Noise around a level
+      v += (int32_t)RandBelow((uint32_t)noise) - noise / 2;
+      break;
+    case 2: // Ramp, either way
+      v = (int32_t)((uint64_t)i * 0xFFFFU / count);
+      v = (level & 1) ? 0xFFFF - v : v;
+      break;
+    case 3: // Lines on a dark floor
+      v = 2000 + (int32_t)RandBelow(64);
+      if ((i * 37U) % 500U < 6U) {
+        v += 30000 + (int32_t)RandBelow(20000);
+      }
+      break;
+    case 4: // Rare single-pixel spikes
+      v += (int32_t)RandBelow(32) - 16;
+      if (RandBelow(200) == 0) {
+        v = (int32_t)RandBelow(0x10000);
+      }
+      break;
+    case 5: // Saturated stretch
+      v = (i > count / 3 && i < count / 2) ? 0xFFFF : level / 2;
+      break;
+    default: // Full-range noise: every Rice block escapes
+      v = (int32_t)RandBelow(0x10000);
+      break;
+    }
+    px[i] = Clip(v);
+  }
+}
+
+// A reference frame near the line, at the coding depth: a temporal delta
+static void Line_Ref(uint16_t *ref, const uint16_t *px, uint32_t count,
+                     uint32_t shift) {
+  uint32_t max = 0xFFFFU >> shift;
+  int32_t drift = (int32_t)RandBelow(64) - 32;
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t v = (px[i] >> shift) + drift + (int32_t)RandBelow(8) - 4;
+    if (RandBelow(16) == 0) {
+      v = (int32_t)RandBelow(max + 1U); // An unrelated pixel
+    }
+    v = (v < 0) ? 0 : v;
+    ref[i] = (uint16_t)(((uint32_t)v > max) ? max : (uint32_t)v);
+  }
+}
+
+// ========== BINNING ==========
+
+static void Test_Bin(const uint16_t *px, uint32_t count) {
+  static uint16_t out[LINE_MAX];
+  for (uint32_t b = 1; b <= 8; b <<= 1) {
+    memset(out, 0xA5, sizeof(out));
+    uint32_t n = CCD_Codec_BinKernel(b)(out, px, count);
+    CHECK(n == count / b, "bin %u of %u: %u outputs", b, count, n);
+    for (uint32_t j = 0; j < n && j < count / b; j++) {
+      uint32_t sum = 0;
+      for (uint32_t i = 0; i < b; i++) {
+        sum += px[j * b + i];
+      }
+      uint16_t want = (uint16_t)((sum + b / 2U) / b);
+      CHECK(out[j] == want, "bin %u of %u: [%u] %u, want %u", b, count, j,
+            out[j], want);
+    }
+  }
+}
+
+// ========== PACKING ==========
+
+static void Test_Pack(const uint16_t *px, uint32_t count) {
+  static uint8_t out[LINE_MAX * 2U];
+  uint32_t len = CCD_Codec_Pack12(out, px, count);
+  CHECK(len == (count + 1U) / 2U * 3U, "pack12 of %u: %u bytes", count, len);
+  for (uint32_t i = 0; i < count; i++) {
+    const uint8_t *g = &out[i / 2U * 3U];
+    uint32_t v = g[0] | (uint32_t)g[1] << 8 | (uint32_t)g[2] << 16;
+    uint32_t got = (v >> (12U * (i & 1U))) & 0xFFFU;
+    CHECK(got == (uint32_t)(px[i] >> 4), "pack12 of %u: [%u] %u, want %u",
+          count, i, got, px[i] >> 4);
+  }
+  if (count & 1U) {
+    CHECK(out[len - 1U] == 0 && out[len - 2U] >> 4 == 0,
+          "pack12 of %u: tail not zero", count);
+  }
+
+  len = CCD_Codec_Pack14(out, px, count);
+  CHECK(len == (count + 3U) / 4U * 7U, "pack14 of %u: %u bytes", count, len);
+  for (uint32_t i = 0; i < count; i++) {
+    const uint8_t *g = &out[i / 4U * 7U];
+    uint64_t v = 0;
+    for (uint32_t k = 0; k < 7; k++) {
+      v |= (uint64_t)g[k] << (8U * k);
+    }
+    uint32_t got = (uint32_t)(v >> (14U * (i & 3U))) & 0x3FFFU;
+    CHECK(got == (uint32_t)(px[i] >> 2), "pack14 of %u: [%u] %u, want %u",
+          count, i, got, px[i] >> 2);
+  }
+}
+
+// ========== RICE ==========
+
+// MSB-first bit reader over the stream; reads past the end give zeros and
+// are caught by the length check
+typedef struct {
+  const uint8_t *data;
+  uint32_t len;
+  uint32_t pos; // Bits
+} Bits_t;
+
+static uint32_t Get(Bits_t *br, uint32_t n) {
+  uint32_t v = 0;
+  for (uint32_t i = 0; i < n; i++, br->pos++) {
+    uint32_t byte = br->pos >> 3;
+    uint32_t bit = 0;
+    if (byte < br->len) {
+      bit = (br->data[byte] >> (7U - (br->pos & 7U))) & 1U;
+    }
+    v = (v << 1) | bit;
+  }
+  return v;
+}
+
+// The stream as ccd_proc.h describes it; returns 0 on a malformed one
+static uint8_t Rice_Decode(uint16_t *out, const uint8_t *data, uint32_t len,
+                           const uint16_t *ref, uint32_t count,
+                           uint32_t bits) {
+  Bits_t br = {data, len, 0};
+  int32_t prev = 0;
+  for (uint32_t i = 0; i < count; i += CCD_PROC_RICE_BLOCK) {
+    uint32_t n = count - i;
+    if (n > CCD_PROC_RICE_BLOCK) {
+      n = CCD_PROC_RICE_BLOCK;
+    }
+    uint32_t k = Get(&br, 5);
+    for (uint32_t j = 0; j < n; j++) {
+      int32_t v;
+      if (k == CCD_PROC_RICE_ESCAPE) {
+        v = (int32_t)Get(&br, bits);
+      } else {
+        uint32_t q = 0;
+        while (Get(&br, 1)) {
+          if (++q > 0x40000U || br.pos > len * 8U) {
+            return 0;
+          }
+        }
+        uint32_t u = (q << k) | Get(&br, k);
+        int32_t d = (int32_t)(u >> 1) ^ -(int32_t)(u & 1U);
+        v = d + (ref ? ref[i + j] : prev);
+      }
+      if (v < 0 || (uint32_t)v >> bits) {
+        return 0;
+      }
+      out[i + j] = (uint16_t)v;
+      prev = v;
+    }
+  }
+  return (br.pos + 7U) / 8U == len; // Padded to the byte, nothing after
+}
+
+static void Test_Rice(const uint16_t *px, uint32_t count) {
+  static uint8_t stream[LINE_MAX * 3U];
+  static uint8_t again[LINE_MAX * 3U];
+  static uint16_t ref[LINE_MAX];
+  static uint16_t back[LINE_MAX];
+  static const uint8_t depths[] = {12, 14, 16};
+  for (uint32_t d = 0; d < sizeof(depths); d++) {
+    uint32_t bits = depths[d];
+    uint32_t shift = 16U - bits;
+    for (uint32_t temporal = 0; temporal < 2; temporal++) {
+      const uint16_t *r = NULL;
+      if (temporal) {
+        Line_Ref(ref, px, count, shift);
+        r = ref;
+      }
+      uint32_t len = CCD_Codec_RiceEncode(stream, sizeof(stream), px, r,
+                                          count, (uint8_t)bits);
+      // No block costs more than 5 bits over its plain bits
+      uint32_t blocks =
+          (count + CCD_PROC_RICE_BLOCK - 1U) / CCD_PROC_RICE_BLOCK;
+      uint32_t bound = (blocks * 5U + count * bits + 7U) / 8U;
+      CHECK(len != 0 && len <= bound,
+            "rice %u-bit%s of %u: %u bytes, bound %u", bits,
+            temporal ? " temporal" : "", count, len, bound);
+      if (len == 0) {
+        continue;
+      }
+      memset(back, 0, sizeof(back));
+      uint8_t ok = Rice_Decode(back, stream, len, r, count, bits);
+      CHECK(ok, "rice %u-bit%s of %u: stream does not decode", bits,
+            temporal ? " temporal" : "", count);
+      for (uint32_t i = 0; ok && i < count; i++) {
+        if (back[i] != px[i] >> shift) {
+          CHECK(0, "rice %u-bit%s of %u: [%u] %u, want %u", bits,
+                temporal ? " temporal" : "", count, i, back[i],
+                px[i] >> shift);
+          break;
+        }
+      }
+
+      // The caller's limit: exactly enough, then one byte short
+      memset(again, 0, sizeof(again));
+      uint32_t fit = CCD_Codec_RiceEncode(again, len, px, r, count,
+                                          (uint8_t)bits);
+      CHECK(fit == len && memcmp(again, stream, len) == 0,
+            "rice %u-bit of %u: limit %u gives %u", bits, count, len, fit);
+      memset(again, 0x5A, sizeof(again));
+      uint32_t over = CCD_Codec_RiceEncode(again, len - 1U, px, r, count,
+                                           (uint8_t)bits);
+      CHECK(over == 0, "rice %u-bit of %u: limit %u gives %u", bits, count,
+            len - 1U, over);
+      CHECK(again[len - 1U] == 0x5A, "rice %u-bit of %u: wrote past limit",
+            bits, count);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  uint32_t iterations = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0)
+                                   : ITERATIONS;
+  uint32_t seed = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 0) : 1U;
+  rng_state = seed ? seed : 1U;
+  // One pixel over for the odd-count word loads (ccd_codec.h)
+  static uint16_t px[LINE_MAX + 1U];
+  for (uint32_t it = 0; it < iterations; it++) {
+    uint32_t count;
+    switch (it % 4U) {
+    case 0:
+      count = 1U + RandBelow(40); // Short and odd tails
+      break;
+    case 1:
+      count = 3694U; // A TCD1304 line
+      break;
+    default:
+      count = 1U + RandBelow(LINE_MAX);
+      break;
+    }
+    Line_Make(px, count);
+    px[count] = (uint16_t)Rand();
+    Test_Bin(px, count);
+    Test_Pack(px, count);
+    Test_Rice(px, count);
+  }
+  printf("%u iterations, seed %u: %u failures\n", iterations, seed, failures);
+  return failures ? 1 : 0;
+}